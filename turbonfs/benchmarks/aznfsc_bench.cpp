@@ -0,0 +1,750 @@
+/*
+ * aznfsc_bench: Benchmark and trace replay tool for aznfsclient.
+ *
+ * It drives the client through plain POSIX calls on a directory, so the same
+ * binary can be used both:
+ * - against a fuse mount of aznfsclient, and
+ * - in-process through libnofuse, by running it with
+ *   LD_PRELOAD=libaznfsclient.so and AZNFSC_NOFUSE_ROOT=<dir>. This takes the
+ *   kernel and fuse out of the picture and measures just our IO path.
+ *
+ * For each op type it reports ops, throughput, latency percentiles and the
+ * client CPU used per GB (and per op). CPU is that of this process which is
+ * the client for nofuse, for fuse mounts pass the aznfsclient pid with
+ * --client-pid.
+ *
+ * Workloads:
+ * seqread   Each thread reads its own file sequentially, bs at a time.
+ * randread  Each thread reads random bs aligned blocks from its own file.
+ * seqwrite  Each thread writes its own file sequentially.
+ * create    Each thread creates small files of file-size bytes.
+ * readdir   Each thread enumerates the directory repeatedly.
+ * replay    Replay the ops in a trace file, see replay_trace().
+ *
+ * Files used by the read and readdir workloads are created with --prepare.
+ *
+ * There is no mock server, runs need a live NFS server behind the mount (or
+ * behind the AZNFSC_NOFUSE_CONFIG_YAML config for nofuse), and the latencies
+ * reported include the server and network. For comparing client side
+ * changes use the same server and prefer cached workloads (seqread/randread
+ * on files that fit in the cache, readdir), which don't depend on it.
+ *
+ * libnofuse only intercepts absolute, lexically normal paths under
+ * AZNFSC_NOFUSE_ROOT, anything else silently goes to the local filesystem.
+ * So we normalize <dir> and, when AZNFSC_NOFUSE_ROOT is set, refuse to run
+ * on a <dir> outside it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+namespace {
+
+enum bench_op
+{
+    OP_READ = 0,
+    OP_WRITE,
+    OP_CREATE,
+    OP_READDIR,
+    OP_STAT,
+    OP_MAX
+};
+
+const char *op_name[OP_MAX] = {
+    "read",
+    "write",
+    "create",
+    "readdir",
+    "stat",
+};
+
+struct bench_config
+{
+    std::string dir;
+    std::string workload = "seqread";
+    std::string trace;
+    int threads = 1;
+    int files = 1000;
+    uint64_t file_size = 1024 * 1024 * 1024ULL;
+    uint64_t bs = 1024 * 1024;
+    int duration = 30;
+    bool prepare = false;
+    pid_t client_pid = 0;
+};
+
+/*
+ * Stats collected by each thread, merged at the end.
+ * Latencies are kept individually as nsecs so that we can report exact
+ * percentiles, runs are short enough for this to be fine.
+ */
+struct thread_stats
+{
+    std::vector<uint64_t> lat_ns[OP_MAX];
+    uint64_t bytes[OP_MAX] = {};
+    uint64_t errors[OP_MAX] = {};
+};
+
+bench_config cfg;
+std::atomic<bool> stop = false;
+
+uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * CPU time in nsecs used by pid, or by us if pid is 0.
+ */
+uint64_t get_cpu_ns(pid_t pid)
+{
+    if (pid == 0) {
+        struct rusage ru;
+        ::getrusage(RUSAGE_SELF, &ru);
+        return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+               (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+    }
+
+    std::ifstream ifs("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    if (!std::getline(ifs, line)) {
+        return 0;
+    }
+
+    /*
+     * comm (2nd field) can have spaces, utime and stime are the 12th and
+     * 13th fields after it.
+     */
+    const size_t pos = line.rfind(')');
+    if (pos == std::string::npos) {
+        return 0;
+    }
+
+    std::istringstream iss(line.substr(pos + 2));
+    std::string field;
+    uint64_t utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && (iss >> field); i++) {
+        if (i == 14) {
+            utime = std::stoull(field);
+        } else if (i == 15) {
+            stime = std::stoull(field);
+        }
+    }
+
+    return (utime + stime) * (1000000000ULL / ::sysconf(_SC_CLK_TCK));
+}
+
+uint64_t parse_size(const char *str)
+{
+    char *end;
+    uint64_t val = ::strtoull(str, &end, 10);
+
+    switch (*end) {
+        case 'k': case 'K': val <<= 10; break;
+        case 'm': case 'M': val <<= 20; break;
+        case 'g': case 'G': val <<= 30; break;
+        case '\0': break;
+        default:
+            fprintf(stderr, "Invalid size: %s\n", str);
+            ::exit(1);
+    }
+
+    return val;
+}
+
+std::string thread_file(int tid)
+{
+    return cfg.dir + "/bench." + std::to_string(tid);
+}
+
+/*
+ * Run one op, adding its latency to ts.
+ */
+template<typename F>
+void timed_op(thread_stats& ts, bench_op op, F&& func)
+{
+    const uint64_t start = now_ns();
+    const ssize_t ret = func();
+    const uint64_t end = now_ns();
+
+    if (ret < 0) {
+        ts.errors[op]++;
+        return;
+    }
+
+    ts.lat_ns[op].push_back(end - start);
+    ts.bytes[op] += ret;
+}
+
+/*
+ * Read count bytes at offset, returns bytes read or -1.
+ */
+ssize_t do_read(int fd, char *buf, uint64_t count, off_t offset)
+{
+    return ::pread(fd, buf, count, offset);
+}
+
+ssize_t do_write(int fd, const char *buf, uint64_t count, off_t offset)
+{
+    return ::pwrite(fd, buf, count, offset);
+}
+
+/*
+ * O_TRUNC matters only for replay, which may create a file more than once.
+ */
+ssize_t do_create(const std::string& path, const char *buf, uint64_t size)
+{
+    const int fd = ::open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    const ssize_t ret = (size > 0) ? ::write(fd, buf, size) : 0;
+    if (::close(fd) != 0) {
+        return -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Returns number of entries read, we count them in place of bytes.
+ */
+ssize_t do_readdir(const std::string& path)
+{
+    DIR *dirp = ::opendir(path.c_str());
+    if (!dirp) {
+        return -1;
+    }
+
+    ssize_t count = 0;
+    while (::readdir(dirp) != nullptr) {
+        count++;
+    }
+
+    ::closedir(dirp);
+    return count;
+}
+
+ssize_t do_stat(const std::string& path)
+{
+    struct stat st;
+    return (::stat(path.c_str(), &st) == 0) ? 0 : -1;
+}
+
+void run_rw(int tid, thread_stats& ts, bool random, bool write)
+{
+    const std::string path = thread_file(tid);
+    const int fd = ::open(path.c_str(), write ? (O_CREAT | O_WRONLY) : O_RDONLY,
+                          0644);
+    if (fd < 0) {
+        fprintf(stderr, "open(%s) failed: %s\n", path.c_str(), strerror(errno));
+        return;
+    }
+
+    std::vector<char> buf(cfg.bs, 'a');
+    std::mt19937_64 rng(tid);
+    const uint64_t nblocks = std::max(cfg.file_size / cfg.bs, (uint64_t) 1);
+    uint64_t block = 0;
+
+    while (!stop) {
+        if (random) {
+            block = rng() % nblocks;
+        } else if (block == nblocks) {
+            block = 0;
+        }
+
+        const off_t offset = block * cfg.bs;
+        if (write) {
+            timed_op(ts, OP_WRITE, [&] {
+                return do_write(fd, buf.data(), cfg.bs, offset);
+            });
+        } else {
+            timed_op(ts, OP_READ, [&] {
+                return do_read(fd, buf.data(), cfg.bs, offset);
+            });
+        }
+
+        block++;
+    }
+
+    ::close(fd);
+}
+
+void run_create(int tid, thread_stats& ts)
+{
+    std::vector<char> buf(cfg.file_size, 'a');
+
+    for (uint64_t i = 0; !stop; i++) {
+        const std::string path = cfg.dir + "/create." + std::to_string(tid) +
+                                 "." + std::to_string(i);
+        timed_op(ts, OP_CREATE, [&] {
+            return do_create(path, buf.data(), cfg.file_size);
+        });
+    }
+}
+
+void run_readdir(int tid, thread_stats& ts)
+{
+    while (!stop) {
+        timed_op(ts, OP_READDIR, [&] {
+            return do_readdir(cfg.dir);
+        });
+    }
+}
+
+/*
+ * Trace file has one op per line, blank lines and lines starting with '#' are
+ * ignored. Paths are relative to the benchmark directory.
+ *
+ *   read <path> <offset> <length>
+ *   write <path> <offset> <length>
+ *   create <path> <size>
+ *   readdir <path>
+ *   stat <path>
+ *
+ * Ops are picked by the threads in trace order, so with more than one
+ * thread ops run concurrently but their start order follows the trace.
+ * Files opened for read/write are kept open by each thread till the end.
+ */
+struct trace_op
+{
+    bench_op op;
+    std::string path;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+};
+
+std::vector<trace_op> load_trace(const std::string& file)
+{
+    std::ifstream ifs(file);
+    if (!ifs.is_open()) {
+        fprintf(stderr, "Cannot open trace %s\n", file.c_str());
+        ::exit(1);
+    }
+
+    std::vector<trace_op> ops;
+    std::string line;
+    int lineno = 0;
+
+    while (std::getline(ifs, line)) {
+        lineno++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream iss(line);
+        std::string op;
+        trace_op top;
+        iss >> op >> top.path;
+
+        bool ok = !top.path.empty();
+        if (op == "read" || op == "write") {
+            top.op = (op == "read") ? OP_READ : OP_WRITE;
+            ok = ok && (iss >> top.offset >> top.length);
+        } else if (op == "create") {
+            top.op = OP_CREATE;
+            ok = ok && (iss >> top.length);
+        } else if (op == "readdir") {
+            top.op = OP_READDIR;
+        } else if (op == "stat") {
+            top.op = OP_STAT;
+        } else {
+            ok = false;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "%s:%d: invalid trace line: %s\n",
+                    file.c_str(), lineno, line.c_str());
+            ::exit(1);
+        }
+
+        top.path = cfg.dir + "/" + top.path;
+        ops.push_back(std::move(top));
+    }
+
+    return ops;
+}
+
+void replay_trace(const std::vector<trace_op>& ops,
+                  std::atomic<size_t>& next,
+                  thread_stats& ts)
+{
+    std::map<std::string, int> rfds, wfds;
+    std::vector<char> buf;
+
+    auto get_fd = [](std::map<std::string, int>& fds,
+                     const std::string& path,
+                     int flags) {
+        auto it = fds.find(path);
+        if (it != fds.end()) {
+            return it->second;
+        }
+        const int fd = ::open(path.c_str(), flags, 0644);
+        if (fd >= 0) {
+            fds[path] = fd;
+        }
+        return fd;
+    };
+
+    while (!stop) {
+        const size_t idx = next++;
+        if (idx >= ops.size()) {
+            break;
+        }
+
+        const trace_op& top = ops[idx];
+        if (buf.size() < top.length) {
+            buf.resize(top.length, 'a');
+        }
+
+        switch (top.op) {
+            case OP_READ: {
+                const int fd = get_fd(rfds, top.path, O_RDONLY);
+                timed_op(ts, OP_READ, [&] {
+                    return (fd < 0) ? -1 : do_read(fd, buf.data(), top.length,
+                                                   top.offset);
+                });
+                break;
+            }
+            case OP_WRITE: {
+                const int fd = get_fd(wfds, top.path, O_CREAT | O_WRONLY);
+                timed_op(ts, OP_WRITE, [&] {
+                    return (fd < 0) ? -1 : do_write(fd, buf.data(), top.length,
+                                                    top.offset);
+                });
+                break;
+            }
+            case OP_CREATE:
+                timed_op(ts, OP_CREATE, [&] {
+                    return do_create(top.path, buf.data(), top.length);
+                });
+                break;
+            case OP_READDIR:
+                timed_op(ts, OP_READDIR, [&] {
+                    return do_readdir(top.path);
+                });
+                break;
+            case OP_STAT:
+                timed_op(ts, OP_STAT, [&] {
+                    return do_stat(top.path);
+                });
+                break;
+            default:
+                break;
+        }
+    }
+
+    for (const auto& p : rfds) {
+        ::close(p.second);
+    }
+    for (const auto& p : wfds) {
+        ::close(p.second);
+    }
+}
+
+/*
+ * Create the files used by the read and readdir workloads.
+ */
+void prepare()
+{
+    if (cfg.workload == "readdir") {
+        fprintf(stderr, "Creating %d files in %s\n",
+                cfg.files, cfg.dir.c_str());
+        for (int i = 0; i < cfg.files; i++) {
+            const std::string path = cfg.dir + "/entry." + std::to_string(i);
+            if (do_create(path, nullptr, 0) < 0) {
+                fprintf(stderr, "Failed to create %s: %s\n",
+                        path.c_str(), strerror(errno));
+                ::exit(1);
+            }
+        }
+        return;
+    }
+
+    fprintf(stderr, "Creating %d files of %lu bytes\n",
+            cfg.threads, cfg.file_size);
+
+    std::vector<char> buf(1024 * 1024, 'a');
+    for (int tid = 0; tid < cfg.threads; tid++) {
+        const std::string path = thread_file(tid);
+        const int fd = ::open(path.c_str(), O_CREAT | O_WRONLY, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "open(%s) failed: %s\n",
+                    path.c_str(), strerror(errno));
+            ::exit(1);
+        }
+
+        for (uint64_t off = 0; off < cfg.file_size; off += buf.size()) {
+            const uint64_t len = std::min((uint64_t) buf.size(),
+                                          cfg.file_size - off);
+            if (do_write(fd, buf.data(), len, off) != (ssize_t) len) {
+                fprintf(stderr, "write(%s) failed: %s\n",
+                        path.c_str(), strerror(errno));
+                ::exit(1);
+            }
+        }
+
+        ::close(fd);
+    }
+}
+
+void report(std::vector<thread_stats>& stats,
+            uint64_t elapsed_ns,
+            uint64_t cpu_ns)
+{
+    const double secs = elapsed_ns / 1e9;
+
+    printf("%-8s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+           "op", "ops", "errors", "iops", "MiB/s", "p50(us)", "p90(us)",
+           "p99(us)", "p99.9(us)", "max(us)", "avg(us)");
+
+    uint64_t total_ops = 0, total_bytes = 0;
+
+    for (int op = 0; op < OP_MAX; op++) {
+        std::vector<uint64_t> lat;
+        uint64_t bytes = 0, errors = 0;
+
+        for (thread_stats& ts : stats) {
+            lat.insert(lat.end(), ts.lat_ns[op].begin(), ts.lat_ns[op].end());
+            bytes += ts.bytes[op];
+            errors += ts.errors[op];
+        }
+
+        if (lat.empty() && errors == 0) {
+            continue;
+        }
+
+        std::sort(lat.begin(), lat.end());
+
+        auto pct = [&lat](double p) -> double {
+            if (lat.empty()) {
+                return 0;
+            }
+            const size_t idx = std::min((size_t) (p * lat.size()),
+                                        lat.size() - 1);
+            return lat[idx] / 1000.0;
+        };
+
+        double sum = 0;
+        for (const uint64_t l : lat) {
+            sum += l;
+        }
+
+        /*
+         * readdir counts entries in bytes, don't report it as throughput.
+         */
+        const bool has_bytes = (op == OP_READ || op == OP_WRITE ||
+                                op == OP_CREATE);
+
+        printf("%-8s %10zu %10lu %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f "
+               "%10.1f %10.1f\n",
+               op_name[op], lat.size(), errors, lat.size() / secs,
+               has_bytes ? (bytes / secs / 1048576.0) : 0.0,
+               pct(0.50), pct(0.90), pct(0.99), pct(0.999),
+               lat.empty() ? 0.0 : lat.back() / 1000.0,
+               lat.empty() ? 0.0 : sum / lat.size() / 1000.0);
+
+        total_ops += lat.size();
+        if (has_bytes) {
+            total_bytes += bytes;
+        }
+    }
+
+    printf("\nelapsed: %.2fs, client cpu: %.2fs", secs, cpu_ns / 1e9);
+    if (total_bytes > 0) {
+        printf(", cpu/GB: %.3fs", (cpu_ns / 1e9) / (total_bytes / 1e9));
+    }
+    if (total_ops > 0) {
+        printf(", cpu/op: %.1fus", (cpu_ns / 1e3) / total_ops);
+    }
+    printf("\n");
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr,
+"Usage: %s [options] <dir>\n"
+"  --workload=<seqread|randread|seqwrite|create|readdir|replay>\n"
+"                         Workload to run (default seqread).\n"
+"  --trace=<file>         Trace file for the replay workload.\n"
+"  --threads=<n>          Number of threads (default 1).\n"
+"  --bs=<size>            IO size for read/write workloads (default 1M).\n"
+"  --file-size=<size>     Per thread file size for read/write workloads\n"
+"                         (default 1G), file size for create (use 4k f.e.).\n"
+"  --files=<n>            Entries created by --prepare for readdir\n"
+"                         (default 1000).\n"
+"  --duration=<secs>      Run time (default 30), replay stops at the end of\n"
+"                         the trace if that's earlier.\n"
+"  --prepare              Create the files needed by the workload first.\n"
+"  --client-pid=<pid>     Report CPU of this aznfsclient process instead of\n"
+"                         ours, for fuse mounts.\n",
+            prog);
+    ::exit(1);
+}
+
+void parse_args(int argc, char *argv[])
+{
+    static const struct option long_opts[] = {
+        {"workload",    required_argument, nullptr, 'w'},
+        {"trace",       required_argument, nullptr, 't'},
+        {"threads",     required_argument, nullptr, 'n'},
+        {"bs",          required_argument, nullptr, 'b'},
+        {"file-size",   required_argument, nullptr, 's'},
+        {"files",       required_argument, nullptr, 'f'},
+        {"duration",    required_argument, nullptr, 'd'},
+        {"prepare",     no_argument,       nullptr, 'p'},
+        {"client-pid",  required_argument, nullptr, 'c'},
+        {nullptr,       0,                 nullptr, 0},
+    };
+
+    int c;
+    while ((c = ::getopt_long(argc, argv, "", long_opts, nullptr)) != -1) {
+        switch (c) {
+            case 'w': cfg.workload = optarg; break;
+            case 't': cfg.trace = optarg; break;
+            case 'n': cfg.threads = ::atoi(optarg); break;
+            case 'b': cfg.bs = parse_size(optarg); break;
+            case 's': cfg.file_size = parse_size(optarg); break;
+            case 'f': cfg.files = ::atoi(optarg); break;
+            case 'd': cfg.duration = ::atoi(optarg); break;
+            case 'p': cfg.prepare = true; break;
+            case 'c': cfg.client_pid = ::atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+
+    /*
+     * See the nofuse note at the top, this doesn't make any filesystem call
+     * other than getcwd() for a relative <dir>.
+     */
+    cfg.dir = std::filesystem::absolute(argv[optind]).lexically_normal();
+    if (cfg.dir.size() > 1 && cfg.dir.back() == '/') {
+        cfg.dir.pop_back();
+    }
+
+    const char *nofuse_root = ::getenv("AZNFSC_NOFUSE_ROOT");
+    if (nofuse_root) {
+        std::string root =
+            std::filesystem::path(nofuse_root).lexically_normal();
+        if (root.size() > 1 && root.back() == '/') {
+            root.pop_back();
+        }
+        if (cfg.dir.compare(0, root.size(), root) != 0 ||
+            (cfg.dir.size() > root.size() && cfg.dir[root.size()] != '/')) {
+            fprintf(stderr, "%s is not under AZNFSC_NOFUSE_ROOT (%s), "
+                    "nofuse won't see our IOs\n",
+                    cfg.dir.c_str(), root.c_str());
+            ::exit(1);
+        }
+    }
+
+    static const char *workloads[] = {
+        "seqread", "randread", "seqwrite", "create", "readdir", "replay"
+    };
+    if (std::find_if(std::begin(workloads), std::end(workloads),
+                     [](const char *w) { return cfg.workload == w; }) ==
+        std::end(workloads)) {
+        fprintf(stderr, "Invalid workload: %s\n", cfg.workload.c_str());
+        usage(argv[0]);
+    }
+
+    if (cfg.threads <= 0 || cfg.bs == 0 || cfg.duration <= 0) {
+        usage(argv[0]);
+    }
+
+    if ((cfg.workload == "replay") == cfg.trace.empty()) {
+        fprintf(stderr, "--trace must be given only for replay\n");
+        usage(argv[0]);
+    }
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+
+    if (cfg.prepare) {
+        prepare();
+    }
+
+    std::vector<trace_op> ops;
+    std::atomic<size_t> next = 0;
+    if (cfg.workload == "replay") {
+        ops = load_trace(cfg.trace);
+        fprintf(stderr, "Loaded %zu ops from %s\n", ops.size(),
+                cfg.trace.c_str());
+    }
+
+    std::vector<thread_stats> stats(cfg.threads);
+    std::vector<std::thread> threads;
+    std::atomic<int> running = cfg.threads;
+
+    const uint64_t cpu_start = get_cpu_ns(cfg.client_pid);
+    const uint64_t start = now_ns();
+
+    for (int tid = 0; tid < cfg.threads; tid++) {
+        threads.emplace_back([&, tid] {
+            thread_stats& ts = stats[tid];
+
+            if (cfg.workload == "seqread") {
+                run_rw(tid, ts, false /* random */, false /* write */);
+            } else if (cfg.workload == "randread") {
+                run_rw(tid, ts, true /* random */, false /* write */);
+            } else if (cfg.workload == "seqwrite") {
+                run_rw(tid, ts, false /* random */, true /* write */);
+            } else if (cfg.workload == "create") {
+                run_create(tid, ts);
+            } else if (cfg.workload == "readdir") {
+                run_readdir(tid, ts);
+            } else {
+                replay_trace(ops, next, ts);
+            }
+
+            running--;
+        });
+    }
+
+    /*
+     * Stop after duration, or earlier if all threads are done (replay).
+     */
+    const uint64_t deadline = start + cfg.duration * 1000000000ULL;
+    while (running > 0 && now_ns() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    stop = true;
+
+    for (std::thread& t : threads) {
+        t.join();
+    }
+
+    const uint64_t elapsed = now_ns() - start;
+    const uint64_t cpu_used = get_cpu_ns(cfg.client_pid) - cpu_start;
+
+    report(stats, elapsed, cpu_used);
+    return 0;
+}
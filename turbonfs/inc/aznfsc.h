@@ -60,9 +60,20 @@ static_assert(AZNFSCFG_WSIZE_MAX == AZNFSCFG_RSIZE_MAX);
 #define AZNFSCFG_CACHE_MAX_MB_MAX (10 * 1024 * 1024)
 // Default value for percentage of total RAM to be used for cache.
 #define AZNFSCFG_CACHE_MAX_MB_PERCENT_DEF 60
+#define AZNFSCFG_PREFETCH_INFLIGHT_MB_MIN 16
+#define AZNFSCFG_PREFETCH_INFLIGHT_MB_MAX 16384
+#define AZNFSCFG_PREFETCH_INFLIGHT_MB_DEF 256
+#define AZNFSCFG_MAX_PINNED_PCT_MIN 1
+#define AZNFSCFG_MAX_PINNED_PCT_MAX 90
+#define AZNFSCFG_MAX_PINNED_PCT_DEF 50
 #define AZNFSCFG_FILECACHE_MAX_GB_MIN 1
 #define AZNFSCFG_FILECACHE_MAX_GB_MAX (1024 * 1024)
 #define AZNFSCFG_FILECACHE_MAX_GB_DEF (1024)
+#define AZNFSCFG_READDIR_PREFETCH_MIN 0
+#define AZNFSCFG_READDIR_PREFETCH_MAX 64
+#define AZNFSCFG_READDIR_PREFETCH_DEF 4
+#define AZNFSCFG_METRICS_PORT_MIN 1
+#define AZNFSCFG_METRICS_PORT_MAX 65535
 #define AZNFSCFG_RETRANS_MIN    1
 #define AZNFSCFG_RETRANS_MAX    100
 #define AZNFSCFG_ACTIMEO_MIN    1
@@ -71,6 +82,13 @@ static_assert(AZNFSCFG_WSIZE_MAX == AZNFSCFG_RSIZE_MAX);
 #define AZNFSCFG_LOOKUPCACHE_POS    2
 #define AZNFSCFG_LOOKUPCACHE_ALL    3
 #define AZNFSCFG_LOOKUPCACHE_DEF    AZNFSCFG_LOOKUPCACHE_ALL
+#define AZNFSCFG_AFFINITY_NONE      0
+#define AZNFSCFG_AFFINITY_NICNODE   1
+#define AZNFSCFG_AFFINITY_SPREAD    2
+#define AZNFSCFG_AFFINITY_DEF       AZNFSCFG_AFFINITY_NONE
+#define AZNFSCFG_EP_RECHECK_SEC_MIN 5
+#define AZNFSCFG_EP_RECHECK_SEC_MAX 3600
+#define AZNFSCFG_EP_RECHECK_SEC_DEF 30
 
 // W/o jumbo blocks, 5TiB is the max file size we can support.
 #define AZNFSC_MAX_FILE_SIZE    (50'000ULL * AZNFSC_MAX_BLOCK_SIZE)
@@ -146,6 +164,11 @@ typedef struct aznfsc_cfg
     // Enable debug logging?
     bool debug = false;
 
+    /*
+     * Write logs from a background thread, see azlog::enable_async().
+     */
+    bool log_async = true;
+
     /*************************************************
      **                Mount path                   **
      ** Identify the server and the export to mount **
@@ -247,6 +270,12 @@ typedef struct aznfsc_cfg
     // Fuse max_idle_threads config value.
     int fuse_max_idle_threads = -1;
 
+    /*
+     * Send read replies to fuse as memfd buffers so that libfuse can
+     * splice() them to /dev/fuse instead of copying, see membuf_pool.
+     */
+    bool fuse_splice_read_reply = false;
+
     // Whether to use TLS or not.
     const char *xprtsec = nullptr;
 
@@ -278,6 +307,12 @@ typedef struct aznfsc_cfg
              */
             struct {
                 bool enable = true;
+
+                /*
+                 * Serve expired attributes while they are revalidated in
+                 * the background. Only honoured for standardnfs consistency.
+                 */
+                bool stale_while_revalidate = false;
             } user;
         } attr;
 
@@ -298,6 +333,13 @@ typedef struct aznfsc_cfg
 
                 // Max userspace readdir cache size in MB.
                 int max_size_mb = -1;
+
+                /*
+                 * Number of READDIRPLUS batches to prefetch ahead of fuse,
+                 * once sequential enumeration is detected. 0 disables
+                 * directory readahead.
+                 */
+                int prefetch_depth = -1;
             } user;
         } readdir;
 
@@ -319,6 +361,31 @@ typedef struct aznfsc_cfg
 
                 // Max userspace data cache size in MB.
                 int max_size_mb = -1;
+
+                /*
+                 * Back large cache buffers with hugepages.
+                 * See membuf_pool for details.
+                 */
+                bool hugepages = false;
+
+                /*
+                 * Max prefetch reads ongoing, for application prefetch
+                 * hints. See ra_state::prefetch().
+                 */
+                int prefetch_inflight_mb = -1;
+
+                /*
+                 * Max percentage of max_size_mb which applications can pin,
+                 * 0 disables pinning.
+                 */
+                int max_pinned_pct = -1;
+
+                /*
+                 * Size the cache as per the cgroup memory limit and memory
+                 * pressure, with max_size_mb as the upper limit.
+                 * See mem_pressure.
+                 */
+                bool adaptive_size = false;
             } user;
         } data;
     } cache;
@@ -349,6 +416,30 @@ typedef struct aznfsc_cfg
          */
         bool resolve_before_reconnect = true;
 
+        /*
+         * Use latency/load aware connection scheduling (CONN_SCHED_P2C_*)
+         * instead of round robin, for requests which can be spread over all
+         * connections.
+         */
+        bool conn_sched_latency_aware = false;
+
+        /*
+         * Small file fast path, for workloads with lots of files smaller
+         * than rsize/wsize where per-file round trips dominate.
+         * - Files not bigger than rsize are read whole on open, so reads
+         *   are served from the cache.
+         * - New files whose data fits in one WRITE are flushed with a single
+         *   FILE_SYNC write, saving the COMMIT.
+         */
+        bool small_file_mode = false;
+
+        /*
+         * Reset the per-RPC latency histograms on every stats dump, so that
+         * the percentiles reported convey latencies since the last dump and
+         * not since mount.
+         */
+        bool stats_reset_on_dump = false;
+
         /*
          * How should we behave when a retransmitted RPC fails possibly due to
          * lack of federated DRC at the server.
@@ -371,6 +462,84 @@ typedef struct aznfsc_cfg
              */
             bool rename_noent_as_success = true;
         } nodrc;
+
+        /*
+         * Metrics server, for scraping stats in machine readable format.
+         * Either or both can be configured, see metrics_server.
+         */
+        struct {
+            /*
+             * Serve metrics over HTTP on this port on localhost.
+             * 0 disables it.
+             */
+            int port = -1;
+
+            /*
+             * Serve metrics over HTTP on this unix domain socket.
+             */
+            const char *socket = nullptr;
+        } metrics;
+
+        /*
+         * CPU and memory placement on multi-socket (NUMA) nodes, see
+         * cpu_affinity.
+         */
+        struct {
+            /*
+             * none:    Threads and memory float freely (default).
+             * nicnode: Pin the libnfs service threads and fuse workers to
+             *          the CPUs of the NIC's NUMA node and allocate membufs
+             *          from that node.
+             * spread:  Spread the libnfs service threads evenly over all
+             *          NUMA nodes and interleave membufs over them.
+             */
+            const char *mode = nullptr;
+            int mode_int = AZNFSCFG_AFFINITY_DEF;
+
+            /*
+             * Network interface whose NUMA node is used for nicnode mode.
+             * If not set we use the interface through which the first
+             * connection to the server goes.
+             */
+            const char *iface = nullptr;
+        } affinity;
+
+        /*
+         * Striping of nconnect connections over multiple server endpoints
+         * (IP addresses), see rpc_endpoint.
+         */
+        struct {
+            /*
+             * Comma separated list of server IP addresses to spread the
+             * connections over. Takes precedence over resolve.
+             */
+            const char *list = nullptr;
+
+            /*
+             * Spread the connections over all IPv4 addresses the server
+             * name resolves to.
+             */
+            bool resolve = false;
+
+            /*
+             * An endpoint marked unhealthy is put back in use after these
+             * many seconds, doubling every time it's found still unhealthy,
+             * up to 8x.
+             */
+            int recheck_sec = -1;
+        } endpoints;
+
+        /*
+         * QoS classes for RPCs, see qos_class_t.
+         */
+        struct {
+            /*
+             * Number of connections (out of nconnect) reserved for metadata
+             * RPCs, the rest carry data RPCs. 0 means all RPCs share all
+             * connections. At most half the connections can be reserved.
+             */
+            int meta_connections = -1;
+        } qos;
      } sys;
 
     /*
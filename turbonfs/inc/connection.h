@@ -3,6 +3,54 @@
 
 #include "aznfsc.h"
 #include "nfs_internal.h"
+#include "rpc_stats.h"
+
+/**
+ * One server endpoint (IP address) which connections can be made to.
+ * By default all connections are made to mo.server, but when the server
+ * name resolves to multiple addresses, or a list is configured with
+ * sys.endpoints.list, rpc_transport stripes its connections over all of
+ * them so that one mount is not limited by one server frontend.
+ * Endpoints which stop responding are taken out of connection selection
+ * till they come back, see rpc_transport::check_endpoints().
+ */
+struct rpc_endpoint
+{
+    // IP address, in the form accepted by nfs_mount().
+    const std::string addr;
+
+    // Index in rpc_transport::endpoints, useful for logging.
+    const int idx;
+
+    /*
+     * Connections over unhealthy endpoints are not selected for new RPCs.
+     * down_sec is when it was last marked unhealthy.
+     */
+    std::atomic<bool> healthy = true;
+    std::atomic<uint64_t> down_sec = 0;
+
+    /*
+     * Times marked unhealthy w/o a successful RPC after being restored,
+     * used to back off restoring endpoints which are still not working.
+     * up_sec is when it was last restored.
+     * Only accessed by rpc_transport::check_endpoints(), no lock needed.
+     */
+    int trips = 0;
+    uint64_t up_sec = 0;
+
+    /*
+     * Number of connections made to this endpoint.
+     */
+    int num_connections = 0;
+
+    rpc_endpoint(const std::string& _addr, int _idx) :
+        addr(_addr),
+        idx(_idx)
+    {
+        assert(!addr.empty());
+        assert(idx >= 0);
+    }
+};
 
 /**
  * This represents one connection to the NFS server.
@@ -33,10 +81,23 @@ private:
      */
     int idx = -1;
 
+    /*
+     * Load/latency stats for RPCs issued over this connection.
+     */
+    struct conn_stats stats;
+
+    /*
+     * Server endpoint this connection is made to, nullptr if not striping
+     * connections over multiple endpoints, in which case we connect to
+     * mo.server.
+     */
+    struct rpc_endpoint *endpoint = nullptr;
+
 public:
     nfs_connection(struct nfs_client* _client, int _idx):
         client(_client),
-        idx(_idx)
+        idx(_idx),
+        stats(this)
     {
         assert(client != nullptr);
         // idx should actually be < client->mnt_options.num_connections.
@@ -57,6 +118,43 @@ public:
         return nfs_context;
     }
 
+    int get_index() const
+    {
+        return idx;
+    }
+
+    struct conn_stats& get_stats()
+    {
+        return stats;
+    }
+
+    const struct conn_stats& get_stats() const
+    {
+        return stats;
+    }
+
+    /*
+     * Set the endpoint to connect to, must be called before open().
+     */
+    void set_endpoint(struct rpc_endpoint *_endpoint)
+    {
+        assert(nfs_context == nullptr);
+        endpoint = _endpoint;
+    }
+
+    struct rpc_endpoint *get_endpoint() const
+    {
+        return endpoint;
+    }
+
+    /*
+     * Can this connection be selected for sending new RPCs?
+     */
+    bool is_healthy() const
+    {
+        return !endpoint || endpoint->healthy;
+    }
+
     /*
      * This should open the connection to the server.
      * It should init the nfs_context, make a libnfs mount call and start a
@@ -0,0 +1,168 @@
+#ifndef __AZNFSC_CPU_AFFINITY_H__
+#define __AZNFSC_CPU_AFFINITY_H__
+
+#include <sched.h>
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+
+#include "aznfsc.h"
+
+namespace aznfsc {
+
+/*
+ * Memory policy modes for mbind(2), from <linux/mempolicy.h>.
+ * We make the syscall directly so that we don't need to depend on libnuma.
+ */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED  1
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+/*
+ * Max NUMA nodes we support, nodes beyond this are ignored.
+ * This is also the nodemask size in bits passed to mbind().
+ */
+#define AFFINITY_MAX_NODES 64
+
+/**
+ * Placement of our threads and memory on multi-socket (NUMA) machines,
+ * as configured by sys.affinity.mode.
+ *
+ * With a single NIC attached to one socket, reads are DMA'ed by the NIC into
+ * socket buffers on that node, copied by the libnfs service thread into the
+ * membufs and then copied again by the fuse worker into the fuse reply.
+ * When these threads and the membufs float across sockets, most of this
+ * memory traffic becomes cross-socket. nicnode mode keeps them all on the
+ * NIC's node:
+ * - libnfs service thread of each nfs_connection is pinned to the CPUs of
+ *   the NIC's node, see pin_service_thread().
+ * - fuse worker threads are pinned to the same CPUs, see pin_fuse_workers().
+ * - membufs are allocated with MPOL_PREFERRED for the NIC's node, see
+ *   bind_memory(). We use preferred and not bind, so that we fall back to
+ *   remote memory instead of failing the allocation or OOM'ing, when the
+ *   local node runs out of memory.
+ *
+ * spread mode instead distributes the libnfs service threads round robin
+ * over all nodes and interleaves membufs over them, for when there are NICs
+ * on every socket or the workload is CPU bound on the service threads.
+ *
+ * The NIC's node is known only after the first connection is established,
+ * unless sys.affinity.iface is set, so anything that wants node local memory
+ * before that gets default placement. The splice region is rebound when the
+ * node becomes known, which is fine as its pages are only allocated on first
+ * touch.
+ *
+ * All of this is best effort, on any failure we log and continue with the
+ * default placement. On single node machines it's a no-op.
+ */
+class cpu_affinity
+{
+public:
+    static cpu_affinity& get_instance()
+    {
+        static cpu_affinity ca;
+        return ca;
+    }
+
+    /**
+     * Read the NUMA topology from sysfs and, if iface is set, the NUMA node
+     * of that interface. Must be called once after the config is sanitized
+     * and before any threads or membufs are created.
+     */
+    void init(int mode, const char *iface);
+
+    /**
+     * Pin the libnfs service thread of the connection with index conn_idx.
+     * sockfd is the connection's socket, used for finding the NIC in nicnode
+     * mode if sys.affinity.iface is not set.
+     */
+    void pin_service_thread(pid_t tid, int conn_idx, int sockfd);
+
+    /**
+     * Pin the calling thread to the NIC's node in nicnode mode.
+     * It must be called by the thread which starts the fuse session loop, so
+     * that all fuse worker threads, which are created by it (or its
+     * descendants), inherit its affinity.
+     */
+    void pin_fuse_workers();
+
+    /**
+     * Apply the NUMA memory policy to the given anonymous or shared mapping.
+     * Call after mmap() and before the memory is touched.
+     */
+    void bind_memory(void *addr, uint64_t length) const;
+
+    /**
+     * Returns the NUMA node used for nicnode mode, -1 if not known (yet).
+     */
+    int get_nic_node() const
+    {
+        return nic_node;
+    }
+
+    bool is_enabled() const
+    {
+        return (mode != AZNFSCFG_AFFINITY_NONE);
+    }
+
+private:
+    cpu_affinity() = default;
+
+    /*
+     * NUMA node of the given network interface, -1 if not known.
+     */
+    static int get_iface_node(const std::string& iface);
+
+    /*
+     * Name of the local interface that has the address sockfd is bound to.
+     */
+    static std::string get_sock_iface(int sockfd);
+
+    /*
+     * Parse a sysfs cpulist like "0-15,32-47" into a cpu set.
+     */
+    static bool parse_cpulist(const std::string& cpulist, cpu_set_t& cpus);
+
+    /*
+     * Set nic_node and rebind the memory which was allocated before that.
+     * Called with affinity_lock_53 held.
+     */
+    void set_nic_node(int node, const std::string& iface);
+
+    int mode = AZNFSCFG_AFFINITY_NONE;
+
+    /*
+     * Online NUMA nodes which have CPUs, and their CPUs.
+     * Memory-only nodes (f.e., CXL) are not interesting for us.
+     * Constant after init(), so can be accessed w/o lock.
+     */
+    std::vector<int> nodes;
+    std::vector<cpu_set_t> node_cpus;
+
+    /*
+     * NIC's NUMA node and its index into nodes[].
+     * Set once, either from init() or from the first pin_service_thread().
+     */
+    std::atomic<int> nic_node = -1;
+    std::atomic<int> nic_node_idx = -1;
+
+    /*
+     * Set if we failed to find the NIC's node, so that other connections
+     * don't retry and flood the logs.
+     */
+    bool nic_node_unknown = false;
+
+    /*
+     * Serializes NIC node discovery from the connections.
+     */
+    std::mutex affinity_lock_53;
+};
+
+}
+
+#endif /* __AZNFSC_CPU_AFFINITY_H__ */
@@ -0,0 +1,397 @@
+#ifndef __AZNFSC_DISK_CACHE_H__
+#define __AZNFSC_DISK_CACHE_H__
+
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <atomic>
+
+#include <cstdint>
+#include <cassert>
+#include <ctime>
+
+#include "aznfsc.h"
+
+// Forward declarations.
+struct nfs_inode;
+
+namespace aznfsc {
+
+struct bytes_chunk;
+
+/*
+ * Disk cache tracks cached data in blocks of this size.
+ * A block is either fully cached or not, except the last block of a file
+ * which is considered fully cached when cached till eof.
+ */
+#define DISK_CACHE_BLOCK_SIZE (1024 * 1024ULL)
+
+/*
+ * Number of threads doing disk cache IO, i.e., writing data read from the
+ * server to the disk cache and reading data from the disk cache for
+ * readaheads.
+ */
+#define DISK_CACHE_IO_THREADS 4
+
+/*
+ * Max bytes that can be queued for writing to the disk cache. Data read from
+ * the server is not added to the disk cache if more than this is queued,
+ * since queued buffers hold memory which is not limited by the cache size.
+ */
+#define DISK_CACHE_MAX_QUEUED_BYTES (256 * 1024 * 1024ULL)
+
+/*
+ * How often (in secs) the housekeeper persists the metadata of modified
+ * entries.
+ */
+#define DISK_CACHE_SYNC_INTERVAL_SEC 30
+
+/*
+ * Value of gen which never matches an entry's gen, used for data which must
+ * not be added to the disk cache.
+ */
+#define DISK_CACHE_NO_GEN UINT64_MAX
+
+/**
+ * Cached data of one file in the disk cache.
+ *
+ * Every file is cached in two files under the cachedir, named after the hex
+ * encoded NFS filehandle:
+ * - <fh>.data holds the file data at the same offsets as in the actual
+ *   file. It's a sparse file, only cached blocks are written.
+ * - <fh>.meta holds a disk_cache_meta header followed by the bitmap of
+ *   cached blocks. This is what allows the cache to survive restarts.
+ *
+ * The file size and mtime in the meta header tell which version of the file
+ * the data belongs to. validate() must be called with the current attributes
+ * before using the entry, if they don't match all the cached data is dropped.
+ *
+ * Every time the cached data is dropped, the entry gen is bumped. Callers
+ * sample get_gen() before issuing a READ to the server and pass it to
+ * write(), which refuses the data if the gen changed in between, so that data
+ * read from an older version of the file is never cached against the new
+ * version.
+ *
+ * The meta file is written lazily (see disk_cache::sync()), after the data
+ * file is synced, so on a crash the persisted bitmap can only be missing
+ * blocks, never claim blocks that are not on disk. When cached data is
+ * dropped the meta file is removed first, for the same reason.
+ */
+struct disk_cache_entry
+{
+    friend class disk_cache;
+
+    /*
+     * Key is the hex encoded filehandle, used for naming the cache files.
+     */
+    const std::string key;
+    const std::string data_path;
+    const std::string meta_path;
+
+    disk_cache_entry(const std::string& _key, const std::string& cachedir);
+    ~disk_cache_entry();
+
+    /**
+     * Validate cached data against the given file size and mtime.
+     * If they don't match the cached data is dropped and the entry starts
+     * caching data for this size/mtime. Also re-enables a disabled entry.
+     */
+    void validate(uint64_t size, const struct timespec& mtime);
+
+    /**
+     * Drop all cached data and set the file size/mtime to the given values.
+     * Used when cache is invalidated as the file changed at the server.
+     */
+    void invalidate(uint64_t size, const struct timespec& mtime);
+
+    /**
+     * Drop all cached data and stop caching till the next validate().
+     * This is called when the file is modified locally (write/truncate) as
+     * we don't know the file size/mtime the data will correspond to, it
+     * will be known when the file is opened next.
+     */
+    void disable();
+
+    /**
+     * Does the disk cache have all the data in [offset, offset+length)?
+     */
+    bool is_cached(uint64_t offset, uint64_t length) const;
+
+    /**
+     * Read [offset, offset+length) from the disk cache into buf.
+     * Returns false if any part of the range is not cached or the read
+     * fails, in which case contents of buf must not be used.
+     */
+    bool read(uint64_t offset, uint64_t length, uint8_t *buf);
+
+    /**
+     * Write data read from the server to the disk cache.
+     * Only blocks fully contained in [offset, offset+length) are cached.
+     * gen must be the value returned by get_gen() before the data was read
+     * from the server. Returns the number of bytes written.
+     */
+    uint64_t write(uint64_t offset, uint64_t length, const uint8_t *buf,
+                   uint64_t gen);
+
+    uint64_t get_gen() const
+    {
+        return gen;
+    }
+
+    /**
+     * Bytes of disk space used by this entry.
+     */
+    uint64_t get_bytes_cached() const
+    {
+        return nblocks_cached * DISK_CACHE_BLOCK_SIZE;
+    }
+
+private:
+    /*
+     * Protects all the members below and also serializes IO to the data
+     * file with dropping of cached data.
+     */
+    mutable std::mutex dce_lock_46;
+
+    int data_fd = -1;
+
+    /*
+     * File size and mtime of the file version cached.
+     */
+    uint64_t file_size = 0;
+    struct timespec file_mtime = {0, 0};
+
+    /*
+     * One bit per DISK_CACHE_BLOCK_SIZE block of the file.
+     */
+    std::vector<uint64_t> bitmap;
+
+    /*
+     * Atomic as disk_cache::evict() reads it w/o the lock.
+     */
+    std::atomic<uint64_t> nblocks_cached = 0;
+
+    /*
+     * See comment above the class.
+     */
+    std::atomic<uint64_t> gen = 0;
+
+    /*
+     * Cleared by disable() and set again by validate().
+     */
+    bool enabled = true;
+
+    /*
+     * Bumped every time the bitmap is modified, meta_seq_synced is the
+     * meta_seq persisted by the last sync_meta().
+     */
+    uint64_t meta_seq = 0;
+    uint64_t meta_seq_synced = 0;
+
+    /*
+     * Last time (secs since epoch) the entry was used, for LRU eviction.
+     */
+    std::atomic<time_t> last_access = 0;
+
+    uint64_t get_nblocks_nolock() const
+    {
+        return (file_size + DISK_CACHE_BLOCK_SIZE - 1) / DISK_CACHE_BLOCK_SIZE;
+    }
+
+    bool test_block_nolock(uint64_t b) const
+    {
+        assert(b < get_nblocks_nolock());
+        return (bitmap[b / 64] & (1ULL << (b % 64))) != 0;
+    }
+
+    void set_block_nolock(uint64_t b);
+
+    bool is_cached_nolock(uint64_t offset, uint64_t length) const;
+
+    /*
+     * Drop cached data, resize bitmap for file_size.
+     */
+    void drop_nolock();
+
+    /*
+     * Open (and create if needed) the data file.
+     */
+    bool open_data_nolock();
+
+    /*
+     * Load entry from the meta file, called only at init.
+     */
+    bool load_meta();
+
+    /*
+     * Persist the meta file if bitmap changed since the last sync.
+     * Data file is synced before the meta file is written.
+     */
+    void sync_meta();
+};
+
+/**
+ * Persistent second tier data cache on local disk (typically NVMe).
+ *
+ * The in-memory file cache (bytes_chunk_cache) is limited by RAM, for
+ * workloads which repeatedly read datasets larger than that (f.e., ML
+ * training epochs) data cached on a local disk avoids reading it again from
+ * the server. Enabled using filecache.enable, filecache.cachedir and
+ * filecache.max_size_gb.
+ *
+ * Reads which miss the in-memory cache are served from the disk cache if the
+ * data is cached there, else they are read from the server as usual and the
+ * data read is then written to the disk cache asynchronously by the IO
+ * threads. Application reads read the disk cache inline, while readaheads
+ * are queued to the IO threads.
+ *
+ * The disk cache is limited to filecache.max_size_gb, when it grows beyond
+ * that the housekeeper thread evicts least recently used entries. On startup
+ * init() loads all entries from cachedir, entries are matched to files by
+ * filehandle and validated against the file size/mtime when the file is
+ * opened.
+ *
+ * dcache_lock_47 and disk_cache_entry::dce_lock_46 are never held together,
+ * methods which need to lock entries first take a snapshot of the entries
+ * under dcache_lock_47.
+ */
+class disk_cache
+{
+public:
+    /*
+     * Intentionally never destroyed, as IO threads may still be running
+     * when static destructors run, if shutdown() was not called.
+     */
+    static disk_cache& get_instance()
+    {
+        static disk_cache *dc = new disk_cache();
+        return *dc;
+    }
+
+    /**
+     * Load existing entries from cachedir and start the IO and housekeeper
+     * threads. Must be called once, before any other method.
+     */
+    bool init(const std::string& cachedir, uint64_t max_bytes);
+
+    /**
+     * Complete queued IOs, persist metadata and stop the threads.
+     */
+    void shutdown();
+
+    bool is_enabled() const
+    {
+        return enabled;
+    }
+
+    /**
+     * Get the disk cache entry for the file with the given filehandle,
+     * creating it if not present. The entry is validated against size and
+     * mtime. Returns null if disk cache is not enabled.
+     */
+    std::shared_ptr<disk_cache_entry> get_entry(const struct nfs_fh3& fh,
+                                                uint64_t size,
+                                                const struct timespec& mtime);
+
+    /**
+     * Queue a job to be run by an IO thread. length is the number of bytes
+     * of memory held by the job. Returns false if the job could not be
+     * queued, because of too many bytes queued or disk cache shutting down.
+     */
+    bool queue_job(std::function<void()> job, uint64_t length);
+
+    /**
+     * Queue bc to be written to the disk cache entry of inode. bc must have
+     * valid data for [bc.offset, bc.offset+length), read from the server
+     * after gen was sampled. bc is copied, holding a ref on the membuf till
+     * the write completes, and an inode ref is held for the same duration
+     * as membuf destruction needs the inode's bytes_chunk_cache.
+     */
+    void populate(struct nfs_inode *inode,
+                  const struct bytes_chunk& bc,
+                  uint64_t length,
+                  uint64_t gen);
+
+    /**
+     * Persist the meta of all modified entries.
+     */
+    void sync();
+
+    /**
+     * Evict least recently used entries till disk cache usage falls below
+     * 90% of max_bytes. No-op if usage is not above max_bytes.
+     */
+    void evict();
+
+    /*
+     * Disk cache stats.
+     *
+     * num_hits_g:         reads served from the disk cache.
+     * bytes_read_g:       bytes read from the disk cache.
+     * num_ra_hits_g:      of num_hits_g, how many were readaheads.
+     * num_read_errors_g:  reads from the disk cache that failed.
+     * bytes_written_g:    bytes written to the disk cache.
+     * num_write_dropped_g: populate requests dropped because of too many
+     *                     bytes already queued.
+     * num_stale_g:        entries whose cached data was dropped as the file
+     *                     changed.
+     * num_evictions_g:    entries evicted to stay within max_bytes.
+     * bytes_cached_g:     disk space used by all entries.
+     * bytes_queued_g:     bytes currently queued for the IO threads.
+     */
+    static std::atomic<uint64_t> num_hits_g;
+    static std::atomic<uint64_t> bytes_read_g;
+    static std::atomic<uint64_t> num_ra_hits_g;
+    static std::atomic<uint64_t> num_read_errors_g;
+    static std::atomic<uint64_t> bytes_written_g;
+    static std::atomic<uint64_t> num_write_dropped_g;
+    static std::atomic<uint64_t> num_stale_g;
+    static std::atomic<uint64_t> num_evictions_g;
+    static std::atomic<uint64_t> bytes_cached_g;
+    static std::atomic<uint64_t> bytes_queued_g;
+
+    uint64_t get_max_bytes() const
+    {
+        return max_bytes;
+    }
+
+    size_t get_num_entries() const
+    {
+        std::unique_lock<std::mutex> lock(dcache_lock_47);
+        return entries.size();
+    }
+
+private:
+    disk_cache() = default;
+
+    void io_worker();
+    void housekeeper();
+
+    std::atomic<bool> enabled = false;
+    std::string cachedir;
+    uint64_t max_bytes = 0;
+
+    /*
+     * Protects entries, jobs and shutting_down.
+     */
+    mutable std::mutex dcache_lock_47;
+    std::condition_variable jobs_cv;
+    std::condition_variable hk_cv;
+
+    std::unordered_map<std::string, std::shared_ptr<disk_cache_entry>> entries;
+    std::deque<std::pair<std::function<void()>, uint64_t>> jobs;
+    bool shutting_down = false;
+
+    std::vector<std::thread> io_threads;
+    std::thread hk_thread;
+};
+
+}
+
+#endif /* __AZNFSC_DISK_CACHE_H__ */
@@ -2,6 +2,9 @@
 #define __FCSM_H__
 
 #include <queue>
+#include <map>
+#include <mutex>
+#include <vector>
 
 #include "aznfsc.h"
 
@@ -12,6 +15,8 @@ struct rpc_task;
 
 namespace aznfsc {
 
+struct bytes_chunk;
+
 /**
  * This is the flush-commit state machine responsible for ensuring cached file
  * data is properly synced with the backend blob, with the following goals:
@@ -51,11 +56,58 @@ namespace aznfsc {
  * finds no fctgt queued and then the state machine goes back to idle state,
  * to be kicked again when new ensure calls are made.
  *
- * Note: fcsm doesn't introduce new locks, various members of fcsm are
+ * Write window:
+ * A flush is issued as one or more parallel write calls, and to keep enough
+ * writes outstanding to saturate all the connections, fcsm doesn't wait for
+ * an ongoing flush to complete before issuing the next one. As writes complete
+ * fill_write_window() issues more dirty data, in full block sized units, such
+ * that the bytes being flushed stay within the write window. The write window
+ * is sized adaptively as the bandwidth-delay product of the backend writes,
+ * see update_write_window(). For unstable writes only data contiguous to what
+ * is already being flushed is issued this way, anything else (f.e. switching
+ * to stable writes) waits for the ongoing flushes to complete, as before.
+ * Commit still cannot run with any flush in progress, so once queued commit
+ * targets can be met by the data already flushing, we stop issuing more and
+ * let the window drain. The commit threshold is also derived from the window,
+ * see get_commit_batch_bytes(), so that commits are big enough to amortize
+ * the cost of draining the window.
+ *
+ * Since parallel writes can complete in any order, flushed_seq_num is only
+ * advanced over the contiguous range of flushed seq numbers, i.e., all bytes
+ * before flushed_seq_num are known to be flushed. See flushes_inflight.
+ *
+ * Note: Other than flush_seq_lock_48, which protects only flushes_inflight,
+ *       fcsm doesn't introduce new locks, various members of fcsm are
  *       protected by flush_lock.
  */
 #define FCSM_MAGIC *((const uint32_t *)"FCSM")
 
+/*
+ * Write window is this many times the estimated bandwidth-delay product.
+ * The headroom lets the window grow when the bandwidth estimate is itself
+ * limited by a small window.
+ */
+#define FCSM_WRITE_WINDOW_GAIN 2
+
+/*
+ * Min write RTT sample is forgotten after this long, so that the window can
+ * adapt to a slower server.
+ */
+#define FCSM_MIN_RTT_EXPIRY_USEC (10 * 1000 * 1000ULL)
+
+/*
+ * Commit when this many write windows worth of data is commit pending.
+ */
+#define FCSM_COMMIT_BATCH_WINDOWS 2
+
+/*
+ * Write-combining hold, see hold_write_tail().
+ * A trailing write smaller than wsize is held back from a flush if the file
+ * was written in the last these many usecs, as an appending writer will most
+ * likely grow it into a full wsize write soon.
+ */
+#define FCSM_WRITE_COMBINE_HOLD_USEC (50 * 1000ULL)
+
 class fcsm
 {
 public:
@@ -132,15 +184,22 @@ public:
      * Callbacks to be called when flush/commit successfully complete.
      * These will update flushed_seq_num/committed_seq_num and run flush/commit
      * targets from ftgtq/ctgtq as appropriate.
+     * flush_seq is the seq number of the first byte of the flush, as returned
+     * by add_flushing(), and rtt_usec is the RTT of the write that completed
+     * it, used for sizing the write window.
      */
-    void on_flush_complete(uint64_t flush_bytes);
+    void on_flush_complete(uint64_t flush_seq,
+                           uint64_t flush_bytes,
+                           uint64_t rtt_usec);
     void on_commit_complete(uint64_t commit_bytes);
 
     /**
      * Is the state machine currently running, i.e. it has sent (one or more)
      * flush requests or a commit request and is waiting for it to complete.
      * At any point only one flush (executed as one or more parallel write
-     * calls for different blocks) or commit can be running. Once the currently
+     * calls for different blocks, with more such flushes issued as earlier
+     * ones complete, as long as they fit the write window) or commit can be
+     * running. Once the currently
      * running flush/commit completes it checks ftgtq/ctgtq to see if it needs
      * to perform more flush/commit, if yes the state machine continues to run,
      * till it has no more targets to execute, at which point the state machine
@@ -187,8 +246,27 @@ public:
      * flushing.
      * This MUST be called before the write_iov_callback() can be called, i.e.,
      * before the actual write call is issued.
+     * Bytes added by one call are tracked as a new flush and the seq number of
+     * its first byte is returned. Subsequent calls for the same write must
+     * pass that as flush_seq to extend the same flush, and the same value must
+     * later be passed to on_flush_complete().
+     */
+    uint64_t add_flushing(uint64_t bytes, uint64_t flush_seq = UINT64_MAX);
+
+    /**
+     * Max bytes that we want to be flushing at any time.
+     */
+    uint64_t get_write_window() const
+    {
+        return write_window;
+    }
+
+    /**
+     * Commit pending bytes at which we want to issue a commit.
+     * This is FCSM_COMMIT_BATCH_WINDOWS write windows, but never more than
+     * bytes_chunk_cache::max_commit_bytes().
      */
-    void add_flushing(uint64_t bytes);
+    uint64_t get_commit_batch_bytes() const;
 
     struct nfs_inode *get_inode() const
     {
@@ -234,6 +312,59 @@ public:
     void ftgtq_cleanup();
 
 private:
+    /**
+     * Update the write window using the RTT of a just completed write and
+     * the current backend write throughput.
+     */
+    void update_write_window(uint64_t rtt_usec);
+
+    /**
+     * Issue more dirty data for flushing while an earlier flush is still in
+     * progress, without exceeding the write window. Only full blocks are
+     * issued this way, and nothing is issued if a commit target is waiting
+     * for the ongoing flushes to complete. Returns bytes issued.
+     *
+     * Caller MUST hold the flush_lock.
+     */
+    uint64_t fill_write_window();
+
+    /**
+     * Trim bc_vec (as returned by get_contiguous_dirty_bcs() or
+     * get_dirty_nonflushing_bcs_range()) so that flushing it doesn't exceed
+     * the write window, releasing the inuse count held on the bcs removed.
+     * At least one bc is left in a non-empty bc_vec. bytes is updated to
+     * reflect the bytes left in bc_vec.
+     */
+    void trim_to_write_window(std::vector<bytes_chunk>& bc_vec,
+                              uint64_t& bytes) const;
+
+    /**
+     * Write-combining stage for flushes issued while the file is still being
+     * written. sync_membufs() packs contiguous bcs (they can span multiple
+     * chunks/membufs) into WRITE RPCs of up to max write size, so small
+     * appends result in full sized WRITEs except for the last one, which
+     * carries whatever was appended after the last full WRITE.
+     * If that trailing WRITE would be smaller than wsize and the file was
+     * written recently (FCSM_WRITE_COMBINE_HOLD_USEC), its bcs are removed
+     * from bc_vec (releasing the inuse count held on them), so that they can
+     * be combined with the appends that follow and flushed later. The tail
+     * is only held if at least min_bytes remain in bc_vec and at least one
+     * full WRITE remains, so flushing always makes progress. bytes is
+     * updated to reflect the bytes left in bc_vec.
+     * Returns the bytes held back.
+     */
+    uint64_t hold_write_tail(std::vector<bytes_chunk>& bc_vec,
+                             uint64_t& bytes,
+                             uint64_t min_bytes = 0) const;
+
+    /**
+     * Complete all flush targets in ftgtq which are met by the current
+     * flushed_seq_num.
+     *
+     * Caller MUST hold the flush_lock.
+     */
+    void complete_flush_targets();
+
     /*
      * The singleton nfs_client, for convenience.
      */
@@ -347,6 +478,33 @@ private:
     std::atomic<uint64_t> committing_seq_num = 0;
     std::atomic<uint64_t> in_fc_callback = 0;
 
+    /*
+     * Flushes which are not yet complete, indexed by the seq number of their
+     * first byte, value is the flush length.
+     * Once all flushes before a seq number complete, flushed_seq_num can be
+     * advanced till that seq number. Since add_flushing() is called with
+     * flush_lock held while flushes complete w/o it, this is protected by
+     * flush_seq_lock_48 and not the flush_lock. This is a leaf lock.
+     */
+    std::mutex flush_seq_lock_48;
+    std::map<uint64_t, uint64_t> flushes_inflight;
+
+    /*
+     * Write window and the min write RTT (along with when it was sampled)
+     * used for sizing it, see update_write_window().
+     * write_window starts at the min allowed value and grows as write
+     * completions show we can use more.
+     */
+    std::atomic<uint64_t> write_window;
+    std::atomic<uint64_t> min_rtt_usec = 0;
+    std::atomic<uint64_t> min_rtt_stamp_usec = 0;
+
+    /*
+     * Time in usecs of the last application write to this file, stamped by
+     * run(), used by hold_write_tail().
+     */
+    std::atomic<uint64_t> last_write_usec = 0;
+
     /*
      * The state machine starts in an idle state.
      */
@@ -3,6 +3,7 @@
 
 #include <map>
 #include <mutex>
+#include <shared_mutex>
 #include <memory>
 #include <vector>
 #include <list>
@@ -97,6 +98,29 @@ namespace aznfsc {
  */
 #define CACHE_TAG (inode ? inode->get_fuse_ino() : (uint64_t) this)
 
+/*
+ * Max value of membuf::clock_ref. A membuf re-read these many times survives
+ * these many aging sweeps of the background evictor, ref
+ * bytes_chunk_cache::evict_cold().
+ */
+#define MB_CLOCK_REF_MAX 3
+
+/*
+ * membuf::read_state packs the range of the membuf read by the application
+ * and the bytes read, in units of MB_READ_UNIT bytes, in MB_READ_BITS bits
+ * each. This covers membufs up to 128MB, far more than AZNFSC_MAX_CHUNK_SIZE.
+ * Re-reads smaller than MB_READ_UNIT may go unnoticed, which is fine.
+ */
+#define MB_READ_UNIT 64
+#define MB_READ_BITS 21
+#define MB_READ_MASK ((uint64_t) ((1ULL << MB_READ_BITS) - 1))
+
+/*
+ * membuf::read_map has one bit per 1/MB_READ_MAP_BITS of the membuf (but
+ * not less than MB_READ_UNIT bytes), set once any byte in it is read.
+ */
+#define MB_READ_MAP_BITS 256
+
 // Forward declaration.
 class bytes_chunk_cache;
 
@@ -417,6 +441,159 @@ struct membuf
     void set_inuse();
     void clear_inuse();
 
+    /**
+     * Called for every application read served from this membuf, with the
+     * file range [off, off+len) that the read uses. A read that overlaps
+     * what the application has already read from this membuf is a re-read
+     * and makes the membuf hot, see clock_ref.
+     *
+     * Re-reads are detected in two ways, neither of which mistakes reads
+     * that don't overlap for re-reads, no matter in what order they come,
+     * so sequential readers (even with fuse threads completing their reads
+     * out of order, or multiple readers splitting a scan between them)
+     * leave their membufs cold.
+     * 1. read_map has a bit per read map unit, set when any byte of the unit
+     *    is read. A read that fully covers a unit whose bit was already set
+     *    overlaps an earlier read. This catches sparse random re-reads of a
+     *    hot set, however little of the membuf they touch.
+     * 2. For re-reads smaller than a read map unit, we track the span of the
+     *    membuf read so far and the number of bytes read. Reads that don't
+     *    overlap can never add up to more than the span they cover. Once the
+     *    bytes read exceed the span, some read was a re-read. We then trim
+     *    the bytes read to the span, so that only further re-reads count.
+     */
+    void on_app_read(uint64_t off, uint64_t len)
+    {
+        const uint64_t mb_off = offset;
+        const uint64_t start = (off > mb_off) ? (off - mb_off) : 0;
+        const uint64_t end = ((off + len) > mb_off) ? (off + len - mb_off) : 0;
+
+        bool reread = on_app_read_map(off, len);
+
+        // In MB_READ_UNIT units, span rounded out and bytes rounded down.
+        const uint64_t rlo = std::min(start / MB_READ_UNIT, MB_READ_MASK);
+        const uint64_t rhi =
+            std::min((end + MB_READ_UNIT - 1) / MB_READ_UNIT, MB_READ_MASK);
+        const uint64_t rbytes = std::min(len / MB_READ_UNIT, MB_READ_MASK);
+
+        uint64_t old_state = read_state;
+        uint64_t new_state;
+        bool reread_span;
+
+        do {
+            uint64_t lo = (old_state >> (2 * MB_READ_BITS)) & MB_READ_MASK;
+            uint64_t hi = (old_state >> MB_READ_BITS) & MB_READ_MASK;
+            uint64_t bytes = old_state & MB_READ_MASK;
+
+            // hi is 0 only till the first read.
+            if (hi == 0) {
+                lo = rlo;
+                hi = rhi;
+                bytes = 0;
+            } else {
+                lo = std::min(lo, rlo);
+                hi = std::max(hi, rhi);
+            }
+
+            bytes += rbytes;
+            reread_span = (bytes > (hi - lo));
+            if (reread_span) {
+                bytes = hi - lo;
+            }
+
+            new_state = (lo << (2 * MB_READ_BITS)) | (hi << MB_READ_BITS) |
+                        bytes;
+        } while (!read_state.compare_exchange_weak(old_state, new_state));
+
+        if (reread || reread_span) {
+            uint8_t ref = clock_ref;
+            // Lost updates under contention are harmless.
+            if (ref < MB_CLOCK_REF_MAX) {
+                clock_ref.compare_exchange_strong(ref, ref + 1);
+            }
+        }
+    }
+
+    /**
+     * Set the read_map bits for the file range [off, off+len) read by the
+     * application, returns true if it fully covers a unit that had been
+     * read before, see on_app_read().
+     */
+    bool on_app_read_map(uint64_t off, uint64_t len)
+    {
+        static_assert((MB_READ_MAP_BITS % 64) == 0);
+
+        // Unit is fixed for the membuf, so use initial_offset/length.
+        const uint64_t unit =
+            std::max((uint64_t) MB_READ_UNIT,
+                     (initial_length + MB_READ_MAP_BITS - 1) / MB_READ_MAP_BITS);
+        const uint64_t mb_end = initial_offset + initial_length;
+        const uint64_t start = std::max(off, initial_offset) - initial_offset;
+        const uint64_t end =
+            std::max(std::min(off + len, mb_end), initial_offset) -
+            initial_offset;
+
+        if (end <= start) {
+            return false;
+        }
+
+        // Units touched by the read and units fully covered by it.
+        const uint64_t ulo = start / unit;
+        const uint64_t uhi = std::min((uint64_t) MB_READ_MAP_BITS,
+                                      (end + unit - 1) / unit);
+        const uint64_t flo = (start + unit - 1) / unit;
+        const uint64_t fhi = std::min((uint64_t) MB_READ_MAP_BITS, end / unit);
+        bool reread = false;
+
+        for (uint64_t w = (ulo / 64); w < ((uhi + 63) / 64); w++) {
+            const auto range_mask = [w](uint64_t lo, uint64_t hi) -> uint64_t {
+                lo = std::max(lo, w * 64);
+                hi = std::min(hi, (w + 1) * 64);
+                if (hi <= lo) {
+                    return 0;
+                }
+                const uint64_t n = hi - lo;
+                return ((n == 64) ? ~0ULL : ((1ULL << n) - 1)) << (lo - (w * 64));
+            };
+
+            const uint64_t touched = range_mask(ulo, uhi);
+            const uint64_t covered = range_mask(flo, fhi);
+
+            // Don't dirty the cacheline if all bits are already set.
+            uint64_t old = read_map[w].load(std::memory_order_relaxed);
+            if ((old & touched) != touched) {
+                old = read_map[w].fetch_or(touched, std::memory_order_relaxed);
+            }
+
+            if (old & covered) {
+                reread = true;
+            }
+        }
+
+        return reread;
+    }
+
+    /**
+     * Cold membufs have not been re-read since they were filled, these are
+     * the first to be evicted by the background evictor.
+     */
+    bool is_hot() const
+    {
+        return (clock_ref > 0);
+    }
+
+    /**
+     * Age a hot membuf by one aging sweep, returns true if it became cold.
+     */
+    bool age()
+    {
+        uint8_t ref = clock_ref;
+
+        return ((ref > 0) &&
+                clock_ref.compare_exchange_strong(ref, ref - 1) &&
+                (ref == 1));
+    }
+
     /**
      * trim 'trim_len' bytes from the membuf. 'left' should be true if trimming
      * is done from the left side of the membuf, else trimming is done from the
@@ -565,6 +742,20 @@ private:
      * writing the membuf.
      */
     std::atomic<uint32_t> inuse = 0;
+
+    /*
+     * Range of this membuf read by the application and the bytes read (see
+     * MB_READ_BITS), and the CLOCK reference count, bumped on every re-read
+     * and decremented by every aging sweep of the background evictor.
+     * See on_app_read().
+     */
+    std::atomic<uint64_t> read_state = 0;
+    std::atomic<uint8_t> clock_ref = 0;
+
+    /*
+     * Units of this membuf read by the application, see on_app_read_map().
+     */
+    std::atomic<uint64_t> read_map[MB_READ_MAP_BITS / 64] = {};
 };
 
 /**
@@ -812,11 +1003,11 @@ public:
      * XXX: If we need to gracefully handle allocation failure, the buffer
      *      allocation must be done by the caller.
      *
-     * XXX Default std new[] implementation is very slow, use tcmalloc for
-     *     much faster perf. The main problem with std new is that it doesn't
-     *     use memory pools and for large allocations it gets/releases memory
-     *     to the system, which causes zero'ing overhead as kernel has to
-     *     zero pages.
+     * Note: The buffer is allocated from membuf_pool and not using std
+     *       new[]. The main problem with std new is that it doesn't use
+     *       memory pools and for large allocations it gets/releases memory
+     *       to the system, which causes zero'ing overhead as kernel has to
+     *       zero pages.
      */
     bytes_chunk(bytes_chunk_cache *_bcc,
                 uint64_t _offset,
@@ -924,6 +1115,74 @@ enum class scan_action
     SCAN_ACTION_RELEASE,
 };
 
+/*
+ * bytes_chunk_cache::chunkmap is sharded by file offset, so that IOs to
+ * disjoint regions of a file don't serialize on one lock.
+ * The file is divided into CHUNKMAP_REGION_SIZE sized regions and region R
+ * is held by shard (R % CHUNKMAP_SHARDS), every shard has its own chunkmap
+ * and its own chunkmap_lock_43. Consecutive regions map to different shards,
+ * so IOs to different parts of the file mostly find different shards, while
+ * an IO (get() cannot ask for more than AZNFSC_MAX_CHUNK_SIZE) touches at
+ * most two shards.
+ * A chunk never spans regions, get() allocates separate chunks for the parts
+ * of the requested range lying in different regions. This means a chunk is
+ * always found in the shard of its starting offset.
+ *
+ * CHUNKMAP_SHARDS must be a power of 2 and not more than 32.
+ * CHUNKMAP_REGION_SIZE must be a multiple of AZNFSC_MAX_CHUNK_SIZE.
+ */
+#define CHUNKMAP_SHARDS         16
+#define CHUNKMAP_REGION_SIZE    (16 * AZNFSC_MAX_CHUNK_SIZE)
+
+/**
+ * Lock for the chunkmap shards of a bytes_chunk_cache which hold the chunks
+ * for the range [offset, offset+length), or for all the shards.
+ * Shards are locked in increasing shard order and unlocked in the reverse
+ * order, so threads locking overlapping sets of shards don't deadlock.
+ *
+ * This satisfies the SharedMutex requirements so it can be used with
+ * std::unique_lock and std::shared_lock, f.e.,
+ *
+ *   chunkmap_lock shards_lock(this, offset, length);
+ *   const std::unique_lock<chunkmap_lock> _lock(shards_lock);
+ *
+ * Note: This is not recursive, a thread holding some shards must not lock
+ *       any of them again, using the same or another chunkmap_lock.
+ */
+class chunkmap_lock
+{
+public:
+    /*
+     * All shards.
+     */
+    chunkmap_lock(const bytes_chunk_cache *_bcc);
+
+    /*
+     * Shards holding the chunks for the range [offset, offset+length).
+     */
+    chunkmap_lock(const bytes_chunk_cache *_bcc,
+                  uint64_t offset,
+                  uint64_t length);
+
+    void lock();
+    void unlock();
+    void lock_shared();
+    void unlock_shared();
+
+    /*
+     * Is shard one of the shards locked by us?
+     */
+    bool has_shard(int shard) const
+    {
+        assert(shard >= 0 && shard < CHUNKMAP_SHARDS);
+        return (shard_mask & (1U << shard));
+    }
+
+private:
+    const bytes_chunk_cache *const bcc;
+    const uint32_t shard_mask;
+};
+
 /**
  * This is the per-file cache that caches variable sized extents and is
  * indexed using byte offset and length.
@@ -947,6 +1206,7 @@ class bytes_chunk_cache
 {
     friend membuf;
     friend bytes_chunk;
+    friend chunkmap_lock;
 
 public:
     bytes_chunk_cache(struct nfs_inode *_inode,
@@ -960,15 +1220,12 @@ public:
     bool is_empty() const
     {
         /*
-         * TSAN Warning.
-         * FIXME:
-         * If we call it while bytes_chunk_cache::scan() is adding to chunkmap,
-         * TSAN complains of data race.
-         * We need to fix this, though usually the caller is not strictly
-         * depending on the result returned by this, as the cache can change
-         * right after the call.
+         * num_chunks is updated along with the chunkmap (with the shard
+         * lock held), but it's atomic so we can read it w/o the locks.
+         * Usually the caller is not strictly depending on the result
+         * returned by this, as the cache can change right after the call.
          */
-        return chunkmap.empty();
+        return (num_chunks == 0);
     }
 
     /**
@@ -1333,14 +1590,62 @@ public:
      * the file is no longer being used, so we release all chunks irrespective
      * of their current state.
      */
-    void clear_nolock(bool shutdown = false);
+    void clear_nolock(bool shutdown = false,
+                      std::map<uint64_t, struct bytes_chunk> *retire_map = nullptr);
 
     void clear(bool shutdown = false)
     {
-        const std::unique_lock<std::mutex> _lock(chunkmap_lock_43);
+        chunkmap_lock all_shards(this);
+        const std::unique_lock<chunkmap_lock> _lock(all_shards);
         clear_nolock(shutdown);
     }
 
+    /**
+     * Logically purge the cache w/o freeing the memory.
+     * This is what a deferred invalidation (ref invalidate()) does on the
+     * next cache lookup. Chunks that clear_nolock() would release are moved
+     * out of chunkmap into the retired list, tagged with a new cache
+     * generation, so all lookups after this see an empty cache, while the
+     * membufs are freed later by the reclaimer thread, in batches and w/o
+     * holding chunkmap_lock_43, ref reclaim_retired(). Otherwise freeing a
+     * few GBs of cache would stall the unlucky IO that happened to find
+     * invalidate_pending set.
+     * Chunks that clear_nolock() would skip (inuse, locked, dirty or
+     * commit_pending) stay in chunkmap, same as with clear_nolock().
+     *
+     * Caller MUST hold exclusive lock on all the chunkmap shards.
+     */
+    void retire_nolock();
+
+    /**
+     * Free up to max_chunks of the chunks retired by retire_nolock(), oldest
+     * generation first. Returns the number of retired chunks still left,
+     * caller must call again if it's not 0.
+     *
+     * LOCKS: Exclusive chunkmap_lock_43 of all shards, but not while
+     *        freeing.
+     */
+    uint64_t reclaim_retired(uint64_t max_chunks);
+
+    /**
+     * Cache generation, incremented every time the cache is logically
+     * purged by retire_nolock(). Chunks returned by a lookup before and
+     * after a change in generation belong to different versions of the
+     * file data.
+     */
+    uint64_t get_generation() const
+    {
+        return generation;
+    }
+
+    /**
+     * Number of chunks retired but not yet freed.
+     */
+    uint64_t get_num_retired() const
+    {
+        return num_retired;
+    }
+
     /**
      * Mark the cache as invalid.
      * Should be called when it's determined that the cached data is not valid.
@@ -1493,11 +1798,16 @@ public:
      *    memory. In this case we might be committing more frequently which
      *    won't necessarily be optimal, but we have no choice due to the
      *    memory pressure.
+     *
+     * commit_bytes is the commit pending bytes for #1, caller can pass
+     * something smaller than max_commit_bytes() to commit more often, f.e.,
+     * fcsm passes fcsm::get_commit_batch_bytes().
      */
-    bool commit_required() const
+    bool commit_required(uint64_t commit_bytes = max_commit_bytes()) const
     {
+        assert(commit_bytes <= max_commit_bytes());
         const bool local_pressure =
-            (bytes_commit_pending >= max_commit_bytes());
+            (bytes_commit_pending >= commit_bytes);
 
         if (local_pressure) {
             INC_GBL_STATS(commit_lp, 1);
@@ -1649,8 +1959,7 @@ public:
     void get_prune_goals(uint64_t *inline_bytes, uint64_t *periodic_bytes) const
     {
         // Maximum cache size allowed in bytes.
-        static const uint64_t max_total =
-            (aznfsc_cfg.cache.data.user.max_size_mb * 1024 * 1024ULL);
+        const uint64_t max_total = get_cache_budget();
         assert(max_total != 0);
 
         /*
@@ -1666,10 +1975,10 @@ public:
          * Following also means that at any time, half of the cache_max_mb
          * can be safely present in the cache.
          */
-        static const uint64_t inline_threshold = (max_total * 0.9);
-        static const uint64_t inline_target = (max_total * 0.8);
-        static const uint64_t periodic_threshold = (max_total * 0.7);
-        static const uint64_t periodic_target = (max_total * 0.6);
+        const uint64_t inline_threshold = (max_total * 0.9);
+        const uint64_t inline_target = (max_total * 0.8);
+        const uint64_t periodic_threshold = (max_total * 0.7);
+        const uint64_t periodic_target = (max_total * 0.6);
 
         /*
          * Current total cache size in bytes. Save it once to avoid issues
@@ -1726,16 +2035,78 @@ public:
         }
     }
 
+    /**
+     * Max bytes all the file caches together can use, this is what all the
+     * cache sizing and pruning is based on.
+     * It's cache.data.user.max_size_mb, unless cache.data.user.adaptive_size
+     * is set, in which case it's updated as per the memory pressure, ref
+     * mem_pressure, and can be lower than that.
+     */
+    static uint64_t get_cache_budget()
+    {
+        const uint64_t budget = cache_budget_g;
+        return budget ? budget :
+            (aznfsc_cfg.cache.data.user.max_size_mb * 1024 * 1024ULL);
+    }
+
+    static void set_cache_budget(uint64_t budget)
+    {
+        assert(budget > 0);
+        assert(budget <=
+               (aznfsc_cfg.cache.data.user.max_size_mb * 1024 * 1024ULL));
+        cache_budget_g = budget;
+    }
+
+    /**
+     * Global periodic prune goal, i.e., how many bytes must be freed from all
+     * caches together to bring the total cache usage down to the periodic
+     * target. Must use the same limits as get_prune_goals().
+     */
+    static uint64_t get_global_prune_goal()
+    {
+        const uint64_t max_total = get_cache_budget();
+        const uint64_t periodic_threshold = (max_total * 0.7);
+        const uint64_t periodic_target = (max_total * 0.6);
+
+        const uint64_t curr_bytes_total = bytes_allocated_g;
+
+        if (curr_bytes_total <= periodic_threshold) {
+            return 0;
+        }
+
+        return (curr_bytes_total - periodic_target);
+    }
+
     /**
      * Check and perform inline pruning if needed.
      * We do inline pruning when we are "extremely" high on memory usage and
      * hence cannot proceed w/o making space for this new request. This must be
      * called from get() which may need more memory.
      *
-     * TODO: Also add periodic pruning support.
+     * Periodic pruning is done by the background evictor, which normally
+     * keeps us below the inline threshold, see nfs_client::evictor().
      */
     void inline_prune();
 
+    /**
+     * Evict upto max_bytes worth of cold membufs from this cache, returns the
+     * bytes evicted. Only membufs which are not inuse, locked, dirty or
+     * commit pending and not in the readahead window are evicted, same as
+     * inline_prune().
+     * This is called by the background evictor, which goes over all the
+     * caches so that membufs touched once by a big sequential read are
+     * evicted before the membufs that are re-read by other applications.
+     */
+    uint64_t evict_cold(uint64_t max_bytes);
+
+    /**
+     * One aging sweep over the membufs of this cache, decrements clock_ref
+     * of every hot membuf so that hot membufs not re-read since the last
+     * sweep eventually become cold and can be evicted by evict_cold().
+     * Returns the number of membufs which became cold.
+     */
+    uint64_t age_hot();
+
     /**
      * This will run self tests to test the correctness of this class.
      */
@@ -1789,6 +2160,8 @@ public:
     static std::atomic<uint64_t> num_truncate_g;
     static std::atomic<uint64_t> bytes_truncate_g;
     static std::atomic<uint64_t> bytes_allocated_g;
+    // 0 means not set, see get_cache_budget().
+    static std::atomic<uint64_t> cache_budget_g;
     static std::atomic<uint64_t> bytes_cached_g;
     static std::atomic<uint64_t> bytes_dirty_g;
     static std::atomic<uint64_t> bytes_flushing_g;
@@ -1851,6 +2224,21 @@ public:
 
 private:
 
+    /**
+     * Remove the chunk at 'it' from chunkmap, updating the cache stats, and
+     * return the bytes freed (once the last ref on the membuf is dropped).
+     * Only for chunks known not to be in use, called with the shard's
+     * chunkmap_lock_43 held exclusively by inline_prune() and evict_cold().
+     */
+    uint64_t prune_chunk(
+            std::map<uint64_t, struct bytes_chunk>& chunkmap,
+            std::map<uint64_t, struct bytes_chunk>::const_iterator it);
+
+    /**
+     * Can this membuf be evicted by the background evictor?
+     */
+    bool is_evictable(const struct membuf *mb) const;
+
     /**
      * Scan all chunks lying in the range [offset, offset+length) and perform
      * requested action, as described below:
@@ -1865,6 +2253,9 @@ private:
      * bytes_released will be set to the number of bytes actually released,
      * i.e., either entire chunk was released (and membuf freed) or the chunk
      * was trimmed.
+     *
+     * This locks only the chunkmap shards holding the requested range, see
+     * CHUNKMAP_SHARDS.
      */
     std::vector<bytes_chunk> scan(uint64_t offset,
                                   uint64_t length,
@@ -1874,7 +2265,66 @@ private:
                                   uint64_t *extent_right = nullptr);
 
     /**
-     * This must be called with bytes_chunk_cache lock held.
+     * scan() for the chunks in one chunkmap shard.
+     * For SCAN_ACTION_GET the range must lie within one region, as the new
+     * chunks are added to this chunkmap, and the extent returned is limited
+     * to the chunks in this chunkmap. For SCAN_ACTION_RELEASE the range can
+     * span regions, only the chunks in this chunkmap are released.
+     *
+     * Caller MUST hold the shard's chunkmap_lock_43 exclusively.
+     */
+    std::vector<bytes_chunk> scan_nolock(
+            std::map<uint64_t, struct bytes_chunk>& chunkmap,
+            uint64_t offset,
+            uint64_t length,
+            scan_action action,
+            uint64_t *bytes_released,
+            uint64_t *extent_left,
+            uint64_t *extent_right);
+
+    /**
+     * Extend the extent [extent_left, extent_right) returned by scan_nolock()
+     * into the neighbouring regions, see scan().
+     * shards_lock is the lock held by the caller.
+     */
+    void extend_extent_nolock(const chunkmap_lock& shards_lock,
+                              uint64_t& extent_left,
+                              uint64_t& extent_right) const;
+
+    /**
+     * Chunks starting in the range [start_off, end_off] from all the shards,
+     * sorted by offset. For callers which need to walk the chunkmap in file
+     * offset order.
+     *
+     * Caller MUST hold all the chunkmap shards locked, in shared or
+     * exclusive mode.
+     */
+    std::vector<const struct bytes_chunk *> get_sorted_chunks_nolock(
+            uint64_t start_off, uint64_t end_off) const;
+
+    /**
+     * Fast path for scan(), called with chunkmap_lock_43 of the shards
+     * holding the requested range held in shared mode.
+     * It serves only those requests which don't need to update the chunkmap:
+     * - SCAN_ACTION_GET for memory-backed caches where the requested range
+     *   is fully covered by existing chunks and caller doesn't need the
+     *   extent range. This is the common case of reads served from cache.
+     * - SCAN_ACTION_RELEASE where none of the chunks overlapping the requested
+     *   range is safe_to_release(), so there's nothing to release.
+     *
+     * Returns true if it served the request, in which case chunkvec will
+     * contain the chunks to be returned by get() and bytes_released (for
+     * SCAN_ACTION_RELEASE) will be 0. A false return means the caller must
+     * perform the scan with the shards locked exclusively.
+     */
+    bool scan_shared(uint64_t offset,
+                     uint64_t length,
+                     scan_action action,
+                     std::vector<bytes_chunk>& chunkvec,
+                     uint64_t *bytes_released);
+
+    /**
+     * This must be called with all the chunkmap shards locked exclusively.
      */
     bool extend_backing_file(uint64_t newlen)
     {
@@ -1904,12 +2354,55 @@ private:
     }
 
     /*
-     * std::map of bytes_chunk, indexed by the starting offset of the chunk.
+     * Shard holding the chunks of region R of the file, see CHUNKMAP_SHARDS.
+     */
+    static int get_shard(uint64_t offset)
+    {
+        return (offset / CHUNKMAP_REGION_SIZE) & (CHUNKMAP_SHARDS - 1);
+    }
+
+    /*
+     * Bitmask of the shards holding the chunks for the range
+     * [offset, offset+length).
      */
-    std::map<uint64_t, struct bytes_chunk> chunkmap;
+    static uint32_t get_shard_mask(uint64_t offset, uint64_t length);
 
-    // Lock to protect chunkmap.
-    mutable std::mutex chunkmap_lock_43;
+    /*
+     * Shard of the chunkmap.
+     * chunkmap is a std::map of bytes_chunk, indexed by the starting offset
+     * of the chunk.
+     *
+     * chunkmap_lock_43 protects chunkmap.
+     * Hold it exclusively for adding/removing/trimming chunks, and in shared
+     * mode for only looking up chunks. Since membuf inuse count is atomic, it
+     * can be incremented for looked up chunks with the lock held in shared
+     * mode. Anyone checking inuse for deciding whether a chunk can be removed
+     * (release(), clear(), inline_prune()) holds the lock exclusively, so they
+     * cannot race with a lookup setting inuse.
+     * Use chunkmap_lock for locking the shards, it takes care of the lock
+     * order.
+     */
+    struct alignas(64) chunkmap_shard
+    {
+        std::map<uint64_t, struct bytes_chunk> chunkmap;
+        mutable std::shared_mutex chunkmap_lock_43;
+    };
+
+    chunkmap_shard shards[CHUNKMAP_SHARDS];
+
+    /*
+     * Chunks removed from chunkmap by retire_nolock() and waiting to be freed
+     * by the reclaimer thread, indexed by the generation they were retired
+     * in. num_retired is the total chunks in all generations.
+     * reclaim_queued is set when the inode is queued to the reclaimer, so
+     * that back to back invalidations queue it only once.
+     * All protected by chunkmap_lock_43 of all the shards.
+     */
+    std::map<uint64_t,
+             std::map<uint64_t, struct bytes_chunk>> retired;
+    std::atomic<uint64_t> num_retired = 0;
+    std::atomic<uint64_t> generation = 0;
+    bool reclaim_queued = false;
 
     /*
      * Size of the cache.
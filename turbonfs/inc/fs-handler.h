@@ -1,9 +1,16 @@
 #ifndef __FS_HANDLER_H__
 #define __FS_HANDLER_H__
 
+#include <cinttypes>
+
 #include "nfs_client.h"
 
 #ifdef ENABLE_NO_FUSE
+/*
+ * The aznfsc_ll_*() handlers below reply directly (w/o going through an
+ * rpc_task), so like the rpc_task::fuse_reply_*() nofuse variants these must
+ * wakeup the posix_task waiting for the reply.
+ */
 static inline
 int fuse_reply_err(fuse_req_t req, int err)
 {
@@ -11,6 +18,7 @@ int fuse_reply_err(fuse_req_t req, int err)
 
     PXT *pxtask = _FR2PXT(req);
     pxtask->res = -err;
+    pxtask->wakeup();
     return 0;
 }
 
@@ -19,8 +27,16 @@ int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *f)
 {
     PXT *pxtask = _FR2PXT(req);
     pxtask->res = 0;
+    pxtask->wakeup();
     return 0;
 }
+
+#define FUSE_REPLY_ERR(req, errno_pos) \
+do { \
+    assert(errno_pos >= 0); \
+    fuse_reply_err(req, errno_pos); \
+    DEC_GBL_STATS(fuse_responses_awaited, 1); \
+} while (0)
 #else
 #define FUSE_REPLY_ERR(req, errno_pos) \
 do { \
@@ -409,6 +425,12 @@ static void aznfsc_ll_open(fuse_req_t req,
     inode->on_fuse_open(FUSE_OPEN);
     assert(inode->opencnt > 0);
 
+    /*
+     * Small file fast path, start reading the file before the application
+     * asks for it.
+     */
+    inode->prefetch_small_file(fi->flags);
+
     const int fre = fuse_reply_open(req, fi);
     if (fre != 0) {
         INC_GBL_STATS(fuse_reply_failed, 1);
@@ -661,6 +683,43 @@ static void aznfsc_ll_statfs(fuse_req_t req,
     client->statfs(req, ino);
 }
 
+/*
+ * Application cache hints are passed as setxattr of these names on a
+ * regular file, with value "offset,length" or empty for the whole file,
+ * see nfs_inode::prefetch() and nfs_inode::dontneed().
+ * These are not stored anywhere, getxattr doesn't return them.
+ */
+#define AZNFSC_XATTR_PREFETCH       "user.aznfsc.prefetch"
+#define AZNFSC_XATTR_PREFETCH_PIN   "user.aznfsc.prefetch_pin"
+#define AZNFSC_XATTR_DONTNEED       "user.aznfsc.dontneed"
+
+/*
+ * Parse the "offset,length" value of a hint xattr, value is not null
+ * terminated. Returns false if value is not valid.
+ */
+static inline
+bool parse_hint_range(const char *value, size_t size,
+                      uint64_t& offset, uint64_t& length)
+{
+    offset = length = 0;
+
+    if (size == 0) {
+        return true;
+    }
+
+    char buf[64];
+    if (size >= sizeof(buf)) {
+        return false;
+    }
+
+    ::memcpy(buf, value, size);
+    buf[size] = '\0';
+
+    char extra;
+    return (::sscanf(buf, "%" SCNu64 ",%" SCNu64 "%c",
+                     &offset, &length, &extra) == 2);
+}
+
 [[maybe_unused]]
 static void aznfsc_ll_setxattr(fuse_req_t req,
                                fuse_ino_t ino,
@@ -669,10 +728,38 @@ static void aznfsc_ll_setxattr(fuse_req_t req,
                                size_t size,
                                int flags)
 {
+    FUSE_STATS_TRACKER(FUSE_SETXATTR);
+    INC_GBL_STATS(fuse_responses_awaited, 1);
+
+    AZLogDebug("aznfsc_ll_setxattr(req={}, ino={}, name={}, size={}, "
+               "flags={})", fmt::ptr(req), ino, name, size, flags);
+
+    const bool prefetch = (::strcmp(name, AZNFSC_XATTR_PREFETCH) == 0);
+    const bool prefetch_pin = (::strcmp(name, AZNFSC_XATTR_PREFETCH_PIN) == 0);
+    const bool dontneed = (::strcmp(name, AZNFSC_XATTR_DONTNEED) == 0);
+
     /*
-     * TODO: Fill me.
+     * We don't support xattrs, only the hints.
+     * Note: ENOSYS would make fuse not send any more setxattr.
      */
-    fuse_reply_err(req, ENOSYS);
+    if (!prefetch && !prefetch_pin && !dontneed) {
+        FUSE_REPLY_ERR(req, ENOTSUP);
+        return;
+    }
+
+    uint64_t offset, length;
+    if (!parse_hint_range(value, size, offset, length)) {
+        FUSE_REPLY_ERR(req, EINVAL);
+        return;
+    }
+
+    struct nfs_client *client = get_nfs_client_from_fuse_req(req);
+    struct nfs_inode *inode = client->get_nfs_inode_from_ino(ino);
+    const int ret = dontneed ?
+                    inode->dontneed(offset, length) :
+                    inode->prefetch(offset, length, prefetch_pin);
+
+    FUSE_REPLY_ERR(req, ret);
 }
 
 [[maybe_unused]]
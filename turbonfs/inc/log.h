@@ -7,6 +7,9 @@
 #include "spdlog/sinks/basic_file_sink.h"
 #include "spdlog/sinks/stdout_color_sinks.h"  // support for user defined type
 
+#include <atomic>
+#include <string>
+
 #ifdef ENABLE_DEBUG
 /*
  * __FILE__ like macro but returns the short filename, which is more usable
@@ -28,57 +31,235 @@
 #endif /* ENABLE_DEBUG */
 
 /*
+ * Log levels, for AZLOG_ACTIVE_LEVEL.
+ */
+#define AZLOG_LEVEL_VERBOSE 0
+#define AZLOG_LEVEL_DEBUG   1
+#define AZLOG_LEVEL_INFO    2
+#define AZLOG_LEVEL_WARN    3
+
+/*
+ * Log calls for levels below AZLOG_ACTIVE_LEVEL are compiled out, their
+ * arguments are not even evaluated. Set using the LOG_ACTIVE_LEVEL cmake
+ * option. The default keeps debug logs, which are then enabled at runtime
+ * with -d or the debug config.
+ *
  * Despite their claims, spdlog because of its typeless logging is seen to
- * consume lot of cpu. We can quickly verify that by uncommenting this.
- * If seen to be a real problem we will have to move to simpler logging
- * lib.
+ * consume lot of cpu. We can quickly verify that by uncommenting
+ * DISABLE_NON_CRIT_LOGGING which compiles out info and debug logs.
  */
 //#define DISABLE_NON_CRIT_LOGGING
 
+#ifdef DISABLE_NON_CRIT_LOGGING
+#undef AZLOG_ACTIVE_LEVEL
+#define AZLOG_ACTIVE_LEVEL AZLOG_LEVEL_WARN
+#endif
+
+#ifndef AZLOG_ACTIVE_LEVEL
+#define AZLOG_ACTIVE_LEVEL AZLOG_LEVEL_DEBUG
+#endif
+
+/*
+ * Async logging.
+ *
+ * Formatting the log message and writing it to the sinks synchronously in
+ * the caller's context is what makes debug logging so expensive, more so as
+ * we flush on every debug message when debug logging is enabled. With async
+ * logging enabled (the log_async config) each thread formats its messages
+ * into a per-thread ring of fixed size slots, w/o taking any lock or
+ * allocating memory (only the ring itself is allocated on a thread's first
+ * log), and a background thread applies the log pattern and writes the
+ * messages to the spdlog sinks, in timestamp order across all threads.
+ *
+ * Each ring has a single producer (the owning thread) and a single
+ * consumer (the log thread). When a ring is full, debug and info messages
+ * are dropped (and the drop is logged later), while warn and above wait
+ * for space. Messages longer than AZLOG_MSG_SIZE (f.e., the stats dump) are
+ * formatted again into a heap allocated string which the slot points to, so
+ * they are written intact and in order with the other messages, at the cost
+ * of formatting twice. This is rare enough to not matter.
+ *
+ * Messages queued in the rings are lost if the process is killed, but
+ * AZLogCrit() waits for all queued messages to be written and so does
+ * abort() (f.e., assert failure) and crashing signals, see
+ * azlog::enable_async().
+ */
+#define AZLOG_RING_SLOTS    256
+#define AZLOG_MSG_SIZE      480
+
+namespace azlog {
+
+struct log_slot
+{
+    spdlog::log_clock::time_point time;
+    size_t thread_id;
+    spdlog::level::level_enum level;
+    uint32_t len;
+
+    /*
+     * Set for messages that don't fit in msg, owned by the slot and freed
+     * once written.
+     */
+    std::string *long_msg;
+    char msg[AZLOG_MSG_SIZE];
+};
+
+/*
+ * Set once async logging is enabled, never cleared.
+ */
+extern std::atomic<bool> async_enabled;
+
+/*
+ * Reserve a slot in the calling thread's ring for a message of the given
+ * level. Returns nullptr if the message must be dropped.
+ */
+log_slot *get_slot(spdlog::level::level_enum lvl);
+
+/*
+ * Publish the slot returned by get_slot(), after formatting the message
+ * into it.
+ */
+void commit_slot(log_slot *slot, size_t len);
+
+/*
+ * Publish the slot returned by get_slot() for a message that didn't fit in
+ * the slot, slot takes ownership of the fully formatted message.
+ */
+void commit_long_slot(log_slot *slot, std::string&& msg);
+
+/*
+ * Start the log thread, called once, after the log level and sinks are
+ * setup.
+ */
+void enable_async();
+
+/*
+ * Wait till all messages queued so far are written (and flushed), or
+ * timeout_msecs expires.
+ */
+void flush_async(int timeout_msecs = 1000);
+
+/*
+ * Stop the log thread after writing all queued messages. Logging is
+ * synchronous after this.
+ */
+void shutdown_async();
+
+/*
+ * Async logging unit test, run with DEBUG_AZLOG defined.
+ */
+int unit_test();
+}
+
+/*
+ * Log the message with the given spdlog level.
+ * Level check is done before formatting and for async logging the message
+ * is formatted directly into the ring slot. The arguments are passed through
+ * a lambda so that they are evaluated only once, even when an oversize
+ * message needs to be formatted again.
+ */
+#define AZLOG_WRITE(lvl, _fmt, ...) \
+do { \
+    if (spdlog::default_logger_raw()->should_log(lvl)) { \
+        if (azlog::async_enabled) { \
+            [](spdlog::level::level_enum __lvl, auto&&... __args) { \
+                azlog::log_slot *__slot = azlog::get_slot(__lvl); \
+                if (!__slot) { \
+                    return; \
+                } \
+                const auto __res = fmt::format_to_n(__slot->msg, \
+                                                    sizeof(__slot->msg), \
+                                                    _fmt, __args...); \
+                if (__res.size <= sizeof(__slot->msg)) { \
+                    azlog::commit_slot(__slot, __res.size); \
+                } else { \
+                    azlog::commit_long_slot( \
+                        __slot, fmt::format(_fmt, __args...)); \
+                } \
+            }(lvl, ##__VA_ARGS__); \
+        } else { \
+            spdlog::log(lvl, _fmt, ##__VA_ARGS__); \
+        } \
+    } \
+} while (0)
+
+/*
+ * Log calls compiled out due to AZLOG_ACTIVE_LEVEL.
+ * Arguments are still type checked, so that we don't get unused variable
+ * errors or bitrot, but they are never evaluated.
+ */
+#define AZLOG_NOP(fmt, ...) \
+do { \
+    if (false) { \
+        spdlog::debug(fmt, ##__VA_ARGS__); \
+    } \
+} while (0)
+
 #ifndef ENABLE_DEBUG
 #define AZLogCrit(fmt, ...) \
-    spdlog::critical(fmt, ##__VA_ARGS__)
+do { \
+    AZLOG_WRITE(spdlog::level::critical, fmt, ##__VA_ARGS__); \
+    azlog::flush_async(); \
+} while (0)
 #define AZLogError(fmt, ...) \
-    spdlog::error(fmt, ##__VA_ARGS__)
+    AZLOG_WRITE(spdlog::level::err, fmt, ##__VA_ARGS__)
 #define AZLogWarn(fmt, ...) \
-    spdlog::warn(fmt, ##__VA_ARGS__)
+    AZLOG_WRITE(spdlog::level::warn, fmt, ##__VA_ARGS__)
 #else /* !ENABLE_DEBUG */
 #define AZLogCrit(fmt, ...) \
-    spdlog::critical(LOC_FMT fmt, __FILENAME__, __LINE__, ##__VA_ARGS__)
+do { \
+    AZLOG_WRITE(spdlog::level::critical, LOC_FMT fmt, __FILENAME__, __LINE__, ##__VA_ARGS__); \
+    azlog::flush_async(); \
+} while (0)
 #define AZLogError(fmt, ...) \
-    spdlog::error(LOC_FMT fmt, __FILENAME__, __LINE__, ##__VA_ARGS__)
+    AZLOG_WRITE(spdlog::level::err, LOC_FMT fmt, __FILENAME__, __LINE__, ##__VA_ARGS__)
 #define AZLogWarn(fmt, ...) \
-    spdlog::warn(LOC_FMT fmt, __FILENAME__, __LINE__, ##__VA_ARGS__)
+    AZLOG_WRITE(spdlog::level::warn, LOC_FMT fmt, __FILENAME__, __LINE__, ##__VA_ARGS__)
 #endif /* ENABLE_DEBUG */
 
-#ifdef DISABLE_NON_CRIT_LOGGING
-#define AZLogInfo(...)     /* nothing */
-#define AZLogDebug(...)    /* nothing */
-#else /* !DISABLE_NON_CRIT_LOGGING */
-#ifndef ENABLE_DEBUG
+#if AZLOG_ACTIVE_LEVEL > AZLOG_LEVEL_INFO
+#define AZLogInfo(fmt, ...)     AZLOG_NOP(fmt, ##__VA_ARGS__)
+#elif !defined(ENABLE_DEBUG)
 #define AZLogInfo(fmt, ...) \
-    spdlog::info(fmt, ##__VA_ARGS__)
-#define AZLogDebug(fmt, ...) \
-    if (enable_debug_logs) spdlog::debug(fmt, ##__VA_ARGS__)
-#else /* !ENABLE_DEBUG */
+    AZLOG_WRITE(spdlog::level::info, fmt, ##__VA_ARGS__)
+#else
 #define AZLogInfo(fmt, ...) \
-    spdlog::info(LOC_FMT fmt, __FILENAME__, __LINE__, ##__VA_ARGS__)
+    AZLOG_WRITE(spdlog::level::info, LOC_FMT fmt, __FILENAME__, __LINE__, ##__VA_ARGS__)
+#endif
+
+/*
+ * enable_debug_logs is checked first as that's cheaper than the spdlog
+ * level check.
+ */
+#if AZLOG_ACTIVE_LEVEL > AZLOG_LEVEL_DEBUG
+#define AZLogDebug(fmt, ...)    AZLOG_NOP(fmt, ##__VA_ARGS__)
+#elif !defined(ENABLE_DEBUG)
 #define AZLogDebug(fmt, ...) \
-    if (enable_debug_logs) spdlog::debug(LOC_FMT fmt, __FILENAME__, __LINE__, ##__VA_ARGS__)
-#endif /* ENABLE_DEBUG */
-#endif /* DISABLE_NON_CRIT_LOGGING */
+do { \
+    if (__builtin_expect(enable_debug_logs, 0)) { \
+        AZLOG_WRITE(spdlog::level::debug, fmt, ##__VA_ARGS__); \
+    } \
+} while (0)
+#else
+#define AZLogDebug(fmt, ...) \
+do { \
+    if (__builtin_expect(enable_debug_logs, 0)) { \
+        AZLOG_WRITE(spdlog::level::debug, LOC_FMT fmt, __FILENAME__, __LINE__, ##__VA_ARGS__); \
+    } \
+} while (0)
+#endif
 
 /*
  * For some special debugging needs we may want very chatty logs,
  * which for normal debugging causes too much distraction.
  */
-#ifdef ENABLE_CHATTY
+#if defined(ENABLE_CHATTY) && (AZLOG_ACTIVE_LEVEL <= AZLOG_LEVEL_VERBOSE)
 #ifndef ENABLE_DEBUG
-#define AZLogVerbose(...) \
-    spdlog::debug(__VA_ARGS__)
+#define AZLogVerbose(fmt, ...) \
+    AZLOG_WRITE(spdlog::level::debug, fmt, ##__VA_ARGS__)
 #else /* !ENABLE_DEBUG */
 #define AZLogVerbose(fmt, ...) \
-    spdlog::debug(LOC_FMT fmt, __FILENAME__, __LINE__, ##__VA_ARGS__)
+    AZLOG_WRITE(spdlog::level::debug, LOC_FMT fmt, __FILENAME__, __LINE__, ##__VA_ARGS__)
 #endif /* ENABLE_DEBUG */
 #else /* !ENABLE_CHATTY */
 #define AZLogVerbose(...)  /* nothing */
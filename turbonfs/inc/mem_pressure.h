@@ -0,0 +1,157 @@
+#ifndef __AZNFSC_MEM_PRESSURE_H__
+#define __AZNFSC_MEM_PRESSURE_H__
+
+#include <string>
+#include <atomic>
+
+#include "aznfsc.h"
+
+namespace aznfsc {
+
+/*
+ * The cache budget is recomputed at most once every these many seconds,
+ * ref mem_pressure::update().
+ */
+#define MEMPRESSURE_UPDATE_SECS 1
+
+/*
+ * Percentage of the memory limit we try to keep free, for the application
+ * and the kernel, when sizing the cache against the cgroup (or system) free
+ * memory.
+ */
+#define MEMPRESSURE_RESERVE_PCT 10
+
+/*
+ * PSI memory "some avg10" percentage above which the cache budget is shrunk
+ * by MEMPRESSURE_SHRINK_PCT every update, and below which it's allowed to
+ * grow back by MEMPRESSURE_GROW_PCT every update. In between the budget is
+ * left alone, so that we don't oscillate.
+ */
+#define MEMPRESSURE_PSI_HIGH 10.0
+#define MEMPRESSURE_PSI_LOW 1.0
+#define MEMPRESSURE_SHRINK_PCT 10
+#define MEMPRESSURE_GROW_PCT 5
+
+/*
+ * The cache budget never goes below this, a smaller cache won't let us do
+ * full sized reads and writes.
+ */
+#define MEMPRESSURE_MIN_BUDGET_MB AZNFSCFG_CACHE_MAX_MB_MIN
+
+/**
+ * Memory pressure driven sizing of the user data cache, enabled by
+ * cache.data.user.adaptive_size.
+ *
+ * cache.data.user.max_size_mb is sized against the total RAM once at mount
+ * time, which is wrong in a container with a memory limit (the limit can
+ * be much lower than the node's RAM), or when we share the machine with
+ * memory hungry applications. Since we resist the OOM killer (ref
+ * oom_kill_disable) a cache that's too big makes the kernel reclaim and
+ * stall everyone else in the cgroup, while a cache that's too small leaves
+ * memory idle.
+ *
+ * In this mode the cache budget (ref bytes_chunk_cache::get_cache_budget())
+ * is recomputed periodically from:
+ * - The tightest cgroup v2 memory.max/memory.high in our cgroup hierarchy
+ *   and the corresponding memory.current. The budget is capped at what we
+ *   have cached plus what's still free under that limit, less
+ *   MEMPRESSURE_RESERVE_PCT of the limit. W/o a cgroup limit, MemAvailable
+ *   from /proc/meminfo is used against the total RAM.
+ * - Memory PSI ("some avg10" from our cgroup's memory.pressure, or
+ *   /proc/pressure/memory), which shrinks the budget while tasks are
+ *   stalling on memory and lets it grow back slowly once they aren't.
+ * The budget stays within [MEMPRESSURE_MIN_BUDGET_MB, max_size_mb].
+ *
+ * Everything that used max_size_mb for sizing the cache uses the budget
+ * instead, so the prune thresholds (and hence the background evictor and
+ * inline pruning) and the readahead/flush scale factors computed by
+ * nfs_client::periodic_updater() follow it.
+ *
+ * All files are best effort, anything we can't read is ignored.
+ */
+class mem_pressure
+{
+public:
+    static mem_pressure& get_instance()
+    {
+        static mem_pressure mp;
+        return mp;
+    }
+
+    /**
+     * Find our cgroup and the PSI file. Must be called once after the
+     * config is sanitized and before the cache is used.
+     */
+    void init();
+
+    /**
+     * Recompute the cache budget if MEMPRESSURE_UPDATE_SECS have passed
+     * since the last update. Called from nfs_client::periodic_updater(),
+     * only one of the concurrent callers does the update.
+     */
+    void update(time_t now_sec);
+
+    bool is_enabled() const
+    {
+        return enabled;
+    }
+
+    /*
+     * Values seen by the last update, for stats.
+     * limit is UINT64_MAX if there's no memory limit.
+     */
+    uint64_t get_limit_bytes() const
+    {
+        return limit_bytes;
+    }
+
+    uint64_t get_free_bytes() const
+    {
+        return free_bytes;
+    }
+
+    double get_psi_some_avg10() const
+    {
+        return psi_some_avg10;
+    }
+
+private:
+    mem_pressure() = default;
+
+    /*
+     * Find the tightest memory limit in our cgroup hierarchy and the free
+     * memory under it. Returns false if there's no limit.
+     */
+    bool read_cgroup_limit(uint64_t& limit, uint64_t& free) const;
+
+    /*
+     * Read MemTotal and MemAvailable from /proc/meminfo.
+     */
+    static bool read_meminfo(uint64_t& total, uint64_t& avail);
+
+    /*
+     * Read "some avg10" from the given PSI file, -1 if not available.
+     */
+    static double read_psi(const std::string& path);
+
+    bool enabled = false;
+
+    /*
+     * Our cgroup v2 directory under /sys/fs/cgroup, empty if we are not on
+     * cgroup v2 (we then use the system wide values).
+     */
+    std::string cgroup_dir;
+
+    // PSI file to use, empty if the kernel doesn't have PSI.
+    std::string psi_file;
+
+    std::atomic<time_t> last_update_sec = 0;
+
+    std::atomic<uint64_t> limit_bytes = UINT64_MAX;
+    std::atomic<uint64_t> free_bytes = 0;
+    std::atomic<double> psi_some_avg10 = -1;
+};
+
+}
+
+#endif /* __AZNFSC_MEM_PRESSURE_H__ */
@@ -0,0 +1,358 @@
+#ifndef __AZNFSC_MEMBUF_POOL_H__
+#define __AZNFSC_MEMBUF_POOL_H__
+
+#include <mutex>
+#include <vector>
+#include <atomic>
+
+#include <cstdint>
+#include <cassert>
+#include <sys/types.h>
+
+#include "aznfsc.h"
+
+namespace aznfsc {
+
+/**
+ * Pool allocator for membuf data buffers.
+ *
+ * Every non file-backed membuf needs a buffer of initial_length bytes, which
+ * can be anywhere from a few bytes to AZNFSC_MAX_CHUNK_SIZE. Allocating these
+ * from the general purpose allocator for every chunk means constant churn of
+ * multi-MB allocations which the allocator usually returns to the OS right
+ * away, only to fault the same pages back in on first touch for the next
+ * chunk. membuf_pool instead hands out page aligned buffers from a fixed set
+ * of size classes and caches freed buffers for reuse.
+ *
+ * Size classes:
+ * Sizes are first rounded up to PAGE_SIZE. Upto 8 pages we have one class per
+ * page count, beyond that every power of 2 is split into 4 classes, f.e.,
+ * 36K, 40K, 48K, 56K, 64K, 80K, ... 3M, 3.5M, 4M. This caps internal
+ * fragmentation (bytes wasted due to rounding up) to 25%, typically much
+ * less as most chunks are rsize/wsize sized which are powers of 2.
+ * Sizes larger than AZNFSC_MAX_CHUNK_SIZE are not pooled, they are directly
+ * mmap()ed and munmap()ed.
+ *
+ * Slabs:
+ * Pooled buffers are not mmap()ed individually, as with a large cache the
+ * number of mappings would exceed vm.max_map_count (65530 by default) and
+ * allocations would start failing. Instead they are carved out of SLAB_SIZE
+ * anonymous mappings by bumping the current slab's cursor. Releasing a
+ * buffer to the OS frees its memory with MADV_DONTNEED and saves the range
+ * in the per size class slab_holes list for reuse, slabs are never
+ * unmapped. This keeps the number of mappings at about one per SLAB_SIZE of
+ * peak pooled memory.
+ *
+ * Caching:
+ * Freed buffers are first cached in a small per-thread cache (tcache) which
+ * can be accessed w/o any lock. When the tcache for a size class is full,
+ * buffers go to the global per size class depot, protected by pool_lock_45.
+ * The total bytes held in the depot is capped at max_idle_bytes(), beyond
+ * that buffers are released back to the OS. Allocations are served from the
+ * tcache first, then the depot and only then we carve a fresh buffer.
+ * nfs_client::periodic_updater() calls trim() to release all depot buffers
+ * when the cache is under memory pressure.
+ *
+ * Hugepages:
+ * If cache.data.user.hugepages is true, buffers of size 2MiB or more are
+ * backed by hugepages. Sizes which are a multiple of the hugepage size are
+ * carved out of MAP_HUGETLB slabs (needs hugepages reserved through
+ * nr_hugepages), if that fails or for other sizes, they come from slabs
+ * that are madvise(MADV_HUGEPAGE)d so that THP can back them. Smaller
+ * buffers use separate slabs w/o MADV_HUGEPAGE.
+ *
+ * Accounting:
+ * The pool doesn't touch bytes_chunk_cache::bytes_allocated_g, membuf still
+ * accounts allocated_length there as before. Idle buffers cached by the pool
+ * are real process memory though, so nfs_client::periodic_updater() adds
+ * get_bytes_idle() to the cache usage when computing the scale factors.
+ *
+ * Splice region:
+ * If fuse_splice_read_reply is enabled, init_splice_region() creates a
+ * memfd and maps a large (virtual) region of it. Pooled buffers are then
+ * carved out of this region instead of anonymous memory, so that every
+ * buffer is also addressable as (memfd, offset). This allows read replies
+ * to be sent to fuse as fd buffers, which libfuse splice()s from the memfd
+ * to /dev/fuse w/o copying the data through userspace.
+ * Fresh buffers are carved by bumping splice_region_next, released buffers
+ * have their memory returned with MADV_REMOVE and their offset saved in the
+ * per size class holes list for reuse. If the region runs out we fall back
+ * to anonymous mappings, such buffers are simply not spliceable.
+ *
+ * Note: Buffers are never zeroed, just like the new[] allocation it replaces.
+ */
+class membuf_pool
+{
+public:
+    /*
+     * Number of size classes, see get_class_idx().
+     * 8 single page classes and 4 classes for every power of 2 from 8 pages
+     * to AZNFSC_MAX_CHUNK_SIZE.
+     */
+    static const int NUM_CLASSES = 36;
+
+    /*
+     * Max number of buffers and bytes cached in a thread's cache, per size
+     * class and across all size classes respectively.
+     */
+    static const int TCACHE_MAX_PER_CLASS = 8;
+    static const uint64_t TCACHE_MAX_BYTES = (16 * 1024 * 1024ULL);
+
+    /**
+     * Allocate a page aligned buffer of at least length bytes.
+     * Returns nullptr if memory could not be allocated.
+     */
+    static uint8_t *alloc(uint64_t length);
+
+    /**
+     * Free a buffer allocated by alloc(). length must be the same as passed
+     * to alloc().
+     */
+    static void free(uint8_t *buf, uint64_t length);
+
+    /**
+     * Release all buffers cached in the global depot back to the OS.
+     * Per-thread caches are small and are left alone.
+     * Returns the number of bytes released.
+     */
+    static uint64_t trim();
+
+    /**
+     * Bytes held idle by the pool, both in the depot and in all thread
+     * caches.
+     */
+    static uint64_t get_bytes_idle()
+    {
+        return bytes_idle_depot_g + bytes_idle_tcache_g;
+    }
+
+    /**
+     * Size class index for the given allocation size, -1 if size is larger
+     * than the largest size class.
+     */
+    static int get_class_idx(uint64_t length);
+
+    /**
+     * Size in bytes of the given size class.
+     */
+    static uint64_t get_class_size(int idx);
+
+    /**
+     * Max bytes that can be held idle in the depot.
+     * This is derived from the user data cache size.
+     */
+    static uint64_t max_idle_bytes();
+
+    /**
+     * Resident set size of the process, in bytes, 0 if it cannot be found.
+     * Used for reporting fragmentation stats.
+     */
+    static uint64_t get_rss_bytes();
+
+    /**
+     * Create the memfd backed splice region of the given size.
+     * Must be called once, before any IO, and only if splicing is to be
+     * used. Returns false if the region could not be created, in which case
+     * buffers are allocated from anonymous memory as usual.
+     */
+    static bool init_splice_region(uint64_t size);
+
+    /**
+     * (Re)apply the cpu_affinity memory policy to the splice region.
+     * Called when the NIC's NUMA node becomes known after the region was
+     * created. Only affects pages not yet touched.
+     */
+    static void bind_splice_region();
+
+    static bool is_splice_enabled()
+    {
+        return splice_region_base != nullptr;
+    }
+
+    /**
+     * If [buf, buf+length) lies in the splice region, return the memfd and
+     * set *offset to the memfd offset corresponding to buf, else return -1.
+     */
+    static int get_splice_fd(const uint8_t *buf, uint64_t length,
+                             off_t *offset)
+    {
+        assert(offset != nullptr);
+
+        if (!splice_region_base ||
+            (buf < splice_region_base) ||
+            ((buf + length) > (splice_region_base + splice_region_size))) {
+            return -1;
+        }
+
+        *offset = (off_t) (buf - splice_region_base);
+        return splice_memfd;
+    }
+
+    static int unit_test();
+
+    /**
+     * Compare throughput and CPU usage of sending 1MiB read replies through
+     * a pipe by copying (what fuse_reply_iov() does) vs splicing them from
+     * a memfd (what fuse_reply_data() does with splice region buffers).
+     * Enable with DEBUG_SPLICE_BENCHMARK.
+     */
+    static int splice_benchmark();
+
+    /*
+     * Allocator stats.
+     *
+     * num_tcache_hit_g:   allocations served from the thread cache.
+     * num_depot_hit_g:    allocations served from the global depot.
+     * num_miss_g:         allocations which had to map a new buffer.
+     * num_unpooled_g:     allocations larger than the largest size class.
+     * num_free_g:         total calls to free().
+     * num_unmap_g:        buffers released to the OS, either on free() or
+     *                     trim().
+     * num_hugetlb_g:      buffers carved out of MAP_HUGETLB slabs.
+     * num_hugetlb_fail_g: MAP_HUGETLB slab mmap() attempts that failed.
+     * num_slabs_g:        slabs mapped so far, see SLAB_SIZE.
+     * bytes_requested_g:  bytes requested by currently allocated buffers.
+     * bytes_inuse_g:      size class bytes of currently allocated buffers.
+     * bytes_mapped_g:     total bytes mapped by the pool, inuse + idle.
+     * bytes_idle_depot_g: bytes cached in the global depot.
+     * bytes_idle_tcache_g: bytes cached in all thread caches.
+     * num_splice_fallback_g: buffers allocated from anonymous memory since
+     *                     the splice region was full.
+     */
+    static std::atomic<uint64_t> num_tcache_hit_g;
+    static std::atomic<uint64_t> num_depot_hit_g;
+    static std::atomic<uint64_t> num_miss_g;
+    static std::atomic<uint64_t> num_unpooled_g;
+    static std::atomic<uint64_t> num_free_g;
+    static std::atomic<uint64_t> num_unmap_g;
+    static std::atomic<uint64_t> num_hugetlb_g;
+    static std::atomic<uint64_t> num_hugetlb_fail_g;
+    static std::atomic<uint64_t> bytes_requested_g;
+    static std::atomic<uint64_t> bytes_inuse_g;
+    static std::atomic<uint64_t> bytes_mapped_g;
+    static std::atomic<uint64_t> bytes_idle_depot_g;
+    static std::atomic<uint64_t> bytes_idle_tcache_g;
+    static std::atomic<uint64_t> num_splice_fallback_g;
+    static std::atomic<uint64_t> num_slabs_g;
+
+private:
+    /*
+     * Size of one slab mapping, pooled buffers are carved out of these.
+     * Must be a multiple of the hugepage size and of the largest size class.
+     */
+    static constexpr uint64_t SLAB_SIZE = (64 * 1024 * 1024ULL);
+
+    /*
+     * Slabs are kept separate for buffers backed by MAP_HUGETLB, by THP and
+     * by normal pages.
+     */
+    enum slab_type
+    {
+        SLAB_NORMAL = 0,
+        SLAB_THP,
+        SLAB_HUGETLB,
+        NUM_SLAB_TYPES
+    };
+
+    /*
+     * Unused part [next, end) of the current slab of a slab type.
+     */
+    struct slab_cursor
+    {
+        uint8_t *next = nullptr;
+        uint8_t *end = nullptr;
+    };
+
+    /*
+     * Splice region, see init_splice_region().
+     */
+    static uint8_t *splice_region_base;
+    static uint64_t splice_region_size;
+    static int splice_memfd;
+    static std::atomic<uint64_t> splice_region_next;
+
+    /*
+     * Global depot of free buffers, one list per size class.
+     * All lists are protected by pool_lock_45. This is a leaf lock, it can
+     * be acquired with any other lock held (membufs are freed with
+     * chunkmap_lock_43 held).
+     */
+    struct depot
+    {
+        std::mutex pool_lock_45;
+        std::vector<uint8_t *> bins[NUM_CLASSES];
+
+        // Released splice region offsets, per size class.
+        std::vector<uint64_t> holes[NUM_CLASSES];
+
+        // Current slab of every slab type, fresh buffers are carved here.
+        slab_cursor slabs[NUM_SLAB_TYPES];
+
+        // Released slab ranges, per size class.
+        std::vector<uint8_t *> slab_holes[NUM_CLASSES];
+    };
+
+    /*
+     * Per-thread cache of free buffers.
+     * On thread exit all cached buffers are moved to the depot.
+     */
+    struct tcache
+    {
+        std::vector<uint8_t *> bins[NUM_CLASSES];
+        uint64_t bytes = 0;
+
+        ~tcache();
+    };
+
+    /*
+     * The depot is intentionally never destroyed, as thread caches may be
+     * flushed to it from thread_local destructors which can run after
+     * static destructors.
+     */
+    static depot& get_depot()
+    {
+        static depot *d = new depot();
+        return *d;
+    }
+
+    static tcache& get_tcache()
+    {
+        static thread_local tcache tc;
+        return tc;
+    }
+
+    /*
+     * Carve a buffer of the given class size out of the splice region,
+     * nullptr if region is not enabled or is full.
+     */
+    static uint8_t *splice_map_buffer(int idx);
+
+    /*
+     * mmap() a new slab of the given type, nullptr on failure.
+     * Called with pool_lock_45 held.
+     */
+    static uint8_t *map_slab(slab_type type);
+
+    /*
+     * Carve a buffer of the given class size out of a slab, reusing a
+     * released range if any. nullptr if a new slab could not be mapped.
+     */
+    static uint8_t *slab_map_buffer(int idx);
+
+    /*
+     * Map/release a buffer of the given (class) size.
+     * Pooled sizes come from the splice region or a slab and are released
+     * back to it, only unpooled sizes are mmap()ed/munmap()ed directly.
+     */
+    static uint8_t *map_buffer(uint64_t size);
+    static void unmap_buffer(uint8_t *buf, uint64_t size);
+
+    /*
+     * Return a buffer to the depot, or the OS if depot is full.
+     */
+    static void depot_free(uint8_t *buf, int idx);
+};
+
+}
+
+#endif /* __AZNFSC_MEMBUF_POOL_H__ */
@@ -0,0 +1,80 @@
+#ifndef __AZNFSC_METRICS_SERVER_H__
+#define __AZNFSC_METRICS_SERVER_H__
+
+#include <thread>
+#include <string>
+#include <atomic>
+
+#include "aznfsc.h"
+
+namespace aznfsc {
+
+/*
+ * Max bytes of the HTTP request we read, we only care about the request
+ * line.
+ */
+#define METRICS_MAX_REQUEST_SIZE 4096
+
+/*
+ * Clients which don't send the request or don't read the response within
+ * these many msecs are dropped, so that a stuck client cannot block others.
+ */
+#define METRICS_IO_TIMEOUT_MSECS 2000
+
+/**
+ * Minimal HTTP server for scraping stats, so that stats can be collected
+ * across a fleet of mounts w/o having to send SIGUSR1 and parse the log.
+ *
+ * It listens on a localhost TCP port (sys.metrics.port) and/or a unix domain
+ * socket (sys.metrics.socket) and serves:
+ * - /metrics       Prometheus text exposition format.
+ * - /metrics.json  Same metrics as JSON.
+ * Metrics are generated by rpc_stats_az::get_metrics().
+ *
+ * All requests are served one at a time by a single thread and every
+ * connection is closed after the response. Generating metrics only reads
+ * atomic counters so scraping doesn't disturb the IO path.
+ */
+class metrics_server
+{
+public:
+    static metrics_server& get_instance()
+    {
+        static metrics_server ms;
+        return ms;
+    }
+
+    /**
+     * Start listening on the given port (0 to not listen on a port) and/or
+     * unix socket path (null to not listen on a unix socket), and start the
+     * server thread. Returns false if it cannot listen on any.
+     */
+    bool init(int port, const char *socket_path);
+
+    /**
+     * Stop the server thread and close the listening sockets.
+     */
+    void shutdown();
+
+private:
+    metrics_server() = default;
+
+    void server_loop();
+    void serve(int fd);
+
+    int tcp_fd = -1;
+    int unix_fd = -1;
+    std::string unix_path;
+
+    /*
+     * shutdown() writes to this eventfd to wake up server_loop().
+     */
+    int stop_fd = -1;
+
+    std::thread server_thread;
+    std::atomic<bool> running = false;
+};
+
+}
+
+#endif /* __AZNFSC_METRICS_SERVER_H__ */
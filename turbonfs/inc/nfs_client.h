@@ -2,6 +2,11 @@
 #define __NFS_CLIENT_H__
 
 #include <queue>
+#include <array>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <condition_variable>
 
 #include "nfs_inode.h"
 #include "rpc_transport.h"
@@ -15,7 +20,7 @@
  * order lock it's currently holding, i.e., a thread holding a lock *_lock_N
  * cannot hold any lock from *_lock_0 to *_lock_N-1 (it can only hold *_lock_N+1
  * and higher order locks).
- * - nfs_client::inode_map_lock_0
+ * - inode_map_shard::inode_map_lock_0
  * - nfs_inode::ilock_1
  * - nfs_inode::readdircache_lock_2
  * - nfs_inode::iflush_lock_3
@@ -24,9 +29,23 @@
  * - ra_state::ra_lock_40
  * - rpc_task_helper::task_index_lock_41
  * - rpc_stats_az::stats_lock_42
- * - bytes_chunk_cache::chunkmap_lock_43
+ * - bytes_chunk_cache::chunkmap_shard::chunkmap_lock_43
  * - membuf::mb_lock_44
  * - membuf::flush_waiters_lock_44
+ * - membuf_pool::depot::pool_lock_45
+ * - disk_cache_entry::dce_lock_46
+ * - disk_cache::dcache_lock_47
+ * - fcsm::flush_seq_lock_48
+ * - nfs_client::reclaim_lock_49
+ * - nfs_inode::revalidate_lock_50
+ * - nfs_client::revalidate_queue_lock_51
+ * - nfs_client::singleflight_lock_52
+ * - cpu_affinity::affinity_lock_53
+ * - nfs_client::evictor_lock_54
+ * - ra_state::pin_lock_55
+ * - ra_state::prefetch_lock_56
+ * - ra_state::prefetch_waitq_lock_57
+ * - rpc_stats_az::trace_lock_58
  */
 
 extern "C" {
@@ -53,10 +72,94 @@ extern "C" {
 #define NFS_CLIENT_MAGIC *((const uint32_t *)"NFSC")
 
 /**
- * RPC requests that fail with JUKEBOX error are retried after these many secs.
- * We try after 5 seconds similar to Linux NFS client.
+ * RPC requests that fail with JUKEBOX error are retried with exponential
+ * backoff. First retry is after JUKEBOX_MIN_DELAY_MSECS and the delay doubles
+ * for every subsequent JUKEBOX error for the same request, capped at
+ * JUKEBOX_MAX_DELAY_MSECS. The actual delay is jittered in [delay/2, delay)
+ * so that requests throttled together don't all retry together.
+ * Note that Linux NFS client retries after a fixed 5 secs, Blob NFS throttling
+ * is usually short lived and a long fixed delay adds a lot of latency.
  */
-#define JUKEBOX_DELAY_SECS 5
+#define JUKEBOX_MIN_DELAY_MSECS 200
+#define JUKEBOX_MAX_DELAY_MSECS 15000
+
+/**
+ * Inodes with expired attribute cache are revalidated by the revalidator
+ * thread in batches, ref nfs_client::revalidator(). Once woken up it waits
+ * for these many msecs for more inodes to be queued, so that siblings
+ * expiring together (f.e., stat() of all files of a directory after actimeo
+ * expiry) land in the same batch.
+ */
+#define REVALIDATE_BATCH_WINDOW_MSECS 2
+
+/**
+ * If at least these many inodes of a batch have the same parent directory
+ * they are revalidated by READDIRPLUS of the parent instead of one GETATTR
+ * per inode, as READDIRPLUS returns attributes of a directory's worth of
+ * children in one RPC. We read at most REVALIDATE_READDIRPLUS_MAX_BATCHES
+ * READDIRPLUS batches of the parent and inodes not refreshed by those are
+ * revalidated by GETATTR, this bounds the cost of revalidating a few inodes
+ * of a huge directory.
+ */
+#define REVALIDATE_READDIRPLUS_MIN_SIBLINGS 8
+#define REVALIDATE_READDIRPLUS_MAX_BATCHES 4
+
+/**
+ * Max file cache chunks or directory entries freed by the reclaimer thread
+ * in one go for a cache purged by a deferred invalidation, before moving on
+ * to the next queued cache, ref nfs_client::purge_retired().
+ */
+#define RECLAIM_PURGE_BATCH 1024
+
+/**
+ * The evictor thread checks the cache usage every these many msecs, even if
+ * not woken up by periodic_updater(), ref nfs_client::evictor().
+ */
+#define EVICTOR_INTERVAL_MSECS 1000
+
+/**
+ * Max jukebox retries reissued every second on a connection. Retries due
+ * when a connection's budget is exhausted are deferred and spread over the
+ * coming seconds, so that throttled traffic drains smoothly instead of
+ * hitting the server again in one burst.
+ */
+#define JUKEBOX_CONN_RETRIES_PER_SEC 500
+
+/**
+ * Number of shards in nfs_client::inode_map, must be a power of 2.
+ */
+#define INODE_MAP_SHARDS 64
+
+/**
+ * One shard of nfs_client::inode_map.
+ * Every shard has its own inode_map_lock_0 and since a thread never holds
+ * more than one shard's lock at a time they all share the same lock order.
+ * Aligned to a cacheline so that locks of different shards are not falsely
+ * shared.
+ */
+struct alignas(64) inode_map_shard
+{
+    mutable std::shared_mutex inode_map_lock_0;
+    std::unordered_multimap<uint64_t /* fileid */, struct nfs_inode*> inodes;
+};
+
+/**
+ * Comparator for nfs_client::jukebox_seeds, orders seeds such that the one
+ * due earliest is at the top. Defined in rpc_task.h along with
+ * jukebox_seedinfo.
+ */
+struct jukebox_seedinfo;
+
+/*
+ * Tracks revalidation RPCs in flight, defined in nfs_client.cpp.
+ */
+struct revalidate_inflight;
+
+struct jukebox_seedinfo_later
+{
+    bool operator()(const struct jukebox_seedinfo *a,
+                    const struct jukebox_seedinfo *b) const;
+};
 
 struct nfs_client
 {
@@ -92,9 +195,28 @@ private:
      *    directory_entry also refers to the inode and hence we need to
      *    make sure that the inode is not freed till any directory_entry
      *    is referring to it.
+     *
+     * The map is sharded on fileid, see get_inode_map_shard(). Every inode
+     * creation (LOOKUP, READDIRPLUS, CREATE, ...) and deletion (FORGET) needs
+     * to update the map under exclusive lock, with a single lock for all
+     * inodes this lock becomes the bottleneck for metadata heavy workloads,
+     * f.e., enumerating huge directories. Operations on one inode only ever
+     * need to lock the shard the inode belongs to.
+     * inode_map_size is the total number of inodes across all shards.
      */
-    std::multimap<uint64_t /* fileid */, struct nfs_inode*> inode_map;
-    mutable std::shared_mutex inode_map_lock_0;
+    std::array<struct inode_map_shard, INODE_MAP_SHARDS> inode_map;
+    std::atomic<uint64_t> inode_map_size = 0;
+
+    struct inode_map_shard& get_inode_map_shard(uint64_t fileid)
+    {
+        /*
+         * fileids are usually allocated sequentially by the server, mix the
+         * bits to spread consecutive fileids evenly across shards.
+         */
+        static_assert((INODE_MAP_SHARDS & (INODE_MAP_SHARDS - 1)) == 0);
+        const uint64_t h = (fileid * 0x9E3779B97F4A7C15ULL) >> 32;
+        return inode_map[h & (INODE_MAP_SHARDS - 1)];
+    }
 
     /*
      * Every RPC request is represented by an rpc_task which is created when
@@ -107,16 +229,125 @@ private:
     /*
      * JUKEBOX errors are handled by re-running the nfs_client handler for the
      * given request, f.e., for a READDIRPLUS request failing with JUKEBOX error
-     * we will call nfs_client::readdirplus() again after JUKEBOX_DELAY_SECS
-     * seconds. For this we need to save enough information needed to run the
-     * nfs_client handler. jukebox_seedinfo stores that information and we
-     * queue that in jukebox_seeds.
+     * we will call nfs_client::readdirplus() again after the backoff delay,
+     * see JUKEBOX_MIN_DELAY_MSECS. For this we need to save enough information
+     * needed to run the nfs_client handler. jukebox_seedinfo stores that
+     * information and we queue that in jukebox_seeds, which is a min-heap
+     * ordered on the time the seed is due. jukebox_runner() sleeps on
+     * jukebox_cv till the earliest seed is due, jukebox_retry() wakes it up
+     * if the newly queued seed is due before that.
      */
     std::thread jukebox_thread;
     void jukebox_runner();
-    std::queue<struct jukebox_seedinfo*> jukebox_seeds;
+    std::priority_queue<struct jukebox_seedinfo*,
+                        std::vector<struct jukebox_seedinfo*>,
+                        struct jukebox_seedinfo_later> jukebox_seeds;
+    std::condition_variable jukebox_cv;
     mutable std::mutex jukebox_seeds_lock_39;
 
+    /*
+     * Inodes whose lookupcnt is dropped to 0 by fuse FORGET are not freed
+     * inline by the FORGET handler, instead they are queued to reclaim_queue
+     * and the reclaimer thread frees them in batches, ref put_nfs_inodes().
+     * Freeing an inode may need an exclusive inode_map_lock_0 and purging
+     * of its file/directory cache, which can take a while for big caches.
+     * After a large find or rm -rf the kernel sends FORGETs in huge bursts,
+     * doing this inline would keep the fuse threads from serving other
+     * requests.
+     * Every queued inode carries the count of lookupcnt refs that must be
+     * dropped when it's reclaimed, these refs keep the inode alive till then.
+     * reclaimer_running is cleared in shutdown(), after which inodes are
+     * reclaimed inline by queue_reclaim().
+     */
+    std::thread reclaimer_thread;
+    void reclaimer();
+    std::vector<std::pair<struct nfs_inode*, size_t>> reclaim_queue;
+
+    /*
+     * The reclaimer also frees the file/directory caches logically purged
+     * by a deferred invalidation, ref bytes_chunk_cache::retire_nolock() and
+     * readdirectory_cache::retire(). Those inodes are queued to purge_queue,
+     * holding a lookupcnt ref, and their retired chunks/entries are freed
+     * RECLAIM_PURGE_BATCH at a time, round robin over the queued caches,
+     * so that a huge cache doesn't hold up the forgets or other caches.
+     * Also protected by reclaim_lock_49.
+     */
+    void purge_retired(std::vector<struct nfs_inode*>& batch);
+    std::vector<struct nfs_inode*> purge_queue;
+    std::condition_variable reclaim_cv;
+    bool reclaimer_running = false;
+    mutable std::mutex reclaim_lock_49;
+
+    /*
+     * Inodes whose attribute cache has expired are queued to
+     * revalidate_queue by queue_revalidate() and the revalidator thread
+     * refreshes their attributes in batches, ref revalidate_batch().
+     * This keeps a stat() storm over a big tree from turning into a flood of
+     * serial sync GETATTRs, one per fuse thread.
+     * revalidate_batch() only issues the RPCs and doesn't wait for them,
+     * every queued inode completes from the callback of the RPC that
+     * refreshes its attributes, so waiters don't wait for other inodes.
+     * Every queued inode carries a lookupcnt ref which is dropped once it's
+     * revalidated. An inode is queued only once till its revalidation
+     * completes, ref nfs_inode::revalidate_queued.
+     * revalidator_running is cleared in shutdown(), after which
+     * queue_revalidate() fails and callers must revalidate inline.
+     */
+    std::thread revalidator_thread;
+    void revalidator();
+    void revalidate_batch(
+            std::vector<struct nfs_inode*>& batch,
+            const std::shared_ptr<struct revalidate_inflight>& inflight);
+    std::vector<struct nfs_inode*> revalidate_queue;
+    std::condition_variable revalidate_queue_cv;
+    bool revalidator_running = false;
+    mutable std::mutex revalidate_queue_lock_51;
+
+    /*
+     * Background evictor for the user data cache.
+     * Once the total cache usage crosses the periodic prune threshold
+     * (ref bytes_chunk_cache::get_global_prune_goal()) the evictor thread
+     * goes over the file caches of all inodes and evicts clean membufs,
+     * keeping the IO threads out of inline_prune().
+     * It's a global CLOCK with two classes of membufs (2Q style): cold
+     * membufs, only read once since they were filled (f.e., by a big
+     * sequential scan), are evicted first from all files, and only if that
+     * doesn't meet the goal, hot (re-read) membufs are aged, one sweep at a
+     * time, till they become cold. See membuf::on_app_read().
+     * evict_requested is set by wake_evictor() to avoid a notify per
+     * periodic_updater() call, a wakeup lost due to the unlocked set is
+     * covered by the EVICTOR_INTERVAL_MSECS timed wait.
+     */
+    std::thread evictor_thread;
+    void evictor();
+    void evict_from_all_caches();
+    void wake_evictor();
+    std::condition_variable evictor_cv;
+    std::atomic<bool> evict_requested = false;
+    bool evictor_running = false;
+    mutable std::mutex evictor_lock_54;
+
+    /*
+     * Single-flight table for GETATTR and LOOKUP RPCs.
+     * When many fuse threads ask for the same metadata at once (f.e., the
+     * same hot file or the same directory entry) only the first one
+     * (the leader) sends the RPC and the others attach to it as waiters,
+     * all of them are answered from the leader's reply.
+     * Key is built by rpc_task from (opcode, filehandle, name), ref
+     * singleflight_key(). An entry exists as long as the leader's RPC is
+     * in flight and holds the waiter tasks.
+     */
+    std::unordered_map<std::string,
+                       std::vector<struct rpc_task*>> singleflight_map;
+    mutable std::mutex singleflight_lock_52;
+
+    /**
+     * Return the parent directory inode of 'inode' as per its
+     * parent_ino_hint, after holding a lookupcnt ref on it, or null if the
+     * parent is not known or not present in the inode_map anymore.
+     */
+    struct nfs_inode *get_parent_inode_from_hint(const struct nfs_inode *inode);
+
     /*
      * Holds info about the server, queried by FSINFO.
      */
@@ -253,9 +484,20 @@ public:
         return rpc_task_helper;
     }
 
-    std::shared_mutex& get_inode_map_lock()
+    /**
+     * Lock protecting the inode_map shard for the given fileid.
+     */
+    std::shared_mutex& get_inode_map_lock(uint64_t fileid)
     {
-        return inode_map_lock_0;
+        return get_inode_map_shard(fileid).inode_map_lock_0;
+    }
+
+    /**
+     * Total number of inodes in inode_map.
+     */
+    uint64_t get_num_inodes() const
+    {
+        return inode_map_size;
     }
 
     /**
@@ -304,9 +546,11 @@ public:
      *          mode is used. This provides a unique hash for the file/dir
      *          that is the target for this request. All requests to the same
      *          file/dir are sent over the same connection.
+     * qos:     QoS class of the request, see rpc_transport::get_nfs_context().
      */
     struct nfs_context* get_nfs_context(conn_sched_t csched,
-                                        uint32_t fh_hash) const;
+                                        uint32_t fh_hash,
+                                        qos_class_t qos = QOS_CLASS_DATA) const;
 
     /*
      * Given an inode number, return the nfs_inode structure.
@@ -407,7 +651,8 @@ public:
      * then the inode is removed from the inode_map and freed.
      *
      * This nolock version does not hold inode_map_lock_0 so the caller
-     * must hold the lock before calling this. Usually you will call one of
+     * must hold the lock of the inode_map shard the inode belongs to, ref
+     * get_inode_map_lock(), before calling this. Usually you will call one of
      * the other variants which hold the lock.
      *
      * Note: Call put_nfs_inode()/put_nfs_inode_nolock() only when you are
@@ -426,10 +671,77 @@ public:
          * We need to hold inode_map_lock_0 while we check the inode for
          * eligibility to remove (and finally remove) from the inode_map.
          */
-        std::unique_lock<std::shared_mutex> lock(inode_map_lock_0);
+        std::unique_lock<std::shared_mutex> lock(
+                get_inode_map_lock(inode->get_fileid()));
         put_nfs_inode_nolock(inode, dropcnt);
     }
 
+    /**
+     * Batch version of put_nfs_inode(), drops the given count of lookupcnt
+     * refs from each inode in the batch. For inodes which are not referenced
+     * by anyone else the file/directory caches are purged first (w/o holding
+     * any inode_map lock), and then the batch is released shard by shard,
+     * taking each inode_map shard's lock once for all the batch inodes that
+     * belong to it.
+     * batch is consumed and is empty on return.
+     */
+    void put_nfs_inodes(std::vector<std::pair<struct nfs_inode*, size_t>>& batch);
+
+    /**
+     * Queue inode(s) forgotten by fuse to be released by the reclaimer
+     * thread, see reclaim_queue. Once this is called the caller must not
+     * access the inode(s) as they can be freed anytime.
+     * If the reclaimer is not running (not yet started or we are shutting
+     * down) the inode(s) are released inline.
+     */
+    void queue_reclaim(struct nfs_inode *inode, size_t cnt);
+    void queue_reclaim(std::vector<std::pair<struct nfs_inode*, size_t>>& batch);
+
+    /**
+     * Queue inode whose file/directory cache has chunks/entries retired by a
+     * deferred invalidation, to be freed by the reclaimer thread, see
+     * purge_queue. Caller must make sure an inode is queued only once till
+     * its cache tells the reclaimer it has nothing more retired.
+     * Returns false if the reclaimer is not running (we are shutting down),
+     * caller must then free the retired chunks/entries itself or leave them
+     * to be freed along with the cache.
+     */
+    bool queue_purge(struct nfs_inode *inode);
+
+    /**
+     * Queue inode for async revalidation by the revalidator thread, ref
+     * revalidate_queue. If the inode is already queued this is coalesced
+     * with the queued revalidation. Caller can wait for the revalidation to
+     * complete on nfs_inode::revalidate_cv.
+     * Returns false if the revalidator is not running, in which case caller
+     * must revalidate the inode inline.
+     */
+    bool queue_revalidate(struct nfs_inode *inode);
+
+    /**
+     * Attach task to an in-flight RPC with the same single-flight key, ref
+     * singleflight_map. Returns true if the task was attached as a waiter,
+     * in which case it'll be completed along with the in-flight RPC's task
+     * and caller must not access it anymore. Returns false if there's no
+     * such RPC in flight, caller is now the leader and must issue the RPC
+     * and later call singleflight_done() from its callback.
+     */
+    bool singleflight_join(struct rpc_task *task, const std::string& key);
+
+    /**
+     * Called by the leader's callback, removes the single-flight entry and
+     * returns the waiter tasks which the caller must complete.
+     */
+    std::vector<struct rpc_task*> singleflight_done(const std::string& key);
+
+    /**
+     * Update attributes of the inodes we have for the READDIRPLUS entries,
+     * used by the revalidator for batched revalidation of siblings.
+     * Unlike readdirplus_callback() this doesn't add the entries to the
+     * directory cache or create inodes for entries we don't know about.
+     */
+    void revalidate_from_readdirplus(const struct entryplus3 *entries);
+
     /*
      *
      * Define Nfsv3 API specific functions and helpers after this point.
@@ -637,11 +949,20 @@ public:
         const struct fattr3* attr,
         const struct fuse_file_info* file);
 
+    /**
+     * Number of JUKEBOX retries the request being reissued by
+     * jukebox_runner() has seen so far, 0 for all other threads.
+     * alloc_rpc_task() carries it over to the new rpc_task's
+     * api_task_info::num_jukebox_retries, which is how the backoff delay
+     * keeps growing across retries of the same request.
+     */
+    static thread_local uint32_t jukebox_reissue_retries;
+
     /**
      * Call this to handle NFS3ERR_JUKEBOX error received for rpc_task.
      * This will save information needed to re-issue the call and queue
      * it in jukebox_seeds from where jukebox_runner will issue the call
-     * after JUKEBOX_DELAY_SECS seconds.
+     * after the backoff delay for the request.
      */
     void jukebox_retry(struct rpc_task *task);
 };
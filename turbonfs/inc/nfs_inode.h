@@ -8,6 +8,7 @@
 #include "file_cache.h"
 #include "readahead.h"
 #include "fcsm.h"
+#include "disk_cache.h"
 
 #define NFS_INODE_MAGIC *((const uint32_t *)"NFSI")
 
@@ -200,6 +201,34 @@ struct nfs_inode
     fuse_ino_t parent_ino = 0;
     int silly_rename_level = 0;
 
+    /*
+     * Directory through which we last conveyed this inode to fuse (LOOKUP,
+     * CREATE, READDIRPLUS, etc). The revalidator uses this to find expired
+     * siblings that can be revalidated by a single READDIRPLUS of their
+     * parent, ref nfs_client::revalidate_batch(). Since a file can have more
+     * than one hard link this is just a hint. The parent fileid is saved
+     * along with its fuse ino so that the parent can be safely looked up in
+     * the inode_map, as the parent inode may have been freed by the time we
+     * use the hint, ref nfs_client::get_parent_inode_from_hint().
+     */
+    std::atomic<fuse_ino_t> parent_ino_hint = 0;
+    std::atomic<uint64_t> parent_fileid_hint = 0;
+
+    /*
+     * Async revalidation state.
+     * revalidate_queued is set when the inode is queued to the revalidator
+     * and cleared once that revalidation completes, revalidation requests
+     * for the inode received meanwhile are coalesced with the queued one.
+     * revalidate_gen is bumped every time a queued revalidation completes
+     * (successfully or not), revalidate() callers that need fresh attributes
+     * wait on revalidate_cv for it to change.
+     * revalidate_gen is protected by revalidate_lock_50.
+     */
+    std::atomic<bool> revalidate_queued = false;
+    uint64_t revalidate_gen = 0;
+    std::condition_variable revalidate_cv;
+    std::mutex revalidate_lock_50;
+
 private:
     /*
      * NFSv3 filehandle returned by the server.
@@ -235,6 +264,16 @@ private:
     std::shared_ptr<bytes_chunk_cache> filecache_handle;
     std::atomic<bool> filecache_alloced = false;
 
+    /*
+     * Disk cache entry for this file, if disk cache is enabled.
+     * Valid only for regular files.
+     * Set by alloc_filecache() before filecache_alloced is set and never
+     * changed after that, so it can be accessed w/o ilock_1 once
+     * has_filecache() returns true. Access to the disk_cache_entry itself
+     * is protected by its dce_lock_46.
+     */
+    std::shared_ptr<disk_cache_entry> dcache_entry;
+
     /*
      * Pointer to the readdirectory cache.
      * Only valid for a directory, this will be nullptr for a non-directory.
@@ -320,7 +359,9 @@ private:
      * write. Append writes can be sent as unstable write, while non-append
      * writes (either overwrite or sparse write) must go as a stable write
      * (since server knows best how to allocate blocks for them).
-     * Once set to true, it remains true for the life of the inode.
+     * Once set to true, it remains true for the life of the inode, except
+     * for the one-shot stable write of a small file, ref
+     * flush_cache_and_wait().
      * 
      * TODO: Set this to false once we have servers with unstable write
      *       support. Also uncomment the assert in nfs_inode constructor.
@@ -525,6 +566,15 @@ public:
         if (filecache_alloced) {
             // Once allocated it cannot become null again.
             assert(filecache_handle);
+
+            /*
+             * File is being opened again, data cached on disk must be
+             * revalidated against the latest attributes (cto).
+             */
+            if (dcache_entry) {
+                const struct stat st = get_attr();
+                dcache_entry->validate(st.st_size, st.st_mtim);
+            }
             return;
         }
 
@@ -532,18 +582,32 @@ public:
         if (!filecache_handle) {
             assert(!filecache_alloced);
 
-            if (aznfsc_cfg.filecache.enable && aznfsc_cfg.filecache.cachedir) {
-                const std::string backing_file_name =
-                    std::string(aznfsc_cfg.filecache.cachedir) + "/" + std::to_string(get_fuse_ino());
-                filecache_handle =
-                    std::make_shared<bytes_chunk_cache>(this, backing_file_name.c_str());
-            } else {
-                filecache_handle = std::make_shared<bytes_chunk_cache>(this);
-            }
+            /*
+             * filecache.* config enables the disk cache, which is a second
+             * tier behind the in-memory filecache_handle, see disk_cache.
+             */
+            dcache_entry = disk_cache::get_instance().get_entry(
+                                get_fh(), attr.st_size, attr.st_mtim);
+
+            filecache_handle = std::make_shared<bytes_chunk_cache>(this);
             filecache_alloced = true;
+        } else if (dcache_entry) {
+            dcache_entry->validate(attr.st_size, attr.st_mtim);
         }
     }
 
+    /**
+     * Disk cache entry for this file, null if disk cache is not enabled.
+     * This MUST be called only when has_filecache() returns true.
+     */
+    const std::shared_ptr<disk_cache_entry>& get_dcache_entry() const
+    {
+        assert(is_regfile());
+        assert(filecache_alloced);
+
+        return dcache_entry;
+    }
+
     /**
      * We split the truncate operation in two separate apis truncate_start()
      * and truncate_end(). truncate_start() must be called before issuing the
@@ -1016,6 +1080,18 @@ public:
         return attr_expired;
     }
 
+    /**
+     * Checks whether inode->attr expired more than 'msecs' ago.
+     */
+    bool attr_cache_expired_for(int64_t msecs) const
+    {
+        assert(attr_timeout_timestamp != -1);
+        assert(msecs >= 0);
+
+        const int64_t now_msecs = get_current_msecs();
+        return (attr_timeout_timestamp + msecs) < now_msecs;
+    }
+
     void set_truncate_in_progress()
     {
         assert(!truncate_in_progress);
@@ -1163,6 +1239,37 @@ public:
      */
     bool in_ra_window(uint64_t offset, uint64_t length) const;
 
+    /**
+     * Check if [offset, offset+length) overlaps a range pinned by
+     * prefetch(). Like in_ra_window(), bytes_chunk_cache calls this to find
+     * out if a membuf can be purged.
+     *
+     * LOCKS: Shared ra_state::pin_lock_55.
+     */
+    bool is_pinned(uint64_t offset, uint64_t length) const;
+
+    /**
+     * Application hints, see ra_state::prefetch() and ra_state::dontneed().
+     * These can be called for a file which is not open, prefetch()
+     * allocates the filecache and rastate if needed.
+     * Both return 0 on success or an errno.
+     *
+     * LOCKS: If not already allocated, exclusive ilock_1 to allocate
+     *        filecache and rastate.
+     */
+    int prefetch(uint64_t offset, uint64_t length, bool pin);
+    int dontneed(uint64_t offset, uint64_t length);
+
+    /**
+     * Called on open() of a regular file with the open flags. If
+     * sys.small_file_mode is set and the file is not bigger than rsize,
+     * read the whole file into the cache right away, so that reads the
+     * application issues after open find the data, or the READ inflight.
+     *
+     * LOCKS: Same as prefetch().
+     */
+    void prefetch_small_file(int open_flags);
+
     /**
      * Is this file currently open()ed by any application.
      */
@@ -1373,8 +1480,16 @@ public:
      * like the kernel NFS client where flushing the cache causes the
      * directory cache to be flushed, and this can be a useful technique
      * in cases where NFS client is not being consistent with the server.
+     *
+     * When FORGET drops the lookupcnt to 0 the inode is not released inline,
+     * instead it's handed to the reclaimer, ref nfs_client::queue_reclaim().
+     * If 'reclaim_batch' is passed the inode is added to it and the caller
+     * must call nfs_client::queue_reclaim() for the batch, this is used by
+     * fuse forget_multi to queue the whole batch in one go.
      */
-    void decref(size_t cnt = 1, bool from_forget = false);
+    void decref(size_t cnt = 1, bool from_forget = false,
+                std::vector<std::pair<struct nfs_inode*, size_t>>
+                    *reclaim_batch = nullptr);
 
     /**
      * Returns true if inode is FORGOTten by fuse.
@@ -1602,6 +1717,13 @@ public:
     void flush_lock() const;
     void flush_unlock() const;
 
+    /**
+     * Non-blocking version of flush_lock().
+     * Returns true if the flush_lock was acquired, caller must then call
+     * flush_unlock() to release it.
+     */
+    bool try_flush_lock() const;
+
     /**
      * Revalidate the inode.
      * Revalidation is done by querying the inode attributes from the server
@@ -1614,10 +1736,45 @@ public:
      * when a file/dir is opened (for close-to-open consistency reasons).
      * Other reasons for force invalidating the caches could be if file/dir
      * was updated by calls to write()/create()/rename().
+     * If 'sync' is true the caller waits for the revalidation to complete
+     * even if stale_while_revalidate is set. Callers that act on the cached
+     * attributes/dnlc and need an authoritative answer must set it.
      *
      * LOCKS: If revalidating it'll take exclusive ilock_1.
      */
-    void revalidate(bool force = false);
+    void revalidate(bool force = false, bool sync = false);
+
+    /**
+     * Process attributes freshly fetched from the server for revalidating
+     * the inode. If they indicate that the file/dir has changed, cached data
+     * is invalidated, else the attribute cache timeout is exponentially
+     * increased (only if 'force' is false) and the attribute cache is marked
+     * valid for another attr_timeout_secs.
+     *
+     * LOCKS: Exclusive ilock_1.
+     */
+    void revalidate_with_attr(const struct fattr3& fattr, bool force);
+
+    /**
+     * Called by the revalidator once the queued revalidation of this inode
+     * completes, wakes up revalidate() callers waiting for it.
+     * Attributes may or may not have been refreshed, callers must check
+     * attr_cache_expired().
+     *
+     * LOCKS: revalidate_lock_50.
+     */
+    void on_revalidate_done();
+
+    /**
+     * Remember 'parent' as the directory through which this inode was
+     * last conveyed to fuse, ref parent_ino_hint.
+     */
+    void set_parent_hint(const struct nfs_inode *parent)
+    {
+        assert(parent->is_dir());
+        parent_fileid_hint = parent->get_fileid();
+        parent_ino_hint = parent->get_fuse_ino();
+    }
 
     /**
      * Update the inode given that we have received fresh attributes from
@@ -1728,6 +1885,15 @@ public:
                 AZLogDebug("[{}] Invalidating filecache", get_fuse_ino());
                 filecache_handle->invalidate();
 
+                /*
+                 * File data changed at the server, data cached on disk
+                 * belongs to the old version, drop it. attr has the new
+                 * size/mtime.
+                 */
+                if (dcache_entry) {
+                    dcache_entry->invalidate(attr.st_size, attr.st_mtim);
+                }
+
                 if (purge_now) {
                     /*
                      * Wait for ongoing readaheads to complete, else they would
@@ -1783,6 +1949,25 @@ public:
         putblock_filesize = AZNFSC_BAD_OFFSET;
     }
 
+    /**
+     * Clear the stable write flag, for going back to unstable writes after
+     * the one-shot small file stable write, ref flush_cache_and_wait().
+     * 'filesize' is the file size as seen by the server, from where the next
+     * unstable write must start.
+     * Caller must hold the flush_lock and there must not be any flush or
+     * commit in progress, nor any other open handle that may be writing.
+     */
+    void clear_stable_write(off_t filesize)
+    {
+        assert(is_flushing);
+        assert(stable_write);
+        assert(!is_commit_in_progress());
+        assert(filesize >= 0);
+
+        stable_write = false;
+        putblock_filesize = filesize;
+    }
+
     /**
      * Check if the inode has stable write flag set.
      */
@@ -1791,6 +1976,21 @@ public:
         return stable_write;
     }
 
+    /**
+     * Returns the file size as seen by the unstable writes issued till now,
+     * i.e., the offset where the next unstable write must start.
+     * Only valid for unstable writes.
+     * Caller must hold the flush_lock.
+     */
+    off_t get_putblock_filesize() const
+    {
+        assert(is_flushing);
+        assert(!is_stable_write());
+        assert(putblock_filesize != (off_t) AZNFSC_BAD_OFFSET);
+
+        return putblock_filesize;
+    }
+
     /**
      * Directory cache lookup method.
      *
@@ -6,8 +6,10 @@
 #endif
 
 #include <atomic>
+#include <memory>
+#include <mutex>
 #include <shared_mutex>
-#include <unordered_map>
+#include <unordered_set>
 #include <filesystem>
 
 #include <stdint.h>
@@ -15,6 +17,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sys/uio.h>
 
 struct nfs_client;
 
@@ -416,59 +420,170 @@ struct fuse_bufvec {
      */
     struct fuse_buf buf[1];
 };
+
+/* Initialize bufvec with a single buffer of given size */
+#define FUSE_BUFVEC_INIT(size__)                            \
+    ((struct fuse_bufvec) {                                 \
+        /* .count= */ 1,                                    \
+        /* .idx =  */ 0,                                    \
+        /* .off =  */ 0,                                    \
+        /* .buf =  */ { /* [0] = */ {                       \
+            /* .size =  */ (size__),                        \
+            /* .flags = */ (enum fuse_buf_flags) 0,         \
+            /* .mem =   */ NULL,                            \
+            /* .fd =    */ -1,                              \
+            /* .pos =   */ 0,                               \
+        } }                                                 \
+    } )
 #endif /* AZNFSC_FUSE_COMPAT */
 
+/*
+ * Size of the fd table, fds >= this are never ours. See fdinfo.
+ */
+#define NOFUSE_MAX_FDS          65536
+
+/*
+ * Max bytes we read/write in one aznfsc_ll_read()/aznfsc_ll_write_buf()
+ * call. This is the max IO size fuse sends, and the lower level code asserts
+ * for it, larger application IOs are split.
+ */
+#define NOFUSE_MAX_IO_SIZE      1048576
+
+/*
+ * Buffer size used for aznfsc_ll_readdir() calls made by readdir(), this is
+ * the max number of bytes worth of dirents we fetch from the dircache in one
+ * call.
+ */
+#define NOFUSE_READDIR_BUFSIZE  65536
+
+/*
+ * Number of shards of posix_task::write_mutex. See pwrite_ino().
+ */
+#define NOFUSE_WRITE_LOCK_SHARDS 64
+
 /**
- * Information tracked for each fd.
- * We need to track the corresponding fuse_ino_t that we can use for making
- * aznfsc_ll_*() calls. Another imp thing that we need to track is the current
- * position in the file.
- *
- * TODO: Need to support dup/dup2 to have multiple fds refer to the same file,
- *       and thus share the offset. This we should be able to do by
- *       intercepting the dup/dup2 functions.
+ * Open file description, shared by an fd and all the fds dup()ed from it.
+ * As required by POSIX, such fds share the file position and the file status
+ * flags, so those live here and not in fdinfo.
+ * It's refcounted through std::shared_ptr, every fdinfo referring to it
+ * holds a ref and so does every call using it, so a close() racing with a
+ * read/write on another thread doesn't free it under the latter.
  */
-struct fdinfo
+struct nofuse_file
 {
-    fdinfo(int _fd, fuse_ino_t _ino) :
-        fd(_fd),
-        ino(_ino)
+    nofuse_file(fuse_ino_t _ino, int _flags) :
+        ino(_ino),
+        flags(_flags)
     {
-        /*
-         * XXX With dup2() we will have to install whatever fd caller asks.
-         */
-#if 0
-        assert(fd > 2);
-#endif
         assert(ino != 0);
     }
 
-    // POSIX fd.
-    int fd = -1;
+    // Inode this file refers to.
+    const fuse_ino_t ino;
 
-    // Corresponding inode, for passing to aznfsc_ll_* APIs.
-    fuse_ino_t ino = 0;
+    // Flags passed to open(), we need the access mode and O_APPEND.
+    const int flags;
 
     // Current position within the file where next read/write will be done.
     std::atomic<off_t> pos = 0;
 
     /*
-     * Get next free fd for returning from open().
-     *
-     * TODO: Currently we always return a constantly increasing fd and we
-     *       don't reuse closed fds.
+     * Serializes read/write/lseek on this file, as they use and update pos.
+     * This is same as the kernel's per-file f_pos_lock and ensures that
+     * concurrent read/write calls on an fd (or its dups) don't use the same
+     * offset.
+     * pread/pwrite don't use pos and don't take this.
      */
-    static int get_next_fd()
+    std::mutex pos_mutex;
+
+    bool is_readable() const
     {
-        /*
-         * XXX Since we don't implement fopen(), there could be some fds
-         *     opened via fopen(). If those are not our target file, we don't
-         *     really care. Use big enough starting fd so as not to interfere
-         *     with those.
-         */
-        static std::atomic<int> gfd = 1000;
-        return gfd++;
+        return ((flags & O_ACCMODE) != O_WRONLY);
     }
+
+    bool is_writable() const
+    {
+        return ((flags & O_ACCMODE) != O_RDONLY);
+    }
+};
+
+/**
+ * Information tracked for each fd.
+ * We need to track the corresponding fuse_ino_t that we can use for making
+ * aznfsc_ll_*() calls, and the open file description (nofuse_file) which
+ * has the current position in the file.
+ *
+ * fdinfo objects live in a fixed size table indexed by fd, so that the "is
+ * this our fd" check done for every intercepted fd call (most of which are
+ * for sockets, pipes and other files not in the mountpoint) and the fd->ino
+ * lookup are just an array access, w/o any lock. A free slot has ino=0.
+ * Getting a ref on the nofuse_file takes the per-slot mutex, see
+ * posix_task::get_file().
+ *
+ * The fd numbers are reserved with the kernel by opening /dev/null (see
+ * posix_task::fd_alloc()) so that they never alias real fds opened by the
+ * application or by libraries whose calls we don't intercept (fopen() f.e.).
+ */
+struct fdinfo
+{
+    // Corresponding inode, for passing to aznfsc_ll_* APIs. 0 if free.
+    std::atomic<fuse_ino_t> ino = 0;
+
+    /*
+     * Open file description this fd refers to, protected by mutex.
+     * Null iff ino is 0.
+     */
+    std::shared_ptr<struct nofuse_file> file;
+    std::mutex mutex;
+};
+
+/**
+ * DIR stream returned by our opendir()/fdopendir().
+ * We keep the dirents returned by the last aznfsc_ll_readdir() call in buf
+ * and return them one by one from readdir().
+ *
+ * The stream position is the readdir cookie (d_off) of the last returned
+ * entry, which is what telldir() returns and seekdir() takes, as the cookie
+ * is all aznfsc_ll_readdir() needs to continue from there.
+ * Like glibc's DIR, the stream owns an fd for the directory, returned by
+ * dirfd() and closed by closedir().
+ */
+#define NOFUSE_DIR_MAGIC *((const uint32_t *)"NFDR")
+struct nofuse_dir
+{
+    const uint32_t magic = NOFUSE_DIR_MAGIC;
+
+    nofuse_dir(fuse_ino_t _ino, int _fd) :
+        ino(_ino),
+        fd(_fd)
+    {
+        assert(ino != 0);
+        assert(fd > 0);
+    }
+
+    // Directory inode.
+    const fuse_ino_t ino;
+
+    // Our fd for the directory, see posix_task::fd_alloc().
+    const int fd;
+
+    /*
+     * Serializes calls on the stream, as glibc does, so that readdir_r()
+     * and concurrent readdir() calls on different threads are safe.
+     */
+    std::mutex mutex;
+
+    // Offset (cookie) for the next aznfsc_ll_readdir() call.
+    off_t cookie = 0;
+
+    // Last aznfsc_ll_readdir() returned no entries.
+    bool eof = false;
+
+    // Bytes of dirents in buf, and bytes already returned by readdir().
+    size_t len = 0;
+    size_t consumed = 0;
+
+    alignas(struct dirent) char buf[NOFUSE_READDIR_BUFSIZE];
 };
 
 /**
@@ -545,16 +660,81 @@ typedef struct posix_task
      */
     int fd_to_ino(int fd, fuse_ino_t& _ino, off_t *offset = nullptr);
 
+    /**
+     * Return the fdinfo for fd, or nullptr if fd is not ours.
+     * This is lock free, see fdinfo.
+     */
+    static struct fdinfo *get_fdinfo(int fd)
+    {
+        if (fd < 0 || fd >= NOFUSE_MAX_FDS || fdtable[fd].ino == 0) {
+            return nullptr;
+        }
+
+        return &fdtable[fd];
+    }
+
+    /**
+     * Return a ref on the open file description fd refers to, or a null
+     * shared_ptr if fd is not ours.
+     */
+    static std::shared_ptr<struct nofuse_file> get_file(int fd)
+    {
+        struct fdinfo *fdi = get_fdinfo(fd);
+        if (!fdi) {
+            return nullptr;
+        }
+
+        std::unique_lock<std::mutex> lock(fdi->mutex);
+        return fdi->file;
+    }
+
+    /*
+     * Allocate a new fd referring to a new open file description for ino
+     * and add it to the fd table.
+     * Returns the fd on success and -errno on failure.
+     */
+    int fd_alloc(fuse_ino_t ino, int flags);
+
     /*
-     * Add new fd->ino mapping to fdmap.
+     * Add new fd->file mapping to the fd table, replacing any existing
+     * mapping for fd. Caller must have reserved fd with the kernel.
+     * dup()/dup2() pass the file of oldfd, so that both fds share it.
      */
-    void fd_add_to_map(int fd, fuse_ino_t ino);
+    void fd_add_to_map(int fd, const std::shared_ptr<struct nofuse_file>& file);
     void fd_remove_from_map(int fd);
 
     /*
-     * Add 'pos' to the current fd offset.
+     * Track DIR streams returned by our opendir().
      */
-    void fd_add_pos(int fd, off_t pos);
+    void dir_add(struct nofuse_dir *dir);
+    void dir_remove(struct nofuse_dir *dir);
+    bool dir_in_mountpoint(const void *dirp) const;
+
+    /**
+     * Read/write count bytes at offset from/to the file, splitting it into
+     * NOFUSE_MAX_IO_SIZE sized aznfsc_ll_* calls.
+     * Return the number of bytes read/written, which can be less than count
+     * only on eof or error, or -1 with errno set if nothing could be
+     * read/written.
+     */
+    ssize_t pread_ino(fuse_ino_t ino, void *buf, size_t count, off_t offset);
+    ssize_t pwrite_ino(fuse_ino_t ino, const void *buf, size_t count,
+                       off_t offset);
+
+    /**
+     * Serve the read entirely from the inode's bytes_chunk_cache, copying
+     * the data directly from the cached membufs into buf, w/o allocating an
+     * rpc_task or waiting for a completion callback.
+     * Returns the number of bytes read if the entire range was cached (0 for
+     * eof), else -1 and the caller must use read_ll(). errno is not set.
+     */
+    ssize_t read_cached(fuse_ino_t ino, void *buf, size_t count, off_t offset);
+
+    /**
+     * Return the current file size, or -1 with errno set on failure.
+     * Uses the cached size if it's known to be recent, else makes a GETATTR.
+     */
+    off_t get_file_size(fuse_ino_t ino);
 
     /*
      * For every aznfsc_ll_* call that we make we have a struct to hold the
@@ -591,13 +771,39 @@ typedef struct posix_task
         struct stat *statbuf = nullptr;
     } getattr;
 
+    /*
+     * setattr_ll() returns the updated attributes in getattr.statbuf, if set.
+     */
+    int setattr_ll(fuse_ino_t ino, struct stat *attr, int to_set);
+
+    /*
+     * Create and open filename in parent_ino, returning the new inode in ino.
+     * Like open_ll() this takes an open count on the inode.
+     */
+    int create_ll(fuse_ino_t parent_ino, const char *filename, mode_t mode,
+                  int flags, fuse_ino_t& ino);
+
     ssize_t read_ll(fuse_ino_t ino, off_t offset, size_t count);
     struct {
-        int fd = -1;
         void *buf = nullptr;
         size_t count = 0;
     } read;
 
+    ssize_t write_ll(fuse_ino_t ino, const void *buf, size_t count,
+                     off_t offset);
+
+    int open_ll(fuse_ino_t ino, int flags);
+    int release_ll(fuse_ino_t ino);
+    int flush_ll(fuse_ino_t ino);
+
+    int opendir_ll(fuse_ino_t ino);
+    int releasedir_ll(fuse_ino_t ino);
+    ssize_t readdir_ll(fuse_ino_t ino, off_t offset);
+    struct {
+        char *buf = nullptr;
+        size_t size = 0;
+    } readdir;
+
     /*
      * For every glibc call that we hijack we store the pointer to the original
      * function here.
@@ -623,6 +829,51 @@ typedef struct posix_task
     static ssize_t (*__read_orig)(int fd,
                                   void *buf,
                                   size_t count);
+    static ssize_t (*__pread_orig)(int fd,
+                                   void *buf,
+                                   size_t count,
+                                   off_t offset);
+    static ssize_t (*__preadv_orig)(int fd,
+                                    const struct iovec *iov,
+                                    int iovcnt,
+                                    off_t offset);
+    static ssize_t (*__write_orig)(int fd,
+                                   const void *buf,
+                                   size_t count);
+    static ssize_t (*__pwrite_orig)(int fd,
+                                    const void *buf,
+                                    size_t count,
+                                    off_t offset);
+    static ssize_t (*__pwritev_orig)(int fd,
+                                     const struct iovec *iov,
+                                     int iovcnt,
+                                     off_t offset);
+    static off_t (*__lseek_orig)(int fd,
+                                 off_t offset,
+                                 int whence);
+    static int (*__fstat_orig)(int fd,
+                               struct stat *statbuf);
+    static int (*__fsync_orig)(int fd);
+    static int (*__fdatasync_orig)(int fd);
+    static int (*__posix_fadvise_orig)(int fd,
+                                       off_t offset,
+                                       off_t len,
+                                       int advice);
+    static DIR* (*__opendir_orig)(const char *name);
+    static DIR* (*__fdopendir_orig)(int fd);
+    static struct dirent* (*__readdir_orig)(DIR *dirp);
+    static struct dirent64* (*__readdir64_orig)(DIR *dirp);
+    static int (*__readdir_r_orig)(DIR *dirp,
+                                   struct dirent *entry,
+                                   struct dirent **result);
+    static int (*__readdir64_r_orig)(DIR *dirp,
+                                     struct dirent64 *entry,
+                                     struct dirent64 **result);
+    static long (*__telldir_orig)(DIR *dirp);
+    static void (*__seekdir_orig)(DIR *dirp, long loc);
+    static void (*__rewinddir_orig)(DIR *dirp);
+    static int (*__dirfd_orig)(DIR *dirp);
+    static int (*__closedir_orig)(DIR *dirp);
 
     /*
      * nfs_client reference for easy access.
@@ -665,11 +916,26 @@ private:
     mutable std::mutex mutex;
 
     /*
-     * This is the fd table where we maintain info for each open fd.
-     * This is protected by fdmap_mutex.
+     * This is the fd table where we maintain info for each open fd, indexed
+     * by fd. See fdinfo.
+     */
+    static struct fdinfo fdtable[NOFUSE_MAX_FDS];
+
+    /*
+     * Writes to a file are serialized, as the write path depends on not
+     * having more than one write in progress for a file, which fuse ensures
+     * in fuse mode. Files hash to one of these by ino.
+     */
+    static std::mutex write_mutex[NOFUSE_WRITE_LOCK_SHARDS];
+
+    /*
+     * DIR streams returned by our opendir(), protected by dirset_mutex.
+     * num_dirs lets readdir()/closedir() for DIR streams not ours, skip the
+     * lock in the common case when there are none of ours.
      */
-    static std::unordered_map<int, struct fdinfo> fdmap;
-    static std::mutex fdmap_mutex;
+    static std::unordered_set<const void *> dirset;
+    static std::mutex dirset_mutex;
+    static std::atomic<int> num_dirs;
 } PXT;
 
 static inline
@@ -2,6 +2,9 @@
 #define __READAHEAD_H__
 
 #include <atomic>
+#include <map>
+#include <mutex>
+#include <deque>
 #include <shared_mutex>
 
 #include "aznfsc.h"
@@ -12,6 +15,8 @@ struct nfs_client;
 
 namespace aznfsc {
 
+struct bytes_chunk;
+
 /**
  * Readahead state for a Blob.
  * This maintains state to track application read pattern and based on that
@@ -41,30 +46,37 @@ namespace aznfsc {
  *    issued by the application. Also, it should be told when a readahead
  *    completes.
  *
- * TODO: Currently it only tracks a single reader stream. If it's used in a
- *       scope where multiple reader applications are performing reads, it
- *       may not be able to correctly detect sequential patterns, even if all
- *       those multiple reader streams are sequential by themselves.
- *
- *       Another way of achieving the same is for the user to use multiple
- *       ra_state objects, one per reading context, f.e., one way of doing it
- *       is to associate the ra_state with the issuing process' (pid returned
- *       by fuse_get_context()) and not with the file inode.
+ * Multiple streams
+ * ================
+ * Readahead state is per inode, but there can be multiple readers reading
+ * different regions of the same file, f.e., multiple threads each reading
+ * one part of a large file. Interleaved reads from such readers would look
+ * random if tracked as one stream, so ra_state tracks upto MAX_STREAMS
+ * streams, each with its own pattern tracking state (described below).
+ * Every application read is assigned to the stream which it's closest to,
+ * i.e., the stream whose max_byte_read is within ra_bytes of the read, or
+ * the stream whose next strided read it is. If no stream is close enough, a
+ * new stream is started, replacing the least recently used stream (random
+ * streams are replaced before sequential/strided ones). Streams not read
+ * for STREAM_IDLE_READS application reads are freed.
+ * Readaheads are issued for the stream of the most recent application read,
+ * i.e., every stream drives its own readaheads. The readahead window
+ * (scaled ra_bytes) is split equally among all the streams that are
+ * sequential or strided, and ra_ongoing, which is shared by all streams,
+ * caps the total readahead bytes ongoing to the scaled ra_bytes.
  *
- *       Note that it would be ideal if fuse provided us info on the file
- *       pointer on whose behalf a specific IO is being issued. This would
- *       help us associate readahead state with a file pointer and not with
- *       the inode as the readahead (like read offset) is a property of the
- *       file pointer and not of the inode. In absence of this, above pid
- *       based readahead state maintenance is the next best thing we can do.
+ * Note that readahead state is per inode and not per file pointer (fuse
+ * doesn't tell us the file pointer on whose behalf a specific IO is issued),
+ * multiple streams help recover the per file pointer access patterns.
  *
  * How does pattern detection work?
  * ================================
  * File is divided into 1GB logical sections. Everytime access moves to a new
  * section, pattern tracking variables are reset (this is skipped for an
- * ongoing sequential access). This is done to make sure we use the most recent
- * accesses to correctly detect the pattern and older accesses do not muddle the
- * pattern detection. Following pattern tracking variables are maintained:
+ * ongoing sequential or strided access). This is done to make sure we use the
+ * most recent accesses to correctly detect the pattern and older accesses do
+ * not muddle the pattern detection. Following pattern tracking variables are
+ * maintained per stream:
  *
  * - ra_bytes is the amount of readahead in bytes. We never keep more than
  *   ra_bytes of readahead reads ongoing.
@@ -90,21 +102,67 @@ namespace aznfsc {
  *   already read recently.
  * - Pattern tracking is reset when one of the following happens:
  *    - New read from the application lies in a different section than
- *      max_byte_read (and the current access is not sequential). This ensures
- *      our pattern detection is based on recent data and historical accesses
- *      do not have carry influence for long time.
+ *      max_byte_read (and the current access is not sequential/strided). This
+ *      ensures our pattern detection is based on recent data and historical
+ *      accesses do not have carry influence for long time.
  *    - New read starts after max_byte_read+ra_bytes. Such a large jump in
  *      read offset hints at non-sequential access and hence the access pattern
  *      need to be reviewed again and sequential pattern must be proved afresh.
+ *      Such a read starts a new stream, see above.
  * - Following pattern tracking variables are reset:
  *    - min_byte_read
  *    - max_byte_read
  *    - num_reads
  *    - num_bytes_read
  *    - last_byte_readahead
+ *    - stride tracking variables (see below)
  * - When pattern tracking is reset it'll take at least 3 reads to detect the
  *   pattern again. Till that time we won't recommend any new readaheads.
  *   Previously issued readaheads will continue and ra_ongoing is not reset.
+ *
+ * How does stride detection work?
+ * ===============================
+ * Record readers (f.e., reading selected columns from Parquet row groups or
+ * chunks of a HDF5 dataset) read fixed size records at a constant stride,
+ * leaving gaps between the records. These fail the access_density check but
+ * are perfectly predictable. For every stream we track the offset and length
+ * of the last read and the distance (stride) between the last two reads.
+ * If STRIDE_MIN_READS consecutive reads are at the same stride and the
+ * stride is larger than the read length (else it'd be a sequential pattern),
+ * the stream is marked strided. For strided streams we readahead the next
+ * records, i.e., [last_read_offset + N*stride, +last_read_length) for
+ * N = 1, 2, ..., as many as fit in the stream's share of the readahead
+ * window. A read that's not at the expected stride ends stride detection
+ * for the stream and stride has to be proved afresh.
+ * A stride larger than the readahead window puts every read beyond
+ * ra_bytes from the stream's last byte read, so every read starts a new
+ * stream and the stride is never seen by any one stream. For these we also
+ * track the reads which start new streams, and if STRIDE_MIN_READS_FAR
+ * consecutive such reads are of the same length and at the same stride,
+ * the new stream starts as strided. From then on the reads at the stride
+ * are matched to that stream. The higher threshold is to not mistake
+ * upto MAX_STREAMS readers starting at evenly spaced offsets (f.e., fio
+ * jobs with offset_increment) for a strided reader.
+ *
+ * Prefetch and pinning
+ * ====================
+ * Applications which know what they will read next (f.e., data loaders)
+ * can ask for a file range to be read into the cache ahead of time, using
+ * prefetch(), and optionally pin it so that the evictor and inline pruning
+ * leave it alone. This doesn't depend on the read pattern and doesn't count
+ * against the readahead window, instead it has its own budget, all inodes
+ * together have at most cache.data.user.prefetch_inflight_mb (scaled by
+ * ra_scale_factor) of prefetch reads ongoing. The range is read in
+ * def_ra_size sized reads using the readahead machinery (disk cache or
+ * READ RPCs completed by readahead_callback()), as prefetch reads complete
+ * more of the range is read. Inodes which couldn't issue prefetch reads
+ * due to the budget wait in prefetch_waitq for other inodes' prefetch reads
+ * to complete.
+ * Pinned ranges are kept till dontneed() or till the inode is freed, and
+ * all pinned ranges together must not exceed cache.data.user.max_pinned_pct
+ * of the cache.
+ * dontneed() unpins the range, stops prefetching it and drops the cached
+ * data for the range right away (except dirty or inuse membufs).
  */
 class ra_state
 {
@@ -124,6 +182,29 @@ public:
      */
     const int ACCESS_DENSITY_MIN = 70;
 
+    /*
+     * Max number of reader streams tracked per inode.
+     */
+    static const int MAX_STREAMS = 8;
+
+    /*
+     * A stream not read for these many application reads (to the inode) is
+     * considered done and its slot is freed.
+     */
+    static const uint64_t STREAM_IDLE_READS = 64;
+
+    /*
+     * Number of consecutive reads at the same stride needed to consider a
+     * stream strided.
+     */
+    static const uint64_t STRIDE_MIN_READS = 3;
+
+    /*
+     * Number of consecutive new streams started at the same stride needed
+     * to consider it a stride larger than the readahead window.
+     */
+    static const uint64_t STRIDE_MIN_READS_FAR = MAX_STREAMS + 1;
+
     /**
      * Initialize readahead state.
      * nfs_client is for convenience, nfs_inode identifies the target file.
@@ -143,114 +224,36 @@ public:
      * This must be called *before* issuing the read and not after the read
      * completes.
      */
-    void on_application_read(uint64_t offset, uint64_t length)
-    {
-        assert(offset < AZNFSC_MAX_FILE_SIZE);
-        assert((offset + length) <= AZNFSC_MAX_FILE_SIZE);
-
-        if (length == 0) {
-            assert(0);
-            return;
-        }
-        assert((int64_t) length > 0);
-
-        std::unique_lock<std::shared_mutex> _lock(ra_lock_40);
-
-        const uint64_t curr_section = (max_byte_read / SECTION_SIZE);
-        const uint64_t this_section = ((offset + length) / SECTION_SIZE);
-        // How far from the current last byte read, is this new request.
-        const uint64_t read_gap =
-            std::abs((int64_t) (offset - max_byte_read));
-        bool reset_readahead = false;
-        /*
-         * Scaled ra_bytes is the ra_bytes scaled to account for global cache
-         * pressure. We use that to decide how much to readahead.
-         */
-        const uint64_t ra_bytes_scaled = get_ra_bytes();
-
-        /*
-         * If this read is beyond ra_bytes away from the current last byte
-         * read, then this strongly indicates a non-sequential pattern.
-         * Reset the readahead state, switching to random access and let the
-         * read pattern prove once again for sequential-ness.
-         */
-        if (read_gap > ra_bytes_scaled) {
-            reset_readahead = true;
-        } else if (curr_section != this_section) {
-            /*
-             * Read is within the readahead window but the section changes.
-             * Since the section size is usually much larger than the readahead
-             * window size, so this usually means one of the following two:
-             * 1. this_section == "curr_section + 1" (likely for seq pattern).
-             * 2. this_section == "curr_section - 1"
-             */
-            if (this_section != curr_section + 1) {
-                assert((this_section == (curr_section - 1)) ||
-                       (max_byte_read == UINT64_MAX));
-                reset_readahead = true;
-            } else {
-                /*
-                 * Common case of sequential reads progressing to the next
-                 * section, don't reset pattern detector.
-                 */
-                reset_readahead = !is_sequential_nolock();
-            }
-        }
-
-        if (reset_readahead) {
-            num_reads = 1;
-            num_bytes_read = length;
-            min_byte_read = offset;
-            max_byte_read = offset + length - 1;
-            last_byte_readahead = 0;
-        } else {
-            num_reads++;
-            num_bytes_read += length;
-            max_byte_read = std::max(max_byte_read.load(), offset + length - 1);
-            min_byte_read = std::min(min_byte_read.load(), offset);
-        }
-
-        assert(max_byte_read >= min_byte_read);
-
-        /*
-         * Next readahead will be from last_byte_readahead+1, so if this read
-         * is past the current last_byte_readahead, update last_byte_readahead.
-         */
-        while (last_byte_readahead < max_byte_read) {
-            uint64_t expected = last_byte_readahead;
-            last_byte_readahead.compare_exchange_weak(expected,
-                                                      max_byte_read);
-        }
-    }
+    void on_application_read(uint64_t offset, uint64_t length);
 
     /**
      * Returns the byte offset below which it's unlikely to get any application
      * read (given that the application is doing (pseudo) sequential reads).
      * Caller can use this to release any unused buffers which may have not been
      * released as it wasn't safe to release when release was last attempted.
+     * With multiple streams this is the smallest such offset across streams.
+     */
+    uint64_t release_till() const;
+
+    /**
+     * Returns the currently observed access pattern of the stream that the
+     * most recent application read belongs to.
      */
-    uint64_t release_till() const
+    bool is_sequential() const
     {
-        /*
-         * Our active readahead window starts from max_byte_read and spans
-         * get_ra_bytes() bytes. For the case of sequential reads, anything
-         * less than "max_byte_read - SECTION_SIZE" is unlikely to be read
-         * again. The margin of SECTION_SIZE helps readers like fio which
-         * issue lot of parallel reads which together are working towards a
-         * sequential goal but may be ordered upto SECTION_SIZE apart.
-         */
-        return (max_byte_read == UINT64_MAX) ? 0 :
-                std::max((int64_t) (max_byte_read - SECTION_SIZE), 0L);
+        std::shared_lock<std::shared_mutex> _lock(ra_lock_40);
+
+        return is_sequential_nolock(streams[curr_stream]);
     }
 
     /**
-     * Returns the currently observed access pattern.
+     * Is the stream of the most recent application read strided?
      */
-    bool is_sequential() const
+    bool is_strided() const
     {
         std::shared_lock<std::shared_mutex> _lock(ra_lock_40);
 
-        return is_sequential_nolock();
+        return is_strided_nolock(streams[curr_stream]);
     }
 
     /**
@@ -266,10 +269,19 @@ public:
      */
     int issue_readaheads();
 
+    /**
+     * Queue readahead of bc from the disk cache, caller must have checked
+     * that the disk cache has the data and must hold the membuf lock and
+     * inuse count, which are released when the read completes.
+     * Returns false if it could not be queued, caller then still owns the
+     * membuf lock and inuse count.
+     */
+    bool disk_readahead(struct bytes_chunk& bc, bool is_prefetch = false);
+
     /**
      * Hook for reporting completion of a readahead read.
      * This MUST be called for every readahead that get_next_ra() suggested
-     * and the length parameter MUST match what was passed to get_next_ra().
+     * and the length parameter MUST match the length get_next_ra() returned.
      * This must be called before the readahead read completes, successful or
      * not.
      *
@@ -294,37 +306,61 @@ public:
     }
 
     /**
-     * Wait for ongoing readaheads to complete.
+     * Wait for ongoing readaheads (and prefetch reads) to complete.
      */
     void wait_for_ongoing_readahead() const;
 
-    bool in_ra_window(uint64_t offset, uint64_t length) const
-    {
-        assert((int64_t) (offset + length) >= 0);
+    /**
+     * Prefetch [offset, offset+length) into the cache, length of 0 means
+     * till eof. The range is clipped to the file size. If pin is true the
+     * range is also pinned against eviction.
+     * Returns 0 on success or an errno, ENOSPC if the range could not be
+     * pinned as that would exceed max_pinned_pct. The prefetch itself
+     * happens asynchronously.
+     *
+     * LOCKS: prefetch_lock_56 and pin_lock_55, not held together.
+     */
+    int prefetch(uint64_t offset, uint64_t length, bool pin);
 
-        /*
-         * If last_byte_readahead is 0 it mostly means we are not doing
-         * readaheads which is mostly true for files which are being
-         * written and not read.
-         */
-        if (last_byte_readahead == 0)
-            return false;
+    /**
+     * Application doesn't need [offset, offset+length) anymore, length of 0
+     * means till eof. Unpin it, stop any prefetch of it and release its
+     * cached membufs. Returns the bytes released from the cache.
+     */
+    uint64_t dontneed(uint64_t offset, uint64_t length);
 
-        /*
-         * Scaled ra_bytes is the ra_bytes scaled to account for global cache
-         * pressure. We use that to decide how much to readahead.
-         */
-        const uint64_t ra_bytes_scaled = get_ra_bytes();
-        const uint64_t le = offset;
-        const uint64_t re = offset + length;
-        const uint64_t lra = max_byte_read + 1;
-        const uint64_t rra = max_byte_read + ra_bytes_scaled;
-        const bool ends_before = re <= lra;
-        const bool starts_after = le > rra;
-
-        return !ends_before && !starts_after;
+    /**
+     * Does [offset, offset+length) overlap with a pinned range?
+     * Like in_ra_window() this is called from inline_prune() and
+     * evict_cold() with chunkmap lock held, so it only takes pin_lock_55.
+     */
+    bool is_pinned(uint64_t offset, uint64_t length) const;
+
+    /**
+     * Total bytes pinned by all inodes.
+     */
+    static uint64_t get_pinned_bytes_g()
+    {
+        return pinned_bytes_g;
     }
 
+    /**
+     * Called by the readahead callbacks when a prefetch read completes,
+     * successful or not. Issues more prefetch reads for this and other
+     * waiting inodes, as permitted by the prefetch budget.
+     *
+     * Note: This is not meant to be called by user. This is made public
+     *       as it's called from the global readahead callback.
+     */
+    void on_prefetch_complete(uint64_t length);
+
+    /**
+     * Does [offset, offset+length) overlap with the readahead window of any
+     * stream? This doesn't take ra_lock_40 as it's called from
+     * inline_prune() with chunkmap lock held.
+     */
+    bool in_ra_window(uint64_t offset, uint64_t length) const;
+
     /**
      * XXX This is provided as a quick hack to reset readahead state on
      *     file open so that the access to the file using the new handle
@@ -334,10 +370,12 @@ public:
      */
     void reset()
     {
-        num_reads = 0;
-        num_bytes_read = 0;
-        min_byte_read = 0;
-        max_byte_read = UINT64_MAX;
+        std::unique_lock<std::shared_mutex> _lock(ra_lock_40);
+
+        for (ra_stream& s : streams) {
+            s.free_nolock();
+        }
+        curr_stream = 0;
     }
 
     /**
@@ -350,11 +388,15 @@ public:
      */
     static int unit_test();
 
+    ~ra_state();
+
 private:
     /**
      * This private constructor is only to be called from unit_test().
      */
     ra_state(int _ra_kib, int _def_ra_size_kib) :
+        client(nullptr),
+        inode(nullptr),
         ra_bytes(_ra_kib * 1024),
         def_ra_size(std::min<uint64_t>(_def_ra_size_kib * 1024ULL, ra_bytes))
     {
@@ -371,20 +413,99 @@ private:
                   _ra_kib, _def_ra_size_kib);
     }
 
+    /**
+     * Pattern tracking state for one reader stream.
+     * All members are protected by ra_lock_40, the ones which are read by
+     * in_ra_window() and release_till() w/o the lock are atomic.
+     */
+    struct ra_stream
+    {
+        /*
+         * Last byte of readahead read recommended by most recent call to
+         * get_next_ra() for this stream. Next readahead recommended will
+         * start at the next byte after this.
+         * For strided streams this is the last byte of the last record read
+         * ahead.
+         * This is reset when pattern detection is reset.
+         */
+        std::atomic<uint64_t> last_byte_readahead = 0;
+
+        /*
+         * Smallest and largest byte read in the current section. These point
+         * to the minimum and the maximum byte read, so if application reads 3
+         * bytes at offset 0, we will have:
+         * min_byte_read == 0, and
+         * max_byte_read == 2.
+         * These are truthfully updated as application reports its read calls
+         * through on_application_read().
+         * These are reset when pattern detection is reset.
+         * max_byte_read of UINT64_MAX means the stream slot is free.
+         */
+        std::atomic<uint64_t> min_byte_read = 0;
+        std::atomic<uint64_t> max_byte_read = UINT64_MAX;
+
+        /*
+         * Number of read calls and number of bytes read by those, in the
+         * current section.
+         * These are reset when pattern detection is reset.
+         */
+        uint64_t num_reads = 0;
+        uint64_t num_bytes_read = 0;
+
+        /*
+         * Stride tracking.
+         * last_read_offset/last_read_length are of the most recent read,
+         * stride is the distance between the last two reads and
+         * num_stride_reads is the number of consecutive reads at that stride
+         * (counting the first read).
+         * stride_ra_rec is the start of the record being read ahead and
+         * stride_ra_next is the next byte to readahead in that record.
+         */
+        uint64_t last_read_offset = 0;
+        uint64_t last_read_length = 0;
+        uint64_t stride = 0;
+        uint64_t num_stride_reads = 0;
+        uint64_t stride_ra_rec = 0;
+        uint64_t stride_ra_next = 0;
+
+        /*
+         * ra_state::read_seq at the time of the most recent read of this
+         * stream, for LRU replacement.
+         */
+        uint64_t last_read_seq = 0;
+
+        bool is_free() const
+        {
+            return max_byte_read == UINT64_MAX;
+        }
+
+        /*
+         * Reset pattern tracking to start afresh with the given read.
+         */
+        void reset_nolock(uint64_t offset, uint64_t length);
+
+        /*
+         * Free the stream slot.
+         */
+        void free_nolock();
+    };
+
     /**
      * Returns the offset of the next readahead to issue. Caller must pass the
      * length of the readahead it wants to issue.
-     * Return value of 0 would indicate "don't issue readahead read", this would
-     * mostly be caused by recent application read pattern which has been
-     * indentifed as non-sequential, or if the current ongoing readaheads are
-     * already ra_bytes.
+     * Return value <= 0 would indicate "don't issue readahead read", this
+     * would mostly be caused by recent application read pattern which has
+     * been indentifed as non-sequential, or if the current ongoing readaheads
+     * are already ra_bytes. Negative values tell the reason, for logging.
      *
-     * If this function returns a non-zero value, then caller SHOULD issue a
-     * readahead read at the returned offset and 'length' (or less) and MUST
-     * call on_readahead_complete(length) when this readahead read completes,
-     * to let ra_state know.
-     * Note that the argument to on_readahead_complete() MUST be 'length' even
-     * if the readahead read ends up reading less.
+     * If this function returns a positive value, then caller SHOULD issue a
+     * readahead read at the returned offset and *ra_length (or less) and MUST
+     * call on_readahead_complete(*ra_length) when this readahead read
+     * completes, to let ra_state know.
+     * *ra_length is 'length' for sequential streams, it can be less for
+     * strided streams as we only readahead the records and not the gaps.
+     * Note that the argument to on_readahead_complete() MUST be *ra_length
+     * even if the readahead read ends up reading less.
      *
      * Note: If you don't pass the length parameter, it uses the def_ra_size
      *       set in the constructor. This is the recommended usage.
@@ -393,22 +514,89 @@ private:
      *       offsets beyond eof. It's the caller's responsibility to handle
      *       that.
      */
-    int64_t get_next_ra(uint64_t length = 0);
+    int64_t get_next_ra(uint64_t length = 0, uint64_t *ra_length = nullptr);
+
+    /*
+     * Issue read for one bytes_chunk returned by get() for a readahead or
+     * prefetch. Returns true if the read was issued, else the readahead or
+     * prefetch of bc is completed right away (and the inuse count dropped).
+     * use_reserved is passed to alloc_rpc_task(), prefetch reads issued
+     * from the readahead callback must not block for a free rpc_task.
+     */
+    bool issue_read(struct bytes_chunk& bc, bool is_prefetch,
+                    bool use_reserved = false);
 
-    bool is_sequential_nolock() const
+    /*
+     * Account completion of a readahead or prefetch read which was not
+     * issued, or failed to issue.
+     */
+    void on_read_complete(uint64_t offset, uint64_t length, bool is_prefetch)
+    {
+        if (is_prefetch) {
+            assert(pf_ongoing >= length);
+            assert(prefetch_ongoing_g >= length);
+            pf_ongoing -= length;
+            prefetch_ongoing_g -= length;
+        } else {
+            on_readahead_complete(offset, length);
+        }
+    }
+
+    /*
+     * Issue prefetch reads, as many as allowed by the prefetch budget, or
+     * only one from libnfs callback context. Returns the number of reads
+     * issued.
+     */
+    int issue_prefetch(bool from_callback = false);
+
+    /*
+     * Prefetch budget in bytes, shared by all inodes.
+     */
+    uint64_t get_prefetch_budget() const;
+
+    /*
+     * Issue prefetch reads for the first waiting inode, if any.
+     */
+    static void kick_prefetch_waitq(bool from_callback);
+
+    /*
+     * Readahead offset for a strided stream, called by get_next_ra().
+     */
+    int64_t get_next_stride_ra_nolock(ra_stream& s,
+                                      uint64_t length,
+                                      uint64_t window,
+                                      uint64_t *ra_length);
+
+    /*
+     * Find the stream that a read at offset belongs to, -1 if none.
+     */
+    int find_stream_nolock(uint64_t offset, uint64_t ra_bytes_scaled) const;
+
+    /*
+     * Pick a stream slot for a new stream.
+     */
+    int alloc_stream_nolock();
+
+    /*
+     * Number of streams which are sequential or strided, i.e., the streams
+     * sharing the readahead window. At least 1.
+     */
+    int num_ra_streams_nolock() const;
+
+    bool is_sequential_nolock(const ra_stream& s) const
     {
         /*
          * Need minimum 3 reads from current section to check the access
          * pattern.
          */
-        if (num_reads < 3) {
+        if (s.num_reads < 3) {
             return false;
         }
 
-        const int64_t access_range = (max_byte_read - min_byte_read + 1);
+        const int64_t access_range = (s.max_byte_read - s.min_byte_read + 1);
         assert(access_range > 0);
 
-        const int access_density = (num_bytes_read * 100) / access_range;
+        const int access_density = (s.num_bytes_read * 100) / access_range;
 
         /*
          * This can happen in case of duplicate reads, which is not a case of
@@ -421,6 +609,12 @@ private:
         return (access_density > ACCESS_DENSITY_MIN);
     }
 
+    bool is_strided_nolock(const ra_stream& s) const
+    {
+        return (s.num_stride_reads >= STRIDE_MIN_READS) &&
+               !is_sequential_nolock(s);
+    }
+
     /*
      * The singleton nfs_client, for convenience.
      */
@@ -446,48 +640,80 @@ private:
     const uint64_t def_ra_size;
 
     /*
-     * Last byte of readahead read recommended by most recent call to
-     * get_next_ra(). Next readahead recommended will start at the next byte
-     * after this.
-     * This is reset when pattern detection is reset.
+     * Reader streams, see "Multiple streams" above.
      */
-    std::atomic<uint64_t> last_byte_readahead = 0;
+    ra_stream streams[MAX_STREAMS];
 
     /*
-     * Smallest and largest byte read in the current section. These point to
-     * the minimum and the maximum byte read, so if application reads 3 bytes
-     * at offset 0, we will have:
-     * min_byte_read == 0, and
-     * max_byte_read == 2.
-     * These are truthfully updated as application reports its read calls
-     * through on_application_read().
-     * These are reset when pattern detection is reset.
-     */
-    std::atomic<uint64_t> min_byte_read = 0;
-    std::atomic<uint64_t> max_byte_read = UINT64_MAX;
+     * Stream that the most recent application read belongs to. Readaheads
+     * are issued for this stream.
+     */
+    int curr_stream = 0;
 
     /*
-     * Current ongoing readahead bytes.
+     * Number of application reads reported, used for LRU tracking of
+     * streams.
+     */
+    uint64_t read_seq = 0;
+
+    /*
+     * Offset and length of the last read which started a new stream, the
+     * distance from the previous such read and the number of consecutive
+     * such reads at that distance. See "How does stride detection work?".
+     */
+    uint64_t far_last_offset = 0;
+    uint64_t far_last_length = 0;
+    uint64_t far_stride = 0;
+    uint64_t far_num_reads = 0;
+
+    /*
+     * Current ongoing readahead bytes, across all streams.
      * This depends on application correctly informing us of readahead reads
      * completing by calling on_readahead_complete().
      * This is not reset when pattern detection is reset.
      */
     std::atomic<uint64_t> ra_ongoing = 0;
 
-    /*
-     * Number of read calls and number of bytes read by those, in the current
-     * section.
-     * These are reset when pattern detection is reset.
-     */
-    std::atomic<uint64_t> num_reads = 0;
-    std::atomic<uint64_t> num_bytes_read = 0;
-
     /*
      * Common memory pressure code will update this scaling factor to force
      * all ra_state machines to slow down in case if high memory pressure.
      */
     static std::atomic<double> ra_scale_factor;
 
+    /*
+     * Prefetch state.
+     * [pf_next, pf_end) is the part of the prefetch range yet to be read,
+     * protected by prefetch_lock_56. pf_waiting is set while this inode is
+     * queued in prefetch_waitq.
+     * pf_ongoing is the prefetch bytes ongoing for this inode and
+     * prefetch_ongoing_g for all inodes.
+     */
+    uint64_t pf_next = 0;
+    uint64_t pf_end = 0;
+    bool pf_waiting = false;
+    std::atomic<uint64_t> pf_ongoing = 0;
+    mutable std::mutex prefetch_lock_56;
+
+    static std::atomic<uint64_t> prefetch_ongoing_g;
+
+    /*
+     * Inodes waiting for prefetch budget, each holds an inode ref.
+     */
+    static std::deque<struct nfs_inode*> prefetch_waitq;
+    static std::mutex prefetch_waitq_lock_57;
+
+    /*
+     * Pinned ranges, start offset -> end offset, non-overlapping.
+     * num_pinned is the number of entries in pinned, for a lock-free check
+     * in is_pinned().
+     */
+    std::map<uint64_t, uint64_t> pinned;
+    std::atomic<uint64_t> num_pinned = 0;
+    uint64_t pinned_bytes = 0;
+    mutable std::shared_mutex pin_lock_55;
+
+    static std::atomic<uint64_t> pinned_bytes_g;
+
     /*
      * Lock for safely accessing/updating above state.
      */
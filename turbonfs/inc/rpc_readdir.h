@@ -70,9 +70,35 @@
 struct directory_entry
 {
     const cookie3 cookie;
-    const struct stat attributes;
+
+    /*
+     * Packed attributes.
+     * We don't store the full struct stat as that alone is 144 bytes, which
+     * adds up for directories with millions of entries. READDIRPLUS responses
+     * are served using the (latest) attributes from nfs_inode, so the only
+     * attributes we need here are the ones needed by fuse_add_direntry() for
+     * READDIR responses, i.e., the inode number and the file type.
+     * Use get_attr() to get these as a struct stat.
+     */
+    const uint64_t fileid;
+
+    /*
+     * Again, for READDIR fetched entries, we won't know the filehandle
+     * (and the fileid), hence we won't have the inode set.
+     */
+    struct nfs_inode *const nfs_inode;
+
+    /*
+     * Name is interned here, readdirectory_cache's DNLC index refers to this
+     * and doesn't keep its own copy.
+     */
+    const char *const name;
+
+    // st_mode, 0 for READDIR created entries.
+    const uint32_t mode;
+
     /*
-     * whether 'attributes' holds valid attributes?
+     * whether 'mode' holds valid attributes?
      * directory_entry which are made as a result of READDIR call, would
      * not have the attributes. Those can only be used by subsequent
      * readdir calls made by fuse. If fuse makes readdirplus call and
@@ -83,13 +109,6 @@ struct directory_entry
      */
     const bool has_attributes;
 
-    /*
-     * Again, for READDIR fetched entries, we won't know the filehandle
-     * (and the fileid), hence we won't have the inode set.
-     */
-    struct nfs_inode *const nfs_inode;
-    const char *const name;
-
     // Constructor for adding a readdirplus returned entry.
     directory_entry(char* name_,
                     cookie3 cookie_,
@@ -103,6 +122,17 @@ struct directory_entry
 
     ~directory_entry();
 
+    /**
+     * Attributes of this directory_entry as a struct stat.
+     * Only st_ino and st_mode are valid, rest are 0.
+     */
+    void get_attr(struct stat& st) const
+    {
+        ::memset(&st, 0, sizeof(st));
+        st.st_ino = fileid;
+        st.st_mode = mode;
+    }
+
     /**
      * Returns size of the directory_entry.
      * This is used to find the cache space taken by this directory_entry.
@@ -110,14 +140,17 @@ struct directory_entry
     size_t get_cache_size() const
     {
         /*
-         * Since we store this directory_entry in a map, it will have two
-         * pointers and a key and value, all 8 bytes each, so we add those
-         * to get a closer estimate.
+         * directory_entry is allocated by make_shared, so add the control
+         * block (vptr and the two refcounts) and the allocator overhead for
+         * the object and the name.
+         * The dirent_store and dnlc_index slots it takes are accounted by
+         * those, ref dirent_store::get_cache_size() and
+         * dnlc_index::get_cache_size().
          *
-         * Note: For usual filename lengths it comes to ~250 bytes.
+         * Note: For usual filename lengths it comes to ~90 bytes.
          * Note: It may take slightly more than this.
          */
-        return sizeof(*this) + ::strlen(name) + 4*sizeof(uint64_t);
+        return sizeof(*this) + ::strlen(name) + 1 + 4*sizeof(uint64_t);
     }
 
     /**
@@ -157,6 +190,241 @@ struct directory_entry
     }
 };
 
+/*
+ * Cookies per dirent_store chunk, as a power of 2.
+ * Blob NFS cookies are dense (see dirent_store), for other NFS servers which
+ * may return arbitrary cookie values we use one cookie per chunk, which
+ * degenerates to a map indexed by cookie.
+ */
+#ifndef ENABLE_NON_AZURE_NFS
+#define DIRENT_CHUNK_SHIFT 6
+#else
+#define DIRENT_CHUNK_SHIFT 0
+#endif
+#define DIRENT_CHUNK_SIZE (1ULL << DIRENT_CHUNK_SHIFT)
+
+/**
+ * Cookie indexed storage for directory_entry objects of a directory.
+ *
+ * Blob NFS uses cookies starting at 1 and increasing by 1 for every entry,
+ * and entries added by LOOKUP use cookies counting up from UINT64_MAX/2,
+ * so cookies are dense. We take advantage of that and store entries in
+ * chunks of DIRENT_CHUNK_SIZE consecutive cookies, each chunk an array of
+ * shared_ptr slots sorted by cookie. Compared to a map node per entry, this
+ * needs one allocation per chunk and 16 bytes per entry, while still
+ * allowing entries to be added/removed anywhere in O(log #chunks), f.e.,
+ * when re-enumerating after the cache was purged mid-way.
+ *
+ * Note: Caller must synchronize access, readdirectory_cache uses
+ *       readdircache_lock_2.
+ */
+class dirent_store
+{
+public:
+    dirent_store() = default;
+
+    /*
+     * Retiring a cache moves its dir_entries to the retired list, the moved
+     * from store is left empty.
+     */
+    dirent_store(dirent_store&& other);
+    dirent_store(const dirent_store&) = delete;
+    dirent_store& operator=(const dirent_store&) = delete;
+
+    ~dirent_store();
+
+    /**
+     * Add entry at entry->cookie.
+     * Returns false if an entry with that cookie already exists.
+     */
+    bool emplace(const std::shared_ptr<struct directory_entry>& entry);
+
+    /**
+     * Returns the entry stored at cookie, or a null shared_ptr if none.
+     * The reference returned is valid only till the entry is removed.
+     */
+    const std::shared_ptr<struct directory_entry>& find(cookie3 cookie) const;
+
+    /**
+     * Remove the entry stored at cookie, returns false if not found.
+     */
+    bool erase(cookie3 cookie);
+
+    /**
+     * Call fn for every entry stored, in cookie order.
+     * fn must not add or remove entries.
+     */
+    template <typename Fn>
+    void for_each(Fn&& fn)
+    {
+        for (auto& [chunk_idx, chunk] : chunks) {
+            for (std::shared_ptr<struct directory_entry>& slot : chunk.slots) {
+                if (slot) {
+                    fn(slot);
+                }
+            }
+        }
+    }
+
+    /**
+     * Remove entries in cookie order, a chunk at a time, till at least
+     * max_entries are removed or the store becomes empty. fn is called for
+     * every entry removed, before it's dropped.
+     * Returns the number of entries removed.
+     */
+    template <typename Fn>
+    size_t drain(size_t max_entries, Fn&& fn)
+    {
+        size_t removed = 0;
+
+        while (!chunks.empty() && (removed < max_entries)) {
+            auto it = chunks.begin();
+            chunk& c = it->second;
+
+            for (std::shared_ptr<struct directory_entry>& slot : c.slots) {
+                if (slot) {
+                    fn(slot);
+                }
+            }
+
+            assert(num_entries >= c.count);
+            num_entries -= c.count;
+            removed += c.count;
+            erase_chunk(it);
+        }
+
+        return removed;
+    }
+
+    void clear();
+
+    size_t size() const
+    {
+        return num_entries;
+    }
+
+    bool empty() const
+    {
+        return (num_entries == 0);
+    }
+
+    /**
+     * Memory taken by the chunks, not including the directory_entry objects
+     * they point to. Every chunk costs DIRENT_CHUNK_SIZE slots even if only
+     * a few are used, so this is significant for sparsely filled chunks.
+     * This is also accounted in readdirectory_cache::bytes_allocated_g as
+     * chunks are added and removed.
+     */
+    size_t get_cache_size() const
+    {
+        return chunks.size() * CHUNK_BYTES;
+    }
+
+private:
+    struct chunk
+    {
+        std::shared_ptr<struct directory_entry> slots[DIRENT_CHUNK_SIZE];
+        // Non-null slots.
+        uint32_t count = 0;
+    };
+
+    /*
+     * Bytes taken by one chunk, including the std::map node (color, 3
+     * pointers and the key) and the allocator overhead.
+     */
+    static constexpr size_t CHUNK_BYTES =
+        sizeof(chunk) + 4*sizeof(void *) + sizeof(uint64_t) + 16;
+
+    /*
+     * Get the chunk for cookie, adding a new one if not present.
+     */
+    chunk& get_chunk(cookie3 cookie);
+
+    /*
+     * Remove the chunk at 'it', dropping its entries.
+     */
+    void erase_chunk(std::map<uint64_t, chunk>::iterator it);
+
+    // Chunks indexed by (cookie >> DIRENT_CHUNK_SHIFT).
+    std::map<uint64_t, chunk> chunks;
+    size_t num_entries = 0;
+};
+
+/**
+ * Open-addressing hash index from filename to directory_entry, used by the
+ * DNLC lookups.
+ *
+ * It stores a pointer to the directory_entry (an entry is looked up by
+ * comparing with directory_entry::name), so the filename is stored only
+ * once. A directory_entry MUST be removed from dnlc_index before it's
+ * removed from dirent_store, which holds the ref that keeps it alive.
+ * Linear probing with backward shift deletion, so there are no tombstones
+ * and lookups never degrade after many removes.
+ *
+ * Note: Caller must synchronize access, readdirectory_cache uses
+ *       readdircache_lock_2.
+ */
+class dnlc_index
+{
+public:
+    const struct directory_entry *find(const char *name) const;
+
+    /**
+     * Add entry to the index, entry->name must not be present.
+     */
+    void insert(const struct directory_entry *entry);
+
+    /**
+     * Remove name from the index, returns false if not found.
+     */
+    bool erase(const char *name);
+
+    /**
+     * Remove all entries and release the slots' memory.
+     */
+    void clear();
+
+    ~dnlc_index()
+    {
+        clear();
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    /**
+     * Memory taken by the slots, also accounted in
+     * readdirectory_cache::bytes_allocated_g.
+     */
+    size_t get_cache_size() const
+    {
+        return slots.size() * sizeof(struct slot);
+    }
+
+private:
+    struct slot
+    {
+        const struct directory_entry *entry = nullptr;
+        uint64_t hash = 0;
+    };
+
+    static uint64_t hash_name(const char *name);
+
+    /*
+     * Returns the index of the slot holding name, or the empty slot where
+     * name must be inserted.
+     */
+    size_t probe(const char *name, uint64_t hash) const;
+
+    void grow();
+
+    // Power of 2 sized, empty till the first insert.
+    std::vector<struct slot> slots;
+    size_t count = 0;
+};
+
 /**
  * This is our unified readdir and DNLC cache.
  */
@@ -195,9 +463,43 @@ private:
      */
     uint64_t seq_last_cookie = 0;
 
-    // Size of the cache.
+    /*
+     * Size of the cache.
+     * This is the size of all the cached directory_entry objects plus the
+     * memory taken by dir_entries and dnlc_map themselves, ref
+     * get_index_bytes_nolock().
+     */
     size_t cache_size;
 
+    /*
+     * Memory taken by dir_entries and dnlc_map, over and above the
+     * directory_entry objects.
+     * Caller must hold readdircache_lock_2.
+     */
+    size_t get_index_bytes_nolock() const
+    {
+        return dir_entries.get_cache_size() + dnlc_map.get_cache_size();
+    }
+
+    /*
+     * Directory readahead state.
+     *
+     * fuse_offset is the offset last queried by fuse through readdirplus,
+     * i.e., fuse has consumed all cookies upto fuse_offset.
+     * last_batch_dirents is the number of dirents returned by the last
+     * READDIRPLUS response, this is used to convert the configured prefetch
+     * depth (in batches) to cookies.
+     * prefetch_inflight is set while a prefetch READDIRPLUS is outstanding.
+     * Since cookies chain, i.e., we cannot query the next batch w/o knowing
+     * the last cookie of the previous batch, we can have only one prefetch
+     * RPC outstanding for a directory. The prefetch chain keeps on issuing
+     * the next READDIRPLUS from its own callback till we are prefetch_depth
+     * batches ahead of fuse_offset.
+     */
+    uint64_t fuse_offset = 0;
+    uint64_t last_batch_dirents = 0;
+    bool prefetch_inflight = false;
+
     cookieverf3 cookie_verifier;
 
     /*
@@ -254,8 +556,9 @@ private:
     /*
      * dir_entries is the readdir cache, indexed by cookie value.
      * We double readdir cache as DNLC cache too. dnlc_map is used to convert
-     * filename (which is the index into the DNLC cache) to cookie (which is
-     * the index into the readdir cache).
+     * filename (which is the index into the DNLC cache) to the
+     * directory_entry (and hence the cookie, which is the index into the
+     * readdir cache).
      * dir_entries contains shared_ptr of directory_entry objects, thus
      * lookup_dircache() can safely return a vector of directory_entry objects
      * w/o worrying of them being deleted by an unlink() or some other call
@@ -263,8 +566,8 @@ private:
      * Original ref to the shared_ptr is held when directory_entry is added to
      * dir_entries by readdirectory_cache::add().
      */
-    std::map<cookie3, std::shared_ptr<struct directory_entry>> dir_entries;
-    std::unordered_map<std::string, cookie3> dnlc_map;
+    dirent_store dir_entries;
+    dnlc_index dnlc_map;
 
     /*
      * This lock protects all the members of this readdirectory_cache.
@@ -278,6 +581,48 @@ private:
      */
     std::atomic<bool> invalidate_pending = false;
 
+    /*
+     * Entries moved out of dir_entries by retire() and waiting to be freed
+     * by the reclaimer thread, indexed by the generation they were retired
+     * in. num_retired is the total entries in all generations.
+     * reclaim_queued is set while dir_inode is queued to the reclaimer.
+     * Protected by readdircache_lock_2, generation is atomic only for
+     * lockless reads by get_generation().
+     */
+    std::map<uint64_t, dirent_store> retired;
+    uint64_t num_retired = 0;
+    std::atomic<uint64_t> generation = 0;
+    bool reclaim_queued = false;
+
+    /**
+     * Free one directory_entry from dir_entries or retired, and if it holds
+     * the last dircachecnt on its inode add the inode to tofree_vec, with a
+     * lookupcnt ref, for put_tofree() to decref.
+     *
+     * Caller MUST hold exclusive readdircache_lock_2.
+     */
+    void free_entry(std::shared_ptr<struct directory_entry>& de,
+                    std::vector<struct nfs_inode*>& tofree_vec);
+
+    void put_tofree(std::vector<struct nfs_inode*>& tofree_vec);
+
+    /**
+     * Reset the directory enumeration state after dir_entries is emptied.
+     *
+     * Caller MUST hold exclusive readdircache_lock_2.
+     */
+    void reset_nolock();
+
+    /**
+     * Logically purge the cache, used by clear_if_needed().
+     * dir_entries is moved to the retired list in one go, so subsequent
+     * lookups and enumerations find an empty cache right away, while the
+     * entries are freed by the reclaimer thread in batches, ref
+     * reclaim_retired(), instead of by the unlucky lookup that found
+     * invalidate_pending set.
+     */
+    void retire();
+
 public:
     readdirectory_cache(struct nfs_client *_client,
                         struct nfs_inode *_inode):
@@ -324,11 +669,11 @@ public:
     {
         // Take shared lock on the map.
         std::shared_lock<std::shared_mutex> lock(readdircache_lock_2);
-        auto it = dir_entries.find(cookie);
+        const std::shared_ptr<struct directory_entry>& de =
+            dir_entries.find(cookie);
 
-        if (it != dir_entries.end())
-        {
-            dirent = it->second;
+        if (de) {
+            dirent = de;
             return true;
         }
 
@@ -418,6 +763,31 @@ public:
 
     void set_eof(uint64_t eof_cookie);
 
+    /**
+     * Called for every fuse readdirplus call, with the offset queried by
+     * fuse and the number of dirents returned by the server in the last
+     * READDIRPLUS response (0 if the call was served from the cache).
+     */
+    void on_fuse_readdirplus(uint64_t offset, uint64_t num_dirents = 0);
+
+    /**
+     * Directory readahead.
+     * Once fuse is enumerating the directory sequentially (it queries an
+     * offset past the first batch and within the sequence of cookies we
+     * have cached from the start of the directory), we prefetch entries
+     * following seq_last_cookie so that later readdirplus calls can be
+     * served from the cache w/o having to wait for a server roundtrip.
+     *
+     * start_prefetch() returns true if a prefetch READDIRPLUS must be issued
+     * now, and sets cookie to the cookie to query. Caller must then issue
+     * the READDIRPLUS and call prefetch_done() from its callback.
+     * Prefetch is not done if the directory has reached eof, if the cache
+     * is invalid, if we are already prefetch_depth batches ahead of fuse,
+     * or if adding another batch may exceed the readdir cache limits.
+     */
+    bool start_prefetch(cookie3& cookie);
+    void prefetch_done(uint64_t num_dirents);
+
     /**
      * Given a filename, returns the cookie corresponding to that.
      * The cookie returned is the one returned for this filename, by the latest
@@ -428,8 +798,8 @@ public:
      */
     cookie3 filename_to_cookie(const char *filename) const
     {
-        const auto it = dnlc_map.find(filename);
-        const cookie3 cookie = (it == dnlc_map.end()) ? 0 : it->second;
+        const struct directory_entry *de = dnlc_map.find(filename);
+        const cookie3 cookie = de ? de->cookie : 0;
 
 #ifndef ENABLE_NON_AZURE_NFS
         /*
@@ -506,6 +876,25 @@ public:
      */
     void clear_if_needed();
 
+    /**
+     * Free up to max_entries of the entries retired by a deferred purge,
+     * oldest generation first. Also deletes the inodes for which this was
+     * the last ref. Returns the number of retired entries still left,
+     * caller must call again if it's not 0.
+     *
+     * LOCKS: Exclusive readdircache_lock_2, but not while deleting inodes.
+     */
+    uint64_t reclaim_retired(uint64_t max_entries);
+
+    /**
+     * Cache generation, incremented every time the cache is logically
+     * purged by a deferred invalidation.
+     */
+    uint64_t get_generation() const
+    {
+        return generation;
+    }
+
     /*
      * Global stats for all caches.
      */
@@ -520,5 +909,8 @@ public:
     static std::atomic<uint64_t> num_dirents_returned_g;
     // Total bytes consumed by all readdir caches.
     static std::atomic<uint64_t> bytes_allocated_g;
+    // Prefetch READDIRPLUS RPCs issued and dirents fetched by them.
+    static std::atomic<uint64_t> num_prefetch_calls_g;
+    static std::atomic<uint64_t> num_dirents_prefetched_g;
 };
 #endif /* __READDIR_RPC_TASK___ */
@@ -3,9 +3,13 @@
 
 #include <atomic>
 #include <mutex>
+#include <algorithm>
 
 #include "aznfsc.h"
 #include "libnfs-raw.h"
+#include "usdt.h"
+
+struct nfs_connection;
 
 namespace aznfsc {
 
@@ -18,6 +22,154 @@ static const int NFS3ERR_RPC_ERROR = 999999;
 #define NFS_STATUS(r) ((r) ? (r)->status : NFS3ERR_SERVERFAULT)
 #define NFS_STATUSX(rpc_status, r) (((rpc_status) == RPC_STATUS_SUCCESS) ? NFS_STATUS(r) : (nfsstat3) NFS3ERR_RPC_ERROR)
 
+/**
+ * Lock-free log-linear (HDR style) histogram of latencies in usecs.
+ *
+ * Values less than LAT_HIST_SUB_BUCKETS get one bucket each, after that
+ * every power of 2 range [2^e, 2^(e+1)) is divided into LAT_HIST_SUB_BUCKETS
+ * equal sized buckets, so the relative error of any value reported is less
+ * than 1/LAT_HIST_SUB_BUCKETS (~6%) over the entire range. Values of
+ * 2^(LAT_HIST_MAX_EXP+1) usecs (~38 hours) or more are counted in the last
+ * bucket.
+ *
+ * record() is a single relaxed atomic increment, so it's cheap enough to be
+ * called for every RPC. Readers take a snapshot() of the counts and compute
+ * percentiles from the snapshot, the snapshot may not be an exact point in
+ * time view if RPCs are completing, which is fine for stats.
+ */
+#define LAT_HIST_SUB_BITS       4
+#define LAT_HIST_SUB_BUCKETS    (1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_MAX_EXP        36
+#define LAT_HIST_BUCKETS        ((LAT_HIST_MAX_EXP - LAT_HIST_SUB_BITS + 2) * \
+                                 LAT_HIST_SUB_BUCKETS)
+
+struct latency_histogram
+{
+    std::atomic<uint64_t> counts[LAT_HIST_BUCKETS] = {};
+
+    void record(uint64_t usec)
+    {
+        counts[bucket_index(usec)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static int bucket_index(uint64_t usec)
+    {
+        if (usec < LAT_HIST_SUB_BUCKETS) {
+            return usec;
+        }
+
+        const int e = 63 - __builtin_clzll(usec);
+        assert(e >= LAT_HIST_SUB_BITS);
+
+        if (e > LAT_HIST_MAX_EXP) {
+            return LAT_HIST_BUCKETS - 1;
+        }
+
+        const int idx = ((e - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB_BUCKETS) +
+                        ((usec >> (e - LAT_HIST_SUB_BITS)) - LAT_HIST_SUB_BUCKETS);
+        assert(idx < LAT_HIST_BUCKETS);
+        return idx;
+    }
+
+    /**
+     * Largest value which falls in bucket idx.
+     */
+    static uint64_t bucket_max(int idx)
+    {
+        assert(idx >= 0 && idx < LAT_HIST_BUCKETS);
+
+        if (idx < LAT_HIST_SUB_BUCKETS) {
+            return idx;
+        }
+
+        const int e = (idx / LAT_HIST_SUB_BUCKETS) + LAT_HIST_SUB_BITS - 1;
+        const uint64_t sub = idx % LAT_HIST_SUB_BUCKETS;
+        const uint64_t width = 1ULL << (e - LAT_HIST_SUB_BITS);
+
+        return ((LAT_HIST_SUB_BUCKETS + sub) * width) + width - 1;
+    }
+
+    /**
+     * Copy the counts into snap[] and return the total count.
+     * If reset is true the counts are atomically moved into snap[], so the
+     * histogram starts afresh w/o losing any concurrently recorded value.
+     */
+    uint64_t snapshot(uint64_t snap[LAT_HIST_BUCKETS], bool reset)
+    {
+        uint64_t total = 0;
+
+        for (int i = 0; i < LAT_HIST_BUCKETS; i++) {
+            snap[i] = reset ? counts[i].exchange(0, std::memory_order_relaxed) :
+                              counts[i].load(std::memory_order_relaxed);
+            total += snap[i];
+        }
+
+        return total;
+    }
+
+    /**
+     * Return the value at the given percentile (0 < pct <= 100) from a
+     * snapshot returned by snapshot(). The value returned is the largest
+     * value of the bucket the percentile falls in, so it's never
+     * under-reported.
+     */
+    static uint64_t percentile(const uint64_t snap[LAT_HIST_BUCKETS],
+                               uint64_t total,
+                               double pct);
+};
+
+/**
+ * QoS class of an RPC, decided by its type.
+ * Data RPCs (READ, WRITE and COMMIT) carry up to rsize/wsize bytes each while
+ * metadata RPCs are small and latency sensitive (ls, stat). If
+ * sys.qos.meta_connections is set, metadata RPCs go over connections
+ * reserved for them so that they don't queue behind megabytes of data, see
+ * rpc_transport::get_nfs_connection().
+ */
+typedef enum
+{
+    QOS_CLASS_DATA  = 0,
+    QOS_CLASS_META  = 1,
+    QOS_CLASS_MAX   = 2,
+} qos_class_t;
+
+static inline
+qos_class_t get_qos_class(enum fuse_opcode optype)
+{
+    switch (optype) {
+        case FUSE_READ:
+        case FUSE_WRITE:
+        // COMMIT RPCs are issued by FUSE_FLUSH tasks.
+        case FUSE_FLUSH:
+            return QOS_CLASS_DATA;
+        default:
+            return QOS_CLASS_META;
+    }
+}
+
+static inline
+const char *qos_class_to_string(qos_class_t qos)
+{
+    assert(qos >= QOS_CLASS_DATA && qos < QOS_CLASS_MAX);
+    return (qos == QOS_CLASS_DATA) ? "data" : "meta";
+}
+
+/**
+ * Stats for all RPCs of a QoS class.
+ * These tell how long RPCs of each class waited in libnfs queues to be sent
+ * and for the response, so we can verify that metadata latencies don't go
+ * up under data load.
+ */
+struct rpc_qosstat
+{
+    std::atomic<uint64_t> count = 0;
+    std::atomic<uint64_t> dispatch_usec = 0;
+    std::atomic<uint64_t> rtt_usec = 0;
+
+    struct latency_histogram dispatch_hist;
+    struct latency_histogram rtt_hist;
+};
+
 /**
  * Stats for a specific RPC (actually FUSE_*) type.
  */
@@ -79,6 +231,17 @@ struct rpc_opstat
      */
     std::atomic<uint64_t> fuse_handler_usec = 0;
 
+    /*
+     * Latency distribution of rtt_usec, dispatch_usec, total_usec and
+     * fuse_handler_usec, for reporting percentiles.
+     * If sys.stats_reset_on_dump is set these are reset by every
+     * dump_stats(), so they convey the latencies since the last dump.
+     */
+    struct latency_histogram rtt_hist;
+    struct latency_histogram dispatch_hist;
+    struct latency_histogram total_hist;
+    struct latency_histogram fuse_handler_hist;
+
     /*
      * Error map to store all the errors encountered by the given api.
      * This is guarded by rpc_stats_az::stats_lock_42.
@@ -86,6 +249,234 @@ struct rpc_opstat
     std::map<int /*error status*/, uint64_t /*error count*/> error_map;
 };
 
+/**
+ * Per-connection load and latency stats.
+ * One of these is embedded in every nfs_connection. An RPC is bound to the
+ * connection it's issued on (see rpc_task::get_nfs_context()) and the
+ * rpc_stats_az event handlers update these as the RPC is issued and
+ * completed. The CONN_SCHED_P2C_* connection schedulers use get_cost() to
+ * steer new RPCs away from loaded or slow connections.
+ *
+ * inflight_rpcs:  RPCs issued on this connection, awaiting response.
+ * inflight_bytes: Data bytes (READ/WRITE payload) of inflight_rpcs.
+ * ewma_rtt_usec:  Exponentially weighted moving average of the server
+ *                 processing time (complete - dispatch), with weight 1/8 for
+ *                 the latest sample.
+ * num_rpcs:       RPCs completed on this connection.
+ * cum_rtt_usec:   Cumulative RTT of num_rpcs.
+ * max_rtt_usec:   Largest RTT seen.
+ * bytes_sent/bytes_rcvd: Cumulative request/response bytes, including RPC
+ *                 header.
+ * num_jukebox:    RPCs failed with NFS3ERR_JUKEBOX on this connection.
+ *
+ * Note: ewma_rtt_usec and max_rtt_usec are updated w/o any lock, so we may
+ *       occasionally lose an update. That's ok for their use.
+ */
+struct conn_stats
+{
+    // Connection these stats belong to.
+    struct nfs_connection *const conn;
+
+    std::atomic<int64_t> inflight_rpcs = 0;
+    std::atomic<int64_t> inflight_bytes = 0;
+    std::atomic<uint64_t> ewma_rtt_usec = 0;
+    std::atomic<uint64_t> num_rpcs = 0;
+    std::atomic<uint64_t> cum_rtt_usec = 0;
+    std::atomic<uint64_t> max_rtt_usec = 0;
+    std::atomic<uint64_t> bytes_sent = 0;
+    std::atomic<uint64_t> bytes_rcvd = 0;
+    std::atomic<uint64_t> num_jukebox = 0;
+
+    /*
+     * Health of the connection, used by rpc_transport::check_endpoints().
+     * consec_errors is the number of RPCs which failed with an RPC error
+     * (timeout, connection loss) since the last RPC that got a response.
+     * busy_since_usec is when the connection last went from idle to having
+     * RPCs inflight, last_complete_usec is when the last RPC completed.
+     */
+    std::atomic<uint64_t> num_rpc_errors = 0;
+    std::atomic<uint64_t> consec_errors = 0;
+    std::atomic<uint64_t> busy_since_usec = 0;
+    std::atomic<uint64_t> last_complete_usec = 0;
+
+    /*
+     * Jukebox retry budget of this connection. This is a token bucket which
+     * allows up to 'per_sec' retries to be reissued every second, with bursts
+     * of up to 'per_sec'. Only accessed by nfs_client::jukebox_runner(), so
+     * no lock needed.
+     */
+    int64_t jukebox_tokens = -1;
+    int64_t jukebox_refill_msecs = 0;
+
+    conn_stats(struct nfs_connection *_conn) :
+        conn(_conn)
+    {
+        assert(conn != nullptr);
+    }
+
+    void on_issue(uint64_t io_bytes)
+    {
+        if (inflight_rpcs++ == 0) {
+            busy_since_usec = get_current_usecs();
+        }
+        inflight_bytes += io_bytes;
+    }
+
+    void on_cancel(uint64_t io_bytes)
+    {
+        assert(inflight_rpcs > 0);
+        assert(inflight_bytes >= (int64_t) io_bytes);
+        inflight_rpcs--;
+        inflight_bytes -= io_bytes;
+    }
+
+    void on_complete(uint64_t io_bytes, uint64_t rtt_usec,
+                     size_t req_size, size_t resp_size)
+    {
+        on_cancel(io_bytes);
+
+        const uint64_t ewma = ewma_rtt_usec;
+        ewma_rtt_usec = (ewma == 0) ? rtt_usec :
+                                      ((ewma * 7 + rtt_usec) / 8);
+        if (rtt_usec > max_rtt_usec) {
+            max_rtt_usec = rtt_usec;
+        }
+
+        num_rpcs++;
+        cum_rtt_usec += rtt_usec;
+        bytes_sent += req_size;
+        bytes_rcvd += resp_size;
+    }
+
+    /**
+     * Record the outcome of an RPC completed over this connection.
+     * rpc_error is true if the RPC didn't get a response from the server.
+     */
+    void on_rpc_status(bool rpc_error, uint64_t complete_usec)
+    {
+        if (rpc_error) {
+            num_rpc_errors++;
+            consec_errors++;
+        } else {
+            consec_errors = 0;
+        }
+
+        last_complete_usec = complete_usec;
+    }
+
+    /**
+     * Is this connection failing to get responses from the server?
+     * That's the case if the last few RPCs all failed with RPC errors, or
+     * if RPCs are inflight but none has completed for stall_usecs.
+     */
+    bool is_unhealthy(uint64_t now_usec, uint64_t max_errors,
+                      uint64_t stall_usecs) const
+    {
+        if (consec_errors >= max_errors) {
+            return true;
+        }
+
+        if (inflight_rpcs <= 0) {
+            return false;
+        }
+
+        const uint64_t since = std::max<uint64_t>(busy_since_usec,
+                                                  last_complete_usec);
+        return (now_usec > since) && ((now_usec - since) > stall_usecs);
+    }
+
+    /**
+     * Estimated cost of sending a new RPC over this connection, lower is
+     * better. Every RPC ahead of us costs roughly one RTT worth of time and
+     * inflight data bytes add transfer time. We don't know the connection
+     * b/w so we count every MiB of inflight data as one more RPC.
+     * Connections with no completed RPCs yet have 0 RTT and are preferred,
+     * which gets us RTT samples for them.
+     */
+    uint64_t get_cost() const
+    {
+        const uint64_t rtt = std::max<uint64_t>(ewma_rtt_usec, 1);
+        const uint64_t load = 1 + std::max<int64_t>(inflight_rpcs, 0) +
+                              (std::max<int64_t>(inflight_bytes, 0) >> 20);
+        return rtt * load;
+    }
+
+    /**
+     * Take one token from the jukebox retry budget, returns false if the
+     * budget is exhausted, in which case the retry must be deferred.
+     */
+    bool consume_jukebox_token(int64_t now_msecs, int64_t per_sec)
+    {
+        assert(per_sec > 0);
+
+        // First use, start with a full bucket.
+        if (jukebox_tokens < 0) {
+            jukebox_tokens = per_sec;
+            jukebox_refill_msecs = now_msecs;
+        }
+
+        const int64_t elapsed_msecs = now_msecs - jukebox_refill_msecs;
+        const int64_t refill = (elapsed_msecs * per_sec) / 1000;
+        if (refill > 0) {
+            jukebox_tokens = std::min(jukebox_tokens + refill, per_sec);
+            jukebox_refill_msecs = now_msecs;
+        }
+
+        if (jukebox_tokens == 0) {
+            return false;
+        }
+
+        jukebox_tokens--;
+        return true;
+    }
+};
+
+/**
+ * Number of buckets in the jukebox delay histogram. Bucket 0 counts delays
+ * less than 1ms, bucket i counts delays in [2^(i-1), 2^i) ms and the last
+ * bucket counts everything larger.
+ */
+#define JUKEBOX_DELAY_HIST_BUCKETS 20
+
+/**
+ * Number of slowest requests whose per-stage latency breakdown is kept in the
+ * trace ring, see rpc_stats_az::record_slowest(). Requests faster than
+ * RPC_TRACE_MIN_USEC are never recorded, so that the common case doesn't
+ * take the trace lock while the ring is filling up.
+ */
+#define RPC_TRACE_SLOWEST   32
+#define RPC_TRACE_MIN_USEC  1000
+
+/**
+ * Per-stage latency breakdown of one request, as recorded in the trace ring.
+ * All times are in usecs, stages which the request didn't go through (f.e.,
+ * requests served from the cache are never issued) are 0.
+ *
+ * alloc_wait: Time spent waiting for a free rpc_task (create - start).
+ * pre_issue:  Time from rpc_task creation till the RPC was issued to libnfs,
+ *             this includes waiting for membuf locks and for the cache.
+ * dispatch:   Time the RPC was queued in libnfs (dispatch - issue).
+ * rtt:        Server RTT (complete - dispatch).
+ * pre_reply:  Time from completion (or creation, for requests not issued)
+ *             till we replied to fuse, or till free for requests that don't
+ *             reply to fuse, f.e., flush WRITEs.
+ * reply:      Time from replying to fuse till the rpc_task was freed.
+ */
+struct rpc_trace_entry
+{
+    enum fuse_opcode optype = (fuse_opcode) 0;
+    uint64_t start_usec = 0;
+    uint64_t total_usec = 0;
+    uint64_t alloc_wait_usec = 0;
+    uint64_t pre_issue_usec = 0;
+    uint64_t dispatch_usec = 0;
+    uint64_t rtt_usec = 0;
+    uint64_t pre_reply_usec = 0;
+    uint64_t reply_usec = 0;
+    size_t req_size = 0;
+    size_t resp_size = 0;
+};
+
 /**
  * Class for maintaining RPC stats.
  * An object of this must be included in rpc_task and user must call designated
@@ -121,11 +512,20 @@ public:
         stamp.issue = 0;
         stamp.dispatch = 0;
         stamp.complete = 0;
+        stamp.reply = 0;
         stamp.free = 0;
         req_size = 0;
         resp_size = 0;
 
+        // Must have been unbound when the last RPC completed.
+        assert(cstats == nullptr);
+        cstats_bytes = 0;
+        jukebox_cstats = nullptr;
+
         assert(stamp.create >= stamp.start);
+
+        AZNFSC_PROBE4(rpc_alloc, this, (int) optype, stamp.start,
+                      stamp.create);
     }
 
     /**
@@ -145,6 +545,8 @@ public:
 
         assert(optype > 0 && optype <= FUSE_OPCODE_MAX);
         opstats[optype].pending++;
+
+        AZNFSC_PROBE3(rpc_issue, this, (int) optype, stamp.issue);
     }
 
     /**
@@ -159,11 +561,65 @@ public:
         assert(stamp.complete == 0);
         stamp.issue = 0;
 
+        if (cstats) {
+            cstats->on_cancel(cstats_bytes);
+            cstats = nullptr;
+        }
+
         assert(optype > 0 && optype <= FUSE_OPCODE_MAX);
         assert(opstats[optype].pending > 0);
         opstats[optype].pending--;
     }
 
+    /**
+     * Returns true if the RPC has been issued and we haven't yet got the
+     * response.
+     */
+    bool is_issued() const
+    {
+        return (stamp.issue != 0) && (stamp.complete == 0);
+    }
+
+    /**
+     * RTT of the RPC, i.e., time from when it was dispatched to the server
+     * till the response was received. 0 if the RPC has not yet completed.
+     */
+    uint64_t get_rtt_usecs() const
+    {
+        return (stamp.complete != 0) ? (stamp.complete - stamp.dispatch) : 0;
+    }
+
+    /**
+     * Bind the issued RPC to the connection it's being sent on.
+     * io_bytes is the READ/WRITE payload size, 0 for other RPCs.
+     * The binding is dropped when the RPC completes or is cancelled.
+     */
+    void on_rpc_conn(struct conn_stats *_cstats, uint64_t io_bytes)
+    {
+        assert(is_issued());
+        assert(cstats == nullptr);
+        assert(_cstats != nullptr);
+
+        cstats = _cstats;
+        cstats_bytes = io_bytes;
+        cstats->on_issue(io_bytes);
+    }
+
+    struct conn_stats *get_conn_stats() const
+    {
+        return cstats;
+    }
+
+    /**
+     * Stats of the connection on which the RPC failed with NFS3ERR_JUKEBOX,
+     * the retry is charged to this connection's jukebox retry budget.
+     * nullptr if the RPC didn't fail with JUKEBOX.
+     */
+    struct conn_stats *get_jukebox_conn_stats() const
+    {
+        return jukebox_cstats;
+    }
+
     /**
      * Event handler method to be called when the RPC completes, i.e., when
      * the libnfs callback is called.
@@ -191,10 +647,28 @@ public:
         stamp.complete = get_current_usecs();
         assert(stamp.complete > stamp.dispatch);
 
+        AZNFSC_PROBE4(rpc_send, this, (int) optype, stamp.issue,
+                      stamp.dispatch);
+        AZNFSC_PROBE5(rpc_complete, this, (int) optype, (int) status,
+                      stamp.dispatch, stamp.complete);
+
         assert(optype > 0 && optype <= FUSE_OPCODE_MAX);
         assert(opstats[optype].pending > 0);
         opstats[optype].pending--;
 
+        if (cstats) {
+            cstats->on_complete(cstats_bytes,
+                                stamp.complete - stamp.dispatch,
+                                req_size, resp_size);
+            cstats->on_rpc_status(status == NFS3ERR_RPC_ERROR,
+                                  stamp.complete);
+            if (status == NFS3ERR_JUKEBOX) {
+                cstats->num_jukebox++;
+                jukebox_cstats = cstats;
+            }
+            cstats = nullptr;
+        }
+
         if (status != NFS3_OK) {
             /*
              * This thread will block till it obtains the lock.
@@ -211,6 +685,20 @@ public:
         }
     }
 
+    /**
+     * Event handler method to be called right before replying to fuse.
+     * Requests that don't reply to fuse (f.e., flush WRITEs or readahead
+     * READs) don't call it, and a request can reply only once.
+     */
+    void on_fuse_reply()
+    {
+        assert(stamp.reply == 0);
+        stamp.reply = get_current_usecs();
+        assert(stamp.reply >= stamp.create);
+
+        AZNFSC_PROBE2(rpc_reply, this, (int) optype);
+    }
+
     /**
      * Event handler method to be called right before the RPC is freed.
      */
@@ -238,6 +726,17 @@ public:
             opstats[optype].rtt_usec += (stamp.complete - stamp.dispatch);
             opstats[optype].dispatch_usec += (stamp.dispatch - stamp.issue);
             opstats[optype].total_usec += (stamp.complete - stamp.start);
+
+            opstats[optype].rtt_hist.record(stamp.complete - stamp.dispatch);
+            opstats[optype].dispatch_hist.record(stamp.dispatch - stamp.issue);
+            opstats[optype].total_hist.record(stamp.complete - stamp.start);
+
+            struct rpc_qosstat& qs = qosstats[get_qos_class(optype)];
+            qs.count++;
+            qs.dispatch_usec += (stamp.dispatch - stamp.issue);
+            qs.rtt_usec += (stamp.complete - stamp.dispatch);
+            qs.dispatch_hist.record(stamp.dispatch - stamp.issue);
+            qs.rtt_hist.record(stamp.complete - stamp.dispatch);
         } else if (stamp.issue == 0) {
             /*
              * Requests not issued.
@@ -266,6 +765,28 @@ public:
             assert(stamp.complete == 0);
 
             AZLogWarn("Didn't get response for RPC request type {}", (int) optype);
+
+            // Not inflight anymore.
+            if (cstats) {
+                cstats->on_cancel(cstats_bytes);
+                cstats = nullptr;
+            }
+        }
+
+        if (stamp.free == 0) {
+            stamp.free = get_current_usecs();
+        }
+
+        AZNFSC_PROBE4(rpc_free, this, (int) optype, stamp.start, stamp.free);
+
+        /*
+         * Cheap check for the common case of the request not being slow
+         * enough to make it to the trace ring.
+         */
+        const uint64_t total_usec = stamp.free - stamp.start;
+        if (total_usec >= RPC_TRACE_MIN_USEC &&
+            total_usec > slowest_min_usec.load(std::memory_order_relaxed)) {
+            record_slowest(total_usec);
         }
     }
 
@@ -281,11 +802,28 @@ public:
      */
     static void dump_stats();
 
+    /**
+     * Return the current stats in a machine readable format, Prometheus
+     * text exposition format if json is false, else JSON.
+     * Unlike dump_stats() this only reads counters, it doesn't walk the
+     * inodes and never resets the latency histograms, so it's cheap enough
+     * to be scraped every few seconds. See metrics_server.
+     */
+    static std::string get_metrics(bool json);
+
 private:
     enum fuse_opcode optype = (fuse_opcode) 0;
     size_t req_size = 0;
     size_t resp_size = 0;
 
+    /*
+     * Stats of the connection the current RPC is issued on and the payload
+     * bytes accounted in cstats->inflight_bytes, see on_rpc_conn().
+     */
+    struct conn_stats *cstats = nullptr;
+    uint64_t cstats_bytes = 0;
+    struct conn_stats *jukebox_cstats = nullptr;
+
     /*
      * Timestamp in microseconds for various stages of the RPC.
      *
@@ -303,6 +841,8 @@ private:
      * complete:  When the libnfs async method completes and the callback is
      *            called. (complete - dispatch) is the time taken by the
      *            server to process the RPC.
+     * reply:     When we replied to fuse, 0 for requests which don't reply
+     *            to fuse.
      * free:      When free_rpc_task() was called.
      */
     struct {
@@ -311,14 +851,39 @@ private:
         uint64_t issue = 0;
         uint64_t dispatch = 0;
         uint64_t complete = 0;
+        uint64_t reply = 0;
         uint64_t free = 0;
     } stamp;
 
+    /**
+     * Record this request in the trace ring if it's slower than the fastest
+     * request in there, replacing that one.
+     */
+    void record_slowest(uint64_t total_usec) const;
+
+    /*
+     * Trace ring of the RPC_TRACE_SLOWEST slowest requests since the last
+     * stats reset, in no particular order. slowest_min_usec is the smallest
+     * total_usec in the ring once it's full (0 till then), requests not
+     * slower than that are not recorded. Dumped (and reset, if
+     * sys.stats_reset_on_dump is set) by dump_stats().
+     * Guarded by trace_lock_58.
+     */
+    static struct rpc_trace_entry slowest[RPC_TRACE_SLOWEST];
+    static int num_slowest;
+    static std::atomic<uint64_t> slowest_min_usec;
+    static std::mutex trace_lock_58;
+
     /*
      * Aggregated per-RPC-type stats, for all RPCs issued of a given type.
      */
     static struct rpc_opstat opstats[FUSE_OPCODE_MAX + 1];
 
+    /*
+     * Aggregated per-QoS-class stats.
+     */
+    static struct rpc_qosstat qosstats[QOS_CLASS_MAX];
+
     /*
      * Lock for synchronizing dumping stats and for inserting into error_map.
      */
@@ -334,6 +899,9 @@ public:
      * zero_reads: How many of app_read_reqs we responded with 0 bytes, either
      *             application requested 0 bytes or it was beyond eof.
      * app_bytes_read: Total bytes read by application.
+     * splice_reads: How many of app_read_reqs were replied by splicing the
+     *               data from the membuf cache memfd (fuse_splice_read_reply).
+     * bytes_read_spliced: Bytes returned by those.
      * server_bytes_read: Total bytes that we actually read from
      *      server. Every byte read by application must come from server,
      *      unless application is reading a hole in the cache (see
@@ -349,10 +917,31 @@ public:
      * num_readhead: Number of readahead calls made.
      * bytes_read_ahead: How many bytes were read ahead using num_readhead
      *                   calls.
+     * prefetch_reqs: How many prefetch hints were received from applications.
+     * bytes_prefetched: How many bytes were read by those.
+     * bytes_dontneed_released: How many cached bytes were released on
+     *                          applications' dontneed hints.
+     * small_file_prefetches: How many small files were read whole on open,
+     *                        see sys.small_file_mode. These are counted in
+     *                        prefetch_reqs too.
      * tot_getattr_reqs: How many getattr requests were received from fuse.
      * getattr_served_from_cache: How many were served from inode->attr cache.
+     * getattr_coalesced: How many were answered by the reply of an identical
+     *                    GETATTR already in flight (single-flight).
+     * getattr_served_stale: How many were served from expired inode->attr
+     *                       cache while being revalidated in the background
+     *                       (stale-while-revalidate).
+     * revalidate_coalesced: How many inode revalidations were coalesced with
+     *                       an already queued revalidation of the inode.
+     * revalidate_getattrs: How many GETATTRs were issued by the revalidator.
+     * revalidate_readdirplus: How many times the revalidator revalidated
+     *                         siblings by READDIRPLUS of their parent.
+     * revalidate_by_readdirplus: How many inodes were revalidated by those
+     *                            READDIRPLUS calls, saving a GETATTR each.
      * tot_lookup_reqs: How many lookup requests were received from fuse.
      * lookup_served_from_cache: How many were served from dnlc/lookup cache.
+     * lookup_coalesced: How many were answered by the reply of an identical
+     *                   LOOKUP already in flight (single-flight).
      * app_write_reqs: Total fuse writes requests.
      * failed_write_reqs: How many of app_write_reqs we responded with a failed
      *                   status.
@@ -374,23 +963,81 @@ public:
      *           beyond configured limit.
      * commit_gp: How many time commit was issued as global cache grew beyond
      *           configured limit.
+     * flush_pipelined: How many flushes were issued while earlier flushes
+     *                  were still in progress, to keep the write window full.
+     * bytes_flush_pipelined: Bytes flushed by those.
+     * small_file_stable_flushes: How many small files were flushed with a
+     *                            single FILE_SYNC write instead of unstable
+     *                            write(s) + COMMIT.
+     * server_full_write_reqs: How many of server_write_reqs were full wsize
+     *                        WRITE RPCs.
+     * write_tail_held: How many times a small trailing WRITE was held back
+     *                  from a flush for write-combining with later appends.
+     * bytes_write_tail_held: Bytes held back by those.
+     * evictor_runs: How many times the background evictor had to prune the
+     *               data cache.
+     * bytes_evicted_cold: Bytes of cold (read once) membufs evicted by it.
+     * bytes_evicted_hot: Bytes of hot (re-read) membufs evicted by it, after
+     *                    they aged to cold.
+     * cache_budget_shrinks: How many times the cache budget was reduced due
+     *                      to memory pressure, see mem_pressure.
+     * cache_budget_grows: How many times it was increased back.
+     * cache_purges_deferred: How many times a file/directory cache
+     *                        invalidation was applied by retiring the
+     *                        cached data, to be freed by the reclaimer
+     *                        thread instead of inline.
+     * bytes_purge_deferred: File cache bytes retired by those.
+     * dirents_purge_deferred: Directory entries retired by those.
+     * purge_reclaim_batches: How many batches of retired chunks/entries
+     *                        were freed, ref RECLAIM_PURGE_BATCH.
      * num_sync_membufs: How many times sync_membufs() was called?
      * tot_bytes_sync_membufs: Total bytes flushed by sync_membufs().
+     * rpc_task_alloc_waits: How many rpc_task allocations had to wait for
+     *                       a free rpc_task.
+     * rpc_task_alloc_wait_usecs: Total time spent waiting by those.
+     * rpc_task_alloc_max_wait_usecs: Longest wait seen.
+     * jukebox_retries: How many RPCs were queued for retry after failing
+     *                  with NFS3ERR_JUKEBOX.
+     * jukebox_deferred: How many times a due jukebox retry had to be
+     *                   deferred as its connection's retry budget was
+     *                   exhausted.
+     * jukebox_queued: Jukebox retries currently queued.
+     * endpoints_marked_down: How many times a server endpoint was taken out
+     *                        of connection selection for being unhealthy,
+     *                        see rpc_transport::check_endpoints().
+     * endpoints_restored: How many times a down endpoint was put back.
+     * jukebox_max_queued: Max jukebox retries queued at any time.
+     * jukebox_delay_hist: Histogram of the time jukebox retries were queued
+     *                     before being reissued, in msecs, see
+     *                     JUKEBOX_DELAY_HIST_BUCKETS.
      */
     static std::atomic<uint64_t> app_read_reqs;
     static std::atomic<uint64_t> server_read_reqs;
     static std::atomic<uint64_t> failed_read_reqs;
     static std::atomic<uint64_t> zero_reads;
     static std::atomic<uint64_t> app_bytes_read;
+    static std::atomic<uint64_t> splice_reads;
+    static std::atomic<uint64_t> bytes_read_spliced;
     static std::atomic<uint64_t> server_bytes_read;
     static std::atomic<uint64_t> bytes_read_from_cache;
     static std::atomic<uint64_t> bytes_zeroed_from_cache;
     static std::atomic<uint64_t> bytes_read_ahead;
     static std::atomic<uint64_t> num_readhead;
+    static std::atomic<uint64_t> prefetch_reqs;
+    static std::atomic<uint64_t> bytes_prefetched;
+    static std::atomic<uint64_t> bytes_dontneed_released;
+    static std::atomic<uint64_t> small_file_prefetches;
     static std::atomic<uint64_t> tot_getattr_reqs;
     static std::atomic<uint64_t> getattr_served_from_cache;
+    static std::atomic<uint64_t> getattr_coalesced;
+    static std::atomic<uint64_t> getattr_served_stale;
+    static std::atomic<uint64_t> revalidate_coalesced;
+    static std::atomic<uint64_t> revalidate_getattrs;
+    static std::atomic<uint64_t> revalidate_readdirplus;
+    static std::atomic<uint64_t> revalidate_by_readdirplus;
     static std::atomic<uint64_t> tot_lookup_reqs;
     static std::atomic<uint64_t> lookup_served_from_cache;
+    static std::atomic<uint64_t> lookup_coalesced;
     static std::atomic<uint64_t> app_write_reqs;
     static std::atomic<uint64_t> server_write_reqs;
     static std::atomic<uint64_t> failed_write_reqs;
@@ -405,12 +1052,47 @@ public:
     static std::atomic<uint64_t> flush_gp;
     static std::atomic<uint64_t> commit_lp;
     static std::atomic<uint64_t> commit_gp;
+    static std::atomic<uint64_t> flush_pipelined;
+    static std::atomic<uint64_t> bytes_flush_pipelined;
+    static std::atomic<uint64_t> small_file_stable_flushes;
+    static std::atomic<uint64_t> server_full_write_reqs;
+    static std::atomic<uint64_t> write_tail_held;
+    static std::atomic<uint64_t> bytes_write_tail_held;
+    static std::atomic<uint64_t> evictor_runs;
+    static std::atomic<uint64_t> bytes_evicted_cold;
+    static std::atomic<uint64_t> bytes_evicted_hot;
+    static std::atomic<uint64_t> cache_budget_shrinks;
+    static std::atomic<uint64_t> cache_budget_grows;
+    static std::atomic<uint64_t> cache_purges_deferred;
+    static std::atomic<uint64_t> bytes_purge_deferred;
+    static std::atomic<uint64_t> dirents_purge_deferred;
+    static std::atomic<uint64_t> purge_reclaim_batches;
     static std::atomic<uint64_t> num_sync_membufs;
     static std::atomic<uint64_t> tot_bytes_sync_membufs;
 
     static std::atomic<uint64_t> rpc_tasks_allocated;
+    static std::atomic<uint64_t> rpc_task_alloc_waits;
+    static std::atomic<uint64_t> rpc_task_alloc_wait_usecs;
+    static std::atomic<uint64_t> rpc_task_alloc_max_wait_usecs;
     static std::atomic<uint64_t> fuse_responses_awaited;
     static std::atomic<uint64_t> fuse_reply_failed;
+    static std::atomic<uint64_t> jukebox_retries;
+    static std::atomic<uint64_t> jukebox_deferred;
+    static std::atomic<uint64_t> jukebox_queued;
+    static std::atomic<uint64_t> endpoints_marked_down;
+    static std::atomic<uint64_t> endpoints_restored;
+    static std::atomic<uint64_t> jukebox_max_queued;
+    static std::atomic<uint64_t> jukebox_delay_hist[JUKEBOX_DELAY_HIST_BUCKETS];
+
+    static void on_jukebox_reissue(uint64_t delay_msecs)
+    {
+        int bucket = 0;
+        while (delay_msecs && bucket < (JUKEBOX_DELAY_HIST_BUCKETS - 1)) {
+            delay_msecs >>= 1;
+            bucket++;
+        }
+        jukebox_delay_hist[bucket]++;
+    }
 };
 
 #define INC_GBL_STATS(var, inc)  rpc_stats_az::var += (inc)
@@ -431,6 +1113,7 @@ struct fuse_req_stats
         assert((int64_t) handler_usec >= 0);
 
         rpc_stats_az::opstats[optype].fuse_handler_usec += handler_usec;
+        rpc_stats_az::opstats[optype].fuse_handler_hist.record(handler_usec);
     }
 
     const enum fuse_opcode optype = (fuse_opcode) 0;
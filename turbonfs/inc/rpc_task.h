@@ -9,6 +9,9 @@
 #include <vector>
 #include <set>
 #include <thread>
+#include <memory>
+#include <atomic>
+#include <condition_variable>
 
 #include "nfs_client.h"
 #include "file_cache.h"
@@ -466,7 +469,7 @@ struct bc_iovec
              * flushed as flush callbacks can start getting called anytime after
              * this.
              */
-            inode->get_fcsm()->add_flushing(bc.length);
+            flush_seq = inode->get_fcsm()->add_flushing(bc.length);
 
             return true;
         } else if (((offset + length) == bc.offset) &&
@@ -479,7 +482,7 @@ struct bc_iovec
             iovcnt++;
             mb->set_flushing();
             bcq.emplace(bc);
-            inode->get_fcsm()->add_flushing(bc.length);
+            inode->get_fcsm()->add_flushing(bc.length, flush_seq);
 
             return true;
         }
@@ -520,6 +523,13 @@ struct bc_iovec
     uint64_t orig_offset = 0;
     uint64_t orig_length = 0;
 
+    /*
+     * fcsm seq number of the first byte of this write, as returned by
+     * fcsm::add_flushing(). [flush_seq, flush_seq+orig_length) is the
+     * range of seq numbers flushed by this write.
+     */
+    uint64_t flush_seq = 0;
+
     /*
      * Hold refs to the bytes_chunks.
      * add_bc() adds new bytes_chunk to the front of this and on_io_complete()
@@ -1262,6 +1272,19 @@ public:
         return cv2i(cookie_verifier);
     }
 
+    void set_prefetch(bool _prefetch)
+    {
+        prefetch = _prefetch;
+    }
+
+    /**
+     * Is this a directory readahead READDIRPLUS issued by us and not by fuse?
+     */
+    bool is_prefetch() const
+    {
+        return prefetch;
+    }
+
 private:
     // Inode of the directory.
     fuse_ino_t inode;
@@ -1283,6 +1306,9 @@ private:
     fuse_file_info file;
     fuse_file_info* file_ptr;
     cookieverf3 cookie_verifier;
+
+    // Directory readahead READDIRPLUS, see init_readdirplus_prefetch().
+    bool prefetch;
 };
 
 struct read_rpc_task
@@ -1447,6 +1473,13 @@ struct api_task_info
      */
     enum fuse_opcode optype = (fuse_opcode) 0;
 
+    /*
+     * How many times this request has failed with NFS3ERR_JUKEBOX and been
+     * retried, used for computing the backoff delay for the next retry.
+     * See nfs_client::jukebox_reissue_retries.
+     */
+    uint32_t num_jukebox_retries = 0;
+
     /*
      * Proxy operation type.
      * If the RPC task is issued on behalf of another task, this will be set
@@ -2035,6 +2068,13 @@ public:
                          off_t target_offset,
                          struct fuse_file_info *file);
 
+    /*
+     * Directory readahead READDIRPLUS, not associated with any fuse request.
+     * Entries fetched are only added to the readdir cache.
+     * See readdirectory_cache::start_prefetch().
+     */
+    void init_readdirplus_prefetch(fuse_ino_t inode, off_t offset);
+
     void run_readdirplus();
 
     // This function is responsible for setting up the members of read task.
@@ -2053,14 +2093,14 @@ public:
     void set_csched(conn_sched_t _csched)
     {
         assert(_csched > CONN_SCHED_INVALID &&
-               _csched <= CONN_SCHED_FH_HASH);
+               _csched <= CONN_SCHED_P2C_W);
         csched = _csched;
     }
 
     conn_sched_t get_csched() const
     {
         assert(csched > CONN_SCHED_INVALID &&
-               csched <= CONN_SCHED_FH_HASH);
+               csched <= CONN_SCHED_P2C_W);
         return csched;
     }
 
@@ -2113,11 +2153,19 @@ public:
         return stats;
     }
 
-    struct nfs_context *get_nfs_context() const;
+    /**
+     * Returns the nfs_context to send this task's RPC over, as per the
+     * task's connection scheduling type.
+     * If called after stats.on_rpc_issue(), the RPC is bound to the selected
+     * connection, which accounts it in the connection's conn_stats until
+     * the RPC completes. Further calls for the same issue return the same
+     * connection. io_bytes is the READ/WRITE payload size.
+     */
+    struct nfs_context *get_nfs_context(uint64_t io_bytes = 0);
 
-    struct rpc_context *get_rpc_ctx() const
+    struct rpc_context *get_rpc_ctx(uint64_t io_bytes = 0)
     {
-        return nfs_get_rpc_context(get_nfs_context());
+        return nfs_get_rpc_context(get_nfs_context(io_bytes));
     }
 
     nfs_client *get_client() const
@@ -2141,6 +2189,7 @@ public:
     void reply_error(int rc)
     {
         assert(rc >= 0);
+        stats.on_fuse_reply();
         const int fre = fuse_reply_err(get_fuse_req(), rc);
         if (fre != 0) {
             INC_GBL_STATS(fuse_reply_failed, 1);
@@ -2156,6 +2205,7 @@ public:
 
     void reply_statfs(const struct statvfs *statbuf)
     {
+        stats.on_fuse_reply();
         const int fre = fuse_reply_statfs(get_fuse_req(), statbuf);
         if (fre != 0) {
             INC_GBL_STATS(fuse_reply_failed, 1);
@@ -2171,6 +2221,7 @@ public:
 
     void reply_readlink(const char *linkname)
     {
+        stats.on_fuse_reply();
         const int fre = fuse_reply_readlink(get_fuse_req(), linkname);
         if (fre != 0) {
             INC_GBL_STATS(fuse_reply_failed, 1);
@@ -2186,6 +2237,7 @@ public:
 
     void reply_attr(const struct stat& attr, double attr_timeout)
     {
+        stats.on_fuse_reply();
         const int fre = fuse_reply_attr(get_fuse_req(), &attr, attr_timeout);
         if (fre != 0) {
             INC_GBL_STATS(fuse_reply_failed, 1);
@@ -2217,6 +2269,7 @@ public:
          */
         assert(num_ongoing_backend_writes == 0);
 
+        stats.on_fuse_reply();
         const int fre = fuse_reply_write(get_fuse_req(), count);
         if (fre != 0) {
             INC_GBL_STATS(fuse_reply_failed, 1);
@@ -2253,6 +2306,7 @@ public:
             assert(0);
         }
 
+        stats.on_fuse_reply();
         const int fre = fuse_reply_iov(get_fuse_req(), iov, count);
         if (fre != 0) {
             INC_GBL_STATS(fuse_reply_failed, 1);
@@ -2266,6 +2320,31 @@ public:
         free_rpc_task();
     }
 
+#ifndef ENABLE_NO_FUSE
+    /*
+     * Reply with fuse_reply_data(), used for sending read data as memfd
+     * buffers which libfuse can splice to /dev/fuse.
+     */
+    void reply_data(struct fuse_bufvec *bufv)
+    {
+        assert(bufv != nullptr);
+
+        stats.on_fuse_reply();
+        const int fre = fuse_reply_data(get_fuse_req(), bufv,
+                                        FUSE_BUF_SPLICE_MOVE);
+        if (fre != 0) {
+            INC_GBL_STATS(fuse_reply_failed, 1);
+            AZLogError("fuse_reply_data({}) failed (count={}): {}",
+                       fmt::ptr(get_fuse_req()), bufv->count, fre);
+            assert(0);
+        } else {
+            DEC_GBL_STATS(fuse_responses_awaited, 1);
+        }
+
+        free_rpc_task();
+    }
+#endif
+
     void reply_entry(const struct fuse_entry_param *e)
     {
         struct nfs_inode *inode = nullptr;
@@ -2297,6 +2376,7 @@ public:
 
         assert((int64_t) e->generation <= get_current_usecs());
 
+        stats.on_fuse_reply();
         const int fre = fuse_reply_entry(get_fuse_req(), e);
         if (fre != 0) {
             INC_GBL_STATS(fuse_reply_failed, 1);
@@ -2357,6 +2437,7 @@ public:
          */
         assert(inode->opencnt > 0);
 
+        stats.on_fuse_reply();
         const int fre = fuse_reply_create(get_fuse_req(), entry, file);
         if (fre != 0) {
             INC_GBL_STATS(fuse_reply_failed, 1);
@@ -2485,15 +2566,33 @@ public:
 class rpc_task_helper
 {
 private:
-    // Mutex for synchronizing access to free_task_index stack.
-    std::shared_mutex task_index_lock_41;
+    /*
+     * Free rpc_task indices are kept in a lock-free stack (Treiber stack)
+     * threaded through free_next[]. free_head packs the index at the top of
+     * the stack in the low 32 bits and a generation count in the high 32
+     * bits. The generation count is bumped on every pop and push, so that a
+     * CAS never succeeds against a stale head (ABA).
+     *
+     * free_count is the number of free indices and is what alloc and free
+     * use for admission control, the stack itself is only used to find a
+     * free index. To keep free_count from ever exceeding the number of
+     * entries on the stack we push before incrementing free_count on free,
+     * and decrement free_count before popping on alloc. This means once an
+     * allocator has claimed a slot in free_count, pop is guaranteed to find
+     * an entry, though it may have to retry the CAS.
+     */
+    static constexpr uint32_t FREE_LIST_END = UINT32_MAX;
 
-    // Stack containing index into the rpc_task_list vector.
-    std::stack<int> free_task_index;
+    std::atomic<uint64_t> free_head = FREE_LIST_END;
+    std::unique_ptr<std::atomic<uint32_t>[]> free_next;
+    std::atomic<int64_t> free_count = 0;
 
 #ifdef ENABLE_PARANOID
-    // Set for catching double free.
-    std::set<int> free_task_index_set;
+    /*
+     * For catching double free, or using an index which is not allocated.
+     * is_free[i] is true iff index i is free.
+     */
+    std::unique_ptr<std::atomic<bool>[]> is_free;
 #endif
 
     /*
@@ -2506,31 +2605,106 @@ private:
      */
     std::vector<struct rpc_task*> rpc_task_list;
 
-    // Condition variable to wait for free task index availability.
-    std::condition_variable_any cv;
+    /*
+     * Mutex and condition variable to wait for free task index availability.
+     * These are used only in the slow path when we run out of free tasks,
+     * num_waiters tells release_free_index() if it needs to notify.
+     */
+    std::mutex task_index_lock_41;
+    std::condition_variable cv;
+    std::atomic<int> num_waiters = 0;
 
     // This is a singleton class, hence make the constructor private.
-    rpc_task_helper(struct nfs_client *client)
+    rpc_task_helper(struct nfs_client *client) :
+        free_next(new std::atomic<uint32_t>[MAX_OUTSTANDING_RPC_TASKS])
+#ifdef ENABLE_PARANOID
+        , is_free(new std::atomic<bool>[MAX_OUTSTANDING_RPC_TASKS])
+#endif
     {
         assert(client != nullptr);
 
-        // There should be no elements in the stack.
-        assert(free_task_index.empty());
+        // There should be no free indices yet.
+        assert(free_count == 0);
+        assert((uint32_t) free_head == FREE_LIST_END);
 
-        // Initialize the index stack.
+        // Initialize the free index stack.
         for (int i = 0; i < MAX_OUTSTANDING_RPC_TASKS; i++) {
-            free_task_index.push(i);
-
 #ifdef ENABLE_PARANOID
-            const auto p = free_task_index_set.insert(i);
-            assert(p.second);
-            assert(free_task_index_set.size() == free_task_index.size());
+            is_free[i] = false;
 #endif
             rpc_task_list.emplace_back(new rpc_task(client, i));
+            release_free_index(i);
         }
 
         // There should be MAX_OUTSTANDING_RPC_TASKS index available.
-        assert(free_task_index.size() == MAX_OUTSTANDING_RPC_TASKS);
+        assert(free_count == MAX_OUTSTANDING_RPC_TASKS);
+    }
+
+    /*
+     * Push index to the free stack.
+     * Caller must increment free_count after this.
+     */
+    void push_free_idx(uint32_t index)
+    {
+        uint64_t head = free_head.load(std::memory_order_relaxed);
+        uint64_t new_head;
+
+        do {
+            free_next[index].store((uint32_t) head, std::memory_order_relaxed);
+            new_head = (((head >> 32) + 1) << 32) | index;
+        } while (!free_head.compare_exchange_weak(head, new_head,
+                                                  std::memory_order_release,
+                                                  std::memory_order_relaxed));
+    }
+
+    /*
+     * Pop an index from the free stack.
+     * Caller must have decremented free_count before this, which guarantees
+     * that the stack has at least one entry for us.
+     */
+    uint32_t pop_free_idx()
+    {
+        uint64_t head = free_head.load(std::memory_order_acquire);
+        uint64_t new_head;
+        uint32_t index;
+
+        do {
+            index = (uint32_t) head;
+            /*
+             * Pushers push before incrementing free_count, so if we have
+             * claimed a free_count slot, the stack cannot be empty.
+             */
+            assert(index != FREE_LIST_END);
+            assert(index < MAX_OUTSTANDING_RPC_TASKS);
+
+            /*
+             * free_next[index] may be changed under us if index is popped
+             * and pushed back by other threads, the generation count will
+             * make the CAS fail in that case.
+             */
+            new_head = (((head >> 32) + 1) << 32) |
+                       free_next[index].load(std::memory_order_relaxed);
+        } while (!free_head.compare_exchange_weak(head, new_head,
+                                                  std::memory_order_acquire,
+                                                  std::memory_order_acquire));
+
+        return index;
+    }
+
+    /*
+     * Claim one free index iff more than spare_count are free.
+     */
+    bool try_claim_free_idx(int64_t spare_count)
+    {
+        int64_t cnt = free_count.load();
+
+        while (cnt > spare_count) {
+            if (free_count.compare_exchange_weak(cnt, cnt - 1)) {
+                return true;
+            }
+        }
+
+        return false;
     }
 
 public:
@@ -2538,21 +2712,16 @@ public:
     {
         AZLogInfo("~rpc_task_helper() called");
 
-#ifdef ENABLE_PARANOID
-        assert(free_task_index_set.size() == free_task_index.size());
-#endif
-
         /*
          * We should be called when there are no outstanding tasks.
          */
-        assert(free_task_index.size() == MAX_OUTSTANDING_RPC_TASKS);
-
-        while (!free_task_index.empty()) {
-            free_task_index.pop();
-        }
+        assert(free_count == MAX_OUTSTANDING_RPC_TASKS);
 
         for (int i = 0; i < MAX_OUTSTANDING_RPC_TASKS; i++) {
             assert(rpc_task_list[i]);
+#ifdef ENABLE_PARANOID
+            assert(is_free[i]);
+#endif
             delete rpc_task_list[i]->rpc_api;
             delete rpc_task_list[i];
         }
@@ -2598,6 +2767,13 @@ public:
         task->set_op_type(optype);
         task->stats.on_rpc_create(optype, start_usec);
 
+        /*
+         * Non-zero only when jukebox_runner() is reissuing a request that
+         * failed with JUKEBOX.
+         */
+        task->rpc_api->num_jukebox_retries =
+            nfs_client::jukebox_reissue_retries;
+
         // No task starts as a child task.
         assert(task->rpc_api->parent_task == nullptr);
 
@@ -2610,7 +2786,8 @@ public:
          * used. Later init_*() method can set it to a more appropriate value.
          */
         task->csched = (task->client->mnt_options.nfs_port == 2047) ?
-                        CONN_SCHED_RR_W : CONN_SCHED_FH_HASH;
+                        get_spread_csched(false /* is_read */) :
+                        CONN_SCHED_FH_HASH;
 
 #ifdef ENABLE_PARANOID
         task->issuing_tid = ::gettid();
@@ -2645,34 +2822,54 @@ public:
          * callback allocates a task they don't have to block.
          * Don't allow more than 25% of total tasks as reserved tasks.
          */
-        static const size_t RESERVED_TASKS = 1000;
+        static const int64_t RESERVED_TASKS = 1000;
         static_assert(RESERVED_TASKS < MAX_OUTSTANDING_RPC_TASKS / 4);
-        const size_t spare_count = use_reserved ? 0 : RESERVED_TASKS;
+        const int64_t spare_count = use_reserved ? 0 : RESERVED_TASKS;
 
-        std::unique_lock<std::shared_mutex> lock(task_index_lock_41);
+        /*
+         * Fast path, lock-free.
+         * Slow path, wait until a free rpc task is available.
+         */
+        if (!try_claim_free_idx(spare_count)) {
+            const uint64_t wait_start_usec = get_current_usecs();
+            std::unique_lock<std::mutex> lock(task_index_lock_41);
 
-        // Wait until a free rpc task is available.
-        while (free_task_index.size() <= spare_count) {
-#ifdef ENABLE_PARANOID
-            assert(free_task_index_set.size() == free_task_index.size());
-#endif
-            if (!cv.wait_for(lock, std::chrono::seconds(30),
-                             [this, spare_count] {
-                                return free_task_index.size() > spare_count;
-                             })) {
-                AZLogError("Timed out waiting for free rpc_task ({}), "
-                           "re-trying!", free_task_index.size());
+            /*
+             * Must increment num_waiters before checking free_count, so that
+             * release_free_index() either sees us as a waiter, or we see
+             * the index it freed.
+             */
+            num_waiters++;
+            while (!try_claim_free_idx(spare_count)) {
+                if (!cv.wait_for(lock, std::chrono::seconds(30),
+                                 [this, spare_count] {
+                                    return free_count > spare_count;
+                                 })) {
+                    AZLogError("Timed out waiting for free rpc_task ({}), "
+                               "re-trying!", free_count.load());
+                }
             }
+            num_waiters--;
+            lock.unlock();
+
+            const uint64_t wait_usecs = get_current_usecs() - wait_start_usec;
+            INC_GBL_STATS(rpc_task_alloc_waits, 1);
+            INC_GBL_STATS(rpc_task_alloc_wait_usecs, wait_usecs);
+            AZNFSC_PROBE2(rpc_alloc_wait, wait_usecs, free_count.load());
+
+            uint64_t max_wait = GET_GBL_STATS(rpc_task_alloc_max_wait_usecs);
+            while (wait_usecs > max_wait &&
+                   !rpc_stats_az::rpc_task_alloc_max_wait_usecs.
+                        compare_exchange_weak(max_wait, wait_usecs))
+                ;
         }
 
-        const int free_index = free_task_index.top();
-        free_task_index.pop();
+        const int free_index = pop_free_idx();
 
 #ifdef ENABLE_PARANOID
-        // Must also be free as per free_task_index_set.
-        const size_t cnt = free_task_index_set.erase(free_index);
-        assert(cnt == 1);
-        assert(free_task_index_set.size() == free_task_index.size());
+        // Must be free as per is_free[].
+        [[maybe_unused]] const bool was_free = is_free[free_index].exchange(false);
+        assert(was_free);
 #endif
 
         // Must be a valid index.
@@ -2686,21 +2883,27 @@ public:
         // Must be a valid index.
         assert(index >= 0 && index < MAX_OUTSTANDING_RPC_TASKS);
 
-        {
-            std::unique_lock<std::shared_mutex> lock(task_index_lock_41);
-
 #ifdef ENABLE_PARANOID
-            assert(free_task_index_set.size() == free_task_index.size());
-            // Must not already be free.
-            const auto p = free_task_index_set.insert(index);
-            assert(p.second);
+        // Must not already be free.
+        [[maybe_unused]] const bool was_free = is_free[index].exchange(true);
+        assert(!was_free);
 #endif
 
-            free_task_index.push(index);
-        }
+        push_free_idx(index);
+        free_count++;
 
-        // Notify any waiters blocked in alloc_rpc_task().
-        cv.notify_one();
+        /*
+         * Notify any waiters blocked in alloc_rpc_task().
+         * Waiters may be waiting for different spare_count, so wake up all
+         * and let them re-check. This is the rare case when we have run out
+         * of rpc_tasks, in the common case we don't touch the lock or cv.
+         */
+        if (num_waiters > 0) {
+            {
+                std::unique_lock<std::mutex> lock(task_index_lock_41);
+            }
+            cv.notify_all();
+        }
     }
 
     void free_rpc_task(struct rpc_task *task)
@@ -2733,16 +2936,35 @@ struct jukebox_seedinfo
     api_task_info *rpc_api;
 
     /*
-     * When to rerun the task.
+     * When the seed was queued and when to rerun the task.
      */
+    const int64_t queued_msecs;
     int64_t run_at_msecs;
 
-    jukebox_seedinfo(api_task_info *_rpc_api) :
+    /*
+     * Connection on which the task failed, the retry is charged to its
+     * jukebox retry budget. Can be null.
+     */
+    struct conn_stats *const cstats;
+
+    jukebox_seedinfo(api_task_info *_rpc_api,
+                     int64_t delay_msecs,
+                     struct conn_stats *_cstats) :
         rpc_api(_rpc_api),
-        run_at_msecs(get_current_msecs() + JUKEBOX_DELAY_SECS*1000)
+        queued_msecs(get_current_msecs()),
+        run_at_msecs(queued_msecs + delay_msecs),
+        cstats(_cstats)
     {
         assert(rpc_api != nullptr);
+        assert(delay_msecs >= 0);
     }
 };
 
+inline bool jukebox_seedinfo_later::operator()(
+        const struct jukebox_seedinfo *a,
+        const struct jukebox_seedinfo *b) const
+{
+    return a->run_at_msecs > b->run_at_msecs;
+}
+
 #endif /*__RPC_TASK_H__*/
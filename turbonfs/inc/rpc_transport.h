@@ -36,8 +36,39 @@ typedef enum
      * will use different connections.
      */
     CONN_SCHED_FH_HASH  = 4,
+
+    /*
+     * Latency/load aware scheduling using "power of two choices".
+     * Pick two random connections and send over the one with the lower
+     * conn_stats::get_cost(), i.e., the one with fewer inflight requests/bytes
+     * and lower EWMA RTT. This steers requests away from connections that
+     * land on slow server frontends, without the herding that always picking
+     * the least loaded connection would cause.
+     * Like CONN_SCHED_RR_R/CONN_SCHED_RR_W, CONN_SCHED_P2C_R is used for
+     * read requests and CONN_SCHED_P2C_W is used for write requests, and they
+     * pick from separate connection pools when there are simultaneous reads
+     * and writes.
+     */
+    CONN_SCHED_P2C_R    = 5,
+    CONN_SCHED_P2C_W    = 6,
 } conn_sched_t;
 
+/**
+ * Connection scheduling type to use for read/write requests which can be
+ * spread over all connections.
+ * This is CONN_SCHED_P2C_R/CONN_SCHED_P2C_W if sys.conn_sched_latency_aware
+ * is set, else CONN_SCHED_RR_R/CONN_SCHED_RR_W.
+ */
+static inline
+conn_sched_t get_spread_csched(bool is_read)
+{
+    if (aznfsc_cfg.sys.conn_sched_latency_aware) {
+        return is_read ? CONN_SCHED_P2C_R : CONN_SCHED_P2C_W;
+    }
+
+    return is_read ? CONN_SCHED_RR_R : CONN_SCHED_RR_W;
+}
+
 /*
  * This represents an RPC transport.
  * An RPC transport is comprised of one or more nfs_connection and uses those
@@ -50,6 +81,17 @@ typedef enum
 
 #define RPC_TRANSPORT_MAGIC *((const uint32_t *)"RPCT")
 
+/*
+ * A connection is unhealthy if its last RPC_CONN_MAX_ERRORS RPCs failed with
+ * RPC errors, or if it has RPCs inflight but none completed in the last
+ * RPC_CONN_STALL_SECS. An endpoint is marked unhealthy when more than half
+ * its connections are unhealthy.
+ * Note that libnfs times out RPCs only after timeo*retrans, stall detection
+ * lets us stop sending new RPCs to a dead endpoint much sooner.
+ */
+#define RPC_CONN_MAX_ERRORS     4
+#define RPC_CONN_STALL_SECS     20
+
 struct rpc_transport
 {
     const uint32_t magic = RPC_TRANSPORT_MAGIC;
@@ -68,6 +110,25 @@ private:
      */
     std::vector<struct nfs_connection*> nfs_connections;
 
+    /*
+     * Server endpoints the connections are striped over, empty if all
+     * connections go to mo.server.
+     * Connection #i is made to endpoint #(i % endpoints.size()), so all
+     * endpoints get an equal share of the connections.
+     */
+    std::vector<struct rpc_endpoint*> endpoints;
+
+    /*
+     * Number of endpoints currently marked unhealthy. Selection has to skip
+     * connections over unhealthy endpoints only when this is non-zero.
+     */
+    mutable std::atomic<int> num_down_endpoints = 0;
+
+    /*
+     * Time (secs since epoch) we last ran check_endpoints().
+     */
+    mutable std::atomic<uint64_t> last_check_sec = 0;
+
     /*
      * Last context on which the request was sent.
      * Note: Each context is identified from 0 to X-1 (where X is the value of nconnect).
@@ -105,6 +166,14 @@ public:
         assert(client != nullptr);
     }
 
+    ~rpc_transport()
+    {
+        for (struct rpc_endpoint *ep : endpoints) {
+            delete ep;
+        }
+        endpoints.clear();
+    }
+
     uint32_t get_avg_qlen_r() const
     {
         return cnt_qlen_r ? (cum_qlen_r / cnt_qlen_r) : 0;
@@ -159,14 +228,63 @@ public:
      *          mode is used. This provides a unique hash for the file/dir
      *          that is the target for this request. All requests to the same
      *          file/dir are sent over the same connection.
+     * qos:     QoS class of the request. If sys.qos.meta_connections is set,
+     *          QOS_CLASS_META requests are sent over the connections reserved
+     *          for metadata, and the rest over the remaining connections.
      */
     struct nfs_context *get_nfs_context(conn_sched_t csched = CONN_SCHED_FIRST,
-                                        uint32_t fh_hash = 0) const;
+                                        uint32_t fh_hash = 0,
+                                        qos_class_t qos = QOS_CLASS_DATA) const;
+
+    /*
+     * Same as get_nfs_context() but returns the nfs_connection.
+     * Callers who want to account the RPC against the connection's
+     * conn_stats need this.
+     */
+    struct nfs_connection *get_nfs_connection(
+                                conn_sched_t csched = CONN_SCHED_FIRST,
+                                uint32_t fh_hash = 0,
+                                qos_class_t qos = QOS_CLASS_DATA) const;
 
     const std::vector<struct nfs_connection*>& get_all_connections() const
     {
         return nfs_connections;
     }
+
+    const std::vector<struct rpc_endpoint*>& get_all_endpoints() const
+    {
+        return endpoints;
+    }
+
+    int get_num_down_endpoints() const
+    {
+        return num_down_endpoints;
+    }
+
+private:
+    /*
+     * Find the server endpoints to stripe the connections over, from
+     * sys.endpoints.list or by resolving the server name if
+     * sys.endpoints.resolve is set. Leaves endpoints empty if neither is
+     * set or the name resolves to just one address, connections then go to
+     * mo.server.
+     */
+    void setup_endpoints();
+
+    /*
+     * Take endpoints whose connections are not getting responses out of
+     * connection selection, and put back endpoints which have been down for
+     * the recheck period. Called at most once a second from
+     * get_nfs_connection().
+     */
+    void check_endpoints(uint64_t now_sec) const;
+
+    /*
+     * Return idx if connection #idx is healthy, else the next healthy
+     * connection in [base, base+count), else the next healthy connection
+     * among all. If all connections are unhealthy, return idx.
+     */
+    int pick_healthy(int idx, int base, int count) const;
 };
 
 #endif /* __RPC_TRANSPORT_H__ */
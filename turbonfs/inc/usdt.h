@@ -0,0 +1,79 @@
+#ifndef __AZNFSC_USDT_H__
+#define __AZNFSC_USDT_H__
+
+/*
+ * Static tracepoints (USDT) for tracing the life of requests in production
+ * w/o rebuilding, f.e., using bpftrace:
+ *
+ *   bpftrace -e 'usdt:/path/to/aznfsclient:aznfsc:rpc_complete
+ *                { @rtt[arg1] = hist(arg4 - arg3); }'
+ *
+ * Use "bpftrace -l 'usdt:/path/to/aznfsclient:*'" to list all probes. A probe
+ * is a single nop instruction and a note in the ELF, so it costs nothing when
+ * not being traced, but the arguments are still evaluated, so don't pass
+ * anything expensive to compute.
+ *
+ * Probes are compiled in only with ENABLE_USDT (needs sys/sdt.h from
+ * systemtap-sdt-dev), o/w they compile to nothing.
+ *
+ * Probes, all under the "aznfsc" provider, times in usecs as returned by
+ * get_current_usecs():
+ *
+ * rpc_task lifecycle. task is the address of the rpc_task's stats, which
+ * uniquely identifies a request while it's alive.
+ * rpc_alloc(task, optype, start, create)
+ *      rpc_task allocated by alloc_rpc_task(), (create - start) is the time
+ *      spent waiting for a free rpc_task.
+ * rpc_alloc_wait(wait_usecs, free_count)
+ *      get_free_idx() had to wait for a free rpc_task.
+ * rpc_issue(task, optype, issue)
+ *      Request handed to libnfs.
+ * rpc_conn(task, optype, conn_index, io_bytes)
+ *      Request bound to a connection by get_nfs_context().
+ * rpc_send(task, optype, issue, dispatch)
+ *      Request written completely to the socket. libnfs only tells us the
+ *      dispatch time when the response arrives, so this fires right before
+ *      rpc_complete.
+ * rpc_complete(task, optype, status, dispatch, complete)
+ *      Response received, (complete - dispatch) is the server RTT.
+ * rpc_reply(task, optype)
+ *      About to reply to fuse.
+ * rpc_free(task, optype, start, free)
+ *      rpc_task freed, (free - start) is the total latency of the request.
+ *
+ * fcsm flush/commit transitions, ino is the fuse inode number.
+ * fcsm_flush_start(ino, flush_seq, bytes)
+ * fcsm_flush_done(ino, flush_seq, bytes, rtt_usec)
+ * fcsm_commit_start(ino, bytes)
+ * fcsm_commit_done(ino, bytes)
+ * fcsm_run(ino) / fcsm_idle(ino)
+ *      Flush/commit state machine started/stopped running.
+ *
+ * membuf_lock_wait(offset, length, wait_usecs)
+ *      membuf::set_locked() had to wait for the membuf lock.
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define AZNFSC_PROBE(name) \
+    DTRACE_PROBE(aznfsc, name)
+#define AZNFSC_PROBE1(name, a1) \
+    DTRACE_PROBE1(aznfsc, name, a1)
+#define AZNFSC_PROBE2(name, a1, a2) \
+    DTRACE_PROBE2(aznfsc, name, a1, a2)
+#define AZNFSC_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(aznfsc, name, a1, a2, a3)
+#define AZNFSC_PROBE4(name, a1, a2, a3, a4) \
+    DTRACE_PROBE4(aznfsc, name, a1, a2, a3, a4)
+#define AZNFSC_PROBE5(name, a1, a2, a3, a4, a5) \
+    DTRACE_PROBE5(aznfsc, name, a1, a2, a3, a4, a5)
+#else
+#define AZNFSC_PROBE(name)                          do {} while (0)
+#define AZNFSC_PROBE1(name, a1)                     do {} while (0)
+#define AZNFSC_PROBE2(name, a1, a2)                 do {} while (0)
+#define AZNFSC_PROBE3(name, a1, a2, a3)             do {} while (0)
+#define AZNFSC_PROBE4(name, a1, a2, a3, a4)         do {} while (0)
+#define AZNFSC_PROBE5(name, a1, a2, a3, a4, a5)     do {} while (0)
+#endif
+
+#endif /* __AZNFSC_USDT_H__ */
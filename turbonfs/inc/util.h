@@ -7,6 +7,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/un.h>
+#include <net/if.h>
+#include <arpa/inet.h>
 #include <zlib.h>
 
 #include <string>
@@ -118,6 +121,59 @@ bool is_valid_cachedir(const std::string& cachedir)
     return true;
 }
 
+static inline
+bool is_valid_metrics_socket(const std::string& path)
+{
+    // Must be an absolute path that fits in sockaddr_un.sun_path.
+    return (!path.empty() && path[0] == '/' &&
+            path.size() < sizeof(((struct sockaddr_un *) nullptr)->sun_path));
+}
+
+static inline
+bool is_valid_affinity_mode(const std::string& mode)
+{
+    return (mode == "none" || mode == "nicnode" || mode == "spread");
+}
+
+static inline
+bool is_valid_affinity_iface(const std::string& iface)
+{
+    // Must be a valid interface name, it's used to build a sysfs path.
+    return (!iface.empty() && iface.size() < IFNAMSIZ &&
+            iface.find('/') == std::string::npos &&
+            iface != "." && iface != "..");
+}
+
+/*
+ * Comma separated list of IPv4/IPv6 addresses.
+ */
+static inline
+bool is_valid_endpoint_list(const std::string& list)
+{
+    if (list.empty()) {
+        return false;
+    }
+
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = list.size();
+        }
+
+        const std::string addr = list.substr(pos, comma - pos);
+        pos = comma + 1;
+
+        struct in6_addr buf;
+        if (::inet_pton(AF_INET, addr.c_str(), &buf) != 1 &&
+            ::inet_pton(AF_INET6, addr.c_str(), &buf) != 1) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 static inline
 bool is_valid_lookupcache(const std::string& lookupcache)
 {
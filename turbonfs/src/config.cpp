@@ -115,6 +115,7 @@ do { \
         YAML::Node config = YAML::LoadFile(config_yaml);
 
         _CHECK_BOOL(debug);
+        _CHECK_BOOL(log_async);
 
         _CHECK_STR(account);
         _CHECK_STR(container);
@@ -165,14 +166,18 @@ do { \
         _CHECK_INT(fuse_max_background, AZNFSCFG_FUSE_MAX_BG_MIN, AZNFSCFG_FUSE_MAX_BG_MAX);
         _CHECK_INT(fuse_max_threads, AZNFSCFG_FUSE_MAX_THR_MIN, AZNFSCFG_FUSE_MAX_THR_MAX);
         _CHECK_INT(fuse_max_idle_threads, AZNFSCFG_FUSE_MAX_IDLE_THR_MIN, AZNFSCFG_FUSE_MAX_IDLE_THR_MAX);
+        _CHECK_BOOL(fuse_splice_read_reply);
 
         _CHECK_STR(xprtsec);
         _CHECK_BOOL(oom_kill_disable);
 
         _CHECK_BOOL(cache.attr.user.enable);
+        _CHECK_BOOL(cache.attr.user.stale_while_revalidate);
         _CHECK_BOOL(cache.readdir.kernel.enable);
         _CHECK_INT(cache.readdir.user.max_size_mb,
                    AZNFSCFG_CACHE_MAX_MB_MIN, AZNFSCFG_CACHE_MAX_MB_MAX);
+        _CHECK_INTZ(cache.readdir.user.prefetch_depth,
+                    AZNFSCFG_READDIR_PREFETCH_MIN, AZNFSCFG_READDIR_PREFETCH_MAX);
         // User readdir cache cannot be turned off.
         assert(cache.readdir.user.enable);
         _CHECK_BOOL(cache.data.kernel.enable);
@@ -216,6 +221,15 @@ do { \
                 _CHECK_INT(cache.data.user.max_size_mb,
                            AZNFSCFG_CACHE_MAX_MB_MIN, AZNFSCFG_CACHE_MAX_MB_MAX);
             }
+
+            _CHECK_BOOL(cache.data.user.hugepages);
+            _CHECK_INT(cache.data.user.prefetch_inflight_mb,
+                       AZNFSCFG_PREFETCH_INFLIGHT_MB_MIN,
+                       AZNFSCFG_PREFETCH_INFLIGHT_MB_MAX);
+            _CHECK_INTZ(cache.data.user.max_pinned_pct,
+                        AZNFSCFG_MAX_PINNED_PCT_MIN,
+                        AZNFSCFG_MAX_PINNED_PCT_MAX);
+            _CHECK_BOOL(cache.data.user.adaptive_size);
         } else {
             cache.data.user.max_size_mb = 0;
         }
@@ -233,9 +247,20 @@ do { \
          */
         _CHECK_BOOL(sys.force_stable_writes);
         _CHECK_BOOL(sys.resolve_before_reconnect);
+        _CHECK_BOOL(sys.conn_sched_latency_aware);
+        _CHECK_BOOL(sys.small_file_mode);
+        _CHECK_BOOL(sys.stats_reset_on_dump);
         _CHECK_BOOL(sys.nodrc.remove_noent_as_success);
         _CHECK_BOOL(sys.nodrc.create_exist_as_success);
         _CHECK_BOOL(sys.nodrc.rename_noent_as_success);
+        _CHECK_INTZ(sys.metrics.port, AZNFSCFG_METRICS_PORT_MIN, AZNFSCFG_METRICS_PORT_MAX);
+        _CHECK_STR2(sys.metrics.socket, is_valid_metrics_socket);
+        _CHECK_STR2(sys.affinity.mode, is_valid_affinity_mode);
+        _CHECK_STR2(sys.affinity.iface, is_valid_affinity_iface);
+        _CHECK_STR2(sys.endpoints.list, is_valid_endpoint_list);
+        _CHECK_BOOL(sys.endpoints.resolve);
+        _CHECK_INT(sys.endpoints.recheck_sec, AZNFSCFG_EP_RECHECK_SEC_MIN, AZNFSCFG_EP_RECHECK_SEC_MAX);
+        _CHECK_INTZ(sys.qos.meta_connections, 1, AZNFSCFG_NCONNECT_MAX / 2);
 
     } catch (const YAML::BadFile& e) {
         AZLogError("Error loading config file {}: {}", config_yaml, e.what());
@@ -351,6 +376,15 @@ bool aznfsc_cfg::set_defaults_and_sanitize()
                 cache.data.user.max_size_mb = 16384;
             }
         }
+
+        if (cache.data.user.prefetch_inflight_mb == -1) {
+            cache.data.user.prefetch_inflight_mb =
+                AZNFSCFG_PREFETCH_INFLIGHT_MB_DEF;
+        }
+
+        if (cache.data.user.max_pinned_pct == -1) {
+            cache.data.user.max_pinned_pct = AZNFSCFG_MAX_PINNED_PCT_DEF;
+        }
     }
 
     if (cache.readdir.user.enable) {
@@ -362,6 +396,12 @@ bool aznfsc_cfg::set_defaults_and_sanitize()
         }
 
         assert(cache.readdir.user.max_size_mb > 0);
+
+        if (cache.readdir.user.prefetch_depth == -1) {
+            cache.readdir.user.prefetch_depth = AZNFSCFG_READDIR_PREFETCH_DEF;
+        }
+
+        assert(cache.readdir.user.prefetch_depth >= 0);
     }
 
     if (filecache.enable) {
@@ -369,6 +409,41 @@ bool aznfsc_cfg::set_defaults_and_sanitize()
             filecache.max_size_gb = AZNFSCFG_FILECACHE_MAX_GB_DEF;
     }
 
+    // Metrics port is disabled by default.
+    if (sys.metrics.port == -1) {
+        sys.metrics.port = 0;
+    }
+
+    if (sys.affinity.mode) {
+        if (std::string(sys.affinity.mode) == "none") {
+            sys.affinity.mode_int = AZNFSCFG_AFFINITY_NONE;
+        } else if (std::string(sys.affinity.mode) == "nicnode") {
+            sys.affinity.mode_int = AZNFSCFG_AFFINITY_NICNODE;
+        } else if (std::string(sys.affinity.mode) == "spread") {
+            sys.affinity.mode_int = AZNFSCFG_AFFINITY_SPREAD;
+        } else {
+            // We should not come here with an invalid value.
+            assert(0);
+            sys.affinity.mode_int = AZNFSCFG_AFFINITY_DEF;
+        }
+    } else {
+        sys.affinity.mode = "";
+        sys.affinity.mode_int = AZNFSCFG_AFFINITY_DEF;
+    }
+
+    if (sys.endpoints.recheck_sec == -1) {
+        sys.endpoints.recheck_sec = AZNFSCFG_EP_RECHECK_SEC_DEF;
+    }
+
+    if (sys.qos.meta_connections == -1) {
+        sys.qos.meta_connections = 0;
+    } else if (sys.qos.meta_connections > (nconnect / 2)) {
+        AZLogWarn("sys.qos.meta_connections ({}) cannot be more than half "
+                  "of nconnect ({}), using {}",
+                  sys.qos.meta_connections, nconnect, nconnect / 2);
+        sys.qos.meta_connections = nconnect / 2;
+    }
+
     if (consistency) {
         if (std::string(consistency) == "solowriter") {
             consistency_int = consistency_t::SOLOWRITER;
@@ -404,6 +479,16 @@ bool aznfsc_cfg::set_defaults_and_sanitize()
             (int) consistency_standardnfs +
             (int) consistency_azurempa) == 1);
 
+    /*
+     * Serving stale attributes is only ok for close-to-open consistency,
+     * the other consistency modes have their own attribute caching rules.
+     */
+    if (cache.attr.user.stale_while_revalidate && !consistency_standardnfs) {
+        AZLogWarn("cache.attr.user.stale_while_revalidate is only supported "
+                  "with standardnfs consistency, disabling it!");
+        cache.attr.user.stale_while_revalidate = false;
+    }
+
     /*
      * If user has not provided cloud_suffix, try to make a good guess.
      */
@@ -452,6 +537,7 @@ done_cloud_suffix:
 #ifdef ENABLE_PRESSURE_POINTS
     AZLogDebug("inject_err_prob_pct_def = {}", inject_err_prob_pct_def);
 #endif
+    AZLogDebug("log_async = {}", log_async);
     AZLogDebug("auth = {}", auth);
     AZLogDebug("port = {}", port);
     AZLogDebug("nconnect = {}", nconnect);
@@ -473,21 +559,43 @@ done_cloud_suffix:
     AZLogDebug("fuse_max_background = {}", fuse_max_background);
     AZLogDebug("fuse_max_threads = {}", fuse_max_threads);
     AZLogDebug("fuse_max_idle_threads = {}", fuse_max_idle_threads);
+    AZLogDebug("fuse_splice_read_reply = {}", fuse_splice_read_reply);
     AZLogDebug("cache.attr.user.enable = {}", cache.attr.user.enable);
+    AZLogDebug("cache.attr.user.stale_while_revalidate = {}",
+               cache.attr.user.stale_while_revalidate);
     AZLogDebug("cache.readdir.kernel.enable = {}", cache.readdir.kernel.enable);
     AZLogDebug("cache.readdir.user.enable = {}", cache.readdir.user.enable);
     AZLogDebug("cache.readdir.user.max_size_mb = {}", cache.readdir.user.max_size_mb);
+    AZLogDebug("cache.readdir.user.prefetch_depth = {}", cache.readdir.user.prefetch_depth);
     AZLogDebug("cache.data.kernel.enable = {}", cache.data.kernel.enable);
     AZLogDebug("cache.data.user.enable = {}", cache.data.user.enable);
     AZLogDebug("cache.data.user.max_size_mb = {}", cache.data.user.max_size_mb);
+    AZLogDebug("cache.data.user.hugepages = {}", cache.data.user.hugepages);
+    AZLogDebug("cache.data.user.prefetch_inflight_mb = {}",
+               cache.data.user.prefetch_inflight_mb);
+    AZLogDebug("cache.data.user.max_pinned_pct = {}",
+               cache.data.user.max_pinned_pct);
+    AZLogDebug("cache.data.user.adaptive_size = {}",
+               cache.data.user.adaptive_size);
     AZLogDebug("filecache.enable = {}", filecache.enable);
     AZLogDebug("filecache.cachedir = {}", filecache.cachedir ? filecache.cachedir : "");
     AZLogDebug("filecache.max_size_gb = {}", filecache.max_size_gb);
     AZLogDebug("sys.force_stable_writes = {}", sys.force_stable_writes);
     AZLogDebug("sys.resolve_before_reconnect = {}", sys.resolve_before_reconnect);
+    AZLogDebug("sys.conn_sched_latency_aware = {}", sys.conn_sched_latency_aware);
+    AZLogDebug("sys.small_file_mode = {}", sys.small_file_mode);
+    AZLogDebug("sys.stats_reset_on_dump = {}", sys.stats_reset_on_dump);
     AZLogDebug("sys.nodrc.remove_noent_as_success = {}", sys.nodrc.remove_noent_as_success);
     AZLogDebug("sys.nodrc.create_exist_as_success = {}", sys.nodrc.create_exist_as_success);
     AZLogDebug("sys.nodrc.rename_noent_as_success = {}", sys.nodrc.rename_noent_as_success);
+    AZLogDebug("sys.metrics.port = {}", sys.metrics.port);
+    AZLogDebug("sys.metrics.socket = {}", sys.metrics.socket ? sys.metrics.socket : "");
+    AZLogDebug("sys.affinity.mode = <{}> ({})", sys.affinity.mode, sys.affinity.mode_int);
+    AZLogDebug("sys.affinity.iface = {}", sys.affinity.iface ? sys.affinity.iface : "");
+    AZLogDebug("sys.endpoints.list = {}", sys.endpoints.list ? sys.endpoints.list : "");
+    AZLogDebug("sys.endpoints.resolve = {}", sys.endpoints.resolve);
+    AZLogDebug("sys.endpoints.recheck_sec = {}", sys.endpoints.recheck_sec);
+    AZLogDebug("sys.qos.meta_connections = {}", sys.qos.meta_connections);
     AZLogDebug("account = {}", account);
     AZLogDebug("container = {}", container);
     AZLogDebug("cloud_suffix = {}", cloud_suffix);
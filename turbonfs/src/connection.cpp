@@ -1,5 +1,6 @@
 #include "connection.h"
 #include "nfs_client.h"
+#include "cpu_affinity.h"
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -86,6 +87,12 @@ bool nfs_connection::open()
     struct mount_options& mo = client->mnt_options;
     const std::string url_str = mo.get_url_str();
 
+    /*
+     * When striping connections over multiple endpoints, connect to our
+     * endpoint's address instead of the server name.
+     */
+    const std::string& server = endpoint ? endpoint->addr : mo.server;
+
     AZLogDebug("Parsing NFS URL string: {}", url_str);
 
     struct nfs_url *url = nfs_parse_url_full(nfs_context, url_str.c_str());
@@ -147,6 +154,9 @@ bool nfs_connection::open()
     /*
      * LLAM may cause Blob NFS endpoint IP to change, direct libnfs to resolve
      * before reconnect.
+     * This is a no-op when connecting to an endpoint address, if that IP
+     * goes away the endpoint is marked unhealthy and its connections are
+     * not used till it comes back.
      */
     if (aznfsc_cfg.sys.resolve_before_reconnect) {
         nfs_set_resolve_on_reconnect(nfs_context);
@@ -159,13 +169,13 @@ bool nfs_connection::open()
      */
     int status;
     do {
-        status = nfs_mount(nfs_context, mo.server.c_str(),
+        status = nfs_mount(nfs_context, server.c_str(),
                            mo.export_path.c_str());
         if (status == -EAGAIN) {
             AZLogWarn("[{}] JUKEBOX error mounting nfs share ({}:{}): {}, "
                       "retrying in 5 secs!",
                       (void *) nfs_context,
-                      mo.server,
+                      server,
                       mo.export_path,
                       nfs_get_error(nfs_context));
             ::sleep(5);
@@ -173,7 +183,7 @@ bool nfs_connection::open()
         } else if (status != 0) {
             AZLogError("[{}] Failed to mount nfs share ({}:{}): {} ({})",
                        (void *) nfs_context,
-                       mo.server,
+                       server,
                        mo.export_path,
                        nfs_get_error(nfs_context),
                        status);
@@ -268,11 +278,19 @@ bool nfs_connection::open()
         goto unmount_and_destroy_context;
     }
 
+    /*
+     * Place the service thread as per sys.affinity.mode, it does all the
+     * socket IO for this connection.
+     */
+    cpu_affinity::get_instance().pin_service_thread(nfs_get_tid(nfs_context),
+                                                    idx,
+                                                    nfs_get_fd(nfs_context));
+
     AZLogInfo("[{} / {}] Successfully mounted nfs share ({}:{}). "
               "Negotiated values: readmax={}, writemax={}, readdirmax={}",
               (void *) nfs_context,
               nfs_get_tid(nfs_context),
-              mo.server,
+              server,
               mo.export_path,
               nfs_get_readmax(nfs_context),
               nfs_get_writemax(nfs_context),
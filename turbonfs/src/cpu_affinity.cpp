@@ -0,0 +1,375 @@
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <ifaddrs.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include <fstream>
+
+#include "cpu_affinity.h"
+#include "file_cache.h"
+#include "membuf_pool.h"
+
+namespace aznfsc {
+
+/*
+ * Read the first line of a sysfs file.
+ */
+static bool read_sysfs(const std::string& path, std::string& val)
+{
+    std::ifstream ifs(path);
+
+    if (!ifs.is_open()) {
+        return false;
+    }
+
+    std::getline(ifs, val);
+    return !ifs.bad();
+}
+
+/* static */
+bool cpu_affinity::parse_cpulist(const std::string& cpulist, cpu_set_t& cpus)
+{
+    CPU_ZERO(&cpus);
+
+    size_t pos = 0;
+    while (pos < cpulist.size()) {
+        size_t comma = cpulist.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = cpulist.size();
+        }
+
+        const std::string range = cpulist.substr(pos, comma - pos);
+        pos = comma + 1;
+
+        if (range.empty()) {
+            continue;
+        }
+
+        int lo, hi;
+        const int n = ::sscanf(range.c_str(), "%d-%d", &lo, &hi);
+        if (n == 1) {
+            hi = lo;
+        } else if (n != 2) {
+            return false;
+        }
+
+        if (lo < 0 || hi < lo) {
+            return false;
+        }
+
+        for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+
+    return CPU_COUNT(&cpus) > 0;
+}
+
+/* static */
+int cpu_affinity::get_iface_node(const std::string& iface)
+{
+    const std::string dir = "/sys/class/net/" + iface;
+    std::string val;
+
+    /*
+     * Physical NICs have the PCI device's node.
+     */
+    if (read_sysfs(dir + "/device/numa_node", val)) {
+        const int node = ::atoi(val.c_str());
+        if (node >= 0) {
+            return node;
+        }
+    }
+
+    /*
+     * Virtual interfaces (bond, vlan, or the synthetic NIC with an
+     * accelerated networking VF) don't have a device node, but the
+     * interfaces they are stacked over do, use the first one we find.
+     */
+    DIR *dp = ::opendir(dir.c_str());
+    if (!dp) {
+        return -1;
+    }
+
+    int node = -1;
+    struct dirent *de;
+    while ((node == -1) && (de = ::readdir(dp)) != nullptr) {
+        if (::strncmp(de->d_name, "lower_", 6) == 0) {
+            node = get_iface_node(de->d_name + 6);
+        }
+    }
+
+    ::closedir(dp);
+    return node;
+}
+
+/* static */
+std::string cpu_affinity::get_sock_iface(int sockfd)
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen = sizeof(ss);
+
+    if (::getsockname(sockfd, (struct sockaddr *) &ss, &sslen) != 0) {
+        AZLogWarn("[AFFINITY] getsockname({}) failed: {}",
+                  sockfd, strerror(errno));
+        return "";
+    }
+
+    struct ifaddrs *ifaddr = nullptr;
+    if (::getifaddrs(&ifaddr) != 0) {
+        AZLogWarn("[AFFINITY] getifaddrs() failed: {}", strerror(errno));
+        return "";
+    }
+
+    std::string iface;
+    for (struct ifaddrs *ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != ss.ss_family) {
+            continue;
+        }
+
+        if (ss.ss_family == AF_INET) {
+            const auto *a = (const struct sockaddr_in *) &ss;
+            const auto *b = (const struct sockaddr_in *) ifa->ifa_addr;
+            if (a->sin_addr.s_addr == b->sin_addr.s_addr) {
+                iface = ifa->ifa_name;
+                break;
+            }
+        } else if (ss.ss_family == AF_INET6) {
+            const auto *a = (const struct sockaddr_in6 *) &ss;
+            const auto *b = (const struct sockaddr_in6 *) ifa->ifa_addr;
+            if (::memcmp(&a->sin6_addr, &b->sin6_addr,
+                         sizeof(a->sin6_addr)) == 0) {
+                iface = ifa->ifa_name;
+                break;
+            }
+        }
+    }
+
+    ::freeifaddrs(ifaddr);
+    return iface;
+}
+
+void cpu_affinity::init(int _mode, const char *iface)
+{
+    // Must be called only once.
+    assert(nodes.empty());
+
+    mode = _mode;
+    if (mode == AZNFSCFG_AFFINITY_NONE) {
+        return;
+    }
+
+    std::string val;
+    cpu_set_t online;
+
+    /*
+     * online is a cpulist formatted list of node ids, we reuse cpu_set_t
+     * as a bitmap for it.
+     */
+    if (!read_sysfs("/sys/devices/system/node/online", val) ||
+        !parse_cpulist(val, online)) {
+        AZLogWarn("[AFFINITY] Cannot read NUMA topology, disabling affinity");
+        mode = AZNFSCFG_AFFINITY_NONE;
+        return;
+    }
+
+    for (int node = 0; node < AFFINITY_MAX_NODES; node++) {
+        if (!CPU_ISSET(node, &online)) {
+            continue;
+        }
+
+        cpu_set_t cpus;
+        if (!read_sysfs("/sys/devices/system/node/node" +
+                        std::to_string(node) + "/cpulist", val) ||
+            !parse_cpulist(val, cpus)) {
+            // Memory-only node.
+            continue;
+        }
+
+        nodes.push_back(node);
+        node_cpus.push_back(cpus);
+    }
+
+    assert(nodes.size() == node_cpus.size());
+
+    if (nodes.size() < 2) {
+        AZLogInfo("[AFFINITY] {} NUMA node(s) with CPUs, affinity not needed",
+                  nodes.size());
+        nodes.clear();
+        node_cpus.clear();
+        mode = AZNFSCFG_AFFINITY_NONE;
+        return;
+    }
+
+    AZLogInfo("[AFFINITY] Using {} affinity over {} NUMA nodes",
+              (mode == AZNFSCFG_AFFINITY_NICNODE) ? "nicnode" : "spread",
+              nodes.size());
+
+    if ((mode == AZNFSCFG_AFFINITY_NICNODE) && iface) {
+        const int node = get_iface_node(iface);
+
+        if (node == -1) {
+            AZLogWarn("[AFFINITY] Cannot find NUMA node of interface {}, "
+                      "will use the interface of the first connection",
+                      iface);
+        } else {
+            std::unique_lock<std::mutex> _lock(affinity_lock_53);
+            set_nic_node(node, iface);
+        }
+    }
+}
+
+void cpu_affinity::set_nic_node(int node, const std::string& iface)
+{
+    assert(mode == AZNFSCFG_AFFINITY_NICNODE);
+    assert(nic_node_idx == -1);
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i] == node) {
+            nic_node = node;
+            nic_node_idx = i;
+
+            AZLogInfo("[AFFINITY] Interface {} is on NUMA node {}",
+                      iface, node);
+
+            /*
+             * Splice region is created before the connections, so it
+             * might not have got the policy.
+             */
+            membuf_pool::bind_splice_region();
+            return;
+        }
+    }
+
+    AZLogWarn("[AFFINITY] NUMA node {} of interface {} has no CPUs, "
+              "not pinning", node, iface);
+    nic_node_unknown = true;
+}
+
+void cpu_affinity::pin_service_thread(pid_t tid, int conn_idx, int sockfd)
+{
+    if (mode == AZNFSCFG_AFFINITY_NONE) {
+        return;
+    }
+
+    assert(tid > 0);
+    assert(conn_idx >= 0);
+
+    int idx;
+
+    if (mode == AZNFSCFG_AFFINITY_SPREAD) {
+        // Round robin over the nodes in connection index order.
+        idx = conn_idx % nodes.size();
+    } else {
+        if (nic_node_idx == -1) {
+            std::unique_lock<std::mutex> _lock(affinity_lock_53);
+
+            if (nic_node_idx == -1 && !nic_node_unknown) {
+                const std::string iface = get_sock_iface(sockfd);
+                const int node = iface.empty() ? -1 : get_iface_node(iface);
+
+                if (node == -1) {
+                    AZLogWarn("[AFFINITY] Cannot find NUMA node of the NIC "
+                              "(iface: {}), set sys.affinity.iface. Not "
+                              "pinning!", iface.empty() ? "?" : iface);
+                    nic_node_unknown = true;
+                } else {
+                    set_nic_node(node, iface);
+                }
+            }
+        }
+
+        idx = nic_node_idx;
+        if (idx == -1) {
+            return;
+        }
+    }
+
+    assert(idx >= 0 && idx < (int) nodes.size());
+
+    /*
+     * sched_setaffinity() with a tid only affects that thread, which is
+     * what we want as the service thread is created by libnfs.
+     */
+    if (::sched_setaffinity(tid, sizeof(cpu_set_t), &node_cpus[idx]) != 0) {
+        AZLogWarn("[AFFINITY] Failed to pin service thread {} of connection "
+                  "#{} to NUMA node {}: {}",
+                  tid, conn_idx, nodes[idx], strerror(errno));
+        return;
+    }
+
+    AZLogInfo("[AFFINITY] Pinned service thread {} of connection #{} to "
+              "NUMA node {}", tid, conn_idx, nodes[idx]);
+}
+
+void cpu_affinity::pin_fuse_workers()
+{
+    /*
+     * In spread mode fuse workers are left to the scheduler, they are
+     * created and destroyed on demand by libfuse so we cannot place them
+     * individually.
+     */
+    if (mode != AZNFSCFG_AFFINITY_NICNODE) {
+        return;
+    }
+
+    const int idx = nic_node_idx;
+    if (idx == -1) {
+        return;
+    }
+
+    const int ret = ::pthread_setaffinity_np(::pthread_self(),
+                                             sizeof(cpu_set_t),
+                                             &node_cpus[idx]);
+    if (ret != 0) {
+        AZLogWarn("[AFFINITY] Failed to pin fuse workers to NUMA node {}: {}",
+                  nodes[idx], strerror(ret));
+        return;
+    }
+
+    AZLogInfo("[AFFINITY] Pinned fuse workers to NUMA node {}", nodes[idx]);
+}
+
+void cpu_affinity::bind_memory(void *addr, uint64_t length) const
+{
+    if (mode == AZNFSCFG_AFFINITY_NONE) {
+        return;
+    }
+
+    assert(addr != nullptr);
+    assert(((uintptr_t) addr % PAGE_SIZE) == 0);
+
+    unsigned long nodemask = 0;
+    static_assert(AFFINITY_MAX_NODES <= (sizeof(nodemask) * 8));
+    int policy;
+
+    if (mode == AZNFSCFG_AFFINITY_NICNODE) {
+        const int node = nic_node;
+        if (node == -1) {
+            return;
+        }
+        nodemask = (1UL << node);
+        policy = MPOL_PREFERRED;
+    } else {
+        for (const int node : nodes) {
+            nodemask |= (1UL << node);
+        }
+        policy = MPOL_INTERLEAVE;
+    }
+
+    /*
+     * Kernel ignores the last bit of maxnode, hence the +1.
+     */
+    if (::syscall(SYS_mbind, addr, length, policy, &nodemask,
+                  AFFINITY_MAX_NODES + 1, 0) != 0) {
+        static std::atomic<bool> warned = false;
+        if (!warned.exchange(true)) {
+            AZLogWarn("[AFFINITY] mbind(size={}) failed: {}, membufs will "
+                      "not be node local", length, strerror(errno));
+        }
+    }
+}
+
+}
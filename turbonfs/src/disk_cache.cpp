@@ -0,0 +1,864 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "aznfsc.h"
+#include "disk_cache.h"
+#include "file_cache.h"
+#include "nfs_inode.h"
+
+namespace aznfsc {
+
+/* static */ std::atomic<uint64_t> disk_cache::num_hits_g = 0;
+/* static */ std::atomic<uint64_t> disk_cache::bytes_read_g = 0;
+/* static */ std::atomic<uint64_t> disk_cache::num_ra_hits_g = 0;
+/* static */ std::atomic<uint64_t> disk_cache::num_read_errors_g = 0;
+/* static */ std::atomic<uint64_t> disk_cache::bytes_written_g = 0;
+/* static */ std::atomic<uint64_t> disk_cache::num_write_dropped_g = 0;
+/* static */ std::atomic<uint64_t> disk_cache::num_stale_g = 0;
+/* static */ std::atomic<uint64_t> disk_cache::num_evictions_g = 0;
+/* static */ std::atomic<uint64_t> disk_cache::bytes_cached_g = 0;
+/* static */ std::atomic<uint64_t> disk_cache::bytes_queued_g = 0;
+
+#define DISK_CACHE_META_MAGIC   0x4d434441 /* "ADCM" */
+#define DISK_CACHE_META_VERSION 1
+
+/*
+ * On-disk header of the meta file.
+ * This is followed by the bitmap of cached blocks, 1 bit per
+ * DISK_CACHE_BLOCK_SIZE block of the file, as an array of uint64_t.
+ */
+struct disk_cache_meta
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t block_size;
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t last_access;
+    uint64_t nblocks_cached;
+};
+
+static bool full_pread(int fd, uint8_t *buf, uint64_t length, uint64_t offset)
+{
+    while (length > 0) {
+        const ssize_t ret = ::pread(fd, buf, length, offset);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += ret;
+        offset += ret;
+        length -= ret;
+    }
+    return true;
+}
+
+static bool full_pwrite(int fd, const uint8_t *buf, uint64_t length,
+                        uint64_t offset)
+{
+    while (length > 0) {
+        const ssize_t ret = ::pwrite(fd, buf, length, offset);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += ret;
+        offset += ret;
+        length -= ret;
+    }
+    return true;
+}
+
+static std::string fh_to_key(const struct nfs_fh3& fh)
+{
+    static const char hex[] = "0123456789abcdef";
+    std::string key;
+
+    key.reserve(fh.data.data_len * 2);
+    for (uint32_t i = 0; i < fh.data.data_len; i++) {
+        const uint8_t c = (uint8_t) fh.data.data_val[i];
+        key += hex[c >> 4];
+        key += hex[c & 0xf];
+    }
+
+    return key;
+}
+
+disk_cache_entry::disk_cache_entry(const std::string& _key,
+                                   const std::string& cachedir) :
+    key(_key),
+    data_path(cachedir + "/" + _key + ".data"),
+    meta_path(cachedir + "/" + _key + ".meta")
+{
+    assert(!key.empty());
+    last_access = ::time(NULL);
+}
+
+disk_cache_entry::~disk_cache_entry()
+{
+    if (data_fd != -1) {
+        ::close(data_fd);
+        data_fd = -1;
+    }
+
+    /*
+     * Entries w/o any cached data don't need the data file.
+     * Cached data, if any, was persisted by the last sync_meta().
+     */
+    if (nblocks_cached == 0) {
+        ::unlink(data_path.c_str());
+    }
+}
+
+void disk_cache_entry::set_block_nolock(uint64_t b)
+{
+    assert(b < get_nblocks_nolock());
+
+    if (!test_block_nolock(b)) {
+        bitmap[b / 64] |= (1ULL << (b % 64));
+        nblocks_cached++;
+        disk_cache::bytes_cached_g += DISK_CACHE_BLOCK_SIZE;
+        meta_seq++;
+    }
+}
+
+bool disk_cache_entry::is_cached_nolock(uint64_t offset,
+                                        uint64_t length) const
+{
+    if (!enabled || (length == 0) || (nblocks_cached == 0)) {
+        return false;
+    }
+
+    if ((offset + length) > file_size) {
+        return false;
+    }
+
+    const uint64_t first = offset / DISK_CACHE_BLOCK_SIZE;
+    const uint64_t last = (offset + length - 1) / DISK_CACHE_BLOCK_SIZE;
+
+    for (uint64_t b = first; b <= last; b++) {
+        if (!test_block_nolock(b)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool disk_cache_entry::is_cached(uint64_t offset, uint64_t length) const
+{
+    std::unique_lock<std::mutex> lock(dce_lock_46);
+    return is_cached_nolock(offset, length);
+}
+
+void disk_cache_entry::drop_nolock()
+{
+    /*
+     * Meta file must be removed before the data, see comment above the
+     * class.
+     */
+    if (::unlink(meta_path.c_str()) != 0 && errno != ENOENT) {
+        AZLogWarn("[DCACHE] unlink({}) failed: {}",
+                  meta_path, strerror(errno));
+    }
+
+    if (data_fd != -1) {
+        if (::ftruncate(data_fd, 0) != 0) {
+            AZLogWarn("[DCACHE] ftruncate({}) failed: {}",
+                      data_path, strerror(errno));
+        }
+    } else {
+        ::unlink(data_path.c_str());
+    }
+
+    assert(disk_cache::bytes_cached_g >= get_bytes_cached());
+    disk_cache::bytes_cached_g -= get_bytes_cached();
+    nblocks_cached = 0;
+
+    bitmap.assign((get_nblocks_nolock() + 63) / 64, 0);
+    meta_seq = meta_seq_synced = 0;
+    gen++;
+}
+
+void disk_cache_entry::validate(uint64_t size, const struct timespec& mtime)
+{
+    std::unique_lock<std::mutex> lock(dce_lock_46);
+
+    last_access = ::time(NULL);
+
+    if ((size == file_size) &&
+        (mtime.tv_sec == file_mtime.tv_sec) &&
+        (mtime.tv_nsec == file_mtime.tv_nsec)) {
+        if (!enabled) {
+            // disable() must have dropped all cached data.
+            assert(nblocks_cached == 0);
+            enabled = true;
+        }
+        return;
+    }
+
+    if (nblocks_cached > 0) {
+        AZLogDebug("[DCACHE] {}: File changed, size {} -> {}, "
+                   "mtime {}.{} -> {}.{}, dropping {} cached blocks",
+                   key, file_size, size,
+                   file_mtime.tv_sec, file_mtime.tv_nsec,
+                   mtime.tv_sec, mtime.tv_nsec, nblocks_cached);
+        disk_cache::num_stale_g++;
+    }
+
+    file_size = size;
+    file_mtime = mtime;
+    enabled = true;
+    drop_nolock();
+}
+
+void disk_cache_entry::invalidate(uint64_t size, const struct timespec& mtime)
+{
+    std::unique_lock<std::mutex> lock(dce_lock_46);
+
+    if (nblocks_cached > 0) {
+        AZLogDebug("[DCACHE] {}: Invalidating {} cached blocks",
+                   key, nblocks_cached);
+        disk_cache::num_stale_g++;
+    }
+
+    file_size = size;
+    file_mtime = mtime;
+    drop_nolock();
+}
+
+void disk_cache_entry::disable()
+{
+    std::unique_lock<std::mutex> lock(dce_lock_46);
+
+    if (!enabled) {
+        assert(nblocks_cached == 0);
+        return;
+    }
+
+    AZLogDebug("[DCACHE] {}: File modified locally, disabling, dropping {} "
+               "cached blocks", key, nblocks_cached);
+
+    enabled = false;
+    drop_nolock();
+}
+
+bool disk_cache_entry::open_data_nolock()
+{
+    if (data_fd != -1) {
+        return true;
+    }
+
+    data_fd = ::open(data_path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+    if (data_fd == -1) {
+        AZLogError("[DCACHE] Failed to open {}: {}",
+                   data_path, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool disk_cache_entry::read(uint64_t offset, uint64_t length, uint8_t *buf)
+{
+    uint64_t sampled_gen;
+    int fd;
+
+    assert(buf != nullptr);
+
+    {
+        std::unique_lock<std::mutex> lock(dce_lock_46);
+
+        if (!is_cached_nolock(offset, length) || !open_data_nolock()) {
+            return false;
+        }
+
+        sampled_gen = gen;
+        fd = data_fd;
+    }
+
+    last_access = ::time(NULL);
+
+    /*
+     * Read w/o the lock so that reads to the same file can proceed in
+     * parallel. The data fd is only closed by the destructor, but cached
+     * data can be dropped while we are reading, which we detect by a change
+     * in gen.
+     */
+    const bool success = full_pread(fd, buf, length, offset);
+
+    if (!success || (gen != sampled_gen)) {
+        if (!success) {
+            AZLogError("[DCACHE] {}: Read of [{}, {}) failed: {}",
+                       key, offset, offset + length, strerror(errno));
+            disk_cache::num_read_errors_g++;
+
+            std::unique_lock<std::mutex> lock(dce_lock_46);
+            if (gen == sampled_gen) {
+                drop_nolock();
+            }
+        }
+        return false;
+    }
+
+    disk_cache::num_hits_g++;
+    disk_cache::bytes_read_g += length;
+
+    return true;
+}
+
+uint64_t disk_cache_entry::write(uint64_t offset, uint64_t length,
+                                 const uint8_t *buf, uint64_t _gen)
+{
+    assert(buf != nullptr);
+
+    std::unique_lock<std::mutex> lock(dce_lock_46);
+
+    if (!enabled || (_gen != gen) || (offset >= file_size)) {
+        return 0;
+    }
+
+    /*
+     * Data beyond the file size is not cached, and the last block is
+     * cached when we have data till eof.
+     */
+    const uint64_t end = std::min(offset + length, file_size);
+    const uint64_t first =
+        (offset + DISK_CACHE_BLOCK_SIZE - 1) / DISK_CACHE_BLOCK_SIZE;
+    const uint64_t last = (end == file_size) ?
+        ((end + DISK_CACHE_BLOCK_SIZE - 1) / DISK_CACHE_BLOCK_SIZE) :
+        (end / DISK_CACHE_BLOCK_SIZE);
+
+    if (first >= last) {
+        return 0;
+    }
+
+    const uint64_t woff = first * DISK_CACHE_BLOCK_SIZE;
+    const uint64_t wlen =
+        std::min<uint64_t>(last * DISK_CACHE_BLOCK_SIZE, file_size) - woff;
+    assert(woff >= offset && (woff + wlen) <= end);
+
+    /*
+     * Skip if all these blocks are already cached.
+     */
+    uint64_t b;
+    for (b = first; b < last; b++) {
+        if (!test_block_nolock(b)) {
+            break;
+        }
+    }
+
+    if (b == last) {
+        return 0;
+    }
+
+    if (!open_data_nolock()) {
+        return 0;
+    }
+
+    /*
+     * Write with the lock held, so that drop_nolock() cannot truncate
+     * the data file while we are writing to it.
+     */
+    if (!full_pwrite(data_fd, buf + (woff - offset), wlen, woff)) {
+        AZLogError("[DCACHE] {}: Write of [{}, {}) failed: {}",
+                   key, woff, woff + wlen, strerror(errno));
+        return 0;
+    }
+
+    for (b = first; b < last; b++) {
+        set_block_nolock(b);
+    }
+
+    last_access = ::time(NULL);
+    disk_cache::bytes_written_g += wlen;
+
+    return wlen;
+}
+
+bool disk_cache_entry::load_meta()
+{
+    struct disk_cache_meta hdr;
+    struct stat sb;
+
+    const int fd = ::open(meta_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    if (!full_pread(fd, (uint8_t *) &hdr, sizeof(hdr), 0) ||
+        (hdr.magic != DISK_CACHE_META_MAGIC) ||
+        (hdr.version != DISK_CACHE_META_VERSION) ||
+        (hdr.block_size != DISK_CACHE_BLOCK_SIZE) ||
+        (hdr.file_size > AZNFSC_MAX_FILE_SIZE)) {
+        AZLogWarn("[DCACHE] Invalid meta file {}", meta_path);
+        ::close(fd);
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(dce_lock_46);
+
+    file_size = hdr.file_size;
+    file_mtime.tv_sec = hdr.mtime_sec;
+    file_mtime.tv_nsec = hdr.mtime_nsec;
+    last_access = hdr.last_access;
+
+    bitmap.assign((get_nblocks_nolock() + 63) / 64, 0);
+    const uint64_t bitmap_bytes = bitmap.size() * sizeof(uint64_t);
+
+    if (!full_pread(fd, (uint8_t *) bitmap.data(), bitmap_bytes,
+                    sizeof(hdr))) {
+        AZLogWarn("[DCACHE] Short meta file {}", meta_path);
+        ::close(fd);
+        return false;
+    }
+
+    ::close(fd);
+
+    const uint64_t nblocks = get_nblocks_nolock();
+    uint64_t count = 0;
+    uint64_t data_end = 0;
+    for (size_t i = 0; i < bitmap.size(); i++) {
+        if (bitmap[i]) {
+            count += __builtin_popcountll(bitmap[i]);
+            data_end = ((i * 64) + (64 - __builtin_clzll(bitmap[i]))) *
+                       DISK_CACHE_BLOCK_SIZE;
+        }
+    }
+    data_end = std::min(data_end, file_size);
+
+    /*
+     * Bitmap must agree with the header, must not have bits beyond the last
+     * block and the data file must have all the cached data.
+     */
+    const bool bits_beyond_eof =
+        ((nblocks % 64) != 0) && ((bitmap.back() >> (nblocks % 64)) != 0);
+
+    if ((count == 0) ||
+        (count != hdr.nblocks_cached) ||
+        bits_beyond_eof ||
+        (::stat(data_path.c_str(), &sb) != 0) ||
+        ((uint64_t) sb.st_size < data_end)) {
+        AZLogWarn("[DCACHE] Meta file {} doesn't match data file", meta_path);
+        return false;
+    }
+
+    nblocks_cached = count;
+    meta_seq = meta_seq_synced = 0;
+    disk_cache::bytes_cached_g += get_bytes_cached();
+
+    return true;
+}
+
+void disk_cache_entry::sync_meta()
+{
+    struct disk_cache_meta hdr;
+    std::vector<uint64_t> bitmap_copy;
+    uint64_t sampled_gen, sampled_seq;
+    int fd;
+
+    {
+        std::unique_lock<std::mutex> lock(dce_lock_46);
+
+        if ((meta_seq == meta_seq_synced) || (nblocks_cached == 0)) {
+            return;
+        }
+
+        assert(data_fd != -1);
+
+        hdr.magic = DISK_CACHE_META_MAGIC;
+        hdr.version = DISK_CACHE_META_VERSION;
+        hdr.block_size = DISK_CACHE_BLOCK_SIZE;
+        hdr.file_size = file_size;
+        hdr.mtime_sec = file_mtime.tv_sec;
+        hdr.mtime_nsec = file_mtime.tv_nsec;
+        hdr.last_access = last_access;
+        hdr.nblocks_cached = nblocks_cached;
+
+        bitmap_copy = bitmap;
+        sampled_gen = gen;
+        sampled_seq = meta_seq;
+        fd = data_fd;
+    }
+
+    /*
+     * Make sure all the blocks claimed by the bitmap are on disk before the
+     * meta is written. This can take long, so it's done w/o the lock.
+     */
+    if (::fdatasync(fd) != 0) {
+        AZLogWarn("[DCACHE] fdatasync({}) failed: {}",
+                  data_path, strerror(errno));
+        return;
+    }
+
+    const std::string tmp_path = meta_path + ".tmp";
+    const int mfd = ::open(tmp_path.c_str(),
+                           O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+    if (mfd == -1) {
+        AZLogWarn("[DCACHE] Failed to create {}: {}",
+                  tmp_path, strerror(errno));
+        return;
+    }
+
+    const bool success =
+        full_pwrite(mfd, (const uint8_t *) &hdr, sizeof(hdr), 0) &&
+        full_pwrite(mfd, (const uint8_t *) bitmap_copy.data(),
+                    bitmap_copy.size() * sizeof(uint64_t), sizeof(hdr)) &&
+        (::fdatasync(mfd) == 0);
+    ::close(mfd);
+
+    std::unique_lock<std::mutex> lock(dce_lock_46);
+
+    /*
+     * If cached data was dropped after we sampled, this meta is stale.
+     */
+    if (!success || (gen != sampled_gen) ||
+        (::rename(tmp_path.c_str(), meta_path.c_str()) != 0)) {
+        ::unlink(tmp_path.c_str());
+        return;
+    }
+
+    meta_seq_synced = sampled_seq;
+}
+
+bool disk_cache::init(const std::string& _cachedir, uint64_t _max_bytes)
+{
+    // Must be called only once.
+    assert(!enabled);
+    assert(!_cachedir.empty());
+    assert(_max_bytes > 0);
+
+    cachedir = _cachedir;
+    max_bytes = _max_bytes;
+
+    DIR *dir = ::opendir(cachedir.c_str());
+    if (!dir) {
+        AZLogError("[DCACHE] opendir({}) failed: {}",
+                   cachedir, strerror(errno));
+        return false;
+    }
+
+    std::vector<std::string> names;
+    struct dirent *de;
+    while ((de = ::readdir(dir)) != nullptr) {
+        names.emplace_back(de->d_name);
+    }
+    ::closedir(dir);
+
+    auto has_suffix = [](const std::string& s, const std::string& suffix) {
+        return (s.size() > suffix.size()) &&
+               (s.compare(s.size() - suffix.size(),
+                          suffix.size(), suffix) == 0);
+    };
+
+    /*
+     * Load all valid entries, remove invalid meta files and leftover temp
+     * files.
+     */
+    for (const std::string& name : names) {
+        if (has_suffix(name, ".meta.tmp")) {
+            ::unlink((cachedir + "/" + name).c_str());
+            continue;
+        }
+
+        if (!has_suffix(name, ".meta")) {
+            continue;
+        }
+
+        const std::string key = name.substr(0, name.size() - 5);
+        auto entry = std::make_shared<disk_cache_entry>(key, cachedir);
+
+        if (!entry->load_meta()) {
+            ::unlink(entry->meta_path.c_str());
+            ::unlink(entry->data_path.c_str());
+            continue;
+        }
+
+        entries.emplace(key, entry);
+    }
+
+    /*
+     * Data files w/o a valid meta file hold no usable data.
+     */
+    for (const std::string& name : names) {
+        if (has_suffix(name, ".data") &&
+            !entries.count(name.substr(0, name.size() - 5))) {
+            ::unlink((cachedir + "/" + name).c_str());
+        }
+    }
+
+    AZLogInfo("[DCACHE] Loaded {} entries with {} bytes cached from {}, "
+              "max {} bytes",
+              entries.size(), bytes_cached_g.load(), cachedir, max_bytes);
+
+    enabled = true;
+
+    // Cache size may have been reduced since the last run.
+    evict();
+
+    for (int i = 0; i < DISK_CACHE_IO_THREADS; i++) {
+        io_threads.emplace_back(&disk_cache::io_worker, this);
+    }
+    hk_thread = std::thread(&disk_cache::housekeeper, this);
+
+    return true;
+}
+
+void disk_cache::shutdown()
+{
+    if (!enabled) {
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(dcache_lock_47);
+        assert(!shutting_down);
+        shutting_down = true;
+    }
+
+    /*
+     * IO threads complete all queued jobs before exiting, since jobs hold
+     * inode refs which must be dropped before the inodes are freed.
+     */
+    jobs_cv.notify_all();
+    hk_cv.notify_all();
+
+    for (std::thread& t : io_threads) {
+        t.join();
+    }
+    hk_thread.join();
+
+    assert(jobs.empty());
+    assert(bytes_queued_g == 0);
+
+    sync();
+
+    AZLogInfo("[DCACHE] Shutdown, {} entries with {} bytes cached",
+              entries.size(), bytes_cached_g.load());
+}
+
+std::shared_ptr<disk_cache_entry> disk_cache::get_entry(
+        const struct nfs_fh3& fh,
+        uint64_t size,
+        const struct timespec& mtime)
+{
+    if (!enabled) {
+        return nullptr;
+    }
+
+    const std::string key = fh_to_key(fh);
+    std::shared_ptr<disk_cache_entry> entry;
+
+    {
+        std::unique_lock<std::mutex> lock(dcache_lock_47);
+
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            entry = std::make_shared<disk_cache_entry>(key, cachedir);
+            entries.emplace(key, entry);
+        } else {
+            entry = it->second;
+        }
+    }
+
+    entry->validate(size, mtime);
+
+    return entry;
+}
+
+bool disk_cache::queue_job(std::function<void()> job, uint64_t length)
+{
+    {
+        std::unique_lock<std::mutex> lock(dcache_lock_47);
+
+        if (shutting_down ||
+            ((bytes_queued_g + length) > DISK_CACHE_MAX_QUEUED_BYTES)) {
+            return false;
+        }
+
+        jobs.emplace_back(std::move(job), length);
+        bytes_queued_g += length;
+    }
+
+    jobs_cv.notify_one();
+    return true;
+}
+
+void disk_cache::populate(struct nfs_inode *inode,
+                          const struct bytes_chunk& bc,
+                          uint64_t length,
+                          uint64_t gen)
+{
+    assert(inode->magic == NFS_INODE_MAGIC);
+    assert(length <= bc.length);
+
+    const std::shared_ptr<disk_cache_entry>& entry =
+        inode->get_dcache_entry();
+
+    if (!entry || (gen == DISK_CACHE_NO_GEN) || (length == 0) ||
+        (gen != entry->get_gen()) || entry->is_cached(bc.offset, length)) {
+        return;
+    }
+
+    /*
+     * Dropped by the job, after the bc (and hence the membuf) is released.
+     */
+    inode->incref();
+
+    auto bcp = std::make_shared<bytes_chunk>(bc);
+
+    if (!queue_job([inode, entry, bcp, length, gen]() mutable {
+                       entry->write(bcp->offset, length,
+                                    bcp->get_buffer(), gen);
+
+                       // Drop the membuf ref before the inode ref.
+                       bcp.reset();
+                       inode->decref();
+                   }, length)) {
+        num_write_dropped_g++;
+        inode->decref();
+    }
+}
+
+void disk_cache::io_worker()
+{
+    while (true) {
+        std::pair<std::function<void()>, uint64_t> job;
+
+        {
+            std::unique_lock<std::mutex> lock(dcache_lock_47);
+
+            jobs_cv.wait(lock, [this] {
+                return !jobs.empty() || shutting_down;
+            });
+
+            if (jobs.empty()) {
+                assert(shutting_down);
+                return;
+            }
+
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        job.first();
+        job.first = nullptr;
+
+        assert(bytes_queued_g >= job.second);
+        bytes_queued_g -= job.second;
+
+        if (bytes_cached_g > max_bytes) {
+            hk_cv.notify_one();
+        }
+    }
+}
+
+void disk_cache::housekeeper()
+{
+    time_t last_sync = ::time(NULL);
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(dcache_lock_47);
+
+            hk_cv.wait_for(lock, std::chrono::seconds(5), [this] {
+                return shutting_down || (bytes_cached_g > max_bytes);
+            });
+
+            if (shutting_down) {
+                return;
+            }
+        }
+
+        evict();
+
+        const time_t now = ::time(NULL);
+        if ((now - last_sync) >= DISK_CACHE_SYNC_INTERVAL_SEC) {
+            sync();
+            last_sync = now;
+        }
+    }
+}
+
+void disk_cache::sync()
+{
+    std::vector<std::shared_ptr<disk_cache_entry>> snapshot;
+
+    {
+        std::unique_lock<std::mutex> lock(dcache_lock_47);
+
+        snapshot.reserve(entries.size());
+        for (auto& it : entries) {
+            snapshot.push_back(it.second);
+        }
+    }
+
+    for (auto& entry : snapshot) {
+        entry->sync_meta();
+    }
+}
+
+void disk_cache::evict()
+{
+    if (bytes_cached_g <= max_bytes) {
+        return;
+    }
+
+    const uint64_t target = (max_bytes * 9) / 10;
+    std::vector<std::pair<time_t, std::shared_ptr<disk_cache_entry>>> lru;
+
+    {
+        std::unique_lock<std::mutex> lock(dcache_lock_47);
+
+        for (auto& it : entries) {
+            if (it.second->nblocks_cached > 0) {
+                lru.emplace_back(it.second->last_access.load(), it.second);
+            }
+        }
+    }
+
+    std::sort(lru.begin(), lru.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    for (auto& it : lru) {
+        if (bytes_cached_g <= target) {
+            break;
+        }
+
+        std::unique_lock<std::mutex> lock(it.second->dce_lock_46);
+
+        AZLogDebug("[DCACHE] Evicting {} ({} bytes, last access {})",
+                   it.second->key, it.second->get_bytes_cached(), it.first);
+
+        it.second->drop_nolock();
+        num_evictions_g++;
+    }
+
+    lru.clear();
+
+    /*
+     * Entries not referenced by any inode and w/o any cached data are no
+     * longer needed.
+     */
+    std::unique_lock<std::mutex> lock(dcache_lock_47);
+    for (auto it = entries.begin(); it != entries.end();) {
+        if ((it->second.use_count() == 1) &&
+            (it->second->nblocks_cached == 0)) {
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+}
@@ -1,16 +1,35 @@
 #include "fcsm.h"
 #include "rpc_task.h"
 #include "nfs_inode.h"
+#include "usdt.h"
 
 namespace aznfsc {
 
+/*
+ * Write window limits.
+ * We want at least two full blocks flushing so that the next block can be
+ * written while one completes, and not more than one full dirty extent as
+ * otherwise we will be flushing all of the dirty data as soon as it's
+ * written, resulting in smaller blocks.
+ */
+static uint64_t max_write_window()
+{
+    return bytes_chunk_cache::max_dirty_extent_bytes();
+}
+
+static uint64_t min_write_window()
+{
+    return std::min<uint64_t>(2 * AZNFSC_MAX_BLOCK_SIZE, max_write_window());
+}
+
 /**
  * This is called from alloc_fcsm() with exclusive lock on ilock_1.
  */
 fcsm::fcsm(struct nfs_client *_client,
            struct nfs_inode *_inode) :
     client(_client),
-    inode(_inode)
+    inode(_inode),
+    write_window(min_write_window())
 {
     assert(client->magic == NFS_CLIENT_MAGIC);
     assert(inode->magic == NFS_INODE_MAGIC);
@@ -82,6 +101,8 @@ void fcsm::mark_running()
 {
     assert(inode->is_flushing);
     running = true;
+
+    AZNFSC_PROBE1(fcsm_run, inode->get_fuse_ino());
 }
 
 void fcsm::clear_running()
@@ -90,16 +111,371 @@ void fcsm::clear_running()
     // Must be running.
     assert(running);
     running = false;
+
+    AZNFSC_PROBE1(fcsm_idle, inode->get_fuse_ino());
 }
 
-void fcsm::add_flushing(uint64_t bytes)
+uint64_t fcsm::add_flushing(uint64_t bytes, uint64_t flush_seq)
 {
     assert(inode->is_flushing);
     assert(flushed_seq_num <= flushing_seq_num);
     assert(committed_seq_num <= committing_seq_num);
     assert(committing_seq_num <= flushed_seq_num);
+    assert(bytes > 0);
+
+    std::unique_lock<std::mutex> _lock(flush_seq_lock_48);
+
+    if (flush_seq == UINT64_MAX) {
+        // New flush.
+        flush_seq = flushing_seq_num;
+        [[maybe_unused]]
+        const bool inserted = flushes_inflight.emplace(flush_seq, bytes).second;
+        assert(inserted);
+    } else {
+        /*
+         * Extend an existing flush. Since flushes are added with flush_lock
+         * held and a flush is not issued till all its bytes are added, it
+         * must be the last one.
+         */
+        assert(!flushes_inflight.empty());
+        auto it = std::prev(flushes_inflight.end());
+        assert(it->first == flush_seq);
+        assert((it->first + it->second) == flushing_seq_num);
+        it->second += bytes;
+    }
 
     flushing_seq_num += bytes;
+
+    AZNFSC_PROBE3(fcsm_flush_start, inode->get_fuse_ino(), flush_seq, bytes);
+
+    return flush_seq;
+}
+
+uint64_t fcsm::get_commit_batch_bytes() const
+{
+    const uint64_t max_commit_bytes = bytes_chunk_cache::max_commit_bytes();
+
+    return std::min(FCSM_COMMIT_BATCH_WINDOWS * get_write_window(),
+                    max_commit_bytes);
+}
+
+void fcsm::update_write_window(uint64_t rtt_usec)
+{
+    if (rtt_usec == 0) {
+        return;
+    }
+
+    /*
+     * Queueing at the server or the connections only adds to the RTT, so
+     * the min RTT seen is the best estimate of the actual write delay.
+     * Forget it after a while so that we notice if the server gets slower.
+     */
+    const uint64_t now_usec = get_current_usecs();
+    if ((min_rtt_usec == 0) ||
+        (rtt_usec <= min_rtt_usec) ||
+        ((now_usec - min_rtt_stamp_usec) > FCSM_MIN_RTT_EXPIRY_USEC)) {
+        min_rtt_usec = rtt_usec;
+        min_rtt_stamp_usec = now_usec;
+    }
+
+    /*
+     * Bandwidth-delay product.
+     * get_write_MBps() is in units of 10^6 bytes/sec, which multiplied by
+     * usecs gives bytes. Note that this is the write throughput across all
+     * files and not just this file, so with many files being written it
+     * overestimates, max_write_window() keeps it in check.
+     * Write throughput is limited by the window itself, which is why we
+     * have the gain, so that the window keeps growing till we are limited by
+     * the backend.
+     */
+    const uint64_t bdp = client->get_write_MBps() * min_rtt_usec;
+    const uint64_t window =
+        std::clamp<uint64_t>(bdp * FCSM_WRITE_WINDOW_GAIN,
+                             min_write_window(),
+                             max_write_window());
+
+    if (window != write_window) {
+        AZLogDebug("[{}] [FCSM] write window {} -> {} (min_rtt: {} usec, "
+                   "write_MBps: {})",
+                   inode->get_fuse_ino(), write_window.load(), window,
+                   min_rtt_usec.load(), client->get_write_MBps());
+        write_window = window;
+    }
+}
+
+void fcsm::trim_to_write_window(std::vector<bytes_chunk>& bc_vec,
+                                uint64_t& bytes) const
+{
+    const uint64_t bytes_flushing =
+        inode->get_filecache()->bytes_flushing;
+    const uint64_t window = get_write_window();
+    const uint64_t room =
+        (bytes_flushing < window) ? (window - bytes_flushing) : 0;
+    uint64_t bytes_kept = 0;
+    size_t i = 0;
+
+    for (; i < bc_vec.size(); i++) {
+        if ((i > 0) && ((bytes_kept + bc_vec[i].length) > room)) {
+            break;
+        }
+        bytes_kept += bc_vec[i].length;
+    }
+
+    if (i == bc_vec.size()) {
+        return;
+    }
+
+    AZLogDebug("[{}] [FCSM] trimming flush {} -> {} bytes, write window: {}, "
+               "bytes_flushing: {}",
+               inode->get_fuse_ino(), bytes, bytes_kept, window,
+               bytes_flushing);
+
+    /*
+     * Release inuse count held by get_contiguous_dirty_bcs() or
+     * get_dirty_nonflushing_bcs_range() on the bcs we are not flushing now.
+     */
+    for (size_t j = i; j < bc_vec.size(); j++) {
+        bc_vec[j].get_membuf()->clear_inuse();
+    }
+
+    bc_vec.resize(i);
+    bytes = bytes_kept;
+}
+
+uint64_t fcsm::hold_write_tail(std::vector<bytes_chunk>& bc_vec,
+                               uint64_t& bytes,
+                               uint64_t min_bytes) const
+{
+    /*
+     * Writer has gone quiet, the tail won't grow, flush it now.
+     */
+    const uint64_t now_usec = get_current_usecs();
+    if ((last_write_usec + FCSM_WRITE_COMBINE_HOLD_USEC) < now_usec) {
+        return 0;
+    }
+
+    const uint64_t wsize = client->mnt_options.wsize_adj;
+    const uint64_t max_iosize =
+        inode->is_stable_write() ? wsize : AZNFSCFG_WSIZE_MAX;
+
+    /*
+     * Find the bcs that sync_membufs() would pack into the last WRITE,
+     * mimicking bc_iovec::add_bc().
+     */
+    size_t tail_start = 0;
+    uint64_t tail_bytes = 0;
+    uint64_t tail_end = 0;
+    int tail_iovcnt = 0;
+
+    for (size_t i = 0; i < bc_vec.size(); i++) {
+        const bytes_chunk& bc = bc_vec[i];
+
+        if ((i == 0) ||
+            (bc.offset != tail_end) ||
+            ((tail_bytes + bc.length) > max_iosize) ||
+            ((tail_iovcnt + 1) > BC_IOVEC_MAX_VECTORS)) {
+            tail_start = i;
+            tail_bytes = 0;
+            tail_iovcnt = 0;
+        }
+
+        tail_bytes += bc.length;
+        tail_end = bc.offset + bc.length;
+        tail_iovcnt++;
+    }
+
+    if ((tail_start == 0) ||
+        (tail_bytes >= wsize) ||
+        ((bytes - tail_bytes) < min_bytes)) {
+        return 0;
+    }
+
+    AZLogDebug("[{}] [FCSM] holding {} tail bytes @ {} for write-combining, "
+               "flushing {} bytes",
+               inode->get_fuse_ino(), tail_bytes, bc_vec[tail_start].offset,
+               bytes - tail_bytes);
+
+    /*
+     * Release inuse count held by get_contiguous_dirty_bcs() or
+     * get_dirty_nonflushing_bcs_range() on the bcs we are not flushing now.
+     */
+    for (size_t j = tail_start; j < bc_vec.size(); j++) {
+        bc_vec[j].get_membuf()->clear_inuse();
+    }
+
+    bc_vec.resize(tail_start);
+    bytes -= tail_bytes;
+
+    INC_GBL_STATS(write_tail_held, 1);
+    INC_GBL_STATS(bytes_write_tail_held, tail_bytes);
+
+    return tail_bytes;
+}
+
+uint64_t fcsm::fill_write_window()
+{
+    assert(inode->is_flushing);
+
+    /*
+     * Commit must wait for all ongoing flushes to complete and flushes
+     * issued after a commit must wait for the commit to complete.
+     */
+    if (!is_running() || inode->is_commit_in_progress()) {
+        return 0;
+    }
+
+    /*
+     * Nothing is flushing, on_flush_complete()/on_commit_complete() issue the
+     * next flush in that case.
+     */
+    if (!inode->get_filecache()->is_flushing_in_progress()) {
+        return 0;
+    }
+
+    /*
+     * If the oldest commit target can be met by what is already flushing,
+     * let the ongoing flushes complete so that we can commit.
+     */
+    if (!ctgtq.empty() && (ctgtq.front().commit_seq <= flushing_seq_num)) {
+        return 0;
+    }
+
+    /*
+     * Targets are queued in increasing seq order, so the last one tells us
+     * how much we are asked to flush.
+     */
+    const uint64_t goal =
+        std::max((ftgtq.empty() ? 0 : ftgtq.back().flush_seq),
+                 (ctgtq.empty() ? 0 : ctgtq.back().commit_seq));
+    if (goal <= flushing_seq_num) {
+        return 0;
+    }
+
+    /*
+     * Only issue full blocks, as we have writes outstanding anyway, waiting
+     * for more dirty data to accumulate costs nothing. For stable writes
+     * there are no blocks to fill, but we still don't want to issue anything
+     * smaller than a write RPC.
+     */
+    const uint64_t min_bytes =
+        inode->is_stable_write() ?
+            (uint64_t) client->mnt_options.wsize_adj : AZNFSC_MAX_BLOCK_SIZE;
+    const uint64_t bytes_flushing =
+        inode->get_filecache()->bytes_flushing;
+    const uint64_t window = get_write_window();
+
+    if ((bytes_flushing + min_bytes) > window) {
+        return 0;
+    }
+
+    uint64_t bytes;
+    std::vector<bytes_chunk> bc_vec;
+
+    if (inode->is_stable_write()) {
+        bc_vec = inode->get_filecache()->get_dirty_nonflushing_bcs_range(
+                                                    0, UINT64_MAX, &bytes);
+    } else {
+        bc_vec = inode->get_filecache()->get_contiguous_dirty_bcs(&bytes);
+    }
+
+    trim_to_write_window(bc_vec, bytes);
+    hold_write_tail(bc_vec, bytes);
+
+    /*
+     * Unstable writes must continue right after the data already flushing,
+     * these are the only unstable writes we issue while other writes are
+     * outstanding, see sync_membufs().
+     */
+    const bool append =
+        inode->is_stable_write() ||
+        (!bc_vec.empty() &&
+         ((off_t) bc_vec[0].offset == inode->get_putblock_filesize()));
+
+    if ((bytes < min_bytes) || !append) {
+        for (bytes_chunk& bc : bc_vec) {
+            bc.get_membuf()->clear_inuse();
+        }
+        return 0;
+    }
+
+    AZLogDebug("[{}] [FCSM] filling write window, flushing {} bytes, "
+               "bytes_flushing: {}, write window: {}, flushing_seq_num: {}, "
+               "flushed_seq_num: {}",
+               inode->get_fuse_ino(), bytes, bytes_flushing, window,
+               flushing_seq_num.load(), flushed_seq_num.load());
+
+    INC_GBL_STATS(flush_pipelined, 1);
+    INC_GBL_STATS(bytes_flush_pipelined, bytes);
+
+    [[maybe_unused]]
+    const uint64_t prev_flushing_seq_num = flushing_seq_num;
+    inode->sync_membufs(bc_vec, false /* is_flush */);
+    assert(flushing_seq_num <= (prev_flushing_seq_num + bytes));
+
+    return bytes;
+}
+
+void fcsm::complete_flush_targets()
+{
+    assert(inode->is_flushing);
+
+    /*
+     * Go over all queued flush targets to see if any can be completed after
+     * the latest flush completed.
+     */
+    while (!ftgtq.empty()) {
+        struct fctgt& tgt = ftgtq.front();
+
+        assert(tgt.fcsm == this);
+
+        /*
+         * ftgtq has flush targets in increasing order of flushed_seq_num, so
+         * as soon as we find one that's greater than flushed_seq_num, we can
+         * safely skip the rest.
+         */
+        if (tgt.flush_seq > flushed_seq_num) {
+            break;
+        }
+
+        if (tgt.task) {
+            // Only one of task or done can be present.
+            assert(!tgt.done);
+            assert(tgt.task->magic == RPC_TASK_MAGIC);
+            assert(tgt.task->get_op_type() == FUSE_WRITE);
+            assert(tgt.task->rpc_api->write_task.is_fe());
+            assert(tgt.task->rpc_api->write_task.get_size() > 0);
+
+            AZLogDebug("[{}] [FCSM] completing blocking flush target: {}, "
+                       "flushed_seq_num: {}, write task: [{}, {})",
+                       inode->get_fuse_ino(),
+                       tgt.flush_seq,
+                       flushed_seq_num.load(),
+                       tgt.task->rpc_api->write_task.get_offset(),
+                       tgt.task->rpc_api->write_task.get_offset() +
+                       tgt.task->rpc_api->write_task.get_size());
+
+            tgt.task->reply_write(
+                    tgt.task->rpc_api->write_task.get_size());
+        } else if (tgt.done) {
+            AZLogDebug("[{}] [FCSM] completing blocking flush target: {}, "
+                       "flushed_seq_num: {}",
+                       inode->get_fuse_ino(),
+                       tgt.flush_seq,
+                       flushed_seq_num.load());
+
+            assert(*tgt.done == false);
+            *tgt.done = true;
+        } else {
+            AZLogDebug("[{}] [FCSM] completing non-blocking flush target: {}, "
+                       "flushed_seq_num: {}",
+                       inode->get_fuse_ino(),
+                       tgt.flush_seq,
+                       flushed_seq_num.load());
+        }
+
+        // Flush target accomplished, remove from queue.
+        ftgtq.pop();
+    }
 }
 
 void fcsm::add_committing(uint64_t bytes)
@@ -111,6 +487,8 @@ void fcsm::add_committing(uint64_t bytes)
 
     committing_seq_num += bytes;
 
+    AZNFSC_PROBE2(fcsm_commit_start, inode->get_fuse_ino(), bytes);
+
     // We can only commit a byte that's flushed.
     assert(flushed_seq_num <= flushing_seq_num);
     assert(committing_seq_num <= flushed_seq_num);
@@ -131,6 +509,8 @@ void fcsm::run(struct rpc_task *task,
     const bool sparse_write = false;
     const fuse_ino_t ino = task->rpc_api->write_task.get_ino();
 
+    last_write_usec = get_current_usecs();
+
     /*
      * fcsm::run() is called after fuse thread successfully copies user data
      * into the cache. We can have the following cases (in decreasing order of
@@ -146,7 +526,7 @@ void fcsm::run(struct rpc_task *task,
      *    write threshold" and then we have to slow down the writers by delaying
      *    completion.
      * 2. Cache has uncommitted data beyond the "commit threshold", ref
-     *    commit_required().
+     *    commit_required() and get_commit_batch_bytes().
      *    In this case we free up space in the cache by committing data.
      *    We just initiate a commit while the current write request is
      *    completed. Note that we want to delay commits so that we can reduce
@@ -198,7 +578,7 @@ void fcsm::run(struct rpc_task *task,
         (sparse_write || inode->get_filecache()->do_inline_write());
     const bool need_commit =
         !need_inline_write &&
-        inode->get_filecache()->commit_required();
+        inode->get_filecache()->commit_required(get_commit_batch_bytes());
     const bool need_flush =
         !need_inline_write &&
         inode->get_filecache()->flush_required(extent_right - extent_left);
@@ -272,7 +652,7 @@ void fcsm::run(struct rpc_task *task,
                        ino);
         } else {
             AZLogDebug("[{}] Committing {} bytes", ino,
-                       inode->get_filecache()->max_commit_bytes());
+                       inode->get_filecache()->get_bytes_to_commit());
             inode->get_fcsm()->ensure_commit(offset, length, nullptr);
         }
         inode->flush_unlock();
@@ -574,10 +954,12 @@ void fcsm::ensure_commit(uint64_t write_off,
                      commit_full);
 
         /*
-         * ensure_flush() flushes *all* dirty data, so it must have scheduled
-         * flushing till target_committed_seq_num.
+         * ensure_flush() flushes *all* dirty data, but it may issue only part
+         * of it right away, as per the write window, rest is issued as
+         * writes complete. The commit target queued below will make sure we
+         * flush till target_committed_seq_num before committing.
          */
-        assert(flushing_seq_num >= target_committed_seq_num);
+        assert(flushing_seq_num > flushed_seq_num);
 
         if (!inode->is_stable_write()) {
             /**
@@ -713,7 +1095,7 @@ void fcsm::ensure_flush(uint64_t write_off,
         inode->get_filecache()->get_bytes_to_flush();
     const uint64_t last_flush_seq =
                 !ftgtq.empty() ? ftgtq.front().flush_seq : 0;
-    const uint64_t target_flushed_seq_num =
+    uint64_t target_flushed_seq_num =
              std::max((flushing_seq_num + bytes_to_flush), last_flush_seq);
 
     /*
@@ -757,6 +1139,7 @@ void fcsm::ensure_flush(uint64_t write_off,
          */
         if (!task && !done &&
             (target_flushed_seq_num == last_flush_seq)) {
+            fill_write_window();
             return;
         }
 
@@ -766,6 +1149,12 @@ void fcsm::ensure_flush(uint64_t write_off,
                       task,
                       done,
                       flush_full_unstable);
+
+        /*
+         * Don't wait for the ongoing flush to complete, if the write window
+         * allows, issue more now.
+         */
+        fill_write_window();
         return;
     }
 
@@ -828,6 +1217,27 @@ void fcsm::ensure_flush(uint64_t write_off,
     assert(bc_vec.empty() == (bytes == 0));
     assert(bytes > 0);
 
+    /*
+     * Flush only as much as the write window allows, the rest will be issued
+     * by fill_write_window() as writes complete, or by on_flush_complete()
+     * once all of these complete.
+     */
+    trim_to_write_window(bc_vec, bytes);
+
+    /*
+     * Nobody is waiting for this flush, so a small trailing write can be
+     * held back for combining with the appends that follow. Those bytes are
+     * not part of this flush target.
+     */
+    if (!task && !done && !flush_full_unstable) {
+        const uint64_t held = hold_write_tail(bc_vec, bytes);
+        if (held > 0) {
+            target_flushed_seq_num =
+                std::max(target_flushed_seq_num - held,
+                         flushing_seq_num + bytes);
+        }
+    }
+
     /*
      * Kickstart the state machine.
      * Since we pass the 3rd arg to sync_membufs, it tells sync_membufs()
@@ -912,6 +1322,8 @@ void fcsm::on_commit_complete(uint64_t commit_bytes)
     // Update committed_seq_num to account for the commit_bytes.
     committed_seq_num += commit_bytes;
 
+    AZNFSC_PROBE2(fcsm_commit_done, inode->get_fuse_ino(), commit_bytes);
+
     /*
      * When a commit completes it commits everything that has been flushed
      * till now also whatever has been scheduled for commit.
@@ -1046,6 +1458,8 @@ void fcsm::on_commit_complete(uint64_t commit_bytes)
              */
         }
 
+        trim_to_write_window(bc_vec, bytes);
+
         // flushed_seq_num can never be more than flushing_seq_num.
         assert(flushed_seq_num <= flushing_seq_num);
 
@@ -1089,7 +1503,9 @@ void fcsm::on_commit_complete(uint64_t commit_bytes)
  *       are exhausted. No new tasks can complete if libnfs threads are
  *       blocked.
  */
-void fcsm::on_flush_complete(uint64_t flush_bytes)
+void fcsm::on_flush_complete(uint64_t flush_seq,
+                             uint64_t flush_bytes,
+                             uint64_t rtt_usec)
 {
     // Must be called only for success.
     assert(inode->get_write_error() == 0);
@@ -1116,15 +1532,37 @@ void fcsm::on_flush_complete(uint64_t flush_bytes)
     assert(committed_seq_num <= committing_seq_num);
     assert(committing_seq_num <= flushing_seq_num);
 
-    // Update flushed_seq_num to account for the newly flushed bytes.
-    flushed_seq_num += flush_bytes;
+    /*
+     * Update flushed_seq_num to account for the newly flushed bytes.
+     * Flushes can complete out of order, flushed_seq_num can only move till
+     * the oldest flush that's still not complete.
+     */
+    bool all_flushed;
+    {
+        std::unique_lock<std::mutex> _lock(flush_seq_lock_48);
+        auto it = flushes_inflight.find(flush_seq);
+        assert(it != flushes_inflight.end());
+        assert(it->second == flush_bytes);
+        flushes_inflight.erase(it);
+
+        all_flushed = flushes_inflight.empty();
+        flushed_seq_num = all_flushed ? flushing_seq_num.load() :
+                                        flushes_inflight.begin()->first;
+    }
 
     // flushed_seq_num can never go more than flushing_seq_num.
     assert(flushed_seq_num <= flushing_seq_num);
 
-    AZLogDebug("[{}] [FCSM] on_flush_complete({}), Fd: {}, Fing: {}, "
-               "Cd: {}, Cing: {}, Fq: {}, Cq: {}, bytes_flushing: {}",
+    update_write_window(rtt_usec);
+
+    AZNFSC_PROBE4(fcsm_flush_done, inode->get_fuse_ino(), flush_seq,
+                  flush_bytes, rtt_usec);
+
+    AZLogDebug("[{}] [FCSM] on_flush_complete({}, {}), Fd: {}, Fing: {}, "
+               "Cd: {}, Cing: {}, Fq: {}, Cq: {}, bytes_flushing: {}, "
+               "write_window: {}",
                inode->get_fuse_ino(),
+               flush_seq,
                flush_bytes,
                flushed_seq_num.load(),
                flushing_seq_num.load(),
@@ -1132,15 +1570,23 @@ void fcsm::on_flush_complete(uint64_t flush_bytes)
                committing_seq_num.load(),
                ftgtq.size(),
                ctgtq.size(),
-               inode->get_filecache()->bytes_flushing.load());
+               inode->get_filecache()->bytes_flushing.load(),
+               write_window.load());
 
     /*
      * If this is not the last completing flush (of the multiple parallel
-     * flushes that sync_membufs() may start), don't do anything.
-     * Only the last completing flush checks flush targets, as we cannot
-     * start a new flush or commit till the current flush completes fully.
+     * flushes that may be ongoing), we cannot start a commit or a flush that
+     * needs switching to stable writes, but we can complete flush targets
+     * met by the flushed_seq_num and keep the write window full.
+     * We must not block the libnfs thread waiting for the flush_lock, if
+     * someone else holds it we leave it to the completions that follow.
      */
-    if (inode->get_filecache()->is_flushing_in_progress()) {
+    if (!all_flushed || inode->get_filecache()->is_flushing_in_progress()) {
+        if (inode->try_flush_lock()) {
+            complete_flush_targets();
+            fill_write_window();
+            inode->flush_unlock();
+        }
         return;
     }
 
@@ -1156,9 +1602,12 @@ void fcsm::on_flush_complete(uint64_t flush_bytes)
      * 1. The first one didn't find anything to do, so it stopped the FSCM.
      * 2. The first one triggered a flush target.
      * 3. The first one triggered a commit target.
+     * Also, if some completed flush has not yet updated flushed_seq_num,
+     * leave it to that one.
      */
     if (inode->get_filecache()->is_flushing_in_progress() ||
         inode->is_commit_in_progress() ||
+        (flushed_seq_num != flushing_seq_num) ||
         !is_running()) {
         assert(is_running() || ftgtq.empty());
         inode->flush_unlock();
@@ -1171,63 +1620,7 @@ void fcsm::on_flush_complete(uint64_t flush_bytes)
      */
     assert(flushed_seq_num == flushing_seq_num);
 
-    /*
-     * Go over all queued flush targets to see if any can be completed after
-     * the latest flush completed.
-     */
-    while (!ftgtq.empty()) {
-        struct fctgt& tgt = ftgtq.front();
-
-        assert(tgt.fcsm == this);
-
-        /*
-         * ftgtq has flush targets in increasing order of flushed_seq_num, so
-         * as soon as we find one that's greater than flushed_seq_num, we can
-         * safely skip the rest.
-         */
-        if (tgt.flush_seq > flushed_seq_num) {
-            break;
-        }
-
-        if (tgt.task) {
-            // Only one of task or done can be present.
-            assert(!tgt.done);
-            assert(tgt.task->magic == RPC_TASK_MAGIC);
-            assert(tgt.task->get_op_type() == FUSE_WRITE);
-            assert(tgt.task->rpc_api->write_task.is_fe());
-            assert(tgt.task->rpc_api->write_task.get_size() > 0);
-
-            AZLogDebug("[{}] [FCSM] completing blocking flush target: {}, "
-                       "flushed_seq_num: {}, write task: [{}, {})",
-                       inode->get_fuse_ino(),
-                       tgt.flush_seq,
-                       flushed_seq_num.load(),
-                       tgt.task->rpc_api->write_task.get_offset(),
-                       tgt.task->rpc_api->write_task.get_offset() +
-                       tgt.task->rpc_api->write_task.get_size());
-
-            tgt.task->reply_write(
-                    tgt.task->rpc_api->write_task.get_size());
-        } else if (tgt.done) {
-            AZLogDebug("[{}] [FCSM] completing blocking flush target: {}, "
-                       "flushed_seq_num: {}",
-                       inode->get_fuse_ino(),
-                       tgt.flush_seq,
-                       flushed_seq_num.load());
-
-            assert(*tgt.done == false);
-            *tgt.done = true;
-        } else {
-            AZLogDebug("[{}] [FCSM] completing non-blocking flush target: {}, "
-                       "flushed_seq_num: {}",
-                       inode->get_fuse_ino(),
-                       tgt.flush_seq,
-                       flushed_seq_num.load());
-        }
-
-        // Flush target accomplished, remove from queue.
-        ftgtq.pop();
-    }
+    complete_flush_targets();
 
     /*
      * We just completed a flush. See if we have some commit targets that we
@@ -1293,12 +1686,19 @@ void fcsm::on_flush_complete(uint64_t flush_bytes)
          */
         assert(!bc_vec.empty());
         // We should flush all the dirty data in the chunkmap.
-        [[maybe_unused]]
         const uint64_t next_goal =
             std::max((ftgtq.empty() ? 0 : ftgtq.front().flush_seq),
                      (ctgtq.empty() ? 0 : ctgtq.front().commit_seq));
         assert(bytes >= (next_goal - flushing_seq_num));
 
+        /*
+         * Flush as much as the write window allows, the rest is issued by
+         * fill_write_window() as these complete. A small tail can be held
+         * only if we still flush enough to meet the next target.
+         */
+        trim_to_write_window(bc_vec, bytes);
+        hold_write_tail(bc_vec, bytes, next_goal - flushing_seq_num);
+
         // flushed_seq_num can never be more than flushing_seq_num.
         assert(flushed_seq_num <= flushing_seq_num);
 
@@ -3,8 +3,11 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 
+#include <algorithm>
+
 #include "aznfsc.h"
 #include "file_cache.h"
+#include "membuf_pool.h"
 #include "nfs_inode.h"
 #include "rpc_task.h"
 
@@ -38,6 +41,7 @@ namespace aznfsc {
 /* static */ std::atomic<uint64_t> bytes_chunk_cache::num_truncate_g = 0;
 /* static */ std::atomic<uint64_t> bytes_chunk_cache::bytes_truncate_g = 0;
 /* static */ std::atomic<uint64_t> bytes_chunk_cache::bytes_allocated_g = 0;
+/* static */ std::atomic<uint64_t> bytes_chunk_cache::cache_budget_g = 0;
 /* static */ std::atomic<uint64_t> bytes_chunk_cache::bytes_cached_g = 0;
 /* static */ std::atomic<uint64_t> bytes_chunk_cache::bytes_dirty_g = 0;
 /* static */ std::atomic<uint64_t> bytes_chunk_cache::bytes_flushing_g = 0;
@@ -72,8 +76,18 @@ membuf::membuf(bytes_chunk_cache *_bcc,
         assert(bcc->bytes_allocated_g >= allocated_length);
     } else {
         assert(initial_length > 0);
-        // TODO: Handle memory alloc failures gracefully.
-        allocated_buffer = buffer = new uint8_t[initial_length];
+        /*
+         * Buffers come from membuf_pool which caches freed buffers for
+         * reuse, avoiding the allocator churn and page faults of allocating
+         * multi-MB buffers for every chunk.
+         *
+         * TODO: Handle memory alloc failures gracefully.
+         */
+        allocated_buffer = buffer = membuf_pool::alloc(initial_length);
+        if (!allocated_buffer) {
+            AZLogError("membuf_pool::alloc({}) failed", initial_length);
+            throw std::bad_alloc();
+        }
         allocated_length = initial_length;
 
         bcc->bytes_allocated_g += allocated_length;
@@ -166,7 +180,7 @@ membuf::~membuf()
         bcc->bytes_allocated -= allocated_length;
         bcc->bytes_allocated_g -= allocated_length;
 
-        delete [] allocated_buffer;
+        membuf_pool::free(allocated_buffer, allocated_length);
         allocated_buffer = buffer = nullptr;
     }
 
@@ -716,8 +730,11 @@ bool membuf::set_locked()
     }
 
     if (start_usecs) {
+        const uint64_t wait_usecs = get_current_usecs() - start_usecs;
         bcc->num_lockwait_g++;
-        bcc->lock_wait_usecs_g += (get_current_usecs() - start_usecs);
+        bcc->lock_wait_usecs_g += wait_usecs;
+        AZNFSC_PROBE3(membuf_lock_wait, offset.load(), length.load(),
+                      wait_usecs);
     }
 
     bcc->num_locked_g++;
@@ -993,12 +1010,98 @@ bytes_chunk_cache::~bytes_chunk_cache()
 {
     clear();
 
+    /*
+     * clear() w/o shutdown leaves the retired chunks alone, they must be
+     * freed before the cache goes as membuf destructor updates our stats.
+     */
+    reclaim_retired(UINT64_MAX);
+    assert(retired.empty());
+
     assert(num_caches > 0);
     num_caches--;
     AZLogDebug("[{}] Deleted file cache, total file caches now: {}",
                CACHE_TAG, get_num_caches());
 }
 
+/* static */
+uint32_t bytes_chunk_cache::get_shard_mask(uint64_t offset, uint64_t length)
+{
+    static_assert((CHUNKMAP_SHARDS & (CHUNKMAP_SHARDS - 1)) == 0);
+    static_assert(CHUNKMAP_SHARDS <= 32);
+    static_assert((CHUNKMAP_REGION_SIZE % AZNFSC_MAX_CHUNK_SIZE) == 0);
+
+    assert(length > 0);
+    assert((offset + length) <= AZNFSC_MAX_FILE_SIZE);
+
+    const uint64_t first_region = (offset / CHUNKMAP_REGION_SIZE);
+    const uint64_t last_region = ((offset + length - 1) / CHUNKMAP_REGION_SIZE);
+
+    // Range covers all the shards.
+    if ((last_region - first_region) >= (CHUNKMAP_SHARDS - 1)) {
+        return (uint32_t) ((1ULL << CHUNKMAP_SHARDS) - 1);
+    }
+
+    uint32_t shard_mask = 0;
+    for (uint64_t region = first_region; region <= last_region; region++) {
+        shard_mask |= (1U << (region & (CHUNKMAP_SHARDS - 1)));
+    }
+
+    return shard_mask;
+}
+
+chunkmap_lock::chunkmap_lock(const bytes_chunk_cache *_bcc) :
+    bcc(_bcc),
+    shard_mask((uint32_t) ((1ULL << CHUNKMAP_SHARDS) - 1))
+{
+    assert(bcc != nullptr);
+}
+
+chunkmap_lock::chunkmap_lock(const bytes_chunk_cache *_bcc,
+                             uint64_t offset,
+                             uint64_t length) :
+    bcc(_bcc),
+    shard_mask(bytes_chunk_cache::get_shard_mask(offset, length))
+{
+    assert(bcc != nullptr);
+    assert(shard_mask != 0);
+}
+
+void chunkmap_lock::lock()
+{
+    for (int i = 0; i < CHUNKMAP_SHARDS; i++) {
+        if (has_shard(i)) {
+            bcc->shards[i].chunkmap_lock_43.lock();
+        }
+    }
+}
+
+void chunkmap_lock::unlock()
+{
+    for (int i = CHUNKMAP_SHARDS - 1; i >= 0; i--) {
+        if (has_shard(i)) {
+            bcc->shards[i].chunkmap_lock_43.unlock();
+        }
+    }
+}
+
+void chunkmap_lock::lock_shared()
+{
+    for (int i = 0; i < CHUNKMAP_SHARDS; i++) {
+        if (has_shard(i)) {
+            bcc->shards[i].chunkmap_lock_43.lock_shared();
+        }
+    }
+}
+
+void chunkmap_lock::unlock_shared()
+{
+    for (int i = CHUNKMAP_SHARDS - 1; i >= 0; i--) {
+        if (has_shard(i)) {
+            bcc->shards[i].chunkmap_lock_43.unlock_shared();
+        }
+    }
+}
+
 std::vector<bytes_chunk> bytes_chunk_cache::scan(uint64_t offset,
                                                  uint64_t length,
                                                  scan_action action,
@@ -1047,6 +1150,268 @@ std::vector<bytes_chunk> bytes_chunk_cache::scan(uint64_t offset,
     // inode must be valid when get()/release() is called.
     assert(!inode || (inode->magic == NFS_INODE_MAGIC));
 
+    // Do we need to find containing extent's left and right edges?
+    const bool find_extent = (extent_left != nullptr);
+
+    // bytes_chunk vector that will be returned to the caller.
+    std::vector<bytes_chunk> chunkvec;
+
+    if (bytes_released)
+        *bytes_released = 0;
+
+    /*
+     * Before we proceed with the cache lookup check if invalidate is pending.
+     * Note that this will not sync dirty data with the server.
+     * Purging needs all the shards, so do it before locking the shards for
+     * the requested range. If invalidate is flagged after this, the next
+     * lookup will purge.
+     */
+    if (invalidate_pending) {
+        chunkmap_lock all_shards(this);
+        const std::unique_lock<chunkmap_lock> _lock(all_shards);
+
+        if (test_and_clear_invalidate_pending()) {
+            AZLogDebug("[{}] (Deferred) Purging file_cache", CACHE_TAG);
+            retire_nolock();
+        }
+    }
+
+    /*
+     * get() for file-backed caches may need to open/extend the backing file,
+     * which is shared by all the shards. These are only used for testing so
+     * we simply lock all the shards.
+     */
+    chunkmap_lock shards_lock =
+        ((action == scan_action::SCAN_ACTION_GET) && !backing_file_name.empty())
+            ? chunkmap_lock(this) : chunkmap_lock(this, offset, length);
+
+    /*
+     * First try serving the request holding the shards in shared mode.
+     * This will succeed for the common case of reads served from the cache
+     * (and for no-op releases) and doesn't block parallel lookups.
+     * If that cannot serve the request we need to update the chunkmap, grab
+     * the shards exclusively and do the full scan.
+     * Note that the chunkmap can change between the two, but that's fine as
+     * the exclusive scan doesn't depend on anything found by scan_shared().
+     *
+     * Writers (find_extent) always take the exclusive path as they need the
+     * containing extent's edges, which scan_shared() doesn't compute.
+     */
+    if (!find_extent) {
+        const std::shared_lock<chunkmap_lock> _slock(shards_lock);
+        if (scan_shared(offset, length, action, chunkvec, bytes_released)) {
+            return chunkvec;
+        }
+        assert(chunkvec.empty());
+    }
+
+    const std::unique_lock<chunkmap_lock> _lock(shards_lock);
+
+    /*
+     * Release the range from all the shards holding some part of it.
+     * A chunk lies in one shard, so each is released exactly once.
+     */
+    if (action == scan_action::SCAN_ACTION_RELEASE) {
+        for (int i = 0; i < CHUNKMAP_SHARDS; i++) {
+            if (!shards_lock.has_shard(i)) {
+                continue;
+            }
+
+            uint64_t shard_bytes_released = 0;
+            scan_nolock(shards[i].chunkmap, offset, length, action,
+                        &shard_bytes_released, nullptr, nullptr);
+            *bytes_released += shard_bytes_released;
+        }
+
+        return chunkvec;
+    }
+
+    assert(action == scan_action::SCAN_ACTION_GET);
+
+    /*
+     * First things first, if file-backed cache and backing file not yet open,
+     * open it.
+     */
+    if (action == scan_action::SCAN_ACTION_GET) {
+        if ((backing_file_fd == -1) && !backing_file_name.empty()) {
+            backing_file_fd = ::open(backing_file_name.c_str(),
+                                     O_CREAT|O_TRUNC|O_RDWR, 0755);
+            if (backing_file_fd == -1) {
+                AZLogError("Failed to open backing_file {}: {}",
+                           backing_file_name, strerror(errno));
+                assert(0);
+                return chunkvec;
+            } else {
+                AZLogInfo("Opened backing_file {}: fd={}",
+                           backing_file_name, backing_file_fd);
+            }
+        }
+
+        /*
+         * Extend backing_file as the very first thing.
+         * It is important that when membuf::load() is called, the backing file
+         * has size >= (offset + length).
+         */
+        if (!extend_backing_file(offset + length)) {
+            AZLogError("Failed to extend backing_file to {} bytes: {}",
+                       offset+length, strerror(errno));
+            assert(0);
+            return chunkvec;
+        }
+    }
+
+    /*
+     * Get the chunks region by region, each region from its own shard, so
+     * that new chunks don't span regions. The extent starts at the left
+     * edge of the first region's extent and ends at the right edge of the
+     * last region's extent, as the requested range lies in between.
+     */
+    uint64_t next_offset = offset;
+    const uint64_t end_offset = offset + length;
+    uint64_t _extent_left = AZNFSC_BAD_OFFSET;
+    uint64_t _extent_right = AZNFSC_BAD_OFFSET;
+
+    while (next_offset < end_offset) {
+        const uint64_t region_end =
+            ((next_offset / CHUNKMAP_REGION_SIZE) + 1) * CHUNKMAP_REGION_SIZE;
+        const uint64_t region_length =
+            std::min(end_offset, region_end) - next_offset;
+        uint64_t region_left = AZNFSC_BAD_OFFSET;
+        uint64_t region_right = AZNFSC_BAD_OFFSET;
+
+        std::vector<bytes_chunk> region_chunkvec =
+            scan_nolock(shards[get_shard(next_offset)].chunkmap,
+                        next_offset, region_length, action,
+                        nullptr /* bytes_released */,
+                        find_extent ? &region_left : nullptr,
+                        find_extent ? &region_right : nullptr);
+
+        if (find_extent) {
+            if (_extent_left == AZNFSC_BAD_OFFSET) {
+                _extent_left = region_left;
+            }
+            _extent_right = region_right;
+        }
+
+        if (chunkvec.empty()) {
+            chunkvec = std::move(region_chunkvec);
+        } else {
+            chunkvec.insert(chunkvec.end(),
+                            std::make_move_iterator(region_chunkvec.begin()),
+                            std::make_move_iterator(region_chunkvec.end()));
+        }
+
+        next_offset += region_length;
+    }
+
+    if (find_extent) {
+        extend_extent_nolock(shards_lock, _extent_left, _extent_right);
+
+        *extent_left = _extent_left;
+        *extent_right = _extent_right;
+    }
+
+    return chunkvec;
+}
+
+void bytes_chunk_cache::extend_extent_nolock(const chunkmap_lock& shards_lock,
+                                             uint64_t& extent_left,
+                                             uint64_t& extent_right) const
+{
+    /*
+     * scan_nolock() finds the extent only among the chunks in one shard, so
+     * an extent reaching a region boundary may continue in the neighbouring
+     * region. Walk the neighbouring regions for as long as the extent spans
+     * them fully.
+     * Shards not held by the caller are locked in shared mode, but only if
+     * available w/o waiting, as we cannot wait for a shard while holding
+     * others (in any order). If not available we return the extent found
+     * till then. That's fine as the extent is only used to decide when to
+     * flush, and flush_required() also checks the total dirty bytes.
+     */
+    while ((extent_left != 0) && ((extent_left % CHUNKMAP_REGION_SIZE) == 0)) {
+        const int shard = get_shard(extent_left - 1);
+        const chunkmap_shard& s = shards[shard];
+        const bool need_lock = !shards_lock.has_shard(shard);
+        const uint64_t prev_extent_left = extent_left;
+
+        if (need_lock && !s.chunkmap_lock_43.try_lock_shared()) {
+            break;
+        }
+
+        auto it = s.chunkmap.lower_bound(extent_left);
+        while (it != s.chunkmap.cbegin()) {
+            const struct bytes_chunk& bc = (--it)->second;
+
+            if (((bc.offset + bc.length) != extent_left) || !bc.needs_flush()) {
+                break;
+            }
+
+            extent_left = bc.offset;
+        }
+
+        if (need_lock) {
+            s.chunkmap_lock_43.unlock_shared();
+        }
+
+        if (extent_left == prev_extent_left) {
+            break;
+        }
+    }
+
+    while ((extent_right < AZNFSC_MAX_FILE_SIZE) &&
+           ((extent_right % CHUNKMAP_REGION_SIZE) == 0)) {
+        const int shard = get_shard(extent_right);
+        const chunkmap_shard& s = shards[shard];
+        const bool need_lock = !shards_lock.has_shard(shard);
+        const uint64_t prev_extent_right = extent_right;
+
+        if (need_lock && !s.chunkmap_lock_43.try_lock_shared()) {
+            break;
+        }
+
+        for (auto it = s.chunkmap.lower_bound(extent_right);
+             it != s.chunkmap.cend(); ++it) {
+            const struct bytes_chunk& bc = it->second;
+
+            if ((bc.offset != extent_right) || !bc.needs_flush()) {
+                break;
+            }
+
+            extent_right = bc.offset + bc.length;
+        }
+
+        if (need_lock) {
+            s.chunkmap_lock_43.unlock_shared();
+        }
+
+        if (extent_right == prev_extent_right) {
+            break;
+        }
+    }
+}
+
+std::vector<bytes_chunk> bytes_chunk_cache::scan_nolock(
+        std::map<uint64_t, struct bytes_chunk>& chunkmap,
+        uint64_t offset,
+        uint64_t length,
+        scan_action action,
+        uint64_t *bytes_released,
+        uint64_t *extent_left,
+        uint64_t *extent_right)
+{
+    assert(length > 0);
+    assert((offset + length) <= AZNFSC_MAX_FILE_SIZE);
+
+    // New chunks must not span regions.
+    assert((action == scan_action::SCAN_ACTION_RELEASE) ||
+           ((offset / CHUNKMAP_REGION_SIZE) ==
+            ((offset + length - 1) / CHUNKMAP_REGION_SIZE)));
+
+    // bytes_released MUST be passed for (and only for) SCAN_ACTION_RELEASE.
+    assert((action == scan_action::SCAN_ACTION_RELEASE) ==
+           (bytes_released != nullptr));
+
     // bytes_chunk vector that will be returned to the caller.
     std::vector<bytes_chunk> chunkvec;
 
@@ -1079,21 +1444,6 @@ std::vector<bytes_chunk> bytes_chunk_cache::scan(uint64_t offset,
     // Temp variables to hold chunk details for newly added chunk.
     uint64_t chunk_offset, chunk_length;
 
-    /*
-     * TODO: See if we can hold shared lock for cases where we don't have to
-     *       update chunkmap.
-     */
-    const std::unique_lock<std::mutex> _lock(chunkmap_lock_43);
-
-	/*
-	 * Before we proceed with the cache lookup check if invalidate is pending.
-	 * Note that this will not sync dirty data with the server.
-	 */
-	if (test_and_clear_invalidate_pending()) {
-		AZLogDebug("[{}] (Deferred) Purging file_cache", CACHE_TAG);
-		clear_nolock();
-	}
-
     /*
      * Temp variables to hold details for releasing a range.
      * All chunks in the range [begin_delete, end_delete) will be freed as
@@ -1133,38 +1483,6 @@ do { \
     } \
 } while (0)
 
-    /*
-     * First things first, if file-backed cache and backing file not yet open,
-     * open it.
-     */
-    if (action == scan_action::SCAN_ACTION_GET) {
-        if ((backing_file_fd == -1) && !backing_file_name.empty()) {
-            backing_file_fd = ::open(backing_file_name.c_str(),
-                                     O_CREAT|O_TRUNC|O_RDWR, 0755);
-            if (backing_file_fd == -1) {
-                AZLogError("Failed to open backing_file {}: {}",
-                           backing_file_name, strerror(errno));
-                assert(0);
-                return chunkvec;
-            } else {
-                AZLogInfo("Opened backing_file {}: fd={}",
-                           backing_file_name, backing_file_fd);
-            }
-        }
-
-        /*
-         * Extend backing_file as the very first thing.
-         * It is important that when membuf::load() is called, the backing file
-         * has size >= (offset + length).
-         */
-        if (!extend_backing_file(offset + length)) {
-            AZLogError("Failed to extend backing_file to {} bytes: {}",
-                       offset+length, strerror(errno));
-            assert(0);
-            return chunkvec;
-        }
-    }
-
     /*
      * Find chunk with offset >= next_offset.
      * We start from the first chunk covering the start of the requested range
@@ -2045,40 +2363,171 @@ end:
                 ? chunkvec : std::vector<bytes_chunk>();
 }
 
-int bytes_chunk_cache::truncate(uint64_t trunc_len,
-                                bool post,
-                                uint64_t& bytes_truncated)
+bool bytes_chunk_cache::scan_shared(uint64_t offset,
+                                    uint64_t length,
+                                    scan_action action,
+                                    std::vector<bytes_chunk>& chunkvec,
+                                    uint64_t *bytes_released)
 {
+    assert(chunkvec.empty());
+    assert(length > 0);
+
     /*
-     * Must be called only when inode is being truncated.
-     * Then we are guaranteed that no new writes will be sent by fuse, which
-     * means no simultaneous calls to set_uptodate() can be updating cache_size.
+     * File-backed caches need the backing file to be opened/extended before
+     * we can return chunks, which needs exclusive access.
      */
-    assert(!inode || inode->is_truncate_in_progress());
+    if ((action == scan_action::SCAN_ACTION_GET) &&
+        !backing_file_name.empty()) {
+        return false;
+    }
 
-    // truncate(post=true) must be called with flush_lock held.
-    assert(!post || inode->is_flushing);
-    assert(trunc_len <= AZNFSC_MAX_FILE_SIZE);
+    const uint64_t end_offset = offset + length;
+    uint64_t next_offset = offset;
 
-    AZLogDebug("[{}] <Truncate {}> {}called [S: {}, C: {}, CS: {}], "
-               "U: {}, A: {}, C: {}, T: {}, chunkmap.size(): {}",
-               CACHE_TAG, trunc_len, post ? "POST " : "",
-               inode->get_server_file_size(),
-               inode->get_client_file_size(),
-               inode->get_cached_filesize(),
-               bytes_uptodate.load(),
-               bytes_allocated.load(),
-               bytes_cached.load(),
-               bytes_truncate.load(),
-               chunkmap.size());
+    if (action == scan_action::SCAN_ACTION_RELEASE) {
+        const uint32_t shard_mask = get_shard_mask(offset, length);
 
-    /*
-     * Membufs which must have been deleted/trimmed, but skipped as they were
-     * in use.
-     */
-    int mb_skipped = 0;
+        /*
+         * Go over all chunks overlapping the released range, in all the
+         * shards holding the range, if any of them can be released leave it
+         * for the exclusive scan.
+         * A chunk that's not safe_to_release() can become safe_to_release()
+         * right after we check (see the comment in scan()), but that's no
+         * different from the release() call having come slightly earlier.
+         * release() is only an advice anyway.
+         */
+        for (int i = 0; i < CHUNKMAP_SHARDS; i++) {
+            if (!(shard_mask & (1U << i))) {
+                continue;
+            }
 
-    bytes_truncated = 0;
+            const auto& chunkmap = shards[i].chunkmap;
+
+            /*
+             * Start from the chunk containing offset, if any. That's the
+             * last chunk with starting offset <= offset.
+             */
+            auto it = chunkmap.upper_bound(offset);
+            if (it != chunkmap.begin()) {
+                auto pit = std::prev(it);
+                if ((pit->second.offset + pit->second.length) > offset) {
+                    it = pit;
+                }
+            }
+
+            for (; it != chunkmap.end() && it->first < end_offset; ++it) {
+                if (it->second.safe_to_release()) {
+                    return false;
+                }
+            }
+        }
+
+        assert(bytes_released && *bytes_released == 0);
+        return true;
+    }
+
+    assert(action == scan_action::SCAN_ACTION_GET);
+
+    /*
+     * Requested range must be completely covered by existing chunks, else
+     * we need to allocate chunks for the gaps.
+     * Note that we add the chunks to chunkvec same as scan() would for
+     * existing chunks.
+     */
+    for (; next_offset < end_offset; ) {
+        const auto& chunkmap = shards[get_shard(next_offset)].chunkmap;
+
+        /*
+         * Find the chunk containing next_offset, that's the last chunk with
+         * starting offset <= next_offset. Chunks don't span regions, so it
+         * must be in next_offset's shard.
+         */
+        const auto it = chunkmap.upper_bound(next_offset);
+        const struct bytes_chunk *bc =
+            (it != chunkmap.begin()) ? &(std::prev(it)->second) : nullptr;
+
+        if (!bc || ((bc->offset + bc->length) <= next_offset)) {
+            // Gap, need a new chunk.
+            chunkvec.clear();
+            return false;
+        }
+
+        // membuf and chunkmap bc offset and length must always be in sync.
+        assert(bc->length == bc->get_membuf()->length);
+        assert(bc->offset == bc->get_membuf()->offset);
+        assert(next_offset < (bc->offset + bc->length));
+
+        const uint64_t chunk_length =
+            std::min(bc->offset + bc->length, end_offset) - next_offset;
+        assert(chunk_length > 0);
+
+        if (next_offset == bc->offset) {
+            chunkvec.emplace_back(this, next_offset, chunk_length,
+                                  bc->buffer_offset, bc->alloc_buffer,
+                                  (chunk_length == bc->length) /* is_whole */);
+        } else {
+            chunkvec.emplace_back(this, next_offset, chunk_length,
+                                  bc->buffer_offset + (next_offset - bc->offset),
+                                  bc->alloc_buffer,
+                                  false /* is_whole */);
+        }
+
+        AZLogVerbose("(existing chunk, shared) [{},{}) b:{} a:{}",
+                     next_offset, next_offset + chunk_length,
+                     fmt::ptr(chunkvec.back().get_buffer()),
+                     fmt::ptr(bc->alloc_buffer->get()));
+
+        next_offset += chunk_length;
+    }
+
+    assert(next_offset == end_offset);
+
+    /*
+     * Whole range found, we can now safely mark the membufs inuse.
+     * See scan().
+     */
+    for (const auto& chunk : chunkvec) {
+        assert(!chunk.is_new);
+        chunk.alloc_buffer->set_inuse();
+    }
+
+    return true;
+}
+
+int bytes_chunk_cache::truncate(uint64_t trunc_len,
+                                bool post,
+                                uint64_t& bytes_truncated)
+{
+    /*
+     * Must be called only when inode is being truncated.
+     * Then we are guaranteed that no new writes will be sent by fuse, which
+     * means no simultaneous calls to set_uptodate() can be updating cache_size.
+     */
+    assert(!inode || inode->is_truncate_in_progress());
+
+    // truncate(post=true) must be called with flush_lock held.
+    assert(!post || inode->is_flushing);
+    assert(trunc_len <= AZNFSC_MAX_FILE_SIZE);
+
+    AZLogDebug("[{}] <Truncate {}> {}called [S: {}, C: {}, CS: {}], "
+               "U: {}, A: {}, C: {}, T: {}, num_chunks: {}",
+               CACHE_TAG, trunc_len, post ? "POST " : "",
+               inode->get_server_file_size(),
+               inode->get_client_file_size(),
+               inode->get_cached_filesize(),
+               bytes_uptodate.load(),
+               bytes_allocated.load(),
+               bytes_cached.load(),
+               bytes_truncate.load(),
+               num_chunks.load());
+
+    /*
+     * Membufs which must have been deleted/trimmed, but skipped as they were
+     * in use.
+     */
+    int mb_skipped = 0;
+
+    bytes_truncated = 0;
 
     /*
      * Step #1: Grab chunkmap lock and mark all the affected bcs inuse, so that
@@ -2087,51 +2536,67 @@ int bytes_chunk_cache::truncate(uint64_t trunc_len,
     std::vector<std::map<uint64_t, struct bytes_chunk>::iterator> it_vec1;
     {
         // TODO: Make it shared lock.
-        const std::unique_lock<std::mutex> _lock(chunkmap_lock_43);
+        chunkmap_lock all_shards(this);
+        const std::unique_lock<chunkmap_lock> _lock(all_shards);
 
-        if (chunkmap.empty()) {
-            return 0;
-        }
+        for (chunkmap_shard& shard : shards) {
+            auto& chunkmap = shard.chunkmap;
 
-        /*
-         * Get chunk with starting offset >= trunc_len.
-         * If prev bc has one or more bytes to be truncated, count that in too.
-         */
-        auto it = chunkmap.lower_bound(trunc_len);
+            if (chunkmap.empty()) {
+                continue;
+            }
 
-        if (it != chunkmap.begin()) {
-            auto prev_it = std::prev(it);
-            const struct bytes_chunk *prev_bc = &(prev_it->second);
+            /*
+             * Get chunk with starting offset >= trunc_len.
+             * If prev bc has one or more bytes to be truncated, count that
+             * in too.
+             */
+            auto it = chunkmap.lower_bound(trunc_len);
 
-            assert(trunc_len > prev_bc->offset);
+            if (it != chunkmap.begin()) {
+                auto prev_it = std::prev(it);
+                const struct bytes_chunk *prev_bc = &(prev_it->second);
 
-            if (trunc_len < (prev_bc->offset + prev_bc->length)) {
-                // Prev bc has one or more bytes truncated.
-                it = prev_it;
+                assert(trunc_len > prev_bc->offset);
+
+                if (trunc_len < (prev_bc->offset + prev_bc->length)) {
+                    // Prev bc has one or more bytes truncated.
+                    it = prev_it;
+                }
             }
-        }
 
-        /*
-         * Save iterators to all the affected bcs in it_vec1.
-         * Note that since we don't remove an inuse bc from the chunkmap, it's
-         * safe to access these iterators after the chunkmap lock is released.
-         */
-        while (it != chunkmap.cend()) {
-            const struct bytes_chunk& bc = it->second;
-            struct membuf *mb = bc.get_membuf();
+            /*
+             * Save iterators to all the affected bcs in it_vec1.
+             * Note that since we don't remove an inuse bc from the chunkmap,
+             * it's safe to access these iterators after the chunkmap lock is
+             * released.
+             */
+            while (it != chunkmap.cend()) {
+                const struct bytes_chunk& bc = it->second;
+                struct membuf *mb = bc.get_membuf();
 
-            // bc must have at least one byte truncated.
-            assert((bc.offset + bc.length) > trunc_len);
+                // bc must have at least one byte truncated.
+                assert((bc.offset + bc.length) > trunc_len);
 
-            mb->set_inuse();
-            it_vec1.emplace_back(it);
+                mb->set_inuse();
+                it_vec1.emplace_back(it);
 
-            ++it;
+                ++it;
+            }
         }
 
         if (it_vec1.empty()) {
             return 0;
         }
+
+        /*
+         * Lock the membufs in offset order, same as a single chunkmap walk
+         * would.
+         */
+        std::sort(it_vec1.begin(), it_vec1.end(),
+                  [](const auto& it1, const auto& it2) {
+                      return it1->first < it2->first;
+                  });
     }
 
     /*
@@ -2212,7 +2677,8 @@ int bytes_chunk_cache::truncate(uint64_t trunc_len,
      *          trimmed from the right.
      */
     {
-        const std::unique_lock<std::mutex> _lock(chunkmap_lock_43);
+        chunkmap_lock all_shards(this);
+        const std::unique_lock<chunkmap_lock> _lock(all_shards);
 
         for (auto& it : it_vec3) {
             struct bytes_chunk& bc = it->second;
@@ -2323,49 +2789,44 @@ int bytes_chunk_cache::truncate(uint64_t trunc_len,
                  * these membufs may have an extra ref count held is if
                  * flush_cache_and_wait() is trying to flush these membufs.
                  */
-                chunkmap.erase(it);
+                shards[get_shard(it->first)].chunkmap.erase(it);
             }
         }
 
         /*
-         * Recalculate cache size.
+         * Recalculate cache size, from the last uptodate chunk of every
+         * shard.
          */
-        bool cache_size_updated = false;
-
-        for (auto it = chunkmap.rbegin(); it != chunkmap.rend(); ++it) {
-            struct bytes_chunk *bc = &(it->second);
-            struct membuf *mb = bc->get_membuf();
-            if (mb->is_uptodate()) {
-                assert(mb->length > 0);
-                assert(cache_size >= (mb->offset + mb->length));
-                /*
-                 * cache_size is only reduced by truncate() and truncates
-                 * are serialized by the VFS inode lock, so only one truncate
-                 * can be ongoing, thus we are guaranteed that cache_size
-                 * cannot be reduced. Also, since no new writes will be sent
-                 * by fuse, no calls to set_uptodate() could be ongoing and
-                 * hence cache_size won't be increased either.
-                 */
-                uint64_t expected = cache_size;
-                [[maybe_unused]]
-                const bool updated =
-                    cache_size.compare_exchange_strong(expected, mb->offset + mb->length);
-                assert(updated);
-                assert(cache_size == (mb->offset + mb->length));
-                assert(cache_size > 0);
-                cache_size_updated = true;
-                break;
+        uint64_t new_cache_size = 0;
+
+        for (const chunkmap_shard& shard : shards) {
+            for (auto it = shard.chunkmap.rbegin();
+                 it != shard.chunkmap.rend(); ++it) {
+                const struct membuf *mb = it->second.get_membuf();
+                if (mb->is_uptodate()) {
+                    assert(mb->length > 0);
+                    assert(cache_size >= (mb->offset + mb->length));
+                    new_cache_size = std::max(new_cache_size,
+                                              mb->offset + mb->length);
+                    break;
+                }
             }
         }
 
-        if (!cache_size_updated) {
-            uint64_t expected = cache_size;
-            [[maybe_unused]]
-            const bool updated =
-                cache_size.compare_exchange_strong(expected, 0);
-            assert(updated);
-            assert(cache_size == 0);
-        }
+        /*
+         * cache_size is only reduced by truncate() and truncates are
+         * serialized by the VFS inode lock, so only one truncate can be
+         * ongoing, thus we are guaranteed that cache_size cannot be reduced.
+         * Also, since no new writes will be sent by fuse, no calls to
+         * set_uptodate() could be ongoing and hence cache_size won't be
+         * increased either.
+         */
+        uint64_t expected = cache_size;
+        [[maybe_unused]]
+        const bool updated =
+            cache_size.compare_exchange_strong(expected, new_cache_size);
+        assert(updated);
+        assert(cache_size == new_cache_size);
     }
 
     assert(bytes_truncated <= (AZNFSC_MAX_FILE_SIZE-trunc_len));
@@ -2378,7 +2839,7 @@ int bytes_chunk_cache::truncate(uint64_t trunc_len,
 
     AZLogDebug("[{}] <Truncate {}> {}done, [S: {}, C: {}, CS: {}], "
                "cache_size: {}, U: {}, A: {}, C: {}, T: {}, "
-               "chunkmap.size(): {}, bytes_truncated: {}, mb_skipped: {}",
+               "num_chunks: {}, bytes_truncated: {}, mb_skipped: {}",
                CACHE_TAG,
                trunc_len, post ? "POST " : "",
                inode->get_server_file_size(),
@@ -2389,7 +2850,7 @@ int bytes_chunk_cache::truncate(uint64_t trunc_len,
                bytes_allocated.load(),
                bytes_cached.load(),
                bytes_truncate.load(),
-               chunkmap.size(),
+               num_chunks.load(),
                bytes_truncated,
                mb_skipped);
 
@@ -2408,15 +2869,14 @@ int bytes_chunk_cache::truncate(uint64_t trunc_len,
 uint64_t bytes_chunk_cache::max_dirty_extent_bytes()
 {
     // Maximum cache size allowed in bytes.
-    static const uint64_t max_total =
-        (aznfsc_cfg.cache.data.user.max_size_mb * 1024 * 1024ULL);
+    const uint64_t max_total = get_cache_budget();
     assert(max_total != 0);
 
     /*
      * Capped due to global cache size. One single file should not use
      * more than 60% of the cache.
      */
-    static const uint64_t max_dirty_extent_g = (max_total * 0.6);
+    const uint64_t max_dirty_extent_g = (max_total * 0.6);
 
     /*
      * Capped due to per-file cache discipline.
@@ -2458,7 +2918,8 @@ void bytes_chunk_cache::inline_prune()
         return;
     }
 
-    const std::unique_lock<std::mutex> _lock(chunkmap_lock_43);
+    chunkmap_lock all_shards(this);
+    const std::unique_lock<chunkmap_lock> _lock(all_shards);
 
     /*
      * Multiple fuse threads may get the prune goals and then all of them
@@ -2474,200 +2935,338 @@ void bytes_chunk_cache::inline_prune()
     AZLogDebug("[{}] inline_prune(): Inline prune goal of {:0.2f} MB",
                CACHE_TAG, inline_bytes / (1024 * 1024.0));
 
-    uint32_t inuse = 0, dirty = 0, commit_pending = 0, locked = 0, inra = 0;
-    uint64_t inuse_bytes = 0, dirty_bytes = 0, commit_pending_bytes = 0, locked_bytes = 0, inra_bytes = 0;
+    uint32_t inuse = 0, dirty = 0, commit_pending = 0, locked = 0, inra = 0, pinned = 0;
+    uint64_t inuse_bytes = 0, dirty_bytes = 0, commit_pending_bytes = 0, locked_bytes = 0, inra_bytes = 0, pinned_bytes = 0;
 
-    for (auto it = chunkmap.cbegin(), next_it = it;
-         (it != chunkmap.cend()) && (pruned_bytes < inline_bytes);
-         it = next_it) {
-        ++next_it;
-        const struct bytes_chunk *bc = &(it->second);
-        const struct membuf *mb = bc->get_membuf();
-
-        /*
-         * inode will be null only for testing.
-         */
-        assert(!inode || (inode->magic == NFS_INODE_MAGIC));
-        if (inode && inode->in_ra_window(mb->offset.load(), mb->length.load())) {
-            AZLogDebug("[{}] inline_prune(): skipping as membuf(offset={}, "
-                       "length={}) lies in RA window",
-                       CACHE_TAG, mb->offset.load(), mb->length.load());
-            inra++;
-            inra_bytes += mb->allocated_length;
-            continue;
-        }
+    for (chunkmap_shard& shard : shards) {
+        auto& chunkmap = shard.chunkmap;
 
-        /*
-         * Possibly under IO.
-         */
-        if (mb->is_inuse()) {
-            AZLogDebug("[{}] inline_prune(): skipping as membuf(offset={}, "
-                       "length={}) is inuse (locked={}, dirty={}, flushing={}, "
-                       "uptodate={})",
-                       CACHE_TAG, mb->offset.load(), mb->length.load(),
-                       mb->is_locked() ? "yes" : "no",
-                       mb->is_dirty() ? "yes" : "no",
-                       mb->is_flushing() ? "yes" : "no",
-                       mb->is_uptodate() ? "yes" : "no");
-            inuse++;
-            inuse_bytes += mb->allocated_length;
-            continue;
-        }
+        for (auto it = chunkmap.cbegin(), next_it = it;
+             (it != chunkmap.cend()) && (pruned_bytes < inline_bytes);
+             it = next_it) {
+            ++next_it;
+            const struct bytes_chunk *bc = &(it->second);
+            const struct membuf *mb = bc->get_membuf();
 
-        /*
-         * Usually inuse count is dropped after the lock so if inuse count
-         * is zero membuf must not be locked, but users who may want to
-         * release() some chunk while holding the lock may drop their inuse
-         * count to allow release() to release the bytes_chunk.
-         */
-        if (mb->is_locked()) {
-            AZLogDebug("[{}] inline_prune(): skipping as membuf(offset={}, "
-                       "length={}) is locked (dirty={}, flushing={}, "
-                       "uptodate={})",
-                       CACHE_TAG, mb->offset.load(), mb->length.load(),
-                       mb->is_dirty() ? "yes" : "no",
-                       mb->is_flushing() ? "yes" : "no",
-                       mb->is_uptodate() ? "yes" : "no");
-            locked++;
-            locked_bytes += mb->allocated_length;
-            continue;
-        }
+            /*
+             * inode will be null only for testing.
+             */
+            assert(!inode || (inode->magic == NFS_INODE_MAGIC));
+            if (inode &&
+                inode->in_ra_window(mb->offset.load(), mb->length.load())) {
+                AZLogDebug("[{}] inline_prune(): skipping as membuf(offset={}, "
+                           "length={}) lies in RA window",
+                           CACHE_TAG, mb->offset.load(), mb->length.load());
+                inra++;
+                inra_bytes += mb->allocated_length;
+                continue;
+            }
 
-        /*
-         * Has data to be written to Blob.
-         * Cannot safely drop this from the cache.
-         */
-        if (mb->is_dirty()) {
-            AZLogDebug("[{}] inline_prune(): skipping as membuf(offset={}, "
-                       "length={}) is dirty (flushing={}, uptodate={})",
-                       CACHE_TAG, mb->offset.load(), mb->length.load(),
-                       mb->is_flushing() ? "yes" : "no",
-                       mb->is_uptodate() ? "yes" : "no");
-            dirty++;
-            dirty_bytes += mb->allocated_length;
-            continue;
-        }
+            if (inode &&
+                inode->is_pinned(mb->offset.load(), mb->length.load())) {
+                AZLogDebug("[{}] inline_prune(): skipping as membuf(offset={}, "
+                           "length={}) is pinned",
+                           CACHE_TAG, mb->offset.load(), mb->length.load());
+                pinned++;
+                pinned_bytes += mb->allocated_length;
+                continue;
+            }
 
-        /*
-         * Data written to blob but not yet committed.
-         * Cannot safely drop this from the cache.
-         */
-        if (mb->is_commit_pending()) {
-            AZLogDebug("[{}] inline_prune(): skipping as membuf(offset={}, "
-                       "length={}) is commit_pending (dirty={} flushing={}, uptodate={})",
-                       CACHE_TAG, mb->offset.load(), mb->length.load(),
-                       mb->is_dirty() ? "yes" : "no",
-                       mb->is_flushing() ? "yes" : "no",
-                       mb->is_uptodate() ? "yes" : "no");
-            commit_pending++;
-            commit_pending_bytes += mb->allocated_length;
-            continue;
-        }
+            /*
+             * Possibly under IO.
+             */
+            if (mb->is_inuse()) {
+                AZLogDebug("[{}] inline_prune(): skipping as membuf(offset={}, "
+                           "length={}) is inuse (locked={}, dirty={}, "
+                           "flushing={}, uptodate={})",
+                           CACHE_TAG, mb->offset.load(), mb->length.load(),
+                           mb->is_locked() ? "yes" : "no",
+                           mb->is_dirty() ? "yes" : "no",
+                           mb->is_flushing() ? "yes" : "no",
+                           mb->is_uptodate() ? "yes" : "no");
+                inuse++;
+                inuse_bytes += mb->allocated_length;
+                continue;
+            }
 
-        AZLogDebug("[{}] inline_prune(): deleting membuf(offset={}, length={})",
-                   CACHE_TAG, mb->offset.load(), mb->length.load());
+            /*
+             * Usually inuse count is dropped after the lock so if inuse count
+             * is zero membuf must not be locked, but users who may want to
+             * release() some chunk while holding the lock may drop their inuse
+             * count to allow release() to release the bytes_chunk.
+             */
+            if (mb->is_locked()) {
+                AZLogDebug("[{}] inline_prune(): skipping as membuf(offset={}, "
+                           "length={}) is locked (dirty={}, flushing={}, "
+                           "uptodate={})",
+                           CACHE_TAG, mb->offset.load(), mb->length.load(),
+                           mb->is_dirty() ? "yes" : "no",
+                           mb->is_flushing() ? "yes" : "no",
+                           mb->is_uptodate() ? "yes" : "no");
+                locked++;
+                locked_bytes += mb->allocated_length;
+                continue;
+            }
 
-        /*
-         * Release the chunk.
-         * This will release the membuf (munmap() it in case of file-backed
-         * cache and delete it for heap backed cache). At this point the membuf
-         * is guaranteed to be not in use since we checked the inuse count
-         * above.
-         */
-        assert(num_chunks > 0);
-        num_chunks--;
-        assert(num_chunks_g > 0);
-        num_chunks_g--;
+            /*
+             * Has data to be written to Blob.
+             * Cannot safely drop this from the cache.
+             */
+            if (mb->is_dirty()) {
+                AZLogDebug("[{}] inline_prune(): skipping as membuf(offset={}, "
+                           "length={}) is dirty (flushing={}, uptodate={})",
+                           CACHE_TAG, mb->offset.load(), mb->length.load(),
+                           mb->is_flushing() ? "yes" : "no",
+                           mb->is_uptodate() ? "yes" : "no");
+                dirty++;
+                dirty_bytes += mb->allocated_length;
+                continue;
+            }
 
-        assert(bytes_cached >= bc->length);
-        assert(bytes_cached_g >= bc->length);
-        bytes_cached -= bc->length;
-        bytes_cached_g -= bc->length;
+            /*
+             * Data written to blob but not yet committed.
+             * Cannot safely drop this from the cache.
+             */
+            if (mb->is_commit_pending()) {
+                AZLogDebug("[{}] inline_prune(): skipping as membuf(offset={}, "
+                           "length={}) is commit_pending (dirty={} "
+                           "flushing={}, uptodate={})",
+                           CACHE_TAG, mb->offset.load(), mb->length.load(),
+                           mb->is_dirty() ? "yes" : "no",
+                           mb->is_flushing() ? "yes" : "no",
+                           mb->is_uptodate() ? "yes" : "no");
+                commit_pending++;
+                commit_pending_bytes += mb->allocated_length;
+                continue;
+            }
 
-        pruned_bytes += mb->allocated_length;
+            AZLogDebug("[{}] inline_prune(): deleting membuf(offset={}, "
+                       "length={})",
+                       CACHE_TAG, mb->offset.load(), mb->length.load());
 
-        chunkmap.erase(it);
+            pruned_bytes += prune_chunk(chunkmap, it);
+        }
     }
 
     if (pruned_bytes < inline_bytes) {
         AZLogDebug("Could not meet inline prune goal, pruned {} of {} bytes "
-                   "[inuse={}/{}, dirty={}/{}, commit_pending={}/{}, locked={}/{}, inra={}/{}]",
+                   "[inuse={}/{}, dirty={}/{}, commit_pending={}/{}, locked={}/{}, inra={}/{}, "
+                   "pinned={}/{}]",
                    pruned_bytes, inline_bytes,
                    inuse, inuse_bytes,
                    dirty, dirty_bytes,
                    commit_pending, commit_pending_bytes,
                    locked, locked_bytes,
-                   inra, inra_bytes);
+                   inra, inra_bytes,
+                   pinned, pinned_bytes);
     } else {
         AZLogDebug("Successfully pruned {} bytes [inuse={}/{}, dirty={}/{}, "
-                   "locked={}/{}, inra={}/{}]",
+                   "locked={}/{}, inra={}/{}, pinned={}/{}]",
                    pruned_bytes,
                    inuse, inuse_bytes,
                    dirty, dirty_bytes,
                    locked, locked_bytes,
-                   inra, inra_bytes);
+                   inra, inra_bytes,
+                   pinned, pinned_bytes);
     }
 }
 
-int64_t bytes_chunk_cache::drop(uint64_t offset, uint64_t length)
+uint64_t bytes_chunk_cache::prune_chunk(
+        std::map<uint64_t, struct bytes_chunk>& chunkmap,
+        std::map<uint64_t, struct bytes_chunk>::const_iterator it)
 {
-    if (backing_file_name.empty()) {
-        // No-op for non file-backed caches.
+    const struct bytes_chunk *bc = &(it->second);
+    const uint64_t allocated_length = bc->get_membuf()->allocated_length;
+
+    /*
+     * Release the chunk.
+     * This will release the membuf (munmap() it in case of file-backed
+     * cache and delete it for heap backed cache). Caller must have checked
+     * the inuse count, so the membuf is guaranteed to be not in use.
+     */
+    assert(!bc->get_membuf()->is_inuse());
+
+    assert(num_chunks > 0);
+    num_chunks--;
+    assert(num_chunks_g > 0);
+    num_chunks_g--;
+
+    assert(bytes_cached >= bc->length);
+    assert(bytes_cached_g >= bc->length);
+    bytes_cached -= bc->length;
+    bytes_cached_g -= bc->length;
+
+    chunkmap.erase(it);
+
+    return allocated_length;
+}
+
+bool bytes_chunk_cache::is_evictable(const struct membuf *mb) const
+{
+    /*
+     * inode will be null only for testing.
+     */
+    assert(!inode || (inode->magic == NFS_INODE_MAGIC));
+
+    if (mb->is_inuse() || mb->is_locked() ||
+        mb->is_dirty() || mb->is_commit_pending()) {
+        return false;
+    }
+
+    /*
+     * Readahead data not yet read by the application is useful even if
+     * cold, evicting it will only cause it to be read again.
+     */
+    if (inode && inode->in_ra_window(mb->offset.load(), mb->length.load())) {
+        return false;
+    }
+
+    // Application asked us to keep this.
+    if (inode && inode->is_pinned(mb->offset.load(), mb->length.load())) {
+        return false;
+    }
+
+    return true;
+}
+
+uint64_t bytes_chunk_cache::evict_cold(uint64_t max_bytes)
+{
+    uint64_t evicted_bytes = 0;
+
+    if (max_bytes == 0) {
         return 0;
     }
 
-    const std::unique_lock<std::mutex> _lock(chunkmap_lock_43);
+    /*
+     * Lock one shard at a time, so that IOs to the other shards can proceed.
+     */
+    for (chunkmap_shard& shard : shards) {
+        auto& chunkmap = shard.chunkmap;
+        const std::unique_lock<std::shared_mutex> _lock(shard.chunkmap_lock_43);
+
+        for (auto it = chunkmap.cbegin(), next_it = it;
+             (it != chunkmap.cend()) && (evicted_bytes < max_bytes);
+             it = next_it) {
+            ++next_it;
+            const struct membuf *mb = it->second.get_membuf();
+
+            if (mb->is_hot() || !is_evictable(mb)) {
+                continue;
+            }
+
+            AZLogDebug("[{}] evict_cold(): evicting membuf(offset={}, "
+                       "length={})",
+                       CACHE_TAG, mb->offset.load(), mb->length.load());
+
+            evicted_bytes += prune_chunk(chunkmap, it);
+        }
+
+        if (evicted_bytes >= max_bytes) {
+            break;
+        }
+    }
+
+    return evicted_bytes;
+}
+
+uint64_t bytes_chunk_cache::age_hot()
+{
+    uint64_t num_cooled = 0;
 
     /*
-     * Find chunk with offset >= next_offset. Note that we only drop caches
-     * for chunks which completely lie in the range, i.e., partial chunks are
-     * skipped. This is ok as dropping caches is only for saving memory and
-     * not doing it doesn't cause correctness isssues.
+     * We only update the atomic clock_ref, chunkmap is not modified, so
+     * shared lock is sufficient and IOs on this file can proceed.
      */
-    auto it = chunkmap.lower_bound(offset);
+    for (const chunkmap_shard& shard : shards) {
+        const std::shared_lock<std::shared_mutex> _lock(shard.chunkmap_lock_43);
 
-    // No full chunk lies in the given range.
-    if (it == chunkmap.end()) {
+        for (const auto& it : shard.chunkmap) {
+            if (it.second.get_membuf()->age()) {
+                num_cooled++;
+            }
+        }
+    }
+
+    return num_cooled;
+}
+
+int64_t bytes_chunk_cache::drop(uint64_t offset, uint64_t length)
+{
+    if (backing_file_name.empty()) {
+        // No-op for non file-backed caches.
         return 0;
     }
 
-    uint64_t remaining_length = length;
+    assert(offset < AZNFSC_MAX_FILE_SIZE);
+
+    // dropall() drops [0, UINT64_MAX).
+    length = std::min<uint64_t>(length, AZNFSC_MAX_FILE_SIZE - offset);
+
+    chunkmap_lock shards_lock(this, offset, length);
+    const std::unique_lock<chunkmap_lock> _lock(shards_lock);
+
+    const uint64_t end_offset = offset + length;
     int64_t total_dropped_bytes = 0;
 
     /*
-     * Iterate over all chunks and drop chunks that completely lie in the
-     * requested range.
+     * Drop chunks that completely lie in the range [offset, offset+length),
+     * i.e., partial chunks are skipped. This is ok as dropping caches is only
+     * for saving memory and not doing it doesn't cause correctness isssues.
      */
-    for (; remaining_length != 0 && it != chunkmap.end(); ++it) {
-        bytes_chunk *bc = &(it->second);
-
-        if (remaining_length < bc->length) {
-            break;
+    for (int i = 0; i < CHUNKMAP_SHARDS; i++) {
+        if (!shards_lock.has_shard(i)) {
+            continue;
         }
 
-        /*
-         * This will not drop the cache if the membuf is being referenced
-         * by some other user (other than the original chunkmap reference).
-         */
-        const int64_t dropped_bytes = bc->drop();
-        if (dropped_bytes > 0) {
-            total_dropped_bytes += dropped_bytes;
-        }
+        auto& chunkmap = shards[i].chunkmap;
 
-        remaining_length -= bc->length;
+        for (auto it = chunkmap.lower_bound(offset);
+             it != chunkmap.end() && it->first < end_offset; ++it) {
+            bytes_chunk *bc = &(it->second);
+
+            if ((bc->offset + bc->length) > end_offset) {
+                continue;
+            }
+
+            /*
+             * This will not drop the cache if the membuf is being referenced
+             * by some other user (other than the original chunkmap reference).
+             */
+            const int64_t dropped_bytes = bc->drop();
+            if (dropped_bytes > 0) {
+                total_dropped_bytes += dropped_bytes;
+            }
+        }
     }
 
     return total_dropped_bytes;
 }
 
 /**
- * Caller MUST hold exclusive lock on chunkmap_lock_43.
+ * Caller MUST hold exclusive lock on all the chunkmap shards.
  */
-void bytes_chunk_cache::clear_nolock(bool shutdown)
+void bytes_chunk_cache::clear_nolock(
+        bool shutdown,
+        std::map<uint64_t, struct bytes_chunk> *retire_map)
 {
-    AZLogDebug("[{}] Cache purge(shutdown={}): chunkmap.size()={}, "
+    AZLogDebug("[{}] Cache purge(shutdown={}, retire={}): num_chunks={}, "
                "backing_file_name={}",
-               CACHE_TAG, shutdown, chunkmap.size(), backing_file_name);
+               CACHE_TAG, shutdown, (retire_map != nullptr), num_chunks.load(),
+               backing_file_name);
+
+    // Retiring is only for the deferred (non-shutdown) purge.
+    assert(!shutdown || !retire_map);
+
+    /*
+     * On shutdown free the chunks retired by earlier deferred purges too,
+     * the reclaimer will find nothing to do.
+     */
+    if (shutdown && !retired.empty()) {
+        AZLogDebug("[{}] Cache purge: freeing {} retired chunks",
+                   CACHE_TAG, num_retired.load());
+        retired.clear();
+        num_retired = 0;
+    }
 
     assert(bytes_allocated <= bytes_allocated_g);
     assert(bytes_cached <= bytes_cached_g);
@@ -2707,154 +3306,169 @@ void bytes_chunk_cache::clear_nolock(bool shutdown)
      * When shutdown is true we don't expect any of the above membuf types to
      * be present, so we assert.
      */
-    const uint64_t start_size = chunkmap.size();
+    const uint64_t start_size = num_chunks;
 
-    for (auto it = chunkmap.cbegin(), next_it = it;
-         it != chunkmap.cend();
-         it = next_it) {
-        ++next_it;
-        const struct bytes_chunk *bc = &(it->second);
-        const struct membuf *mb = bc->get_membuf();
+    for (chunkmap_shard& shard : shards) {
+        auto& chunkmap = shard.chunkmap;
 
-        /*
-         * Possibly under IO.
-         * It could be writer writing application data into the membuf, or
-         * reader reading Blob data into the membuf. For the read case we don't
-         * really care but we cannot distinguish between the two.
-         *
-         * TODO: Currently this means we also don't invalidate membufs which
-         *       may be fetched for read. Technically these shouldn't be
-         *       skipped.
-         */
-        if (!shutdown) {
-            if (mb->is_inuse()) {
-                AZLogDebug("[{}] Cache purge: skipping inuse membuf(offset={}, "
-                           "length={}) (inuse count={}, dirty={})",
-                           CACHE_TAG, mb->offset.load(), mb->length.load(),
-                           mb->get_inuse(), mb->is_dirty());
-                continue;
-            }
-        } else {
-            if (mb->is_inuse()) {
-                AZLogError("[{}] Cache purge: Got inuse membuf(offset={}, "
-                           "length={}) (inuse count={}, dirty={}) when shutting "
-                           "down cache",
-                           CACHE_TAG, mb->offset.load(), mb->length.load(),
-                           mb->get_inuse(), mb->is_dirty());
-                // No membufs should be in use when file is closed.
-                assert(0);
-            }
-        }
+        for (auto it = chunkmap.cbegin(), next_it = it;
+             it != chunkmap.cend();
+             it = next_it) {
+            ++next_it;
+            const struct bytes_chunk *bc = &(it->second);
+            const struct membuf *mb = bc->get_membuf();
 
-        /*
-         * Usually inuse count is dropped after the lock so if inuse count
-         * is zero membuf must not be locked, but users who may want to
-         * release() some chunk while holding the lock may drop their inuse
-         * count to allow release() to release the bytes_chunk.
-         */
-        if (!shutdown) {
-            if (mb->is_locked()) {
-                AZLogDebug("[{}] Cache purge: skipping locked membuf(offset={}, "
-                           "length={}) (inuse count={}, dirty={})",
-                           CACHE_TAG, mb->offset.load(), mb->length.load(),
-                           mb->get_inuse(), mb->is_dirty());
-                continue;
-            }
-        } else {
-            if (mb->is_locked()) {
-                AZLogError("[{}] Cache purge: Got locked membuf(offset={}, "
-                           "length={}) (inuse count={}, dirty={}) when shutting "
-                           "down cache",
-                           CACHE_TAG, mb->offset.load(), mb->length.load(),
-                           mb->get_inuse(), mb->is_dirty());
-                // No membufs should be locked when file is closed.
-                assert(0);
+            /*
+             * Possibly under IO.
+             * It could be writer writing application data into the membuf,
+             * or reader reading Blob data into the membuf. For the read case
+             * we don't really care but we cannot distinguish between the two.
+             *
+             * TODO: Currently this means we also don't invalidate membufs
+             *       which may be fetched for read. Technically these
+             *       shouldn't be skipped.
+             */
+            if (!shutdown) {
+                if (mb->is_inuse()) {
+                    AZLogDebug("[{}] Cache purge: skipping inuse "
+                               "membuf(offset={}, length={}) "
+                               "(inuse count={}, dirty={})",
+                               CACHE_TAG, mb->offset.load(), mb->length.load(),
+                               mb->get_inuse(), mb->is_dirty());
+                    continue;
+                }
+            } else {
+                if (mb->is_inuse()) {
+                    AZLogError("[{}] Cache purge: Got inuse membuf(offset={}, "
+                               "length={}) (inuse count={}, dirty={}) when "
+                               "shutting down cache",
+                               CACHE_TAG, mb->offset.load(), mb->length.load(),
+                               mb->get_inuse(), mb->is_dirty());
+                    // No membufs should be in use when file is closed.
+                    assert(0);
+                }
             }
-        }
 
-        /*
-         * Has data to be written to Blob.
-         * Cannot safely drop this from the cache.
-         */
-        if (!shutdown) {
-            if (mb->is_dirty()) {
-                AZLogDebug("[{}] Cache purge: skipping dirty membuf(offset={}, "
-                           "length={})",
-                           CACHE_TAG, mb->offset.load(), mb->length.load());
-                continue;
-            }
-        } else {
             /*
-             * This can happen f.e., when we have dirty membufs due to write
-             * failures, log and proceed with freeing.
+             * Usually inuse count is dropped after the lock so if inuse count
+             * is zero membuf must not be locked, but users who may want to
+             * release() some chunk while holding the lock may drop their inuse
+             * count to allow release() to release the bytes_chunk.
              */
-            if (mb->is_dirty()) {
-                AZLogWarn("[{}] Cache purge: Got dirty membuf(offset={}, "
-                          "length={}) when shutting down cache, freeing it. "
-                          "THIS MAY CAUSE FILE DATA TO BE INCONSISTENT!",
-                          CACHE_TAG, mb->offset.load(), mb->length.load());
+            if (!shutdown) {
+                if (mb->is_locked()) {
+                    AZLogDebug("[{}] Cache purge: skipping locked "
+                               "membuf(offset={}, length={}) "
+                               "(inuse count={}, dirty={})",
+                               CACHE_TAG, mb->offset.load(), mb->length.load(),
+                               mb->get_inuse(), mb->is_dirty());
+                    continue;
+                }
+            } else {
+                if (mb->is_locked()) {
+                    AZLogError("[{}] Cache purge: Got locked membuf(offset={}, "
+                               "length={}) (inuse count={}, dirty={}) when "
+                               "shutting down cache",
+                               CACHE_TAG, mb->offset.load(), mb->length.load(),
+                               mb->get_inuse(), mb->is_dirty());
+                    // No membufs should be locked when file is closed.
+                    assert(0);
+                }
             }
-        }
 
-        /*
-         * Has data not yet committed.
-         * Cannot safely drop this from the cache.
-         */
-        if (!shutdown) {
-            if (mb->is_commit_pending()) {
-                AZLogDebug("[{}] Cache purge: skipping commit_pending "
-                           "membuf(offset={}, length={})",
-                           CACHE_TAG, mb->offset.load(), mb->length.load());
-                continue;
+            /*
+             * Has data to be written to Blob.
+             * Cannot safely drop this from the cache.
+             */
+            if (!shutdown) {
+                if (mb->is_dirty()) {
+                    AZLogDebug("[{}] Cache purge: skipping dirty "
+                               "membuf(offset={}, length={})",
+                               CACHE_TAG, mb->offset.load(), mb->length.load());
+                    continue;
+                }
+            } else {
+                /*
+                 * This can happen f.e., when we have dirty membufs due to
+                 * write failures, log and proceed with freeing.
+                 */
+                if (mb->is_dirty()) {
+                    AZLogWarn("[{}] Cache purge: Got dirty membuf(offset={}, "
+                              "length={}) when shutting down cache, "
+                              "freeing it. "
+                              "THIS MAY CAUSE FILE DATA TO BE INCONSISTENT!",
+                              CACHE_TAG, mb->offset.load(), mb->length.load());
+                }
             }
-        } else {
+
             /*
-             * This can happen f.e., when we have uncommitted membufs due to
-             * write failures, log and proceed with freeing.
+             * Has data not yet committed.
+             * Cannot safely drop this from the cache.
              */
-            if (mb->is_commit_pending()) {
-                AZLogWarn("[{}] Cache purge: Got commit_pending "
-                          "membuf(offset={}, length={}) when shutting down "
-                          "cache, freeing it. "
-                          "THIS MAY CAUSE FILE DATA TO BE INCONSISTENT!",
-                          CACHE_TAG, mb->offset.load(), mb->length.load());
+            if (!shutdown) {
+                if (mb->is_commit_pending()) {
+                    AZLogDebug("[{}] Cache purge: skipping commit_pending "
+                               "membuf(offset={}, length={})",
+                               CACHE_TAG, mb->offset.load(), mb->length.load());
+                    continue;
+                }
+            } else {
+                /*
+                 * This can happen f.e., when we have uncommitted membufs due to
+                 * write failures, log and proceed with freeing.
+                 */
+                if (mb->is_commit_pending()) {
+                    AZLogWarn("[{}] Cache purge: Got commit_pending "
+                              "membuf(offset={}, length={}) when shutting down "
+                              "cache, freeing it. "
+                              "THIS MAY CAUSE FILE DATA TO BE INCONSISTENT!",
+                              CACHE_TAG, mb->offset.load(), mb->length.load());
+                }
             }
-        }
 
-        AZLogDebug("[{}] Cache purge: deleting membuf(offset={}, length={}), "
-                   "use_count={}, deleted {} of {}",
-                   CACHE_TAG, mb->offset.load(), mb->length.load(),
-                   bc->get_membuf_usecount(),
-                   start_size - chunkmap.size(), start_size);
+            AZLogDebug("[{}] Cache purge: deleting membuf(offset={}, "
+                       "length={}), use_count={}, deleted {} of {}",
+                       CACHE_TAG, mb->offset.load(), mb->length.load(),
+                       bc->get_membuf_usecount(),
+                       start_size - num_chunks, start_size);
 
-        // Make sure the compound check also passes.
-        assert(bc->safe_to_release() || shutdown);
+            // Make sure the compound check also passes.
+            assert(bc->safe_to_release() || shutdown);
 
-        /*
-         * Release the chunk.
-         * This will release the membuf (munmap() it in case of file-backed
-         * cache and delete it for heap backed cache). At this point the membuf
-         * is guaranteed to be not in use since we checked the inuse count
-         * above.
-         */
-        assert(num_chunks > 0);
-        num_chunks--;
-        assert(num_chunks_g > 0);
-        num_chunks_g--;
+            /*
+             * Release the chunk.
+             * This will release the membuf (munmap() it in case of
+             * file-backed cache and delete it for heap backed cache). At this
+             * point the membuf is guaranteed to be not in use since we checked
+             * the inuse count above.
+             */
+            assert(num_chunks > 0);
+            num_chunks--;
+            assert(num_chunks_g > 0);
+            num_chunks_g--;
 
-        assert(bytes_cached >= bc->length);
-        assert(bytes_cached_g >= bc->length);
-        bytes_cached -= bc->length;
-        bytes_cached_g -= bc->length;
+            assert(bytes_cached >= bc->length);
+            assert(bytes_cached_g >= bc->length);
+            bytes_cached -= bc->length;
+            bytes_cached_g -= bc->length;
 
-        chunkmap.erase(it);
+            /*
+             * Retired chunks leave the chunkmap w/o freeing the membuf, that's
+             * done by reclaim_retired().
+             */
+            if (retire_map) {
+                retire_map->insert(chunkmap.extract(it));
+            } else {
+                chunkmap.erase(it);
+            }
+        }
     }
 
-    if (!chunkmap.empty()) {
+    if (!is_empty()) {
         AZLogDebug("[{}] Cache purge: Skipping delete for backing_file_name={}, "
                    "as chunkmap not empty (still present {} of {})",
                    CACHE_TAG, backing_file_name,
-                   chunkmap.size(), start_size);
+                   num_chunks.load(), start_size);
         // On file close, we should free all chunks.
         assert(!shutdown);
         assert(bytes_allocated > 0);
@@ -2879,7 +3493,11 @@ void bytes_chunk_cache::clear_nolock(bool shutdown)
      */
     assert(bytes_cached == 0);
 
-    if (bytes_allocated != 0) {
+    /*
+     * Retired chunks are still allocated till the reclaimer frees them.
+     */
+    if ((bytes_allocated != 0) && retired.empty() &&
+        (!retire_map || retire_map->empty())) {
         AZLogWarnNR("[{}] Cache purge: bytes_allocated is still {}, some user "
                     "is still holding on to the bytes_chunk/membuf even after "
                     "dropping the inuse count: backing_file_name={}",
@@ -2921,6 +3539,141 @@ void bytes_chunk_cache::clear_nolock(bool shutdown)
     }
 }
 
+/**
+ * Caller MUST hold exclusive lock on all the chunkmap shards.
+ */
+void bytes_chunk_cache::retire_nolock()
+{
+    /*
+     * Caches not backing a file (f.e., the ones created by unit tests) cannot
+     * be queued to the reclaimer, purge them inline.
+     */
+    if (!inode) {
+        clear_nolock();
+        return;
+    }
+
+    std::map<uint64_t, struct bytes_chunk> retire_map;
+    const uint64_t bytes_cached_before = bytes_cached;
+
+    clear_nolock(false /* shutdown */, &retire_map);
+
+    /*
+     * Bump the generation even if nothing could be retired, the cache
+     * contents have logically changed.
+     */
+    const uint64_t gen = ++generation;
+
+    if (retire_map.empty()) {
+        return;
+    }
+
+    const uint64_t nchunks = retire_map.size();
+    assert(bytes_cached_before >= bytes_cached);
+    const uint64_t nbytes = bytes_cached_before - bytes_cached;
+
+    assert(retired.count(gen) == 0);
+    retired.emplace(gen, std::move(retire_map));
+    num_retired += nchunks;
+
+    INC_GBL_STATS(cache_purges_deferred, 1);
+    INC_GBL_STATS(bytes_purge_deferred, nbytes);
+
+    AZLogDebug("[{}] Cache purge: retired {} chunks ({} bytes) as generation "
+               "{}, {} retired chunks pending reclaim",
+               CACHE_TAG, nchunks, nbytes, gen, num_retired.load());
+
+    /*
+     * If this fails we are shutting down, the retired chunks are then freed
+     * when the cache is deleted.
+     */
+    if (!reclaim_queued) {
+        reclaim_queued = nfs_client::get_instance().queue_purge(inode);
+    }
+}
+
+uint64_t bytes_chunk_cache::reclaim_retired(uint64_t max_chunks)
+{
+    assert(max_chunks > 0);
+
+    /*
+     * Chunks are moved out under the lock and freed after dropping it,
+     * freeing membufs doesn't need the chunkmap shards locked as it only
+     * updates the (atomic) cache stats.
+     */
+    std::vector<std::map<uint64_t, struct bytes_chunk>> tofree;
+    uint64_t nfree = 0;
+    uint64_t remaining;
+
+    {
+        chunkmap_lock all_shards(this);
+        const std::unique_lock<chunkmap_lock> _lock(all_shards);
+
+        while (!retired.empty() && (nfree < max_chunks)) {
+            auto git = retired.begin();
+            std::map<uint64_t, struct bytes_chunk>& chunks = git->second;
+            assert(!chunks.empty());
+
+            if (chunks.size() <= (max_chunks - nfree)) {
+                // Common case, take the whole generation.
+                nfree += chunks.size();
+                tofree.emplace_back(std::move(chunks));
+                retired.erase(git);
+            } else {
+                std::map<uint64_t, struct bytes_chunk>& part =
+                    tofree.emplace_back();
+                while (nfree < max_chunks) {
+                    part.insert(chunks.extract(chunks.begin()));
+                    nfree++;
+                }
+                assert(!chunks.empty());
+            }
+        }
+
+        assert(num_retired >= nfree);
+        num_retired -= nfree;
+        remaining = num_retired;
+
+        /*
+         * Once all retired chunks are freed the next retire_nolock() must
+         * queue us again.
+         */
+        if (remaining == 0) {
+            reclaim_queued = false;
+        }
+    }
+
+    if (nfree > 0) {
+        AZLogDebug("[{}] Reclaiming {} retired chunks, {} still retired",
+                   CACHE_TAG, nfree, remaining);
+        INC_GBL_STATS(purge_reclaim_batches, 1);
+        tofree.clear();
+    }
+
+    return remaining;
+}
+
+std::vector<const struct bytes_chunk *>
+bytes_chunk_cache::get_sorted_chunks_nolock(uint64_t start_off,
+                                            uint64_t end_off) const
+{
+    std::vector<const struct bytes_chunk *> bcs;
+
+    for (const chunkmap_shard& shard : shards) {
+        for (auto it = shard.chunkmap.lower_bound(start_off);
+             it != shard.chunkmap.cend() && it->first <= end_off; ++it) {
+            bcs.emplace_back(&(it->second));
+        }
+    }
+
+    std::sort(bcs.begin(), bcs.end(),
+              [](const struct bytes_chunk *a, const struct bytes_chunk *b) {
+                  return a->offset < b->offset;
+              });
+
+    return bcs;
+}
+
 /**
  * All the bcs returned by this function are guaranteed to be inuse and locked.
  *
@@ -2939,13 +3692,13 @@ bytes_chunk_cache::get_commit_pending_bcs(uint64_t *bytes) const
         *bytes = 0;
     }
 
-    // TODO: Make it shared lock.
-    const std::unique_lock<std::mutex> _lock(chunkmap_lock_43);
-    auto it = chunkmap.cbegin();
+    chunkmap_lock all_shards(this);
+    const std::shared_lock<chunkmap_lock> _lock(all_shards);
     uint64_t next_offset = AZNFSC_BAD_OFFSET;
 
-    while (it != chunkmap.cend()) {
-        const struct bytes_chunk& bc = it->second;
+    for (const struct bytes_chunk *_bc :
+            get_sorted_chunks_nolock(0, AZNFSC_MAX_FILE_SIZE)) {
+        const struct bytes_chunk& bc = *_bc;
         struct membuf *mb = bc.get_membuf();
 
         if (mb->is_commit_pending()) {
@@ -3009,8 +3762,6 @@ bytes_chunk_cache::get_commit_pending_bcs(uint64_t *bytes) const
                 *bytes += bc.length;
             }
         }
-
-        ++it;
     }
 
     return bc_vec;
@@ -3025,13 +3776,13 @@ std::vector<bytes_chunk> bytes_chunk_cache::get_contiguous_dirty_bcs(
         *bytes = 0;
     }
 
-    // TODO: Make it shared lock.
-    const std::unique_lock<std::mutex> _lock(chunkmap_lock_43);
-    auto it = chunkmap.cbegin();
+    chunkmap_lock all_shards(this);
+    const std::shared_lock<chunkmap_lock> _lock(all_shards);
     uint64_t next_offset = AZNFSC_BAD_OFFSET;
 
-    while (it != chunkmap.cend()) {
-        const struct bytes_chunk& bc = it->second;
+    for (const struct bytes_chunk *_bc :
+            get_sorted_chunks_nolock(0, AZNFSC_MAX_FILE_SIZE)) {
+        const struct bytes_chunk& bc = *_bc;
         struct membuf *mb = bc.get_membuf();
 
         assert(bc.offset == mb->offset);
@@ -3057,8 +3808,6 @@ std::vector<bytes_chunk> bytes_chunk_cache::get_contiguous_dirty_bcs(
                 *bytes += bc.length;
             }
         }
-
-        ++it;
     }
 
     return bc_vec;
@@ -3070,21 +3819,19 @@ std::vector<bytes_chunk> bytes_chunk_cache::get_flushing_bc_range(
     std::vector<bytes_chunk> bc_vec;
     assert(start_off < end_off);
 
-    // TODO: Make it shared lock.
-    const std::unique_lock<std::mutex> _lock(chunkmap_lock_43);
-    auto it = chunkmap.lower_bound(start_off);
+    chunkmap_lock all_shards(this);
+    const std::shared_lock<chunkmap_lock> _lock(all_shards);
 
     // TODO: Do we want membufs that completely lie within end_off?
-    while (it != chunkmap.cend() && it->first <= end_off) {
-        const struct bytes_chunk& bc = it->second;
+    for (const struct bytes_chunk *_bc :
+            get_sorted_chunks_nolock(start_off, end_off)) {
+        const struct bytes_chunk& bc = *_bc;
         struct membuf *mb = bc.get_membuf();
 
         if (mb->is_dirty() && mb->is_flushing()) {
             mb->set_inuse();
             bc_vec.emplace_back(bc);
         }
-
-        ++it;
     }
 
     return bc_vec;
@@ -3100,12 +3847,12 @@ std::vector<bytes_chunk> bytes_chunk_cache::get_dirty_nonflushing_bcs_range(
         *bytes = 0;
     }
 
-    // TODO: Make it shared lock.
-    const std::unique_lock<std::mutex> _lock(chunkmap_lock_43);
-    auto it = chunkmap.lower_bound(start_off);
+    chunkmap_lock all_shards(this);
+    const std::shared_lock<chunkmap_lock> _lock(all_shards);
 
-    while (it != chunkmap.cend() && it->first <= end_off) {
-        const struct bytes_chunk& bc = it->second;
+    for (const struct bytes_chunk *_bc :
+            get_sorted_chunks_nolock(start_off, end_off)) {
+        const struct bytes_chunk& bc = *_bc;
         struct membuf *mb = bc.get_membuf();
 
         assert(bc.offset == mb->offset);
@@ -3123,8 +3870,6 @@ std::vector<bytes_chunk> bytes_chunk_cache::get_dirty_nonflushing_bcs_range(
                 *bytes += bc.length;
             }
         }
-
-        ++it;
     }
 
     return bc_vec;
@@ -3136,12 +3881,12 @@ std::vector<bytes_chunk> bytes_chunk_cache::get_dirty_bc_range(
     std::vector<bytes_chunk> bc_vec;
     assert(start_off < end_off);
 
-    // TODO: Make it shared lock.
-    const std::unique_lock<std::mutex> _lock(chunkmap_lock_43);
-    auto it = chunkmap.lower_bound(start_off);
+    chunkmap_lock all_shards(this);
+    const std::shared_lock<chunkmap_lock> _lock(all_shards);
 
-    while (it != chunkmap.cend() && it->first <= end_off) {
-        const struct bytes_chunk& bc = it->second;
+    for (const struct bytes_chunk *_bc :
+            get_sorted_chunks_nolock(start_off, end_off)) {
+        const struct bytes_chunk& bc = *_bc;
         struct membuf *mb = bc.get_membuf();
 
         assert(bc.offset == mb->offset);
@@ -3155,8 +3900,6 @@ std::vector<bytes_chunk> bytes_chunk_cache::get_dirty_bc_range(
             mb->set_inuse();
             bc_vec.emplace_back(bc);
         }
-
-        ++it;
     }
 
     return bc_vec;
@@ -3349,9 +4092,11 @@ do { \
     /* get all chunks and calculate total allocated bytes */ \
     uint64_t total_allocated_bytes = 0; \
     uint64_t total_bytes = 0; \
-    for ([[maybe_unused]] const auto& e : cache.chunkmap) { \
-        total_allocated_bytes += e.second.get_membuf()->allocated_length; \
-        total_bytes += e.second.get_membuf()->length; \
+    for (const auto& shard : cache.shards) { \
+        for ([[maybe_unused]] const auto& e : shard.chunkmap) { \
+            total_allocated_bytes += e.second.get_membuf()->allocated_length; \
+            total_bytes += e.second.get_membuf()->length; \
+        } \
     } \
     [[maybe_unused]] const uint64_t total_dropped_bytes = cache.dropall(); \
     if (cache.is_file_backed()) { \
@@ -3367,16 +4112,18 @@ do { \
      */ \
     uint64_t total_allocated_bytes1 = 0; \
     uint64_t total_bytes1 = 0; \
-    for ([[maybe_unused]] const auto& e : cache.chunkmap) { \
-        if (cache.is_file_backed()) { \
-            assert(e.second.get_membuf()->allocated_buffer == nullptr); \
-            assert(e.second.get_membuf()->buffer == nullptr); \
-        } else { \
-            assert(e.second.get_membuf()->allocated_buffer != nullptr); \
-            assert(e.second.get_membuf()->buffer != nullptr); \
+    for (const auto& shard : cache.shards) { \
+        for ([[maybe_unused]] const auto& e : shard.chunkmap) { \
+            if (cache.is_file_backed()) { \
+                assert(e.second.get_membuf()->allocated_buffer == nullptr); \
+                assert(e.second.get_membuf()->buffer == nullptr); \
+            } else { \
+                assert(e.second.get_membuf()->allocated_buffer != nullptr); \
+                assert(e.second.get_membuf()->buffer != nullptr); \
+            } \
+            total_allocated_bytes1 += e.second.get_membuf()->allocated_length; \
+            total_bytes1 += e.second.get_membuf()->length; \
         } \
-        total_allocated_bytes1 += e.second.get_membuf()->allocated_length; \
-        total_bytes1 += e.second.get_membuf()->length; \
     } \
     assert(total_bytes1 == total_bytes); \
     assert(total_allocated_bytes1 == total_allocated_bytes); \
@@ -3397,10 +4144,12 @@ do { \
 #define PRINT_CHUNKMAP() \
     AZLogInfo("==== [{}] chunkmap start [a:{} c:{}] ====", \
               __LINE__, cache.bytes_allocated.load(), cache.bytes_cached.load()); \
-    for (auto& e : cache.chunkmap) { \
-        /* mmap() just in case drop was called prior to this */ \
-        e.second.load(); \
-        PRINT_CHUNK(e.second); \
+    for (auto& shard : cache.shards) { \
+        for (auto& e : shard.chunkmap) { \
+            /* mmap() just in case drop was called prior to this */ \
+            e.second.load(); \
+            PRINT_CHUNK(e.second); \
+        } \
     } \
     AZLogInfo("==== chunkmap end ====");
 
@@ -4101,12 +4850,153 @@ do { \
      */
     AZLogInfo("========== [Release] --> (0, 500) ==========");
     assert(cache.release(0, 500) == 195);
-    assert(cache.chunkmap.empty());
+    assert(cache.is_empty());
 
     assert(cache.release(0, 1) == 0);
     assert(cache.release(10, 20) == 0);
     assert(cache.release(2, 2000) == 0);
 
+    /*
+     * Scan resistance, ref membuf::on_app_read().
+     * Two readers splitting a sequential scan of a membuf between them,
+     * reading alternate 4K blocks concurrently (and hence out of order),
+     * must leave the membuf cold. A re-read of a block must make it hot.
+     */
+    AZLogInfo("========== [Interleaved sequential readers] ==========");
+    {
+        static const uint64_t mb_size = 1024 * 1024ULL;
+        static const uint64_t rd_size = 4096;
+
+        v = cache.get(mb_size, mb_size);
+        assert(v.size() == 1);
+        ASSERT_NEW(v[0], mb_size, 2 * mb_size);
+        struct membuf *mb = v[0].get_membuf();
+        assert(!mb->is_hot());
+
+        auto reader = [mb](uint64_t first) {
+            for (uint64_t off = first; off < mb_size; off += (2 * rd_size)) {
+                mb->on_app_read(mb_size + off, rd_size);
+            }
+        };
+
+        std::thread r1(reader, 0);
+        std::thread r2(reader, rd_size);
+        r1.join();
+        r2.join();
+        assert(!mb->is_hot());
+
+        // Re-read.
+        mb->on_app_read(mb_size + rd_size, rd_size);
+        assert(mb->is_hot());
+        v.clear();
+
+        /*
+         * Out of order reads by a single reader don't count either, and
+         * after a re-read only further re-reads count.
+         */
+        v = cache.get(2 * mb_size, mb_size);
+        assert(v.size() == 1);
+        ASSERT_NEW(v[0], 2 * mb_size, 3 * mb_size);
+        mb = v[0].get_membuf();
+
+        mb->on_app_read((2 * mb_size) + rd_size, rd_size);
+        mb->on_app_read((2 * mb_size), rd_size);
+        mb->on_app_read((2 * mb_size) + (3 * rd_size), rd_size);
+        mb->on_app_read((2 * mb_size) + (2 * rd_size), rd_size);
+        assert(!mb->is_hot());
+
+        mb->on_app_read((2 * mb_size) + rd_size, rd_size);
+        assert(mb->is_hot());
+        mb->on_app_read((2 * mb_size) + (4 * rd_size), rd_size);
+
+        // clock_ref must be 1, so one aging sweep makes it cold.
+        assert(mb->age());
+        assert(!mb->is_hot());
+        v.clear();
+
+        /*
+         * Sparse random re-reads, covering a small part of the membuf's read
+         * span, must make it hot too.
+         */
+        v = cache.get(3 * mb_size, mb_size);
+        assert(v.size() == 1);
+        ASSERT_NEW(v[0], 3 * mb_size, 4 * mb_size);
+        mb = v[0].get_membuf();
+
+        mb->on_app_read((3 * mb_size) + (25 * rd_size), rd_size);
+        mb->on_app_read((3 * mb_size) + (200 * rd_size), rd_size);
+        mb->on_app_read((3 * mb_size) + (120 * rd_size), rd_size);
+        assert(!mb->is_hot());
+
+        mb->on_app_read((3 * mb_size) + (25 * rd_size), rd_size);
+        assert(mb->is_hot());
+
+        v.clear();
+        assert(cache.release(mb_size, 3 * mb_size) == (3 * mb_size));
+        assert(cache.is_empty());
+    }
+
+    /*
+     * Chunks never span regions, ref CHUNKMAP_SHARDS, so a get() straddling
+     * a region boundary returns one chunk from either region, while the
+     * extent must still span the dirty chunks in both regions.
+     */
+    AZLogInfo("========== [Region boundary] ==========");
+    {
+        static const uint64_t reg = CHUNKMAP_REGION_SIZE;
+
+        v = cache.getx(reg - 100, 200, &l, &r);
+        assert(v.size() == 2);
+
+        ASSERT_EXTENT((reg - 100), (reg + 100));
+        ASSERT_NEW(v[0], (reg - 100), reg);
+        ASSERT_NEW(v[1], reg, (reg + 100));
+
+        for ([[maybe_unused]] const auto& e : v) {
+            e.get_membuf()->set_inuse();
+            e.get_membuf()->set_locked();
+            e.get_membuf()->set_uptodate();
+            e.get_membuf()->set_dirty();
+            e.get_membuf()->clear_locked();
+            e.get_membuf()->clear_inuse();
+            assert(e.needs_flush());
+        }
+        v.clear();
+
+        // Extent extended into the next region.
+        v = cache.getx(reg - 50, 10, &l, &r);
+        assert(v.size() == 1);
+
+        ASSERT_EXTENT((reg - 100), (reg + 100));
+        ASSERT_EXISTING(v[0], (reg - 50), (reg - 40));
+        v.clear();
+
+        // Extent extended into the previous region.
+        v = cache.getx(reg + 50, 10, &l, &r);
+        assert(v.size() == 1);
+
+        ASSERT_EXTENT((reg - 100), (reg + 100));
+        ASSERT_EXISTING(v[0], (reg + 50), (reg + 60));
+        v.clear();
+
+        PRINT_CHUNKMAP();
+
+        v = cache.get(reg - 100, 200);
+        assert(v.size() == 2);
+        for ([[maybe_unused]] const auto& e : v) {
+            e.get_membuf()->set_locked();
+            e.get_membuf()->set_flushing();
+            e.get_membuf()->clear_dirty();
+            e.get_membuf()->clear_flushing();
+            e.get_membuf()->clear_locked();
+            e.get_membuf()->clear_inuse();
+        }
+        v.clear();
+
+        assert(cache.release(reg - 100, 200) == 200);
+        assert(cache.is_empty());
+    }
+
     /*
      * Now run some random cache get/release to stress test the cache.
      */
@@ -4133,6 +5023,176 @@ do { \
 
     AZLogInfo("========== Cache stress successful!  ==========");
 
+    /*
+     * Now measure get()/release() throughput with increasing number of
+     * threads, all looking up the same cache. This mostly measures the
+     * chunkmap_lock_43 contention, hence all reads are served from the cache
+     * (which is the common case for parallel readers of a file) and the
+     * released range always has inuse chunks, so release() doesn't free
+     * anything. Keep the file small enough to not trigger inline pruning.
+     */
+    AZLogInfo("========== Starting get/release benchmark ==========");
+
+    cache.clear();
+    assert(cache.is_empty());
+
+    {
+        static const uint64_t bench_file_size = 64 * 1024 * 1024ULL;
+        static const uint64_t bench_read_size = 64 * 1024ULL;
+        static const int bench_ops_per_thread = 200'000;
+        std::vector<bytes_chunk> pinned;
+
+        for (uint64_t off = 0; off < bench_file_size;
+             off += AZNFSC_MAX_CHUNK_SIZE) {
+            v = cache.get(off, AZNFSC_MAX_CHUNK_SIZE);
+            assert(v.size() == 1);
+            assert(v[0].is_new);
+
+            v[0].get_membuf()->set_locked();
+            v[0].get_membuf()->set_uptodate();
+            v[0].get_membuf()->clear_locked();
+
+            /*
+             * Don't clear inuse so that release() cannot free these chunks.
+             */
+            pinned.emplace_back(v[0]);
+        }
+        v.clear();
+
+        for (int nthreads = 1; nthreads <= 64; nthreads *= 2) {
+            std::vector<std::thread> threads;
+            const uint64_t start_usec = get_current_usecs();
+
+            for (int t = 0; t < nthreads; t++) {
+                threads.emplace_back([&cache]() {
+                    for (int i = 0; i < bench_ops_per_thread; i++) {
+                        const uint64_t offset =
+                            random_number(0, (bench_file_size -
+                                              bench_read_size) / PAGE_SIZE) *
+                                              PAGE_SIZE;
+                        const std::vector<bytes_chunk> bv =
+                            cache.get(offset, bench_read_size);
+
+                        for ([[maybe_unused]] const auto& e : bv) {
+                            assert(!e.is_new);
+                            assert(e.get_membuf()->is_uptodate());
+                            e.get_membuf()->clear_inuse();
+                        }
+
+                        [[maybe_unused]]
+                        const uint64_t released =
+                            cache.release(offset, bench_read_size);
+                        assert(released == 0);
+                    }
+                });
+            }
+
+            for (auto& t : threads) {
+                t.join();
+            }
+
+            const uint64_t elapsed_usec =
+                std::max<uint64_t>(get_current_usecs() - start_usec, 1);
+            const uint64_t total_ops =
+                (uint64_t) nthreads * bench_ops_per_thread;
+
+            AZLogInfo("[get/release] threads: {}, ops: {}, time: {:.3f} sec, "
+                      "throughput: {:.0f} ops/sec ({:.0f} ops/sec/thread)",
+                      nthreads, total_ops, elapsed_usec / 1000'000.0,
+                      (total_ops * 1000'000.0) / elapsed_usec,
+                      (total_ops * 1000'000.0) / (elapsed_usec * nthreads));
+        }
+
+        for (const auto& e : pinned) {
+            e.get_membuf()->clear_inuse();
+        }
+        pinned.clear();
+
+        cache.clear();
+        assert(cache.is_empty());
+    }
+
+    AZLogInfo("========== get/release benchmark done ==========");
+
+    /*
+     * Now writers, each allocating and freeing chunks in its own disjoint
+     * range of the file. Every get() adds a new chunk and every release()
+     * frees it, so both need the chunkmap locked exclusively.
+     * Run it twice, first with all the ranges in the same region (hence
+     * the same shard) and then with each range in its own region. The
+     * latter must scale with the number of threads (and CPUs), till there
+     * are more threads than CHUNKMAP_SHARDS.
+     */
+    AZLogInfo("========== Starting writers benchmark ==========");
+
+    {
+        static const uint64_t bench_write_size = 64 * 1024ULL;
+        static const int bench_ops_per_thread = 200'000;
+        static const int bench_max_threads = 64;
+
+        for (const bool same_shard : {true, false}) {
+            // Size of the range written by each thread.
+            const uint64_t range_size =
+                same_shard ? (CHUNKMAP_REGION_SIZE / bench_max_threads) :
+                             CHUNKMAP_REGION_SIZE;
+
+            for (int nthreads = 1; nthreads <= bench_max_threads;
+                 nthreads *= 2) {
+                std::vector<std::thread> threads;
+                const uint64_t start_usec = get_current_usecs();
+
+                for (int t = 0; t < nthreads; t++) {
+                    threads.emplace_back([&cache, range_size, t]() {
+                        const uint64_t range_start = t * range_size;
+
+                        for (int i = 0; i < bench_ops_per_thread; i++) {
+                            const uint64_t pages =
+                                (range_size - bench_write_size) / PAGE_SIZE;
+                            const uint64_t offset = range_start +
+                                random_number(0, pages) * PAGE_SIZE;
+                            const std::vector<bytes_chunk> bv =
+                                cache.get(offset, bench_write_size);
+                            assert(bv.size() == 1);
+                            assert(bv[0].is_new);
+
+                            struct membuf *mb = bv[0].get_membuf();
+                            mb->set_locked();
+                            mb->set_uptodate();
+                            mb->clear_locked();
+                            mb->clear_inuse();
+
+                            [[maybe_unused]]
+                            const uint64_t released =
+                                cache.release(offset, bench_write_size);
+                            assert(released == bench_write_size);
+                        }
+                    });
+                }
+
+                for (auto& t : threads) {
+                    t.join();
+                }
+
+                const uint64_t elapsed_usec =
+                    std::max<uint64_t>(get_current_usecs() - start_usec, 1);
+                const uint64_t total_ops =
+                    (uint64_t) nthreads * bench_ops_per_thread;
+
+                AZLogInfo("[writers, {}] threads: {}, ops: {}, "
+                          "time: {:.3f} sec, throughput: {:.0f} ops/sec "
+                          "({:.0f} ops/sec/thread)",
+                          same_shard ? "same shard" : "shard per thread",
+                          nthreads, total_ops, elapsed_usec / 1000'000.0,
+                          (total_ops * 1000'000.0) / elapsed_usec,
+                          (total_ops * 1000'000.0) / (elapsed_usec * nthreads));
+            }
+        }
+
+        assert(cache.is_empty());
+    }
+
+    AZLogInfo("========== writers benchmark done ==========");
+
     return 0;
 }
 
@@ -1,5 +1,20 @@
+#include <signal.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
 #include "log.h"
 
+#ifdef DEBUG_AZLOG
+#include <sstream>
+#include "spdlog/sinks/ostream_sink.h"
+#endif
+
 bool enable_debug_logs = false;
 
 void init_log() 
@@ -58,3 +73,504 @@ void set_file_logger(const std::string& log_file_path) {
 
     AZLogDebug("File logger init.");
 }
+
+namespace azlog {
+
+std::atomic<bool> async_enabled = false;
+
+/*
+ * Per-thread ring of log slots.
+ * head is advanced only by the owning thread after filling a slot and tail
+ * only by the log thread after writing it out.
+ */
+struct log_ring
+{
+    log_slot slots[AZLOG_RING_SLOTS];
+    std::atomic<uint64_t> head = 0;
+    std::atomic<uint64_t> tail = 0;
+
+    // Messages dropped as the ring was full.
+    std::atomic<uint64_t> dropped = 0;
+
+    /*
+     * Set when the owning thread exits, the ring can then be adopted by a
+     * new thread. Rings are never freed, so the number of rings is bounded
+     * by the max number of threads ever alive at the same time.
+     */
+    std::atomic<bool> orphaned = false;
+
+    // Next ring in the global list, never changes once the ring is added.
+    log_ring *next = nullptr;
+};
+
+/*
+ * List of all rings, rings are only ever added at the head.
+ */
+static std::atomic<log_ring*> ring_list = nullptr;
+
+/*
+ * Never freed, a joinable std::thread must not be destroyed at exit if we
+ * didn't get to shutdown_async().
+ */
+static std::thread *log_thread = nullptr;
+static std::atomic<bool> log_thread_running = false;
+static std::atomic<bool> log_thread_stop = false;
+static std::atomic<bool> flush_requested = false;
+
+/*
+ * Log thread polls the rings, producers wake it up early only when a ring
+ * gets half full, so the common case doesn't make any syscall.
+ */
+static std::mutex drain_mutex;
+static std::condition_variable drain_cv;
+
+/*
+ * Incremented by the log thread after every pass over all the rings.
+ */
+static std::atomic<uint64_t> pass_gen = 0;
+
+/*
+ * Id of the log thread, it must never wait for itself.
+ */
+static std::atomic<std::thread::id> log_thread_id;
+
+/*
+ * Marks the thread's ring orphaned when the thread exits.
+ */
+struct ring_owner
+{
+    log_ring *ring = nullptr;
+
+    ~ring_owner()
+    {
+        if (ring) {
+            ring->orphaned = true;
+            ring = nullptr;
+        }
+    }
+};
+
+static thread_local ring_owner my_ring;
+
+static log_ring *get_ring()
+{
+    if (my_ring.ring) {
+        return my_ring.ring;
+    }
+
+    /*
+     * Adopt an orphaned ring if any, else add a new one.
+     * Messages left by the previous owner are still written out as the
+     * log thread doesn't care who owns the ring.
+     */
+    for (log_ring *ring = ring_list; ring; ring = ring->next) {
+        bool expected = true;
+        if (ring->orphaned &&
+            ring->orphaned.compare_exchange_strong(expected, false)) {
+            my_ring.ring = ring;
+            return ring;
+        }
+    }
+
+    log_ring *ring = new log_ring();
+    ring->next = ring_list;
+    while (!ring_list.compare_exchange_weak(ring->next, ring))
+        ;
+
+    my_ring.ring = ring;
+    return ring;
+}
+
+log_slot *get_slot(spdlog::level::level_enum lvl)
+{
+    log_ring *ring = get_ring();
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+
+    /*
+     * Ring full.
+     * Drop debug and info messages, warn and above must not be lost so we
+     * wait for the log thread to make space.
+     */
+    while ((head - ring->tail.load(std::memory_order_acquire)) >=
+           AZLOG_RING_SLOTS) {
+        if (lvl < spdlog::level::warn ||
+            !log_thread_running ||
+            (std::this_thread::get_id() == log_thread_id.load())) {
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        drain_cv.notify_one();
+        ::sched_yield();
+    }
+
+    log_slot *slot = &ring->slots[head % AZLOG_RING_SLOTS];
+    slot->time = spdlog::log_clock::now();
+    slot->thread_id = spdlog::details::os::thread_id();
+    slot->level = lvl;
+    slot->long_msg = nullptr;
+
+    return slot;
+}
+
+void commit_slot(log_slot *slot, size_t len)
+{
+    log_ring *ring = my_ring.ring;
+    assert(ring);
+    assert(slot == &ring->slots[ring->head % AZLOG_RING_SLOTS]);
+
+    // Oversize messages must use commit_long_slot().
+    assert(len <= sizeof(slot->msg));
+    slot->len = len;
+
+    const uint64_t head = ring->head.load(std::memory_order_relaxed) + 1;
+    ring->head.store(head, std::memory_order_release);
+
+    if ((head - ring->tail.load(std::memory_order_relaxed)) ==
+        (AZLOG_RING_SLOTS / 2)) {
+        drain_cv.notify_one();
+    }
+}
+
+void commit_long_slot(log_slot *slot, std::string&& msg)
+{
+    assert(msg.size() > sizeof(slot->msg));
+    slot->long_msg = new std::string(std::move(msg));
+    commit_slot(slot, 0);
+}
+
+static void write_msg(spdlog::logger *logger,
+                      spdlog::log_clock::time_point time,
+                      size_t thread_id,
+                      spdlog::level::level_enum lvl,
+                      spdlog::string_view_t msg)
+{
+    spdlog::details::log_msg lmsg(time, spdlog::source_loc{},
+                                  logger->name(), lvl, msg);
+    lmsg.thread_id = thread_id;
+
+    for (auto& sink : logger->sinks()) {
+        if (sink->should_log(lvl)) {
+            sink->log(lmsg);
+        }
+    }
+}
+
+/*
+ * Write out all messages queued in the rings at the time of the call,
+ * merged in timestamp order. Returns the number of messages written.
+ */
+static uint64_t drain_rings()
+{
+    /*
+     * set_file_logger() may change the default logger, hold a ref for the
+     * duration of the pass.
+     */
+    std::shared_ptr<spdlog::logger> logger = spdlog::default_logger();
+    const spdlog::level::level_enum flush_level = logger->flush_level();
+
+    struct ring_state {
+        log_ring *ring;
+        uint64_t tail;
+        uint64_t head;
+    };
+    std::vector<ring_state> rings;
+    uint64_t dropped = 0;
+
+    for (log_ring *ring = ring_list; ring; ring = ring->next) {
+        const uint64_t head = ring->head.load(std::memory_order_acquire);
+        const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+
+        dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+
+        if (head != tail) {
+            rings.push_back({ring, tail, head});
+        }
+    }
+
+    uint64_t written = 0;
+    bool need_flush = flush_requested.exchange(false);
+
+    while (true) {
+        ring_state *next = nullptr;
+
+        for (ring_state& rs : rings) {
+            if (rs.tail == rs.head) {
+                continue;
+            }
+            const log_slot& slot = rs.ring->slots[rs.tail % AZLOG_RING_SLOTS];
+            if (!next ||
+                slot.time <
+                next->ring->slots[next->tail % AZLOG_RING_SLOTS].time) {
+                next = &rs;
+            }
+        }
+
+        if (!next) {
+            break;
+        }
+
+        log_slot& slot = next->ring->slots[next->tail % AZLOG_RING_SLOTS];
+        if (slot.long_msg) {
+            write_msg(logger.get(), slot.time, slot.thread_id, slot.level,
+                      spdlog::string_view_t(slot.long_msg->data(),
+                                            slot.long_msg->size()));
+            delete slot.long_msg;
+            slot.long_msg = nullptr;
+        } else {
+            write_msg(logger.get(), slot.time, slot.thread_id, slot.level,
+                      spdlog::string_view_t(slot.msg, slot.len));
+        }
+
+        if (slot.level >= flush_level) {
+            need_flush = true;
+        }
+
+        // Release the slot back to the producer.
+        next->ring->tail.store(++next->tail, std::memory_order_release);
+        written++;
+    }
+
+    if (dropped) {
+        static char buf[128];
+        const auto res = fmt::format_to_n(buf, sizeof(buf),
+                "[LOG] Dropped {} log message(s), log ring full", dropped);
+        write_msg(logger.get(), spdlog::log_clock::now(),
+                  spdlog::details::os::thread_id(), spdlog::level::warn,
+                  spdlog::string_view_t(buf, std::min(res.size, sizeof(buf))));
+        need_flush = true;
+    }
+
+    if (need_flush) {
+        for (auto& sink : logger->sinks()) {
+            sink->flush();
+        }
+    }
+
+    pass_gen++;
+
+    return written;
+}
+
+static void log_thread_main()
+{
+    log_thread_id = std::this_thread::get_id();
+
+    /*
+     * Sleep more when idle, less when busy. 1ms is short enough for the
+     * rings to not fill up under a burst.
+     */
+    int idle_passes = 0;
+
+    while (!log_thread_stop) {
+        if (drain_rings() || flush_requested) {
+            idle_passes = 0;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> _lock(drain_mutex);
+        drain_cv.wait_for(_lock, std::chrono::milliseconds(
+                                    (++idle_passes > 100) ? 5 : 1));
+    }
+
+    // Final drain.
+    drain_rings();
+}
+
+/*
+ * Crashing signals, we write out all queued messages before letting the
+ * default action take place. These are the messages most likely to tell
+ * why we crashed.
+ */
+static const int crash_signals[] = { SIGABRT, SIGSEGV, SIGBUS, SIGFPE, SIGILL };
+
+static void handle_crash_signal(int signum)
+{
+    /*
+     * Not strictly async signal safe, but we only wait on atomics and
+     * sleep. Bounded wait, in case the log thread itself crashed.
+     */
+    flush_async(1000);
+
+    /*
+     * SA_RESETHAND has restored the default action, which takes effect
+     * once we return from the handler.
+     */
+    ::raise(signum);
+}
+
+static void after_fork_child()
+{
+    async_enabled = false;
+    log_thread_running = false;
+    log_thread = nullptr;
+}
+
+void enable_async()
+{
+    // Must be called only once.
+    assert(!log_thread_running);
+
+    log_thread_stop = false;
+    log_thread = new std::thread(log_thread_main);
+    log_thread_running = true;
+    async_enabled = true;
+
+    /*
+     * Forked child (possible with nofuse) doesn't have the log thread, it
+     * logs synchronously. Any messages queued by the parent at the time of
+     * fork are not written by the child.
+     */
+    static std::atomic<bool> atfork_registered = false;
+    if (!atfork_registered.exchange(true)) {
+        ::pthread_atfork(nullptr, nullptr, after_fork_child);
+    }
+
+    for (const int signum : crash_signals) {
+        struct sigaction sa, oldsa;
+
+        /*
+         * Don't override handlers set by someone else, f.e., the
+         * application when running as nofuse.
+         */
+        if ((::sigaction(signum, nullptr, &oldsa) != 0) ||
+            (oldsa.sa_handler != SIG_DFL) ||
+            (oldsa.sa_flags & SA_SIGINFO)) {
+            continue;
+        }
+
+        ::memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_crash_signal;
+        sa.sa_flags = SA_RESETHAND;
+
+        if (::sigaction(signum, &sa, nullptr) != 0) {
+            AZLogWarn("[LOG] sigaction({}) failed: {}",
+                      signum, ::strerror(errno));
+        }
+    }
+
+    /*
+     * Don't lose queued messages if some path calls exit().
+     */
+    static std::atomic<bool> atexit_registered = false;
+    if (!atexit_registered.exchange(true)) {
+        ::atexit(shutdown_async);
+    }
+
+    AZLogDebug("[LOG] Async logging enabled, ring slots: {}, max msg size: {}",
+               AZLOG_RING_SLOTS, AZLOG_MSG_SIZE);
+}
+
+void flush_async(int timeout_msecs)
+{
+    if (!log_thread_running ||
+        (std::this_thread::get_id() == log_thread_id.load())) {
+        return;
+    }
+
+    /*
+     * Wait for two passes to start after this point, the first one may
+     * have missed our messages.
+     */
+    const uint64_t target_gen = pass_gen + 2;
+    flush_requested = true;
+
+    for (int waited_usecs = 0;
+         (pass_gen < target_gen) && log_thread_running;
+         waited_usecs += 100) {
+        if (waited_usecs >= (timeout_msecs * 1000)) {
+            break;
+        }
+        ::usleep(100);
+    }
+}
+
+void shutdown_async()
+{
+    if (!log_thread_running.exchange(false)) {
+        return;
+    }
+
+    /*
+     * New messages are written synchronously from now on, the log thread
+     * writes out whatever is queued before it exits.
+     */
+    async_enabled = false;
+    log_thread_stop = true;
+    log_thread->join();
+    delete log_thread;
+    log_thread = nullptr;
+
+    /*
+     * Threads which saw async_enabled just before we cleared it may have
+     * queued messages after the log thread's final drain.
+     */
+    drain_rings();
+}
+
+#ifdef DEBUG_AZLOG
+int unit_test()
+{
+    AZLogInfo("========== [azlog] Starting unit test ==========");
+
+    /*
+     * Log to a string stream with just the message in the pattern, so that
+     * we can verify exactly what gets written.
+     */
+    std::ostringstream oss;
+    auto sink = std::make_shared<spdlog::sinks::ostream_sink_mt>(oss);
+    sink->set_pattern("%v");
+    auto logger = std::make_shared<spdlog::logger>("azlog_test", sink);
+    logger->set_level(spdlog::level::info);
+
+    std::shared_ptr<spdlog::logger> saved_logger = spdlog::default_logger();
+    spdlog::set_default_logger(logger);
+
+    enable_async();
+    assert(async_enabled);
+
+    /*
+     * Message longer than a slot (and the stats dump), surrounded by
+     * messages that fit in a slot. It must be written intact and in order.
+     */
+    std::string long_msg;
+    for (int i = 0; long_msg.size() < (AZLOG_MSG_SIZE * 8); i++) {
+        long_msg += "<" + std::to_string(i) + ">";
+    }
+
+    /*
+     * Arguments must be evaluated only once even though the long message
+     * is formatted twice.
+     */
+    int evals = 0;
+    AZLogWarn("before");
+    AZLogWarn("\n{}{}\n", long_msg, ++evals);
+    AZLogWarn("after");
+    assert(evals == 1);
+
+    flush_async();
+
+    const std::string out = oss.str();
+    const size_t before_pos = out.find("before");
+    const size_t long_pos = out.find(long_msg + "1\n");
+    const size_t after_pos = out.find("after");
+
+    assert(before_pos != std::string::npos);
+    assert(long_pos != std::string::npos);
+    assert(after_pos != std::string::npos);
+    assert(before_pos < long_pos);
+    assert(long_pos < after_pos);
+
+    shutdown_async();
+    assert(!async_enabled);
+
+    spdlog::set_default_logger(saved_logger);
+
+    AZLogInfo("========== [azlog] Unit test passed ==========");
+
+    return 0;
+}
+
+static int _i = unit_test();
+#endif
+
+}
@@ -1,5 +1,8 @@
 #include "aznfsc.h"
 #include "rpc_stats.h"
+#include "membuf_pool.h"
+#include "metrics_server.h"
+#include "cpu_affinity.h"
 
 #include <signal.h>
 
@@ -127,13 +130,23 @@ static void aznfsc_ll_init(void *userdata,
     conn->want &= ~FUSE_CAP_ATOMIC_O_TRUNC;
 
     /*
-     * For availing perf advantage of splice() we must add splice()/sendfile()
-     * support to libnfs. Till then just disable splicing so fuse never sends
-     * us fd+offset but just a plain buffer.
-     * Test splice read/write performance before enabling.
+     * For availing perf advantage of splice() for writes we must add
+     * splice()/sendfile() support to libnfs. Till then just disable splice
+     * read so fuse never sends us fd+offset but just a plain buffer.
+     *
+     * Read replies OTOH are sent from the membuf cache, which can be backed
+     * by a memfd (see membuf_pool::init_splice_region()). In that case we
+     * pass memfd buffers to fuse_reply_data() and libfuse splices them to
+     * /dev/fuse, saving a copy of all read data.
      */
-    conn->want &= ~FUSE_CAP_SPLICE_WRITE;
-    conn->want &= ~FUSE_CAP_SPLICE_MOVE;
+    if (membuf_pool::is_splice_enabled()) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+        conn->want |= FUSE_CAP_SPLICE_MOVE;
+        AZLogInfo("Using splice for read replies");
+    } else {
+        conn->want &= ~FUSE_CAP_SPLICE_WRITE;
+        conn->want &= ~FUSE_CAP_SPLICE_MOVE;
+    }
     conn->want &= ~FUSE_CAP_SPLICE_READ;
 
     // conn->want |= FUSE_CAP_AUTO_INVAL_DATA;
@@ -260,6 +273,12 @@ void aznfsc_ll_forget_multi(fuse_req_t req,
 
     struct nfs_client *client = get_nfs_client_from_fuse_req(req);
 
+    /*
+     * Inodes that this batch of forgets drops the last ref on, these are all
+     * queued to the reclaimer in one go.
+     */
+    std::vector<std::pair<struct nfs_inode*, size_t>> reclaim_batch;
+
     for (size_t i = 0; i < count; i++) {
         const uint64_t nlookup = forgets[i].nlookup;
         const fuse_ino_t ino = forgets[i].ino;
@@ -270,9 +289,10 @@ void aznfsc_ll_forget_multi(fuse_req_t req,
          * Decrement refcnt of the inode and free the inode if refcnt
          * becomes 0.
          */
-        inode->decref(nlookup, true /* from_forget */);
+        inode->decref(nlookup, true /* from_forget */, &reclaim_batch);
     }
 
+    client->queue_reclaim(reclaim_batch);
     fuse_reply_none(req);
 }
 
@@ -735,6 +755,29 @@ int main(int argc, char *argv[])
         goto err_out1;
     }
 
+    /*
+     * Read the NUMA topology before creating any threads or membufs.
+     */
+    cpu_affinity::get_instance().init(aznfsc_cfg.sys.affinity.mode_int,
+                                      aznfsc_cfg.sys.affinity.iface);
+
+    /*
+     * Splice region must be created before any membuf is allocated.
+     * It's only virtual address space, sized 2x the cache to leave room for
+     * fragmentation, the memfd is populated only as buffers are used.
+     * Shared mappings and the memfd are inherited across fuse_daemonize().
+     */
+    if (aznfsc_cfg.fuse_splice_read_reply) {
+        const uint64_t region_size =
+            2 * (aznfsc_cfg.cache.data.user.max_size_mb * 1024 * 1024ULL);
+
+        if (!membuf_pool::init_splice_region(region_size)) {
+            AZLogWarn("Failed to create splice region, read replies will "
+                      "not be spliced");
+            aznfsc_cfg.fuse_splice_read_reply = false;
+        }
+    }
+
     /*
      * Honour "-o max_threads=" cmdline option, else use the fuse_max_threads
      * value from the config, if set.
@@ -810,6 +853,14 @@ int main(int argc, char *argv[])
         goto err_out4;
     }
 
+    /*
+     * Start the log thread after fuse_daemonize(), for the same reason as
+     * the libnfs threads below.
+     */
+    if (aznfsc_cfg.log_async) {
+        azlog::enable_async();
+    }
+
     if (aznfsc_cfg.auth) {
         // Set the auth token callback for this connection if auth is enabled.
         set_auth_token_callback(get_auth_token_and_setargs_cb);
@@ -826,6 +877,18 @@ int main(int argc, char *argv[])
     }
 
     client_started = true;
+
+    /*
+     * Start the metrics server, if configured. Failure is not fatal, we just
+     * run w/o it.
+     */
+    if (aznfsc_cfg.sys.metrics.port > 0 || aznfsc_cfg.sys.metrics.socket) {
+        if (!metrics_server::get_instance().init(aznfsc_cfg.sys.metrics.port,
+                                                 aznfsc_cfg.sys.metrics.socket)) {
+            AZLogWarn("Failed to start metrics server, continuing w/o it");
+        }
+    }
+
     AZLogInfo("==> Aznfsclient fuse driver ready to serve requests!");
     
     // Open the pipe for writing.
@@ -840,6 +903,11 @@ int main(int argc, char *argv[])
         }
     }
 
+    /*
+     * fuse worker threads inherit the affinity of this thread.
+     */
+    cpu_affinity::get_instance().pin_fuse_workers();
+
     if (opts.singlethread) {
         ret = fuse_session_loop(se);
     } else {
@@ -935,8 +1003,11 @@ err_out0:
      * get any more requests from fuse.
      */
     if (client_started) {
+        metrics_server::get_instance().shutdown();
         nfs_client::get_instance().shutdown();
     }
 
+    azlog::shutdown_async();
+
     return ret ? 1 : 0;
 }
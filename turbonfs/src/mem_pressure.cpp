@@ -0,0 +1,306 @@
+#include <unistd.h>
+
+#include <fstream>
+#include <algorithm>
+
+#include "mem_pressure.h"
+#include "file_cache.h"
+#include "membuf_pool.h"
+#include "rpc_stats.h"
+
+namespace aznfsc {
+
+/*
+ * Mount point of the cgroup v2 hierarchy.
+ */
+static const std::string cgroup_root = "/sys/fs/cgroup";
+
+/*
+ * Read a cgroup file with a single number, like memory.current.
+ * "max" (no limit) is returned as UINT64_MAX.
+ */
+static bool read_u64(const std::string& path, uint64_t& val)
+{
+    std::ifstream ifs(path);
+    std::string str;
+
+    if (!ifs.is_open() || !std::getline(ifs, str) || str.empty()) {
+        return false;
+    }
+
+    if (str == "max") {
+        val = UINT64_MAX;
+        return true;
+    }
+
+    char *endp = nullptr;
+    val = ::strtoull(str.c_str(), &endp, 10);
+    return (endp != str.c_str());
+}
+
+/*
+ * Read the value of key from a "key value" formatted file, like
+ * memory.stat.
+ */
+static bool read_keyed_u64(const std::string& path,
+                           const std::string& key,
+                           uint64_t& val)
+{
+    std::ifstream ifs(path);
+    std::string k;
+    uint64_t v;
+
+    while (ifs >> k >> v) {
+        if (k == key) {
+            val = v;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void mem_pressure::init()
+{
+    // Must be called only once.
+    assert(!enabled);
+
+    if (!aznfsc_cfg.cache.data.user.adaptive_size) {
+        return;
+    }
+
+    enabled = true;
+
+    /*
+     * On cgroup v2 we have a single "0::<path>" line, path is relative to
+     * the cgroup root (which with cgroup namespaces, f.e., in a container,
+     * is our own cgroup and the path is "/").
+     */
+    std::ifstream ifs("/proc/self/cgroup");
+    std::string line;
+
+    while (std::getline(ifs, line)) {
+        if (line.compare(0, 3, "0::") == 0) {
+            std::string dir = cgroup_root + line.substr(3);
+            while (dir.size() > cgroup_root.size() && dir.back() == '/') {
+                dir.pop_back();
+            }
+
+            if (::access((dir + "/memory.max").c_str(), R_OK) == 0 ||
+                ::access((dir + "/memory.current").c_str(), R_OK) == 0) {
+                cgroup_dir = dir;
+            }
+            break;
+        }
+    }
+
+    /*
+     * Prefer our cgroup's PSI, it tells how much our cgroup is stalling and
+     * not the whole system.
+     */
+    if (!cgroup_dir.empty() &&
+        ::access((cgroup_dir + "/memory.pressure").c_str(), R_OK) == 0) {
+        psi_file = cgroup_dir + "/memory.pressure";
+    } else if (::access("/proc/pressure/memory", R_OK) == 0) {
+        psi_file = "/proc/pressure/memory";
+    }
+
+    AZLogInfo("[MEMPRESSURE] Adaptive cache size enabled, cgroup: {}, "
+              "psi: {}, max cache: {} MB",
+              cgroup_dir.empty() ? "none" : cgroup_dir,
+              psi_file.empty() ? "none" : psi_file,
+              aznfsc_cfg.cache.data.user.max_size_mb);
+
+    // Start with the budget as per the current memory availability.
+    update(::time(NULL));
+}
+
+bool mem_pressure::read_cgroup_limit(uint64_t& limit, uint64_t& free) const
+{
+    if (cgroup_dir.empty()) {
+        return false;
+    }
+
+    bool found = false;
+    std::string dir = cgroup_dir;
+
+    /*
+     * A pod's limit is usually on the pod's cgroup which is an ancestor of
+     * the container's cgroup, so we need to go up the hierarchy. We use the
+     * cgroup with the least free memory, which need not be the one with the
+     * lowest limit.
+     */
+    while (true) {
+        uint64_t max = UINT64_MAX, high = UINT64_MAX, current;
+
+        read_u64(dir + "/memory.max", max);
+        read_u64(dir + "/memory.high", high);
+
+        const uint64_t lim = std::min(max, high);
+
+        if ((lim != UINT64_MAX) && read_u64(dir + "/memory.current", current)) {
+            /*
+             * Inactive page cache will be reclaimed by the kernel before it
+             * hits the limit, so it's as good as free.
+             */
+            uint64_t inactive_file = 0;
+            read_keyed_u64(dir + "/memory.stat", "inactive_file",
+                           inactive_file);
+
+            const uint64_t used =
+                (current > inactive_file) ? (current - inactive_file) : 0;
+            const uint64_t f = (lim > used) ? (lim - used) : 0;
+
+            if (!found || (f < free)) {
+                limit = lim;
+                free = f;
+                found = true;
+            }
+        }
+
+        const size_t pos = dir.rfind('/');
+        if ((dir.size() <= cgroup_root.size()) ||
+            (pos == std::string::npos) || (pos < cgroup_root.size())) {
+            break;
+        }
+        dir.resize(pos);
+    }
+
+    return found;
+}
+
+/* static */
+bool mem_pressure::read_meminfo(uint64_t& total, uint64_t& avail)
+{
+    std::ifstream ifs("/proc/meminfo");
+    std::string key, unit;
+    uint64_t val;
+    int found = 0;
+
+    while ((found != 3) && (ifs >> key >> val >> unit)) {
+        if (key == "MemTotal:") {
+            total = val * 1024;
+            found |= 1;
+        } else if (key == "MemAvailable:") {
+            avail = val * 1024;
+            found |= 2;
+        }
+    }
+
+    return (found == 3);
+}
+
+/* static */
+double mem_pressure::read_psi(const std::string& path)
+{
+    if (path.empty()) {
+        return -1;
+    }
+
+    std::ifstream ifs(path);
+    std::string line;
+    double avg10;
+
+    /*
+     * First line is
+     * "some avg10=0.00 avg60=0.00 avg300=0.00 total=0".
+     */
+    if (!std::getline(ifs, line) ||
+        ::sscanf(line.c_str(), "some avg10=%lf", &avg10) != 1) {
+        return -1;
+    }
+
+    return avg10;
+}
+
+void mem_pressure::update(time_t now_sec)
+{
+    if (!enabled) {
+        return;
+    }
+
+    time_t last = last_update_sec;
+    if ((now_sec - last) < MEMPRESSURE_UPDATE_SECS) {
+        return;
+    }
+
+    // Only one thread updates.
+    if (!last_update_sec.compare_exchange_strong(last, now_sec)) {
+        return;
+    }
+
+    const uint64_t max_cache =
+        (aznfsc_cfg.cache.data.user.max_size_mb * 1024 * 1024ULL);
+    const uint64_t min_budget =
+        std::min<uint64_t>(MEMPRESSURE_MIN_BUDGET_MB * 1024 * 1024ULL,
+                           max_cache);
+    const uint64_t budget = bytes_chunk_cache::get_cache_budget();
+
+    /*
+     * Memory used by us for the cache, this is part of the used memory
+     * under the limit so it must be added back to what we can have.
+     */
+    const uint64_t ours = bytes_chunk_cache::bytes_allocated_g +
+                          membuf_pool::get_bytes_idle();
+
+    uint64_t limit, free;
+    if (!read_cgroup_limit(limit, free)) {
+        uint64_t total, avail;
+        if (read_meminfo(total, avail)) {
+            limit = total;
+            free = avail;
+        } else {
+            limit = UINT64_MAX;
+            free = 0;
+        }
+    }
+
+    limit_bytes = limit;
+    free_bytes = free;
+
+    uint64_t cap = max_cache;
+    if (limit != UINT64_MAX) {
+        const uint64_t reserve = (limit * MEMPRESSURE_RESERVE_PCT) / 100;
+        const uint64_t avail = ours + free;
+        cap = (avail > reserve) ? (avail - reserve) : 0;
+    }
+
+    const double psi = read_psi(psi_file);
+    psi_some_avg10 = psi;
+
+    /*
+     * Under pressure shrink multiplicatively, which gets us out quickly, and
+     * grow back slowly, w/o pressure (or w/o PSI support) we are limited
+     * only by cap.
+     */
+    uint64_t target = budget;
+    if (psi >= MEMPRESSURE_PSI_HIGH) {
+        target = budget - ((budget * MEMPRESSURE_SHRINK_PCT) / 100);
+    } else if (psi < MEMPRESSURE_PSI_LOW) {
+        target = budget + ((budget * MEMPRESSURE_GROW_PCT) / 100);
+    }
+
+    target = std::min(target, cap);
+    target = std::clamp(target, min_budget, max_cache);
+
+    if (target == budget) {
+        return;
+    }
+
+    bytes_chunk_cache::set_cache_budget(target);
+
+    if (target < budget) {
+        INC_GBL_STATS(cache_budget_shrinks, 1);
+    } else {
+        INC_GBL_STATS(cache_budget_grows, 1);
+    }
+
+    AZLogDebug("[MEMPRESSURE] Cache budget {} MB -> {} MB (used: {} MB, "
+               "limit: {} MB, free: {} MB, psi some avg10: {:0.2f})",
+               budget / (1024 * 1024), target / (1024 * 1024),
+               ours / (1024 * 1024),
+               (limit == UINT64_MAX) ? -1 : (int64_t) (limit / (1024 * 1024)),
+               free / (1024 * 1024), psi);
+}
+
+}
@@ -0,0 +1,857 @@
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#include <fstream>
+
+#include "aznfsc.h"
+#include "membuf_pool.h"
+#include "file_cache.h"
+#include "cpu_affinity.h"
+
+/*
+ * This enables debug logs and also runs the self tests.
+ * Must enable once after making any changes to the size class logic.
+ */
+//#define DEBUG_MEMBUF_POOL
+//#define DEBUG_SPLICE_BENCHMARK
+
+#define HUGEPAGE_SIZE (2 * 1024 * 1024ULL)
+
+namespace aznfsc {
+
+/* static */ std::atomic<uint64_t> membuf_pool::num_tcache_hit_g = 0;
+/* static */ std::atomic<uint64_t> membuf_pool::num_depot_hit_g = 0;
+/* static */ std::atomic<uint64_t> membuf_pool::num_miss_g = 0;
+/* static */ std::atomic<uint64_t> membuf_pool::num_unpooled_g = 0;
+/* static */ std::atomic<uint64_t> membuf_pool::num_free_g = 0;
+/* static */ std::atomic<uint64_t> membuf_pool::num_unmap_g = 0;
+/* static */ std::atomic<uint64_t> membuf_pool::num_hugetlb_g = 0;
+/* static */ std::atomic<uint64_t> membuf_pool::num_hugetlb_fail_g = 0;
+/* static */ std::atomic<uint64_t> membuf_pool::bytes_requested_g = 0;
+/* static */ std::atomic<uint64_t> membuf_pool::bytes_inuse_g = 0;
+/* static */ std::atomic<uint64_t> membuf_pool::bytes_mapped_g = 0;
+/* static */ std::atomic<uint64_t> membuf_pool::bytes_idle_depot_g = 0;
+/* static */ std::atomic<uint64_t> membuf_pool::bytes_idle_tcache_g = 0;
+/* static */ std::atomic<uint64_t> membuf_pool::num_splice_fallback_g = 0;
+/* static */ std::atomic<uint64_t> membuf_pool::num_slabs_g = 0;
+
+/* static */ uint8_t *membuf_pool::splice_region_base = nullptr;
+/* static */ uint64_t membuf_pool::splice_region_size = 0;
+/* static */ int membuf_pool::splice_memfd = -1;
+/* static */ std::atomic<uint64_t> membuf_pool::splice_region_next = 0;
+
+static_assert(AZNFSC_MAX_CHUNK_SIZE == (1024 * PAGE_SIZE),
+              "Update membuf_pool::NUM_CLASSES for the new max chunk size");
+
+/* static */
+int membuf_pool::get_class_idx(uint64_t length)
+{
+    assert(length > 0);
+
+    if (length > AZNFSC_MAX_CHUNK_SIZE) {
+        return -1;
+    }
+
+    const uint64_t pages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    // One class per page count for the first 8 pages.
+    if (pages <= 8) {
+        return pages - 1;
+    }
+
+    /*
+     * 2^e < pages <= 2^(e+1), split the range in 4 equal steps and find
+     * the step that pages falls in.
+     */
+    const int e = 63 - __builtin_clzll(pages - 1);
+    const uint64_t step = (1ULL << (e - 2));
+    const uint64_t q = ((pages - (1ULL << e)) + step - 1) / step;
+
+    assert(e >= 3);
+    assert(q >= 1 && q <= 4);
+
+    const int idx = 8 + (e - 3) * 4 + (q - 1);
+    assert(idx < NUM_CLASSES);
+
+    return idx;
+}
+
+/* static */
+uint64_t membuf_pool::get_class_size(int idx)
+{
+    assert(idx >= 0 && idx < NUM_CLASSES);
+
+    if (idx < 8) {
+        return (idx + 1) * PAGE_SIZE;
+    }
+
+    const int e = ((idx - 8) / 4) + 3;
+    const uint64_t q = ((idx - 8) % 4) + 1;
+    const uint64_t pages = (1ULL << e) + q * (1ULL << (e - 2));
+
+    return pages * PAGE_SIZE;
+}
+
+/* static */
+uint64_t membuf_pool::max_idle_bytes()
+{
+    /*
+     * Allow 1/32nd of the user data cache to be held idle, capped at 512MiB.
+     * Self-tests run before config is parsed, use 256MiB for those.
+     */
+    const int max_size_mb = aznfsc_cfg.cache.data.user.max_size_mb;
+
+    if (max_size_mb <= 0) {
+        return 256 * 1024 * 1024ULL;
+    }
+
+    return std::min((max_size_mb * 1024 * 1024ULL) / 32,
+                    512 * 1024 * 1024ULL);
+}
+
+/* static */
+uint64_t membuf_pool::get_rss_bytes()
+{
+    /*
+     * Second field in /proc/self/statm is the resident set size in pages.
+     */
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size_pages = 0, rss_pages = 0;
+
+    if (!(statm >> size_pages >> rss_pages)) {
+        return 0;
+    }
+
+    return rss_pages * ::sysconf(_SC_PAGESIZE);
+}
+
+/* static */
+bool membuf_pool::init_splice_region(uint64_t size)
+{
+    // Must be called only once.
+    assert(splice_region_base == nullptr);
+    assert(splice_memfd == -1);
+
+    size = ((size + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE) * HUGEPAGE_SIZE;
+    assert(size > 0);
+
+    const int fd = ::memfd_create("aznfsc_membuf", MFD_CLOEXEC);
+    if (fd == -1) {
+        AZLogError("[MEMBUF_POOL] memfd_create() failed: {}", strerror(errno));
+        return false;
+    }
+
+    /*
+     * memfd is sparse, this doesn't allocate any memory, pages are allocated
+     * on first touch and released by MADV_REMOVE.
+     */
+    if (::ftruncate(fd, size) != 0) {
+        AZLogError("[MEMBUF_POOL] ftruncate(memfd, {}) failed: {}",
+                   size, strerror(errno));
+        ::close(fd);
+        return false;
+    }
+
+    void *base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (base == MAP_FAILED) {
+        AZLogError("[MEMBUF_POOL] mmap(memfd, {}) failed: {}",
+                   size, strerror(errno));
+        ::close(fd);
+        return false;
+    }
+
+    // Pages must come from the node local memory, when configured.
+    cpu_affinity::get_instance().bind_memory(base, size);
+
+    splice_memfd = fd;
+    splice_region_size = size;
+    splice_region_next = 0;
+    splice_region_base = (uint8_t *) base;
+
+    AZLogInfo("[MEMBUF_POOL] Created splice region of {} bytes at {}",
+              size, fmt::ptr(base));
+
+    return true;
+}
+
+/* static */
+uint8_t *membuf_pool::splice_map_buffer(int idx)
+{
+    if (!splice_region_base) {
+        return nullptr;
+    }
+
+    const uint64_t size = get_class_size(idx);
+    depot& d = get_depot();
+
+    /*
+     * Reuse a previously released range of the same size class, if any.
+     */
+    {
+        std::unique_lock<std::mutex> lock(d.pool_lock_45);
+
+        if (!d.holes[idx].empty()) {
+            const uint64_t offset = d.holes[idx].back();
+            d.holes[idx].pop_back();
+            assert((offset + size) <= splice_region_size);
+            return splice_region_base + offset;
+        }
+    }
+
+    const uint64_t offset = splice_region_next.fetch_add(size);
+    if ((offset + size) > splice_region_size) {
+        /*
+         * Region full. Leave splice_region_next beyond the region so that
+         * others fail fast too, it's never used to compute offsets after
+         * this.
+         */
+        num_splice_fallback_g++;
+        return nullptr;
+    }
+
+    return splice_region_base + offset;
+}
+
+/* static */
+void membuf_pool::bind_splice_region()
+{
+    if (splice_region_base) {
+        cpu_affinity::get_instance().bind_memory(splice_region_base,
+                                                 splice_region_size);
+    }
+}
+
+/* static */
+uint8_t *membuf_pool::map_slab(slab_type type)
+{
+    static_assert((SLAB_SIZE % AZNFSC_MAX_CHUNK_SIZE) == 0);
+
+    /*
+     * Slabs are only reserved address space, pages are allocated on first
+     * touch of the buffers carved out of them. MAP_HUGETLB slabs are not
+     * MAP_NORESERVE as we want mmap() to fail rather than SIGBUS on first
+     * touch if there aren't enough hugepages reserved.
+     */
+    if (type == SLAB_HUGETLB) {
+        void *slab = ::mmap(nullptr, SLAB_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab == MAP_FAILED) {
+            /*
+             * Most likely no hugepages reserved, fall back to THP.
+             * Don't flood the logs, warn only for the first failure.
+             */
+            if (num_hugetlb_fail_g++ == 0) {
+                AZLogWarn("[MEMBUF_POOL] mmap(MAP_HUGETLB, size={}) failed: "
+                          "{}, falling back to transparent hugepages",
+                          SLAB_SIZE, strerror(errno));
+            }
+            return nullptr;
+        }
+
+        cpu_affinity::get_instance().bind_memory(slab, SLAB_SIZE);
+        num_slabs_g++;
+        return (uint8_t *) slab;
+    }
+
+    /*
+     * Map an extra hugepage worth and trim the ends so that the slab is
+     * hugepage aligned, else THP cannot back the buffers carved from it.
+     */
+    const uint64_t map_size = SLAB_SIZE + HUGEPAGE_SIZE;
+    uint8_t *const map = (uint8_t *)
+        ::mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        AZLogError("[MEMBUF_POOL] mmap(size={}) failed: {}",
+                   map_size, strerror(errno));
+        return nullptr;
+    }
+
+    uint8_t *const slab = (uint8_t *)
+        (((uintptr_t) map + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1));
+    const uint64_t head = slab - map;
+    const uint64_t tail = HUGEPAGE_SIZE - head;
+
+    if (head) {
+        ::munmap(map, head);
+    }
+    if (tail) {
+        ::munmap(slab + SLAB_SIZE, tail);
+    }
+
+    /*
+     * madvise() and mbind() are applied to the whole slab, doing it per
+     * buffer would split the slab into one mapping per buffer again.
+     */
+    if (type == SLAB_THP) {
+        // Failure is not fatal, we will just get normal pages.
+        (void) ::madvise(slab, SLAB_SIZE, MADV_HUGEPAGE);
+    }
+
+    // Must be done before any buffer is touched.
+    cpu_affinity::get_instance().bind_memory(slab, SLAB_SIZE);
+
+    num_slabs_g++;
+    return slab;
+}
+
+/* static */
+uint8_t *membuf_pool::slab_map_buffer(int idx)
+{
+    const uint64_t size = get_class_size(idx);
+    const bool use_hugepages =
+        aznfsc_cfg.cache.data.user.hugepages && (size >= HUGEPAGE_SIZE);
+    depot& d = get_depot();
+
+    std::unique_lock<std::mutex> lock(d.pool_lock_45);
+
+    /*
+     * Reuse a previously released range of the same size class, if any.
+     */
+    if (!d.slab_holes[idx].empty()) {
+        uint8_t *buf = d.slab_holes[idx].back();
+        d.slab_holes[idx].pop_back();
+        return buf;
+    }
+
+    slab_type type = SLAB_NORMAL;
+    if (use_hugepages) {
+        type = ((size % HUGEPAGE_SIZE) == 0) ? SLAB_HUGETLB : SLAB_THP;
+    }
+
+    while (true) {
+        slab_cursor& cursor = d.slabs[type];
+
+        if ((uint64_t) (cursor.end - cursor.next) >= size) {
+            uint8_t *buf = cursor.next;
+            cursor.next += size;
+            if (type == SLAB_HUGETLB) {
+                num_hugetlb_g++;
+            }
+            return buf;
+        }
+
+        /*
+         * Current slab (if any) cannot fit this buffer, start a new one.
+         * The unused tail of the old slab is never touched, so it only
+         * costs address space.
+         * Slab creation is rare enough to be done with pool_lock_45 held.
+         */
+        uint8_t *slab = map_slab(type);
+        if (slab) {
+            cursor.next = slab;
+            cursor.end = slab + SLAB_SIZE;
+            continue;
+        }
+
+        if (type != SLAB_HUGETLB) {
+            return nullptr;
+        }
+        type = SLAB_THP;
+    }
+}
+
+/* static */
+uint8_t *membuf_pool::map_buffer(uint64_t size)
+{
+    assert((size % PAGE_SIZE) == 0);
+
+    /*
+     * Pooled buffers come from the splice region, when enabled, else they
+     * are carved out of anonymous slabs.
+     */
+    const int idx = get_class_idx(size);
+    if ((idx != -1) && (get_class_size(idx) == size)) {
+        uint8_t *buf = splice_map_buffer(idx);
+        if (!buf) {
+            buf = slab_map_buffer(idx);
+        }
+        if (buf) {
+            bytes_mapped_g += size;
+        }
+        return buf;
+    }
+
+    /*
+     * Unpooled buffers are larger than the largest size class, these are
+     * rare and get their own mapping.
+     */
+    const bool use_hugepages = aznfsc_cfg.cache.data.user.hugepages;
+    void *buf = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        AZLogError("[MEMBUF_POOL] mmap(size={}) failed: {}",
+                   size, strerror(errno));
+        return nullptr;
+    }
+
+    if (use_hugepages) {
+        // Failure is not fatal, we will just get normal pages.
+        (void) ::madvise(buf, size, MADV_HUGEPAGE);
+    }
+
+    // Must be done before the buffer is touched.
+    cpu_affinity::get_instance().bind_memory(buf, size);
+
+    bytes_mapped_g += size;
+
+    return (uint8_t *) buf;
+}
+
+/* static */
+void membuf_pool::unmap_buffer(uint8_t *buf, uint64_t size)
+{
+    assert(buf != nullptr);
+    assert(((uint64_t) buf & (PAGE_SIZE - 1)) == 0);
+
+    const int idx = get_class_idx(size);
+    const bool pooled = (idx != -1) && (get_class_size(idx) == size);
+
+    off_t offset;
+    if (get_splice_fd(buf, size, &offset) != -1) {
+        /*
+         * Splice region buffer, free the memory but keep the range for
+         * reuse by the same size class.
+         */
+        assert(pooled);
+
+        if (::madvise(buf, size, MADV_REMOVE) != 0) {
+            AZLogError("[MEMBUF_POOL] madvise(MADV_REMOVE, buf={}, size={}) "
+                       "failed: {}", fmt::ptr(buf), size, strerror(errno));
+        }
+
+        {
+            depot& d = get_depot();
+            std::unique_lock<std::mutex> lock(d.pool_lock_45);
+            d.holes[idx].push_back(offset);
+        }
+    } else if (pooled) {
+        /*
+         * Slab buffer, same as above. Slabs are never unmapped.
+         * MADV_DONTNEED on MAP_HUGETLB ranges needs Linux 5.18+, on older
+         * kernels the hugepages just stay with the range till it's reused.
+         */
+        if ((::madvise(buf, size, MADV_DONTNEED) != 0) &&
+            (errno != EINVAL)) {
+            AZLogError("[MEMBUF_POOL] madvise(MADV_DONTNEED, buf={}, "
+                       "size={}) failed: {}",
+                       fmt::ptr(buf), size, strerror(errno));
+        }
+
+        {
+            depot& d = get_depot();
+            std::unique_lock<std::mutex> lock(d.pool_lock_45);
+            d.slab_holes[idx].push_back(buf);
+        }
+    } else if (::munmap(buf, size) != 0) {
+        AZLogError("[MEMBUF_POOL] munmap(buf={}, size={}) failed: {}",
+                   fmt::ptr(buf), size, strerror(errno));
+        assert(0);
+        return;
+    }
+
+    assert(bytes_mapped_g >= size);
+    bytes_mapped_g -= size;
+    num_unmap_g++;
+}
+
+/* static */
+uint8_t *membuf_pool::alloc(uint64_t length)
+{
+    assert(length > 0);
+
+    const int idx = get_class_idx(length);
+
+    /*
+     * Larger than the largest size class, not pooled.
+     */
+    if (idx == -1) {
+        const uint64_t size = ((length + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
+        uint8_t *buf = map_buffer(size);
+
+        if (buf) {
+            num_unpooled_g++;
+            bytes_requested_g += length;
+            bytes_inuse_g += size;
+        }
+        return buf;
+    }
+
+    const uint64_t size = get_class_size(idx);
+    uint8_t *buf = nullptr;
+
+    /*
+     * Fast path, thread cache.
+     */
+    tcache& tc = get_tcache();
+    if (!tc.bins[idx].empty()) {
+        buf = tc.bins[idx].back();
+        tc.bins[idx].pop_back();
+
+        assert(tc.bytes >= size);
+        tc.bytes -= size;
+        assert(bytes_idle_tcache_g >= size);
+        bytes_idle_tcache_g -= size;
+        num_tcache_hit_g++;
+    }
+
+    /*
+     * Next try the global depot.
+     */
+    if (!buf) {
+        depot& d = get_depot();
+        std::unique_lock<std::mutex> lock(d.pool_lock_45);
+
+        if (!d.bins[idx].empty()) {
+            buf = d.bins[idx].back();
+            d.bins[idx].pop_back();
+
+            assert(bytes_idle_depot_g >= size);
+            bytes_idle_depot_g -= size;
+            num_depot_hit_g++;
+        }
+    }
+
+    /*
+     * Miss, allocate a fresh buffer.
+     */
+    if (!buf) {
+        buf = map_buffer(size);
+        if (!buf) {
+            return nullptr;
+        }
+        num_miss_g++;
+    }
+
+    assert(((uint64_t) buf & (PAGE_SIZE - 1)) == 0);
+
+    bytes_requested_g += length;
+    bytes_inuse_g += size;
+
+    return buf;
+}
+
+/* static */
+void membuf_pool::depot_free(uint8_t *buf, int idx)
+{
+    const uint64_t size = get_class_size(idx);
+    depot& d = get_depot();
+
+    {
+        std::unique_lock<std::mutex> lock(d.pool_lock_45);
+
+        if ((bytes_idle_depot_g + size) <= max_idle_bytes()) {
+            d.bins[idx].push_back(buf);
+            bytes_idle_depot_g += size;
+            return;
+        }
+    }
+
+    // Depot full, release to the OS, outside the lock.
+    unmap_buffer(buf, size);
+}
+
+/* static */
+void membuf_pool::free(uint8_t *buf, uint64_t length)
+{
+    assert(buf != nullptr);
+    assert(length > 0);
+
+    const int idx = get_class_idx(length);
+    const uint64_t size =
+        (idx == -1) ? (((length + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE) :
+                      get_class_size(idx);
+
+    num_free_g++;
+    assert(bytes_requested_g >= length);
+    bytes_requested_g -= length;
+    assert(bytes_inuse_g >= size);
+    bytes_inuse_g -= size;
+
+    if (idx == -1) {
+        unmap_buffer(buf, size);
+        return;
+    }
+
+    tcache& tc = get_tcache();
+    if ((tc.bins[idx].size() < TCACHE_MAX_PER_CLASS) &&
+        ((tc.bytes + size) <= TCACHE_MAX_BYTES)) {
+        tc.bins[idx].push_back(buf);
+        tc.bytes += size;
+        bytes_idle_tcache_g += size;
+        return;
+    }
+
+    depot_free(buf, idx);
+}
+
+/* static */
+uint64_t membuf_pool::trim()
+{
+    std::vector<std::pair<uint8_t *, uint64_t>> tofree;
+    depot& d = get_depot();
+
+    {
+        std::unique_lock<std::mutex> lock(d.pool_lock_45);
+
+        for (int idx = 0; idx < NUM_CLASSES; idx++) {
+            const uint64_t size = get_class_size(idx);
+            for (uint8_t *buf : d.bins[idx]) {
+                tofree.emplace_back(buf, size);
+            }
+            d.bins[idx].clear();
+        }
+    }
+
+    /*
+     * munmap() can be slow for large buffers, don't hold pool_lock_45
+     * across it.
+     */
+    uint64_t bytes_trimmed = 0;
+    for (const auto& [buf, size] : tofree) {
+        assert(bytes_idle_depot_g >= size);
+        bytes_idle_depot_g -= size;
+        unmap_buffer(buf, size);
+        bytes_trimmed += size;
+    }
+
+    if (bytes_trimmed) {
+        AZLogDebug("[MEMBUF_POOL] Trimmed {} buffers, {} bytes",
+                   tofree.size(), bytes_trimmed);
+    }
+
+    return bytes_trimmed;
+}
+
+membuf_pool::tcache::~tcache()
+{
+    for (int idx = 0; idx < NUM_CLASSES; idx++) {
+        const uint64_t size = get_class_size(idx);
+        for (uint8_t *buf : bins[idx]) {
+            assert(bytes_idle_tcache_g >= size);
+            bytes_idle_tcache_g -= size;
+            depot_free(buf, idx);
+        }
+        bins[idx].clear();
+    }
+    bytes = 0;
+}
+
+#ifdef DEBUG_MEMBUF_POOL
+/* static */
+int membuf_pool::unit_test()
+{
+    AZLogInfo("========== [membuf_pool] Starting unit test ==========");
+
+    /*
+     * Size classes must be monotonically increasing, page aligned and
+     * get_class_idx() must map every size to the smallest class that can
+     * hold it.
+     */
+    for (int idx = 0; idx < NUM_CLASSES; idx++) {
+        const uint64_t size = get_class_size(idx);
+        assert((size % PAGE_SIZE) == 0);
+        assert(get_class_idx(size) == idx);
+        assert(get_class_idx(size - 1) == idx ||
+               (idx == 0 && size == PAGE_SIZE));
+        if (idx > 0) {
+            assert(size > get_class_size(idx - 1));
+            assert(get_class_idx(get_class_size(idx - 1) + 1) == idx);
+            /*
+             * Beyond the single page classes, internal fragmentation must
+             * not exceed 25%.
+             */
+            assert(idx < 8 ||
+                   (((size - get_class_size(idx - 1)) * 4) <= size));
+        }
+    }
+    assert(get_class_size(NUM_CLASSES - 1) == AZNFSC_MAX_CHUNK_SIZE);
+    assert(get_class_idx(1) == 0);
+    assert(get_class_idx(AZNFSC_MAX_CHUNK_SIZE) == (NUM_CLASSES - 1));
+    assert(get_class_idx(AZNFSC_MAX_CHUNK_SIZE + 1) == -1);
+
+    /*
+     * Free followed by alloc of the same class must hit the tcache and
+     * return the same buffer.
+     */
+    const uint64_t hits = num_tcache_hit_g;
+    uint8_t *buf1 = alloc(100000);
+    assert(buf1);
+    ::memset(buf1, 0xab, 100000);
+    free(buf1, 100000);
+    uint8_t *buf2 = alloc(get_class_size(get_class_idx(100000)));
+    assert(buf2 == buf1);
+    assert(num_tcache_hit_g == (hits + 1));
+    free(buf2, get_class_size(get_class_idx(100000)));
+
+    /*
+     * Unpooled allocations.
+     */
+    const uint64_t unpooled = num_unpooled_g;
+    buf1 = alloc(AZNFSC_MAX_CHUNK_SIZE * 2 + 1);
+    assert(buf1);
+    assert(num_unpooled_g == (unpooled + 1));
+    free(buf1, AZNFSC_MAX_CHUNK_SIZE * 2 + 1);
+
+    /*
+     * Overflow the tcache, excess must go to the depot and trim() must
+     * release them.
+     */
+    std::vector<uint8_t *> bufs;
+    for (int i = 0; i < TCACHE_MAX_PER_CLASS * 2; i++) {
+        bufs.push_back(alloc(PAGE_SIZE));
+        assert(bufs.back());
+    }
+    for (uint8_t *buf : bufs) {
+        free(buf, PAGE_SIZE);
+    }
+    assert(bytes_idle_depot_g >= (TCACHE_MAX_PER_CLASS * PAGE_SIZE));
+    trim();
+    assert(bytes_idle_depot_g == 0);
+
+    /*
+     * Many pooled buffers must be carved out of a few slabs and not need
+     * one mapping each, and trimmed buffers must be reused.
+     */
+    const uint64_t slabs = num_slabs_g;
+    const int nbufs = (SLAB_SIZE / PAGE_SIZE) * 2;
+    bufs.clear();
+    for (int i = 0; i < nbufs; i++) {
+        bufs.push_back(alloc(PAGE_SIZE));
+        assert(bufs.back());
+    }
+    assert(num_slabs_g <= (slabs + 3));
+    for (uint8_t *buf : bufs) {
+        free(buf, PAGE_SIZE);
+    }
+    trim();
+    for (int i = 0; i < nbufs; i++) {
+        bufs[i] = alloc(PAGE_SIZE);
+        assert(bufs[i]);
+    }
+    assert(num_slabs_g <= (slabs + 3));
+    for (uint8_t *buf : bufs) {
+        free(buf, PAGE_SIZE);
+    }
+    trim();
+
+    AZLogInfo("========== [membuf_pool] Unit test passed ==========");
+
+    return 0;
+}
+
+static int _i = membuf_pool::unit_test();
+#endif
+
+#ifdef DEBUG_SPLICE_BENCHMARK
+/*
+ * CPU time (user+sys) consumed by this process so far, in usecs.
+ */
+static uint64_t get_cpu_usecs()
+{
+    struct rusage ru;
+    [[maybe_unused]] const int ret = ::getrusage(RUSAGE_SELF, &ru);
+    assert(ret == 0);
+
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000'000ULL +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* static */
+int membuf_pool::splice_benchmark()
+{
+    /*
+     * libfuse sends a reply by first moving it into a pipe (copy for memory
+     * buffers, splice for fd buffers) and then splicing the pipe to
+     * /dev/fuse. The second step is the same for both, so we compare just
+     * the first, draining the pipe to /dev/null.
+     */
+    const uint64_t reply_size = 1048576;
+    const uint64_t total_bytes = 16 * 1024 * 1048576ULL;
+    const int niter = total_bytes / reply_size;
+
+    int pfd[2];
+    [[maybe_unused]] int ret = ::pipe(pfd);
+    assert(ret == 0);
+    ret = ::fcntl(pfd[1], F_SETPIPE_SZ, reply_size);
+    assert(ret >= (int) reply_size);
+
+    const int nullfd = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+    assert(nullfd != -1);
+
+    const int memfd = ::memfd_create("splice_benchmark", MFD_CLOEXEC);
+    assert(memfd != -1);
+    ret = ::ftruncate(memfd, reply_size);
+    assert(ret == 0);
+
+    uint8_t *buf = (uint8_t *) ::mmap(nullptr, reply_size,
+                                      PROT_READ | PROT_WRITE, MAP_SHARED,
+                                      memfd, 0);
+    assert(buf != MAP_FAILED);
+    ::memset(buf, 'x', reply_size);
+
+    auto drain = [&]() {
+        uint64_t left = reply_size;
+        while (left) {
+            const ssize_t n = ::splice(pfd[0], nullptr, nullfd, nullptr,
+                                       left, SPLICE_F_MOVE);
+            assert(n > 0);
+            left -= n;
+        }
+    };
+
+    auto report = [&](const char *what, uint64_t usecs, uint64_t cpu_usecs) {
+        AZLogInfo("[{}] {} bytes in {} usecs, {:.2f} GB/s, {:.2f} cpu "
+                  "usecs/MB", what, total_bytes, usecs,
+                  (total_bytes / 1073741824.0) / (usecs / 1000'000.0),
+                  cpu_usecs / (double) (total_bytes / 1048576));
+    };
+
+    AZLogInfo("========== [membuf_pool] Splice benchmark start ==========");
+
+    // Copy: write() the user buffer into the pipe.
+    uint64_t start = get_current_usecs();
+    uint64_t cpu_start = get_cpu_usecs();
+    for (int i = 0; i < niter; i++) {
+        uint64_t off = 0;
+        while (off < reply_size) {
+            const ssize_t n = ::write(pfd[1], buf + off, reply_size - off);
+            assert(n > 0);
+            off += n;
+        }
+        drain();
+    }
+    report("copy", get_current_usecs() - start, get_cpu_usecs() - cpu_start);
+
+    // Splice: splice() the memfd range into the pipe.
+    start = get_current_usecs();
+    cpu_start = get_cpu_usecs();
+    for (int i = 0; i < niter; i++) {
+        loff_t off = 0;
+        while (off < (loff_t) reply_size) {
+            const ssize_t n = ::splice(memfd, &off, pfd[1], nullptr,
+                                       reply_size - off, SPLICE_F_MOVE);
+            assert(n > 0);
+        }
+        drain();
+    }
+    report("splice", get_current_usecs() - start, get_cpu_usecs() - cpu_start);
+
+    ::munmap(buf, reply_size);
+    ::close(memfd);
+    ::close(nullfd);
+    ::close(pfd[0]);
+    ::close(pfd[1]);
+
+    AZLogInfo("========== [membuf_pool] Splice benchmark done ==========");
+
+    return 0;
+}
+
+static int _j = membuf_pool::splice_benchmark();
+#endif
+
+}
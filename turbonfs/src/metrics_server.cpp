@@ -0,0 +1,255 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "aznfsc.h"
+#include "metrics_server.h"
+#include "rpc_stats.h"
+
+namespace aznfsc {
+
+static int listen_on(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    if (::bind(fd, addr, addrlen) != 0) {
+        AZLogError("[METRICS] bind() failed: {}", strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+
+    if (::listen(fd, 16) != 0) {
+        AZLogError("[METRICS] listen() failed: {}", strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool metrics_server::init(int port, const char *socket_path)
+{
+    assert(!running);
+    assert(port >= 0);
+
+    if (port > 0) {
+        const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            AZLogError("[METRICS] socket() failed: {}", strerror(errno));
+        } else {
+            const int one = 1;
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+            /*
+             * Only serve local clients, a scraper agent on the node can
+             * expose these further if needed.
+             */
+            struct sockaddr_in sin = {};
+            sin.sin_family = AF_INET;
+            sin.sin_port = htons(port);
+            sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+            tcp_fd = listen_on(fd, (struct sockaddr *) &sin, sizeof(sin));
+            if (tcp_fd != -1) {
+                AZLogInfo("[METRICS] Serving metrics on 127.0.0.1:{}", port);
+            }
+        }
+    }
+
+    if (socket_path) {
+        const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            AZLogError("[METRICS] socket() failed: {}", strerror(errno));
+        } else {
+            struct sockaddr_un sun = {};
+            sun.sun_family = AF_UNIX;
+            assert(::strlen(socket_path) < sizeof(sun.sun_path));
+            ::strncpy(sun.sun_path, socket_path, sizeof(sun.sun_path) - 1);
+
+            // Remove stale socket left by an earlier instance.
+            ::unlink(socket_path);
+
+            unix_fd = listen_on(fd, (struct sockaddr *) &sun, sizeof(sun));
+            if (unix_fd != -1) {
+                unix_path = socket_path;
+                AZLogInfo("[METRICS] Serving metrics on unix socket {}",
+                          socket_path);
+            }
+        }
+    }
+
+    if (tcp_fd == -1 && unix_fd == -1) {
+        return false;
+    }
+
+    stop_fd = ::eventfd(0, EFD_CLOEXEC);
+    if (stop_fd == -1) {
+        AZLogError("[METRICS] eventfd() failed: {}", strerror(errno));
+        shutdown();
+        return false;
+    }
+
+    running = true;
+    server_thread = std::thread(&metrics_server::server_loop, this);
+
+    return true;
+}
+
+void metrics_server::shutdown()
+{
+    if (running) {
+        const uint64_t one = 1;
+        [[maybe_unused]] const ssize_t ret =
+            ::write(stop_fd, &one, sizeof(one));
+        assert(ret == sizeof(one));
+
+        server_thread.join();
+        running = false;
+    }
+
+    if (tcp_fd != -1) {
+        ::close(tcp_fd);
+        tcp_fd = -1;
+    }
+
+    if (unix_fd != -1) {
+        ::close(unix_fd);
+        ::unlink(unix_path.c_str());
+        unix_fd = -1;
+    }
+
+    if (stop_fd != -1) {
+        ::close(stop_fd);
+        stop_fd = -1;
+    }
+}
+
+void metrics_server::server_loop()
+{
+    AZLogDebug("[METRICS] Server thread started");
+
+    while (true) {
+        struct pollfd pfds[3];
+        int nfds = 0;
+
+        pfds[nfds++] = {stop_fd, POLLIN, 0};
+        if (tcp_fd != -1) {
+            pfds[nfds++] = {tcp_fd, POLLIN, 0};
+        }
+        if (unix_fd != -1) {
+            pfds[nfds++] = {unix_fd, POLLIN, 0};
+        }
+
+        if (::poll(pfds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            AZLogError("[METRICS] poll() failed: {}", strerror(errno));
+            break;
+        }
+
+        if (pfds[0].revents) {
+            break;
+        }
+
+        for (int i = 1; i < nfds; i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            const int fd = ::accept4(pfds[i].fd, nullptr, nullptr,
+                                     SOCK_CLOEXEC);
+            if (fd == -1) {
+                AZLogWarn("[METRICS] accept() failed: {}", strerror(errno));
+                continue;
+            }
+
+            serve(fd);
+            ::close(fd);
+        }
+    }
+
+    AZLogDebug("[METRICS] Server thread exiting");
+}
+
+void metrics_server::serve(int fd)
+{
+    const struct timeval tv = {
+        .tv_sec = METRICS_IO_TIMEOUT_MSECS / 1000,
+        .tv_usec = (METRICS_IO_TIMEOUT_MSECS % 1000) * 1000
+    };
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    /*
+     * Read till we have the request line, we don't care about the headers.
+     */
+    char buf[METRICS_MAX_REQUEST_SIZE];
+    size_t len = 0;
+
+    while (len < sizeof(buf) - 1) {
+        const ssize_t ret = ::recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+        if (ret <= 0) {
+            break;
+        }
+        len += ret;
+        buf[len] = '\0';
+        if (::strstr(buf, "\r\n") || ::strchr(buf, '\n')) {
+            break;
+        }
+    }
+    buf[len] = '\0';
+
+    /*
+     * Request line is "<method> <path> <version>".
+     */
+    std::string method, path;
+    {
+        const char *sp1 = ::strchr(buf, ' ');
+        const char *sp2 = sp1 ? ::strpbrk(sp1 + 1, " \r\n") : nullptr;
+        if (sp1 && sp2) {
+            method.assign(buf, sp1 - buf);
+            path.assign(sp1 + 1, sp2 - sp1 - 1);
+        }
+    }
+
+    std::string status = "200 OK";
+    std::string ctype = "text/plain; version=0.0.4";
+    std::string body;
+
+    if (method != "GET") {
+        status = "405 Method Not Allowed";
+        body = "Only GET is supported\n";
+    } else if (path == "/metrics" || path == "/") {
+        body = rpc_stats_az::get_metrics(false /* json */);
+    } else if (path == "/metrics.json") {
+        ctype = "application/json";
+        body = rpc_stats_az::get_metrics(true /* json */);
+    } else {
+        status = "404 Not Found";
+        body = "Try /metrics or /metrics.json\n";
+    }
+
+    const std::string resp =
+        "HTTP/1.0 " + status + "\r\n" +
+        "Content-Type: " + ctype + "\r\n" +
+        "Content-Length: " + std::to_string(body.size()) + "\r\n" +
+        "Connection: close\r\n\r\n" + body;
+
+    size_t sent = 0;
+    while (sent < resp.size()) {
+        const ssize_t ret = ::send(fd, resp.data() + sent, resp.size() - sent,
+                                   MSG_NOSIGNAL);
+        if (ret <= 0) {
+            AZLogDebug("[METRICS] send() failed: {}", strerror(errno));
+            break;
+        }
+        sent += ret;
+    }
+}
+
+}
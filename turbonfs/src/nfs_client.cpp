@@ -3,6 +3,9 @@
 #include "nfs_internal.h"
 #include "rpc_task.h"
 #include "rpc_readdir.h"
+#include "membuf_pool.h"
+#include "disk_cache.h"
+#include "mem_pressure.h"
 
 /* static */
 std::atomic<double> nfs_client::ra_scale_factor = 1.0;
@@ -76,12 +79,62 @@ bool nfs_client::init()
     // Initialize the RPC task list.
     rpc_task_helper = rpc_task_helper::get_instance(this);
 
+    /*
+     * Load the disk cache, if enabled. Failure to do so is not fatal, we
+     * just run w/o the disk cache.
+     * This must be done before any file is opened.
+     */
+    if (aznfsc_cfg.filecache.enable) {
+        assert(aznfsc_cfg.filecache.cachedir);
+        assert(aznfsc_cfg.filecache.max_size_gb > 0);
+
+        if (!disk_cache::get_instance().init(
+                    aznfsc_cfg.filecache.cachedir,
+                    aznfsc_cfg.filecache.max_size_gb * 1024 * 1024 * 1024ULL)) {
+            AZLogWarn("Failed to init disk cache at {}, continuing w/o it",
+                      aznfsc_cfg.filecache.cachedir);
+        }
+    }
+
+    /*
+     * Find the cgroup memory limit and set the initial cache budget, before
+     * the cache is used.
+     */
+    mem_pressure::get_instance().init();
+
     /*
      * Start the jukebox_runner thread for retrying requests that fail with
      * NFS3ERR_JUKEBOX.
      */
     jukebox_thread = std::thread(&nfs_client::jukebox_runner, this);
 
+    /*
+     * Start the reclaimer thread for freeing inodes forgotten by fuse.
+     */
+    {
+        std::unique_lock<std::mutex> lock(reclaim_lock_49);
+        reclaimer_running = true;
+    }
+    reclaimer_thread = std::thread(&nfs_client::reclaimer, this);
+
+    /*
+     * Start the revalidator thread for async revalidation of inodes.
+     */
+    {
+        std::unique_lock<std::mutex> lock(revalidate_queue_lock_51);
+        revalidator_running = true;
+    }
+    revalidator_thread = std::thread(&nfs_client::revalidator, this);
+
+    /*
+     * Start the evictor thread for background pruning of the data cache.
+     */
+    {
+        std::unique_lock<std::mutex> lock(evictor_lock_54);
+        evictor_running = true;
+    }
+    evictor_thread = std::thread(&nfs_client::evictor, this);
+
     return true;
 }
 
@@ -90,6 +143,46 @@ void nfs_client::shutdown()
     assert(!shutting_down);
     shutting_down = true;
 
+    /*
+     * Stop the evictor first, it holds inode refs while it runs.
+     */
+    {
+        std::unique_lock<std::mutex> lock(evictor_lock_54);
+        evictor_running = false;
+    }
+    evictor_cv.notify_one();
+    evictor_thread.join();
+    AZLogInfo("Stopped evictor!");
+
+    /*
+     * Stop the revalidator after it has revalidated all the queued inodes.
+     * This must be done before stopping the reclaimer as the revalidator
+     * holds inode refs.
+     */
+    {
+        std::unique_lock<std::mutex> lock(revalidate_queue_lock_51);
+        revalidator_running = false;
+    }
+    revalidate_queue_cv.notify_one();
+    revalidator_thread.join();
+    assert(revalidate_queue.empty());
+    AZLogInfo("Stopped revalidator!");
+
+    /*
+     * Stop the reclaimer after it has released all the queued inodes.
+     * This must be done before we go over inode_map below, any forgets
+     * after this are handled inline by queue_reclaim().
+     */
+    {
+        std::unique_lock<std::mutex> lock(reclaim_lock_49);
+        reclaimer_running = false;
+    }
+    reclaim_cv.notify_one();
+    reclaimer_thread.join();
+    assert(reclaim_queue.empty());
+    assert(purge_queue.empty());
+    AZLogInfo("Stopped reclaimer!");
+
     /*
      * Shutdown libnfs RPC transport, so that we don't get any new callbacks
      * after we cleanup our data structures below.
@@ -97,85 +190,98 @@ void nfs_client::shutdown()
     transport.close();
     AZLogInfo("Stopped transport!");
 
-    auto end_delete = inode_map.end();
-    for (auto it = inode_map.begin(), next_it = it; it != end_delete; it = next_it) {
-        ++next_it;
-        struct nfs_inode *inode = it->second;
-        assert(inode->magic == NFS_INODE_MAGIC);
-        const bool unexpected_refs =
-            ((inode->lookupcnt + inode->dircachecnt) == 0);
-
-        if (unexpected_refs) {
-            AZLogError("[BUG] [{}:{}] Inode with 0 ref still present in "
-                       "inode_map at shutdown: lookupcnt={}, "
-                       "dircachecnt={}, forget_expected={}, "
-                       "is_cache_empty={}",
-                       inode->get_filetype_coding(),
-                       inode->get_fuse_ino(),
-                       inode->lookupcnt.load(),
-                       inode->dircachecnt.load(),
-                       inode->forget_expected.load(),
-                       inode->is_cache_empty());
-        } else {
-            AZLogDebug("[{}:{}] Inode still present at shutdown: "
-                       "lookupcnt={}, dircachecnt={}, forget_expected={}, "
-                       "is_cache_empty={}",
-                       inode->get_filetype_coding(),
-                       inode->get_fuse_ino(),
-                       inode->lookupcnt.load(),
-                       inode->dircachecnt.load(),
-                       inode->forget_expected.load(),
-                       inode->is_cache_empty());
-        }
-        /*
-         * Fuse wants to treat an unmount as an implicit forget for
-         * all inodes. Fuse does not gurantee that it will call forget
-         * for each inode, hence we have to implicity forget all inodes.
-         */
-        if (inode->forget_expected) {
-            assert(!inode->is_forgotten());
+    /*
+     * Disk cache IO jobs hold inode refs, complete them before we go over
+     * the inodes below.
+     */
+    disk_cache::get_instance().shutdown();
 
+    /*
+     * No other thread can be accessing inode_map now, so we don't need the
+     * shard locks.
+     */
+    for (struct inode_map_shard& shard : inode_map) {
+        auto end_delete = shard.inodes.end();
+        for (auto it = shard.inodes.begin(), next_it = it;
+             it != end_delete; it = next_it) {
+            ++next_it;
+            struct nfs_inode *inode = it->second;
+            assert(inode->magic == NFS_INODE_MAGIC);
+            const bool unexpected_refs =
+                ((inode->lookupcnt + inode->dircachecnt) == 0);
+
+            if (unexpected_refs) {
+                AZLogError("[BUG] [{}:{}] Inode with 0 ref still present in "
+                           "inode_map at shutdown: lookupcnt={}, "
+                           "dircachecnt={}, forget_expected={}, "
+                           "is_cache_empty={}",
+                           inode->get_filetype_coding(),
+                           inode->get_fuse_ino(),
+                           inode->lookupcnt.load(),
+                           inode->dircachecnt.load(),
+                           inode->forget_expected.load(),
+                           inode->is_cache_empty());
+            } else {
+                AZLogDebug("[{}:{}] Inode still present at shutdown: "
+                           "lookupcnt={}, dircachecnt={}, forget_expected={}, "
+                           "is_cache_empty={}",
+                           inode->get_filetype_coding(),
+                           inode->get_fuse_ino(),
+                           inode->lookupcnt.load(),
+                           inode->dircachecnt.load(),
+                           inode->forget_expected.load(),
+                           inode->is_cache_empty());
+            }
             /*
-             * 'next_it' might get removed as a result of decref() of the
-             * current inode, if 'it' corresponds to a directory inode and
-             * 'next_it' corresponds to a file in that directory and
-             * 'next_it' is present in inode_map only because of the
-             * dircachecnt held by the readdir cache of the current dir.
-             * To prevent next_it from being removed, we hold a lookupcnt
-             * ref on next_inode and then drop that ref after the decref()
-             * call.
+             * Fuse wants to treat an unmount as an implicit forget for
+             * all inodes. Fuse does not gurantee that it will call forget
+             * for each inode, hence we have to implicity forget all inodes.
              */
-            struct nfs_inode *next_inode = nullptr;
-
-            if (next_it != end_delete) {
-                next_inode = next_it->second;
-                assert(next_inode->magic == NFS_INODE_MAGIC);
-                assert((next_inode->lookupcnt +
-                        next_inode->dircachecnt) > 0);
-                next_inode->incref();
-            }
-            inode->decref(inode->forget_expected, true /* from_forget */);
-            if (next_inode) {
+            if (inode->forget_expected) {
+                assert(!inode->is_forgotten());
+
                 /*
-                 * If the following decref() is going to cause next_it to
-                 * be removed, increment it before that.
+                 * 'next_it' might get removed as a result of decref() of the
+                 * current inode, if 'it' corresponds to a directory inode and
+                 * 'next_it' corresponds to a file in that directory and
+                 * 'next_it' is present in inode_map only because of the
+                 * dircachecnt held by the readdir cache of the current dir.
+                 * To prevent next_it from being removed, we hold a lookupcnt
+                 * ref on next_inode and then drop that ref after the decref()
+                 * call.
                  */
-                if (next_inode->lookupcnt == 1 &&
-                    next_inode->dircachecnt == 0) {
-                    ++next_it;
+                struct nfs_inode *next_inode = nullptr;
+
+                if (next_it != end_delete) {
+                    next_inode = next_it->second;
+                    assert(next_inode->magic == NFS_INODE_MAGIC);
+                    assert((next_inode->lookupcnt +
+                            next_inode->dircachecnt) > 0);
+                    next_inode->incref();
+                }
+                inode->decref(inode->forget_expected, true /* from_forget */);
+                if (next_inode) {
+                    /*
+                     * If the following decref() is going to cause next_it to
+                     * be removed, increment it before that.
+                     */
+                    if (next_inode->lookupcnt == 1 &&
+                        next_inode->dircachecnt == 0) {
+                        ++next_it;
+                    }
+                    next_inode->decref();
                 }
-                next_inode->decref();
-            }
 
-            /*
-             * root_fh is not valid anymore, clear it now.
-             * We do not expect forget_expected to be non-zero for root
-             * inode, so we have the assert to confirm.
-             * XXX If the assert hits, just remove it.
-             */
-            if (inode == root_fh) {
-                assert(0);
-                root_fh = nullptr;
+                /*
+                 * root_fh is not valid anymore, clear it now.
+                 * We do not expect forget_expected to be non-zero for root
+                 * inode, so we have the assert to confirm.
+                 * XXX If the assert hits, just remove it.
+                 */
+                if (inode == root_fh) {
+                    assert(0);
+                    root_fh = nullptr;
+                }
             }
         }
     }
@@ -196,29 +302,47 @@ void nfs_client::shutdown()
     /*
      * Now we shouldn't have any left.
      */
-    for (auto it : inode_map) {
-        struct nfs_inode *inode = it.second;
-        AZLogWarn("[BUG] [{}:{}] Inode still present at shutdown: "
-                   "lookupcnt={}, dircachecnt={}, forget_expected={}, "
-                   "is_cache_empty={}",
-                   inode->get_filetype_coding(),
-                   inode->get_fuse_ino(),
-                   inode->lookupcnt.load(),
-                   inode->dircachecnt.load(),
-                   inode->forget_expected.load(),
-                   inode->is_cache_empty());
+    for (const struct inode_map_shard& shard : inode_map) {
+        for (auto it : shard.inodes) {
+            struct nfs_inode *inode = it.second;
+            AZLogWarn("[BUG] [{}:{}] Inode still present at shutdown: "
+                       "lookupcnt={}, dircachecnt={}, forget_expected={}, "
+                       "is_cache_empty={}",
+                       inode->get_filetype_coding(),
+                       inode->get_fuse_ino(),
+                       inode->lookupcnt.load(),
+                       inode->dircachecnt.load(),
+                       inode->forget_expected.load(),
+                       inode->is_cache_empty());
+        }
     }
 
-    assert(inode_map.size() == 0);
+    assert(inode_map_size == 0);
 
+    /*
+     * jukebox_runner checks shutting_down under jukebox_seeds_lock_39, so
+     * taking the lock here ensures it either sees it set or is waiting on
+     * jukebox_cv, and won't miss the wakeup.
+     */
+    {
+        std::unique_lock<std::mutex> lock(jukebox_seeds_lock_39);
+    }
+    jukebox_cv.notify_one();
     jukebox_thread.join();
 }
 
 void nfs_client::periodic_updater()
 {
+    const time_t now_sec = ::time(NULL);
+
+    /*
+     * #0 Resize the cache as per the memory pressure, if enabled.
+     *    Everything below works off the updated cache budget.
+     */
+    mem_pressure::get_instance().update(now_sec);
+
     // Maximum cache size allowed in bytes.
-    static const uint64_t max_cache =
-        (aznfsc_cfg.cache.data.user.max_size_mb * 1024 * 1024ULL);
+    const uint64_t max_cache = bytes_chunk_cache::get_cache_budget();
     assert(max_cache != 0);
 
     /*
@@ -228,7 +352,6 @@ void nfs_client::periodic_updater()
     static std::atomic<uint64_t> last_server_bytes_written;
     static std::atomic<uint64_t> last_server_bytes_read;
     static std::atomic<uint64_t> last_genid;
-    const time_t now_sec = ::time(NULL);
     const int sample_intvl = 5;
 
     assert(GET_GBL_STATS(server_bytes_written) >= last_server_bytes_written);
@@ -276,8 +399,28 @@ void nfs_client::periodic_updater()
      * Note: We use dirty and commit_pending to indicate cache used by writers.
      *       This assumes that cache is released immediately after write or
      *       commit completes, else we will account for write cache as read.
+     *
+     * Note: Buffers held idle by membuf_pool are not accounted in
+     *       bytes_allocated_g but they are real memory, so count them too.
+     *       If that pushes us into memory pressure, release them first.
+     */
+    uint64_t pool_idle = membuf_pool::get_bytes_idle();
+    if ((bytes_chunk_cache::bytes_allocated_g + pool_idle) >
+        ((max_cache * 9) / 10)) {
+        membuf_pool::trim();
+        pool_idle = membuf_pool::get_bytes_idle();
+    }
+
+    /*
+     * Let the evictor prune in the background before we get to the inline
+     * prune limits.
      */
-    const uint64_t cache = bytes_chunk_cache::bytes_allocated_g;
+    if (bytes_chunk_cache::get_global_prune_goal() > 0) {
+        wake_evictor();
+    }
+
+    const uint64_t cache =
+        std::min(bytes_chunk_cache::bytes_allocated_g + pool_idle, max_cache);
     const uint64_t wcache = bytes_chunk_cache::bytes_dirty_g +
                             bytes_chunk_cache::bytes_commit_pending_g;
     const uint64_t rcache = (uint64_t) std::max((int64_t)(cache - wcache), 0L);
@@ -409,61 +552,97 @@ void nfs_client::periodic_updater()
     }
 }
 
+/* static */ thread_local uint32_t nfs_client::jukebox_reissue_retries = 0;
+
 void nfs_client::jukebox_runner()
 {
     AZLogDebug("Started jukebox_runner");
 
-    do {
-        int jukebox_requests;
-
-        {
-            std::unique_lock<std::mutex> lock(jukebox_seeds_lock_39);
-            jukebox_requests = jukebox_seeds.size();
-        }
-
+    while (true) {
         /*
-         * If no jukebox queued, wait more else wait less in order to meet the
-         * 5 sec jukebox deadline.
+         * Seeds due now, we issue these after releasing jukebox_seeds_lock_39.
          */
-        if (jukebox_requests == 0) {
-            ::sleep(5);
-        } else {
-            ::sleep(1);
-        }
+        std::vector<jukebox_seedinfo *> jsv;
 
         {
             std::unique_lock<std::mutex> lock(jukebox_seeds_lock_39);
-            jukebox_requests = jukebox_seeds.size();
-            if (jukebox_requests == 0) {
-                continue;
-            }
-        }
-
-        AZLogDebug("jukebox_runner woken up ({} requests in queue)",
-                   jukebox_requests);
 
-        /*
-         * Go over all queued requests and issue those which are ready to be
-         * issued, i.e., they have been queued for more than JUKEBOX_DELAY_SECS
-         * seconds. We issue the requests after releasing jukebox_seeds_lock_39.
-         */
-        std::vector<jukebox_seedinfo *> jsv;
-        {
-            std::unique_lock<std::mutex> lock(jukebox_seeds_lock_39);
-            while (!jukebox_seeds.empty()) {
-                struct jukebox_seedinfo *js = jukebox_seeds.front();
+            /*
+             * Sleep till the earliest seed is due. jukebox_retry() wakes us
+             * up if it queues a seed, which may be due earlier, and shutdown()
+             * wakes us up to exit.
+             */
+            while (!shutting_down) {
+                if (jukebox_seeds.empty()) {
+                    jukebox_cv.wait(lock);
+                    continue;
+                }
 
-                if (js->run_at_msecs > get_current_msecs()) {
+                const int64_t wait_msecs =
+                    jukebox_seeds.top()->run_at_msecs - get_current_msecs();
+                if (wait_msecs <= 0) {
                     break;
                 }
 
+                jukebox_cv.wait_for(lock, std::chrono::milliseconds(wait_msecs));
+            }
+
+            if (shutting_down) {
+                break;
+            }
+
+            AZLogDebug("jukebox_runner woken up ({} requests in queue)",
+                       jukebox_seeds.size());
+
+            /*
+             * Pick all due seeds, charging each to the retry budget of the
+             * connection it failed on. Seeds whose connection has exhausted
+             * its budget are deferred, spread evenly (with jitter) over the
+             * time the budget needs to refill, so that they trickle in
+             * instead of all being retried together once the budget refills.
+             */
+            const int64_t now_msecs = get_current_msecs();
+            const int64_t token_msecs =
+                std::max<int64_t>(1000 / JUKEBOX_CONN_RETRIES_PER_SEC, 1);
+            std::unordered_map<struct conn_stats *, int64_t> ndeferred;
+            std::vector<jukebox_seedinfo *> deferred;
+
+            while (!jukebox_seeds.empty() &&
+                   jukebox_seeds.top()->run_at_msecs <= now_msecs) {
+                struct jukebox_seedinfo *js = jukebox_seeds.top();
                 jukebox_seeds.pop();
 
+                if (js->cstats &&
+                    !js->cstats->consume_jukebox_token(
+                        now_msecs, JUKEBOX_CONN_RETRIES_PER_SEC)) {
+                    const int64_t n = ++ndeferred[js->cstats];
+                    js->run_at_msecs = now_msecs + (n * token_msecs) +
+                                       random_number(0, token_msecs);
+                    deferred.push_back(js);
+                    INC_GBL_STATS(jukebox_deferred, 1);
+                    continue;
+                }
+
                 jsv.push_back(js);
             }
+
+            for (struct jukebox_seedinfo *js : deferred) {
+                jukebox_seeds.push(js);
+            }
+
+            DEC_GBL_STATS(jukebox_queued, jsv.size());
         }
 
         for (struct jukebox_seedinfo *js : jsv) {
+            rpc_stats_az::on_jukebox_reissue(
+                    std::max<int64_t>(get_current_msecs() - js->queued_msecs, 0));
+
+            /*
+             * Let alloc_rpc_task() know how many times this request has
+             * been retried, see jukebox_reissue_retries.
+             */
+            jukebox_reissue_retries = js->rpc_api->num_jukebox_retries;
+
             switch (js->rpc_api->optype) {
                 case FUSE_LOOKUP:
                     AZLogWarn("[JUKEBOX REISSUE] LOOKUP(req={}, "
@@ -674,9 +853,12 @@ void nfs_client::jukebox_runner()
                     break;
             }
 
+            jukebox_reissue_retries = 0;
             delete js;
         }
-    } while (!shutting_down);
+    }
+
+    AZLogDebug("Exiting jukebox_runner");
 }
 
 struct nfs_inode *nfs_client::__inode_from_inode_map(const nfs_fh3 *fh,
@@ -698,15 +880,16 @@ struct nfs_inode *nfs_client::__inode_from_inode_map(const nfs_fh3 *fh,
         (fattr->type == NF3DIR) ? S_IFDIR :
          ((fattr->type == NF3LNK) ? S_IFLNK : S_IFREG);
 
+    struct inode_map_shard& shard = get_inode_map_shard(fattr->fileid);
     std::shared_mutex dummy_lock;
     std::shared_lock<std::shared_mutex> lock(
-            acquire_lock ? inode_map_lock_0 : dummy_lock);
+            acquire_lock ? shard.inode_map_lock_0 : dummy_lock);
 
     /*
      * Search by fileid in the multimap. Since fileid is not guaranteed to be
      * unique, we need to check for FH match in the matched inode(s) list.
      */
-    const auto range = inode_map.equal_range(fattr->fileid);
+    const auto range = shard.inodes.equal_range(fattr->fileid);
 
     for (auto i = range.first; i != range.second; ++i) {
         struct nfs_inode *inode = i->second;
@@ -866,288 +1049,1203 @@ struct nfs_inode *nfs_client::__get_nfs_inode(LOC_PARAMS
         new nfs_inode(fh, fattr, this, file_type,
                       is_root_inode ? FUSE_ROOT_ID : 0);
 
-    {
-        std::unique_lock<std::shared_mutex> lock(inode_map_lock_0);
+    {
+        struct inode_map_shard& shard = get_inode_map_shard(fattr->fileid);
+        std::unique_lock<std::shared_mutex> lock(shard.inode_map_lock_0);
+
+        /*
+         * With the exclusive lock held, check once more if some other thread
+         * added this inode before we could get the lock. If so, then delete
+         * the inode created above, grab a refcnt on the inode created by the
+         * other thread and return that.
+         */
+
+        struct nfs_inode *inode =
+            __inode_from_inode_map(fh, fattr, false /* acquire_lock */);
+
+        AZLogDebug(LOC_FMT
+                   "[{}:{} / 0x{:08x}] Allocated new inode (map size: {})",
+                   LOC_ARGS
+                   new_inode->get_filetype_coding(),
+                   new_inode->get_fuse_ino(), new_inode->get_crc(),
+                   inode_map_size.load());
+
+        if (inode) {
+            AZLogWarn(LOC_FMT
+                      "[{}] Another thread added inode {}, deleting ours",
+                      LOC_ARGS
+                      new_inode->get_fuse_ino(),
+                      inode->get_fuse_ino());
+
+            /*
+             * If fattr is newer, update inode attr.
+             */
+            std::unique_lock<std::shared_mutex> lock1(inode->ilock_1);
+
+            const bool fattr_is_newer =
+                (compare_timespec_and_nfstime(inode->get_attr_nolock().st_ctim,
+                                              fattr->ctime) == -1);
+            if (fattr_is_newer) {
+                AZLogWarn(LOC_FMT
+                        "[{}:{} / 0x{:08x}] Updating inode attr, "
+                        "size {} -> {}, "
+                        "ctime {}.{} -> {}.{}, "
+                        "mtime {}.{} -> {}.{}",
+                        LOC_ARGS
+                        inode->get_filetype_coding(),
+                        inode->get_fuse_ino(),
+                        inode->get_crc(),
+                        inode->get_attr_nolock().st_size, fattr->size,
+                        inode->get_attr_nolock().st_ctim.tv_sec,
+                        inode->get_attr_nolock().st_ctim.tv_nsec,
+                        fattr->ctime.seconds,
+                        fattr->ctime.nseconds,
+                        inode->get_attr_nolock().st_mtim.tv_sec,
+                        inode->get_attr_nolock().st_mtim.tv_nsec,
+                        fattr->mtime.seconds,
+                        fattr->mtime.nseconds);
+
+                nfs_client::stat_from_fattr3(inode->get_attr_nolock(), *fattr);
+
+                inode->attr_timeout_secs = inode->get_actimeo_min();
+                inode->attr_timeout_timestamp =
+                    get_current_msecs() + inode->attr_timeout_secs*1000;
+            }
+
+            delete new_inode;
+
+            return inode;
+        }
+
+        /*
+         * Common case.
+         * Bump lookupcnt ref on the newly allocated inode, add it to the
+         * map and return.
+         */
+#ifdef ENABLE_PARANOID
+        min_ino = std::min(min_ino.load(), (fuse_ino_t) new_inode);
+        max_ino = std::max(max_ino.load(), (fuse_ino_t) new_inode);
+#endif
+
+        new_inode->incref();
+
+        // Ok, insert the newly allocated inode in the global map.
+        shard.inodes.insert({fattr->fileid, new_inode});
+        inode_map_size++;
+    }
+
+    return new_inode;
+}
+
+void nfs_client::get_inode_stats(uint64_t& total_inodes,
+                                 uint64_t& num_files,
+                                 uint64_t& num_dirs,
+                                 uint64_t& num_symlinks,
+                                 uint64_t& open_files,
+                                 uint64_t& open_dirs,
+                                 uint64_t& num_files_cache_empty,
+                                 uint64_t& num_dirs_cache_empty,
+                                 uint64_t& num_forgotten,
+                                 uint64_t& expecting_forget,
+                                 uint64_t& num_dircached,
+                                 uint64_t& num_silly_renamed) const
+{
+    total_inodes = 0;
+    num_files = 0;
+    num_dirs = 0;
+    num_symlinks = 0;
+    open_files = 0;
+    open_dirs = 0;
+    num_files_cache_empty = 0;
+    num_dirs_cache_empty = 0;
+    num_forgotten = 0;
+    expecting_forget = 0;
+    num_dircached = 0;
+    num_silly_renamed = 0;
+
+    /*
+     * Go over all inodes in inode_map, one shard at a time, so that we don't
+     * block inode creation/deletion for all inodes while we go over what
+     * can be millions of inodes.
+     */
+    for (const struct inode_map_shard& shard : inode_map) {
+        std::shared_lock<std::shared_mutex> _lock(shard.inode_map_lock_0);
+        for (auto it = shard.inodes.cbegin(); it != shard.inodes.cend(); ++it) {
+            const struct nfs_inode *inode = it->second;
+            assert(inode->magic == NFS_INODE_MAGIC);
+
+            total_inodes++;
+
+            switch (inode->file_type) {
+                case S_IFREG:
+                    num_files++;
+                    if (inode->is_open()) {
+                        open_files++;
+                    }
+                    if (inode->is_cache_empty()) {
+                        num_files_cache_empty++;
+                    }
+                    break;
+                case S_IFDIR:
+                    num_dirs++;
+                    if (inode->is_open()) {
+                        open_dirs++;
+                    }
+                    if (inode->is_cache_empty()) {
+                        num_dirs_cache_empty++;
+                    }
+                    break;
+                case S_IFLNK:
+                    num_symlinks++;
+                    break;
+            }
+
+            // This inode is cached in one or more readdir caches?
+            if (inode->is_dircached()) {
+                num_dircached++;
+            }
+
+            // Fuse has called forget for this inode?
+            if (inode->is_forgotten()) {
+                assert(!inode->forget_expected);
+                num_forgotten++;
+            }
+
+            // Do we expect a forget from fuse for this inode?
+            if (inode->forget_expected > 0) {
+                assert(!inode->is_forgotten());
+                expecting_forget++;
+            }
+
+            // Is this inode silly-renamed?
+            if (inode->is_silly_renamed) {
+                num_silly_renamed++;
+            }
+        }
+    }
+
+    /*
+     * Let's perform some sanity checks.
+     */
+    assert(total_inodes == (num_files + num_dirs + num_symlinks));
+}
+
+// Caller must hold inode_map_lock_0 of the inode's inode_map shard.
+void nfs_client::put_nfs_inode_nolock(struct nfs_inode *inode,
+                                      size_t dropcnt)
+{
+    AZLogDebug("[{}] put_nfs_inode_nolock(dropcnt={}) called, lookupcnt={}, "
+               "dircachecnt={}, forget_expected={}",
+               inode->get_fuse_ino(), dropcnt, inode->lookupcnt.load(),
+               inode->dircachecnt.load(), inode->forget_expected.load());
+
+    assert(inode->magic == NFS_INODE_MAGIC);
+    assert(inode->lookupcnt >= dropcnt);
+
+    /*
+     * We have to reduce the lookupcnt by dropcnt regardless of whether we
+     * free the inode or not. After dropping the lookupcnt if it becomes 0
+     * then we proceed to perform the other checks for deciding whether the
+     * inode can be safely removed from inode_map and freed.
+     */
+    inode->lookupcnt -= dropcnt;
+
+    /*
+     * If this inode is referenced by some directory_entry then we cannot free
+     * it. We will attempt to free it later when the parent directory is purged
+     * and the inode loses its last dircachecnt reference.
+     *
+     * Note: It's important to first check dircachecnt before lookupcnt, as
+     *       users who want to protect nfs_inode using dircachecnt, acquire
+     *       dircachecnt before lookupcnt.
+     *       Ref readdirectory_cache::dnlc_lookup().
+     */
+    if (inode->dircachecnt > 0) {
+        AZLogVerbose("[{}] Inode is cached by readdir ({})",
+                     inode->get_fuse_ino(), inode->dircachecnt.load());
+        return;
+    }
+
+    /*
+     * Caller should call us only for forgotten inodes but it's possible that
+     * after we held inode_map_lock_0 some other thread got a reference on
+     * this inode.
+     */
+    if (inode->lookupcnt > 0) {
+        AZLogWarn("[{}] Inode no longer forgotten: lookupcnt={}",
+                  inode->get_fuse_ino(), inode->lookupcnt.load());
+        return;
+    }
+
+    /*
+     * This inode is going to be freed, either we never conveyed the inode
+     * to fuse (we couldn't fit the directory entry in readdirplus buffer
+     * or we failed to call fuse_reply_entry(), fuse_reply_create() or
+     * fuse_reply_buf()), or fuse called forget for the inode.
+     */
+    assert(!inode->forget_expected);
+
+    /*
+     * Directory inodes cannot be deleted while the directory cache is not
+     * purged. Note that we purge directory cache from decref() when the
+     * refcnt reaches 0, i.e., fuse is no longer referencing the directory.
+     * So, a non-zero directory cache count means that some other thread
+     * started enumerating the directory before we could delete the directory
+     * inode. Fuse will call FORGET on the directory and then we can free this
+     * inode.
+     * XXX This should not happen as for enumerating a directory fuse would
+     *     have open()ed the directory and must have a lookupcnt ref on the
+     *     directory inode.
+     */
+    if (inode->is_dir() && !inode->is_cache_empty()) {
+        AZLogWarn("[{}] Inode still has {} entries in dircache, skipping",
+                  inode->get_fuse_ino(),
+                  inode->get_dircache()->get_num_entries());
+        assert(0);
+        return;
+    }
+
+    /*
+     * Ok, inode is not referenced by fuse VFS and it's not referenced by
+     * any readdir cache, let's remove it from the inode_map. Once removed
+     * from inode_map, any subsequent get_nfs_inode() calls for this file
+     * (fh and fileid) will allocate a new nfs_inode, which will most likely
+     * result in a new fuse inode number.
+     */
+    struct inode_map_shard& shard = get_inode_map_shard(inode->get_fileid());
+    auto range = shard.inodes.equal_range(inode->get_fileid());
+
+    for (auto i = range.first; i != range.second; ++i) {
+        assert(i->first == inode->get_fileid());
+        assert(i->second->magic == NFS_INODE_MAGIC);
+
+        if (i->second == inode) {
+            assert(inode_map_size > 0);
+            AZLogDebug("[{}:{}] Deleting inode (inode_map size: {})",
+                       inode->get_filetype_coding(),
+                       inode->get_fuse_ino(),
+                       inode_map_size - 1);
+            shard.inodes.erase(i);
+            inode_map_size--;
+            delete inode;
+            return;
+        }
+    }
+
+    // We must find the inode in inode_map.
+    assert(0);
+}
+
+void nfs_client::put_nfs_inodes(
+        std::vector<std::pair<struct nfs_inode*, size_t>>& batch)
+{
+    if (batch.empty()) {
+        return;
+    }
+
+    AZLogDebug("put_nfs_inodes() called for {} inodes", batch.size());
+
+    /*
+     * Purge caches of inodes which are going to be freed. This is done w/o
+     * holding any inode_map lock as purging a directory cache drops the
+     * dircachecnt refs of its entries' inodes, which needs to lock their
+     * inode_map shards. See nfs_inode::decref() for why we purge here.
+     * It's possible that some other thread gets a fresh ref on the inode
+     * after we purged its cache, that's fine, the cache will be populated
+     * again, and put_nfs_inode_nolock() will not free the inode.
+     */
+    for (const auto& [inode, cnt] : batch) {
+        assert(inode->magic == NFS_INODE_MAGIC);
+        assert(cnt > 0);
+        assert(inode->lookupcnt >= cnt);
+
+        if (inode->lookupcnt == cnt) {
+            AZLogDebug("[{}:{}] lookupcnt dropping by {}, to 0, "
+                       "forgetting inode",
+                       inode->get_filetype_coding(), inode->get_fuse_ino(), cnt);
+            inode->invalidate_cache(true /* purge_now */, true /* shutdown */);
+        } else {
+            AZLogWarn("[{}:{}] lookupcnt dropping by {}, to {} "
+                      "(some other thread got a fresh ref)",
+                      inode->get_filetype_coding(), inode->get_fuse_ino(),
+                      cnt, inode->lookupcnt - cnt);
+        }
+    }
+
+    /*
+     * Group inodes by their inode_map shard so that we take every shard lock
+     * only once for the entire batch.
+     */
+    std::sort(batch.begin(), batch.end(),
+              [this](const auto& a, const auto& b) {
+                  return &get_inode_map_shard(a.first->get_fileid()) <
+                         &get_inode_map_shard(b.first->get_fileid());
+              });
+
+    size_t i = 0;
+    while (i < batch.size()) {
+        struct inode_map_shard& shard =
+            get_inode_map_shard(batch[i].first->get_fileid());
+        std::unique_lock<std::shared_mutex> lock(shard.inode_map_lock_0);
+
+        /*
+         * Note: put_nfs_inode_nolock() can free the inode, so we must not
+         *       access it after that.
+         */
+        do {
+            put_nfs_inode_nolock(batch[i].first, batch[i].second);
+            i++;
+        } while (i < batch.size() &&
+                 &get_inode_map_shard(batch[i].first->get_fileid()) == &shard);
+    }
+
+    batch.clear();
+}
+
+void nfs_client::queue_reclaim(struct nfs_inode *inode, size_t cnt)
+{
+    assert(inode->magic == NFS_INODE_MAGIC);
+    assert(cnt > 0);
+    assert(inode->lookupcnt >= cnt);
+
+    {
+        std::unique_lock<std::mutex> lock(reclaim_lock_49);
+        if (reclaimer_running) {
+            reclaim_queue.emplace_back(inode, cnt);
+            lock.unlock();
+            reclaim_cv.notify_one();
+            return;
+        }
+    }
+
+    std::vector<std::pair<struct nfs_inode*, size_t>> batch{{inode, cnt}};
+    put_nfs_inodes(batch);
+}
+
+void nfs_client::queue_reclaim(
+        std::vector<std::pair<struct nfs_inode*, size_t>>& batch)
+{
+    if (batch.empty()) {
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(reclaim_lock_49);
+        if (reclaimer_running) {
+            if (reclaim_queue.empty()) {
+                reclaim_queue.swap(batch);
+            } else {
+                reclaim_queue.insert(reclaim_queue.end(),
+                                     batch.begin(), batch.end());
+                batch.clear();
+            }
+            lock.unlock();
+            reclaim_cv.notify_one();
+            return;
+        }
+    }
+
+    put_nfs_inodes(batch);
+}
+
+bool nfs_client::queue_purge(struct nfs_inode *inode)
+{
+    assert(inode->magic == NFS_INODE_MAGIC);
+
+    std::unique_lock<std::mutex> lock(reclaim_lock_49);
+    if (!reclaimer_running) {
+        return false;
+    }
+
+    // Dropped by purge_retired() once all retired chunks/entries are freed.
+    inode->incref();
+    purge_queue.emplace_back(inode);
+    lock.unlock();
+    reclaim_cv.notify_one();
+
+    return true;
+}
+
+void nfs_client::purge_retired(std::vector<struct nfs_inode*>& batch)
+{
+    std::vector<struct nfs_inode*> requeue;
+
+    for (struct nfs_inode *inode : batch) {
+        assert(inode->magic == NFS_INODE_MAGIC);
+        assert(inode->lookupcnt > 0);
+
+        uint64_t remaining;
+
+        if (inode->is_dir()) {
+            assert(inode->has_dircache());
+            remaining =
+                inode->get_dircache()->reclaim_retired(RECLAIM_PURGE_BATCH);
+        } else {
+            assert(inode->has_filecache());
+            remaining =
+                inode->get_filecache()->reclaim_retired(RECLAIM_PURGE_BATCH);
+        }
+
+        if (remaining > 0) {
+            // Keep the ref, we will continue in the next round.
+            requeue.emplace_back(inode);
+        } else {
+            inode->decref();
+        }
+    }
+
+    batch.clear();
+
+    if (!requeue.empty()) {
+        std::unique_lock<std::mutex> lock(reclaim_lock_49);
+        purge_queue.insert(purge_queue.end(), requeue.begin(), requeue.end());
+    }
+}
+
+void nfs_client::reclaimer()
+{
+    std::vector<std::pair<struct nfs_inode*, size_t>> batch;
+    std::vector<struct nfs_inode*> purge_batch;
+
+    AZLogInfo("Reclaimer thread started");
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(reclaim_lock_49);
+            reclaim_cv.wait(lock, [this] {
+                return !reclaim_queue.empty() || !purge_queue.empty() ||
+                       !reclaimer_running;
+            });
+
+            /*
+             * On shutdown we exit only after releasing all queued inodes.
+             */
+            if (reclaim_queue.empty() && purge_queue.empty()) {
+                assert(!reclaimer_running);
+                break;
+            }
+
+            /*
+             * Grab everything queued so far. While we release this batch,
+             * forgets arriving meanwhile collect into the next batch.
+             */
+            assert(batch.empty());
+            batch.swap(reclaim_queue);
+            assert(purge_batch.empty());
+            purge_batch.swap(purge_queue);
+        }
+
+        put_nfs_inodes(batch);
+
+        /*
+         * Caches with more retired chunks/entries than one batch are added
+         * back to purge_queue.
+         */
+        purge_retired(purge_batch);
+    }
+
+    AZLogInfo("Reclaimer thread exiting");
+}
+
+bool nfs_client::queue_revalidate(struct nfs_inode *inode)
+{
+    assert(inode->magic == NFS_INODE_MAGIC);
+
+    std::unique_lock<std::mutex> lock(revalidate_queue_lock_51);
+    if (!revalidator_running) {
+        return false;
+    }
+
+    /*
+     * Already queued, caller will be woken up when the queued revalidation
+     * completes.
+     */
+    if (inode->revalidate_queued.exchange(true)) {
+        INC_GBL_STATS(revalidate_coalesced, 1);
+        return true;
+    }
+
+    // Dropped by revalidate_batch() once revalidated.
+    inode->incref();
+    revalidate_queue.emplace_back(inode);
+    lock.unlock();
+    revalidate_queue_cv.notify_one();
+
+    return true;
+}
+
+void nfs_client::wake_evictor()
+{
+    if (!evict_requested.exchange(true)) {
+        evictor_cv.notify_one();
+    }
+}
+
+void nfs_client::evictor()
+{
+    AZLogInfo("Evictor thread started");
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(evictor_lock_54);
+            evictor_cv.wait_for(
+                lock, std::chrono::milliseconds(EVICTOR_INTERVAL_MSECS),
+                [this] { return evict_requested || !evictor_running; });
+
+            if (!evictor_running) {
+                break;
+            }
+        }
+
+        evict_requested = false;
+        evict_from_all_caches();
+    }
+
+    AZLogInfo("Evictor thread exiting");
+}
+
+void nfs_client::evict_from_all_caches()
+{
+    uint64_t goal = bytes_chunk_cache::get_global_prune_goal();
+
+    if (goal == 0) {
+        return;
+    }
+
+    INC_GBL_STATS(evictor_runs, 1);
+
+    /*
+     * Collect all files with a cache, holding a lookupcnt ref so that they
+     * are not freed while we evict from their caches. Don't hold the
+     * inode_map lock while evicting, that blocks inode creation/deletion.
+     */
+    std::vector<struct nfs_inode*> inodes;
+
+    for (const struct inode_map_shard& shard : inode_map) {
+        std::shared_lock<std::shared_mutex> _lock(shard.inode_map_lock_0);
+        for (const auto& it : shard.inodes) {
+            struct nfs_inode *inode = it.second;
+            assert(inode->magic == NFS_INODE_MAGIC);
+
+            if (inode->is_regfile() && !inode->is_forgotten() &&
+                inode->has_filecache()) {
+                inode->incref();
+                inodes.emplace_back(inode);
+            }
+        }
+    }
+
+    uint64_t cold_bytes = 0;
+    uint64_t hot_bytes = 0;
+
+    /*
+     * Round 0 evicts the membufs that were never re-read, from all files.
+     * Every following round first ages the hot membufs by one sweep and then
+     * evicts the ones which became cold, so a membuf needs to be re-read
+     * since the last sweep to survive.
+     */
+    for (int round = 0; round <= MB_CLOCK_REF_MAX; round++) {
+        uint64_t cooled = 0;
+
+        if (round > 0) {
+            for (struct nfs_inode *inode : inodes) {
+                cooled += inode->get_filecache()->age_hot();
+            }
+
+            // Nothing more to evict.
+            if (cooled == 0) {
+                break;
+            }
+        }
+
+        for (struct nfs_inode *inode : inodes) {
+            // May overshoot the goal by at most one membuf.
+            const uint64_t evicted =
+                inode->get_filecache()->evict_cold(goal);
+
+            if (round == 0) {
+                cold_bytes += evicted;
+            } else {
+                hot_bytes += evicted;
+            }
+
+            goal -= std::min(goal, evicted);
+            if (goal == 0) {
+                break;
+            }
+        }
+
+        if (goal == 0) {
+            break;
+        }
+    }
+
+    for (struct nfs_inode *inode : inodes) {
+        inode->decref();
+    }
+
+    INC_GBL_STATS(bytes_evicted_cold, cold_bytes);
+    INC_GBL_STATS(bytes_evicted_hot, hot_bytes);
+
+    AZLogDebug("[EVICTOR] Evicted {} cold and {} hot bytes from {} files, "
+               "{} bytes short of goal",
+               cold_bytes, hot_bytes, inodes.size(), goal);
+}
+
+bool nfs_client::singleflight_join(struct rpc_task *task,
+                                   const std::string& key)
+{
+    assert(task->magic == RPC_TASK_MAGIC);
+
+    std::unique_lock<std::mutex> lock(singleflight_lock_52);
+    const auto [it, inserted] = singleflight_map.try_emplace(key);
+
+    if (inserted) {
+        return false;
+    }
+
+    it->second.emplace_back(task);
+    return true;
+}
+
+std::vector<struct rpc_task*> nfs_client::singleflight_done(
+        const std::string& key)
+{
+    std::vector<struct rpc_task*> waiters;
+
+    std::unique_lock<std::mutex> lock(singleflight_lock_52);
+    const auto it = singleflight_map.find(key);
+
+    /*
+     * Leader must have added the entry before issuing the RPC.
+     */
+    assert(it != singleflight_map.end());
+    if (it != singleflight_map.end()) {
+        waiters.swap(it->second);
+        singleflight_map.erase(it);
+    }
+
+    return waiters;
+}
+
+struct nfs_inode *nfs_client::get_parent_inode_from_hint(
+        const struct nfs_inode *inode)
+{
+    const fuse_ino_t parent_ino = inode->parent_ino_hint;
+    const uint64_t parent_fileid = inode->parent_fileid_hint;
+
+    if (parent_ino == 0) {
+        return nullptr;
+    }
+
+    /*
+     * parent_ino is the nfs_inode pointer which we cannot dereference as the
+     * parent may have been freed, so look it up by fileid and match the
+     * fuse ino.
+     */
+    struct inode_map_shard& shard = get_inode_map_shard(parent_fileid);
+    std::shared_lock<std::shared_mutex> lock(shard.inode_map_lock_0);
+
+    const auto range = shard.inodes.equal_range(parent_fileid);
+
+    for (auto i = range.first; i != range.second; ++i) {
+        struct nfs_inode *parent = i->second;
+        assert(parent->magic == NFS_INODE_MAGIC);
+
+        if ((parent->get_fuse_ino() == parent_ino) && parent->is_dir()) {
+            parent->incref();
+            return parent;
+        }
+    }
+
+    return nullptr;
+}
+
+void nfs_client::revalidate_from_readdirplus(const struct entryplus3 *entries)
+{
+    for (const struct entryplus3 *entry = entries;
+         entry != nullptr;
+         entry = entry->nextentry) {
+        if (!entry->name_attributes.attributes_follow ||
+            !entry->name_handle.handle_follows) {
+            continue;
+        }
+
+        const struct fattr3& fattr =
+            entry->name_attributes.post_op_attr_u.attributes;
+        struct nfs_inode *inode =
+            __inode_from_inode_map(&entry->name_handle.post_op_fh3_u.handle,
+                                   &fattr);
+        // Not known to us, nothing to revalidate.
+        if (!inode) {
+            continue;
+        }
+
+        /*
+         * Only inodes with expired attributes are revalidated, for others
+         * these are just fresh attributes.
+         */
+        if (inode->attr_cache_expired()) {
+            inode->revalidate_with_attr(fattr, false /* force */);
+        } else {
+            inode->update(&fattr);
+        }
+
+        inode->decref();
+    }
+}
+
+/*
+ * Async RPCs issued by revalidate_batch() use these context structures.
+ * revalidate_inflight tracks all revalidation RPCs in flight, the revalidator
+ * doesn't wait on it while revalidating, only on exit so that the queued
+ * inodes are done before shutdown proceeds. Every RPC has a
+ * revalidate_rpc_context which shares it and holds a ref on the inode, so
+ * that a timed out wait doesn't free the inode or the inflight context under
+ * the late callbacks.
+ *
+ * Revalidation of a queued inode completes (and its waiters are woken up)
+ * as soon as its own attributes are refreshed, either by its GETATTR or by
+ * the READDIRPLUS batch of its parent carrying its attributes, and not when
+ * the rest of the revalidator batch completes.
+ */
+#define REVALIDATE_RPC_CTX_MAGIC *((const uint32_t *)"RVCX")
+
+struct revalidate_inflight
+{
+    std::condition_variable cv;
+    std::mutex mutex;
+    int pending = 0;
+
+    void issued()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        pending++;
+    }
+
+    void completed()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        assert(pending > 0);
+        if (--pending == 0) {
+            cv.notify_one();
+        }
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!cv.wait_for(lock, std::chrono::seconds(60),
+                         [this] { return pending == 0; })) {
+            AZLogWarn("[REVALIDATE] Timed out waiting for {} RPC(s), "
+                      "moving on", pending);
+        }
+    }
+};
+
+struct revalidate_rpc_context
+{
+    const uint32_t magic = REVALIDATE_RPC_CTX_MAGIC;
+    const std::shared_ptr<revalidate_inflight> inflight;
+
+    /*
+     * Inode being revalidated by GETATTR, or the parent directory being
+     * read by READDIRPLUS. We hold a lookupcnt ref on it.
+     */
+    struct nfs_inode *const inode;
+
+    /*
+     * For GETATTR, inode is a queued inode whose revalidation completes
+     * with this RPC. We then own the ref taken by queue_revalidate(), instead
+     * of taking our own, and wake up the inode's waiters once done.
+     */
+    const bool queued;
+
+    /*
+     * For READDIRPLUS, queued children of inode which we expect to be
+     * revalidated by it. We own the refs taken by queue_revalidate() for
+     * these, ref complete_revalidated_children().
+     */
+    std::vector<struct nfs_inode*> children;
+
+    // rpc_task for accounting the RPC in rpc stats.
+    struct rpc_task *task = nullptr;
+
+    // Number of READDIRPLUS RPCs issued so far.
+    int readdirplus_batches = 0;
+
+    revalidate_rpc_context(const std::shared_ptr<revalidate_inflight>& _inflight,
+                           struct nfs_inode *_inode,
+                           bool _queued):
+        inflight(_inflight),
+        inode(_inode),
+        queued(_queued)
+    {
+        assert(!queued || inode->revalidate_queued);
+
+        if (!queued) {
+            inode->incref();
+        }
+        inflight->issued();
+    }
+
+    ~revalidate_rpc_context()
+    {
+        // All children must have been completed or handed over to GETATTR.
+        assert(children.empty());
+
+        if (task) {
+            task->free_rpc_task();
+        }
+        if (queued) {
+            inode->on_revalidate_done();
+        }
+        inode->decref();
+        inflight->completed();
+    }
+};
+
+static void revalidate_getattr_callback(
+    struct rpc_context *rpc,
+    int rpc_status,
+    void *data,
+    void *private_data)
+{
+    auto ctx = (struct revalidate_rpc_context*) private_data;
+    assert(ctx->magic == REVALIDATE_RPC_CTX_MAGIC);
+    auto res = (GETATTR3res*) data;
+
+    ctx->task->get_stats().on_rpc_complete(rpc_get_pdu(rpc),
+                                           NFS_STATUSX(rpc_status, res));
+
+    if ((rpc_status == RPC_STATUS_SUCCESS) && (NFS_STATUS(res) == NFS3_OK)) {
+        ctx->inode->revalidate_with_attr(
+                res->GETATTR3res_u.resok.obj_attributes, false /* force */);
+    } else {
+        /*
+         * Attributes stay expired and the next access will revalidate
+         * again, also for NFS3ERR_JUKEBOX.
+         */
+        AZLogWarn("[{}] [REVALIDATE] GETATTR failed, rpc_status: {}, "
+                  "nfs_status: {}",
+                  ctx->inode->get_fuse_ino(), rpc_status, NFS_STATUS(res));
+    }
+
+    // This wakes up the inode's waiters.
+    delete ctx;
+}
+
+/*
+ * from_callback must be true when called from a libnfs callback, the rpc_task
+ * is then allocated from the reserved pool so that we never block there.
+ */
+static void issue_revalidate_getattr(struct revalidate_rpc_context *ctx,
+                                     bool from_callback)
+{
+    nfs_client& client = nfs_client::get_instance();
+    struct nfs_inode *const inode = ctx->inode;
+    struct rpc_context *rpc = nfs_get_rpc_context(
+            client.get_nfs_context(CONN_SCHED_FH_HASH, inode->get_crc(),
+                                   QOS_CLASS_META));
+    bool rpc_retry;
+
+    assert(ctx->queued);
+    assert(ctx->task == nullptr);
+    ctx->task = from_callback ?
+        client.get_rpc_task_helper()->alloc_rpc_task_reserved(FUSE_GETATTR) :
+        client.get_rpc_task_helper()->alloc_rpc_task(FUSE_GETATTR);
+    ctx->task->init_getattr(nullptr /* fuse_req */, inode->get_fuse_ino());
+
+    INC_GBL_STATS(revalidate_getattrs, 1);
+
+    do {
+        struct GETATTR3args args;
+        args.object = inode->get_fh();
 
-        /*
-         * With the exclusive lock held, check once more if some other thread
-         * added this inode before we could get the lock. If so, then delete
-         * the inode created above, grab a refcnt on the inode created by the
-         * other thread and return that.
-         */
+        rpc_retry = false;
+        ctx->task->get_stats().on_rpc_issue();
+        if (rpc_nfs3_getattr_task(rpc, revalidate_getattr_callback,
+                                  &args, ctx) == NULL) {
+            ctx->task->get_stats().on_rpc_cancel();
+            rpc_retry = true;
 
-        struct nfs_inode *inode =
-            __inode_from_inode_map(fh, fattr, false /* acquire_lock */);
+            AZLogWarn("rpc_nfs3_getattr_task failed to issue, retrying "
+                      "after 5 secs!");
+            ::sleep(5);
+        }
+    } while (rpc_retry);
+}
 
-        AZLogDebug(LOC_FMT
-                   "[{}:{} / 0x{:08x}] Allocated new inode (map size: {})",
-                   LOC_ARGS
-                   new_inode->get_filetype_coding(),
-                   new_inode->get_fuse_ino(), new_inode->get_crc(),
-                   inode_map.size());
+/*
+ * Complete revalidation of the children of a READDIRPLUS revalidation whose
+ * attributes have been refreshed by the READDIRPLUS batches read so far.
+ * If 'final' is true no more READDIRPLUS batches will be read and children
+ * still not revalidated are revalidated by GETATTR.
+ * Called from the READDIRPLUS callback.
+ */
+static void complete_revalidated_children(struct revalidate_rpc_context *ctx,
+                                          bool final)
+{
+    auto it = ctx->children.begin();
+
+    while (it != ctx->children.end()) {
+        struct nfs_inode *inode = *it;
+
+        if (!inode->attr_cache_expired()) {
+            INC_GBL_STATS(revalidate_by_readdirplus, 1);
+            inode->on_revalidate_done();
+            // Drop the ref held by queue_revalidate().
+            inode->decref();
+        } else if (final) {
+            issue_revalidate_getattr(
+                new revalidate_rpc_context(ctx->inflight, inode,
+                                           true /* queued */),
+                true /* from_callback */);
+        } else {
+            ++it;
+            continue;
+        }
 
-        if (inode) {
-            AZLogWarn(LOC_FMT
-                      "[{}] Another thread added inode {}, deleting ours",
-                      LOC_ARGS
-                      new_inode->get_fuse_ino(),
-                      inode->get_fuse_ino());
+        it = ctx->children.erase(it);
+    }
+}
 
-            /*
-             * If fattr is newer, update inode attr.
-             */
-            std::unique_lock<std::shared_mutex> lock1(inode->ilock_1);
+static void issue_revalidate_readdirplus(struct revalidate_rpc_context *ctx,
+                                         cookie3 cookie,
+                                         const cookieverf3 cookieverf);
 
-            const bool fattr_is_newer =
-                (compare_timespec_and_nfstime(inode->get_attr_nolock().st_ctim,
-                                              fattr->ctime) == -1);
-            if (fattr_is_newer) {
-                AZLogWarn(LOC_FMT
-                        "[{}:{} / 0x{:08x}] Updating inode attr, "
-                        "size {} -> {}, "
-                        "ctime {}.{} -> {}.{}, "
-                        "mtime {}.{} -> {}.{}",
-                        LOC_ARGS
-                        inode->get_filetype_coding(),
-                        inode->get_fuse_ino(),
-                        inode->get_crc(),
-                        inode->get_attr_nolock().st_size, fattr->size,
-                        inode->get_attr_nolock().st_ctim.tv_sec,
-                        inode->get_attr_nolock().st_ctim.tv_nsec,
-                        fattr->ctime.seconds,
-                        fattr->ctime.nseconds,
-                        inode->get_attr_nolock().st_mtim.tv_sec,
-                        inode->get_attr_nolock().st_mtim.tv_nsec,
-                        fattr->mtime.seconds,
-                        fattr->mtime.nseconds);
+static void revalidate_readdirplus_callback(
+    struct rpc_context *rpc,
+    int rpc_status,
+    void *data,
+    void *private_data)
+{
+    auto ctx = (struct revalidate_rpc_context*) private_data;
+    assert(ctx->magic == REVALIDATE_RPC_CTX_MAGIC);
+    auto res = (READDIRPLUS3res*) data;
 
-                nfs_client::stat_from_fattr3(inode->get_attr_nolock(), *fattr);
+    ctx->task->get_stats().on_rpc_complete(rpc_get_pdu(rpc),
+                                           NFS_STATUSX(rpc_status, res));
 
-                inode->attr_timeout_secs = inode->get_actimeo_min();
-                inode->attr_timeout_timestamp =
-                    get_current_msecs() + inode->attr_timeout_secs*1000;
-            }
+    if ((rpc_status == RPC_STATUS_SUCCESS) && (NFS_STATUS(res) == NFS3_OK)) {
+        const READDIRPLUS3resok& resok = res->READDIRPLUS3res_u.resok;
+        const struct entryplus3 *last = nullptr;
 
-            delete new_inode;
+        UPDATE_INODE_ATTR(ctx->inode, resok.dir_attributes);
+        nfs_client::get_instance().revalidate_from_readdirplus(
+                resok.reply.entries);
 
-            return inode;
+        for (const struct entryplus3 *entry = resok.reply.entries;
+             entry != nullptr;
+             entry = entry->nextentry) {
+            last = entry;
         }
 
         /*
-         * Common case.
-         * Bump lookupcnt ref on the newly allocated inode, add it to the
-         * map and return.
+         * Continue with the next batch, siblings not yet revalidated by the
+         * batches read so far will be revalidated by GETATTR.
+         * Siblings revalidated by this batch needn't wait for the rest.
          */
-#ifdef ENABLE_PARANOID
-        min_ino = std::min(min_ino.load(), (fuse_ino_t) new_inode);
-        max_ino = std::max(max_ino.load(), (fuse_ino_t) new_inode);
-#endif
-
-        new_inode->incref();
-
-        // Ok, insert the newly allocated inode in the global map.
-        inode_map.insert({fattr->fileid, new_inode});
+        if (!resok.reply.eof && last &&
+            (ctx->readdirplus_batches < REVALIDATE_READDIRPLUS_MAX_BATCHES)) {
+            complete_revalidated_children(ctx, false /* final */);
+            if (!ctx->children.empty()) {
+                ctx->task->free_rpc_task();
+                ctx->task = nullptr;
+                issue_revalidate_readdirplus(ctx, last->cookie,
+                                             resok.cookieverf);
+                return;
+            }
+        }
+    } else {
+        AZLogWarn("[{}] [REVALIDATE] READDIRPLUS failed, rpc_status: {}, "
+                  "nfs_status: {}",
+                  ctx->inode->get_fuse_ino(), rpc_status, NFS_STATUS(res));
     }
 
-    return new_inode;
+    complete_revalidated_children(ctx, true /* final */);
+    delete ctx;
 }
 
-void nfs_client::get_inode_stats(uint64_t& total_inodes,
-                                 uint64_t& num_files,
-                                 uint64_t& num_dirs,
-                                 uint64_t& num_symlinks,
-                                 uint64_t& open_files,
-                                 uint64_t& open_dirs,
-                                 uint64_t& num_files_cache_empty,
-                                 uint64_t& num_dirs_cache_empty,
-                                 uint64_t& num_forgotten,
-                                 uint64_t& expecting_forget,
-                                 uint64_t& num_dircached,
-                                 uint64_t& num_silly_renamed) const
+static void issue_revalidate_readdirplus(struct revalidate_rpc_context *ctx,
+                                         cookie3 cookie,
+                                         const cookieverf3 cookieverf)
 {
-    total_inodes = 0;
-    num_files = 0;
-    num_dirs = 0;
-    num_symlinks = 0;
-    open_files = 0;
-    open_dirs = 0;
-    num_files_cache_empty = 0;
-    num_dirs_cache_empty = 0;
-    num_forgotten = 0;
-    expecting_forget = 0;
-    num_dircached = 0;
-    num_silly_renamed = 0;
+    nfs_client& client = nfs_client::get_instance();
+    struct nfs_inode *const dir_inode = ctx->inode;
+    struct rpc_context *rpc = nfs_get_rpc_context(
+            client.get_nfs_context(CONN_SCHED_FH_HASH, dir_inode->get_crc(),
+                                   QOS_CLASS_META));
+    bool rpc_retry;
+
+    assert(dir_inode->is_dir());
+    assert(!ctx->queued);
+    assert(ctx->task == nullptr);
 
     /*
-     * Go over all inodes in inode_map.
+     * Chained READDIRPLUS calls are issued from the libnfs callback, use the
+     * reserved pool so that we never block there.
      */
-    std::shared_lock<std::shared_mutex> _lock(inode_map_lock_0);
-    for (auto it = inode_map.cbegin(); it != inode_map.cend(); ++it) {
-        const struct nfs_inode *inode = it->second;
-        assert(inode->magic == NFS_INODE_MAGIC);
+    ctx->task = (ctx->readdirplus_batches == 0) ?
+        client.get_rpc_task_helper()->alloc_rpc_task(FUSE_READDIRPLUS) :
+        client.get_rpc_task_helper()->alloc_rpc_task_reserved(FUSE_READDIRPLUS);
+    ctx->task->init_readdirplus(nullptr /* fuse_req */,
+                                dir_inode->get_fuse_ino(),
+                                0 /* size */,
+                                cookie,
+                                0 /* target_offset */,
+                                nullptr /* fuse_file */);
+    ctx->readdirplus_batches++;
 
-        total_inodes++;
+    do {
+        READDIRPLUS3args args;
 
-        switch (inode->file_type) {
-            case S_IFREG:
-                num_files++;
-                if (inode->is_open()) {
-                    open_files++;
-                }
-                if (inode->is_cache_empty()) {
-                    num_files_cache_empty++;
-                }
-                break;
-            case S_IFDIR:
-                num_dirs++;
-                if (inode->is_open()) {
-                    open_dirs++;
-                }
-                if (inode->is_cache_empty()) {
-                    num_dirs_cache_empty++;
-                }
-                break;
-            case S_IFLNK:
-                num_symlinks++;
-                break;
-        }
+        args.dir = dir_inode->get_fh();
+        args.cookie = cookie;
+        ::memcpy(&args.cookieverf, cookieverf, sizeof(args.cookieverf));
+        args.maxcount = nfs_get_readdir_maxcount(
+                client.get_nfs_context(CONN_SCHED_FH_HASH, dir_inode->get_crc()));
+        args.dircount = args.maxcount;
 
-        // This inode is cached in one or more readdir caches?
-        if (inode->is_dircached()) {
-            num_dircached++;
-        }
+        rpc_retry = false;
+        ctx->task->get_stats().on_rpc_issue();
+        if (rpc_nfs3_readdirplus_task(rpc, revalidate_readdirplus_callback,
+                                      &args, ctx) == NULL) {
+            ctx->task->get_stats().on_rpc_cancel();
+            rpc_retry = true;
 
-        // Fuse has called forget for this inode?
-        if (inode->is_forgotten()) {
-            assert(!inode->forget_expected);
-            num_forgotten++;
+            AZLogWarn("rpc_nfs3_readdirplus_task failed to issue, retrying "
+                      "after 5 secs!");
+            ::sleep(5);
         }
+    } while (rpc_retry);
+}
+
+void nfs_client::revalidate_batch(
+        std::vector<struct nfs_inode*>& batch,
+        const std::shared_ptr<struct revalidate_inflight>& inflight)
+{
+    std::unordered_map<fuse_ino_t, std::vector<struct nfs_inode*>> siblings;
+    std::vector<struct nfs_inode*> getattr_list;
+
+    AZLogDebug("[REVALIDATE] Revalidating {} inode(s)", batch.size());
+
+    for (struct nfs_inode *inode : batch) {
+        assert(inode->magic == NFS_INODE_MAGIC);
+        assert(inode->revalidate_queued);
 
-        // Do we expect a forget from fuse for this inode?
-        if (inode->forget_expected > 0) {
-            assert(!inode->is_forgotten());
-            expecting_forget++;
+        /*
+         * Attributes may have been refreshed since it was queued, f.e., by
+         * postop attributes of some other RPC. Wake up the waiters and drop
+         * the ref held by queue_revalidate().
+         */
+        if (!inode->attr_cache_expired()) {
+            inode->on_revalidate_done();
+            inode->decref();
+            continue;
         }
 
-        // Is this inode silly-renamed?
-        if (inode->is_silly_renamed) {
-            num_silly_renamed++;
+        if (inode->parent_ino_hint != 0) {
+            siblings[inode->parent_ino_hint].emplace_back(inode);
+        } else {
+            getattr_list.emplace_back(inode);
         }
     }
 
+    batch.clear();
+
     /*
-     * Let's perform some sanity checks.
+     * Siblings expiring together are revalidated by READDIRPLUS of their
+     * parent, any sibling not refreshed by it gets a GETATTR once the
+     * READDIRPLUS completes, ref complete_revalidated_children().
+     * We don't wait for any of the RPCs, queued inodes complete from their
+     * RPC callbacks.
      */
-    assert(total_inodes == (num_files + num_dirs + num_symlinks));
-}
+    for (auto& [parent_ino, children] : siblings) {
+        struct nfs_inode *dir_inode = nullptr;
 
-// Caller must hold inode_map_lock_0.
-void nfs_client::put_nfs_inode_nolock(struct nfs_inode *inode,
-                                      size_t dropcnt)
-{
-    AZLogDebug("[{}] put_nfs_inode_nolock(dropcnt={}) called, lookupcnt={}, "
-               "dircachecnt={}, forget_expected={}",
-               inode->get_fuse_ino(), dropcnt, inode->lookupcnt.load(),
-               inode->dircachecnt.load(), inode->forget_expected.load());
+        if (children.size() >= REVALIDATE_READDIRPLUS_MIN_SIBLINGS) {
+            dir_inode = get_parent_inode_from_hint(children[0]);
+        }
 
-    assert(inode->magic == NFS_INODE_MAGIC);
-    assert(inode->lookupcnt >= dropcnt);
+        if (!dir_inode) {
+            getattr_list.insert(getattr_list.end(),
+                                children.begin(), children.end());
+            continue;
+        }
 
-    /*
-     * We have to reduce the lookupcnt by dropcnt regardless of whether we
-     * free the inode or not. After dropping the lookupcnt if it becomes 0
-     * then we proceed to perform the other checks for deciding whether the
-     * inode can be safely removed from inode_map and freed.
-     */
-    inode->lookupcnt -= dropcnt;
+        AZLogDebug("[{}] [REVALIDATE] Revalidating {} children by "
+                   "READDIRPLUS", parent_ino, children.size());
 
-    /*
-     * If this inode is referenced by some directory_entry then we cannot free
-     * it. We will attempt to free it later when the parent directory is purged
-     * and the inode loses its last dircachecnt reference.
-     *
-     * Note: It's important to first check dircachecnt before lookupcnt, as
-     *       users who want to protect nfs_inode using dircachecnt, acquire
-     *       dircachecnt before lookupcnt.
-     *       Ref readdirectory_cache::dnlc_lookup().
-     */
-    if (inode->dircachecnt > 0) {
-        AZLogVerbose("[{}] Inode is cached by readdir ({})",
-                     inode->get_fuse_ino(), inode->dircachecnt.load());
-        return;
+        INC_GBL_STATS(revalidate_readdirplus, 1);
+        auto ctx = new revalidate_rpc_context(inflight, dir_inode,
+                                              false /* queued */);
+        ctx->children.swap(children);
+        // revalidate_rpc_context holds its own ref.
+        dir_inode->decref();
+
+        const cookieverf3 cookieverf = {};
+        issue_revalidate_readdirplus(ctx, 0, cookieverf);
     }
 
-    /*
-     * Caller should call us only for forgotten inodes but it's possible that
-     * after we held inode_map_lock_0 some other thread got a reference on
-     * this inode.
-     */
-    if (inode->lookupcnt > 0) {
-        AZLogWarn("[{}] Inode no longer forgotten: lookupcnt={}",
-                  inode->get_fuse_ino(), inode->lookupcnt.load());
-        return;
+    for (struct nfs_inode *inode : getattr_list) {
+        issue_revalidate_getattr(
+                new revalidate_rpc_context(inflight, inode, true /* queued */),
+                false /* from_callback */);
     }
+}
 
-    /*
-     * This inode is going to be freed, either we never conveyed the inode
-     * to fuse (we couldn't fit the directory entry in readdirplus buffer
-     * or we failed to call fuse_reply_entry(), fuse_reply_create() or
-     * fuse_reply_buf()), or fuse called forget for the inode.
-     */
-    assert(!inode->forget_expected);
+void nfs_client::revalidator()
+{
+    std::vector<struct nfs_inode*> batch;
+    const auto inflight = std::make_shared<revalidate_inflight>();
 
-    /*
-     * Directory inodes cannot be deleted while the directory cache is not
-     * purged. Note that we purge directory cache from decref() when the
-     * refcnt reaches 0, i.e., fuse is no longer referencing the directory.
-     * So, a non-zero directory cache count means that some other thread
-     * started enumerating the directory before we could delete the directory
-     * inode. Fuse will call FORGET on the directory and then we can free this
-     * inode.
-     * XXX This should not happen as for enumerating a directory fuse would
-     *     have open()ed the directory and must have a lookupcnt ref on the
-     *     directory inode.
-     */
-    if (inode->is_dir() && !inode->is_cache_empty()) {
-        AZLogWarn("[{}] Inode still has {} entries in dircache, skipping",
-                  inode->get_fuse_ino(),
-                  inode->get_dircache()->get_num_entries());
-        assert(0);
-        return;
-    }
+    AZLogInfo("Revalidator thread started");
 
-    /*
-     * Ok, inode is not referenced by fuse VFS and it's not referenced by
-     * any readdir cache, let's remove it from the inode_map. Once removed
-     * from inode_map, any subsequent get_nfs_inode() calls for this file
-     * (fh and fileid) will allocate a new nfs_inode, which will most likely
-     * result in a new fuse inode number.
-     */
-    auto range = inode_map.equal_range(inode->get_fileid());
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(revalidate_queue_lock_51);
+            revalidate_queue_cv.wait(lock, [this] {
+                return !revalidate_queue.empty() || !revalidator_running;
+            });
 
-    for (auto i = range.first; i != range.second; ++i) {
-        assert(i->first == inode->get_fileid());
-        assert(i->second->magic == NFS_INODE_MAGIC);
+            /*
+             * On shutdown we exit only after revalidating all queued inodes,
+             * as there may be callers waiting for them.
+             */
+            if (revalidate_queue.empty()) {
+                assert(!revalidator_running);
+                break;
+            }
 
-        if (i->second == inode) {
-            AZLogDebug("[{}:{}] Deleting inode (inode_map size: {})",
-                       inode->get_filetype_coding(),
-                       inode->get_fuse_ino(),
-                       inode_map.size()-1);
-            inode_map.erase(i);
-            delete inode;
-            return;
+            /*
+             * Give siblings expiring together a chance to join this batch.
+             */
+            revalidate_queue_cv.wait_for(
+                lock, std::chrono::milliseconds(REVALIDATE_BATCH_WINDOW_MSECS),
+                [this] { return !revalidator_running; });
+
+            assert(batch.empty());
+            batch.swap(revalidate_queue);
         }
+
+        revalidate_batch(batch, inflight);
     }
 
-    // We must find the inode in inode_map.
-    assert(0);
+    /*
+     * Wait for the revalidation RPCs still in flight, so that all queued
+     * inodes are done before shutdown proceeds.
+     */
+    inflight->wait();
+
+    AZLogInfo("Revalidator thread exiting");
 }
 
 struct nfs_context* nfs_client::get_nfs_context(conn_sched_t csched,
-                                                uint32_t fh_hash) const
+                                                uint32_t fh_hash,
+                                                qos_class_t qos) const
 {
-    return transport.get_nfs_context(csched, fh_hash);
+    return transport.get_nfs_context(csched, fh_hash, qos);
 }
 
 void nfs_client::lookup(fuse_req_t req, fuse_ino_t parent_ino, const char* name)
@@ -1237,7 +2335,7 @@ int nfs_client::lookup_sync(fuse_ino_t parent_ino,
     struct nfs_inode *parent_inode = get_nfs_inode_from_ino(parent_ino);
     const uint32_t fh_hash = parent_inode->get_crc();
     struct nfs_context *nfs_context =
-        get_nfs_context(CONN_SCHED_FH_HASH, fh_hash);
+        get_nfs_context(CONN_SCHED_FH_HASH, fh_hash, QOS_CLASS_META);
     struct rpc_task *task = nullptr;
     struct sync_rpc_context *ctx = nullptr;
     struct rpc_pdu *pdu = nullptr;
@@ -2014,6 +3112,7 @@ void nfs_client::reply_entry(
          * from fuse forget callback.
          */
         inode = get_nfs_inode(fh, fattr);
+        inode->set_parent_hint(parent_inode);
 
         entry.ino = inode->get_fuse_ino();
         entry.generation = inode->get_generation();
@@ -2116,15 +3215,49 @@ void nfs_client::reply_entry(
 void nfs_client::jukebox_retry(struct rpc_task *task)
 {
     {
-        AZLogDebug("Queueing rpc_task {} for jukebox retry", fmt::ptr(task));
+        /*
+         * Exponential backoff with jitter, see JUKEBOX_MIN_DELAY_MSECS.
+         */
+        const uint32_t nretries = task->rpc_api->num_jukebox_retries++;
+        const int64_t max_delay_msecs =
+            std::min<int64_t>(
+                (int64_t) JUKEBOX_MIN_DELAY_MSECS << std::min<uint32_t>(nretries, 16),
+                JUKEBOX_MAX_DELAY_MSECS);
+        const int64_t delay_msecs =
+            (max_delay_msecs / 2) + random_number(0, max_delay_msecs / 2);
+
+        AZLogDebug("Queueing rpc_task {} for jukebox retry #{} after {} msecs",
+                   fmt::ptr(task), nretries + 1, delay_msecs);
 
         /*
          * Transfer ownership of rpc_api from rpc_task to jukebox_seedinfo.
          */
+        struct jukebox_seedinfo *js =
+            new jukebox_seedinfo(task->rpc_api, delay_msecs,
+                                 task->get_stats().get_jukebox_conn_stats());
+
         std::unique_lock<std::mutex> lock(jukebox_seeds_lock_39);
-        jukebox_seeds.emplace(new jukebox_seedinfo(task->rpc_api));
+
+        /*
+         * Wake up jukebox_runner only if the new seed is due before the one
+         * it's currently sleeping for.
+         */
+        const bool wakeup = jukebox_seeds.empty() ||
+            (js->run_at_msecs < jukebox_seeds.top()->run_at_msecs);
+        jukebox_seeds.push(js);
+
+        INC_GBL_STATS(jukebox_retries, 1);
+        const uint64_t queued = ++rpc_stats_az::jukebox_queued;
+        if (queued > GET_GBL_STATS(jukebox_max_queued)) {
+            rpc_stats_az::jukebox_max_queued = queued;
+        }
 
         task->rpc_api = nullptr;
+        lock.unlock();
+
+        if (wakeup) {
+            jukebox_cv.notify_one();
+        }
     }
 
     /*
@@ -2312,7 +3445,8 @@ bool nfs_client::getattr_sync(const struct nfs_fh3& fh,
 {
     const uint32_t fh_hash = calculate_crc32(
             (const unsigned char *) fh.data.data_val, fh.data.data_len);
-    struct nfs_context *nfs_context = get_nfs_context(CONN_SCHED_FH_HASH, fh_hash);
+    struct nfs_context *nfs_context =
+        get_nfs_context(CONN_SCHED_FH_HASH, fh_hash, QOS_CLASS_META);
     struct rpc_task *task = nullptr;
     struct sync_rpc_context *ctx = nullptr;
     struct rpc_pdu *pdu = nullptr;
@@ -159,8 +159,11 @@ nfs_inode::~nfs_inode()
  * LOCKS: inode_map_lock_0.
  *        readdircache_lock_2 for directory.
  *        chunkmap_lock_43 for file.
+ *        reclaim_lock_49 when called from forget.
  */
-void nfs_inode::decref(size_t cnt, bool from_forget)
+void nfs_inode::decref(size_t cnt, bool from_forget,
+                       std::vector<std::pair<struct nfs_inode*, size_t>>
+                           *reclaim_batch)
 {
     AZLogDebug("[{}:{}] decref(cnt={}, from_forget={}) called "
                "(lookupcnt={}, dircachecnt={}, forget_expected={}, opencnt={})",
@@ -177,6 +180,8 @@ void nfs_inode::decref(size_t cnt, bool from_forget)
     assert(cnt > 0);
     // When not from forget, there's never a case to pass cnt > 1.
     assert(from_forget || (cnt == 1));
+    // Only forgets are batched.
+    assert(from_forget || !reclaim_batch);
     assert(lookupcnt >= cnt);
 
     if (from_forget) {
@@ -226,7 +231,27 @@ try_again:
     ++lookupcnt;
     const bool forget_now = ((lookupcnt -= cnt) == 1);
 
-    if (forget_now) {
+    if (forget_now && from_forget) {
+        /*
+         * Fuse has dropped all its references on the inode, hand it over to
+         * the reclaimer along with the 'cnt' refs, which will be dropped
+         * when the reclaimer releases the inode. The reclaimer also purges
+         * the file/directory cache, see the comment below.
+         * This keeps FORGET storms from taking inode_map_lock_0 and purging
+         * caches on the fuse thread.
+         */
+        lookupcnt += (cnt - 1);
+        assert(lookupcnt >= cnt);
+
+        AZLogDebug("[{}:{}] lookupcnt dropping by {}, queueing for reclaim",
+                   get_filetype_coding(), ino, cnt);
+
+        if (reclaim_batch) {
+            reclaim_batch->emplace_back(this, cnt);
+        } else {
+            client->queue_reclaim(this, cnt);
+        }
+    } else if (forget_now) {
         /*
          * For directory inodes it's a good time to purge the dircache, since
          * fuse VFS has lost all references on the directory. Note that we
@@ -271,10 +296,6 @@ try_again:
          * any more forgets, delete the inode. Note that before we grab the
          * inode_map_lock_0 in put_nfs_inode() some other thread can reuse the
          * forgotten inode, in which case put_nfs_inode() will just skip it.
-         *
-         * TODO: In order to avoid taking inode_map_lock_0 for every forget,
-         *       see if we should batch them in a threadlocal vector and call
-         *       put_nfs_inodes() for a batch.
          */
         client->put_nfs_inode(this, cnt);
     } else {
@@ -317,6 +338,96 @@ bool nfs_inode::in_ra_window(uint64_t offset, uint64_t length) const
     return get_rastate()->in_ra_window(offset, length);
 }
 
+bool nfs_inode::is_pinned(uint64_t offset, uint64_t length) const
+{
+    if (!has_rastate()) {
+        return false;
+    }
+
+    return get_rastate()->is_pinned(offset, length);
+}
+
+int nfs_inode::prefetch(uint64_t offset, uint64_t length, bool pin)
+{
+    if (!is_regfile()) {
+        return EINVAL;
+    }
+
+    if ((offset >= AZNFSC_MAX_FILE_SIZE) ||
+        (length > (AZNFSC_MAX_FILE_SIZE - offset))) {
+        return EINVAL;
+    }
+
+    /*
+     * See on_fuse_open(), filecache_handle must be allocated before
+     * readahead_state.
+     */
+    alloc_filecache();
+    alloc_rastate();
+
+    return get_rastate()->prefetch(offset, length, pin);
+}
+
+void nfs_inode::prefetch_small_file(int open_flags)
+{
+    if (!aznfsc_cfg.sys.small_file_mode ||
+        !aznfsc_cfg.cache.data.user.enable ||
+        !is_regfile()) {
+        return;
+    }
+
+    /*
+     * Don't read what the application is not going to read.
+     */
+    if (((open_flags & O_ACCMODE) == O_WRONLY) || (open_flags & O_TRUNC)) {
+        return;
+    }
+
+    /*
+     * Attributes are fresh from the LOOKUP (or the GETATTR done by open for
+     * cto consistency), if they have expired don't bother.
+     */
+    if (attr_cache_expired()) {
+        return;
+    }
+
+    const int64_t fsize = get_server_file_size();
+    if (fsize <= 0 || fsize > client->mnt_options.rsize_adj) {
+        return;
+    }
+
+    // Already cached, nothing to do.
+    if (has_filecache() && !is_cache_empty()) {
+        return;
+    }
+
+    if (prefetch(0, fsize, false /* pin */) == 0) {
+        INC_GBL_STATS(small_file_prefetches, 1);
+        AZLogDebug("[{}] Small file ({} bytes), read whole on open",
+                   ino, fsize);
+    }
+}
+
+int nfs_inode::dontneed(uint64_t offset, uint64_t length)
+{
+    if (!is_regfile()) {
+        return EINVAL;
+    }
+
+    if ((offset >= AZNFSC_MAX_FILE_SIZE) ||
+        (length > (AZNFSC_MAX_FILE_SIZE - offset))) {
+        return EINVAL;
+    }
+
+    // Nothing cached, nothing pinned.
+    if (!has_rastate()) {
+        return 0;
+    }
+
+    get_rastate()->dontneed(offset, length);
+    return 0;
+}
+
 /**
  * Note: nfs_inode::lookup() method currently has limited usage.
  *       It is only meant to be called from silly_rename() and rmdir() where
@@ -333,8 +444,12 @@ struct nfs_inode *nfs_inode::lookup(const char *filename, int *failure_status)
     // Must be called only for a directory inode.
     assert(is_dir());
 
-    // Revalidate to ensure dnlc cache can be safely used.
-    revalidate();
+    /*
+     * Revalidate to ensure dnlc cache can be safely used.
+     * Callers act on the result, so don't use stale dnlc/attributes even
+     * if stale_while_revalidate is set.
+     */
+    revalidate(false /* force */, true /* sync */);
 
     /*
      * First search in dnlc, if not found perform LOOKUP RPC.
@@ -567,8 +682,11 @@ bool nfs_inode::check_stable_write_required(off_t offset)
 
     /*
      * If stable_write is already set, we don't need to do anything.
-     * We don't need lock here as once stable_write is set it's never
-     * unset.
+     * stable_write cannot change under us as it's only ever set or unset
+     * with the flush_lock held (asserted above), ref clear_stable_write().
+     * Note that this check is done for every flush and not when data is
+     * dirtied, so data dirtied while stable_write was set but flushed after
+     * the small file path cleared it, is checked here like any other.
      */
     if (is_stable_write()) {
         return false;
@@ -661,9 +779,14 @@ void nfs_inode::sync_membufs(std::vector<bytes_chunk> &bc_vec,
     if (!is_stable_write()) {
         /*
          * We do not allow a new flush while there's an ongoing one, in case
-         * of unstable writes.
+         * of unstable writes, unless it continues right after the ongoing
+         * one, which is how fcsm::fill_write_window() keeps the write window
+         * full. Anything else may need switching to stable writes, which
+         * needs all ongoing flushes to complete.
          */
-        assert(!get_filecache()->is_flushing_in_progress());
+        assert(!get_filecache()->is_flushing_in_progress() ||
+               bc_vec.empty() ||
+               ((off_t) bc_vec[0].offset == putblock_filesize));
     }
 
     /*
@@ -974,6 +1097,14 @@ int nfs_inode::copy_to_cache(const struct fuse_bufvec* bufv,
     int err = 0;
     bool inject_eagain = false;
 
+    /*
+     * File is being modified locally, stop using the disk cache for it
+     * till it's opened next.
+     */
+    if (dcache_entry) {
+        dcache_entry->disable();
+    }
+
     /*
      * Get bytes_chunk(s) covering the range [offset, offset+length).
      * We need to copy application data to those.
@@ -1411,6 +1542,36 @@ int nfs_inode::flush_cache_and_wait()
      */
     wait_for_ongoing_flush();
 
+    /*
+     * Small file fast path. If nothing has been written yet and all the
+     * data fits in one WRITE, write it as FILE_SYNC instead of an unstable
+     * write followed by a COMMIT round trip.
+     * This is a one-shot stable write, once it completes the inode goes back
+     * to unstable writes, see below. With nothing flushed or commit pending
+     * there's nothing for switch_to_stable_write() to do except setting the
+     * flag, so we do that directly.
+     */
+    bool small_file_stable = false;
+
+    if (aznfsc_cfg.sys.small_file_mode && !is_stable_write() &&
+        (putblock_filesize == 0) &&
+        !is_commit_in_progress() &&
+        (get_filecache()->get_bytes_to_commit() == 0)) {
+        const uint64_t bytes = get_filecache()->get_bytes_to_flush();
+
+        if (bytes > 0 &&
+            bytes <= (uint64_t) client->mnt_options.wsize_adj &&
+            get_cached_filesize() <= client->mnt_options.wsize_adj) {
+            AZLogDebug("[{}] Small file ({} dirty bytes), flushing with "
+                       "FILE_SYNC", ino, bytes);
+            assert(!get_filecache()->is_flushing_in_progress());
+            set_stable_write();
+            get_fcsm()->ctgtq_cleanup();
+            small_file_stable = true;
+            INC_GBL_STATS(small_file_stable_flushes, 1);
+        }
+    }
+
     std::atomic_bool complete = false;
 
     /*
@@ -1442,6 +1603,34 @@ int nfs_inode::flush_cache_and_wait()
         ::usleep(10 * 1000);
     }
 
+    /*
+     * Go back to unstable writes after the one-shot small file stable write.
+     * It's safe to do only when no write is inflight and everything cached
+     * has been written, as then the server file size is the cached file size
+     * and further appending writes can continue as unstable writes from there.
+     * If more data got dirtied meanwhile we stay with stable writes, which is
+     * always correct.
+     * We also stay stable if the file is open through any other handle, as
+     * a writer on that may be copying data into the cache right now, which
+     * get_bytes_to_flush() won't yet see.
+     */
+    if (small_file_stable) {
+        flush_lock();
+        wait_for_ongoing_flush();
+
+        if (is_stable_write() &&
+            (opencnt <= 1) &&
+            (get_write_error() == 0) &&
+            (get_filecache()->get_bytes_to_flush() == 0) &&
+            !is_truncate_in_progress()) {
+            AZLogDebug("[{}] Small file flushed, back to unstable writes "
+                       "(putblock_filesize: {})", ino, get_cached_filesize());
+            clear_stable_write(get_cached_filesize());
+        }
+
+        flush_unlock();
+    }
+
     return get_write_error();
 }
 
@@ -1469,6 +1658,22 @@ void nfs_inode::flush_lock() const
     return;
 }
 
+bool nfs_inode::try_flush_lock() const
+{
+    /*
+     * Caller must call try_flush_lock() for regular files only.
+     */
+    assert(has_filecache());
+
+    if (std::atomic_exchange(&is_flushing, true)) {
+        AZLogDebug("[{}] try_flush_lock() failed", ino);
+        return false;
+    }
+
+    AZLogDebug("[{}] try_flush_lock() acquired", ino);
+    return true;
+}
+
 void nfs_inode::flush_unlock() const
 {
     AZLogDebug("[{}] flush_unlock() called", ino);
@@ -1548,6 +1753,11 @@ bool nfs_inode::truncate_start(size_t size)
     assert(has_filecache());
     assert(size <= AZNFSC_MAX_FILE_SIZE);
 
+    // See comment in copy_to_cache().
+    if (dcache_entry) {
+        dcache_entry->disable();
+    }
+
     /*
      * Our strategy for truncate is as follows:
      * 1. (Pre) Cache truncate.
@@ -1790,7 +2000,7 @@ bool nfs_inode::release(fuse_req_t req)
     return false;
 }
 
-void nfs_inode::revalidate(bool force)
+void nfs_inode::revalidate(bool force, bool sync)
 {
     /*
      * This is set in the constructor as a newly created nfs_inode always has
@@ -1817,6 +2027,38 @@ void nfs_inode::revalidate(bool force)
         return;
     }
 
+    if (!force) {
+        /*
+         * Non-forced revalidations are done by the revalidator, which
+         * coalesces concurrent revalidations of the same inode and batches
+         * revalidations of siblings into READDIRPLUS of their parent.
+         * With stale-while-revalidate we don't wait for it and let the
+         * caller use the cached attributes/data, else (or if caller needs
+         * an authoritative answer) we wait for the revalidation to complete.
+         */
+        uint64_t gen;
+        {
+            std::unique_lock<std::mutex> lock(revalidate_lock_50);
+            gen = revalidate_gen;
+        }
+
+        if (client->queue_revalidate(this)) {
+            if (!sync && aznfsc_cfg.cache.attr.user.stale_while_revalidate) {
+                AZLogDebug("[{}] revalidate: Using stale attributes till "
+                           "revalidated", ino);
+                return;
+            }
+
+            std::unique_lock<std::mutex> lock(revalidate_lock_50);
+            revalidate_cv.wait(lock, [this, gen] {
+                return revalidate_gen != gen;
+            });
+            return;
+        }
+
+        // Revalidator not running, revalidate inline.
+    }
+
     /*
      * Query the attributes of the file from the server to find out if
      * the file has changed and we need to invalidate the cached data.
@@ -1834,6 +2076,11 @@ void nfs_inode::revalidate(bool force)
         return;
     }
 
+    revalidate_with_attr(fattr, force);
+}
+
+void nfs_inode::revalidate_with_attr(const struct fattr3& fattr, bool force)
+{
     /*
      * Let update() decide if the freshly received attributes indicate file
      * has changed that what we have cached, and if so update the cached
@@ -1859,6 +2106,16 @@ void nfs_inode::revalidate(bool force)
     }
 }
 
+void nfs_inode::on_revalidate_done()
+{
+    assert(revalidate_queued);
+
+    std::unique_lock<std::mutex> lock(revalidate_lock_50);
+    revalidate_queued = false;
+    revalidate_gen++;
+    revalidate_cv.notify_all();
+}
+
 /**
  * Caller must hold exclusive inode lock.
  */
@@ -6,6 +6,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <sys/syscall.h>
 
 #include <filesystem>
 #include <atomic>
@@ -14,6 +15,7 @@
 #include "rpc_task.h"
 #include "nfs_inode.h"
 #include "fs-handler.h"
+#include "cpu_affinity.h"
 
 namespace aznfsc {
 
@@ -26,9 +28,44 @@ decltype(PXT::__close_orig) posix_task::__close_orig = nullptr;
 decltype(PXT::__dup_orig) posix_task::__dup_orig = nullptr;
 decltype(PXT::__dup2_orig) posix_task::__dup2_orig = nullptr;
 decltype(PXT::__read_orig) posix_task::__read_orig = nullptr;
+decltype(PXT::__pread_orig) posix_task::__pread_orig = nullptr;
+decltype(PXT::__preadv_orig) posix_task::__preadv_orig = nullptr;
+decltype(PXT::__write_orig) posix_task::__write_orig = nullptr;
+decltype(PXT::__pwrite_orig) posix_task::__pwrite_orig = nullptr;
+decltype(PXT::__pwritev_orig) posix_task::__pwritev_orig = nullptr;
+decltype(PXT::__lseek_orig) posix_task::__lseek_orig = nullptr;
+decltype(PXT::__fstat_orig) posix_task::__fstat_orig = nullptr;
+decltype(PXT::__fsync_orig) posix_task::__fsync_orig = nullptr;
+decltype(PXT::__fdatasync_orig) posix_task::__fdatasync_orig = nullptr;
+decltype(PXT::__posix_fadvise_orig) posix_task::__posix_fadvise_orig = nullptr;
+decltype(PXT::__opendir_orig) posix_task::__opendir_orig = nullptr;
+decltype(PXT::__fdopendir_orig) posix_task::__fdopendir_orig = nullptr;
+decltype(PXT::__readdir_orig) posix_task::__readdir_orig = nullptr;
+decltype(PXT::__readdir64_orig) posix_task::__readdir64_orig = nullptr;
+decltype(PXT::__readdir_r_orig) posix_task::__readdir_r_orig = nullptr;
+decltype(PXT::__readdir64_r_orig) posix_task::__readdir64_r_orig = nullptr;
+decltype(PXT::__telldir_orig) posix_task::__telldir_orig = nullptr;
+decltype(PXT::__seekdir_orig) posix_task::__seekdir_orig = nullptr;
+decltype(PXT::__rewinddir_orig) posix_task::__rewinddir_orig = nullptr;
+decltype(PXT::__dirfd_orig) posix_task::__dirfd_orig = nullptr;
+decltype(PXT::__closedir_orig) posix_task::__closedir_orig = nullptr;
 decltype(PXT::client) posix_task::client = nullptr;
-std::unordered_map<int, struct fdinfo> posix_task::fdmap;
-std::mutex posix_task::fdmap_mutex;
+
+/*
+ * These are constant initialized, so they are usable even by calls
+ * intercepted before our constructor runs.
+ */
+struct fdinfo posix_task::fdtable[NOFUSE_MAX_FDS];
+std::mutex posix_task::write_mutex[NOFUSE_WRITE_LOCK_SHARDS];
+std::unordered_set<const void *> posix_task::dirset;
+std::mutex posix_task::dirset_mutex;
+std::atomic<int> posix_task::num_dirs = 0;
+
+/*
+ * readdir64() returns our struct dirent, which works only because the two
+ * are the same on LP64.
+ */
+static_assert(sizeof(struct dirent) == sizeof(struct dirent64));
 
 /*
  * We don't want to intercept any calls made before we are correctly init'ed
@@ -129,9 +166,20 @@ static void __nofuse_init()
     // Set default values for config variables not set using the above.
     aznfsc_cfg.set_defaults_and_sanitize();
 
+    if (aznfsc_cfg.log_async) {
+        azlog::enable_async();
+    }
+
     aznfsc_cfg.mountpoint = nofuse_root_abs;
     ::free(nofuse_root_abs);
 
+    /*
+     * Service threads and membufs can be placed as configured, application
+     * threads are left alone.
+     */
+    cpu_affinity::get_instance().init(aznfsc_cfg.sys.affinity.mode_int,
+                                      aznfsc_cfg.sys.affinity.iface);
+
     /*
      * Initialize nfs_client singleton.
      * This creates the libnfs polling thread(s).
@@ -227,38 +275,104 @@ bool posix_task::path_in_mountpoint(const char *pathname) const
 
 bool posix_task::fd_in_mountpoint(int fd) const
 {
-    std::unique_lock<std::mutex> lock(fdmap_mutex);
-    const bool in_mp = fdmap.find(fd) != fdmap.end();
+    const bool in_mp = (get_fdinfo(fd) != nullptr);
 
     AZLogDebug("[NOFUSE] fd {} is {}under mountpoint {}",
                fd, in_mp ? "" : "NOT ", aznfsc_cfg.mountpoint);
     return in_mp;
 }
 
-void posix_task::fd_add_to_map(int fd, fuse_ino_t ino)
+int posix_task::fd_alloc(fuse_ino_t ino, int flags)
 {
-    std::unique_lock<std::mutex> lock(fdmap_mutex);
-    [[maybe_unused]] auto p = fdmap.try_emplace(fd, fd, ino);
-    assert(p.second == true);
-    AZLogDebug("fd [{}] -> ino [{}]", fd, ino);
+    /*
+     * Reserve the fd number with the kernel. Use the syscall directly so
+     * that it doesn't come back to us.
+     */
+    const int fd = ::syscall(SYS_openat, AT_FDCWD, "/dev/null",
+                             O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        AZLogError("[NOFUSE] Failed to reserve fd: {}", ::strerror(errno));
+        return -errno;
+    }
+
+    if (fd >= NOFUSE_MAX_FDS) {
+        AZLogError("[NOFUSE] Reserved fd {} >= NOFUSE_MAX_FDS ({})",
+                   fd, NOFUSE_MAX_FDS);
+        ::syscall(SYS_close, fd);
+        return -EMFILE;
+    }
+
+    fd_add_to_map(fd, std::make_shared<struct nofuse_file>(ino, flags));
+    return fd;
+}
+
+void posix_task::fd_add_to_map(int fd,
+                               const std::shared_ptr<struct nofuse_file>& file)
+{
+    assert(fd >= 0 && fd < NOFUSE_MAX_FDS);
+    assert(file);
+
+    struct fdinfo& fdi = fdtable[fd];
+    std::unique_lock<std::mutex> lock(fdi.mutex);
+
+    /*
+     * Set ino last, as that makes the slot visible.
+     */
+    fdi.file = file;
+    fdi.ino = file->ino;
+
+    AZLogDebug("fd [{}] -> ino [{}] (file: {}, refs: {})",
+               fd, file->ino, fmt::ptr(file.get()), file.use_count());
 }
 
 void posix_task::fd_remove_from_map(int fd)
 {
-    std::unique_lock<std::mutex> lock(fdmap_mutex);
-    [[maybe_unused]] const int num_erased = fdmap.erase(fd);
-    assert(num_erased == 1);
+    assert(fd >= 0 && fd < NOFUSE_MAX_FDS);
+
+    struct fdinfo& fdi = fdtable[fd];
+    std::shared_ptr<struct nofuse_file> file;
+
+    {
+        std::unique_lock<std::mutex> lock(fdi.mutex);
+
+        [[maybe_unused]] const fuse_ino_t ino = fdi.ino.exchange(0);
+        assert(ino != 0);
+
+        /*
+         * Drop our ref outside the lock. The file is freed when the last fd
+         * referring to it is closed and no call is using it.
+         */
+        file.swap(fdi.file);
+        assert(file);
+    }
+
     AZLogDebug("Removed fd [{}]", fd);
 }
 
-void posix_task::fd_add_pos(int fd, off_t pos)
+void posix_task::dir_add(struct nofuse_dir *dir)
+{
+    std::unique_lock<std::mutex> lock(dirset_mutex);
+    [[maybe_unused]] const auto p = dirset.insert(dir);
+    assert(p.second == true);
+    num_dirs++;
+}
+
+void posix_task::dir_remove(struct nofuse_dir *dir)
 {
-    std::unique_lock<std::mutex> lock(fdmap_mutex);
-    auto it = fdmap.find(fd);
-    assert(it != fdmap.end());
-    AZLogDebug("fd [{}] pos {} -> {}",
-               fd, it->second.pos.load(), it->second.pos.load() + pos);
-    it->second.pos += pos;
+    std::unique_lock<std::mutex> lock(dirset_mutex);
+    [[maybe_unused]] const int num_erased = dirset.erase(dir);
+    assert(num_erased == 1);
+    num_dirs--;
+}
+
+bool posix_task::dir_in_mountpoint(const void *dirp) const
+{
+    if (num_dirs == 0) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(dirset_mutex);
+    return (dirset.find(dirp) != dirset.end());
 }
 
 int posix_task::path_to_ino(const char *pathname,
@@ -333,19 +447,29 @@ int posix_task::fd_to_ino(int fd, fuse_ino_t& _ino, off_t *offset)
     }
 
     {
-        std::unique_lock<std::mutex> lock(fdmap_mutex);
-
-        auto it = fdmap.find(fd);
-        if (it == fdmap.end()) {
-            return -ENOENT;
+        struct fdinfo *fdi = get_fdinfo(fd);
+        if (!fdi) {
+            return -EBADF;
         }
 
-        _ino = ino = it->second.ino;
+        _ino = fdi->ino;
+        ino = _ino;
         if (offset) {
-            *offset = it->second.pos;
+            const std::shared_ptr<struct nofuse_file> file = get_file(fd);
+            if (!file) {
+                return -EBADF;
+            }
+            *offset = file->pos;
         }
     }
 
+    /*
+     * fd was closed by some other thread.
+     */
+    if (_ino == 0) {
+        return -EBADF;
+    }
+
 done:
 #ifdef ENABLE_PARANOID
     // This will check the magic.
@@ -416,13 +540,37 @@ ssize_t posix_task::getattr_ll(fuse_ino_t ino)
     return res;
 }
 
+int posix_task::setattr_ll(fuse_ino_t ino, struct stat *attr, int to_set)
+{
+    callback_called = false;
+    aznfsc_ll_setattr(_PXT2FR(this), ino, attr, to_set, nullptr);
+
+    wait();
+
+    AZLogDebug("[NOFUSE] setattr_ll: ino={}, to_set=0x{:x}, res={}",
+                ino, to_set, res);
+
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+
+    assert(res == 0);
+    return res;
+}
+
 ssize_t posix_task::read_ll(fuse_ino_t ino, off_t offset, size_t count)
 {
     AZLogDebug("[NOFUSE] read_ll: ino={}, offset={}, count={}",
                 ino, offset, count);
 
+    assert(count <= NOFUSE_MAX_IO_SIZE);
+    assert(read.buf != nullptr);
+
+    struct fuse_file_info fi = {};
+
     callback_called = false;
-    aznfsc_ll_read(_PXT2FR(this), ino, count, offset, nullptr);
+    aznfsc_ll_read(_PXT2FR(this), ino, count, offset, &fi);
 
     wait();
 
@@ -435,272 +583,1348 @@ ssize_t posix_task::read_ll(fuse_ino_t ino, off_t offset, size_t count)
     return res;
 }
 
-} /* namespace aznfsc */
+ssize_t posix_task::read_cached(fuse_ino_t ino,
+                                void *buf,
+                                size_t count,
+                                off_t offset)
+{
+    struct nfs_inode *inode = client->get_nfs_inode_from_ino(ino);
 
-/*
- * Following are the various fuse_reply*() functions which are re-purposed
- * for nofuse. This helps us use the exact same low level code for both fuse
- * and nofuse.
- */
+    assert(count > 0 && count <= NOFUSE_MAX_IO_SIZE);
 
-int rpc_task::fuse_reply_err(fuse_req_t req, int err)
-{
-    AZLogDebug("[NOFUSE] fuse_reply_err(req={}, err={})", fmt::ptr(req), err);
+    if (!inode->is_regfile() ||
+        !inode->has_filecache() || !inode->has_rastate()) {
+        return -1;
+    }
 
-    PXT *pxtask = _FR2PXT(req);
-    pxtask->res = -err;
+    // Revalidate if attribute cache timeout expired, as nfs_client::read().
+    inode->revalidate();
 
-    pxtask->wakeup();
-    return 0;
-}
+    /*
+     * Unless we know the file size for sure we cannot tell eof or holes,
+     * let run_read() handle it.
+     */
+    int64_t cfsize, sfsize;
+    inode->get_file_sizes(cfsize, sfsize);
+    if (cfsize == -1) {
+        return -1;
+    }
 
-int rpc_task::fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e)
-{
-    AZLogDebug("[NOFUSE] fuse_reply_entry(req={}, e={})",
-               fmt::ptr(req), fmt::ptr(e));
+    if (offset >= cfsize) {
+        INC_GBL_STATS(app_read_reqs, 1);
+        INC_GBL_STATS(zero_reads, 1);
+        return 0;
+    }
 
-    PXT *pxtask = _FR2PXT(req);
+    const size_t length = std::min((int64_t) count, cfsize - offset);
+    std::shared_ptr<bytes_chunk_cache>& filecache_handle =
+        inode->get_filecache();
 
     /*
-     * ino=0 is a special case where the entry was not found but we are
-     * returning success for -ve cacheing purpose.
+     * This is the common case of reads served from cache, which get()
+     * serves holding the chunkmap lock only in shared mode.
      */
-    if (e->ino == 0) {
-        pxtask->res = -ENOENT;
-    } else {
-        pxtask->res = 0;
-        pxtask->lookup.ino = e->ino;
-        pxtask->lookup.generation = e->generation;
-        if (pxtask->lookup.attr) {
-            *(pxtask->lookup.attr) = e->attr;
+    std::vector<bytes_chunk> bc_vec = filecache_handle->get(offset, length);
+
+    for (const bytes_chunk& bc : bc_vec) {
+        if (!bc.get_membuf()->is_uptodate()) {
+            /*
+             * Some part needs to be read from the server (or zero filled),
+             * drop our inuse counts and let run_read() do it, it'll find the
+             * same chunks.
+             */
+            for (const bytes_chunk& bc1 : bc_vec) {
+                bc1.get_membuf()->clear_inuse();
+            }
+            return -1;
         }
     }
 
-    pxtask->wakeup();
-    return 0;
-}
+    // See run_read() for why these are done before copying.
+    inode->get_rastate()->on_application_read(offset, length);
+    inode->get_rastate()->issue_readaheads();
 
-int rpc_task::fuse_reply_readlink(fuse_req_t req, const char *linkname)
-{
-    AZLogDebug("[NOFUSE] fuse_reply_readlink(req={}, linkname={})",
-               fmt::ptr(req), linkname);
+    size_t copied = 0;
+    for (const bytes_chunk& bc : bc_vec) {
+        assert(bc.offset == (uint64_t) (offset + copied));
 
-    PXT *pxtask = _FR2PXT(req);
+        ::memcpy((uint8_t *) buf + copied, bc.get_buffer(), bc.length);
+        copied += bc.length;
 
-    assert(pxtask->readlink.buf != nullptr);
-    assert(pxtask->readlink.bufsiz != 0);
+        bc.get_membuf()->on_app_read(bc.offset, bc.length);
+        bc.get_membuf()->clear_inuse();
+    }
 
-    const size_t copylen = ::strnlen(linkname, pxtask->readlink.bufsiz);
+    assert(copied == length);
 
-    /*
-     * readlink(3) manpage says this about the return:
-     * On success, these calls return the number of bytes placed in buf.
-     * (If  the  returned value equals bufsiz, then truncation may have
-     * occurred.)  On error, -1 is returned and errno is set to indicate
-     * the error.
-     * Also,
-     * readlink() does not append a null byte to buf.
-     */
-    ::strncpy(pxtask->readlink.buf, linkname, copylen);
-    pxtask->readlink.bufsiz = copylen;
+    INC_GBL_STATS(app_read_reqs, 1);
+    INC_GBL_STATS(bytes_read_from_cache, copied);
+    INC_GBL_STATS(app_bytes_read, copied);
 
-    pxtask->res = pxtask->readlink.bufsiz;
+    AZLogDebug("[NOFUSE] read_cached: ino={}, offset={}, count={}, "
+               "read {} bytes from {} chunks",
+               ino, offset, count, copied, bc_vec.size());
 
-    pxtask->wakeup();
-    return 0;
+    return copied;
 }
 
-int rpc_task::fuse_reply_attr(fuse_req_t req,
-                              const struct stat *attr,
-                              double attr_timeout)
+ssize_t posix_task::pread_ino(fuse_ino_t ino,
+                              void *buf,
+                              size_t count,
+                              off_t offset)
 {
-    AZLogDebug("[NOFUSE] fuse_reply_attr(req={}, attr_timeout={})",
-               fmt::ptr(req), attr_timeout);
+    size_t done = 0;
+
+    while (done < count) {
+        const size_t chunk = std::min(count - done,
+                                      (size_t) NOFUSE_MAX_IO_SIZE);
+        uint8_t *const chunk_buf = (uint8_t *) buf + done;
+
+        ssize_t ret = read_cached(ino, chunk_buf, chunk, offset + done);
+        if (ret < 0) {
+            read.buf = chunk_buf;
+            read.count = chunk;
+
+            ret = read_ll(ino, offset + done, chunk);
+            if (ret < 0) {
+                // Return what we have read, if any.
+                return (done > 0) ? (ssize_t) done : -1;
+            }
+        }
 
-    PXT *pxtask = _FR2PXT(req);
+        assert((size_t) ret <= chunk);
+        done += ret;
 
-    if (pxtask->getattr.statbuf) {
-        *(pxtask->getattr.statbuf) = *attr;
+        // Short read means eof.
+        if ((size_t) ret < chunk) {
+            break;
+        }
     }
 
-    pxtask->res = 0;
-    pxtask->wakeup();
-    return 0;
+    return done;
 }
 
-int rpc_task::fuse_reply_iov(fuse_req_t req, const struct iovec *iov, int count)
+ssize_t posix_task::write_ll(fuse_ino_t ino,
+                             const void *buf,
+                             size_t count,
+                             off_t offset)
 {
-    AZLogDebug("[NOFUSE] fuse_reply_iov(req={}, count={})",
-               fmt::ptr(req), count);
+    AZLogDebug("[NOFUSE] write_ll: ino={}, offset={}, count={}",
+                ino, offset, count);
 
-    assert((iov == nullptr) == (count == 0));
+    assert(count <= NOFUSE_MAX_IO_SIZE);
 
-    PXT *pxtask = _FR2PXT(req);
-    off_t copied = 0;
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(count);
+    bufv.buf[0].mem = const_cast<void *>(buf);
 
-    /*
-     * fuse_reply_iov() is called with iov=nullptr on eof.
-     */
-    if (iov == nullptr) {
-        goto done;
-    }
+    struct fuse_file_info fi = {};
 
-    /*
-     * Copy data from iov into the caller supplied buffer.
-     */
-    for (int i = 0; i < count; i++) {
-        ::memcpy((uint8_t *) pxtask->read.buf + copied,
-                 iov[i].iov_base,
-                 iov[i].iov_len);
-        copied += iov[i].iov_len;
+    callback_called = false;
+    aznfsc_ll_write_buf(_PXT2FR(this), ino, &bufv, offset, &fi);
+
+    wait();
+
+    if (res < 0) {
+        errno = -res;
+        return -1;
     }
 
+    assert(res >= 0 && (size_t) res <= count);
+    return res;
+}
+
+ssize_t posix_task::pwrite_ino(fuse_ino_t ino,
+                               const void *buf,
+                               size_t count,
+                               off_t offset)
+{
+    size_t done = 0;
+
     /*
-     * Update the file position.
+     * Hold the write lock across the whole IO so that writes from different
+     * threads are not interleaved at NOFUSE_MAX_IO_SIZE granularity.
      */
-    pxtask->fd_add_pos(pxtask->read.fd, copied);
+    std::unique_lock<std::mutex> lock(
+            write_mutex[ino % NOFUSE_WRITE_LOCK_SHARDS]);
 
-done:
-    pxtask->res = copied;
-    assert(pxtask->res >= 0);
-    pxtask->wakeup();
-    return 0;
-}
+    while (done < count) {
+        const size_t chunk = std::min(count - done,
+                                      (size_t) NOFUSE_MAX_IO_SIZE);
 
-/*
- * TODO: Make this return proper values.
- */
-const struct fuse_ctx *rpc_task::fuse_req_ctx(fuse_req_t req)
-{
-    [[maybe_unused]] PXT *pxtask = _FR2PXT(req);
-    static struct fuse_ctx ctx = {0, 0, 100, 0};
-    return &ctx;
+        const ssize_t ret = write_ll(ino, (const uint8_t *) buf + done,
+                                     chunk, offset + done);
+        if (ret < 0) {
+            return (done > 0) ? (ssize_t) done : -1;
+        }
+
+        done += ret;
+
+        if ((size_t) ret < chunk) {
+            break;
+        }
+    }
+
+    return done;
 }
 
-extern "C" {
+off_t posix_task::get_file_size(fuse_ino_t ino)
+{
+    const struct nfs_inode *inode = client->get_nfs_inode_from_ino(ino);
 
-#define CHECK_AND_CALL_ORIG_FUNC_FOR_PATHNAME(pathname, func, force, retonfail, ...) \
-do { \
-    if (!init_done || in_cleanup || force || !pxtask.path_in_mountpoint(pathname)) { \
-        /* \
-         * If pathname is not in mountpoint then call the original function. \
-         */ \
-        if (!PXT::__##func##_orig) { \
-            PXT::__##func##_orig = \
-                (decltype(PXT::__##func##_orig)) ::dlsym(RTLD_NEXT, #func); \
-            if (!PXT::__##func##_orig) { \
-                AZLogError("[NOFUSE] dlsym({}) failed: {}", \
-                           #func, ::dlerror()); \
-                errno = ENOENT; \
-                return retonfail; \
-            } \
-        } \
-        AZLogDebug("[NOFUSE] {}={}", #func, fmt::ptr(PXT::__##func##_orig)); \
-        return PXT::__##func##_orig(__VA_ARGS__); \
-    } \
-} while (0)
+    const int64_t cfsize = inode->get_client_file_size();
+    if (cfsize != -1) {
+        return cfsize;
+    }
 
-#define CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, func, force, ...) \
-do { \
-    if (!init_done || in_cleanup || force || !pxtask.fd_in_mountpoint(fd)) { \
-        /* \
-         * If fd is not in mountpoint then call the original function. \
-         */ \
-        if (!PXT::__##func##_orig) { \
-            PXT::__##func##_orig = \
-                (decltype(PXT::__##func##_orig)) ::dlsym(RTLD_NEXT, #func); \
-            if (!PXT::__##func##_orig) { \
-                AZLogError("[NOFUSE] dlsym({}) failed: {}", \
-                           #func, ::dlerror()); \
-                errno = ENOENT; \
-                return -1; \
-            } \
-        } \
-        AZLogDebug("[NOFUSE] {}={}", #func, fmt::ptr(PXT::__##func##_orig)); \
-        return PXT::__##func##_orig(__VA_ARGS__); \
-    } \
-} while (0)
+    struct stat statbuf;
+    getattr.statbuf = &statbuf;
 
-#define PATH_TO_INO(pathname) \
-({ \
-    fuse_ino_t ino; \
-    const int ret = pxtask.path_to_ino(pathname, \
-                                       false /* follow_symlink */, \
-                                       ino); \
-    if (ret != 0) { \
-        assert(ret > 0); \
-        AZLogError("[NOFUSE] {}: path_to_ino({}) failed, setting errno={}", \
-                   __FUNCTION__, pathname, -ret); \
-        errno = -ret; \
-        return -1; \
-    } \
-    ino; \
-})
+    if (getattr_ll(ino) != 0) {
+        return -1;
+    }
 
-#define FD_TO_INO(fd, off) \
-({ \
-    fuse_ino_t ino; \
-    const int ret = pxtask.fd_to_ino(fd, ino, off); \
-    if (ret != 0) { \
-        assert(ret > 0); \
-        AZLogError("[NOFUSE] {}: fd_to_ino({}) failed, setting errno={}", \
-                   __FUNCTION__, fd, -ret); \
-        errno = -ret; \
-        return -1; \
-    } \
-    ino; \
-})
+    return statbuf.st_size;
+}
 
-int __xstat(int ver, const char *pathname, struct stat *statbuf)
+int posix_task::open_ll(fuse_ino_t ino, int flags)
 {
-    AZLogDebug("[NOFUSE] INTERCEPT: __xstat(ver={}, pathname={})",
-               ver, pathname);
+    struct fuse_file_info fi = {};
+    fi.flags = flags;
 
-    const bool force = (!pathname);
+    callback_called = false;
+    aznfsc_ll_open(_PXT2FR(this), ino, &fi);
 
+    wait();
+
+    AZLogDebug("[NOFUSE] open_ll: ino={}, flags=0x{:x}, res={}",
+                ino, flags, res);
+
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+
+    assert(res == 0);
+    return res;
+}
+
+int posix_task::create_ll(fuse_ino_t parent_ino, const char *filename,
+                          mode_t mode, int flags, fuse_ino_t& ino)
+{
+    struct fuse_file_info fi = {};
+    fi.flags = flags;
+
+    callback_called = false;
+    aznfsc_ll_create(_PXT2FR(this), parent_ino, filename, mode, &fi);
+
+    wait();
+
+    ino = lookup.ino;
+
+    AZLogDebug("[NOFUSE] create_ll: parent_ino={}, filename={}, "
+               "mode=0{:03o}, flags=0x{:x}, res={}, ino={}",
+                parent_ino, filename, mode, flags, res, ino);
+
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+
+    assert(res == 0);
+    return res;
+}
+
+int posix_task::release_ll(fuse_ino_t ino)
+{
+    struct fuse_file_info fi = {};
+
+    /*
+     * For the last close of a file this flushes the dirty data and res will
+     * have the flush status.
+     */
+    callback_called = false;
+    aznfsc_ll_release(_PXT2FR(this), ino, &fi);
+
+    wait();
+
+    AZLogDebug("[NOFUSE] release_ll: ino={}, res={}", ino, res);
+
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+
+    assert(res == 0);
+    return res;
+}
+
+int posix_task::flush_ll(fuse_ino_t ino)
+{
+    struct fuse_file_info fi = {};
+
+    callback_called = false;
+    aznfsc_ll_flush(_PXT2FR(this), ino, &fi);
+
+    wait();
+
+    AZLogDebug("[NOFUSE] flush_ll: ino={}, res={}", ino, res);
+
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+
+    assert(res == 0);
+    return res;
+}
+
+int posix_task::opendir_ll(fuse_ino_t ino)
+{
+    struct fuse_file_info fi = {};
+
+    callback_called = false;
+    aznfsc_ll_opendir(_PXT2FR(this), ino, &fi);
+
+    wait();
+
+    AZLogDebug("[NOFUSE] opendir_ll: ino={}, res={}", ino, res);
+
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+
+    assert(res == 0);
+    return res;
+}
+
+int posix_task::releasedir_ll(fuse_ino_t ino)
+{
+    struct fuse_file_info fi = {};
+
+    callback_called = false;
+    aznfsc_ll_releasedir(_PXT2FR(this), ino, &fi);
+
+    wait();
+
+    AZLogDebug("[NOFUSE] releasedir_ll: ino={}, res={}", ino, res);
+
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+
+    assert(res == 0);
+    return res;
+}
+
+ssize_t posix_task::readdir_ll(fuse_ino_t ino, off_t offset)
+{
+    assert(readdir.buf != nullptr);
+    assert(readdir.size > 0);
+
+    struct fuse_file_info fi = {};
+
+    callback_called = false;
+    aznfsc_ll_readdir(_PXT2FR(this), ino, readdir.size, offset, &fi);
+
+    wait();
+
+    AZLogDebug("[NOFUSE] readdir_ll: ino={}, offset={}, size={}, res={}",
+                ino, offset, readdir.size, res);
+
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+
+    assert((size_t) res <= readdir.size);
+    return res;
+}
+
+} /* namespace aznfsc */
+
+/*
+ * Following are the various fuse_reply*() functions which are re-purposed
+ * for nofuse. This helps us use the exact same low level code for both fuse
+ * and nofuse.
+ */
+
+int rpc_task::fuse_reply_err(fuse_req_t req, int err)
+{
+    AZLogDebug("[NOFUSE] fuse_reply_err(req={}, err={})", fmt::ptr(req), err);
+
+    PXT *pxtask = _FR2PXT(req);
+    pxtask->res = -err;
+
+    pxtask->wakeup();
+    return 0;
+}
+
+int rpc_task::fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e)
+{
+    AZLogDebug("[NOFUSE] fuse_reply_entry(req={}, e={})",
+               fmt::ptr(req), fmt::ptr(e));
+
+    PXT *pxtask = _FR2PXT(req);
+
+    /*
+     * ino=0 is a special case where the entry was not found but we are
+     * returning success for -ve cacheing purpose.
+     */
+    if (e->ino == 0) {
+        pxtask->res = -ENOENT;
+    } else {
+        pxtask->res = 0;
+        pxtask->lookup.ino = e->ino;
+        pxtask->lookup.generation = e->generation;
+        if (pxtask->lookup.attr) {
+            *(pxtask->lookup.attr) = e->attr;
+        }
+    }
+
+    pxtask->wakeup();
+    return 0;
+}
+
+int rpc_task::fuse_reply_create(fuse_req_t req,
+                                const struct fuse_entry_param *e,
+                                const struct fuse_file_info *f)
+{
+    AZLogDebug("[NOFUSE] fuse_reply_create(req={}, e={}, f={})",
+               fmt::ptr(req), fmt::ptr(e), fmt::ptr(f));
+
+    PXT *pxtask = _FR2PXT(req);
+
+    // create always returns a valid inode, see reply_create().
+    assert(e->ino != 0);
+
+    pxtask->res = 0;
+    pxtask->lookup.ino = e->ino;
+    pxtask->lookup.generation = e->generation;
+    if (pxtask->lookup.attr) {
+        *(pxtask->lookup.attr) = e->attr;
+    }
+
+    pxtask->wakeup();
+    return 0;
+}
+
+int rpc_task::fuse_reply_readlink(fuse_req_t req, const char *linkname)
+{
+    AZLogDebug("[NOFUSE] fuse_reply_readlink(req={}, linkname={})",
+               fmt::ptr(req), linkname);
+
+    PXT *pxtask = _FR2PXT(req);
+
+    assert(pxtask->readlink.buf != nullptr);
+    assert(pxtask->readlink.bufsiz != 0);
+
+    const size_t copylen = ::strnlen(linkname, pxtask->readlink.bufsiz);
+
+    /*
+     * readlink(3) manpage says this about the return:
+     * On success, these calls return the number of bytes placed in buf.
+     * (If  the  returned value equals bufsiz, then truncation may have
+     * occurred.)  On error, -1 is returned and errno is set to indicate
+     * the error.
+     * Also,
+     * readlink() does not append a null byte to buf.
+     */
+    ::strncpy(pxtask->readlink.buf, linkname, copylen);
+    pxtask->readlink.bufsiz = copylen;
+
+    pxtask->res = pxtask->readlink.bufsiz;
+
+    pxtask->wakeup();
+    return 0;
+}
+
+int rpc_task::fuse_reply_attr(fuse_req_t req,
+                              const struct stat *attr,
+                              double attr_timeout)
+{
+    AZLogDebug("[NOFUSE] fuse_reply_attr(req={}, attr_timeout={})",
+               fmt::ptr(req), attr_timeout);
+
+    PXT *pxtask = _FR2PXT(req);
+
+    if (pxtask->getattr.statbuf) {
+        *(pxtask->getattr.statbuf) = *attr;
+    }
+
+    pxtask->res = 0;
+    pxtask->wakeup();
+    return 0;
+}
+
+int rpc_task::fuse_reply_iov(fuse_req_t req, const struct iovec *iov, int count)
+{
+    AZLogDebug("[NOFUSE] fuse_reply_iov(req={}, count={})",
+               fmt::ptr(req), count);
+
+    assert((iov == nullptr) == (count == 0));
+
+    PXT *pxtask = _FR2PXT(req);
+    off_t copied = 0;
+
+    /*
+     * fuse_reply_iov() is called with iov=nullptr on eof.
+     */
+    if (iov == nullptr) {
+        goto done;
+    }
+
+    /*
+     * Copy data from iov into the caller supplied buffer.
+     */
+    for (int i = 0; i < count; i++) {
+        assert((copied + iov[i].iov_len) <= pxtask->read.count);
+        ::memcpy((uint8_t *) pxtask->read.buf + copied,
+                 iov[i].iov_base,
+                 iov[i].iov_len);
+        copied += iov[i].iov_len;
+    }
+
+    /*
+     * Caller updates the file position, as needed.
+     */
+done:
+    pxtask->res = copied;
+    assert(pxtask->res >= 0);
+    pxtask->wakeup();
+    return 0;
+}
+
+int rpc_task::fuse_reply_write(fuse_req_t req, size_t count)
+{
+    AZLogDebug("[NOFUSE] fuse_reply_write(req={}, count={})",
+               fmt::ptr(req), count);
+
+    PXT *pxtask = _FR2PXT(req);
+
+    pxtask->res = count;
+    pxtask->wakeup();
+    return 0;
+}
+
+int rpc_task::fuse_reply_buf(fuse_req_t req, const char *buf, size_t size)
+{
+    AZLogDebug("[NOFUSE] fuse_reply_buf(req={}, size={})",
+               fmt::ptr(req), size);
+
+    PXT *pxtask = _FR2PXT(req);
+
+    /*
+     * Only readdir replies with a buffer, which holds dirents added by
+     * fuse_add_direntry() below.
+     */
+    assert(pxtask->readdir.buf != nullptr);
+    assert(size <= pxtask->readdir.size);
+
+    ::memcpy(pxtask->readdir.buf, buf, size);
+
+    pxtask->res = size;
+    pxtask->wakeup();
+    return 0;
+}
+
+/*
+ * Add a struct dirent, as returned by readdir(3), for the given entry.
+ * Like the fuse version, if bufsize is not sufficient it doesn't add the
+ * entry but returns the size needed.
+ */
+size_t rpc_task::fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
+                                   const char *name, const struct stat *stbuf,
+                                   off_t off)
+{
+    const size_t namelen = ::strlen(name);
+    const size_t entsize =
+        (offsetof(struct dirent, d_name) + namelen + 1 + 7) & ~((size_t) 7);
+
+    assert(namelen < sizeof(((struct dirent *) nullptr)->d_name));
+
+    if (entsize > bufsize) {
+        return entsize;
+    }
+
+    struct dirent *de = (struct dirent *) buf;
+
+    de->d_ino = stbuf->st_ino;
+    de->d_off = off;
+    de->d_reclen = entsize;
+    de->d_type = IFTODT(stbuf->st_mode);
+    ::memcpy(de->d_name, name, namelen + 1);
+
+    return entsize;
+}
+
+/*
+ * TODO: Make this return proper values.
+ */
+const struct fuse_ctx *rpc_task::fuse_req_ctx(fuse_req_t req)
+{
+    [[maybe_unused]] PXT *pxtask = _FR2PXT(req);
+    static struct fuse_ctx ctx = {0, 0, 100, 0};
+    return &ctx;
+}
+
+extern "C" {
+
+/*
+ * Call the original libc function, resolving it if not already done.
+ */
+#define CALL_ORIG_FUNC(func, retonfail, ...) \
+do { \
+    if (!PXT::__##func##_orig) { \
+        PXT::__##func##_orig = \
+            (decltype(PXT::__##func##_orig)) ::dlsym(RTLD_NEXT, #func); \
+        if (!PXT::__##func##_orig) { \
+            AZLogError("[NOFUSE] dlsym({}) failed: {}", \
+                       #func, ::dlerror()); \
+            errno = ENOENT; \
+            return retonfail; \
+        } \
+    } \
+    AZLogDebug("[NOFUSE] {}={}", #func, fmt::ptr(PXT::__##func##_orig)); \
+    return PXT::__##func##_orig(__VA_ARGS__); \
+} while (0)
+
+#define CHECK_AND_CALL_ORIG_FUNC_FOR_PATHNAME(pathname, func, force, retonfail, ...) \
+do { \
+    if (!init_done || in_cleanup || force || !pxtask.path_in_mountpoint(pathname)) { \
+        /* \
+         * If pathname is not in mountpoint then call the original function. \
+         */ \
+        CALL_ORIG_FUNC(func, retonfail, __VA_ARGS__); \
+    } \
+} while (0)
+
+#define CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, func, force, ...) \
+do { \
+    if (!init_done || in_cleanup || force || !pxtask.fd_in_mountpoint(fd)) { \
+        /* \
+         * If fd is not in mountpoint then call the original function. \
+         */ \
+        CALL_ORIG_FUNC(func, -1, __VA_ARGS__); \
+    } \
+} while (0)
+
+#define CHECK_AND_CALL_ORIG_FUNC_FOR_DIR(dirp, func, retonfail, ...) \
+do { \
+    if (!init_done || in_cleanup || !pxtask.dir_in_mountpoint(dirp)) { \
+        /* \
+         * If dirp is not returned by our opendir() then call the original \
+         * function. \
+         */ \
+        CALL_ORIG_FUNC(func, retonfail, __VA_ARGS__); \
+    } \
+} while (0)
+
+#define PATH_TO_INO(pathname) \
+({ \
+    fuse_ino_t ino; \
+    const int ret = pxtask.path_to_ino(pathname, \
+                                       false /* follow_symlink */, \
+                                       ino); \
+    if (ret != 0) { \
+        assert(ret < 0); \
+        AZLogError("[NOFUSE] {}: path_to_ino({}) failed, setting errno={}", \
+                   __FUNCTION__, pathname, -ret); \
+        errno = -ret; \
+        return -1; \
+    } \
+    ino; \
+})
+
+#define FD_TO_INO(fd, off) \
+({ \
+    fuse_ino_t ino; \
+    const int ret = pxtask.fd_to_ino(fd, ino, off); \
+    if (ret != 0) { \
+        assert(ret < 0); \
+        AZLogError("[NOFUSE] {}: fd_to_ino({}) failed, setting errno={}", \
+                   __FUNCTION__, fd, -ret); \
+        errno = -ret; \
+        return -1; \
+    } \
+    ino; \
+})
+
+/*
+ * Get a ref on the open file description of an fd which
+ * CHECK_AND_CALL_ORIG_FUNC_FOR_FD() found to be ours, failing with EBADF if
+ * it has been closed since.
+ */
+#define FD_TO_FILE(fd) \
+({ \
+    std::shared_ptr<struct nofuse_file> file = PXT::get_file(fd); \
+    if (!file) { \
+        errno = EBADF; \
+        return -1; \
+    } \
+    file; \
+})
+
+int __xstat(int ver, const char *pathname, struct stat *statbuf)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: __xstat(ver={}, pathname={})",
+               ver, pathname);
+
+    const bool force = (!pathname);
+
+    /*
+     * POSIX task for tracking this request.
+     */
+    PXT pxtask;
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_PATHNAME(pathname,
+                                          __xstat,
+                                          force,
+                                          -1,
+                                          ver, pathname, statbuf);
+
+    /*
+     * Path is inside mountpoint, need to make the aznfsc_ll_getattr call.
+     * That needs the inode number to identify the target.
+     */
+    const fuse_ino_t ino = PATH_TO_INO(pathname);
+
+    pxtask.getattr.statbuf = statbuf;
+
+    return pxtask.getattr_ll(ino);
+}
+
+int __fxstat(int ver, int fd, struct stat *statbuf)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: __xfstat(ver={}, fd={})",
+               ver, fd);
+
+    const bool force = false;
+
+    /*
+     * POSIX task for tracking this request.
+     */
+    PXT pxtask;
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd,
+                                    __fxstat,
+                                    force,
+                                    ver, fd, statbuf);
+
+    /*
+     * Path is inside mountpoint, need to make the aznfsc_ll_getattr call.
+     * That needs the inode number to identify the target.
+     */
+    const fuse_ino_t ino = FD_TO_INO(fd, nullptr);
+
+    pxtask.getattr.statbuf = statbuf;
+
+    return pxtask.getattr_ll(ino);
+}
+
+ssize_t readlink(const char *pathname, char *buf, size_t bufsiz)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: readlink(pathname={}, buf={}, bufsiz={})",
+               pathname, fmt::ptr(buf), bufsiz);
+
+    const bool force = (!pathname || ((int) bufsiz <= 0));
+
+    /*
+     * POSIX task for tracking this request.
+     */
+    PXT pxtask;
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_PATHNAME(pathname,
+                                          readlink,
+                                          force,
+                                          -1,
+                                          pathname, buf, bufsiz);
+
+    /*
+     * Path is inside mountpoint, need to make the aznfsc_ll_readlink call.
+     * That needs the inode number to identify the symlink.
+     */
+    const fuse_ino_t ino = PATH_TO_INO(pathname);
+
+    pxtask.readlink.buf = buf;
+    pxtask.readlink.bufsiz = bufsiz;
+
+    return pxtask.readlink_ll(ino);
+}
+
+int open(const char *pathname, int flags, ...)
+{
+    mode_t mode = 0;
+
+    if ((flags & O_CREAT) != 0 || (flags & O_TMPFILE) != 0) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+
+    AZLogDebug("[NOFUSE] INTERCEPT: open(pathname={}, flags=0x{:x}, mode=0{:03o})",
+               pathname, flags, mode);
+
+    const bool force = (!pathname);
+
+    /*
+     * POSIX task for tracking this request.
+     */
+    PXT pxtask;
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_PATHNAME(pathname,
+                                          open,
+                                          force,
+                                          -1,
+                                          pathname, flags, mode);
+
+    /*
+     * As the kernel does for fuse, O_CREAT is a LOOKUP followed by a CREATE
+     * if the file doesn't exist. CREATE is GUARDED for O_EXCL so that we
+     * fail with EEXIST if the file got created in between.
+     */
+    fuse_ino_t ino = 0;
+    bool created = false;
+
+    if ((flags & O_CREAT) && !is_root_dir(pathname)) {
+        const std::filesystem::path path(pathname);
+        const fuse_ino_t parent_ino = PATH_TO_INO(path.parent_path().c_str());
+
+        if (pxtask.lookup_ll(parent_ino, path.filename().c_str(),
+                             false /* follow_symlink */, ino) == 0) {
+            if (flags & O_EXCL) {
+                errno = EEXIST;
+                return -1;
+            }
+        } else if (errno != ENOENT) {
+            return -1;
+        } else {
+            // Kernel applies the umask before sending FUSE_CREATE.
+            const mode_t mask = ::umask(0);
+            ::umask(mask);
+
+            if (pxtask.create_ll(parent_ino, path.filename().c_str(),
+                                 (mode & ~mask), flags, ino) != 0) {
+                return -1;
+            }
+            created = true;
+        }
+    } else {
+        ino = PATH_TO_INO(pathname);
+    }
+
+    const bool is_dir = pxtask.client->get_nfs_inode_from_ino(ino)->is_dir();
+
+    if ((flags & O_DIRECTORY) && !is_dir) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    if (is_dir &&
+        ((flags & (O_CREAT | O_TRUNC)) || ((flags & O_ACCMODE) != O_RDONLY))) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    /*
+     * Let the inode know of the open, for cto consistency and for allocating
+     * the file cache. create_ll() has already done it for a new file.
+     */
+    if (!created) {
+        const int ret = is_dir ? pxtask.opendir_ll(ino) :
+                                 pxtask.open_ll(ino, flags);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+
+    /*
+     * O_TRUNC is a SETATTR(size=0) after the open, same as fuse does w/o
+     * FUSE_CAP_ATOMIC_O_TRUNC. A new file is already empty.
+     */
+    if ((flags & O_TRUNC) && !created &&
+        pxtask.client->get_nfs_inode_from_ino(ino)->is_regfile()) {
+        struct stat attr = {};
+
+        if (pxtask.setattr_ll(ino, &attr, FUSE_SET_ATTR_SIZE) != 0) {
+            const int error = errno;
+            pxtask.release_ll(ino);
+            errno = error;
+            return -1;
+        }
+    }
+
+    const int fd = pxtask.fd_alloc(ino, flags);
+    if (fd < 0) {
+        if (is_dir) {
+            pxtask.releasedir_ll(ino);
+        } else {
+            pxtask.release_ll(ino);
+        }
+        errno = -fd;
+        return -1;
+    }
+
+    assert(fd > 0);
+    return fd;
+}
+
+int openat(int dirfd, const char *pathname, int flags, ...)
+{
+    mode_t mode = 0;
+
+    if ((flags & O_CREAT) != 0 || (flags & O_TMPFILE) != 0) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+
+    AZLogDebug("[NOFUSE] INTERCEPT: openat(dirfd={}, pathname={}, flags={}, mode={})",
+               dirfd, pathname, flags, mode);
+
+    // XXX Not implemented.
+
+    errno = ENOENT;
+    return -1;
+}
+
+FILE *fopen(const char *pathname, const char *mode)
+{
+    AZLogWarn("[NOFUSE] INTERCEPT: fopen(pathname={}, mode={})",
+              pathname, mode);
+    AZLogWarn("[NOFUSE] fopen not supported, bypassing! If this is your "
+              "target file it won't work!");
+
+    /*
+     * TODO: We don't support fopen/fclose/fread/fwrite.
+     *       Bypass every call.
+     */
     /*
      * POSIX task for tracking this request.
      */
     PXT pxtask;
 
-    CHECK_AND_CALL_ORIG_FUNC_FOR_PATHNAME(pathname,
-                                          __xstat,
-                                          force,
-                                          -1,
-                                          ver, pathname, statbuf);
+    CHECK_AND_CALL_ORIG_FUNC_FOR_PATHNAME(pathname,
+                                          fopen,
+                                          true,
+                                          NULL,
+                                          pathname, mode);
+    assert(0);
+    return NULL;
+}
+
+int close(int fd)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: close(fd={})", fd);
+
+    PXT pxtask;
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, close, false, fd);
+
+    const fuse_ino_t ino = FD_TO_INO(fd, nullptr);
+
+    pxtask.fd_remove_from_map(fd);
+
+    // Release the fd number reserved in fd_alloc().
+    ::syscall(SYS_close, fd);
+
+    /*
+     * Drop the open count taken in open(). For the last close of a file this
+     * flushes the dirty data and returns the flush status, so that the
+     * application gets to know of write failures.
+     */
+    if (pxtask.client->get_nfs_inode_from_ino(ino)->is_dir()) {
+        return pxtask.releasedir_ll(ino);
+    }
+
+    return pxtask.release_ll(ino);
+}
+
+int dup(int oldfd)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: dup(oldfd={})", oldfd);
+
+    PXT pxtask;
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(oldfd, dup, false, oldfd);
+
+    /*
+     * newfd refers to the same open file description as oldfd, so they
+     * share the file position and flags.
+     */
+    const std::shared_ptr<struct nofuse_file> file = FD_TO_FILE(oldfd);
+    const fuse_ino_t ino = FD_TO_INO(oldfd, nullptr);
+
+    // Each fd holds an open count on the inode, see close().
+    const bool is_dir = pxtask.client->get_nfs_inode_from_ino(ino)->is_dir();
+    if ((is_dir ? pxtask.opendir_ll(ino) :
+                  pxtask.open_ll(ino, file->flags)) != 0) {
+        return -1;
+    }
+
+    /*
+     * Duplicate the reserved fd, this gets us a new unique fd number.
+     */
+    const int newfd = ::syscall(SYS_fcntl, oldfd, F_DUPFD_CLOEXEC, 0);
+    if (newfd < 0 || newfd >= NOFUSE_MAX_FDS) {
+        const int error = (newfd < 0) ? errno : EMFILE;
+        if (newfd >= 0) {
+            ::syscall(SYS_close, newfd);
+        }
+        if (is_dir) {
+            pxtask.releasedir_ll(ino);
+        } else {
+            pxtask.release_ll(ino);
+        }
+        errno = error;
+        return -1;
+    }
+
+    pxtask.fd_add_to_map(newfd, file);
+    return newfd;
+}
+
+int dup2(int oldfd, int newfd)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: dup2(oldfd={}, newfd={})",
+               oldfd, newfd);
+    PXT pxtask;
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(oldfd, dup2, false, oldfd, newfd);
+
+    // See dup().
+    const std::shared_ptr<struct nofuse_file> file = FD_TO_FILE(oldfd);
+    const fuse_ino_t ino = FD_TO_INO(oldfd, nullptr);
+
+    if (oldfd == newfd) {
+        return newfd;
+    }
+
+    if (newfd < 0 || newfd >= NOFUSE_MAX_FDS) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /*
+     * dup2() silently closes newfd, if that's ours we need to drop its
+     * open count. Errors are ignored, as with dup2().
+     */
+    if (PXT::get_fdinfo(newfd)) {
+        close(newfd);
+    }
+
+    const bool is_dir = pxtask.client->get_nfs_inode_from_ino(ino)->is_dir();
+    if ((is_dir ? pxtask.opendir_ll(ino) :
+                  pxtask.open_ll(ino, file->flags)) != 0) {
+        return -1;
+    }
+
+    /*
+     * Make newfd a copy of our reserved fd, this closes whatever newfd
+     * referred to in the kernel.
+     */
+    if (::syscall(SYS_dup3, oldfd, newfd, O_CLOEXEC) < 0) {
+        const int error = errno;
+        if (is_dir) {
+            pxtask.releasedir_ll(ino);
+        } else {
+            pxtask.release_ll(ino);
+        }
+        errno = error;
+        return -1;
+    }
+
+    pxtask.fd_add_to_map(newfd, file);
+    return newfd;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: read(fd={}, buf={}, count={})",
+               fd, fmt::ptr(buf), count);
+
+    PXT pxtask;
+    const bool force = aznfsc_cfg.mountpoint.empty();
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, read, force, fd, buf, count);
+
+    const std::shared_ptr<struct nofuse_file> file = FD_TO_FILE(fd);
+    const fuse_ino_t ino = FD_TO_INO(fd, nullptr);
+
+    if (!file->is_readable()) {
+        errno = EBADF;
+        return -1;
+    }
+
+    std::unique_lock<std::mutex> lock(file->pos_mutex);
+
+    const ssize_t ret = pxtask.pread_ino(ino, buf, count, file->pos);
+    if (ret > 0) {
+        file->pos += ret;
+    }
+
+    return ret;
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: pread(fd={}, buf={}, count={}, "
+               "offset={})", fd, fmt::ptr(buf), count, offset);
+
+    PXT pxtask;
+    const bool force = aznfsc_cfg.mountpoint.empty();
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, pread, force, fd, buf, count, offset);
+
+    const std::shared_ptr<struct nofuse_file> file = FD_TO_FILE(fd);
+    const fuse_ino_t ino = FD_TO_INO(fd, nullptr);
+
+    if (!file->is_readable()) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return pxtask.pread_ino(ino, buf, count, offset);
+}
+
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: preadv(fd={}, iovcnt={}, offset={})",
+               fd, iovcnt, offset);
+
+    PXT pxtask;
+    const bool force = aznfsc_cfg.mountpoint.empty();
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, preadv, force,
+                                    fd, iov, iovcnt, offset);
+
+    const std::shared_ptr<struct nofuse_file> file = FD_TO_FILE(fd);
+    const fuse_ino_t ino = FD_TO_INO(fd, nullptr);
+
+    if (!file->is_readable()) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (offset < 0 || iovcnt < 0 || iovcnt > IOV_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t done = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        const ssize_t ret = pxtask.pread_ino(ino,
+                                             iov[i].iov_base,
+                                             iov[i].iov_len,
+                                             offset + done);
+        if (ret < 0) {
+            return (done > 0) ? (ssize_t) done : -1;
+        }
+
+        done += ret;
+
+        if ((size_t) ret < iov[i].iov_len) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: write(fd={}, buf={}, count={})",
+               fd, fmt::ptr(buf), count);
+
+    PXT pxtask;
+    const bool force = aznfsc_cfg.mountpoint.empty();
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, write, force, fd, buf, count);
+
+    const std::shared_ptr<struct nofuse_file> file = FD_TO_FILE(fd);
+    const fuse_ino_t ino = FD_TO_INO(fd, nullptr);
+
+    if (!file->is_writable()) {
+        errno = EBADF;
+        return -1;
+    }
+
+    std::unique_lock<std::mutex> lock(file->pos_mutex);
+
+    /*
+     * Note: As with any NFS client, O_APPEND writes from different
+     *       clients (or processes) are not atomic, we append at the
+     *       file size we know.
+     */
+    if (file->flags & O_APPEND) {
+        const off_t size = pxtask.get_file_size(ino);
+        if (size < 0) {
+            return -1;
+        }
+        file->pos = size;
+    }
+
+    const ssize_t ret = pxtask.pwrite_ino(ino, buf, count, file->pos);
+    if (ret > 0) {
+        file->pos += ret;
+    }
+
+    return ret;
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: pwrite(fd={}, buf={}, count={}, "
+               "offset={})", fd, fmt::ptr(buf), count, offset);
+
+    PXT pxtask;
+    const bool force = aznfsc_cfg.mountpoint.empty();
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, pwrite, force,
+                                    fd, buf, count, offset);
+
+    const std::shared_ptr<struct nofuse_file> file = FD_TO_FILE(fd);
+    const fuse_ino_t ino = FD_TO_INO(fd, nullptr);
+
+    if (!file->is_writable()) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return pxtask.pwrite_ino(ino, buf, count, offset);
+}
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: pwritev(fd={}, iovcnt={}, offset={})",
+               fd, iovcnt, offset);
+
+    PXT pxtask;
+    const bool force = aznfsc_cfg.mountpoint.empty();
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, pwritev, force,
+                                    fd, iov, iovcnt, offset);
 
-    /*
-     * Path is inside mountpoint, need to make the aznfsc_ll_getattr call.
-     * That needs the inode number to identify the target.
-     */
-    const fuse_ino_t ino = PATH_TO_INO(pathname);
+    const std::shared_ptr<struct nofuse_file> file = FD_TO_FILE(fd);
+    const fuse_ino_t ino = FD_TO_INO(fd, nullptr);
 
-    pxtask.getattr.statbuf = statbuf;
+    if (!file->is_writable()) {
+        errno = EBADF;
+        return -1;
+    }
 
-    return pxtask.getattr_ll(ino);
+    if (offset < 0 || iovcnt < 0 || iovcnt > IOV_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t done = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        const ssize_t ret = pxtask.pwrite_ino(ino,
+                                              iov[i].iov_base,
+                                              iov[i].iov_len,
+                                              offset + done);
+        if (ret < 0) {
+            return (done > 0) ? (ssize_t) done : -1;
+        }
+
+        done += ret;
+
+        if ((size_t) ret < iov[i].iov_len) {
+            break;
+        }
+    }
+
+    return done;
 }
 
-int __fxstat(int ver, int fd, struct stat *statbuf)
+off_t lseek(int fd, off_t offset, int whence)
 {
-    AZLogDebug("[NOFUSE] INTERCEPT: __xfstat(ver={}, fd={})",
-               ver, fd);
+    AZLogDebug("[NOFUSE] INTERCEPT: lseek(fd={}, offset={}, whence={})",
+               fd, offset, whence);
 
-    const bool force = false;
+    PXT pxtask;
+    const bool force = aznfsc_cfg.mountpoint.empty();
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, lseek, force, fd, offset, whence);
+
+    const std::shared_ptr<struct nofuse_file> file = FD_TO_FILE(fd);
+    const fuse_ino_t ino = FD_TO_INO(fd, nullptr);
+
+    std::unique_lock<std::mutex> lock(file->pos_mutex);
+    off_t newpos;
+
+    switch (whence) {
+        case SEEK_SET:
+            newpos = offset;
+            break;
+        case SEEK_CUR:
+            newpos = file->pos + offset;
+            break;
+        case SEEK_END:
+        case SEEK_DATA:
+        case SEEK_HOLE: {
+            const off_t size = pxtask.get_file_size(ino);
+            if (size < 0) {
+                return -1;
+            }
+
+            if (whence == SEEK_END) {
+                newpos = size + offset;
+                break;
+            }
+
+            /*
+             * We don't track holes, the whole file is data followed by the
+             * implicit hole at eof.
+             */
+            if (offset >= size) {
+                errno = ENXIO;
+                return -1;
+            }
+
+            newpos = (whence == SEEK_DATA) ? offset : size;
+            break;
+        }
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    if (newpos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    file->pos = newpos;
+    return newpos;
+}
+
+int fstat(int fd, struct stat *statbuf)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: fstat(fd={})", fd);
 
     /*
-     * POSIX task for tracking this request.
+     * Since glibc 2.33 fstat() is a real symbol and not a wrapper over
+     * __fxstat().
      */
     PXT pxtask;
 
-    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd,
-                                    __fxstat,
-                                    force,
-                                    ver, fd, statbuf);
+    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, fstat, false, fd, statbuf);
 
-    /*
-     * Path is inside mountpoint, need to make the aznfsc_ll_getattr call.
-     * That needs the inode number to identify the target.
-     */
     const fuse_ino_t ino = FD_TO_INO(fd, nullptr);
 
     pxtask.getattr.statbuf = statbuf;
@@ -708,183 +1932,386 @@ int __fxstat(int ver, int fd, struct stat *statbuf)
     return pxtask.getattr_ll(ino);
 }
 
-ssize_t readlink(const char *pathname, char *buf, size_t bufsiz)
+int fsync(int fd)
 {
-    AZLogDebug("[NOFUSE] INTERCEPT: readlink(pathname={}, buf={}, bufsiz={})",
-               pathname, fmt::ptr(buf), bufsiz);
+    AZLogDebug("[NOFUSE] INTERCEPT: fsync(fd={})", fd);
 
-    const bool force = (!pathname || ((int) bufsiz <= 0));
+    PXT pxtask;
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, fsync, false, fd);
+
+    const fuse_ino_t ino = FD_TO_INO(fd, nullptr);
+
+    // Nothing to sync for directories.
+    if (pxtask.client->get_nfs_inode_from_ino(ino)->is_dir()) {
+        return 0;
+    }
 
     /*
-     * POSIX task for tracking this request.
+     * flush writes all dirty data to the server and waits for it to be
+     * committed.
      */
+    return pxtask.flush_ll(ino);
+}
+
+int fdatasync(int fd)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: fdatasync(fd={})", fd);
+
     PXT pxtask;
 
-    CHECK_AND_CALL_ORIG_FUNC_FOR_PATHNAME(pathname,
-                                          readlink,
+    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, fdatasync, false, fd);
+
+    const fuse_ino_t ino = FD_TO_INO(fd, nullptr);
+
+    if (pxtask.client->get_nfs_inode_from_ino(ino)->is_dir()) {
+        return 0;
+    }
+
+    return pxtask.flush_ll(ino);
+}
+
+/*
+ * WILLNEED prefetches the range into the cache and DONTNEED drops it from
+ * the cache right away, see nfs_inode::prefetch() and nfs_inode::dontneed().
+ * Other advices don't mean anything to us. len of 0 means till eof.
+ * Note: posix_fadvise() returns the error and doesn't set errno.
+ */
+int posix_fadvise(int fd, off_t offset, off_t len, int advice)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: posix_fadvise(fd={}, offset={}, len={}, "
+               "advice={})", fd, offset, len, advice);
+
+    PXT pxtask;
+
+    if (!init_done || in_cleanup || !pxtask.fd_in_mountpoint(fd)) {
+        CALL_ORIG_FUNC(posix_fadvise, ENOSYS, fd, offset, len, advice);
+    }
+
+    const struct fdinfo *fdi = PXT::get_fdinfo(fd);
+    if (!fdi) {
+        return EBADF;
+    }
+
+    if (offset < 0 || len < 0) {
+        return EINVAL;
+    }
+
+    struct nfs_inode *inode = pxtask.client->get_nfs_inode_from_ino(fdi->ino);
+
+    // Nothing to do for directories.
+    if (!inode->is_regfile()) {
+        return 0;
+    }
+
+    switch (advice) {
+        case POSIX_FADV_WILLNEED:
+            /*
+             * Hint, so failure to pin or prefetch is not an error for the
+             * application.
+             */
+            (void) inode->prefetch(offset, len, false /* pin */);
+            return 0;
+        case POSIX_FADV_DONTNEED:
+            return inode->dontneed(offset, len);
+        case POSIX_FADV_NORMAL:
+        case POSIX_FADV_SEQUENTIAL:
+        case POSIX_FADV_RANDOM:
+        case POSIX_FADV_NOREUSE:
+            return 0;
+        default:
+            return EINVAL;
+    }
+}
+
+DIR *opendir(const char *name)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: opendir(name={})", name);
+
+    const bool force = (!name);
+
+    PXT pxtask;
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_PATHNAME(name,
+                                          opendir,
                                           force,
-                                          -1,
-                                          pathname, buf, bufsiz);
+                                          NULL,
+                                          name);
 
-    /*
-     * Path is inside mountpoint, need to make the aznfsc_ll_readlink call.
-     * That needs the inode number to identify the symlink.
-     */
-    const fuse_ino_t ino = PATH_TO_INO(pathname);
+    fuse_ino_t ino;
+    const int ret = pxtask.path_to_ino(name, false /* follow_symlink */, ino);
+    if (ret != 0) {
+        assert(ret < 0);
+        errno = -ret;
+        return NULL;
+    }
 
-    pxtask.readlink.buf = buf;
-    pxtask.readlink.bufsiz = bufsiz;
+    if (!pxtask.client->get_nfs_inode_from_ino(ino)->is_dir()) {
+        errno = ENOTDIR;
+        return NULL;
+    }
 
-    return pxtask.readlink_ll(ino);
+    if (pxtask.opendir_ll(ino) != 0) {
+        return NULL;
+    }
+
+    // fd for dirfd(), it holds the open count taken above.
+    const int fd = pxtask.fd_alloc(ino, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        pxtask.releasedir_ll(ino);
+        errno = -fd;
+        return NULL;
+    }
+
+    struct nofuse_dir *dir = new nofuse_dir(ino, fd);
+    pxtask.dir_add(dir);
+
+    return reinterpret_cast<DIR *>(dir);
 }
 
-int open(const char *pathname, int flags, ...)
+DIR *fdopendir(int fd)
 {
-    mode_t mode = 0;
+    AZLogDebug("[NOFUSE] INTERCEPT: fdopendir(fd={})", fd);
 
-    if ((flags & O_CREAT) != 0 || (flags & O_TMPFILE) != 0) {
-        va_list args;
-        va_start(args, flags);
-        mode = va_arg(args, mode_t);
-        va_end(args);
+    PXT pxtask;
+
+    if (!init_done || in_cleanup || !pxtask.fd_in_mountpoint(fd)) {
+        CALL_ORIG_FUNC(fdopendir, NULL, fd);
     }
 
-    AZLogDebug("[NOFUSE] INTERCEPT: open(pathname={}, flags=0x{:x}, mode=0{:03o})",
-               pathname, flags, mode);
+    const struct fdinfo *fdi = PXT::get_fdinfo(fd);
+    if (!fdi) {
+        errno = EBADF;
+        return NULL;
+    }
 
-    const bool force = (!pathname);
+    if (!pxtask.client->get_nfs_inode_from_ino(fdi->ino)->is_dir()) {
+        errno = ENOTDIR;
+        return NULL;
+    }
 
     /*
-     * POSIX task for tracking this request.
+     * The stream takes over fd and the open count open() took on the
+     * directory, closedir() closes it.
      */
+    struct nofuse_dir *dir = new nofuse_dir(fdi->ino, fd);
+    pxtask.dir_add(dir);
+
+    return reinterpret_cast<DIR *>(dir);
+}
+
+/*
+ * Return the next dirent from the stream, NULL with errno unchanged at the
+ * end of the directory and NULL with errno set on error.
+ * Caller must hold dir->mutex.
+ */
+static struct dirent *__readdir(PXT& pxtask, struct nofuse_dir *dir)
+{
+    assert(dir->magic == NOFUSE_DIR_MAGIC);
+    assert(dir->consumed <= dir->len);
+
+    if (dir->consumed == dir->len) {
+        if (dir->eof) {
+            return NULL;
+        }
+
+        /*
+         * Returned all dirents from the last batch, get the next one.
+         */
+        pxtask.readdir.buf = dir->buf;
+        pxtask.readdir.size = sizeof(dir->buf);
+
+        const ssize_t ret = pxtask.readdir_ll(dir->ino, dir->cookie);
+        if (ret < 0) {
+            return NULL;
+        }
+
+        dir->len = ret;
+        dir->consumed = 0;
+
+        if (ret == 0) {
+            // End of directory, errno is not changed.
+            dir->eof = true;
+            return NULL;
+        }
+    }
+
+    struct dirent *de = (struct dirent *) (dir->buf + dir->consumed);
+
+    assert(de->d_reclen > 0);
+    assert((dir->consumed + de->d_reclen) <= dir->len);
+
+    dir->consumed += de->d_reclen;
+    dir->cookie = de->d_off;
+
+    return de;
+}
+
+struct dirent *readdir(DIR *dirp)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: readdir(dirp={})", fmt::ptr(dirp));
+
     PXT pxtask;
 
-    CHECK_AND_CALL_ORIG_FUNC_FOR_PATHNAME(pathname,
-                                          open,
-                                          force,
-                                          -1,
-                                          pathname, flags, mode);
+    CHECK_AND_CALL_ORIG_FUNC_FOR_DIR(dirp, readdir, NULL, dirp);
 
-    const fuse_ino_t ino = PATH_TO_INO(pathname);
-    const int fd = fdinfo::get_next_fd();
+    struct nofuse_dir *dir = reinterpret_cast<struct nofuse_dir *>(dirp);
+    std::unique_lock<std::mutex> lock(dir->mutex);
 
-    pxtask.fd_add_to_map(fd, ino);
+    return __readdir(pxtask, dir);
+}
 
-    assert(fd > 0);
-    return fd;
+struct dirent64 *readdir64(DIR *dirp)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: readdir64(dirp={})", fmt::ptr(dirp));
+
+    PXT pxtask;
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_DIR(dirp, readdir64, NULL, dirp);
+
+    struct nofuse_dir *dir = reinterpret_cast<struct nofuse_dir *>(dirp);
+    std::unique_lock<std::mutex> lock(dir->mutex);
+
+    return reinterpret_cast<struct dirent64 *>(__readdir(pxtask, dir));
 }
 
-int openat(int dirfd, const char *pathname, int flags, ...)
+/*
+ * Copy the next dirent into the caller's entry, so that it's not overwritten
+ * by calls on the stream from other threads.
+ * Returns 0 and sets *result to entry (or NULL at the end of the directory)
+ * on success, and the error on failure.
+ */
+static int __readdir_r(PXT& pxtask, struct nofuse_dir *dir,
+                       struct dirent *entry, struct dirent **result)
 {
-    mode_t mode = 0;
+    std::unique_lock<std::mutex> lock(dir->mutex);
+    const int saved_errno = errno;
 
-    if ((flags & O_CREAT) != 0 || (flags & O_TMPFILE) != 0) {
-        va_list args;
-        va_start(args, flags);
-        mode = va_arg(args, mode_t);
-        va_end(args);
+    errno = 0;
+    const struct dirent *de = __readdir(pxtask, dir);
+    const int error = errno;
+    errno = saved_errno;
+
+    if (!de) {
+        *result = NULL;
+        return error;
     }
 
-    AZLogDebug("[NOFUSE] INTERCEPT: openat(dirfd={}, pathname={}, flags={}, mode={})",
-               dirfd, pathname, flags, mode);
+    // d_name is the last member, copy only what this dirent uses.
+    ::memcpy(entry, de, std::min((size_t) de->d_reclen, sizeof(*entry)));
+    *result = entry;
+    return 0;
+}
 
-    // XXX Not implemented.
+int readdir_r(DIR *dirp, struct dirent *entry, struct dirent **result)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: readdir_r(dirp={})", fmt::ptr(dirp));
 
-    errno = ENOENT;
-    return -1;
+    PXT pxtask;
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_DIR(dirp, readdir_r, ENOENT,
+                                     dirp, entry, result);
+
+    return __readdir_r(pxtask, reinterpret_cast<struct nofuse_dir *>(dirp),
+                       entry, result);
 }
 
-FILE *fopen(const char *pathname, const char *mode)
+int readdir64_r(DIR *dirp, struct dirent64 *entry, struct dirent64 **result)
 {
-    AZLogWarn("[NOFUSE] INTERCEPT: fopen(pathname={}, mode={})",
-              pathname, mode);
-    AZLogWarn("[NOFUSE] fopen not supported, bypassing! If this is your "
-              "target file it won't work!");
+    AZLogDebug("[NOFUSE] INTERCEPT: readdir64_r(dirp={})", fmt::ptr(dirp));
 
-    /*
-     * TODO: We don't support fopen/fclose/fread/fwrite.
-     *       Bypass every call.
-     */
-    /*
-     * POSIX task for tracking this request.
-     */
     PXT pxtask;
 
-    CHECK_AND_CALL_ORIG_FUNC_FOR_PATHNAME(pathname,
-                                          fopen,
-                                          true,
-                                          NULL,
-                                          pathname, mode);
-    assert(0);
-    return NULL;
+    CHECK_AND_CALL_ORIG_FUNC_FOR_DIR(dirp, readdir64_r, ENOENT,
+                                     dirp, entry, result);
+
+    return __readdir_r(pxtask, reinterpret_cast<struct nofuse_dir *>(dirp),
+                       reinterpret_cast<struct dirent *>(entry),
+                       reinterpret_cast<struct dirent **>(result));
 }
 
-int close(int fd)
+long telldir(DIR *dirp)
 {
-    AZLogDebug("[NOFUSE] INTERCEPT: close(fd={})", fd);
+    AZLogDebug("[NOFUSE] INTERCEPT: telldir(dirp={})", fmt::ptr(dirp));
 
     PXT pxtask;
 
-    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, close, false, fd);
+    CHECK_AND_CALL_ORIG_FUNC_FOR_DIR(dirp, telldir, -1, dirp);
 
-    pxtask.fd_remove_from_map(fd);
+    struct nofuse_dir *dir = reinterpret_cast<struct nofuse_dir *>(dirp);
+    std::unique_lock<std::mutex> lock(dir->mutex);
 
-    return 0;
+    return dir->cookie;
 }
 
-int dup(int oldfd)
+void seekdir(DIR *dirp, long loc)
 {
-    AZLogDebug("[NOFUSE] INTERCEPT: dup(oldfd={})", oldfd);
+    AZLogDebug("[NOFUSE] INTERCEPT: seekdir(dirp={}, loc={})",
+               fmt::ptr(dirp), loc);
 
     PXT pxtask;
 
-    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(oldfd, dup, false, oldfd);
+    CHECK_AND_CALL_ORIG_FUNC_FOR_DIR(dirp, seekdir, /* void */, dirp, loc);
+
+    struct nofuse_dir *dir = reinterpret_cast<struct nofuse_dir *>(dirp);
+    std::unique_lock<std::mutex> lock(dir->mutex);
 
     /*
-     * TODO: Right now we do a basic dup where we make the newfd also point
-     *       to the same ino, but both fds don't share the file pos.
-     *       This will work only for cases where application closes the oldfd
-     *       after the dup, which is the more common case.
+     * Drop the buffered dirents, the next readdir() fetches the entries
+     * after loc.
      */
-    const fuse_ino_t ino = FD_TO_INO(oldfd, nullptr);
-    const int newfd = fdinfo::get_next_fd();
-
-    pxtask.fd_add_to_map(newfd, ino);
-    return newfd;
+    dir->cookie = loc;
+    dir->eof = false;
+    dir->len = 0;
+    dir->consumed = 0;
 }
 
-int dup2(int oldfd, int newfd)
+void rewinddir(DIR *dirp)
 {
-    AZLogDebug("[NOFUSE] INTERCEPT: dup2(oldfd={}, newfd={})",
-               oldfd, newfd);
+    AZLogDebug("[NOFUSE] INTERCEPT: rewinddir(dirp={})", fmt::ptr(dirp));
+
     PXT pxtask;
 
-    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(oldfd, dup2, false, oldfd, newfd);
+    CHECK_AND_CALL_ORIG_FUNC_FOR_DIR(dirp, rewinddir, /* void */, dirp);
 
-    const fuse_ino_t ino = FD_TO_INO(oldfd, nullptr);
+    seekdir(dirp, 0);
+}
 
-    pxtask.fd_add_to_map(newfd, ino);
-    return newfd;
+int dirfd(DIR *dirp)
+{
+    AZLogDebug("[NOFUSE] INTERCEPT: dirfd(dirp={})", fmt::ptr(dirp));
+
+    PXT pxtask;
+
+    CHECK_AND_CALL_ORIG_FUNC_FOR_DIR(dirp, dirfd, -1, dirp);
+
+    return reinterpret_cast<struct nofuse_dir *>(dirp)->fd;
 }
 
-ssize_t read(int fd, void *buf, size_t count)
+int closedir(DIR *dirp)
 {
-    AZLogDebug("[NOFUSE] INTERCEPT: read(fd={}, buf={}, count={})",
-               fd, fmt::ptr(buf), count);
+    AZLogDebug("[NOFUSE] INTERCEPT: closedir(dirp={})", fmt::ptr(dirp));
 
     PXT pxtask;
-    const bool force = aznfsc_cfg.mountpoint.empty();
 
-    CHECK_AND_CALL_ORIG_FUNC_FOR_FD(fd, read, force, fd, buf, count);
+    CHECK_AND_CALL_ORIG_FUNC_FOR_DIR(dirp, closedir, -1, dirp);
 
-    off_t offset;
-    const fuse_ino_t ino = FD_TO_INO(fd, &offset);
+    struct nofuse_dir *dir = reinterpret_cast<struct nofuse_dir *>(dirp);
+    assert(dir->magic == NOFUSE_DIR_MAGIC);
+
+    pxtask.dir_remove(dir);
+
+    /*
+     * Same as close() of the directory fd, which drops the open count taken
+     * by opendir() or by the open() done before fdopendir().
+     */
+    pxtask.fd_remove_from_map(dir->fd);
+    ::syscall(SYS_close, dir->fd);
 
-    pxtask.read.fd = fd;
-    pxtask.read.buf = buf;
-    pxtask.read.count = count;
+    const int ret = pxtask.releasedir_ll(dir->ino);
+    delete dir;
 
-    return pxtask.read_ll(ino, offset, count);
+    return ret;
 }
 
 }
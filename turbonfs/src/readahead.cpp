@@ -2,6 +2,7 @@
 #include "readahead.h"
 #include "rpc_task.h"
 #include "file_cache.h"
+#include "disk_cache.h"
 
 /*
  * This enables debug logs and also runs the self tests.
@@ -75,19 +76,344 @@ void ra_state::wait_for_ongoing_readahead() const
      * marked their membufs uptodate but they have not unlocked the
      * membufs. This will take very small time.
      */
-    for (int i = 0; i < 1000 && ra_ongoing != 0; i++) {
-        AZLogDebug("[{}] wait_for_ongoing_readahead({})",
-                   inode->get_fuse_ino(), ra_ongoing.load());
+    for (int i = 0; i < 1000 && (ra_ongoing != 0 || pf_ongoing != 0); i++) {
+        AZLogDebug("[{}] wait_for_ongoing_readahead({}, prefetch: {})",
+                   inode->get_fuse_ino(), ra_ongoing.load(),
+                   pf_ongoing.load());
         ::usleep(1000);
     }
 
-    if (ra_ongoing) {
-        AZLogError("[{}] wait_for_ongoing_readahead: {} readahead bytes still "
-                   "not completed, giving up!",
-                   inode->get_fuse_ino(), ra_ongoing.load());
+    if (ra_ongoing || pf_ongoing) {
+        AZLogError("[{}] wait_for_ongoing_readahead: {} readahead and {} "
+                   "prefetch bytes still not completed, giving up!",
+                   inode->get_fuse_ino(), ra_ongoing.load(),
+                   pf_ongoing.load());
     }
 }
 
+/* static */ std::atomic<uint64_t> ra_state::prefetch_ongoing_g = 0;
+/* static */ std::deque<struct nfs_inode*> ra_state::prefetch_waitq;
+/* static */ std::mutex ra_state::prefetch_waitq_lock_57;
+/* static */ std::atomic<uint64_t> ra_state::pinned_bytes_g = 0;
+
+ra_state::~ra_state()
+{
+    /*
+     * Prefetch reads and prefetch_waitq hold inode refs, so we cannot be
+     * freed with those.
+     */
+    assert(pf_ongoing == 0);
+    assert(!pf_waiting);
+
+    assert(pinned_bytes_g >= pinned_bytes);
+    pinned_bytes_g -= pinned_bytes;
+}
+
+uint64_t ra_state::get_prefetch_budget() const
+{
+    const uint64_t budget =
+        (aznfsc_cfg.cache.data.user.prefetch_inflight_mb * 1024ULL * 1024) *
+        nfs_client::get_ra_scale_factor();
+
+    /*
+     * Under heavy memory pressure ra_scale_factor can be tiny, let prefetch
+     * trickle along rather than stall.
+     */
+    return std::max(budget, def_ra_size);
+}
+
+int ra_state::prefetch(uint64_t offset, uint64_t length, bool pin)
+{
+    assert(inode->has_filecache());
+
+    if (!aznfsc_cfg.cache.data.user.enable) {
+        return ENOTSUP;
+    }
+
+    /*
+     * Clip to the file size. Use the cached size even if it's not recent,
+     * worst case we read a little less or issue reads that hit eof.
+     */
+    const uint64_t fsize = inode->get_server_file_size(true);
+    if (length == 0 || (offset + length) > fsize) {
+        length = (offset < fsize) ? (fsize - offset) : 0;
+    }
+
+    if (length == 0) {
+        return 0;
+    }
+
+    INC_GBL_STATS(prefetch_reqs, 1);
+
+    if (pin) {
+        std::unique_lock<std::shared_mutex> _lock(pin_lock_55);
+        const uint64_t max_pinned =
+            (aznfsc_cfg.cache.data.user.max_size_mb * 1024ULL * 1024 *
+             aznfsc_cfg.cache.data.user.max_pinned_pct) / 100;
+
+        /*
+         * Merge with overlapping and adjacent pinned ranges, pinned_bytes
+         * is updated by the net new bytes.
+         */
+        uint64_t start = offset;
+        uint64_t end = offset + length;
+        uint64_t merged_bytes = 0;
+
+        auto it = pinned.upper_bound(start);
+        if (it != pinned.begin() && std::prev(it)->second >= start) {
+            --it;
+        }
+
+        auto first = it;
+        for (; it != pinned.end() && it->first <= end; ++it) {
+            start = std::min(start, it->first);
+            end = std::max(end, it->second);
+            merged_bytes += (it->second - it->first);
+        }
+
+        const uint64_t new_bytes = (end - start) - merged_bytes;
+
+        if ((pinned_bytes_g + new_bytes) > max_pinned) {
+            AZLogWarn("[{}] Cannot pin [{}, {}), {} bytes already pinned, "
+                      "max {} bytes (max_pinned_pct={})",
+                      inode->get_fuse_ino(), offset, offset + length,
+                      pinned_bytes_g.load(), max_pinned,
+                      aznfsc_cfg.cache.data.user.max_pinned_pct);
+            return ENOSPC;
+        }
+
+        pinned.erase(first, it);
+        pinned[start] = end;
+        num_pinned = pinned.size();
+        pinned_bytes += new_bytes;
+        pinned_bytes_g += new_bytes;
+
+        AZLogDebug("[{}] Pinned [{}, {}), now pinned: {} bytes in {} ranges",
+                   inode->get_fuse_ino(), start, end, pinned_bytes,
+                   pinned.size());
+    }
+
+    {
+        std::unique_lock<std::mutex> _lock(prefetch_lock_56);
+
+        /*
+         * If the new range is contiguous with (or overlaps) the ongoing
+         * prefetch, extend it, else the new range replaces the ongoing
+         * one. Reads already issued are not affected.
+         */
+        if (pf_next < pf_end &&
+            offset <= pf_end && (offset + length) >= pf_next) {
+            pf_next = std::min(pf_next, offset);
+            pf_end = std::max(pf_end, offset + length);
+        } else {
+            pf_next = offset;
+            pf_end = offset + length;
+        }
+
+        AZLogDebug("[{}] Prefetch [{}, {}){}, pending [{}, {})",
+                   inode->get_fuse_ino(), offset, offset + length,
+                   pin ? " (pinned)" : "", pf_next, pf_end);
+    }
+
+    issue_prefetch();
+    return 0;
+}
+
+uint64_t ra_state::dontneed(uint64_t offset, uint64_t length)
+{
+    assert(inode->has_filecache());
+
+    if (length == 0) {
+        const uint64_t fsize =
+            std::max<int64_t>(inode->get_server_file_size(true),
+                              inode->get_cached_filesize());
+        length = (offset < fsize) ? (fsize - offset) : 0;
+    }
+
+    if (length == 0) {
+        return 0;
+    }
+
+    const uint64_t end = offset + length;
+
+    {
+        std::unique_lock<std::shared_mutex> _lock(pin_lock_55);
+
+        /*
+         * Unpin [offset, end), trimming or splitting pinned ranges which
+         * partially overlap.
+         */
+        auto it = pinned.upper_bound(offset);
+        if (it != pinned.begin() && std::prev(it)->second > offset) {
+            --it;
+        }
+
+        while (it != pinned.end() && it->first < end) {
+            const uint64_t pstart = it->first;
+            const uint64_t pend = it->second;
+            const uint64_t ustart = std::max(pstart, offset);
+            const uint64_t uend = std::min(pend, end);
+
+            it = pinned.erase(it);
+
+            if (pstart < ustart) {
+                pinned[pstart] = ustart;
+            }
+            if (uend < pend) {
+                pinned[uend] = pend;
+            }
+
+            assert(pinned_bytes >= (uend - ustart));
+            assert(pinned_bytes_g >= (uend - ustart));
+            pinned_bytes -= (uend - ustart);
+            pinned_bytes_g -= (uend - ustart);
+        }
+
+        num_pinned = pinned.size();
+    }
+
+    {
+        std::unique_lock<std::mutex> _lock(prefetch_lock_56);
+
+        // Don't prefetch what the application doesn't need.
+        if (pf_next < end && pf_end > offset) {
+            if (pf_next >= offset) {
+                pf_next = std::min(end, pf_end);
+            } else {
+                pf_end = offset;
+            }
+        }
+    }
+
+    /*
+     * Free the memory right away, membufs under IO or dirty are skipped by
+     * release().
+     */
+    const uint64_t released = inode->get_filecache()->release(offset, length);
+
+    INC_GBL_STATS(bytes_dontneed_released, released);
+
+    AZLogDebug("[{}] Dontneed [{}, {}), released {} bytes",
+               inode->get_fuse_ino(), offset, end, released);
+
+    return released;
+}
+
+bool ra_state::is_pinned(uint64_t offset, uint64_t length) const
+{
+    if (num_pinned == 0) {
+        return false;
+    }
+
+    std::shared_lock<std::shared_mutex> _lock(pin_lock_55);
+
+    auto it = pinned.upper_bound(offset);
+    if (it != pinned.begin() && std::prev(it)->second > offset) {
+        return true;
+    }
+
+    return (it != pinned.end()) && (it->first < (offset + length));
+}
+
+int ra_state::issue_prefetch(bool from_callback)
+{
+    auto& read_cache = inode->get_filecache();
+    const uint64_t budget = get_prefetch_budget();
+    int pf_issued = 0;
+
+    /*
+     * From callback context issue just enough to keep this inode's
+     * prefetch going, the completed read made room for one read.
+     */
+    while (!from_callback || (pf_issued == 0)) {
+        uint64_t offset, length;
+
+        {
+            std::unique_lock<std::mutex> _lock(prefetch_lock_56);
+
+            if (pf_next >= pf_end) {
+                break;
+            }
+
+            length = std::min(def_ra_size, pf_end - pf_next);
+
+            if ((prefetch_ongoing_g + length) > budget) {
+                /*
+                 * Budget exhausted by other inodes' prefetches, wait for
+                 * one of them to complete. If this inode has prefetch reads
+                 * ongoing, their completion will continue the prefetch.
+                 */
+                if (pf_ongoing == 0 && !pf_waiting) {
+                    std::unique_lock<std::mutex> _lock2(prefetch_waitq_lock_57);
+                    inode->incref();
+                    prefetch_waitq.push_back(inode);
+                    pf_waiting = true;
+                }
+                break;
+            }
+
+            offset = pf_next;
+            pf_next += length;
+            pf_ongoing += length;
+            prefetch_ongoing_g += length;
+        }
+
+        std::vector<bytes_chunk> bcv = read_cache->get(offset, length);
+
+        for (bytes_chunk& bc : bcv) {
+            assert(bc.offset >= offset);
+            assert((bc.offset + bc.length) <= (offset + length));
+
+            if (issue_read(bc, true /* is_prefetch */, from_callback)) {
+                pf_issued++;
+            }
+        }
+    }
+
+    return pf_issued;
+}
+
+/* static */
+void ra_state::kick_prefetch_waitq(bool from_callback)
+{
+    struct nfs_inode *inode;
+
+    {
+        std::unique_lock<std::mutex> _lock(prefetch_waitq_lock_57);
+        if (prefetch_waitq.empty()) {
+            return;
+        }
+
+        inode = prefetch_waitq.front();
+        prefetch_waitq.pop_front();
+    }
+
+    const std::shared_ptr<ra_state>& ras = inode->get_rastate();
+
+    {
+        std::unique_lock<std::mutex> _lock(ras->prefetch_lock_56);
+        assert(ras->pf_waiting);
+        ras->pf_waiting = false;
+    }
+
+    ras->issue_prefetch(from_callback);
+
+    // Drop the ref taken when queueing.
+    inode->decref();
+}
+
+void ra_state::on_prefetch_complete(uint64_t length)
+{
+    on_read_complete(0, length, true /* is_prefetch */);
+
+    /*
+     * Continue this inode's prefetch and give one waiting inode a chance,
+     * so that one big prefetch doesn't hog the budget.
+     */
+    issue_prefetch(true /* from_callback */);
+    kick_prefetch_waitq(true /* from_callback */);
+}
+
 /**
  * Readahead context.
  * All ongoing readahead reads are tracked using one ra_context object.
@@ -109,9 +435,24 @@ struct ra_context
      */
     struct rpc_task *task;
 
-    ra_context(rpc_task *_task, struct bytes_chunk& _bc) :
+    /*
+     * Disk cache entry gen sampled before issuing the readahead, see
+     * read_context::dcache_gen.
+     */
+    const uint64_t dcache_gen;
+
+    /*
+     * Read issued by ra_state::prefetch() and not by readahead.
+     */
+    const bool is_prefetch;
+
+    ra_context(rpc_task *_task, struct bytes_chunk& _bc,
+               uint64_t _dcache_gen = DISK_CACHE_NO_GEN,
+               bool _is_prefetch = false) :
         bc(_bc),
-        task(_task)
+        task(_task),
+        dcache_gen(_dcache_gen),
+        is_prefetch(_is_prefetch)
     {
         assert(task->magic == RPC_TASK_MAGIC);
         assert(bc.length > 0 && bc.length <= AZNFSC_MAX_CHUNK_SIZE);
@@ -229,7 +570,11 @@ static void readahead_callback (
         bc->pvt += res->READ3res_u.resok.count;
         assert(bc->pvt <= bc->length);
 
-        INC_GBL_STATS(bytes_read_ahead, res->READ3res_u.resok.count);
+        if (ctx->is_prefetch) {
+            INC_GBL_STATS(bytes_prefetched, res->READ3res_u.resok.count);
+        } else {
+            INC_GBL_STATS(bytes_read_ahead, res->READ3res_u.resok.count);
+        }
 
         AZLogDebug("[{}] <{}> readahead_callback: {}Read completed for offset: {} "
                    " size: {} Bytes read: {} eof: {}, total bytes read till "
@@ -295,7 +640,7 @@ static void readahead_callback (
                  */
                 partial_read_tsk->get_stats().on_rpc_issue();
                 if (rpc_nfs3_read_task(
-                        partial_read_tsk->get_rpc_ctx(),
+                        partial_read_tsk->get_rpc_ctx(new_size),
                         readahead_callback,
                         bc->get_buffer() + bc->pvt,
                         new_size,
@@ -334,6 +679,10 @@ static void readahead_callback (
     assert(status == 0);
     assert((bc->length == bc->pvt) || res->READ3res_u.resok.eof);
 
+    // Add data read ahead to the disk cache.
+    disk_cache::get_instance().populate(inode, *bc, bc->pvt,
+                                        ctx->dcache_gen);
+
     if (bc->maps_full_membuf() && (bc->length == bc->pvt)) {
         /*
          * Only if this bytes_chunk maps the entire membuf and the read has
@@ -405,11 +754,16 @@ static void readahead_callback (
     bc->get_membuf()->clear_inuse();
 
 delete_ctx:
+    const bool is_prefetch = ctx->is_prefetch;
+    const uint64_t length = bc->length;
+
     /*
      * Success or failure, report readahead completion.
      * This MUST be called after dropping the membuf lock and inuse count.
      */
-    inode->get_rastate()->on_readahead_complete(bc->offset, bc->length);
+    if (!is_prefetch) {
+        inode->get_rastate()->on_readahead_complete(bc->offset, length);
+    }
 
     // Free the readahead RPC task.
     task->free_rpc_task();
@@ -417,42 +771,144 @@ delete_ctx:
     // Free the context.
     delete ctx;
 
+    /*
+     * Prefetch completion may issue more prefetch reads, do it after
+     * freeing our rpc_task.
+     */
+    if (is_prefetch) {
+        inode->get_rastate()->on_prefetch_complete(length);
+    }
+
     // Decrement the extra ref taken on inode at the time read was issued.
     inode->decref();
 }
 
-int64_t ra_state::get_next_ra(uint64_t length)
+void ra_state::ra_stream::reset_nolock(uint64_t offset, uint64_t length)
 {
-    if (length == 0) {
-        length = def_ra_size;
+    assert(length > 0);
+
+    num_reads = 1;
+    num_bytes_read = length;
+    min_byte_read = offset;
+    max_byte_read = offset + length - 1;
+    last_byte_readahead = 0;
+
+    last_read_offset = offset;
+    last_read_length = length;
+    stride = 0;
+    num_stride_reads = 1;
+    stride_ra_rec = 0;
+    stride_ra_next = 0;
+}
+
+void ra_state::ra_stream::free_nolock()
+{
+    num_reads = 0;
+    num_bytes_read = 0;
+    min_byte_read = 0;
+    max_byte_read = UINT64_MAX;
+    last_byte_readahead = 0;
+
+    last_read_offset = 0;
+    last_read_length = 0;
+    stride = 0;
+    num_stride_reads = 0;
+    stride_ra_rec = 0;
+    stride_ra_next = 0;
+    last_read_seq = 0;
+}
+
+int ra_state::find_stream_nolock(uint64_t offset,
+                                 uint64_t ra_bytes_scaled) const
+{
+    int best = -1;
+    uint64_t best_gap = UINT64_MAX;
+
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        const ra_stream& s = streams[i];
+
+        if (s.is_free()) {
+            continue;
+        }
+
+        /*
+         * Next read of a stream which has a stride candidate, this must be
+         * matched irrespective of the gap as strided reads may lie far from
+         * max_byte_read.
+         */
+        if ((s.stride != 0) && (offset == (s.last_read_offset + s.stride))) {
+            return i;
+        }
+
+        // How far from the stream's last byte read, is this new request.
+        const uint64_t read_gap =
+            std::abs((int64_t) (offset - s.max_byte_read));
+
+        if ((read_gap <= ra_bytes_scaled) && (read_gap < best_gap)) {
+            best = i;
+            best_gap = read_gap;
+        }
     }
 
-    /*
-     * RA is disabled?
-     */
-    if (length == 0) {
-        return -1;
+    return best;
+}
+
+int ra_state::alloc_stream_nolock()
+{
+    int lru = -1;
+    int lru_random = -1;
+
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        const ra_stream& s = streams[i];
+
+        if (s.is_free()) {
+            return i;
+        }
+
+        if ((lru == -1) || (s.last_read_seq < streams[lru].last_read_seq)) {
+            lru = i;
+        }
+
+        if (!is_sequential_nolock(s) && !is_strided_nolock(s) &&
+            ((lru_random == -1) ||
+             (s.last_read_seq < streams[lru_random].last_read_seq))) {
+            lru_random = i;
+        }
     }
 
     /*
-     * Don't perform readahead beyond eof.
-     * If we don't have a file size estimate (probably the attr cache is too
-     * old) then also we play safe and do not perform readahead.
+     * Prefer replacing a random stream, as that's not benefitting from
+     * readahead anyway.
      */
-    const int64_t filesize =
-        inode ? inode->get_server_file_size(): AZNFSC_MAX_FILE_SIZE;
-    assert(filesize >= 0 || filesize == -1);
-    if ((filesize == -1) ||
-        ((int64_t) (last_byte_readahead + 1 + length) > filesize)) {
-        return -2;
+    return (lru_random != -1) ? lru_random : lru;
+}
+
+int ra_state::num_ra_streams_nolock() const
+{
+    int count = 0;
+
+    for (const ra_stream& s : streams) {
+        if (!s.is_free() &&
+            (is_sequential_nolock(s) || is_strided_nolock(s))) {
+            count++;
+        }
     }
 
-    /*
-     * Application read pattern is known to be non-sequential?
-     */
-    if (!is_sequential()) {
-        return -3;
+    return std::max(count, 1);
+}
+
+void ra_state::on_application_read(uint64_t offset, uint64_t length)
+{
+    assert(offset < AZNFSC_MAX_FILE_SIZE);
+    assert((offset + length) <= AZNFSC_MAX_FILE_SIZE);
+
+    if (length == 0) {
+        assert(0);
+        return;
     }
+    assert((int64_t) length > 0);
+
+    std::unique_lock<std::shared_mutex> _lock(ra_lock_40);
 
     /*
      * Scaled ra_bytes is the ra_bytes scaled to account for global cache
@@ -460,227 +916,662 @@ int64_t ra_state::get_next_ra(uint64_t length)
      */
     const uint64_t ra_bytes_scaled = get_ra_bytes();
 
-    /*
-     * If we already have ra_bytes readahead bytes read, don't readahead
-     * more.
-     */
-    if ((last_byte_readahead + length) > (max_byte_read + ra_bytes_scaled)) {
-        return -4;
-    }
+    read_seq++;
 
     /*
-     * Keep readahead bytes issued always less than the scaled ra_bytes.
+     * Free streams not read recently, so that they don't hold on to their
+     * share of the readahead window and their cached data can be released
+     * (see release_till()).
      */
-    if ((ra_ongoing += length) > ra_bytes_scaled) {
-        assert(ra_ongoing >= length);
-        ra_ongoing -= length;
-        return -5;
+    for (ra_stream& s : streams) {
+        if (!s.is_free() && ((read_seq - s.last_read_seq) > STREAM_IDLE_READS)) {
+            s.free_nolock();
+        }
     }
 
-    std::unique_lock<std::shared_mutex> _lock(ra_lock_40);
+    int idx = find_stream_nolock(offset, ra_bytes_scaled);
 
-    /*
-     * Atomically update last_byte_readahead, as we don't want to return
-     * duplicate readahead offset to multiple calls.
-     */
-    const uint64_t next_ra =
-        std::atomic_exchange(&last_byte_readahead, last_byte_readahead + length) + 1;
+    if (idx == -1) {
+        /*
+         * This read is beyond ra_bytes away from the last byte read by all
+         * the streams, and not a strided read of any stream. Start a new
+         * stream and let it prove its sequential-ness.
+         */
+        idx = alloc_stream_nolock();
+        assert(idx >= 0 && idx < MAX_STREAMS);
+        streams[idx].reset_nolock(offset, length);
 
-    assert((int64_t) next_ra > 0);
-    return next_ra;
-}
-/*
- * TODO: Add readahead stats.
- */
-/**
- * Note: This takes shared lock on ilock_1.
- */
-int ra_state::issue_readaheads()
-{
-    int64_t ra_offset;
+        /*
+         * Stride larger than the readahead window, every record read
+         * starts a new stream.
+         */
+        const uint64_t delta = (offset > far_last_offset) ?
+                               (offset - far_last_offset) : 0;
+
+        if ((length != far_last_length) || (delta <= length)) {
+            far_stride = 0;
+            far_num_reads = 1;
+        } else if (delta == far_stride) {
+            far_num_reads++;
+        } else {
+            far_stride = delta;
+            far_num_reads = 2;
+        }
 
-    /*
-     * issue_readaheads() MUST only be called for open files which will have
-     * the file cache initialized.
-     */
-    assert(inode->has_filecache());
+        far_last_offset = offset;
+        far_last_length = length;
 
-    auto& read_cache = inode->get_filecache();
-    int ra_issued = 0;
+        if (far_num_reads >= STRIDE_MIN_READS_FAR) {
+            ra_stream& s = streams[idx];
 
-    /*
-     * If userspace data cache is disabled, don't do readaheads.
+            s.stride = far_stride;
+            s.num_stride_reads = far_num_reads;
+
+            AZLogDebug("[{}] Stream {} strided, stride: {} length: {}",
+                       inode ? inode->get_fuse_ino() : 0,
+                       idx, s.stride, length);
+        }
+    } else {
+        ra_stream& s = streams[idx];
+        const uint64_t curr_section = (s.max_byte_read / SECTION_SIZE);
+        const uint64_t this_section = ((offset + length) / SECTION_SIZE);
+        bool reset_readahead = false;
+
+        /*
+         * Next record of a strided stream may be sections away if the
+         * stride is large, that's not a change in the access pattern.
+         */
+        if ((curr_section != this_section) &&
+            !(is_strided_nolock(s) &&
+              (offset == (s.last_read_offset + s.stride)))) {
+            /*
+             * Read is close to the stream but the section changes.
+             * Since the section size is usually much larger than the
+             * readahead window size, so this usually means one of the
+             * following two:
+             * 1. this_section == "curr_section + 1" (likely for seq pattern).
+             * 2. this_section == "curr_section - 1"
+             */
+            if (this_section != curr_section + 1) {
+                reset_readahead = true;
+            } else {
+                /*
+                 * Common case of sequential (or strided) reads progressing to
+                 * the next section, don't reset pattern detector.
+                 */
+                reset_readahead =
+                    !is_sequential_nolock(s) && !is_strided_nolock(s);
+            }
+        }
+
+        if (reset_readahead) {
+            s.reset_nolock(offset, length);
+        } else {
+            s.num_reads++;
+            s.num_bytes_read += length;
+            s.max_byte_read = std::max(s.max_byte_read.load(),
+                                       offset + length - 1);
+            s.min_byte_read = std::min(s.min_byte_read.load(), offset);
+
+            /*
+             * Stride tracking. A stride must leave a gap after the previous
+             * read, else it's a sequential pattern.
+             */
+            const uint64_t delta = (offset > s.last_read_offset) ?
+                                   (offset - s.last_read_offset) : 0;
+
+            if (delta > s.last_read_length) {
+                if (delta == s.stride) {
+                    if (++s.num_stride_reads == STRIDE_MIN_READS) {
+                        AZLogDebug("[{}] Stream {} strided, stride: {} "
+                                   "length: {}",
+                                   inode ? inode->get_fuse_ino() : 0,
+                                   idx, s.stride, length);
+                    }
+                } else {
+                    s.stride = delta;
+                    s.num_stride_reads = 2;
+                    s.stride_ra_rec = s.stride_ra_next = 0;
+                }
+            } else {
+                s.stride = 0;
+                s.num_stride_reads = 1;
+                s.stride_ra_rec = s.stride_ra_next = 0;
+            }
+
+            s.last_read_offset = offset;
+            s.last_read_length = length;
+        }
+    }
+
+    ra_stream& s = streams[idx];
+
+    assert(s.max_byte_read >= s.min_byte_read);
+
+    s.last_read_seq = read_seq;
+    curr_stream = idx;
+
+    /*
+     * Next readahead will be from last_byte_readahead+1, so if this read
+     * is past the current last_byte_readahead, update last_byte_readahead.
      */
-    if (!aznfsc_cfg.cache.data.user.enable) {
-        return 0;
+    if (s.last_byte_readahead < s.max_byte_read) {
+        s.last_byte_readahead = s.max_byte_read.load();
     }
+}
+
+uint64_t ra_state::release_till() const
+{
+    uint64_t till = UINT64_MAX;
 
     /*
-     * Issue all readaheads allowed by this ra_state.
+     * Our active readahead window starts from max_byte_read and spans
+     * get_ra_bytes() bytes. For the case of sequential reads, anything
+     * less than "max_byte_read - SECTION_SIZE" is unlikely to be read
+     * again. The margin of SECTION_SIZE helps readers like fio which
+     * issue lot of parallel reads which together are working towards a
+     * sequential goal but may be ordered upto SECTION_SIZE apart.
+     * Free streams have max_byte_read of UINT64_MAX.
      */
-    while ((ra_offset = get_next_ra()) > 0) {
-        AZLogDebug("[{}] Issuing readahead at off: {} len: {}: ongoing: {} "
-                   "sfsize: {} cfsize: {} csfsize: {} ({})",
-                   inode->get_fuse_ino(), ra_offset, def_ra_size,
-                   ra_ongoing.load(),
-                   inode->get_server_file_size(),
-                   inode->get_client_file_size(),
-                   inode->get_cached_filesize(),
-                   get_ra_bytes());
+    for (const ra_stream& s : streams) {
+        const uint64_t max_byte_read = s.max_byte_read;
+
+        if (max_byte_read != UINT64_MAX) {
+            till = std::min(till,
+                            (max_byte_read > SECTION_SIZE) ?
+                            (max_byte_read - SECTION_SIZE) : 0);
+        }
+    }
+
+    return (till == UINT64_MAX) ? 0 : till;
+}
+
+bool ra_state::in_ra_window(uint64_t offset, uint64_t length) const
+{
+    assert((int64_t) (offset + length) >= 0);
+
+    /*
+     * Scaled ra_bytes is the ra_bytes scaled to account for global cache
+     * pressure. We use that to decide how much to readahead.
+     */
+    const uint64_t ra_bytes_scaled = get_ra_bytes();
+    const uint64_t le = offset;
+    const uint64_t re = offset + length;
+
+    for (const ra_stream& s : streams) {
+        const uint64_t max_byte_read = s.max_byte_read;
+        const uint64_t last_byte_readahead = s.last_byte_readahead;
 
         /*
-         * Get bytes_chunk representing the byte range we want to readahead
-         * and issue READ RPCs for all.
+         * If last_byte_readahead is 0 it mostly means we are not doing
+         * readaheads which is mostly true for files which are being
+         * written and not read.
          */
-        std::vector<bytes_chunk> bcv = read_cache->get(ra_offset, def_ra_size);
+        if ((max_byte_read == UINT64_MAX) || (last_byte_readahead == 0)) {
+            continue;
+        }
 
-        for (bytes_chunk& bc : bcv) {
+        /*
+         * Strided streams readahead records which can lie beyond
+         * max_byte_read + ra_bytes, last_byte_readahead covers those.
+         */
+        const uint64_t lra = max_byte_read + 1;
+        const uint64_t rra = std::max(max_byte_read + ra_bytes_scaled,
+                                      last_byte_readahead);
+        const bool ends_before = re <= lra;
+        const bool starts_after = le > rra;
+
+        if (!ends_before && !starts_after) {
+            return true;
+        }
+    }
 
-            // Every bytes_chunk must lie within the readahead.
-            assert(bc.offset >= (uint64_t) ra_offset);
-            assert((bc.offset + bc.length) <= (ra_offset + def_ra_size));
+    return false;
+}
 
-            // get() must grab the inuse count.
-            assert(bc.get_membuf()->is_inuse());
+int64_t ra_state::get_next_stride_ra_nolock(ra_stream& s,
+                                            uint64_t length,
+                                            uint64_t window,
+                                            uint64_t *ra_length)
+{
+    assert(is_strided_nolock(s));
+    assert(s.stride > s.last_read_length);
 
-            /*
-             * Before we issue READ to populate the bytes_chunk, take the
-             * membuf lock. We use try_lock() and skip readahead if we don't
-             * get the lock. It's ok to skip readahead rather than holding the
-             * caller. Mostly if there is a single reader we will get the lock.
-             * This lock will be released in the readahead_callback() after the
-             * buffer is populated.
-             * Note that if the membuf is already locked it means some other
-             * context is already performing IO to it. We should not release
-             * the buffer.
-             */
-            if (!bc.get_membuf()->try_lock()) {
-                AZLogWarnNR("[{}] Skipping readahead at off: {} len: {}. "
-                            "Could not get membuf lock!",
-                            inode->get_fuse_ino(), bc.offset, bc.length);
+    const uint64_t reclen = s.last_read_length;
 
-                on_readahead_complete(bc.offset, bc.length);
-                bc.get_membuf()->clear_inuse();
-                continue;
-            }
+    /*
+     * Start with the record following the last read record, or move to the
+     * next record once the current one is completely read ahead.
+     */
+    if (s.stride_ra_rec <= s.last_read_offset) {
+        s.stride_ra_rec = s.stride_ra_next = s.last_read_offset + s.stride;
+    } else if (s.stride_ra_next >= (s.stride_ra_rec + reclen)) {
+        s.stride_ra_rec += s.stride;
+        s.stride_ra_next = s.stride_ra_rec;
+    }
 
-            /*
-             * If the buffer is already uptodate, skip readahead.
-             */
-            if (bc.get_membuf()->is_uptodate()) {
-                AZLogDebug("[{}] Skipping readahead at off: {} len: {}. "
-                           "Membuf already uptodate!",
-                           inode->get_fuse_ino(), bc.offset, bc.length);
+    /*
+     * Readahead as many records as fit in this stream's share of the
+     * readahead window, at least one.
+     */
+    const uint64_t max_records = std::max<uint64_t>(window / reclen, 1);
+    if (((s.stride_ra_rec - s.last_read_offset) / s.stride) > max_records) {
+        return -4;
+    }
+
+    const uint64_t len =
+        std::min(length, s.stride_ra_rec + reclen - s.stride_ra_next);
+    assert(len > 0);
+
+    const int64_t filesize =
+        inode ? inode->get_server_file_size(): AZNFSC_MAX_FILE_SIZE;
+    if ((int64_t) (s.stride_ra_next + len) > filesize) {
+        return -2;
+    }
+
+    if ((ra_ongoing += len) > get_ra_bytes()) {
+        assert(ra_ongoing >= len);
+        ra_ongoing -= len;
+        return -5;
+    }
+
+    const uint64_t next_ra = s.stride_ra_next;
+    s.stride_ra_next += len;
+
+    if (s.last_byte_readahead < (s.stride_ra_next - 1)) {
+        s.last_byte_readahead = s.stride_ra_next - 1;
+    }
+
+    if (ra_length) {
+        *ra_length = len;
+    }
+
+    assert((int64_t) next_ra > 0);
+    return next_ra;
+}
+
+int64_t ra_state::get_next_ra(uint64_t length, uint64_t *ra_length)
+{
+    if (length == 0) {
+        length = def_ra_size;
+    }
+
+    /*
+     * RA is disabled?
+     */
+    if (length == 0) {
+        return -1;
+    }
+
+    /*
+     * Don't perform readahead beyond eof.
+     * If we don't have a file size estimate (probably the attr cache is too
+     * old) then also we play safe and do not perform readahead.
+     */
+    const int64_t filesize =
+        inode ? inode->get_server_file_size(): AZNFSC_MAX_FILE_SIZE;
+    assert(filesize >= 0 || filesize == -1);
+    if (filesize == -1) {
+        return -2;
+    }
+
+    std::unique_lock<std::shared_mutex> _lock(ra_lock_40);
+
+    /*
+     * Readaheads are issued for the stream of the most recent application
+     * read.
+     */
+    ra_stream& s = streams[curr_stream];
+
+    /*
+     * Scaled ra_bytes is the ra_bytes scaled to account for global cache
+     * pressure. We use that to decide how much to readahead.
+     * It's shared equally by all the streams benefitting from readahead.
+     */
+    const uint64_t ra_bytes_scaled = get_ra_bytes();
+    const uint64_t window =
+        std::max(ra_bytes_scaled / num_ra_streams_nolock(), length);
+
+    /*
+     * Application read pattern is known to be non-sequential?
+     * Strided streams readahead the next records.
+     */
+    if (s.is_free() || !is_sequential_nolock(s)) {
+        if (!s.is_free() && is_strided_nolock(s)) {
+            return get_next_stride_ra_nolock(s, length, window, ra_length);
+        }
+        return -3;
+    }
+
+    if ((int64_t) (s.last_byte_readahead + 1 + length) > filesize) {
+        return -2;
+    }
 
-                on_readahead_complete(bc.offset, bc.length);
+    /*
+     * If we already have the stream's share of readahead bytes read, don't
+     * readahead more.
+     */
+    if ((s.last_byte_readahead + length) > (s.max_byte_read + window)) {
+        return -4;
+    }
+
+    /*
+     * Keep readahead bytes issued always less than the scaled ra_bytes.
+     */
+    if ((ra_ongoing += length) > ra_bytes_scaled) {
+        assert(ra_ongoing >= length);
+        ra_ongoing -= length;
+        return -5;
+    }
+
+    /*
+     * We hold the exclusive lock so we won't return duplicate readahead
+     * offset to multiple calls.
+     */
+    const uint64_t next_ra = s.last_byte_readahead + 1;
+    s.last_byte_readahead += length;
+
+    if (ra_length) {
+        *ra_length = length;
+    }
+
+    assert((int64_t) next_ra > 0);
+    return next_ra;
+}
+
+bool ra_state::disk_readahead(struct bytes_chunk& bc, bool is_prefetch)
+{
+    // Caller must hold the membuf lock and inuse count.
+    assert(bc.get_membuf()->is_locked());
+    assert(bc.get_membuf()->is_inuse());
+
+    /*
+     * Like readahead reads sent to the server, hold an inode ref till the
+     * readahead completes. The job holds its own copy of bc, which holds a
+     * ref on the membuf.
+     */
+    inode->incref();
+
+    auto bcp = std::make_shared<bytes_chunk>(bc);
+    struct nfs_inode *const _inode = inode;
+
+    const bool queued = disk_cache::get_instance().queue_job(
+        [_inode, bcp, is_prefetch]() mutable {
+            bytes_chunk& bc = *bcp;
+            const std::shared_ptr<disk_cache_entry>& dce =
+                _inode->get_dcache_entry();
+
+            if (dce->read(bc.offset, bc.length, bc.get_buffer())) {
+                disk_cache::num_ra_hits_g++;
+                if (is_prefetch) {
+                    INC_GBL_STATS(bytes_prefetched, bc.length);
+                } else {
+                    INC_GBL_STATS(bytes_read_ahead, bc.length);
+                }
+
+                if (bc.maps_full_membuf()) {
+                    AZLogDebug("[{}] Setting uptodate flag for membuf [{}, {}) "
+                               "read from disk cache",
+                               _inode->get_fuse_ino(), bc.offset,
+                               bc.offset + bc.length);
+                    bc.get_membuf()->set_uptodate();
+                }
+
+                bc.get_membuf()->clear_locked();
+                bc.get_membuf()->clear_inuse();
+            } else {
+                /*
+                 * Cached data dropped after we checked, the application read
+                 * will read it from the server.
+                 */
                 bc.get_membuf()->clear_locked();
                 bc.get_membuf()->clear_inuse();
-                continue;
+                _inode->get_filecache()->release(bc.offset, bc.length);
             }
 
-            /*
-             * Ok, now issue READ RPCs to read this byte range.
-             */
-            struct rpc_task *tsk =
-                client->get_rpc_task_helper()->alloc_rpc_task(FUSE_READ);
+            const uint64_t offset = bc.offset;
+            const uint64_t length = bc.length;
 
-            /*
-             * fuse_req is needed to send the fuse response, since we don't
-             * need to send response for readahead reads, it can be null.
-             * fuse_file_info is not used too.
-             */
-            tsk->init_read_be(inode->get_fuse_ino(),  /* ino */
-                              bc.length,              /* size */
-                              bc.offset);             /* offset */
+            // Drop the membuf ref before the inode ref.
+            bcp.reset();
 
-            // No reads should be issued to backend at this point.
-            assert(bc.num_backend_calls_issued == 0);
-            bc.num_backend_calls_issued++;
+            if (is_prefetch) {
+                _inode->get_rastate()->on_prefetch_complete(length);
+            } else {
+                _inode->get_rastate()->on_readahead_complete(offset, length);
+            }
+            _inode->decref();
+        },
+        0 /* doesn't hold any extra memory */);
 
-            assert(bc.pvt == 0);
+    if (!queued) {
+        inode->decref();
+    }
 
-            /*
-             * bc holds a ref on the membuf so we can safely access membuf
-             * only till we have bc in the scope. In readahead_callback() we
-             * need to access bc, hence we transfer ownership to the ra_context
-             * object allocated below.
-             */
-            struct ra_context *ctx = new ra_context(tsk, bc);
-            assert(ctx->bc.num_backend_calls_issued == 1);
+    return queued;
+}
 
-            READ3args args;
-            ::memset(&args, 0, sizeof(args));
-            args.file = inode->get_fh();
-            args.offset = bc.offset;
-            args.count = bc.length;
+bool ra_state::issue_read(struct bytes_chunk& bc,
+                          bool is_prefetch,
+                          bool use_reserved)
+{
+    const char *const what = is_prefetch ? "prefetch" : "readahead";
+    auto& read_cache = inode->get_filecache();
 
-            /*
-             * Grab a ref on this inode so that it is not freed when the
-             * readahead reads are going on. Since the fuse layer does not
-             * know of this readahead operation, it is possible that the fuse
-             * may release this inode soon after the application read returns.
-             * We do not want to be in that state and hence grab an extra ref
-             * on this inode.
-             * This should be decremented in readahead_callback()
-             */
-            inode->incref();
+    // get() must grab the inuse count.
+    assert(bc.get_membuf()->is_inuse());
 
-            AZLogDebug("[{}] Issuing readahead read to backend at "
-                       "off: {} len: {}",
-                       inode->get_fuse_ino(),
-                       args.offset,
-                       args.count);
+    /*
+     * Before we issue READ to populate the bytes_chunk, take the
+     * membuf lock. We use try_lock() and skip readahead if we don't
+     * get the lock. It's ok to skip readahead rather than holding the
+     * caller. Mostly if there is a single reader we will get the lock.
+     * This lock will be released in the readahead_callback() after the
+     * buffer is populated.
+     * Note that if the membuf is already locked it means some other
+     * context is already performing IO to it. We should not release
+     * the buffer.
+     */
+    if (!bc.get_membuf()->try_lock()) {
+        AZLogWarnNR("[{}] Skipping {} at off: {} len: {}. "
+                    "Could not get membuf lock!",
+                    inode->get_fuse_ino(), what, bc.offset, bc.length);
+
+        bc.get_membuf()->clear_inuse();
+        on_read_complete(bc.offset, bc.length, is_prefetch);
+        return false;
+    }
 
-            /*
-             * tsk->get_rpc_ctx() call below will round robin readahead
-             * requests across all available connections.
-             *
-             * TODO: See if issuing a batch of reads over one connection
-             *       before moving to the other connection helps.
-             */
-            tsk->get_stats().on_rpc_issue();
-            if (rpc_nfs3_read_task(
-                        tsk->get_rpc_ctx(),
-                        readahead_callback,
-                        bc.get_buffer(),
-                        bc.length,
-                        &args,
-                        ctx) == NULL) {
-                tsk->get_stats().on_rpc_cancel();
-                /*
-                 * This call failed due to internal issues like OOM etc
-                 * and not due to an actual RPC/NFS error, anyways pretend
-                 * as if we never issued this.
-                 */
-                AZLogWarn("[{}] Skipping readahead at off: {} len: {}. "
-                          "rpc_nfs3_read_task() failed!",
-                          inode->get_fuse_ino(), args.offset, args.count);
+    /*
+     * If the buffer is already uptodate, skip readahead.
+     */
+    if (bc.get_membuf()->is_uptodate()) {
+        AZLogDebug("[{}] Skipping {} at off: {} len: {}. "
+                   "Membuf already uptodate!",
+                   inode->get_fuse_ino(), what, bc.offset, bc.length);
+
+        bc.get_membuf()->clear_locked();
+        bc.get_membuf()->clear_inuse();
+        on_read_complete(bc.offset, bc.length, is_prefetch);
+        return false;
+    }
 
-                on_readahead_complete(bc.offset, bc.length);
+    /*
+     * If the disk cache has this byte range, read it from there.
+     * The read is done by a disk cache IO thread so that we don't
+     * hold up the application read which called us.
+     */
+    const std::shared_ptr<disk_cache_entry>& dce =
+        inode->get_dcache_entry();
+    if (dce && dce->is_cached(bc.offset, bc.length) &&
+        disk_readahead(bc, is_prefetch)) {
+        return true;
+    }
 
-                bc.get_membuf()->clear_locked();
-                bc.get_membuf()->clear_inuse();
+    /*
+     * Ok, now issue READ RPCs to read this byte range.
+     */
+    struct rpc_task *tsk =
+        client->get_rpc_task_helper()->alloc_rpc_task(FUSE_READ,
+                                                      use_reserved);
 
-                // Release the buffer since we did not fill it.
-                read_cache->release(bc.offset, bc.length);
+    /*
+     * fuse_req is needed to send the fuse response, since we don't
+     * need to send response for readahead reads, it can be null.
+     * fuse_file_info is not used too.
+     */
+    tsk->init_read_be(inode->get_fuse_ino(),  /* ino */
+                      bc.length,              /* size */
+                      bc.offset);             /* offset */
 
-                tsk->free_rpc_task();
-                delete ctx;
+    // No reads should be issued to backend at this point.
+    assert(bc.num_backend_calls_issued == 0);
+    bc.num_backend_calls_issued++;
 
-                // Decrement the extra ref that was taken.
-                inode->decref();
+    assert(bc.pvt == 0);
 
-                continue;
-            }
+    /*
+     * bc holds a ref on the membuf so we can safely access membuf
+     * only till we have bc in the scope. In readahead_callback() we
+     * need to access bc, hence we transfer ownership to the ra_context
+     * object allocated below.
+     */
+    struct ra_context *ctx =
+        new ra_context(tsk, bc,
+                       dce ? dce->get_gen() : DISK_CACHE_NO_GEN,
+                       is_prefetch);
+    assert(ctx->bc.num_backend_calls_issued == 1);
+
+    READ3args args;
+    ::memset(&args, 0, sizeof(args));
+    args.file = inode->get_fh();
+    args.offset = bc.offset;
+    args.count = bc.length;
+
+    /*
+     * Grab a ref on this inode so that it is not freed when the
+     * readahead reads are going on. Since the fuse layer does not
+     * know of this readahead operation, it is possible that the fuse
+     * may release this inode soon after the application read returns.
+     * We do not want to be in that state and hence grab an extra ref
+     * on this inode.
+     * This should be decremented in readahead_callback()
+     */
+    inode->incref();
 
-            ra_issued++;
+    AZLogDebug("[{}] Issuing {} read to backend at off: {} len: {}",
+               inode->get_fuse_ino(),
+               what,
+               args.offset,
+               args.count);
 
-            AZLogDebug("[{}] rpc_nfs3_read_task() successfully dispatched "
-                       "#{} readahead at off: {} len: {}. ",
-                       inode->get_fuse_ino(),
-                       ra_issued,
-                       args.offset,
-                       args.count);
+    /*
+     * tsk->get_rpc_ctx() call below will round robin readahead
+     * requests across all available connections.
+     *
+     * TODO: See if issuing a batch of reads over one connection
+     *       before moving to the other connection helps.
+     */
+    tsk->get_stats().on_rpc_issue();
+    if (rpc_nfs3_read_task(
+                tsk->get_rpc_ctx(args.count),
+                readahead_callback,
+                bc.get_buffer(),
+                bc.length,
+                &args,
+                ctx) == NULL) {
+        tsk->get_stats().on_rpc_cancel();
+        /*
+         * This call failed due to internal issues like OOM etc
+         * and not due to an actual RPC/NFS error, anyways pretend
+         * as if we never issued this.
+         */
+        AZLogWarn("[{}] Skipping {} at off: {} len: {}. "
+                  "rpc_nfs3_read_task() failed!",
+                  inode->get_fuse_ino(), what, args.offset, args.count);
+
+        bc.get_membuf()->clear_locked();
+        bc.get_membuf()->clear_inuse();
+
+        // Release the buffer since we did not fill it.
+        read_cache->release(bc.offset, bc.length);
+
+        tsk->free_rpc_task();
+        delete ctx;
+
+        on_read_complete(bc.offset, bc.length, is_prefetch);
+
+        // Decrement the extra ref that was taken.
+        inode->decref();
+
+        return false;
+    }
+
+    AZLogDebug("[{}] rpc_nfs3_read_task() successfully dispatched "
+               "{} at off: {} len: {}. ",
+               inode->get_fuse_ino(),
+               what,
+               args.offset,
+               args.count);
+
+    return true;
+}
+
+/*
+ * TODO: Add readahead stats.
+ */
+/**
+ * Note: This takes shared lock on ilock_1.
+ */
+int ra_state::issue_readaheads()
+{
+    int64_t ra_offset;
+    uint64_t ra_length = 0;
+
+    /*
+     * issue_readaheads() MUST only be called for open files which will have
+     * the file cache initialized.
+     */
+    assert(inode->has_filecache());
+
+    auto& read_cache = inode->get_filecache();
+    int ra_issued = 0;
+
+    /*
+     * If userspace data cache is disabled, don't do readaheads.
+     */
+    if (!aznfsc_cfg.cache.data.user.enable) {
+        return 0;
+    }
+
+    /*
+     * Issue all readaheads allowed by this ra_state.
+     */
+    while ((ra_offset = get_next_ra(0, &ra_length)) > 0) {
+        AZLogDebug("[{}] Issuing readahead at off: {} len: {}: ongoing: {} "
+                   "sfsize: {} cfsize: {} csfsize: {} ({})",
+                   inode->get_fuse_ino(), ra_offset, ra_length,
+                   ra_ongoing.load(),
+                   inode->get_server_file_size(),
+                   inode->get_client_file_size(),
+                   inode->get_cached_filesize(),
+                   get_ra_bytes());
+
+        /*
+         * Get bytes_chunk representing the byte range we want to readahead
+         * and issue READ RPCs for all.
+         */
+        std::vector<bytes_chunk> bcv = read_cache->get(ra_offset, ra_length);
+
+        for (bytes_chunk& bc : bcv) {
+
+            // Every bytes_chunk must lie within the readahead.
+            assert(bc.offset >= (uint64_t) ra_offset);
+            assert((bc.offset + bc.length) <= (ra_offset + ra_length));
+
+            if (issue_read(bc, false /* is_prefetch */)) {
+                ra_issued++;
+            }
         }
     }
 
@@ -700,6 +1591,17 @@ int ra_state::issue_readaheads()
     return ra_issued;
 }
 
+/*
+ * random_number() can return values at most 2^32 apart, unit_test() needs
+ * offsets spread over TiBs.
+ */
+static uint64_t random_offset(uint64_t min, uint64_t max)
+{
+    const uint64_t r = (random_number(0, UINT32_MAX) << 32) |
+                       random_number(0, UINT32_MAX);
+    return min + (r % (max - min + 1));
+}
+
 /* static */
 int ra_state::unit_test()
 {
@@ -715,13 +1617,13 @@ int ra_state::unit_test()
     ras.on_application_read(next_read, 1*_MiB);
 
     // Only 1 read complete, cannot confirm sequential pattern till 3 reads.
-    assert(ras.get_next_ra(4*_MiB) == 0);
+    assert(ras.get_next_ra(4*_MiB) <= 0);
 
     next_read += 1*_MiB;
     ras.on_application_read(next_read, 1*_MiB);
 
     // Only 2 reads complete, cannot confirm sequential pattern till 3 reads.
-    assert(ras.get_next_ra(4*_MiB) == 0);
+    assert(ras.get_next_ra(4*_MiB) <= 0);
 
     next_read += 1*_MiB;
     ras.on_application_read(next_read, 1*_MiB);
@@ -748,7 +1650,7 @@ int ra_state::unit_test()
     }
 
     // No more readahead reads after full ra window is issued.
-    assert(ras.get_next_ra(4*_MiB) == 0);
+    assert(ras.get_next_ra(4*_MiB) <= 0);
 
     /*
      * Complete one readahead.
@@ -758,12 +1660,24 @@ int ra_state::unit_test()
     complete_ra = 3*_MiB;
     ras.on_readahead_complete(complete_ra);
 
+    /*
+     * Readahead window is still fully read ahead, application must read more
+     * before we readahead more.
+     */
+    assert(ras.get_next_ra(4*_MiB) <= 0);
+
+    // Application reads next 4MiB, moving the readahead window 4MiB ahead.
+    for (int i = 0; i < 4; i++) {
+        next_read += 1*_MiB;
+        ras.on_application_read(next_read, 1*_MiB);
+    }
+
     // One more readahead should be allowed.
     next_ra += 4*_MiB;
     assert(ras.get_next_ra(4*_MiB) == next_ra);
 
     // Not any more.
-    assert(ras.get_next_ra(4*_MiB) == 0);
+    assert(ras.get_next_ra(4*_MiB) <= 0);
 
     // Complete all readahead reads.
     for (int i = 0; i < 32; i++) {
@@ -771,7 +1685,12 @@ int ra_state::unit_test()
         ras.on_readahead_complete(complete_ra, 4*_MiB);
     }
 
-    // Now it should recommend next readahead.
+    // Application reads next 4MiB, now it should recommend next readahead.
+    for (int i = 0; i < 4; i++) {
+        next_read += 1*_MiB;
+        ras.on_application_read(next_read, 1*_MiB);
+    }
+
     next_ra += 4*_MiB;
     assert(ras.get_next_ra(4*_MiB) == next_ra);
 
@@ -782,17 +1701,17 @@ int ra_state::unit_test()
     /*
      * Now issue next read at 100MB offset.
      * This will cause access density to drop since now we have a gap of
-     * 97MiB and we have just read 4MiB till now.
+     * 89MiB and we have just read 11MiB till now.
      */
     ras.on_application_read(100*_MiB, 1*_MiB);
-    assert(ras.get_next_ra(4*_MiB) == 0);
+    assert(ras.get_next_ra(4*_MiB) <= 0);
 
     /*
      * Read the entire gap.
      * This will fill the gap and get the access density back to 100%, so
      * now it should recommend readahead.
      */
-    for (int i = 0; i < 97; i++) {
+    for (int i = 0; i < 89; i++) {
         next_read += 1*_MiB;
         ras.on_application_read(next_read, 1*_MiB);
     }
@@ -813,12 +1732,12 @@ int ra_state::unit_test()
      */
     next_read = 2*_GiB;
     ras.on_application_read(next_read, 1*_MiB);
-    assert(ras.get_next_ra(4*_MiB) == 0);
+    assert(ras.get_next_ra(4*_MiB) <= 0);
 
     // 2nd read in the new section.
     next_read += 1*_MiB;
     ras.on_application_read(next_read, 1*_MiB);
-    assert(ras.get_next_ra(4*_MiB) == 0);
+    assert(ras.get_next_ra(4*_MiB) <= 0);
 
     // 3rd read in the new section.
     next_read += 1*_MiB;
@@ -833,16 +1752,16 @@ int ra_state::unit_test()
      */
     next_read = 4*_GiB;
     ras.on_application_read(next_read, 1*_MiB);
-    assert(ras.get_next_ra(4*_MiB) == 0);
+    assert(ras.get_next_ra(4*_MiB) <= 0);
 
     for (int i = 0; i < 1000; i++) {
-        next_read = random_number(0, 1*_TiB);
+        next_read = random_offset(1*_TiB, 2*_TiB);
         ras.on_application_read(next_read, 1*_MiB);
-        assert(ras.get_next_ra(4*_MiB) == 0);
+        assert(ras.get_next_ra(4*_MiB) <= 0);
 
-        next_read = random_number(1*_TiB, 2*_TiB);
+        next_read = random_offset(2*_TiB, 3*_TiB);
         ras.on_application_read(next_read, 1*_MiB);
-        assert(ras.get_next_ra(4*_MiB) == 0);
+        assert(ras.get_next_ra(4*_MiB) <= 0);
     }
 
     /*
@@ -852,11 +1771,11 @@ int ra_state::unit_test()
      */
     next_read = 10*_GiB;
     ras.on_application_read(next_read, 1*_MiB);
-    assert(ras.get_next_ra(4*_MiB) == 0);
+    assert(ras.get_next_ra(4*_MiB) <= 0);
 
     next_read += 1*_MiB;
     ras.on_application_read(next_read, 1*_MiB);
-    assert(ras.get_next_ra(4*_MiB) == 0);
+    assert(ras.get_next_ra(4*_MiB) <= 0);
 
     next_read += 1*_MiB;
     ras.on_application_read(next_read, 1*_MiB);
@@ -865,8 +1784,14 @@ int ra_state::unit_test()
     assert(ras.get_next_ra(4*_MiB) == next_ra);
 
     for (int i = 0; i < 2000; i++) {
-        next_read += 1*_MiB;
-        ras.on_application_read(next_read, 1*_MiB);
+        /*
+         * Read 4MiB for every 4MiB readahead, so that the readahead window
+         * keeps moving.
+         */
+        for (int j = 0; j < 4; j++) {
+            next_read += 1*_MiB;
+            ras.on_application_read(next_read, 1*_MiB);
+        }
 
         next_ra += 4*_MiB;
         assert(ras.get_next_ra(4*_MiB) == next_ra);
@@ -877,25 +1802,247 @@ int ra_state::unit_test()
 
     // Stress run.
     for (int i = 0; i < 10'000'000; i++) {
-        next_read = random_number(0, 1*_TiB);
+        next_read = random_offset(1*_TiB, 2*_TiB);
         ras.on_application_read(next_read, 1*_MiB);
         assert(!ras.is_sequential());
-        assert(ras.get_next_ra(4*_MiB) == 0);
+        assert(ras.get_next_ra(4*_MiB) <= 0);
 
-        next_read = random_number(1*_TiB, 2*_TiB);
+        next_read = random_offset(2*_TiB, 3*_TiB);
         ras.on_application_read(next_read, 1*_MiB);
         assert(!ras.is_sequential());
-        assert(ras.get_next_ra(4*_MiB) == 0);
+        assert(ras.get_next_ra(4*_MiB) <= 0);
 
-        next_read = random_number(2*_TiB, 3*_TiB);
+        next_read = random_offset(3*_TiB, 4*_TiB);
         ras.on_application_read(next_read, 1*_MiB);
         assert(!ras.is_sequential());
-        assert(ras.get_next_ra(4*_MiB) == 0);
+        assert(ras.get_next_ra(4*_MiB) <= 0);
 
-        next_read = random_number(3*_TiB, 4*_TiB);
+        next_read = random_offset(4*_TiB, 4*_TiB + 512*_GiB);
         ras.on_application_read(next_read, 1*_MiB);
         assert(!ras.is_sequential());
-        assert(ras.get_next_ra(4*_MiB) == 0);
+        assert(ras.get_next_ra(4*_MiB) <= 0);
+    }
+
+    /*
+     * Multiple interleaved sequential streams.
+     * 4 readers each reading sequentially from a different 10GiB region of
+     * the file, with their reads interleaved. Each stream must be detected
+     * as sequential and get its share (1/4th) of the readahead window.
+     */
+    {
+        ra_state ras2{128 * 1024, 4 * 1024};
+        const int nstreams = 4;
+        uint64_t base[nstreams];
+        uint64_t stream_ra[nstreams];
+
+        for (int i = 0; i < nstreams; i++) {
+            base[i] = (i + 1) * 10 * _GiB;
+        }
+
+        // First 2 rounds, not enough reads to detect the pattern.
+        for (int r = 0; r < 2; r++) {
+            for (int i = 0; i < nstreams; i++) {
+                ras2.on_application_read(base[i] + r*_MiB, 1*_MiB);
+                assert(!ras2.is_sequential());
+                assert(ras2.get_next_ra(4*_MiB) <= 0);
+            }
+        }
+
+        // 3rd round, every stream is now sequential.
+        for (int i = 0; i < nstreams; i++) {
+            ras2.on_application_read(base[i] + 2*_MiB, 1*_MiB);
+            assert(ras2.is_sequential());
+            assert(ras2.get_next_ra(4*_MiB) == (int64_t) (base[i] + 3*_MiB));
+            stream_ra[i] = base[i] + 3*_MiB;
+        }
+
+        /*
+         * 4th round, after reading next 1MiB every stream can readahead
+         * till max_byte_read+32MiB, i.e., 7 more readaheads.
+         * This uses up the entire 128MiB ra_ongoing budget.
+         */
+        for (int i = 0; i < nstreams; i++) {
+            ras2.on_application_read(base[i] + 3*_MiB, 1*_MiB);
+            assert(ras2.is_sequential());
+
+            for (int j = 0; j < 7; j++) {
+                stream_ra[i] += 4*_MiB;
+                assert(ras2.get_next_ra(4*_MiB) == (int64_t) stream_ra[i]);
+            }
+            assert(ras2.get_next_ra(4*_MiB) <= 0);
+        }
+
+        /*
+         * A random read starts a new stream and doesn't disturb the
+         * existing streams.
+         */
+        ras2.on_application_read(4*_TiB, 1*_MiB);
+        assert(!ras2.is_sequential());
+        assert(ras2.get_next_ra(4*_MiB) <= 0);
+
+        // Complete all readaheads.
+        for (int i = 0; i < nstreams * 8; i++) {
+            ras2.on_readahead_complete(0, 4*_MiB);
+        }
+
+        /*
+         * Every stream reads 4MiB more, it's still sequential and can
+         * readahead the next 4MiB.
+         */
+        for (int i = 0; i < nstreams; i++) {
+            for (int r = 4; r < 8; r++) {
+                ras2.on_application_read(base[i] + r*_MiB, 1*_MiB);
+            }
+            assert(ras2.is_sequential());
+
+            stream_ra[i] += 4*_MiB;
+            assert(ras2.get_next_ra(4*_MiB) == (int64_t) stream_ra[i]);
+            assert(ras2.get_next_ra(4*_MiB) <= 0);
+        }
+
+        /*
+         * All readaheads lie in the readahead window while data already read
+         * doesn't.
+         */
+        for (int i = 0; i < nstreams; i++) {
+            assert(ras2.in_ra_window(stream_ra[i], 4*_MiB));
+            assert(!ras2.in_ra_window(base[i], 4*_MiB));
+        }
+    }
+
+    /*
+     * Strided reads.
+     * 256KiB records read at a stride of 1MiB, access density is 25% so this
+     * is not sequential, but after 3 reads at the same stride the stream is
+     * strided and we readahead the next records (and not the gaps).
+     */
+    {
+        ra_state ras3{128 * 1024, 4 * 1024};
+        const uint64_t reclen = 256 * 1024;
+        const uint64_t stride = 1*_MiB;
+        uint64_t ra_length = 0;
+
+        ras3.on_application_read(0, reclen);
+        assert(ras3.get_next_ra(4*_MiB) <= 0);
+
+        ras3.on_application_read(stride, reclen);
+        assert(!ras3.is_strided());
+        assert(ras3.get_next_ra(4*_MiB) <= 0);
+
+        ras3.on_application_read(2 * stride, reclen);
+        assert(!ras3.is_sequential());
+        assert(ras3.is_strided());
+
+        /*
+         * 128MiB window holds 512 records, ra_ongoing budget also allows
+         * 512 records.
+         */
+        for (int i = 0; i < 512; i++) {
+            next_ra = (3 + i) * stride;
+            assert(ras3.get_next_ra(4*_MiB, &ra_length) == next_ra);
+            assert(ra_length == reclen);
+        }
+        assert(ras3.get_next_ra(4*_MiB, &ra_length) <= 0);
+
+        // Records read ahead are in the readahead window, gaps are not.
+        assert(ras3.in_ra_window(514 * stride, reclen));
+        assert(!ras3.in_ra_window(600 * stride, reclen));
+
+        for (int i = 0; i < 512; i++) {
+            ras3.on_readahead_complete(0, reclen);
+        }
+
+        /*
+         * Next record read moves the readahead window by one record, even
+         * though this read is far from the last readahead.
+         */
+        ras3.on_application_read(3 * stride, reclen);
+        assert(ras3.is_strided());
+        assert(ras3.get_next_ra(4*_MiB, &ra_length) == (int64_t) (515 * stride));
+        assert(ra_length == reclen);
+        assert(ras3.get_next_ra(4*_MiB, &ra_length) <= 0);
+        ras3.on_readahead_complete(0, reclen);
+
+        /*
+         * Read not at the stride, stride has to be proved again.
+         */
+        ras3.on_application_read(4 * stride + 4096, reclen);
+        assert(!ras3.is_strided());
+        assert(ras3.get_next_ra(4*_MiB) <= 0);
+    }
+
+    /*
+     * Strided reads with records larger than the readahead IO size.
+     * Records are read ahead in multiple readahead IOs.
+     */
+    {
+        ra_state ras4{128 * 1024, 4 * 1024};
+        const uint64_t reclen = 6*_MiB;
+        const uint64_t stride = 16*_MiB;
+        uint64_t ra_length = 0;
+
+        for (int i = 0; i < 3; i++) {
+            ras4.on_application_read(i * stride, reclen);
+        }
+        assert(!ras4.is_sequential());
+        assert(ras4.is_strided());
+
+        assert(ras4.get_next_ra(0, &ra_length) == (int64_t) (3 * stride));
+        assert(ra_length == 4*_MiB);
+        assert(ras4.get_next_ra(0, &ra_length) ==
+               (int64_t) (3 * stride + 4*_MiB));
+        assert(ra_length == 2*_MiB);
+        assert(ras4.get_next_ra(0, &ra_length) == (int64_t) (4 * stride));
+        assert(ra_length == 4*_MiB);
+    }
+
+    /*
+     * Strided reads with stride larger than the readahead window.
+     * Every read starts a new stream, after STRIDE_MIN_READS_FAR reads at
+     * the same stride the stream is strided and we readahead the next
+     * record, even across sections.
+     */
+    for (const uint64_t stride : {256*_MiB, 1536*_MiB}) {
+        ra_state ras5{128 * 1024, 4 * 1024};
+        const uint64_t reclen = 64 * 1024;
+        const uint64_t nreads = STRIDE_MIN_READS_FAR;
+        uint64_t ra_length = 0;
+
+        for (uint64_t i = 0; i < nreads; i++) {
+            ras5.on_application_read(1*_MiB + i * stride, reclen);
+            if (i < (nreads - 1)) {
+                assert(!ras5.is_strided());
+                assert(ras5.get_next_ra(4*_MiB) <= 0);
+            }
+        }
+        assert(!ras5.is_sequential());
+        assert(ras5.is_strided());
+
+        next_ra = 1*_MiB + nreads * stride;
+        assert(ras5.get_next_ra(0, &ra_length) == next_ra);
+        assert(ra_length == reclen);
+        assert(ras5.get_next_ra(0, &ra_length) == (int64_t) (next_ra + stride));
+        assert(ras5.in_ra_window(next_ra, reclen));
+
+        // Next record is matched to the strided stream.
+        ras5.on_application_read(next_ra, reclen);
+        assert(ras5.is_strided());
+    }
+
+    /*
+     * Reads far apart with one record out of stride, the stride has to be
+     * proved afresh after it.
+     */
+    {
+        ra_state ras6{128 * 1024, 4 * 1024};
+        const uint64_t stride = 256*_MiB;
+
+        for (uint64_t i = 0; i < STRIDE_MIN_READS_FAR; i++) {
+            ras6.on_application_read(i * stride + ((i == 4) ? 4096 : 0),
+                                     1*_MiB);
+            assert(!ras6.is_strided());
+            assert(ras6.get_next_ra(4*_MiB) <= 0);
+        }
     }
 
     AZLogInfo("Unit testing ra_state, done!");
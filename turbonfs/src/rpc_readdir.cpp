@@ -8,16 +8,19 @@
 /* static */ std::atomic<uint64_t> readdirectory_cache::num_readdirplus_calls_g = 0;
 /* static */ std::atomic<uint64_t> readdirectory_cache::num_dirents_returned_g = 0;
 /* static */ std::atomic<uint64_t> readdirectory_cache::bytes_allocated_g = 0;
+/* static */ std::atomic<uint64_t> readdirectory_cache::num_prefetch_calls_g = 0;
+/* static */ std::atomic<uint64_t> readdirectory_cache::num_dirents_prefetched_g = 0;
 
 directory_entry::directory_entry(char *name_,
                                  cookie3 cookie_,
                                  const struct stat& attr,
                                  struct nfs_inode* nfs_inode_) :
     cookie(cookie_),
-    attributes(attr),
-    has_attributes(true),
+    fileid(attr.st_ino),
     nfs_inode(nfs_inode_),
-    name(name_)
+    name(name_),
+    mode(attr.st_mode),
+    has_attributes(true)
 {
     assert(name != nullptr);
     // Sanity check for attr. Blob NFS only supports these files.
@@ -45,60 +48,20 @@ directory_entry::directory_entry(char *name_,
                                  cookie3 cookie_,
                                  uint64_t fileid_) :
     cookie(cookie_),
-#if defined(__aarch64__)
-    attributes {
-        .st_dev = 0,
-        .st_ino = fileid_,
-        .st_mode = 0,
-        .st_nlink = 0,
-        .st_uid = 0,
-        .st_gid = 0,
-        .st_rdev = 0,
-        .__pad1 = 0,
-        .st_size = 0,
-        .st_blksize = 0,
-        .__pad2 = 0,
-        .st_blocks = 0,
-        .st_atim = {0, 0},
-        .st_mtim = {0, 0},
-        .st_ctim = {0, 0},
-        .__glibc_reserved = {}
-    },
-#else
-    attributes {
-        .st_dev = 0,
-        .st_ino = fileid_,
-        .st_nlink = 0,
-        .st_mode = 0,
-        .st_uid = 0,
-        .st_gid = 0,
-        .__pad0 = 0,
-        .st_rdev = 0,
-        .st_size = 0,
-        .st_blksize = 0,
-        .st_blocks = 0,
-        .st_atim = {0, 0},
-        .st_mtim = {0, 0},
-        .st_ctim = {0, 0},
-        .__glibc_reserved = {}
-    },
-#endif
-    has_attributes(false),
+    fileid(fileid_),
     nfs_inode(nullptr),
-    name(name_)
+    name(name_),
+    /*
+     * fuse_add_direntry() needs fileid and mode (for the filetype). A readdir
+     * response doesn't tell us about the filetype, so we set it to 0.
+     */
+    mode(0),
+    has_attributes(false)
 {
     assert(name != nullptr);
     // NFS recommends against this.
     assert(fileid_ != 0);
 
-    /*
-     * fuse_add_direntry() needs these two fields, so we need to set them.
-     * A readdir response doesn't tell us about the filetype (which is what
-     * fuse wants to extract from the st_mode fields), so we set it to 0.
-     */
-    assert(attributes.st_ino == fileid_);
-    assert(attributes.st_mode == 0);
-
     readdirectory_cache::num_dirents_g++;
     readdirectory_cache::bytes_allocated_g += get_cache_size();
 }
@@ -122,6 +85,243 @@ directory_entry::~directory_entry()
     ::free(const_cast<char*>(name));
 }
 
+dirent_store::dirent_store(dirent_store&& other) :
+    chunks(std::move(other.chunks)),
+    num_entries(other.num_entries)
+{
+    // bytes_allocated_g already accounts the chunks we took over.
+    other.chunks.clear();
+    other.num_entries = 0;
+}
+
+dirent_store::~dirent_store()
+{
+    clear();
+}
+
+void dirent_store::clear()
+{
+    assert(readdirectory_cache::bytes_allocated_g >= get_cache_size());
+    readdirectory_cache::bytes_allocated_g -= get_cache_size();
+
+    chunks.clear();
+    num_entries = 0;
+}
+
+dirent_store::chunk& dirent_store::get_chunk(cookie3 cookie)
+{
+    const auto [it, inserted] =
+        chunks.try_emplace(cookie >> DIRENT_CHUNK_SHIFT);
+
+    if (inserted) {
+        readdirectory_cache::bytes_allocated_g += CHUNK_BYTES;
+    }
+
+    return it->second;
+}
+
+void dirent_store::erase_chunk(std::map<uint64_t, chunk>::iterator it)
+{
+    assert(it != chunks.end());
+
+    chunks.erase(it);
+
+    assert(readdirectory_cache::bytes_allocated_g >= CHUNK_BYTES);
+    readdirectory_cache::bytes_allocated_g -= CHUNK_BYTES;
+}
+
+bool dirent_store::emplace(const std::shared_ptr<struct directory_entry>& entry)
+{
+    assert(entry);
+
+    chunk& c = get_chunk(entry->cookie);
+    std::shared_ptr<struct directory_entry>& slot =
+        c.slots[entry->cookie & (DIRENT_CHUNK_SIZE - 1)];
+
+    if (slot) {
+        assert(slot->cookie == entry->cookie);
+        return false;
+    }
+
+    slot = entry;
+    c.count++;
+    num_entries++;
+
+    assert(c.count <= DIRENT_CHUNK_SIZE);
+    return true;
+}
+
+const std::shared_ptr<struct directory_entry>&
+dirent_store::find(cookie3 cookie) const
+{
+    static const std::shared_ptr<struct directory_entry> null_entry;
+
+    const auto it = chunks.find(cookie >> DIRENT_CHUNK_SHIFT);
+    if (it == chunks.end()) {
+        return null_entry;
+    }
+
+    const std::shared_ptr<struct directory_entry>& slot =
+        it->second.slots[cookie & (DIRENT_CHUNK_SIZE - 1)];
+    assert(!slot || (slot->cookie == cookie));
+
+    return slot;
+}
+
+bool dirent_store::erase(cookie3 cookie)
+{
+    const auto it = chunks.find(cookie >> DIRENT_CHUNK_SHIFT);
+    if (it == chunks.end()) {
+        return false;
+    }
+
+    std::shared_ptr<struct directory_entry>& slot =
+        it->second.slots[cookie & (DIRENT_CHUNK_SIZE - 1)];
+    if (!slot) {
+        return false;
+    }
+
+    slot.reset();
+    assert(num_entries > 0);
+    num_entries--;
+
+    assert(it->second.count > 0);
+    if (--it->second.count == 0) {
+        erase_chunk(it);
+    }
+
+    return true;
+}
+
+/* static */
+uint64_t dnlc_index::hash_name(const char *name)
+{
+    // FNV-1a.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (const unsigned char *p = (const unsigned char *) name; *p; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+size_t dnlc_index::probe(const char *name, uint64_t hash) const
+{
+    assert(!slots.empty());
+    const size_t mask = slots.size() - 1;
+
+    for (size_t i = (hash & mask); ; i = ((i + 1) & mask)) {
+        const struct slot& sl = slots[i];
+        if (!sl.entry ||
+            ((sl.hash == hash) && (::strcmp(sl.entry->name, name) == 0))) {
+            return i;
+        }
+    }
+}
+
+const struct directory_entry *dnlc_index::find(const char *name) const
+{
+    assert(name != nullptr);
+
+    if (count == 0) {
+        return nullptr;
+    }
+
+    return slots[probe(name, hash_name(name))].entry;
+}
+
+void dnlc_index::clear()
+{
+    assert(readdirectory_cache::bytes_allocated_g >= get_cache_size());
+    readdirectory_cache::bytes_allocated_g -= get_cache_size();
+
+    // Release the memory too.
+    std::vector<struct slot>().swap(slots);
+    count = 0;
+}
+
+void dnlc_index::grow()
+{
+    std::vector<struct slot> old;
+    old.swap(slots);
+
+    slots.resize(old.empty() ? 16 : (old.size() * 2));
+    const size_t mask = slots.size() - 1;
+
+    readdirectory_cache::bytes_allocated_g +=
+        ((slots.size() - old.size()) * sizeof(struct slot));
+
+    for (const struct slot& sl : old) {
+        if (sl.entry) {
+            size_t i = (sl.hash & mask);
+            while (slots[i].entry) {
+                i = ((i + 1) & mask);
+            }
+            slots[i] = sl;
+        }
+    }
+}
+
+void dnlc_index::insert(const struct directory_entry *entry)
+{
+    assert(entry != nullptr);
+
+    // Keep load factor under 75%.
+    if (((count + 1) * 4) > (slots.size() * 3)) {
+        grow();
+    }
+
+    const uint64_t hash = hash_name(entry->name);
+    const size_t i = probe(entry->name, hash);
+
+    // Caller must have removed the old entry with the same name.
+    assert(slots[i].entry == nullptr);
+
+    slots[i].entry = entry;
+    slots[i].hash = hash;
+    count++;
+}
+
+bool dnlc_index::erase(const char *name)
+{
+    if (count == 0) {
+        return false;
+    }
+
+    const size_t mask = slots.size() - 1;
+    size_t i = probe(name, hash_name(name));
+
+    if (!slots[i].entry) {
+        return false;
+    }
+
+    /*
+     * Backward shift deletion.
+     * Move back any following entry (till the next empty slot) whose home
+     * slot is not cyclically in (i, j], so that it's still reachable from
+     * its home slot through a sequence of non-empty slots.
+     */
+    for (size_t j = ((i + 1) & mask); slots[j].entry; j = ((j + 1) & mask)) {
+        const size_t home = (slots[j].hash & mask);
+        const bool home_in_range =
+            (i <= j) ? ((i < home) && (home <= j)) :
+                       ((i < home) || (home <= j));
+        if (!home_in_range) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+
+    slots[i] = {};
+
+    assert(count > 0);
+    count--;
+
+    return true;
+}
+
 readdirectory_cache::~readdirectory_cache()
 {
     AZLogDebug("[{}] ~readdirectory_cache() called", dir_inode->get_fuse_ino());
@@ -130,6 +330,7 @@ readdirectory_cache::~readdirectory_cache()
      * The cache must have been purged before deleting.
      */
     assert(dir_entries.empty());
+    assert(retired.empty());
 
     assert(readdirectory_cache::num_caches > 0);
     readdirectory_cache::num_caches--;
@@ -199,6 +400,98 @@ void readdirectory_cache::set_eof(uint64_t eof_cookie)
     }
 }
 
+void readdirectory_cache::on_fuse_readdirplus(uint64_t offset,
+                                              uint64_t num_dirents)
+{
+    std::unique_lock<std::shared_mutex> lock(readdircache_lock_2);
+
+    fuse_offset = offset;
+    if (num_dirents != 0) {
+        last_batch_dirents = num_dirents;
+    }
+}
+
+bool readdirectory_cache::start_prefetch(cookie3& cookie)
+{
+    // Maximum readdir cache size allowed in bytes.
+    static const uint64_t max_cache =
+        (aznfsc_cfg.cache.readdir.user.max_size_mb * 1024 * 1024ULL);
+    const uint64_t max_single_cache =
+        std::min((uint64_t) MAX_CACHE_SIZE_LIMIT, max_cache / 2);
+    const uint64_t prefetch_depth = aznfsc_cfg.cache.readdir.user.prefetch_depth;
+    /*
+     * A READDIRPLUS response can carry at most readdir_maxcount bytes, use
+     * that as a conservative estimate of the cache growth due to one
+     * prefetch batch.
+     */
+    const uint64_t batch_bytes = aznfsc_cfg.readdir_maxcount;
+
+    if (prefetch_depth == 0) {
+        return false;
+    }
+
+    std::unique_lock<std::shared_mutex> lock(readdircache_lock_2);
+
+    if (prefetch_inflight || eof || lookuponly || invalidate_pending) {
+        return false;
+    }
+
+    /*
+     * Sequential enumeration: fuse has moved past the first batch and is
+     * querying cookies from the sequence we have cached from the start of
+     * the directory. Random seekdir() or a fresh opendir+readdir of a small
+     * directory won't trigger prefetch.
+     */
+    if (fuse_offset == 0 || seq_last_cookie == 0 ||
+        fuse_offset > seq_last_cookie || last_batch_dirents == 0) {
+        return false;
+    }
+
+    // Already prefetch_depth batches ahead of fuse?
+    if ((seq_last_cookie - fuse_offset) >=
+        (prefetch_depth * last_batch_dirents)) {
+        return false;
+    }
+
+    /*
+     * Don't let prefetch cause the per-directory cache purge in add(), or
+     * consume the global readdir cache which may be better used by other
+     * directories.
+     */
+    if ((cache_size + batch_bytes) >= max_single_cache ||
+        (bytes_allocated_g + batch_bytes) >= max_cache) {
+        AZLogDebug("[{}] Not prefetching, readdir cache near limit "
+                   "(cache_size: {}, bytes_allocated_g: {})",
+                   dir_inode->get_fuse_ino(), cache_size,
+                   bytes_allocated_g.load());
+        return false;
+    }
+
+    prefetch_inflight = true;
+    cookie = seq_last_cookie;
+    num_prefetch_calls_g++;
+
+    AZLogDebug("[{}] Prefetching READDIRPLUS from cookie {} (fuse_offset: {}, "
+               "last_batch_dirents: {})",
+               dir_inode->get_fuse_ino(), cookie, fuse_offset,
+               last_batch_dirents);
+
+    return true;
+}
+
+void readdirectory_cache::prefetch_done(uint64_t num_dirents)
+{
+    std::unique_lock<std::shared_mutex> lock(readdircache_lock_2);
+
+    assert(prefetch_inflight);
+    prefetch_inflight = false;
+
+    if (num_dirents != 0) {
+        last_batch_dirents = num_dirents;
+        num_dirents_prefetched_g += num_dirents;
+    }
+}
+
 bool readdirectory_cache::add(const std::shared_ptr<struct directory_entry>& entry,
                               const cookieverf3 *cookieverf,
                               bool acquire_lock)
@@ -303,7 +596,8 @@ bool readdirectory_cache::add(const std::shared_ptr<struct directory_entry>& ent
                    entry->nfs_inode ? entry->nfs_inode->dircachecnt.load() : -1,
                    entry->nfs_inode ? entry->nfs_inode->lookupcnt.load() : -1);
 
-        const auto it = dir_entries.emplace(entry->cookie, entry);
+        const size_t index_bytes = get_index_bytes_nolock();
+        const bool added = dir_entries.emplace(entry);
 
         /*
          * Now atomically update readdirectory_cache's cookieverf, so that any
@@ -324,7 +618,7 @@ bool readdirectory_cache::add(const std::shared_ptr<struct directory_entry>& ent
          *       entry->cookie, from readdir{plus}_callback() to here, inside
          *       the lock.
          */
-        if (it.second) {
+        if (added) {
             AZLogDebug("[{}] Adding dnlc cache entry {} -> {} "
                        "(dircachecnt: {}, lookupcnt: {})",
                        dir_inode->get_fuse_ino(), entry->name,
@@ -332,16 +626,20 @@ bool readdirectory_cache::add(const std::shared_ptr<struct directory_entry>& ent
                        entry->nfs_inode ? entry->nfs_inode->dircachecnt.load() : -1,
                        entry->nfs_inode ? entry->nfs_inode->lookupcnt.load() : -1);
 
-            cache_size += entry->get_cache_size();
-
             /*
              * Also add to the DNLC cache.
-             * In the common case the entry must not be present in the DNLC
-             * cache, but in case directory changes, same filename must have
-             * been seen on a different cookie value earlier.
-             * In any case, overwrite that.
+             * If the same filename was seen on a different cookie value
+             * earlier, we have removed that above.
+             */
+            dnlc_map.insert(entry.get());
+
+            /*
+             * Account the entry, and a new dir_entries chunk and/or bigger
+             * dnlc_map if this entry needed one.
              */
-            dnlc_map[entry->name] = entry->cookie;
+            assert(get_index_bytes_nolock() >= index_bytes);
+            cache_size += entry->get_cache_size() +
+                          (get_index_bytes_nolock() - index_bytes);
 
             /*
              * Update seq_last_cookie as long as the sequence of cookies isn't
@@ -358,7 +656,7 @@ bool readdirectory_cache::add(const std::shared_ptr<struct directory_entry>& ent
         }
 
         assert(dir_entries.size() == dnlc_map.size());
-        return it.second;
+        return added;
     }
 
     /*
@@ -517,10 +815,8 @@ std::shared_ptr<struct directory_entry> readdirectory_cache::lookup(
                    dir_inode->ino, filename_hint, cookie);
     }
 
-    const auto it = dir_entries.find(cookie);
-
     const std::shared_ptr<struct directory_entry>& dirent =
-        (it != dir_entries.end()) ? it->second : nullptr;
+        dir_entries.find(cookie);
 
     if (!dirent) {
         AZLogDebug("[{}] cookie: {}, not found",
@@ -642,9 +938,8 @@ bool readdirectory_cache::remove(cookie3 cookie,
                        dir_inode->ino, filename_hint, cookie);
         }
 
-        const auto it = dir_entries.find(cookie);
         std::shared_ptr<struct directory_entry> dirent =
-            (it != dir_entries.end()) ? it->second : nullptr;
+            dir_entries.find(cookie);
 
         if (!dirent){
             AZLogDebug("[{}] cookie: {}, not found",
@@ -680,8 +975,8 @@ bool readdirectory_cache::remove(cookie3 cookie,
         /*
          * Remove the DNLC entry.
          */
-        [[maybe_unused]] const int cnt = dnlc_map.erase(dirent->name);
-        assert(cnt == 1);
+        [[maybe_unused]] const bool found = dnlc_map.erase(dirent->name);
+        assert(found);
 
         /*
          * This just removes it from the cache, no destructor is called at
@@ -689,8 +984,14 @@ bool readdirectory_cache::remove(cookie3 cookie,
          * Also there could be other shared_ptr references to this
          * directory_entry, but no one can take a fresh directory_entry ref
          * after it's removed from dir_entries.
+         * If this was the last entry in its chunk, the chunk is freed too.
          */
-        dir_entries.erase(it);
+        const size_t index_bytes = get_index_bytes_nolock();
+        dir_entries.erase(cookie);
+
+        assert(index_bytes >= get_index_bytes_nolock());
+        assert(cache_size >= (index_bytes - get_index_bytes_nolock()));
+        cache_size -= (index_bytes - get_index_bytes_nolock());
 
         inode = dirent->nfs_inode;
 
@@ -762,6 +1063,101 @@ bool readdirectory_cache::remove(cookie3 cookie,
     return true;
 }
 
+void readdirectory_cache::free_entry(
+        std::shared_ptr<struct directory_entry>& de,
+        std::vector<struct nfs_inode*>& tofree_vec)
+{
+    struct nfs_inode *inode = de->nfs_inode;
+    if (inode) {
+        assert(inode->magic == NFS_INODE_MAGIC);
+        /*
+         * Any inode referenced by a directory_entry added to
+         * a readdirectory_cache must have one reference held,
+         * by readdirectory_cache::add().
+         */
+        assert(inode->dircachecnt > 0);
+
+        AZLogDebug("[{}] Removing {} \"{}\" fuse ino {}, cookie {}, from "
+                   "readdir cache (dircachecnt {}, lookupcnt {}, "
+                   "forget_expected {})",
+                   dir_inode->get_fuse_ino(),
+                   inode->is_dir() ? "directory" : "file",
+                   de->name,
+                   inode->get_fuse_ino(),
+                   de->cookie,
+                   inode->dircachecnt.load(),
+                   inode->lookupcnt.load(),
+                   inode->forget_expected.load());
+    } else {
+        AZLogDebug("[{}] Removing \"{}\", cookie {}, from readdir cache",
+                   dir_inode->get_fuse_ino(),
+                   de->name,
+                   de->cookie);
+    }
+    /*
+     * If this is the last dircachecnt on this inode, it means
+     * there are no more readdirectory_cache,s referencing this
+     * inode. If there are no lookupcnt refs then we can free it.
+     * For safely freeing the inode against any races, we need to call
+     * decref() and for that we need to make sure we have at least one
+     * ref on the inode, so we call incref() before deleting the
+     * directory_entry, and add the inode to a vector which we later
+     * iterate over and call decref() for all the inodes.
+     */
+    if (inode && (inode->dircachecnt == 1)) {
+        tofree_vec.emplace_back(inode);
+        inode->incref();
+    }
+
+    /*
+     * This will call ~directory_entry(), which will drop the
+     * dircachecnt. Note that we grabbed a lookupcnt ref on the
+     * inode so the following decref() will free the inode if that
+     * was the only ref.
+     */
+    de.reset();
+}
+
+void readdirectory_cache::put_tofree(std::vector<struct nfs_inode*>& tofree_vec)
+{
+    if (!tofree_vec.empty()) {
+        AZLogDebug("[{}] {} inodes to be freed, after readdir cache purge",
+                   dir_inode->get_fuse_ino(),
+                   tofree_vec.size());
+        /*
+         * Drop the extra ref we held above, for all inodes in tofree_vec.
+         */
+        for (struct nfs_inode *inode : tofree_vec) {
+            assert(inode->magic == NFS_INODE_MAGIC);
+            assert(inode->lookupcnt > 0);
+
+            inode->decref();
+        }
+    }
+
+    tofree_vec.clear();
+}
+
+void readdirectory_cache::reset_nolock()
+{
+    assert(dir_entries.empty());
+    assert(dnlc_map.size() == 0);
+    assert(get_index_bytes_nolock() == 0);
+
+    /*
+     * No cookies in the cache, hence no sequence.
+     * Also clear eof, eof_cookie, cache_size as cache is purged mostly
+     * because directory changed on the server and thus we don't know any
+     * better about the directory than when we started.
+     */
+    seq_last_cookie = 0;
+    eof = false;
+    eof_cookie = -1;
+    cache_size = 0;
+    clear_confirmed();
+    clear_lookuponly();
+}
+
 void readdirectory_cache::clear(bool acquire_lock)
 {
     /*
@@ -788,92 +1184,135 @@ void readdirectory_cache::clear(bool acquire_lock)
         assert(dir_entries.empty() ||
                (*(uint64_t *)&cookie_verifier != 0) || is_lookuponly());
 
-        for (auto it = dir_entries.begin(); it != dir_entries.end(); ++it) {
-            struct nfs_inode *inode = it->second->nfs_inode;
-            if (inode) {
-                assert(inode->magic == NFS_INODE_MAGIC);
-                /*
-                 * Any inode referenced by a directory_entry added to
-                 * a readdirectory_cache must have one reference held,
-                 * by readdirectory_cache::add().
-                 */
-                assert(inode->dircachecnt > 0);
-
-                AZLogDebug("[{}] Removing {} \"{}\" fuse ino {}, cookie {}, from "
-                           "readdir cache (dircachecnt {}, lookupcnt {}, "
-                           "forget_expected {})",
-                           dir_inode->get_fuse_ino(),
-                           inode->is_dir() ? "directory" : "file",
-                           it->second->name,
-                           inode->get_fuse_ino(),
-                           it->second->cookie,
-                           inode->dircachecnt.load(),
-                           inode->lookupcnt.load(),
-                           inode->forget_expected.load());
-            } else {
-                AZLogDebug("[{}] Removing \"{}\", cookie {}, from readdir cache",
-                           dir_inode->get_fuse_ino(),
-                           it->second->name,
-                           it->second->cookie);
-            }
-            /*
-             * If this is the last dircachecnt on this inode, it means
-             * there are no more readdirectory_cache,s referencing this
-             * inode. If there are no lookupcnt refs then we can free it.
-             * For safely freeing the inode against any races, we need to call
-             * decref() and for that we need to make sure we have at least one
-             * ref on the inode, so we call incref() before deleting the
-             * directory_entry, and add the inode to a vector which we later
-             * iterate over and call decref() for all the inodes.
-             */
-            if (inode && (inode->dircachecnt == 1)) {
-                tofree_vec.emplace_back(inode);
-                inode->incref();
-            }
+        dir_entries.for_each([&](std::shared_ptr<struct directory_entry>& de) {
+            free_entry(de, tofree_vec);
+        });
 
-            /*
-             * This will call ~directory_entry(), which will drop the
-             * dircachecnt. Note that we grabbed a lookupcnt ref on the
-             * inode so the following decref() will free the inode if that
-             * was the only ref.
-             */
-            it->second.reset();
+        /*
+         * A full clear also frees the entries retired by earlier deferred
+         * purges, if the reclaimer has this cache queued it'll find nothing
+         * to do.
+         */
+        for (auto& [gen, store] : retired) {
+            store.for_each([&](std::shared_ptr<struct directory_entry>& de) {
+                free_entry(de, tofree_vec);
+            });
         }
+        retired.clear();
+        num_retired = 0;
 
         // For every entry added to dir_entries we add one to dnlc_map.
         assert(dir_entries.size() == dnlc_map.size());
 
-        dir_entries.clear();
-        dnlc_map.clear();
-
         /*
-         * No cookies in the cache, hence no sequence.
-         * Also clear eof, eof_cookie, cache_size as cache is purged mostly
-         * because directory changed on the server and thus we don't know any
-         * better about the directory than when we started.
+         * dnlc_map refers to the directory_entry objects held by dir_entries,
+         * so clear it first.
          */
-        seq_last_cookie = 0;
-        eof = false;
-        eof_cookie = -1;
-        cache_size = 0;
-        clear_confirmed();
-        clear_lookuponly();
+        dnlc_map.clear();
+        dir_entries.clear();
+
+        reset_nolock();
     }
 
-    if (!tofree_vec.empty()) {
-        AZLogDebug("[{}] {} inodes to be freed, after readdir cache purge",
-                   dir_inode->get_fuse_ino(),
-                   tofree_vec.size());
+    put_tofree(tofree_vec);
+}
+
+void readdirectory_cache::retire()
+{
+    bool queue = false;
+
+    {
+        std::unique_lock<std::shared_mutex> lock(readdircache_lock_2);
+
+        assert(dir_entries.empty() ||
+               (*(uint64_t *)&cookie_verifier != 0) || is_lookuponly());
+        assert(dir_entries.size() == dnlc_map.size());
+
+        const uint64_t gen = ++generation;
+
+        if (!dir_entries.empty()) {
+            const size_t nentries = dir_entries.size();
+
+            AZLogDebug("[{}] Retiring {} dircache entries as generation {}, "
+                       "{} retired entries pending reclaim",
+                       dir_inode->get_fuse_ino(), nentries, gen,
+                       num_retired + nentries);
+
+            /*
+             * dnlc_map only has pointers to the entries, it needs no
+             * deferred freeing.
+             */
+            dnlc_map.clear();
+            assert(retired.count(gen) == 0);
+            retired.emplace(gen, std::move(dir_entries));
+            dir_entries.clear();
+            num_retired += nentries;
+
+            INC_GBL_STATS(cache_purges_deferred, 1);
+            INC_GBL_STATS(dirents_purge_deferred, nentries);
+
+            if (!reclaim_queued) {
+                reclaim_queued = queue = true;
+            }
+        }
+
+        reset_nolock();
+    }
+
+    if (queue && !client->queue_purge(dir_inode)) {
+        // Shutting down, free inline.
+        reclaim_retired(UINT64_MAX);
+    }
+}
+
+uint64_t readdirectory_cache::reclaim_retired(uint64_t max_entries)
+{
+    assert(max_entries > 0);
+
+    std::vector<struct nfs_inode*> tofree_vec;
+    uint64_t nfree = 0;
+    uint64_t remaining;
+
+    {
         /*
-         * Drop the extra ref we held above, for all inodes in tofree_vec.
+         * Entries are freed with the lock held, as free_entry() relies on
+         * readdircache_lock_2 to safely find the last dircachecnt, but only
+         * max_entries at a time.
          */
-        for (struct nfs_inode *inode : tofree_vec) {
-            assert(inode->magic == NFS_INODE_MAGIC);
-            assert(inode->lookupcnt > 0);
+        std::unique_lock<std::shared_mutex> lock(readdircache_lock_2);
 
-            inode->decref();
+        while (!retired.empty() && (nfree < max_entries)) {
+            auto git = retired.begin();
+            nfree += git->second.drain(
+                max_entries - nfree,
+                [&](std::shared_ptr<struct directory_entry>& de) {
+                    free_entry(de, tofree_vec);
+                });
+
+            if (git->second.empty()) {
+                retired.erase(git);
+            }
+        }
+
+        assert(num_retired >= nfree);
+        num_retired -= nfree;
+        remaining = num_retired;
+
+        if (remaining == 0) {
+            reclaim_queued = false;
         }
     }
+
+    if (nfree > 0) {
+        AZLogDebug("[{}] Reclaimed {} retired dircache entries, {} still "
+                   "retired",
+                   dir_inode->get_fuse_ino(), nfree, remaining);
+        INC_GBL_STATS(purge_reclaim_batches, 1);
+    }
+
+    put_tofree(tofree_vec);
+
+    return remaining;
 }
 
 /**
@@ -885,11 +1324,11 @@ void readdirectory_cache::clear_if_needed()
     if (invalidate_pending.exchange(false)) {
         AZLogDebug("[{}] (Deferred) Purging invalid dircache",
                    dir_inode->get_fuse_ino());
-        clear();
+        retire();
     } else if (is_lookuponly()) {
         AZLogDebug("[{}] (Deferred) Purging lookuponly dircache",
                    dir_inode->get_fuse_ino());
-        clear();
+        retire();
     }
 }
 
@@ -1,3 +1,4 @@
+#include <cmath>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -6,25 +7,46 @@
 #include "rpc_stats.h"
 #include "rpc_task.h"
 #include "nfs_client.h"
+#include "membuf_pool.h"
+#include "disk_cache.h"
+#include "mem_pressure.h"
 
 namespace aznfsc {
 
 /* static */ struct rpc_opstat rpc_stats_az::opstats[FUSE_OPCODE_MAX + 1];
+/* static */ struct rpc_qosstat rpc_stats_az::qosstats[QOS_CLASS_MAX];
 /* static */ std::mutex rpc_stats_az::stats_lock_42;
+/* static */ struct rpc_trace_entry rpc_stats_az::slowest[RPC_TRACE_SLOWEST];
+/* static */ int rpc_stats_az::num_slowest = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::slowest_min_usec = 0;
+/* static */ std::mutex rpc_stats_az::trace_lock_58;
 /* static */ std::atomic<uint64_t> rpc_stats_az::app_read_reqs = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::server_read_reqs = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::failed_read_reqs = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::zero_reads = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::app_bytes_read = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::splice_reads = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::bytes_read_spliced = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::server_bytes_read = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::bytes_read_from_cache = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::bytes_zeroed_from_cache = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::bytes_read_ahead = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::num_readhead = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::prefetch_reqs = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::bytes_prefetched = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::bytes_dontneed_released = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::small_file_prefetches = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::tot_getattr_reqs = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::getattr_served_from_cache = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::getattr_coalesced = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::getattr_served_stale = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::revalidate_coalesced = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::revalidate_getattrs = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::revalidate_readdirplus = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::revalidate_by_readdirplus = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::tot_lookup_reqs = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::lookup_served_from_cache = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::lookup_coalesced = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::app_write_reqs = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::server_write_reqs = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::failed_write_reqs = 0;
@@ -38,12 +60,542 @@ namespace aznfsc {
 /* static */ std::atomic<uint64_t> rpc_stats_az::flush_gp = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::commit_lp = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::commit_gp = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::flush_pipelined = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::bytes_flush_pipelined = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::small_file_stable_flushes = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::server_full_write_reqs = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::write_tail_held = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::bytes_write_tail_held = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::evictor_runs = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::bytes_evicted_cold = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::bytes_evicted_hot = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::cache_budget_shrinks = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::cache_budget_grows = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::cache_purges_deferred = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::bytes_purge_deferred = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::dirents_purge_deferred = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::purge_reclaim_batches = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::writes_np = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::num_sync_membufs = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::tot_bytes_sync_membufs = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::rpc_tasks_allocated = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::rpc_task_alloc_waits = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::rpc_task_alloc_wait_usecs = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::rpc_task_alloc_max_wait_usecs = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::fuse_responses_awaited = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::fuse_reply_failed = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::jukebox_retries = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::jukebox_deferred = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::jukebox_queued = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::jukebox_max_queued = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::endpoints_marked_down = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::endpoints_restored = 0;
+/* static */ std::atomic<uint64_t>
+    rpc_stats_az::jukebox_delay_hist[JUKEBOX_DELAY_HIST_BUCKETS];
+
+/* static */
+uint64_t latency_histogram::percentile(const uint64_t snap[LAT_HIST_BUCKETS],
+                                       uint64_t total,
+                                       double pct)
+{
+    assert(pct > 0 && pct <= 100);
+
+    if (total == 0) {
+        return 0;
+    }
+
+    /*
+     * Rank of the value we are looking for, 1 based.
+     */
+    const uint64_t rank =
+        std::max<uint64_t>(std::ceil((pct * total) / 100.0), 1);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < LAT_HIST_BUCKETS; i++) {
+        seen += snap[i];
+        if (seen >= rank) {
+            return bucket_max(i);
+        }
+    }
+
+    // Concurrent updates can make total not match the snapshot.
+    return bucket_max(LAT_HIST_BUCKETS - 1);
+}
+
+/*
+ * Returns "p50/p90/p99/p999" latencies in usecs for the given histogram.
+ */
+static std::string hist_percentiles(struct latency_histogram& hist,
+                                    bool reset)
+{
+    uint64_t snap[LAT_HIST_BUCKETS];
+    const uint64_t total = hist.snapshot(snap, reset);
+
+    return std::to_string(latency_histogram::percentile(snap, total, 50)) + "/" +
+           std::to_string(latency_histogram::percentile(snap, total, 90)) + "/" +
+           std::to_string(latency_histogram::percentile(snap, total, 99)) + "/" +
+           std::to_string(latency_histogram::percentile(snap, total, 99.9));
+}
+
+/*
+ * Helper for rpc_stats_az::get_metrics() for writing metrics in Prometheus
+ * text or JSON format.
+ * Prometheus needs all samples of a metric to be grouped after the metric's
+ * TYPE line, so callers must add all samples of a metric back to back.
+ */
+class metrics_writer
+{
+public:
+    using labels_t = std::vector<std::pair<std::string, std::string>>;
+
+    metrics_writer(bool _json) :
+        json(_json)
+    {
+        if (json) {
+            out = "{\"metrics\":[";
+        }
+    }
+
+    template <typename T>
+    void add(const std::string& name,
+             const char *type,
+             T value,
+             const labels_t& labels = {})
+    {
+        const std::string fullname = "aznfsc_" + name;
+
+        if (json) {
+            out += std::string(first ? "" : ",") +
+                   "\n{\"name\":\"" + fullname + "\",\"type\":\"" + type +
+                   "\",\"labels\":{";
+            for (size_t i = 0; i < labels.size(); i++) {
+                out += std::string(i ? "," : "") +
+                       "\"" + labels[i].first + "\":\"" + labels[i].second + "\"";
+            }
+            out += "},\"value\":" + fmt::format("{}", value) + "}";
+        } else {
+            if (fullname != last_name) {
+                out += "# TYPE " + fullname + " " + type + "\n";
+                last_name = fullname;
+            }
+            out += fullname;
+            for (size_t i = 0; i < labels.size(); i++) {
+                out += std::string(i ? "," : "{") +
+                       labels[i].first + "=\"" + labels[i].second + "\"";
+            }
+            out += std::string(labels.empty() ? "" : "}") + " " +
+                   fmt::format("{}", value) + "\n";
+        }
+
+        first = false;
+    }
+
+    std::string finish()
+    {
+        if (json) {
+            out += "\n]}\n";
+        }
+        return std::move(out);
+    }
+
+private:
+    const bool json;
+    bool first = true;
+    std::string last_name;
+    std::string out;
+};
+
+/* static */
+std::string rpc_stats_az::get_metrics(bool json)
+{
+    const struct nfs_client& client = nfs_client::get_instance();
+    const struct rpc_transport& transport = client.get_transport();
+    const std::vector<struct nfs_connection*> connections =
+        transport.get_all_connections();
+    metrics_writer mw(json);
+
+    /*
+     * Global counters.
+     */
+#define _GBL(var) mw.add(#var "_total", "counter", GET_GBL_STATS(var))
+    _GBL(app_read_reqs);
+    _GBL(server_read_reqs);
+    _GBL(failed_read_reqs);
+    _GBL(zero_reads);
+    _GBL(app_bytes_read);
+    _GBL(splice_reads);
+    _GBL(bytes_read_spliced);
+    _GBL(server_bytes_read);
+    _GBL(bytes_read_from_cache);
+    _GBL(bytes_zeroed_from_cache);
+    _GBL(bytes_read_ahead);
+    _GBL(num_readhead);
+    _GBL(prefetch_reqs);
+    _GBL(bytes_prefetched);
+    _GBL(bytes_dontneed_released);
+    _GBL(small_file_prefetches);
+    _GBL(tot_getattr_reqs);
+    _GBL(getattr_served_from_cache);
+    _GBL(getattr_coalesced);
+    _GBL(getattr_served_stale);
+    _GBL(revalidate_coalesced);
+    _GBL(revalidate_getattrs);
+    _GBL(revalidate_readdirplus);
+    _GBL(revalidate_by_readdirplus);
+    _GBL(tot_lookup_reqs);
+    _GBL(lookup_served_from_cache);
+    _GBL(lookup_coalesced);
+    _GBL(app_write_reqs);
+    _GBL(server_write_reqs);
+    _GBL(failed_write_reqs);
+    _GBL(app_bytes_written);
+    _GBL(server_bytes_written);
+    _GBL(writes_np);
+    _GBL(inline_writes);
+    _GBL(inline_writes_lp);
+    _GBL(inline_writes_gp);
+    _GBL(flush_seq);
+    _GBL(flush_lp);
+    _GBL(flush_gp);
+    _GBL(commit_lp);
+    _GBL(commit_gp);
+    _GBL(flush_pipelined);
+    _GBL(bytes_flush_pipelined);
+    _GBL(small_file_stable_flushes);
+    _GBL(server_full_write_reqs);
+    _GBL(write_tail_held);
+    _GBL(bytes_write_tail_held);
+    _GBL(evictor_runs);
+    _GBL(bytes_evicted_cold);
+    _GBL(bytes_evicted_hot);
+    _GBL(cache_budget_shrinks);
+    _GBL(cache_budget_grows);
+    _GBL(cache_purges_deferred);
+    _GBL(bytes_purge_deferred);
+    _GBL(dirents_purge_deferred);
+    _GBL(purge_reclaim_batches);
+    _GBL(num_sync_membufs);
+    _GBL(tot_bytes_sync_membufs);
+    _GBL(rpc_task_alloc_waits);
+    _GBL(rpc_task_alloc_wait_usecs);
+    _GBL(fuse_reply_failed);
+    _GBL(jukebox_retries);
+    _GBL(jukebox_deferred);
+    _GBL(endpoints_marked_down);
+    _GBL(endpoints_restored);
+#undef _GBL
+    mw.add("rpc_tasks_allocated", "gauge", GET_GBL_STATS(rpc_tasks_allocated));
+    mw.add("fuse_responses_awaited", "gauge",
+           GET_GBL_STATS(fuse_responses_awaited));
+    mw.add("jukebox_queued", "gauge", GET_GBL_STATS(jukebox_queued));
+    mw.add("server_write_avg_bytes", "gauge",
+           server_write_reqs ? (server_bytes_written / server_write_reqs) : 0);
+
+    /*
+     * Per RPC type stats.
+     * Every metric is added for all RPC types before moving to the next.
+     */
+    static const enum fuse_opcode ops[] = {
+        FUSE_STATFS, FUSE_LOOKUP, FUSE_ACCESS, FUSE_GETATTR, FUSE_SETATTR,
+        FUSE_CREATE, FUSE_MKNOD, FUSE_MKDIR, FUSE_SYMLINK, FUSE_READLINK,
+        FUSE_RMDIR, FUSE_UNLINK, FUSE_RENAME, FUSE_READDIR, FUSE_READDIRPLUS,
+        FUSE_READ, FUSE_WRITE, FUSE_FLUSH
+    };
+
+#define _OP(name, type, field) \
+do { \
+    for (const enum fuse_opcode opcode : ops) { \
+        mw.add(name, type, opstats[opcode].field.load(), \
+               {{"op", rpc_task::fuse_opcode_to_string(opcode)}}); \
+    } \
+} while (0)
+    _OP("op_count_total", "counter", count);
+    _OP("op_pending", "gauge", pending);
+    _OP("op_bytes_sent_total", "counter", bytes_sent);
+    _OP("op_bytes_rcvd_total", "counter", bytes_rcvd);
+    _OP("op_rtt_usec_total", "counter", rtt_usec);
+    _OP("op_dispatch_usec_total", "counter", dispatch_usec);
+    _OP("op_total_usec_total", "counter", total_usec);
+    _OP("op_fuse_handler_usec_total", "counter", fuse_handler_usec);
+#undef _OP
+
+    /*
+     * Latency percentiles, computed from the histograms w/o resetting them.
+     */
+    static const std::pair<const char *, double> quantiles[] = {
+        {"0.5", 50}, {"0.9", 90}, {"0.99", 99}, {"0.999", 99.9}
+    };
+    uint64_t snap[LAT_HIST_BUCKETS];
+
+#define _OPHIST(name, hist) \
+do { \
+    for (const enum fuse_opcode opcode : ops) { \
+        const uint64_t total = opstats[opcode].hist.snapshot(snap, false); \
+        if (total == 0) { \
+            continue; \
+        } \
+        for (const auto& [q, pct] : quantiles) { \
+            mw.add(name, "gauge", \
+                   latency_histogram::percentile(snap, total, pct), \
+                   {{"op", rpc_task::fuse_opcode_to_string(opcode)}, \
+                    {"quantile", q}}); \
+        } \
+    } \
+} while (0)
+    _OPHIST("op_rtt_usec", rtt_hist);
+    _OPHIST("op_dispatch_usec", dispatch_hist);
+    _OPHIST("op_total_usec", total_hist);
+    _OPHIST("op_fuse_handler_usec", fuse_handler_hist);
+#undef _OPHIST
+
+    /*
+     * Per QoS class stats.
+     */
+#define _QOS(name, type, expr) \
+do { \
+    for (int q = 0; q < QOS_CLASS_MAX; q++) { \
+        [[maybe_unused]] const struct rpc_qosstat& qs = qosstats[q]; \
+        mw.add(name, type, (uint64_t) (expr), \
+               {{"class", qos_class_to_string((qos_class_t) q)}}); \
+    } \
+} while (0)
+    _QOS("qos_rpcs_total", "counter", qs.count);
+    _QOS("qos_dispatch_usec_total", "counter", qs.dispatch_usec);
+    _QOS("qos_rtt_usec_total", "counter", qs.rtt_usec);
+#undef _QOS
+
+#define _QOSHIST(name, hist) \
+do { \
+    for (int q = 0; q < QOS_CLASS_MAX; q++) { \
+        const uint64_t total = qosstats[q].hist.snapshot(snap, false); \
+        if (total == 0) { \
+            continue; \
+        } \
+        for (const auto& [qt, pct] : quantiles) { \
+            mw.add(name, "gauge", \
+                   latency_histogram::percentile(snap, total, pct), \
+                   {{"class", qos_class_to_string((qos_class_t) q)}, \
+                    {"quantile", qt}}); \
+        } \
+    } \
+} while (0)
+    _QOSHIST("qos_dispatch_usec", dispatch_hist);
+    _QOSHIST("qos_rtt_usec", rtt_hist);
+#undef _QOSHIST
+
+    {
+        std::unique_lock<std::mutex> _lock(stats_lock_42);
+        for (const enum fuse_opcode opcode : ops) {
+            for (const auto& entry : opstats[opcode].error_map) {
+                mw.add("op_errors_total", "counter", entry.second,
+                       {{"op", rpc_task::fuse_opcode_to_string(opcode)},
+                        {"status", (entry.first == NFS3ERR_RPC_ERROR) ?
+                                   "RPC_ERROR" : nfsstat3_to_str(entry.first)}});
+            }
+        }
+    }
+
+    /*
+     * Per connection stats.
+     */
+    std::vector<struct rpc_stats> rstats(connections.size());
+    for (size_t i = 0; i < connections.size(); i++) {
+        rpc_get_stats(nfs_get_rpc_context(connections[i]->get_nfs_context()),
+                      &rstats[i]);
+    }
+
+#define _CONN(name, type, expr) \
+do { \
+    for (size_t i = 0; i < connections.size(); i++) { \
+        [[maybe_unused]] const struct conn_stats& cs = \
+            connections[i]->get_stats(); \
+        [[maybe_unused]] const struct rpc_stats& rs = rstats[i]; \
+        mw.add(name, type, (uint64_t) (expr), \
+               {{"conn", std::to_string(connections[i]->get_index())}}); \
+    } \
+} while (0)
+    _CONN("conn_inflight_rpcs", "gauge", std::max<int64_t>(cs.inflight_rpcs, 0));
+    _CONN("conn_inflight_bytes", "gauge", std::max<int64_t>(cs.inflight_bytes, 0));
+    _CONN("conn_ewma_rtt_usec", "gauge", cs.ewma_rtt_usec);
+    _CONN("conn_max_rtt_usec", "gauge", cs.max_rtt_usec);
+    _CONN("conn_rpcs_total", "counter", cs.num_rpcs);
+    _CONN("conn_rtt_usec_total", "counter", cs.cum_rtt_usec);
+    _CONN("conn_bytes_sent_total", "counter", cs.bytes_sent);
+    _CONN("conn_bytes_rcvd_total", "counter", cs.bytes_rcvd);
+    _CONN("conn_jukebox_total", "counter", cs.num_jukebox);
+    _CONN("conn_rpc_errors_total", "counter", cs.num_rpc_errors);
+    _CONN("conn_healthy", "gauge", connections[i]->is_healthy());
+    _CONN("conn_outqueue_len", "gauge", rs.outqueue_len);
+    _CONN("conn_waitpdu_len", "gauge", rs.waitpdu_len);
+    _CONN("conn_timedout_total", "counter", rs.num_timedout);
+    _CONN("conn_retransmitted_total", "counter", rs.num_retransmitted);
+    _CONN("conn_reconnects_total", "counter", rs.num_reconnects);
+#undef _CONN
+
+    mw.add("rpc_qlen_avg", "gauge", transport.get_avg_qlen_r(),
+           {{"dir", "read"}});
+    mw.add("rpc_qlen_avg", "gauge", transport.get_avg_qlen_w(),
+           {{"dir", "write"}});
+    mw.add("rpc_qlen_max", "gauge", transport.get_max_qlen_r(),
+           {{"dir", "read"}});
+    mw.add("rpc_qlen_max", "gauge", transport.get_max_qlen_w(),
+           {{"dir", "write"}});
+
+    /*
+     * Throughput and scale factors computed by periodic_updater().
+     */
+    mw.add("read_MBps", "gauge", client.get_read_MBps());
+    mw.add("write_MBps", "gauge", client.get_write_MBps());
+    mw.add("fc_scale_factor", "gauge", nfs_client::get_fc_scale_factor());
+    mw.add("ra_scale_factor", "gauge", nfs_client::get_ra_scale_factor());
+    mw.add("cache_pinned_bytes", "gauge", ra_state::get_pinned_bytes_g());
+
+    mw.add("inodes", "gauge", client.get_num_inodes());
+
+    /*
+     * File cache occupancy.
+     * bytes_flushing and bytes_commit_pending convey the fcsm flush/commit
+     * state across all files.
+     */
+    mw.add("filecache_max_bytes", "gauge",
+           aznfsc_cfg.cache.data.user.max_size_mb * 1024 * 1024ULL);
+    mw.add("filecache_budget_bytes", "gauge",
+           bytes_chunk_cache::get_cache_budget());
+    if (mem_pressure::get_instance().is_enabled()) {
+        mw.add("mem_pressure_psi_some_avg10", "gauge",
+               mem_pressure::get_instance().get_psi_some_avg10());
+        mw.add("mem_pressure_free_bytes", "gauge",
+               mem_pressure::get_instance().get_free_bytes());
+    }
+    mw.add("filecache_caches", "gauge", bytes_chunk_cache::get_num_caches());
+    mw.add("filecache_chunks", "gauge", bytes_chunk_cache::num_chunks_g.load());
+#define _FC(var) mw.add("filecache_" #var, "gauge", bytes_chunk_cache::var##_g.load())
+    _FC(bytes_allocated);
+    _FC(bytes_cached);
+    _FC(bytes_dirty);
+    _FC(bytes_flushing);
+    _FC(bytes_commit_pending);
+    _FC(bytes_uptodate);
+    _FC(bytes_inuse);
+    _FC(bytes_locked);
+#undef _FC
+#define _FC(var) mw.add("filecache_" #var "_total", "counter", bytes_chunk_cache::var##_g.load())
+    _FC(num_get);
+    _FC(bytes_get);
+    _FC(num_release);
+    _FC(bytes_release);
+    _FC(num_truncate);
+    _FC(bytes_truncate);
+    _FC(num_lockwait);
+    _FC(lock_wait_usecs);
+#undef _FC
+
+    /*
+     * Memory pool.
+     */
+    mw.add("membuf_pool_bytes_mapped", "gauge", membuf_pool::bytes_mapped_g.load());
+    mw.add("membuf_pool_bytes_inuse", "gauge", membuf_pool::bytes_inuse_g.load());
+    mw.add("membuf_pool_bytes_requested", "gauge",
+           membuf_pool::bytes_requested_g.load());
+    mw.add("membuf_pool_bytes_idle", "gauge", membuf_pool::get_bytes_idle());
+
+    /*
+     * Readdir cache.
+     */
+    mw.add("readdircache_caches", "gauge", readdirectory_cache::num_caches.load());
+    mw.add("readdircache_dirents", "gauge", readdirectory_cache::num_dirents_g.load());
+    mw.add("readdircache_bytes_allocated", "gauge",
+           readdirectory_cache::bytes_allocated_g.load());
+    mw.add("readdircache_dirents_returned_total", "counter",
+           readdirectory_cache::num_dirents_returned_g.load());
+    mw.add("readdircache_prefetch_calls_total", "counter",
+           readdirectory_cache::num_prefetch_calls_g.load());
+    mw.add("readdircache_dirents_prefetched_total", "counter",
+           readdirectory_cache::num_dirents_prefetched_g.load());
+
+    /*
+     * Disk cache.
+     */
+    if (disk_cache::get_instance().is_enabled()) {
+        mw.add("diskcache_max_bytes", "gauge",
+               disk_cache::get_instance().get_max_bytes());
+        mw.add("diskcache_bytes_cached", "gauge", disk_cache::bytes_cached_g.load());
+        mw.add("diskcache_bytes_queued", "gauge", disk_cache::bytes_queued_g.load());
+        mw.add("diskcache_hits_total", "counter", disk_cache::num_hits_g.load());
+        mw.add("diskcache_bytes_read_total", "counter", disk_cache::bytes_read_g.load());
+        mw.add("diskcache_bytes_written_total", "counter",
+               disk_cache::bytes_written_g.load());
+        mw.add("diskcache_evictions_total", "counter",
+               disk_cache::num_evictions_g.load());
+    }
+
+    return mw.finish();
+}
+
+void rpc_stats_az::record_slowest(uint64_t total_usec) const
+{
+    struct rpc_trace_entry te;
+
+    te.optype = optype;
+    te.start_usec = stamp.start;
+    te.total_usec = total_usec;
+    te.alloc_wait_usec = stamp.create - stamp.start;
+    te.req_size = req_size;
+    te.resp_size = resp_size;
+
+    /*
+     * pre_reply starts from the last stage the request went through before
+     * we started processing the reply.
+     */
+    uint64_t pre_reply_start = stamp.create;
+    if (stamp.issue != 0) {
+        te.pre_issue_usec = stamp.issue - stamp.create;
+        pre_reply_start = stamp.issue;
+        if (stamp.complete != 0) {
+            te.dispatch_usec = stamp.dispatch - stamp.issue;
+            te.rtt_usec = stamp.complete - stamp.dispatch;
+            pre_reply_start = stamp.complete;
+        }
+    }
+
+    if (stamp.reply != 0) {
+        // fuse reply can be sent before the RPC completes, f.e., for writes.
+        te.pre_reply_usec = (stamp.reply > pre_reply_start) ?
+                            (stamp.reply - pre_reply_start) : 0;
+        te.reply_usec = stamp.free - stamp.reply;
+    } else {
+        te.pre_reply_usec = stamp.free - pre_reply_start;
+    }
+
+    std::unique_lock<std::mutex> _lock(trace_lock_58);
+
+    // Ring not full, add w/o replacing.
+    if (num_slowest < RPC_TRACE_SLOWEST) {
+        slowest[num_slowest++] = te;
+        if (num_slowest < RPC_TRACE_SLOWEST) {
+            return;
+        }
+    } else {
+        // Raced with another thread which raised the bar.
+        if (total_usec <= slowest_min_usec) {
+            return;
+        }
+
+        int min_idx = 0;
+        for (int i = 1; i < RPC_TRACE_SLOWEST; i++) {
+            if (slowest[i].total_usec < slowest[min_idx].total_usec) {
+                min_idx = i;
+            }
+        }
+        slowest[min_idx] = te;
+    }
+
+    uint64_t min_usec = UINT64_MAX;
+    for (int i = 0; i < RPC_TRACE_SLOWEST; i++) {
+        min_usec = std::min(min_usec, slowest[i].total_usec);
+    }
+    slowest_min_usec = min_usec;
+}
 
 /* static */
 void rpc_stats_az::dump_stats()
@@ -174,6 +726,72 @@ void rpc_stats_az::dump_stats()
     str += "  " + std::to_string(client.get_transport().get_max_qlen_w()) +
                   " Max rpc qlen seen by writes\n";
 
+    str += "Connection statistics:\n";
+    str += "  Connection scheduler: " +
+           std::string(aznfsc_cfg.sys.conn_sched_latency_aware ?
+                       "latency aware (p2c)" : "round robin") + "\n";
+    if (aznfsc_cfg.sys.qos.meta_connections > 0) {
+        str += "  Metadata connections: last " +
+               std::to_string(aznfsc_cfg.sys.qos.meta_connections) + "\n";
+    }
+    for (const struct nfs_connection *conn : connections) {
+        const struct conn_stats& cs = conn->get_stats();
+        const uint64_t nrpcs = cs.num_rpcs;
+
+        str += "  conn#" + std::to_string(conn->get_index()) + ": " +
+               std::to_string(nrpcs) + " rpcs, " +
+               std::to_string(cs.inflight_rpcs) + " inflight (" +
+               std::to_string(cs.inflight_bytes) + " bytes), rtt usec " +
+               "avg/ewma/max " +
+               std::to_string(nrpcs ? (cs.cum_rtt_usec / nrpcs) : 0) + "/" +
+               std::to_string(cs.ewma_rtt_usec) + "/" +
+               std::to_string(cs.max_rtt_usec) + ", " +
+               std::to_string(cs.bytes_sent) + " bytes sent, " +
+               std::to_string(cs.bytes_rcvd) + " bytes rcvd, " +
+               std::to_string(cs.num_jukebox) + " jukebox, " +
+               std::to_string(cs.num_rpc_errors) + " rpc errors" +
+               (conn->get_endpoint() ?
+                    (", endpoint " + conn->get_endpoint()->addr) : "") +
+               "\n";
+    }
+
+    if (!client.get_transport().get_all_endpoints().empty()) {
+        str += "Endpoint statistics:\n";
+        for (const struct rpc_endpoint *ep :
+                client.get_transport().get_all_endpoints()) {
+            str += "  ep#" + std::to_string(ep->idx) + ": " + ep->addr +
+                   ", " + std::to_string(ep->num_connections) +
+                   " connections, " +
+                   (ep->healthy ? "healthy" : "down") + "\n";
+        }
+        str += "  " + std::to_string(GET_GBL_STATS(endpoints_marked_down)) +
+                      " times endpoints were marked down, " +
+                      std::to_string(GET_GBL_STATS(endpoints_restored)) +
+                      " times restored\n";
+    }
+
+    if (GET_GBL_STATS(jukebox_retries)) {
+        str += "Jukebox statistics:\n";
+        str += "  " + std::to_string(GET_GBL_STATS(jukebox_retries)) +
+                      " RPCs queued for retry after NFS3ERR_JUKEBOX\n";
+        str += "  " + std::to_string(GET_GBL_STATS(jukebox_queued)) +
+                      " retries currently queued (max " +
+                      std::to_string(GET_GBL_STATS(jukebox_max_queued)) + ")\n";
+        str += "  " + std::to_string(GET_GBL_STATS(jukebox_deferred)) +
+                      " retries deferred by per-connection retry budget\n";
+        str += "  Retry delay histogram (msecs):\n";
+        for (int i = 0; i < JUKEBOX_DELAY_HIST_BUCKETS; i++) {
+            const uint64_t cnt = jukebox_delay_hist[i];
+            if (cnt == 0) {
+                continue;
+            }
+            const std::string lo = (i == 0) ? "0" : std::to_string(1ULL << (i - 1));
+            const std::string hi = (i == JUKEBOX_DELAY_HIST_BUCKETS - 1) ?
+                                    "inf" : std::to_string(1ULL << i);
+            str += "    [" + lo + ", " + hi + "): " + std::to_string(cnt) + "\n";
+        }
+    }
+
     str += "File/Inode statistics:\n";
     str += "  " + std::to_string(total_inodes) +
                   " total inodes\n";
@@ -201,14 +819,29 @@ void rpc_stats_az::dump_stats()
                   " inodes silly-renamed (waiting for last close)\n";
 
     // Maximum cache size allowed in bytes.
-    uint64_t max_cache =
-        (aznfsc_cfg.cache.data.user.max_size_mb * 1024 * 1024ULL);
+    uint64_t max_cache = bytes_chunk_cache::get_cache_budget();
     assert(max_cache != 0);
 
     str += "File Cache statistics:\n";
     if (aznfsc_cfg.cache.data.user.enable) {
         str += "  " + std::to_string(aznfsc_cfg.cache.data.user.max_size_mb) +
                       " MB user cache size configured\n";
+        const mem_pressure& mp = mem_pressure::get_instance();
+        if (mp.is_enabled()) {
+            const uint64_t limit = mp.get_limit_bytes();
+            str += "  " + std::to_string(max_cache / (1024 * 1024)) +
+                          " MB adaptive cache size (memory limit " +
+                          ((limit == UINT64_MAX) ? std::string("none") :
+                           (std::to_string(limit / (1024 * 1024)) + " MB")) +
+                          ", " +
+                          std::to_string(mp.get_free_bytes() / (1024 * 1024)) +
+                          " MB free, psi some avg10 " +
+                          std::to_string(mp.get_psi_some_avg10()) + "%, " +
+                          std::to_string(GET_GBL_STATS(cache_budget_shrinks)) +
+                          " shrinks, " +
+                          std::to_string(GET_GBL_STATS(cache_budget_grows)) +
+                          " grows)\n";
+        }
     } else {
         str += "  user cache disabled\n";
     }
@@ -269,6 +902,102 @@ void rpc_stats_az::dump_stats()
                       std::to_string(lockwait_pct) + "% had to wait)\n";
     }
 
+    str += "Membuf Pool statistics:\n";
+    const uint64_t pool_allocs = membuf_pool::num_tcache_hit_g +
+                                 membuf_pool::num_depot_hit_g +
+                                 membuf_pool::num_miss_g;
+    if (pool_allocs) {
+        const double hit_pct =
+            (((membuf_pool::num_tcache_hit_g + membuf_pool::num_depot_hit_g) *
+              100.0) / pool_allocs);
+        str += "  " + std::to_string(pool_allocs) +
+                      " pooled allocations (" +
+                      std::to_string(hit_pct) + "% hit rate)\n";
+    }
+    str += "  " + std::to_string(membuf_pool::num_tcache_hit_g) +
+                  " allocations served from thread caches\n";
+    str += "  " + std::to_string(membuf_pool::num_depot_hit_g) +
+                  " allocations served from global depot\n";
+    str += "  " + std::to_string(membuf_pool::num_miss_g) +
+                  " allocations missed the pool\n";
+    str += "  " + std::to_string(membuf_pool::num_unpooled_g) +
+                  " allocations too large to be pooled\n";
+    str += "  " + std::to_string(membuf_pool::num_unmap_g) +
+                  " buffers released to the OS\n";
+    if (aznfsc_cfg.cache.data.user.hugepages) {
+        str += "  " + std::to_string(membuf_pool::num_hugetlb_g) +
+                      " buffers backed by hugetlb pages (" +
+                      std::to_string(membuf_pool::num_hugetlb_fail_g) +
+                      " failed)\n";
+    }
+    if (membuf_pool::is_splice_enabled()) {
+        str += "  " + std::to_string(membuf_pool::num_splice_fallback_g) +
+                      " buffers not spliceable as splice region was full\n";
+    }
+
+    const uint64_t pool_inuse = membuf_pool::bytes_inuse_g;
+    const uint64_t pool_requested = membuf_pool::bytes_requested_g;
+    const uint64_t pool_idle = membuf_pool::get_bytes_idle();
+    str += "  " + std::to_string(membuf_pool::bytes_mapped_g) +
+                  " bytes mapped\n";
+    str += "  " + std::to_string(pool_inuse) +
+                  " bytes inuse (" + std::to_string(pool_requested) +
+                  " bytes requested)\n";
+    if (pool_inuse > pool_requested) {
+        const double frag_pct =
+            (((pool_inuse - pool_requested) * 100.0) / pool_inuse);
+        str += "  " + std::to_string(frag_pct) +
+                      "% internal fragmentation\n";
+    }
+    str += "  " + std::to_string(pool_idle) +
+                  " bytes idle in pool (" +
+                  std::to_string(membuf_pool::bytes_idle_depot_g) +
+                  " bytes in depot)\n";
+
+    const uint64_t rss = membuf_pool::get_rss_bytes();
+    if (rss) {
+        /*
+         * Part of the process RSS not used for holding cached data.
+         * This includes pool overheads as well as all non-cache memory.
+         */
+        const uint64_t cache_bytes = bytes_chunk_cache::bytes_allocated_g;
+        const double overhead_pct =
+            (rss > cache_bytes) ? (((rss - cache_bytes) * 100.0) / rss) : 0;
+        str += "  " + std::to_string(rss) +
+                      " bytes process RSS (" +
+                      std::to_string(overhead_pct) +
+                      "% not holding cached data)\n";
+    }
+
+    if (disk_cache::get_instance().is_enabled()) {
+        const disk_cache& dc = disk_cache::get_instance();
+
+        str += "Disk Cache statistics:\n";
+        str += "  " + std::to_string(dc.get_max_bytes()) +
+                      " bytes disk cache size configured\n";
+        str += "  " + std::to_string(disk_cache::bytes_cached_g) +
+                      " bytes cached in " +
+                      std::to_string(dc.get_num_entries()) + " files\n";
+        str += "  " + std::to_string(disk_cache::num_hits_g) +
+                      " reads served from disk cache (" +
+                      std::to_string(disk_cache::num_ra_hits_g) +
+                      " readaheads)\n";
+        str += "  " + std::to_string(disk_cache::bytes_read_g) +
+                      " bytes read from disk cache\n";
+        str += "  " + std::to_string(disk_cache::num_read_errors_g) +
+                      " disk cache read errors\n";
+        str += "  " + std::to_string(disk_cache::bytes_written_g) +
+                      " bytes written to disk cache\n";
+        str += "  " + std::to_string(disk_cache::num_write_dropped_g) +
+                      " disk cache writes dropped (" +
+                      std::to_string(disk_cache::bytes_queued_g) +
+                      " bytes queued)\n";
+        str += "  " + std::to_string(disk_cache::num_stale_g) +
+                      " stale files dropped\n";
+        str += "  " + std::to_string(disk_cache::num_evictions_g) +
+                      " files evicted\n";
+    }
+
     // Maximum readdir cache size allowed in bytes.
     max_cache =
         (aznfsc_cfg.cache.readdir.user.max_size_mb * 1024 * 1024ULL);
@@ -301,6 +1030,10 @@ void rpc_stats_az::dump_stats()
                   " readdir and " +
                   std::to_string(readdirectory_cache::num_readdirplus_calls_g) +
                   " readdirplus calls\n";
+    str += "  " + std::to_string(readdirectory_cache::num_dirents_prefetched_g) +
+                  " directory entries prefetched over " +
+                  std::to_string(readdirectory_cache::num_prefetch_calls_g) +
+                  " readdirplus prefetch calls\n";
 
 
 
@@ -321,6 +1054,17 @@ void rpc_stats_az::dump_stats()
                       " reads completed with 0 bytes\n";
     }
 
+    if (splice_reads) {
+        const double splice_pct =
+            app_bytes_read ?
+            ((bytes_read_spliced * 100.0) / app_bytes_read) : 0;
+        str += "  " + std::to_string(GET_GBL_STATS(bytes_read_spliced)) +
+                      " bytes (" + std::to_string(splice_pct) +
+                      "%) spliced to fuse in " +
+                      std::to_string(GET_GBL_STATS(splice_reads)) +
+                      " read replies\n";
+    }
+
     const double read_cache_pct =
         app_bytes_read ?
         ((bytes_read_from_cache * 100.0) / app_bytes_read) : 0;
@@ -350,6 +1094,31 @@ void rpc_stats_az::dump_stats()
                   " bytes read by readahead with avg size " +
                   std::to_string(avg_ra_size) + " bytes and ra scale factor " +
                   std::to_string(nfs_client::get_ra_scale_factor()) + "\n";
+    str += "  " + std::to_string(GET_GBL_STATS(bytes_prefetched)) +
+                  " bytes prefetched for " +
+                  std::to_string(GET_GBL_STATS(prefetch_reqs)) +
+                  " application hints, " +
+                  std::to_string(ra_state::get_pinned_bytes_g()) +
+                  " bytes pinned, " +
+                  std::to_string(GET_GBL_STATS(bytes_dontneed_released)) +
+                  " bytes released on dontneed\n";
+    if (aznfsc_cfg.sys.small_file_mode) {
+        str += "  " + std::to_string(GET_GBL_STATS(small_file_prefetches)) +
+                      " small files read whole on open\n";
+    }
+    str += "  " + std::to_string(GET_GBL_STATS(bytes_evicted_cold)) +
+                  " cold and " +
+                  std::to_string(GET_GBL_STATS(bytes_evicted_hot)) +
+                  " hot cache bytes evicted in background in " +
+                  std::to_string(GET_GBL_STATS(evictor_runs)) + " runs\n";
+    str += "  " + std::to_string(GET_GBL_STATS(cache_purges_deferred)) +
+                  " cache invalidations purged in background, " +
+                  std::to_string(GET_GBL_STATS(bytes_purge_deferred)) +
+                  " cache bytes and " +
+                  std::to_string(GET_GBL_STATS(dirents_purge_deferred)) +
+                  " dirents retired, freed in " +
+                  std::to_string(GET_GBL_STATS(purge_reclaim_batches)) +
+                  " batches\n";
 
     const uint64_t avg_app_write_size =
         app_write_reqs ? (app_bytes_written / app_write_reqs) : 0;
@@ -367,6 +1136,12 @@ void rpc_stats_az::dump_stats()
                   " bytes written to server in " +
                   std::to_string(server_write_reqs) + " calls with avg size " +
                   std::to_string(avg_server_write_size) + " bytes\n";
+    str += "  " + std::to_string(GET_GBL_STATS(server_full_write_reqs)) +
+                  " full wsize write calls, " +
+                  std::to_string(GET_GBL_STATS(write_tail_held)) +
+                  " small tail writes held back (" +
+                  std::to_string(GET_GBL_STATS(bytes_write_tail_held)) +
+                  " bytes) for write-combining\n";
 
     str += "  " + std::to_string(GET_GBL_STATS(writes_np)) +
                   " writes did not hit any memory pressure\n";
@@ -386,6 +1161,14 @@ void rpc_stats_az::dump_stats()
                   " commits triggered as per-file cache limit was reached\n";
     str += "  " + std::to_string(GET_GBL_STATS(commit_gp)) +
                   " commits triggered as global cache limit was reached\n";
+    str += "  " + std::to_string(GET_GBL_STATS(flush_pipelined)) +
+                  " flushes issued while earlier flushes were ongoing, " +
+                  std::to_string(GET_GBL_STATS(bytes_flush_pipelined)) +
+                  " bytes\n";
+    if (aznfsc_cfg.sys.small_file_mode) {
+        str += "  " + std::to_string(GET_GBL_STATS(small_file_stable_flushes)) +
+                      " small files flushed with one FILE_SYNC write\n";
+    }
 
     const uint64_t avg_sync_membufs_size =
         num_sync_membufs ? (tot_bytes_sync_membufs / num_sync_membufs) : 0;
@@ -402,6 +1185,18 @@ void rpc_stats_az::dump_stats()
     str += "  " + std::to_string(GET_GBL_STATS(getattr_served_from_cache)) +
                   " getattr served from cache (" +
                   std::to_string(getattr_cache_pct) + "%)\n";
+    str += "  " + std::to_string(GET_GBL_STATS(getattr_coalesced)) +
+                  " getattr coalesced with in-flight getattr\n";
+    str += "  " + std::to_string(GET_GBL_STATS(getattr_served_stale)) +
+                  " getattr served stale while revalidating\n";
+    str += "  " + std::to_string(GET_GBL_STATS(revalidate_getattrs)) +
+                  " revalidation getattrs, " +
+                  std::to_string(GET_GBL_STATS(revalidate_readdirplus)) +
+                  " revalidation readdirplus covering " +
+                  std::to_string(GET_GBL_STATS(revalidate_by_readdirplus)) +
+                  " inodes, " +
+                  std::to_string(GET_GBL_STATS(revalidate_coalesced)) +
+                  " revalidations coalesced\n";
     const double lookup_cache_pct =
         tot_lookup_reqs ?
         ((lookup_served_from_cache * 100.0) / tot_lookup_reqs) : 0;
@@ -410,18 +1205,35 @@ void rpc_stats_az::dump_stats()
     str += "  " + std::to_string(GET_GBL_STATS(lookup_served_from_cache)) +
                   " lookup served from cache (" +
                   std::to_string(lookup_cache_pct) + "%)\n";
+    str += "  " + std::to_string(GET_GBL_STATS(lookup_coalesced)) +
+                  " lookup coalesced with in-flight lookup\n";
 
     str += "Misc statistics:\n";
     str += "  " + std::to_string(GET_GBL_STATS(rpc_tasks_allocated)) +
                   " rpc tasks currently running\n";
+    if (GET_GBL_STATS(rpc_task_alloc_waits)) {
+        str += "  " + std::to_string(GET_GBL_STATS(rpc_task_alloc_waits)) +
+                      " rpc task allocations had to wait (avg " +
+                      std::to_string(GET_GBL_STATS(rpc_task_alloc_wait_usecs) /
+                                     GET_GBL_STATS(rpc_task_alloc_waits)) +
+                      " usec, max " +
+                      std::to_string(GET_GBL_STATS(rpc_task_alloc_max_wait_usecs)) +
+                      " usec)\n";
+    }
     str += "  " + std::to_string(GET_GBL_STATS(fuse_responses_awaited)) +
                   " responses awaited by fuse\n";
     str += "  " + std::to_string(GET_GBL_STATS(fuse_reply_failed)) +
                   " fuse replies failed to send\n";
 
+    /*
+     * Histograms are reset after every dump if so configured, so that
+     * percentiles convey the latencies since the last dump.
+     */
+    const bool reset_hist = aznfsc_cfg.sys.stats_reset_on_dump;
+
 #define DUMP_OP(opcode) \
 do { \
-    const auto& ops = opstats[opcode]; \
+    auto& ops = opstats[opcode]; \
     if (ops.count != 0) { \
         const std::string opstr = rpc_task::fuse_opcode_to_string(opcode); \
         const int pcent_ops = (ops.count * 100.0) / cum_stats.num_req_sent; \
@@ -448,6 +1260,14 @@ do { \
         str += "        Avg Total execute time: " + \
                         std::to_string(ops.total_usec / (ops.count * 1000.0)) + \
                         " msec\n"; \
+        str += "        RTT p50/p90/p99/p999: " + \
+                        hist_percentiles(ops.rtt_hist, reset_hist) + " usec\n"; \
+        str += "        Dispatch wait p50/p90/p99/p999: " + \
+                        hist_percentiles(ops.dispatch_hist, reset_hist) + " usec\n"; \
+        str += "        Fuse issue time p50/p90/p99/p999: " + \
+                        hist_percentiles(ops.fuse_handler_hist, reset_hist) + " usec\n"; \
+        str += "        Total execute time p50/p90/p99/p999: " + \
+                        hist_percentiles(ops.total_hist, reset_hist) + " usec\n"; \
         if (opcode == FUSE_READ) { \
             str += "        Last 5 sec throughput: " + \
                             std::to_string(client.get_read_MBps()) + " MBps\n"; \
@@ -487,6 +1307,73 @@ do { \
     // FUSE_FLUSH corresponds to the COMMIT RPC
     DUMP_OP(FUSE_FLUSH);
 
+    /*
+     * Per QoS class latencies, metadata latencies going up with data
+     * load means metadata RPCs are queueing behind data RPCs.
+     */
+    for (int q = 0; q < QOS_CLASS_MAX; q++) {
+        auto& qs = qosstats[q];
+        if (qs.count == 0) {
+            continue;
+        }
+
+        str += "QoS class " +
+               std::string(qos_class_to_string((qos_class_t) q)) + ":\n";
+        str += "        " + std::to_string(qs.count) + " ops\n";
+        str += "        Avg RTT: " +
+                        std::to_string(qs.rtt_usec / (qs.count * 1000.0)) +
+                        " msec\n";
+        str += "        Avg dispatch wait: " +
+                        std::to_string(qs.dispatch_usec / (qs.count * 1000.0)) +
+                        " msec\n";
+        str += "        RTT p50/p90/p99/p999: " +
+                        hist_percentiles(qs.rtt_hist, reset_hist) + " usec\n";
+        str += "        Dispatch wait p50/p90/p99/p999: " +
+                        hist_percentiles(qs.dispatch_hist, reset_hist) +
+                        " usec\n";
+    }
+
+    /*
+     * Slowest requests, with the time spent in each stage. Copy the ring out
+     * so that we don't hold the trace lock while formatting.
+     */
+    std::vector<struct rpc_trace_entry> trace;
+    {
+        std::unique_lock<std::mutex> _lock2(trace_lock_58);
+        trace.assign(slowest, slowest + num_slowest);
+        if (reset_hist) {
+            num_slowest = 0;
+            slowest_min_usec = 0;
+        }
+    }
+
+    if (!trace.empty()) {
+        std::sort(trace.begin(), trace.end(),
+                  [](const struct rpc_trace_entry& a,
+                     const struct rpc_trace_entry& b) {
+                      return a.total_usec > b.total_usec;
+                  });
+
+        const uint64_t now_usec = get_current_usecs();
+
+        str += "Slowest " + std::to_string(trace.size()) + " requests (usec):\n";
+        str += fmt::format("  {:<12} {:>10} {:>10} {:>10} {:>10} {:>10} "
+                           "{:>10} {:>10} {:>8} {:>8} {:>8}\n",
+                           "op", "total", "allocwait", "preissue",
+                           "dispatch", "rtt", "prereply", "reply",
+                           "reqsz", "respsz", "age(s)");
+        for (const struct rpc_trace_entry& te : trace) {
+            str += fmt::format("  {:<12} {:>10} {:>10} {:>10} {:>10} {:>10} "
+                               "{:>10} {:>10} {:>8} {:>8} {:>8}\n",
+                               rpc_task::fuse_opcode_to_string(te.optype),
+                               te.total_usec, te.alloc_wait_usec,
+                               te.pre_issue_usec, te.dispatch_usec,
+                               te.rtt_usec, te.pre_reply_usec,
+                               te.reply_usec, te.req_size, te.resp_size,
+                               (now_usec - te.start_usec) / 1000000);
+        }
+    }
+
     /*
      * TODO: Add more ops.
      */
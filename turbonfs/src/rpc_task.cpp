@@ -2,6 +2,8 @@
 #include "rpc_task.h"
 #include "nfs_client.h"
 #include "rpc_stats.h"
+#include "membuf_pool.h"
+#include "disk_cache.h"
 
 /*
  * Catch incorrect use of alloc_rpc_task() in libnfs callbacks.
@@ -632,6 +634,23 @@ void rpc_task::init_readdirplus(fuse_req *request,
     rpc_api->readdir_task.set_offset(offset);
     rpc_api->readdir_task.set_target_offset(target_offset);
     rpc_api->readdir_task.set_fuse_file(file);
+    rpc_api->readdir_task.set_prefetch(false);
+
+    fh_hash = get_client()->get_nfs_inode_from_ino(ino)->get_crc();
+}
+
+void rpc_task::init_readdirplus_prefetch(fuse_ino_t ino, off_t offset)
+{
+    assert(get_op_type() == FUSE_READDIRPLUS);
+    assert(offset > 0);
+    set_fuse_req(nullptr);
+    rpc_api->readdir_task.set_ino(ino);
+    // Nothing to be returned to fuse.
+    rpc_api->readdir_task.set_size(0);
+    rpc_api->readdir_task.set_offset(offset);
+    rpc_api->readdir_task.set_target_offset(0);
+    rpc_api->readdir_task.set_fuse_file(nullptr);
+    rpc_api->readdir_task.set_prefetch(true);
 
     fh_hash = get_client()->get_nfs_inode_from_ino(ino)->get_crc();
 }
@@ -674,7 +693,7 @@ void rpc_task::init_read_be(fuse_ino_t ino,
      *
      * TODO: Control this with a config.
      */
-    set_csched(CONN_SCHED_RR_R);
+    set_csched(get_spread_csched(true /* is_read */));
 
     assert(!rpc_api->read_task.is_fe());
     assert(rpc_api->read_task.is_be());
@@ -689,6 +708,28 @@ void rpc_task::init_read_be(fuse_ino_t ino,
  *       too.
  */
 
+/*
+ * Key identifying GETATTR/LOOKUP RPCs which can be answered by the same
+ * reply, ref nfs_client::singleflight_map.
+ */
+static std::string singleflight_key(fuse_opcode optype,
+                                    const nfs_fh3& fh,
+                                    const char *name = nullptr)
+{
+    const uint32_t fh_len = fh.data.data_len;
+    std::string key;
+
+    key.reserve(1 + sizeof(fh_len) + fh_len + (name ? ::strlen(name) : 0));
+    key.push_back((char) optype);
+    key.append((const char *) &fh_len, sizeof(fh_len));
+    key.append(fh.data.data_val, fh_len);
+    if (name) {
+        key.append(name);
+    }
+
+    return key;
+}
+
 static void getattr_callback(
     struct rpc_context *rpc,
     int rpc_status,
@@ -714,6 +755,14 @@ static void getattr_callback(
      */
     task->get_stats().on_rpc_complete(rpc_get_pdu(rpc), NFS_STATUSX(rpc_status, res));
 
+    /*
+     * GETATTRs for the same inode received while this was in flight, they
+     * get the same reply.
+     */
+    const std::vector<rpc_task*> waiters =
+        task->get_client()->singleflight_done(
+            singleflight_key(FUSE_GETATTR, inode->get_fh()));
+
     if (status == 0) {
         // Got fresh attributes, update the attributes cached in the inode.
         inode->update(&(res->GETATTR3res_u.resok.obj_attributes));
@@ -723,10 +772,23 @@ static void getattr_callback(
          * cache timeout for this inode, as per the recent revalidation
          * experience.
          */
+        for (rpc_task *waiter : waiters) {
+            waiter->reply_attr(inode->get_attr(), inode->get_actimeo());
+        }
         task->reply_attr(inode->get_attr(), inode->get_actimeo());
     } else if (NFS_STATUS(res) == NFS3ERR_JUKEBOX) {
+        /*
+         * Waiters are retried independently, they will coalesce again if
+         * they are reissued together.
+         */
+        for (rpc_task *waiter : waiters) {
+            task->get_client()->jukebox_retry(waiter);
+        }
         task->get_client()->jukebox_retry(task);
     } else {
+        for (rpc_task *waiter : waiters) {
+            waiter->reply_error(status);
+        }
         task->reply_error(status);
     }
 }
@@ -766,11 +828,28 @@ static void lookup_callback(
      */
     task->get_stats().on_rpc_complete(rpc_get_pdu(rpc), NFS_STATUSX(rpc_status, res));
 
+    /*
+     * Only original lookups are coalesced, ref run_lookup().
+     */
+    std::vector<rpc_task*> waiters;
+    if (task->get_proxy_op_type() == (fuse_opcode) 0) {
+        waiters = task->get_client()->singleflight_done(
+            singleflight_key(FUSE_LOOKUP, inode->get_fh(),
+                             task->rpc_api->lookup_task.get_file_name()));
+    }
+
     if (((rpc_status == RPC_STATUS_SUCCESS) &&
          (NFS_STATUS(res) == NFS3ERR_NOENT)) && cache_negative) {
         /*
          * Special case for creating negative dentry.
          */
+        for (rpc_task *waiter : waiters) {
+            task->get_client()->reply_entry(
+                waiter,
+                nullptr /* fh */,
+                nullptr /* fattr */,
+                nullptr);
+        }
         task->get_client()->reply_entry(
             task,
             nullptr /* fh */,
@@ -784,14 +863,27 @@ static void lookup_callback(
         UPDATE_INODE_ATTR(inode, res->LOOKUP3res_u.resok.dir_attributes);
 
         assert(res->LOOKUP3res_u.resok.obj_attributes.attributes_follow);
+        for (rpc_task *waiter : waiters) {
+            task->get_client()->reply_entry(
+                waiter,
+                &res->LOOKUP3res_u.resok.object,
+                &res->LOOKUP3res_u.resok.obj_attributes.post_op_attr_u.attributes,
+                waiter->rpc_api->lookup_task.get_fuse_file());
+        }
         task->get_client()->reply_entry(
             task,
             &res->LOOKUP3res_u.resok.object,
             &res->LOOKUP3res_u.resok.obj_attributes.post_op_attr_u.attributes,
             task->rpc_api->lookup_task.get_fuse_file());
     } else if (NFS_STATUS(res) == NFS3ERR_JUKEBOX) {
+        for (rpc_task *waiter : waiters) {
+            task->get_client()->jukebox_retry(waiter);
+        }
         task->get_client()->jukebox_retry(task);
     } else {
+        for (rpc_task *waiter : waiters) {
+            waiter->reply_error(status);
+        }
         task->reply_error(status);
     }
 }
@@ -1478,7 +1570,9 @@ static void write_iov_callback(
      *       stalling.
      */
     if (inode->get_write_error() == 0) {
-        inode->get_fcsm()->on_flush_complete(bciov->orig_length);
+        inode->get_fcsm()->on_flush_complete(bciov->flush_seq,
+                                             bciov->orig_length,
+                                             task->get_stats().get_rtt_usecs());
     } else {
         // TODO: Add fcsm::on_flush_fail() and call it from here.
         assert(0);
@@ -1563,14 +1657,14 @@ void rpc_task::issue_write_rpc()
      * issues as seen by stable writes.
      */
     if (!inode->is_stable_write()) {
-        set_csched(CONN_SCHED_RR_W);
+        set_csched(get_spread_csched(false /* is_read */));
     }
 
     do {
         rpc_retry = false;
         stats.on_rpc_issue();
 
-        if (rpc_nfs3_writev_task(get_rpc_ctx(),
+        if (rpc_nfs3_writev_task(get_rpc_ctx(length),
                                  write_iov_callback, &args,
                                  bciov->iov,
                                  bciov->iovcnt,
@@ -1597,6 +1691,9 @@ void rpc_task::issue_write_rpc()
      */
     INC_GBL_STATS(server_bytes_written, bciov->length);
     INC_GBL_STATS(server_write_reqs, 1);
+    if (bciov->length >= (uint64_t) get_client()->mnt_options.wsize_adj) {
+        INC_GBL_STATS(server_full_write_reqs, 1);
+    }
 }
 
 static void statfs_callback(
@@ -2641,6 +2738,20 @@ void rpc_task::run_lookup()
         }
     }
 
+    /*
+     * If the same lookup is already in flight, wait for its reply instead
+     * of sending another LOOKUP. Proxy lookups are not coalesced as their
+     * replies are handled differently.
+     */
+    if ((get_proxy_op_type() == (fuse_opcode) 0) &&
+        get_client()->singleflight_join(
+            this, singleflight_key(FUSE_LOOKUP, inode->get_fh(), filename))) {
+        INC_GBL_STATS(lookup_coalesced, 1);
+        AZLogDebug("[{}/{}] Coalesced with in-flight lookup",
+                   parent_ino, filename);
+        return;
+    }
+
     do {
         LOOKUP3args args;
         args.what.dir = inode->get_fh();
@@ -2889,6 +3000,31 @@ void rpc_task::run_getattr()
             reply_attr(inode->get_attr(), inode->get_actimeo());
             return;
         }
+
+        /*
+         * Stale-while-revalidate: return the expired attributes and let the
+         * revalidator refresh them in the background. We don't serve
+         * attributes that expired more than one attribute cache timeout ago.
+         */
+        if (aznfsc_cfg.cache.attr.user.stale_while_revalidate &&
+            !inode->attr_cache_expired_for(inode->get_actimeo() * 1000) &&
+            get_client()->queue_revalidate(inode)) {
+            INC_GBL_STATS(getattr_served_stale, 1);
+            AZLogDebug("[{}] Returning stale attributes", ino);
+            reply_attr(inode->get_attr(), 0 /* attr_timeout */);
+            return;
+        }
+    }
+
+    /*
+     * If a GETATTR for this inode is already in flight, wait for its reply
+     * instead of sending another GETATTR.
+     */
+    if (get_client()->singleflight_join(
+            this, singleflight_key(FUSE_GETATTR, inode->get_fh()))) {
+        INC_GBL_STATS(getattr_coalesced, 1);
+        AZLogDebug("[{}] Coalesced with in-flight getattr", ino);
+        return;
     }
 
     do {
@@ -3483,6 +3619,14 @@ void rpc_task::run_read()
             rpc_api->read_task.get_offset(),
             rpc_api->read_task.get_size());
 
+    /*
+     * Let the background evictor know which membufs are re-read, so that
+     * they are not evicted by sequential scans of other files.
+     */
+    for (const bytes_chunk& bc : bc_vec) {
+        bc.get_membuf()->on_app_read(bc.offset, bc.length);
+    }
+
     /*
      * send_read_response() will later convey this read completion to fuse
      * using fuse_reply_iov() which can send max FUSE_REPLY_IOV_MAX_COUNT
@@ -3649,6 +3793,32 @@ void rpc_task::run_read()
                 continue;
             }
 
+            /*
+             * Not in the memory cache, see if the disk cache has it before
+             * going to the server.
+             */
+            const std::shared_ptr<disk_cache_entry>& dce =
+                inode->get_dcache_entry();
+            if (dce && dce->read(bc_vec[i].offset, bc_vec[i].length,
+                                 bc_vec[i].get_buffer())) {
+                AZLogDebug("[{}] Data read from disk cache. offset: {}, "
+                           "length: {}",
+                           ino, bc_vec[i].offset, bc_vec[i].length);
+
+                bc_vec[i].pvt = bc_vec[i].length;
+
+                /*
+                 * Like read_callback(), we can mark the membuf uptodate only
+                 * if bc covers the entire membuf.
+                 */
+                if (bc_vec[i].maps_full_membuf()) {
+                    bc_vec[i].get_membuf()->set_uptodate();
+                }
+                bc_vec[i].get_membuf()->clear_locked();
+                bc_vec[i].get_membuf()->clear_inuse();
+                continue;
+            }
+
             found_in_cache = false;
 
             /*
@@ -3851,6 +4021,63 @@ void rpc_task::send_read_response()
         reply_iov(nullptr, 0);
     } else {
         INC_GBL_STATS(app_bytes_read, bytes_read);
+
+#ifndef ENABLE_NO_FUSE
+        /*
+         * If all the buffers lie in the membuf_pool splice region, send
+         * them as memfd buffers so that libfuse splices them to /dev/fuse
+         * instead of copying them into the fuse pipe. If any buffer is not
+         * in the region (file-backed membufs or region was exhausted) we
+         * send the usual iovec reply.
+         */
+        if (aznfsc_cfg.fuse_splice_read_reply &&
+            membuf_pool::is_splice_enabled()) {
+            /*
+             * fuse_bufvec has space for only one fuse_buf, extra holds the
+             * rest.
+             */
+            struct {
+                struct fuse_bufvec bufv;
+                struct fuse_buf extra[FUSE_REPLY_IOV_MAX_COUNT - 1];
+            } sbufv;
+
+            assert(count <= FUSE_REPLY_IOV_MAX_COUNT);
+            sbufv.bufv.count = count;
+            sbufv.bufv.idx = 0;
+            sbufv.bufv.off = 0;
+
+            size_t i;
+            for (i = 0; i < count; i++) {
+                struct fuse_buf& fb = sbufv.bufv.buf[i];
+                off_t offset;
+                const int fd =
+                    membuf_pool::get_splice_fd((const uint8_t *) iov[i].iov_base,
+                                               iov[i].iov_len, &offset);
+                if (fd == -1) {
+                    break;
+                }
+
+                fb = {};
+                fb.size = iov[i].iov_len;
+                fb.flags = (enum fuse_buf_flags)
+                    (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+                fb.mem = nullptr;
+                fb.fd = fd;
+                fb.pos = offset;
+            }
+
+            if (i == count) {
+                INC_GBL_STATS(splice_reads, 1);
+                INC_GBL_STATS(bytes_read_spliced, bytes_read);
+                AZLogDebug("[{}] Sending success read response (splice), "
+                           "bufvec={}, bytes_read={}",
+                           ino, count, bytes_read);
+                reply_data(&sbufv.bufv);
+                return;
+            }
+        }
+#endif
+
         AZLogDebug("[{}] Sending success read response, iovec={}, "
                    "bytes_read={}",
                    ino, count, bytes_read);
@@ -3863,11 +4090,20 @@ struct read_context
     rpc_task *task;
     struct bytes_chunk *bc;
 
+    /*
+     * Disk cache entry gen sampled before the first READ for bc was issued,
+     * data read is added to the disk cache only if gen is unchanged by the
+     * time the read completes.
+     */
+    uint64_t dcache_gen;
+
     read_context(
         rpc_task *_task,
-        struct bytes_chunk *_bc):
+        struct bytes_chunk *_bc,
+        uint64_t _dcache_gen = DISK_CACHE_NO_GEN):
         task(_task),
-        bc(_bc)
+        bc(_bc),
+        dcache_gen(_dcache_gen)
     {
         assert(task->magic == RPC_TASK_MAGIC);
         assert(bc->length > 0 && bc->length <= AZNFSC_MAX_CHUNK_SIZE);
@@ -3946,6 +4182,7 @@ static void read_callback(
     assert(filecache_handle);
     const uint64_t issued_offset = bc->offset + bc->pvt;
     const uint64_t issued_length = bc->length - bc->pvt;
+    const uint64_t dcache_gen = ctx->dcache_gen;
 
     /*
      * It is okay to free the context here as we do not access it after this
@@ -4001,6 +4238,9 @@ static void read_callback(
         bc->pvt += res->READ3res_u.resok.count;
         assert(bc->pvt <= bc->length);
 
+        // Bytes of bc that have data read from the server.
+        const uint64_t server_bytes = bc->pvt;
+
         AZLogDebug("[{}] <{}> read_callback: {}Read completed for [{}, {}), "
                    "Bytes read: {} eof: {}, total bytes read till "
                    "now: {} of {} for [{}, {}) num_backend_calls_issued: {}",
@@ -4085,7 +4325,8 @@ static void read_callback(
              * TODO: To avoid allocating a new read_context we can reuse the
              *       existing contest but we have to update the task member.
              */
-            struct read_context *new_ctx = new read_context(child_tsk, bc);
+            struct read_context *new_ctx =
+                new read_context(child_tsk, bc, dcache_gen);
             bool rpc_retry;
             READ3args new_args;
 
@@ -4118,7 +4359,7 @@ static void read_callback(
                 rpc_retry = false;
                 child_tsk->get_stats().on_rpc_issue();
                 if (rpc_nfs3_read_task(
-                        child_tsk->get_rpc_ctx(),
+                        child_tsk->get_rpc_ctx(new_size),
                         read_callback,
                         bc->get_buffer() + bc->pvt,
                         new_size,
@@ -4156,6 +4397,13 @@ static void read_callback(
          */
         assert((bc->length == bc->pvt) || res->READ3res_u.resok.eof);
 
+        /*
+         * Add data read from the server to the disk cache, so that next
+         * time it can be read from the disk.
+         */
+        disk_cache::get_instance().populate(inode, *bc, server_bytes,
+                                            dcache_gen);
+
         if (bc->maps_full_membuf() && (bc->length == bc->pvt)) {
             /*
              * If this bc maps the entire chunkmap bytes_chunk and we have
@@ -4362,13 +4610,22 @@ void rpc_task::read_from_server(struct bytes_chunk &bc)
     assert(rpc_api->read_task.get_offset() == ((off_t) bc.offset + (off_t) bc.pvt));
     assert(rpc_api->read_task.get_size() == (bc.length - bc.pvt));
 
+    /*
+     * Data read by a jukebox retried read is not added to the disk cache as
+     * part of the bc may have been read before the current gen.
+     */
+    const std::shared_ptr<disk_cache_entry>& dce =
+        inode->get_dcache_entry();
+    const uint64_t dcache_gen =
+        (dce && !is_jukebox_read) ? dce->get_gen() : DISK_CACHE_NO_GEN;
+
     /*
      * This will be freed in read_callback().
      * Note that the read_context doesn't grab an extra ref on the membuf.
      * Parent rpc_task has bc_vec[] which holds a ref till the entire read
      * (possibly issued as multiple child reads) completes.
      */
-    struct read_context *ctx = new read_context(this, &bc);
+    struct read_context *ctx = new read_context(this, &bc, dcache_gen);
 
     do {
         READ3args args;
@@ -4393,10 +4650,21 @@ void rpc_task::read_from_server(struct bytes_chunk &bc)
         AZLogDebug("[{}] Issuing read to backend at offset: {} length: {}",
                    inode->get_fuse_ino(), args.offset, args.count);
 
+        /*
+         * Note: We pass the membuf as the read buffer, so libnfs receives
+         *       the READ payload straight from the socket into the membuf,
+         *       without staging it in the pdu buffer. read_callback() hence
+         *       never copies the data, it only advances bc.pvt. The only
+         *       copy between the NIC and the application is the one done by
+         *       fuse while replying (none when splicing, see
+         *       membuf_pool::init_splice_region()). Partial read and
+         *       readahead RPCs follow the same rule, any new READ issue path
+         *       MUST also read directly into the target membuf.
+         */
         rpc_retry = false;
         stats.on_rpc_issue();
         if (rpc_nfs3_read_task(
-                get_rpc_ctx(), /* This round robins request across connections */
+                get_rpc_ctx(args.count), /* This round robins request across connections */
                 read_callback,
                 bc.get_buffer() + bc.pvt,
                 args.count,
@@ -4475,9 +4743,32 @@ void rpc_task::free_rpc_task()
     client->get_rpc_task_helper()->free_rpc_task(this);
 }
 
-struct nfs_context* rpc_task::get_nfs_context() const
+struct nfs_context* rpc_task::get_nfs_context(uint64_t io_bytes)
 {
-    return client->get_nfs_context(csched, fh_hash);
+    /*
+     * Not issued yet, caller just wants to query the context.
+     */
+    const qos_class_t qos = get_qos_class(get_op_type());
+
+    if (!stats.is_issued()) {
+        return client->get_nfs_context(csched, fh_hash, qos);
+    }
+
+    /*
+     * Already bound to a connection for this issue.
+     */
+    if (stats.get_conn_stats()) {
+        return stats.get_conn_stats()->conn->get_nfs_context();
+    }
+
+    struct nfs_connection *conn =
+        client->get_transport().get_nfs_connection(csched, fh_hash, qos);
+    stats.on_rpc_conn(&conn->get_stats(), io_bytes);
+
+    AZNFSC_PROBE4(rpc_conn, &stats, (int) get_op_type(), conn->get_index(),
+                  io_bytes);
+
+    return conn->get_nfs_context();
 }
 
 void rpc_task::run_readdir()
@@ -4903,6 +5194,62 @@ static void readdir_callback(
     task->free_rpc_task();
 }
 
+/*
+ * Issue a directory readahead READDIRPLUS for dir_inode, if
+ * readdirectory_cache::start_prefetch() says so.
+ * The prefetch task holds a lookupcnt ref on dir_inode so that the inode
+ * (and its readdirectory_cache) remains valid even if fuse releases and
+ * forgets the directory while the prefetch is in flight. This ref is dropped
+ * by readdirplus_prefetch_done().
+ */
+static void maybe_prefetch_readdirplus(struct nfs_client *client,
+                                       struct nfs_inode *dir_inode)
+{
+    assert(dir_inode->is_dir());
+    assert(dir_inode->has_dircache());
+
+    cookie3 cookie = 0;
+    if (!dir_inode->get_dircache()->start_prefetch(cookie)) {
+        return;
+    }
+
+    assert(cookie > 0);
+    dir_inode->incref();
+
+    struct rpc_task *tsk =
+        client->get_rpc_task_helper()->alloc_rpc_task_reserved(FUSE_READDIRPLUS);
+    tsk->init_readdirplus_prefetch(dir_inode->get_fuse_ino(), cookie);
+    tsk->fetch_readdirplus_entries_from_server();
+}
+
+/*
+ * Called from readdirplus_callback() when a prefetch READDIRPLUS completes.
+ * If chain is true the prefetch succeeded and we issue the next prefetch
+ * READDIRPLUS (if not already enough ahead of fuse) from the last cookie
+ * received. Cookies chain, so this is how we keep the directory readahead
+ * going w/o waiting for fuse to consume the prefetched entries.
+ */
+static void readdirplus_prefetch_done(struct rpc_task *task,
+                                      struct nfs_inode *dir_inode,
+                                      uint64_t num_dirents,
+                                      bool chain)
+{
+    struct nfs_client *const client = task->get_client();
+
+    assert(task->rpc_api->readdir_task.is_prefetch());
+    assert(task->rpc_api->req == nullptr);
+
+    dir_inode->get_dircache()->prefetch_done(num_dirents);
+    task->free_rpc_task();
+
+    if (chain) {
+        maybe_prefetch_readdirplus(client, dir_inode);
+    }
+
+    // Drop the ref held by maybe_prefetch_readdirplus().
+    dir_inode->decref();
+}
+
 /*
  * Callback for the READDIR RPC. Once this callback is called, it will first
  * populate the readdir cache with the newly fetched entries (with the
@@ -4981,6 +5328,15 @@ static void readdirplus_callback(
     const bool is_reenumerating =
         (task->rpc_api->readdir_task.get_target_offset() != 0);
 
+    /*
+     * Directory readahead READDIRPLUS, entries are only added to the readdir
+     * cache and not returned to fuse. Since size is 0, all entries take the
+     * "couldn't fit in fuse response buffer" path below, which drops the
+     * lookupcnt ref and leaves the inode referenced only by the dircache.
+     */
+    const bool is_prefetch = task->rpc_api->readdir_task.is_prefetch();
+    assert(!is_prefetch || (rem_size == 0 && !is_reenumerating));
+
     /*
      * Now that the request has completed, we can query libnfs for the
      * dispatch time.
@@ -5086,6 +5442,7 @@ static void readdirplus_callback(
                 task->get_client()->get_nfs_inode(
                     &entry->name_handle.post_op_fh3_u.handle, fattr);
             nfs_inode->forget_expected++;
+            nfs_inode->set_parent_hint(dir_inode);
 
             if (!fattr) {
                 /*
@@ -5309,11 +5666,43 @@ static void readdirplus_callback(
             }
         }
 
+        if (is_prefetch) {
+            assert(readdirentries.empty());
+            readdirplus_prefetch_done(task, dir_inode, num_dirents,
+                                      true /* chain */);
+            return;
+        }
+
         // Only send to fuse if we have seen new entries.
         if (got_new_entry || eof) {
+            dircache_handle->on_fuse_readdirplus(
+                    task->rpc_api->readdir_task.get_offset(), num_dirents);
+            /*
+             * Kick directory readahead before responding, as fuse may
+             * release the directory once it gets the response.
+             */
+            if (!eof) {
+                maybe_prefetch_readdirplus(task->get_client(), dir_inode);
+            }
             task->send_readdir_or_readdirplus_response(readdirentries);
             return;
         }
+    } else if (is_prefetch) {
+        /*
+         * Prefetch is opportunistic, don't bother retrying on JUKEBOX or
+         * re-enumerating on NFS3ERR_BAD_COOKIE, the next readdirplus from
+         * fuse will query the server and handle these. For BAD_COOKIE we
+         * invalidate the cache as the cookieverf we have is no longer good.
+         */
+        AZLogDebug("[{}] readdirplus_callback: Prefetch from cookie {} "
+                   "failed: {}",
+                   dir_ino, task->rpc_api->readdir_task.get_offset(),
+                   status);
+        if (NFS_STATUS(res) == NFS3ERR_BAD_COOKIE) {
+            dir_inode->invalidate_cache();
+        }
+        readdirplus_prefetch_done(task, dir_inode, 0, false /* chain */);
+        return;
     } else if (NFS_STATUS(res) == NFS3ERR_JUKEBOX) {
         task->get_client()->jukebox_retry(task);
         return;
@@ -5422,6 +5811,17 @@ void rpc_task::get_readdir_entries_from_cache()
                                is_eof,
                                readdirplus);
 
+    /*
+     * Note the offset fuse is at, and see if we need to start/resume the
+     * directory readahead. If we are serving from the cache, this keeps the
+     * prefetch chain ahead of fuse.
+     */
+    if (readdirplus && !readdirentries.empty() && !is_eof) {
+        nfs_inode->get_dircache()->on_fuse_readdirplus(
+                rpc_api->readdir_task.get_offset());
+        maybe_prefetch_readdirplus(get_client(), nfs_inode);
+    }
+
     /*
      * If eof is already received don't ask any more entries from the server.
      */
@@ -5678,35 +6078,15 @@ void rpc_task::send_readdir_or_readdirplus_response(
 
 #ifdef ENABLE_PARANOID
             /*
-             * it->attributes are copied from nfs_inode->attr at the time when
-             * the directory_entry was created, after that inode's ctime can
-             * only go forward. If there are cached writes happening on the file
-             * the attribute size in the inode can increase while ctime remains
-             * unchanged. See on_cached_write() for how this can happen.
-             *
-             * TODO: Remove directory_entry->attributes if we don't need them.
+             * directory_entry only stores the fileid and mode, copied from
+             * nfs_inode->attr at the time when the directory_entry was
+             * created. These cannot change for an inode.
              */
             {
                 std::shared_lock<std::shared_mutex> lock(it->nfs_inode->ilock_1);
-                assert(it->attributes.st_ino == it->nfs_inode->get_attr_nolock().st_ino);
-
-                const bool attr_same = (::memcmp(&it->attributes,
-                                                 &it->nfs_inode->get_attr_nolock(),
-                                                 sizeof(struct stat)) == 0);
-                if (!attr_same) {
-                    const bool inode_attr_ctime_newer =
-                        (compare_timespec(it->attributes.st_ctim,
-                                          it->nfs_inode->get_attr_nolock().st_ctim) < 0);
-                    const bool inode_attr_ctime_same =
-                        (compare_timespec(it->attributes.st_ctim,
-                                          it->nfs_inode->get_attr_nolock().st_ctim) == 0);
-                    const bool inode_attr_size_bigger =
-                        (it->nfs_inode->get_attr_nolock().st_size > it->attributes.st_size);
-
-                    assert(inode_attr_ctime_newer ||
-                           (inode_attr_ctime_same && inode_attr_size_bigger));
-                }
-
+                assert(it->fileid == it->nfs_inode->get_attr_nolock().st_ino);
+                assert((it->mode & S_IFMT) ==
+                       (it->nfs_inode->get_attr_nolock().st_mode & S_IFMT));
             }
 #endif
 
@@ -5746,11 +6126,14 @@ void rpc_task::send_readdir_or_readdirplus_response(
              * entry to the buffer but will still return the space needed to
              * add this entry.
              */
+            struct stat st;
+            it->get_attr(st);
+
             entsize = fuse_add_direntry(get_fuse_req(),
                                         current_buf,
                                         rem, /* size left in the buffer */
                                         it->name,
-                                        &it->attributes,
+                                        &st,
                                         it->cookie);
         }
 
@@ -5843,6 +6226,7 @@ void rpc_task::send_readdir_or_readdirplus_response(
         AZLogDebug("[{}] Num of entries sent in readdir response is {}",
                    parent_ino, num_entries_added);
 
+        stats.on_fuse_reply();
         const int fre = fuse_reply_buf(get_fuse_req(), buf1, size - rem);
         if (fre != 0) {
             INC_GBL_STATS(fuse_reply_failed, 1);
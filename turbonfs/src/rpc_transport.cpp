@@ -1,9 +1,94 @@
 #include "rpc_transport.h"
 #include "nfs_client.h"
 
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
 #include <thread>
 #include <vector>
 
+void rpc_transport::setup_endpoints()
+{
+    assert(endpoints.empty());
+
+    const struct mount_options& mo = client->mnt_options;
+    const char *list = aznfsc_cfg.sys.endpoints.list;
+    std::vector<std::string> addrs;
+
+    auto add_addr = [&addrs](const std::string& addr) {
+        if (std::find(addrs.begin(), addrs.end(), addr) == addrs.end()) {
+            addrs.push_back(addr);
+        }
+    };
+
+    if (list && *list) {
+        // Config parsing has validated the list.
+        const std::string str(list);
+        size_t pos = 0;
+        while (pos <= str.size()) {
+            size_t comma = str.find(',', pos);
+            if (comma == std::string::npos) {
+                comma = str.size();
+            }
+            add_addr(str.substr(pos, comma - pos));
+            pos = comma + 1;
+        }
+    } else if (aznfsc_cfg.sys.endpoints.resolve) {
+        struct addrinfo hints;
+        struct addrinfo *res = nullptr;
+
+        ::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        const int ret = ::getaddrinfo(mo.server.c_str(), nullptr, &hints, &res);
+        if (ret != 0) {
+            AZLogWarn("[ENDPOINT] Failed to resolve {}: {}, not striping "
+                      "connections", mo.server, ::gai_strerror(ret));
+            return;
+        }
+
+        for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+            char ip[INET_ADDRSTRLEN];
+            const auto *sin = (const struct sockaddr_in *) ai->ai_addr;
+
+            if (::inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip))) {
+                add_addr(ip);
+            }
+        }
+
+        ::freeaddrinfo(res);
+
+        if (addrs.size() < 2) {
+            AZLogInfo("[ENDPOINT] {} resolves to {} address(es), not "
+                      "striping connections", mo.server, addrs.size());
+            return;
+        }
+    } else {
+        return;
+    }
+
+    /*
+     * Every endpoint must get at least one connection.
+     */
+    if ((int) addrs.size() > mo.num_connections) {
+        AZLogWarn("[ENDPOINT] {} endpoints but only {} connections, using "
+                  "the first {}", addrs.size(), mo.num_connections,
+                  mo.num_connections);
+        addrs.resize(mo.num_connections);
+    }
+
+    std::string str;
+    for (size_t i = 0; i < addrs.size(); i++) {
+        endpoints.push_back(new rpc_endpoint(addrs[i], i));
+        str += (i ? ", " : "") + addrs[i];
+    }
+
+    AZLogInfo("[ENDPOINT] Striping {} connections over {} endpoints: {}",
+              mo.num_connections, endpoints.size(), str);
+}
+
 bool rpc_transport::start()
 {
     // constructor must have resized the connection vector correctly.
@@ -22,13 +107,36 @@ bool rpc_transport::start()
     std::vector<std::thread> vt;
     std::atomic<int> successful_connections = 0;
 
+    setup_endpoints();
+
     for (int i = 0; i < client->mnt_options.num_connections; i++) {
         vt.emplace_back(std::thread([&, i]() {
             AZLogDebug("Starting thread for creating connection #{}", i);
 
             struct nfs_connection *connection = new nfs_connection(client, i);
+            const int nep = endpoints.size();
+            bool opened = false;
+
+            /*
+             * Connection #i goes to endpoint #(i % nep). If that endpoint
+             * is not reachable, try the others, so that we can mount as long
+             * as one endpoint is up.
+             */
+            for (int j = 0; j < std::max(nep, 1) && !opened; j++) {
+                if (nep > 0) {
+                    connection->set_endpoint(endpoints[(i + j) % nep]);
+                }
+
+                opened = connection->open();
 
-            if (!connection->open()) {
+                if (!opened && (j + 1) < nep) {
+                    AZLogWarn("[ENDPOINT] Failed to setup connection #{} "
+                              "to {}, trying next endpoint", i,
+                              connection->get_endpoint()->addr);
+                }
+            }
+
+            if (!opened) {
                 AZLogError("Failed to setup connection #{}", i);
 
                 /*
@@ -83,6 +191,19 @@ bool rpc_transport::start()
 
     assert((int) nfs_connections.size() == client->mnt_options.num_connections);
 
+    for (const struct nfs_connection *conn : nfs_connections) {
+        if (conn->get_endpoint()) {
+            conn->get_endpoint()->num_connections++;
+        }
+    }
+
+    for (const struct rpc_endpoint *ep : endpoints) {
+        if (ep->num_connections == 0) {
+            AZLogWarn("[ENDPOINT] Endpoint #{} ({}) was not reachable, "
+                      "no connections to it", ep->idx, ep->addr);
+        }
+    }
+
     AZLogDebug("Successfully created all {} nconnect connection(s)",
                client->mnt_options.num_connections);
     return true;
@@ -103,15 +224,197 @@ void rpc_transport::close()
     nfs_connections.clear();
 }
 
+void rpc_transport::check_endpoints(uint64_t now_sec) const
+{
+    const int nep = endpoints.size();
+    if (nep == 0) {
+        return;
+    }
+
+    /*
+     * Once a second, by one thread.
+     */
+    uint64_t last = last_check_sec;
+    if (now_sec <= last ||
+        !last_check_sec.compare_exchange_strong(last, now_sec)) {
+        return;
+    }
+
+    const uint64_t now_usec = get_current_usecs();
+    std::vector<int> nbad(nep, 0);
+    std::vector<int> ngood(nep, 0);
+
+    for (const struct nfs_connection *conn : nfs_connections) {
+        const struct rpc_endpoint *ep = conn->get_endpoint();
+        const struct conn_stats& cs = conn->get_stats();
+        assert(ep != nullptr);
+        assert(ep->idx >= 0 && ep->idx < nep);
+
+        if (cs.is_unhealthy(now_usec, RPC_CONN_MAX_ERRORS,
+                            RPC_CONN_STALL_SECS * 1000'000ULL)) {
+            nbad[ep->idx]++;
+        } else if (cs.consec_errors == 0 &&
+                   cs.last_complete_usec > (ep->up_sec * 1000'000ULL)) {
+            // Got a response since the endpoint was last restored.
+            ngood[ep->idx]++;
+        }
+    }
+
+    for (int e = 0; e < nep; e++) {
+        struct rpc_endpoint *ep = endpoints[e];
+
+        if (ep->healthy) {
+            if ((nbad[e] * 2) <= ep->num_connections) {
+                if (ngood[e] > 0) {
+                    ep->trips = 0;
+                }
+                continue;
+            }
+
+            /*
+             * Never take the last endpoint out, requests have to go
+             * somewhere.
+             */
+            if (num_down_endpoints == (nep - 1)) {
+                continue;
+            }
+
+            ep->healthy = false;
+            ep->down_sec = now_sec;
+            ep->trips++;
+            num_down_endpoints++;
+            INC_GBL_STATS(endpoints_marked_down, 1);
+
+            AZLogWarn("[ENDPOINT] Endpoint #{} ({}) not responding, {} of {} "
+                      "connections unhealthy, not using it for {} secs",
+                      ep->idx, ep->addr, nbad[e], ep->num_connections,
+                      (uint64_t) aznfsc_cfg.sys.endpoints.recheck_sec <<
+                          std::min(ep->trips - 1, 3));
+            continue;
+        }
+
+        assert(ep->trips > 0);
+        const uint64_t down_secs =
+            (uint64_t) aznfsc_cfg.sys.endpoints.recheck_sec <<
+                std::min(ep->trips - 1, 3);
+
+        if ((now_sec - ep->down_sec) < down_secs) {
+            continue;
+        }
+
+        /*
+         * Forget errors and stalls seen so far on its connections, else
+         * it'll be marked down right away. If it's still not working, the
+         * new RPCs we send will fail/stall and it'll be marked down again,
+         * for longer.
+         */
+        for (struct nfs_connection *conn : nfs_connections) {
+            if (conn->get_endpoint() == ep) {
+                conn->get_stats().consec_errors = 0;
+                conn->get_stats().busy_since_usec = now_usec;
+            }
+        }
+
+        ep->up_sec = now_sec;
+        ep->healthy = true;
+        assert(num_down_endpoints > 0);
+        num_down_endpoints--;
+        INC_GBL_STATS(endpoints_restored, 1);
+
+        AZLogInfo("[ENDPOINT] Putting endpoint #{} ({}) back in use after "
+                  "{} secs", ep->idx, ep->addr, now_sec - ep->down_sec);
+    }
+}
+
+int rpc_transport::pick_healthy(int idx, int base, int count) const
+{
+    const int nconn = nfs_connections.size();
+
+    assert(idx >= 0 && idx < nconn);
+    assert(base >= 0 && count > 0 && (base + count) <= nconn);
+
+    if (nfs_connections[idx]->is_healthy()) {
+        return idx;
+    }
+
+    for (int i = 1; i < count; i++) {
+        const int j = base + ((idx - base + i) % count);
+        if (nfs_connections[j]->is_healthy()) {
+            return j;
+        }
+    }
+
+    // All connections in the pool are unhealthy, go outside the pool.
+    for (int i = 1; i < nconn; i++) {
+        const int j = (idx + i) % nconn;
+        if (nfs_connections[j]->is_healthy()) {
+            return j;
+        }
+    }
+
+    return idx;
+}
+
+struct nfs_context *rpc_transport::get_nfs_context(conn_sched_t csched,
+                                                   uint32_t fh_hash,
+                                                   qos_class_t qos) const
+{
+    return get_nfs_connection(csched, fh_hash, qos)->get_nfs_context();
+}
+
+/*
+ * Power of two choices.
+ * Pick two distinct random connections in [base, base+count) and return the
+ * one with lower cost.
+ */
+static int p2c_pick(const std::vector<struct nfs_connection*>& connections,
+                    int base, int count)
+{
+    assert(count > 0);
+
+    if (count == 1) {
+        return base;
+    }
+
+    const int i1 = random_number(0, count - 1);
+    // Second one is chosen from the remaining count-1 connections.
+    int i2 = random_number(0, count - 2);
+    if (i2 >= i1) {
+        i2++;
+    }
+
+    assert(i1 != i2);
+    assert(i2 >= 0 && i2 < count);
+
+    /*
+     * Connections over unhealthy endpoints lose to any healthy one.
+     */
+    const uint64_t cost1 = connections[base + i1]->is_healthy() ?
+                           connections[base + i1]->get_stats().get_cost() :
+                           UINT64_MAX;
+    const uint64_t cost2 = connections[base + i2]->is_healthy() ?
+                           connections[base + i2]->get_stats().get_cost() :
+                           UINT64_MAX;
+
+    return base + ((cost1 <= cost2) ? i1 : i2);
+}
+
 /*
  * This function decides which connection should be chosen for sending
  * the current request.
  */
-struct nfs_context *rpc_transport::get_nfs_context(conn_sched_t csched,
-                                                   uint32_t fh_hash) const
+struct nfs_connection *rpc_transport::get_nfs_connection(conn_sched_t csched,
+                                                         uint32_t fh_hash,
+                                                         qos_class_t qos) const
 {
     int idx = 0;
-    const int nconn = client->mnt_options.num_connections;
+    /*
+     * Last nmeta connections are reserved for metadata RPCs, data RPCs are
+     * scheduled over the first nconn.
+     */
+    const int nmeta = aznfsc_cfg.sys.qos.meta_connections;
+    const int nconn = client->mnt_options.num_connections - nmeta;
+    assert(nmeta >= 0 && nmeta <= nconn);
     assert(nconn > 0);
     const int rconn = nconn / 2;
     const int wconn = nconn - rconn;
@@ -122,6 +425,8 @@ struct nfs_context *rpc_transport::get_nfs_context(conn_sched_t csched,
 
     assert(now_sec >= last_sec);
 
+    check_endpoints(now_sec);
+
     /*
      * Take stock of things, no sooner than 5 secs.
      */
@@ -158,9 +463,33 @@ struct nfs_context *rpc_transport::get_nfs_context(conn_sched_t csched,
         last_sec = now_sec;
     }
 
+    if (nmeta > 0 && qos == QOS_CLASS_META) {
+        /*
+         * Honour file affinity if asked for, else pick the less loaded of
+         * two. Metadata RPCs are small so load is mostly the number of
+         * inflight RPCs.
+         */
+        idx = (csched == CONN_SCHED_FH_HASH) ?
+                (nconn + (fh_hash % nmeta)) :
+                p2c_pick(nfs_connections, nconn, nmeta);
+
+        if (num_down_endpoints) {
+            idx = pick_healthy(idx, nconn, nmeta);
+        }
+
+        assert(idx >= 0 && idx < client->mnt_options.num_connections);
+        return nfs_connections[idx];
+    }
+
     struct nfs_context *nfs = nullptr;
     uint32_t qlen = 0, avg_qlen = 0;
 
+    /*
+     * Connection pool idx is chosen from, if it's over an unhealthy
+     * endpoint we pick another from the same pool.
+     */
+    int base = 0, count = nconn;
+
     switch (csched) {
         case CONN_SCHED_FIRST:
             idx = 0;
@@ -171,9 +500,16 @@ struct nfs_context *rpc_transport::get_nfs_context(conn_sched_t csched,
              * readers and writers, else they get all the connections.
              * The for loop is to keep connections balanced.
              */
+            if (rnw) {
+                base = wconn;
+                count = rconn;
+            }
             for (int i = 0; i < nconn; i++) {
                 idx = (rnw ? (wconn + (last_context++ % rconn))
                            : (last_context++ % nconn));
+                if (num_down_endpoints && !nfs_connections[idx]->is_healthy()) {
+                    continue;
+                }
                 nfs = nfs_connections[idx]->get_nfs_context();
                 qlen = nfs_queue_length(nfs);
                 max_qlen_r = std::max(max_qlen_r, qlen);
@@ -204,9 +540,15 @@ struct nfs_context *rpc_transport::get_nfs_context(conn_sched_t csched,
              *       are old writes still pending else we will get slowed down
              *       by optimistic concurrency backoff.
              */
+            if (rnw) {
+                count = wconn;
+            }
             for (int i = 0; i < nconn; i++) {
                 idx = (rnw ? (last_context++ % wconn)
                            : (last_context++ % nconn));
+                if (num_down_endpoints && !nfs_connections[idx]->is_healthy()) {
+                    continue;
+                }
                 nfs = nfs_connections[idx]->get_nfs_context();
                 qlen = nfs_queue_length(nfs);
                 max_qlen_w = std::max(max_qlen_w, qlen);
@@ -230,6 +572,23 @@ struct nfs_context *rpc_transport::get_nfs_context(conn_sched_t csched,
         case CONN_SCHED_FH_HASH:
             assert(fh_hash != 0);
             idx = rnw ? (fh_hash % wconn) : (fh_hash % nconn);
+            count = rnw ? wconn : nconn;
+            break;
+        case CONN_SCHED_P2C_R:
+            /*
+             * Same connection pools as CONN_SCHED_RR_R/CONN_SCHED_RR_W.
+             */
+            idx = rnw ? p2c_pick(nfs_connections, wconn, rconn)
+                      : p2c_pick(nfs_connections, 0, nconn);
+            if (rnw) {
+                base = wconn;
+                count = rconn;
+            }
+            break;
+        case CONN_SCHED_P2C_W:
+            idx = rnw ? p2c_pick(nfs_connections, 0, wconn)
+                      : p2c_pick(nfs_connections, 0, nconn);
+            count = rnw ? wconn : nconn;
             break;
         default:
             assert(0);
@@ -237,5 +596,13 @@ struct nfs_context *rpc_transport::get_nfs_context(conn_sched_t csched,
 
     assert(idx >= 0 && idx < client->mnt_options.num_connections);
 
-    return nfs_connections[idx]->get_nfs_context();
+    /*
+     * Skip connections over endpoints which are not responding. Once the
+     * endpoint is back, the same scheduling puts load back on it.
+     */
+    if (num_down_endpoints) {
+        idx = pick_healthy(idx, base, count);
+    }
+
+    return nfs_connections[idx];
 }